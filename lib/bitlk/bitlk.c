@@ -26,6 +26,7 @@
 #include <time.h>
 #include <iconv.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include "bitlk.h"
 #include "internal.h"
@@ -59,6 +60,7 @@
 
 #define BITLK_KDF_HASH "sha256"
 #define BITLK_KDF_ITERATION_COUNT 0x100000
+#define BITLK_KDF_THREADS_MAX 16
 
 /* maximum number of segments for the DM device */
 #define MAX_BITLK_SEGMENTS 10
@@ -337,6 +339,11 @@ static int parse_vmk_entry(struct crypt_device *cd, uint8_t *data, int start, in
 		if (key_entry_size == 0)
 			break;
 
+		if (key_entry_size < BITLK_ENTRY_HEADER_LEN || key_entry_size > end - start) {
+			log_err(cd, _("Invalid BITLK metadata entry size %" PRIu16 "."), key_entry_size);
+			return -EINVAL;
+		}
+
 		/* type and value of this entry */
 		memcpy(&key_entry_type, data + start + sizeof(key_entry_size), sizeof(key_entry_type));
 		memcpy(&key_entry_value,
@@ -361,6 +368,10 @@ static int parse_vmk_entry(struct crypt_device *cd, uint8_t *data, int start, in
 			       sizeof((*vmk)->salt));
 		/* AES-CCM encrypted key */
 		else if (key_entry_value == BITLK_ENTRY_VALUE_ENCRYPTED_KEY) {
+			if (key_entry_size <= BITLK_ENTRY_HEADER_LEN + BITLK_NONCE_SIZE + BITLK_VMK_MAC_TAG_SIZE) {
+				log_err(cd, _("Invalid BITLK metadata entry size %" PRIu16 "."), key_entry_size);
+				return -EINVAL;
+			}
 			/* nonce */
 			memcpy((*vmk)->nonce,
 			       data + start + BITLK_ENTRY_HEADER_LEN,
@@ -466,6 +477,47 @@ void BITLK_bitlk_metadata_free(struct bitlk_metadata *metadata)
 	BITLK_bitlk_fvek_free(metadata->fvek);
 }
 
+/*
+ * Read the whole FVE metadata block (header and all entries) in one aligned
+ * read, the first of the three copies that validates is used.
+ * Returns number of bytes read.
+ */
+static int read_fve_block(struct crypt_device *cd, int devfd, struct device *device,
+			  const uint64_t *offsets, uint8_t *buf, struct bitlk_fve_metadata *fve)
+{
+	uint32_t metadata_size;
+	ssize_t len;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		log_dbg(cd, "Reading BITLK FVE metadata block %d of size %d on device %s, offset %" PRIu64 ".",
+			i, BITLK_FVE_METADATA_SIZE, device_path(device), offsets[i]);
+
+		len = read_lseek_blockwise(devfd, device_block_size(cd, device),
+			device_alignment(device), buf, BITLK_FVE_METADATA_SIZE, offsets[i]);
+		if (len < (ssize_t)sizeof(*fve)) {
+			log_dbg(cd, "Failed to read BITLK FVE metadata block %d.", i);
+			continue;
+		}
+
+		memcpy(fve, buf, sizeof(*fve));
+		metadata_size = le32_to_cpu(fve->metadata_size);
+		if (memcmp(fve->signature, BITLK_SIGNATURE, sizeof(fve->signature)) ||
+		    le16_to_cpu(fve->fve_version) != 2 ||
+		    metadata_size < BITLK_FVE_METADATA_HEADER_LEN ||
+		    metadata_size + BITLK_FVE_METADATA_BLOCK_HEADER_LEN > (size_t)len) {
+			log_dbg(cd, "Invalid BITLK FVE metadata block %d.", i);
+			continue;
+		}
+
+		if (i)
+			log_dbg(cd, "Using BITLK FVE metadata block %d.", i);
+		return len;
+	}
+
+	return -EINVAL;
+}
+
 int BITLK_read_sb(struct crypt_device *cd, struct bitlk_metadata *params)
 {
 	int devfd;
@@ -474,6 +526,7 @@ int BITLK_read_sb(struct crypt_device *cd, struct bitlk_metadata *params)
 	struct bitlk_superblock sb = {};
 	struct bitlk_fve_metadata fve = {};
 	struct bitlk_entry_vmk entry_vmk = {};
+	uint8_t *fve_block = NULL;
 	uint8_t *fve_entries = NULL;
 	uint32_t fve_metadata_size = 0;
 	int fve_offset = 0;
@@ -560,14 +613,13 @@ int BITLK_read_sb(struct crypt_device *cd, struct bitlk_metadata *params)
 	for (i = 0; i < 3; i++)
 		params->metadata_offset[i] = le64_to_cpu(sb.fve_offset[i]);
 
-	log_dbg(cd, "Reading BITLK FVE metadata of size %zu on device %s, offset %" PRIu64 ".",
-		sizeof(fve), device_path(device), params->metadata_offset[0]);
+	/* one buffer for FVE metadata header and entries, entries are parsed in place */
+	if (!(fve_block = device_alloc_buffer(device, BITLK_FVE_METADATA_SIZE))) {
+		r = -ENOMEM;
+		goto out;
+	}
 
-	/* read FVE metadata from the first metadata area */
-	if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-		device_alignment(device), &fve, sizeof(fve), params->metadata_offset[0]) != sizeof(fve) ||
-		memcmp(fve.signature, BITLK_SIGNATURE, sizeof(fve.signature)) ||
-		le16_to_cpu(fve.fve_version) != 2) {
+	if (read_fve_block(cd, devfd, device, params->metadata_offset, fve_block, &fve) < 0) {
 		log_err(cd, _("Failed to read BITLK FVE metadata from %s."), device_path(device));
 		r = -EINVAL;
 		goto out;
@@ -637,25 +689,8 @@ int BITLK_read_sb(struct crypt_device *cd, struct bitlk_metadata *params)
 
 	params->creation_time = filetime_to_unixtime(le64_to_cpu(fve.creation_time));
 
-	/* read and parse all FVE metadata entries */
-	fve_entries = malloc(fve_metadata_size - BITLK_FVE_METADATA_HEADER_LEN);
-	if (!fve_entries) {
-		r = -ENOMEM;
-		goto out;
-	}
-	memset(fve_entries, 0, (fve_metadata_size - BITLK_FVE_METADATA_HEADER_LEN));
-
-	log_dbg(cd, "Reading BITLK FVE metadata entries of size %" PRIu32 " on device %s, offset %" PRIu64 ".",
-		fve_metadata_size - BITLK_FVE_METADATA_HEADER_LEN, device_path(device),
-		params->metadata_offset[0] + BITLK_FVE_METADATA_HEADERS_LEN);
-
-	if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-		device_alignment(device), fve_entries, fve_metadata_size - BITLK_FVE_METADATA_HEADER_LEN,
-		params->metadata_offset[0] + BITLK_FVE_METADATA_HEADERS_LEN) != (ssize_t)(fve_metadata_size - BITLK_FVE_METADATA_HEADER_LEN)) {
-		log_err(cd, _("Failed to read BITLK metadata entries from %s."), device_path(device));
-		r = -EINVAL;
-		goto out;
-	}
+	/* parse all FVE metadata entries */
+	fve_entries = fve_block + BITLK_FVE_METADATA_HEADERS_LEN;
 
 	end = fve_metadata_size - BITLK_FVE_METADATA_HEADER_LEN;
 	while (end - start > 2) {
@@ -665,6 +700,12 @@ int BITLK_read_sb(struct crypt_device *cd, struct bitlk_metadata *params)
 		if (entry_size == 0)
 			break;
 
+		if (entry_size < BITLK_ENTRY_HEADER_LEN || entry_size > end - start) {
+			log_err(cd, _("Invalid BITLK metadata entry size %" PRIu16 "."), entry_size);
+			r = -EINVAL;
+			goto out;
+		}
+
 		/* type of this entry */
 		memcpy(&entry_type, fve_entries + start + sizeof(entry_size), sizeof(entry_type));
 		entry_type = le16_to_cpu(entry_type);
@@ -707,7 +748,12 @@ int BITLK_read_sb(struct crypt_device *cd, struct bitlk_metadata *params)
 			vmk_p = vmk;
 			vmk = vmk->next;
 		/* FVEK */
-		} else if (entry_type == BITLK_ENTRY_TYPE_FVEK) {
+		} else if (entry_type == BITLK_ENTRY_TYPE_FVEK && !params->fvek) {
+			if (entry_size <= BITLK_ENTRY_HEADER_LEN + BITLK_NONCE_SIZE + BITLK_VMK_MAC_TAG_SIZE) {
+				log_err(cd, _("Invalid BITLK metadata entry size %" PRIu16 "."), entry_size);
+				r = -EINVAL;
+				goto out;
+			}
 			params->fvek = malloc(sizeof(struct bitlk_fvek));
 			if (!params->fvek) {
 				r = -ENOMEM;
@@ -751,8 +797,7 @@ int BITLK_read_sb(struct crypt_device *cd, struct bitlk_metadata *params)
 	}
 
 out:
-	if (fve_entries)
-		free(fve_entries);
+	free(fve_block);
 	return r;
 }
 
@@ -1031,7 +1076,16 @@ static int bitlk_kdf(struct crypt_device *cd,
 			goto out;
 	}
 
-	for (i = 0; i < BITLK_KDF_ITERATION_COUNT; i++) {
+	/* Internal SHA-256 loop, FIPS mode uses only crypto backend hash */
+	if (!crypt_fips_mode()) {
+		r = crypt_bitlk_kdf_sha256(kdf.initial_sha256, kdf.salt,
+					   BITLK_KDF_ITERATION_COUNT, kdf.last_sha256);
+		if (r < 0)
+			goto out;
+		i = BITLK_KDF_ITERATION_COUNT;
+	}
+
+	for (; i < BITLK_KDF_ITERATION_COUNT; i++) {
 		crypt_hash_write(hd, (const char*) &kdf, sizeof(kdf));
 		r = crypt_hash_final(hd, kdf.last_sha256, len);
 		if (r < 0)
@@ -1101,57 +1155,158 @@ out:
 	return r;
 }
 
+/* KDF for one passphrase or recovery passphrase VMK */
+struct bitlk_kdf_job {
+	struct crypt_device *cd;
+	const char *password;
+	size_t passwordLen;
+	bool recovery;
+	const uint8_t *salt;
+	struct volume_key *vk;
+	bool queued;
+	int r;
+};
+
+struct bitlk_kdf_pool {
+	struct bitlk_kdf_job *jobs;
+	unsigned count;
+	unsigned threads;
+	unsigned first;
+};
+
+/* All jobs have the same cost, each thread takes every n-th job */
+static void *bitlk_kdf_worker(void *arg)
+{
+	struct bitlk_kdf_pool *pool = arg;
+	struct bitlk_kdf_job *job;
+	unsigned i;
+
+	for (i = __atomic_fetch_add(&pool->first, 1, __ATOMIC_RELAXED);
+	     i < pool->count; i += pool->threads) {
+		job = &pool->jobs[i];
+		if (!job->queued)
+			continue;
+		job->r = bitlk_kdf(job->cd, job->password, job->passwordLen,
+				   job->recovery, job->salt, &job->vk);
+	}
+
+	return NULL;
+}
+
+static void bitlk_kdf_run(struct crypt_device *cd, struct bitlk_kdf_job *jobs, unsigned count)
+{
+	struct bitlk_kdf_pool pool = { .jobs = jobs, .count = count };
+	pthread_t tids[BITLK_KDF_THREADS_MAX];
+	unsigned i, queued = 0, started = 0;
+
+	for (i = 0; i < count; i++)
+		if (jobs[i].queued)
+			queued++;
+
+	pool.threads = crypt_cpusonline() ?: 1;
+	if (pool.threads > queued)
+		pool.threads = queued;
+	if (pool.threads > BITLK_KDF_THREADS_MAX)
+		pool.threads = BITLK_KDF_THREADS_MAX;
+
+	if (pool.threads > 1) {
+		log_dbg(cd, "Running %u VMK key derivations using %u threads.", queued, pool.threads);
+		for (i = 0; i < pool.threads; i++) {
+			if (pthread_create(&tids[i], NULL, bitlk_kdf_worker, &pool))
+				break;
+			started++;
+		}
+	}
+
+	/* stripes without a thread are run in caller thread */
+	for (i = started; i < pool.threads; i++)
+		bitlk_kdf_worker(&pool);
+
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+}
+
 int BITLK_get_volume_key(struct crypt_device *cd,
 			 const char *password,
 			 size_t passwordLen,
 			 const struct bitlk_metadata *params,
 			 struct volume_key **open_fvek_key)
 {
-	int r = 0;
+	int r = 0, r_recovery = 0;
 	struct volume_key *open_vmk_key = NULL;
 	struct volume_key *vmk_dec_key = NULL;
 	struct volume_key *recovery_key = NULL;
 	const struct bitlk_vmk *next_vmk = NULL;
+	struct bitlk_kdf_job *jobs = NULL;
+	unsigned i, count = 0;
+
+	/* the same recovery key is used for all recovery passphrase VMKs */
+	for (next_vmk = params->vmks; next_vmk; next_vmk = next_vmk->next, count++)
+		if (next_vmk->protection == BITLK_PROTECTION_RECOVERY_PASSPHRASE &&
+		    !recovery_key && !r_recovery)
+			r_recovery = get_recovery_key(cd, password, passwordLen, &recovery_key);
+
+	/* derive keys for all passphrase VMKs at once, these are tried in order later */
+	if (count) {
+		jobs = calloc(count, sizeof(*jobs));
+		if (!jobs) {
+			crypt_free_volume_key(recovery_key);
+			return -ENOMEM;
+		}
+	}
 
-	next_vmk = params->vmks;
-	while (next_vmk) {
+	for (next_vmk = params->vmks, i = 0; next_vmk; next_vmk = next_vmk->next, i++) {
+		jobs[i].cd = cd;
+		jobs[i].salt = next_vmk->salt;
+		if (next_vmk->protection == BITLK_PROTECTION_PASSPHRASE) {
+			jobs[i].password = password;
+			jobs[i].passwordLen = passwordLen;
+			jobs[i].queued = true;
+		} else if (next_vmk->protection == BITLK_PROTECTION_RECOVERY_PASSPHRASE &&
+			   !r_recovery && recovery_key) {
+			jobs[i].password = recovery_key->key;
+			jobs[i].passwordLen = recovery_key->keylength;
+			jobs[i].recovery = true;
+			jobs[i].queued = true;
+		}
+	}
+
+	bitlk_kdf_run(cd, jobs, count);
+
+	for (next_vmk = params->vmks, i = 0; next_vmk; next_vmk = next_vmk->next, i++) {
 		if (next_vmk->protection == BITLK_PROTECTION_PASSPHRASE) {
-			r = bitlk_kdf(cd, password, passwordLen, false, next_vmk->salt, &vmk_dec_key);
+			r = jobs[i].r;
 			if (r) {
 				/* something wrong happened, but we still want to check other key slots */
-				next_vmk = next_vmk->next;
 				continue;
 			}
+			vmk_dec_key = jobs[i].vk;
+			jobs[i].vk = NULL;
 		} else if (next_vmk->protection == BITLK_PROTECTION_RECOVERY_PASSPHRASE) {
-			r = get_recovery_key(cd, password, passwordLen, &recovery_key);
+			r = r_recovery;
 			if (r) {
 				/* something wrong happened, but we still want to check other key slots */
-				next_vmk = next_vmk->next;
 				continue;
 			}
 			if (recovery_key == NULL) {
 				/* r = 0 but no key -> given passphrase is not a recovery passphrase */
 				r = -EPERM;
-				next_vmk = next_vmk->next;
 				continue;
 			}
 			log_dbg(cd, "Trying to use given password as a recovery key.");
-			r = bitlk_kdf(cd, recovery_key->key, recovery_key->keylength,
-				      true, next_vmk->salt, &vmk_dec_key);
-			crypt_free_volume_key(recovery_key);
+			r = jobs[i].r;
 			if (r)
-				return r;
+				goto out;
+			vmk_dec_key = jobs[i].vk;
+			jobs[i].vk = NULL;
 		} else if (next_vmk->protection == BITLK_PROTECTION_STARTUP_KEY) {
 			r = get_startup_key(cd, password, passwordLen, next_vmk, &vmk_dec_key);
-			if (r) {
-				next_vmk = next_vmk->next;
+			if (r)
 				continue;
-			}
 			log_dbg(cd, "Trying to use external key found in provided password.");
 		} else {
 			/* only passphrase, recovery passphrase and startup key VMKs supported right now */
 			log_dbg(cd, "Skipping %s", get_vmk_protection_string(next_vmk->protection));
-			next_vmk = next_vmk->next;
 			if (r == 0)
 				/* we need to set error code in case we have only unsupported VMKs */
 				r = -ENOTSUP;
@@ -1166,8 +1321,7 @@ int BITLK_get_volume_key(struct crypt_device *cd,
 			log_dbg(cd, "Failed to decrypt VMK using provided passphrase.");
 			crypt_free_volume_key(vmk_dec_key);
 			if (r == -ENOTSUP)
-				return r;
-			next_vmk = next_vmk->next;
+				goto out;
 			continue;
 		}
 		crypt_free_volume_key(vmk_dec_key);
@@ -1179,21 +1333,22 @@ int BITLK_get_volume_key(struct crypt_device *cd,
 			log_dbg(cd, "Failed to decrypt FVEK using VMK.");
 			crypt_free_volume_key(open_vmk_key);
 			if (r == -ENOTSUP)
-				return r;
+				goto out;
 		} else {
 			crypt_free_volume_key(open_vmk_key);
 			break;
 		}
-
-		next_vmk = next_vmk->next;
 	}
 
-	if (r) {
+	if (r)
 		log_dbg(cd, "No more VMKs to try.");
-		return r;
-	}
+out:
+	for (i = 0; i < count; i++)
+		crypt_free_volume_key(jobs[i].vk);
+	free(jobs);
+	crypt_free_volume_key(recovery_key);
 
-	return 0;
+	return r;
 }
 
 static int _activate_check(struct crypt_device *cd,
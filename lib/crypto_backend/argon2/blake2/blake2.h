@@ -82,6 +82,11 @@ ARGON2_LOCAL int blake2b(void *out, size_t outlen, const void *in, size_t inlen,
 ARGON2_LOCAL int blake2b_long(void *out, size_t outlen, const void *in, size_t inlen);
 /* Argon2 Team - End Code */
 
+/* blake2b_long() of n (up to 4) equally sized inputs, vectorized if possible */
+ARGON2_LOCAL int blake2b_long_x4(void *out[], size_t outlen,
+                                 const void *const in[], size_t inlen,
+                                 unsigned int n);
+
 #if defined(__cplusplus)
 }
 #endif
@@ -165,7 +165,7 @@ int blake2b_init_key(blake2b_state *S, size_t outlen, const void *key,
     return 0;
 }
 
-static void blake2b_compress(blake2b_state *S, const uint8_t *block) {
+static void blake2b_compress_ref(blake2b_state *S, const uint8_t *block) {
     uint64_t m[16];
     uint64_t v[16];
     unsigned int i, r;
@@ -223,6 +223,24 @@ static void blake2b_compress(blake2b_state *S, const uint8_t *block) {
 #undef ROUND
 }
 
+#if defined(ARGON2_DISPATCH_AVX2)
+void blake2b_compress_avx2(uint64_t h[8], const uint64_t t[2],
+                           const uint64_t f[2], const uint8_t *block);
+void blake2b_block_x4_avx2(uint8_t *const out[4],
+                           const uint8_t *const block[4], size_t outlen,
+                           size_t inlen);
+#endif
+
+static void blake2b_compress(blake2b_state *S, const uint8_t *block) {
+#if defined(ARGON2_DISPATCH_AVX2)
+    if (__builtin_cpu_supports("avx2")) {
+        blake2b_compress_avx2(S->h, S->t, S->f, block);
+        return;
+    }
+#endif
+    blake2b_compress_ref(S, block);
+}
+
 int blake2b_update(blake2b_state *S, const void *in, size_t inlen) {
     const uint8_t *pin = (const uint8_t *)in;
 
@@ -390,3 +408,92 @@ fail:
 #undef TRY
 }
 /* Argon2 Team - End Code */
+
+#if defined(ARGON2_DISPATCH_AVX2)
+/*
+ * Four-way H': every BLAKE2b call in blake2b_long() is a single block when
+ * outlen_bytes || in fits in one block, so four independent chains can run
+ * in the 64-bit lanes of AVX2 registers.
+ */
+static void blake2b_long_x4_avx2(void *pout[], size_t outlen,
+                                 const void *const in[], size_t inlen,
+                                 unsigned int n) {
+    uint8_t block[4][BLAKE2B_BLOCKBYTES];
+    uint8_t hash[4][BLAKE2B_OUTBYTES];
+    const uint8_t *block_ptr[4];
+    uint8_t *hash_ptr[4];
+    uint8_t *out[4];
+    uint32_t toproduce;
+    unsigned int i;
+
+    memset(block, 0, sizeof(block));
+    for (i = 0; i < 4; ++i) {
+        /* Unused lanes recompute the first input and are discarded */
+        store32(block[i], (uint32_t)outlen);
+        memcpy(block[i] + sizeof(uint32_t), in[i < n ? i : 0], inlen);
+        block_ptr[i] = block[i];
+        hash_ptr[i] = hash[i];
+        out[i] = i < n ? (uint8_t *)pout[i] : NULL;
+    }
+
+    blake2b_block_x4_avx2(hash_ptr, block_ptr, BLAKE2B_OUTBYTES,
+                          inlen + sizeof(uint32_t));
+    for (i = 0; i < n; ++i) {
+        memcpy(out[i], hash[i], BLAKE2B_OUTBYTES / 2);
+        out[i] += BLAKE2B_OUTBYTES / 2;
+    }
+    toproduce = (uint32_t)outlen - BLAKE2B_OUTBYTES / 2;
+
+    memset(block, 0, sizeof(block));
+    while (toproduce > BLAKE2B_OUTBYTES) {
+        for (i = 0; i < 4; ++i) {
+            memcpy(block[i], hash[i], BLAKE2B_OUTBYTES);
+        }
+        blake2b_block_x4_avx2(hash_ptr, block_ptr, BLAKE2B_OUTBYTES,
+                              BLAKE2B_OUTBYTES);
+        for (i = 0; i < n; ++i) {
+            memcpy(out[i], hash[i], BLAKE2B_OUTBYTES / 2);
+            out[i] += BLAKE2B_OUTBYTES / 2;
+        }
+        toproduce -= BLAKE2B_OUTBYTES / 2;
+    }
+
+    for (i = 0; i < 4; ++i) {
+        memcpy(block[i], hash[i], BLAKE2B_OUTBYTES);
+    }
+    blake2b_block_x4_avx2(hash_ptr, block_ptr, toproduce, BLAKE2B_OUTBYTES);
+    for (i = 0; i < n; ++i) {
+        memcpy(out[i], hash[i], toproduce);
+    }
+
+    clear_internal_memory(block, sizeof(block));
+    clear_internal_memory(hash, sizeof(hash));
+}
+#endif
+
+int blake2b_long_x4(void *out[], size_t outlen, const void *const in[],
+                    size_t inlen, unsigned int n) {
+    unsigned int i;
+    int ret;
+
+    if (n == 0 || n > 4) {
+        return -1;
+    }
+
+#if defined(ARGON2_DISPATCH_AVX2)
+    if (n > 1 && outlen > BLAKE2B_OUTBYTES && outlen <= UINT32_MAX &&
+        inlen <= BLAKE2B_BLOCKBYTES - sizeof(uint32_t) &&
+        __builtin_cpu_supports("avx2")) {
+        blake2b_long_x4_avx2(out, outlen, in, inlen, n);
+        return 0;
+    }
+#endif
+
+    for (i = 0; i < n; ++i) {
+        ret = blake2b_long(out[i], outlen, in[i], inlen);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
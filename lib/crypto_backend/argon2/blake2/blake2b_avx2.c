@@ -0,0 +1,177 @@
+/*
+ * Argon2 reference source code package - reference C implementations
+ *
+ * Copyright 2015
+ * Daniel Dinu, Dmitry Khovratovich, Jean-Philippe Aumasson, and Samuel Neves
+ *
+ * You may use this work under the terms of a Creative Commons CC0 1.0
+ * License/Waiver or the Apache Public License 2.0, at your option. The terms of
+ * these licenses can be found at:
+ *
+ * - CC0 1.0 Universal : https://creativecommons.org/publicdomain/zero/1.0
+ * - Apache 2.0        : https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * You should have received a copy of both of these licenses along with this
+ * software. If not, they may be obtained at the above URLs.
+ */
+
+/*
+ * AVX2 BLAKE2b compression, compiled with -mavx2 and selected at runtime
+ * from blake2b.c. Two variants are provided: a single message with one
+ * state row per register, and four independent single-block messages
+ * with one message per 64-bit lane (used for H' of the first blocks).
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "blake2.h"
+#include "blake2-impl.h"
+#include "blamka-round-opt.h"
+
+void clear_internal_memory(void *v, size_t n);
+void blake2b_compress_avx2(uint64_t h[8], const uint64_t t[2],
+                           const uint64_t f[2], const uint8_t *block);
+void blake2b_block_x4_avx2(uint8_t *const out[4],
+                           const uint8_t *const block[4], size_t outlen,
+                           size_t inlen);
+
+static const uint64_t blake2b_IV[8] = {
+    UINT64_C(0x6a09e667f3bcc908), UINT64_C(0xbb67ae8584caa73b),
+    UINT64_C(0x3c6ef372fe94f82b), UINT64_C(0xa54ff53a5f1d36f1),
+    UINT64_C(0x510e527fade682d1), UINT64_C(0x9b05688c2b3e6c1f),
+    UINT64_C(0x1f83d9abfb41bd6b), UINT64_C(0x5be0cd19137e2179)};
+
+static const unsigned int blake2b_sigma[12][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+    {11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4},
+    {7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+    {9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13},
+    {2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+    {12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11},
+    {13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+    {6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5},
+    {10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0},
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+};
+
+#define G_AVX2(a, b, c, d, x, y)                                               \
+    do {                                                                       \
+        a = _mm256_add_epi64(_mm256_add_epi64(a, b), x);                       \
+        d = rotr32(_mm256_xor_si256(d, a));                                    \
+        c = _mm256_add_epi64(c, d);                                            \
+        b = rotr24(_mm256_xor_si256(b, c));                                    \
+        a = _mm256_add_epi64(_mm256_add_epi64(a, b), y);                       \
+        d = rotr16(_mm256_xor_si256(d, a));                                    \
+        c = _mm256_add_epi64(c, d);                                            \
+        b = rotr63(_mm256_xor_si256(b, c));                                    \
+    } while ((void)0, 0)
+
+#define MSG4(s, i0, i1, i2, i3)                                                \
+    _mm256_set_epi64x((int64_t)m[s[i3]], (int64_t)m[s[i2]],                    \
+                      (int64_t)m[s[i1]], (int64_t)m[s[i0]])
+
+void blake2b_compress_avx2(uint64_t h[8], const uint64_t t[2],
+                           const uint64_t f[2], const uint8_t *block) {
+    uint64_t m[16];
+    __m256i row1, row2, row3, row4;
+    __m256i h0, h1;
+    const unsigned int *s;
+    unsigned int i, r;
+
+    for (i = 0; i < 16; ++i) {
+        m[i] = load64(block + i * sizeof(m[i]));
+    }
+
+    h0 = row1 = _mm256_loadu_si256((const __m256i *)(const void *)&h[0]);
+    h1 = row2 = _mm256_loadu_si256((const __m256i *)(const void *)&h[4]);
+    row3 = _mm256_loadu_si256((const __m256i *)(const void *)&blake2b_IV[0]);
+    row4 = _mm256_xor_si256(
+        _mm256_loadu_si256((const __m256i *)(const void *)&blake2b_IV[4]),
+        _mm256_set_epi64x((int64_t)f[1], (int64_t)f[0], (int64_t)t[1],
+                          (int64_t)t[0]));
+
+    for (r = 0; r < 12; ++r) {
+        s = blake2b_sigma[r];
+
+        /* Columns: G(v0,v4,v8,v12) .. G(v3,v7,v11,v15) */
+        G_AVX2(row1, row2, row3, row4, MSG4(s, 0, 2, 4, 6),
+               MSG4(s, 1, 3, 5, 7));
+
+        /* Diagonals: rotate rows so that G(v0,v5,v10,v15) is in lane 0 */
+        row2 = _mm256_permute4x64_epi64(row2, _MM_SHUFFLE(0, 3, 2, 1));
+        row3 = _mm256_permute4x64_epi64(row3, _MM_SHUFFLE(1, 0, 3, 2));
+        row4 = _mm256_permute4x64_epi64(row4, _MM_SHUFFLE(2, 1, 0, 3));
+
+        G_AVX2(row1, row2, row3, row4, MSG4(s, 8, 10, 12, 14),
+               MSG4(s, 9, 11, 13, 15));
+
+        row2 = _mm256_permute4x64_epi64(row2, _MM_SHUFFLE(2, 1, 0, 3));
+        row3 = _mm256_permute4x64_epi64(row3, _MM_SHUFFLE(1, 0, 3, 2));
+        row4 = _mm256_permute4x64_epi64(row4, _MM_SHUFFLE(0, 3, 2, 1));
+    }
+
+    _mm256_storeu_si256((__m256i *)(void *)&h[0],
+                        _mm256_xor_si256(h0, _mm256_xor_si256(row1, row3)));
+    _mm256_storeu_si256((__m256i *)(void *)&h[4],
+                        _mm256_xor_si256(h1, _mm256_xor_si256(row2, row4)));
+}
+
+/*
+ * Hash four independent messages that each fit in one (zero padded) block
+ * of inlen bytes, writing the full 64-byte chaining value of each to out[].
+ * The digest length outlen only enters the parameter block; truncation is
+ * left to the caller.
+ */
+void blake2b_block_x4_avx2(uint8_t *const out[4],
+                           const uint8_t *const block[4], size_t outlen,
+                           size_t inlen) {
+    __m256i m[16], v[16], h[8];
+    uint64_t lanes[4];
+    const unsigned int *s;
+    unsigned int i, j, r;
+
+    for (i = 0; i < 16; ++i) {
+        m[i] = _mm256_set_epi64x((int64_t)load64(block[3] + i * 8),
+                                 (int64_t)load64(block[2] + i * 8),
+                                 (int64_t)load64(block[1] + i * 8),
+                                 (int64_t)load64(block[0] + i * 8));
+    }
+
+    /* Unkeyed parameter block: digest length, fanout 1, depth 1 */
+    h[0] = _mm256_set1_epi64x(
+        (int64_t)(blake2b_IV[0] ^ UINT64_C(0x01010000) ^ (uint64_t)outlen));
+    for (i = 1; i < 8; ++i) {
+        h[i] = _mm256_set1_epi64x((int64_t)blake2b_IV[i]);
+    }
+
+    for (i = 0; i < 8; ++i) {
+        v[i] = h[i];
+        v[i + 8] = _mm256_set1_epi64x((int64_t)blake2b_IV[i]);
+    }
+    v[12] = _mm256_xor_si256(v[12], _mm256_set1_epi64x((int64_t)inlen));
+    v[14] = _mm256_xor_si256(v[14], _mm256_set1_epi64x(-1));
+
+    for (r = 0; r < 12; ++r) {
+        s = blake2b_sigma[r];
+        G_AVX2(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);
+        G_AVX2(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);
+        G_AVX2(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);
+        G_AVX2(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);
+        G_AVX2(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);
+        G_AVX2(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+        G_AVX2(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);
+        G_AVX2(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);
+    }
+
+    for (i = 0; i < 8; ++i) {
+        h[i] = _mm256_xor_si256(h[i], _mm256_xor_si256(v[i], v[i + 8]));
+        _mm256_storeu_si256((__m256i *)(void *)lanes, h[i]);
+        for (j = 0; j < 4; ++j) {
+            store64(out[j] + i * 8, lanes[j]);
+        }
+    }
+    clear_internal_memory(lanes, sizeof(lanes));
+}
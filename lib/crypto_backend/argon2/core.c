@@ -277,6 +277,11 @@ static void *fill_segment_thr(void *thread_data)
     return 0;
 }
 
+static void fill_segment_job(void *thread_data) {
+    argon2_thread_data *my_data = thread_data;
+    fill_segment(my_data->instance_ptr, my_data->pos);
+}
+
 /* Multi-threaded version for p > 1 case */
 static int fill_memory_blocks_mt(argon2_instance_t *instance) {
     uint32_t r, s;
@@ -301,7 +306,20 @@ static int fill_memory_blocks_mt(argon2_instance_t *instance) {
         for (s = 0; s < ARGON2_SYNC_POINTS; ++s) {
             uint32_t l, ll;
 
-            /* 2. Calling threads */
+            /* 2. Use persistent worker pool if available */
+            for (l = 0; l < instance->lanes; ++l) {
+                argon2_position_t position = {r, l, (uint8_t)s, 0};
+                thr_data[l].instance_ptr = instance;
+                memcpy(&(thr_data[l].pos), &position,
+                       sizeof(argon2_position_t));
+            }
+            if (!argon2_thread_pool_run(fill_segment_job, thr_data,
+                                        sizeof(argon2_thread_data),
+                                        instance->lanes, instance->threads)) {
+                continue;
+            }
+
+            /* 2. Calling threads, pool is busy */
             for (l = 0; l < instance->lanes; ++l) {
                 argon2_position_t position;
 
@@ -506,26 +524,36 @@ int validate_inputs(const argon2_context *context) {
 }
 
 void fill_first_blocks(uint8_t *blockhash, const argon2_instance_t *instance) {
-    uint32_t l;
     /* Make the first and second block in each lane as G(H0||0||i) or
-       G(H0||1||i) */
-    uint8_t blockhash_bytes[ARGON2_BLOCK_SIZE];
-    for (l = 0; l < instance->lanes; ++l) {
-
-        store32(blockhash + ARGON2_PREHASH_DIGEST_LENGTH, 0);
-        store32(blockhash + ARGON2_PREHASH_DIGEST_LENGTH + 4, l);
-        blake2b_long(blockhash_bytes, ARGON2_BLOCK_SIZE, blockhash,
-                     ARGON2_PREHASH_SEED_LENGTH);
-        load_block(&instance->memory[l * instance->lane_length + 0],
-                   blockhash_bytes);
-
-        store32(blockhash + ARGON2_PREHASH_DIGEST_LENGTH, 1);
-        blake2b_long(blockhash_bytes, ARGON2_BLOCK_SIZE, blockhash,
-                     ARGON2_PREHASH_SEED_LENGTH);
-        load_block(&instance->memory[l * instance->lane_length + 1],
-                   blockhash_bytes);
-    }
-    clear_internal_memory(blockhash_bytes, ARGON2_BLOCK_SIZE);
+       G(H0||1||i); up to four of them are hashed at once */
+    uint8_t seeds[4][ARGON2_PREHASH_SEED_LENGTH];
+    uint8_t blockhash_bytes[4][ARGON2_BLOCK_SIZE];
+    void *out[4];
+    const void *in[4];
+    uint32_t blocks = 2 * instance->lanes, b, i, n;
+
+    for (i = 0; i < 4; ++i) {
+        out[i] = blockhash_bytes[i];
+        in[i] = seeds[i];
+    }
+
+    for (b = 0; b < blocks; b += n) {
+        n = blocks - b < 4 ? blocks - b : 4;
+        for (i = 0; i < n; ++i) {
+            memcpy(seeds[i], blockhash, ARGON2_PREHASH_DIGEST_LENGTH);
+            store32(seeds[i] + ARGON2_PREHASH_DIGEST_LENGTH, (b + i) % 2);
+            store32(seeds[i] + ARGON2_PREHASH_DIGEST_LENGTH + 4, (b + i) / 2);
+        }
+        blake2b_long_x4(out, ARGON2_BLOCK_SIZE, in,
+                        ARGON2_PREHASH_SEED_LENGTH, n);
+        for (i = 0; i < n; ++i) {
+            load_block(&instance->memory[((b + i) / 2) * instance->lane_length +
+                                         (b + i) % 2],
+                       blockhash_bytes[i]);
+        }
+    }
+    clear_internal_memory(seeds, sizeof(seeds));
+    clear_internal_memory(blockhash_bytes, sizeof(blockhash_bytes));
 }
 
 void initial_hash(uint8_t *blockhash, argon2_context *context,
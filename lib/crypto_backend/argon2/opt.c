@@ -25,6 +25,20 @@
 #include "blake2/blake2.h"
 #include "blake2/blamka-round-opt.h"
 
+/*
+ * With runtime dispatch, this unit is the SSE fallback and AVX2/AVX-512
+ * variants are compiled separately (opt_avx2.c, opt_avx512.c).
+ */
+#if !defined(ARGON2_FILL_SEGMENT) && \
+    (defined(ARGON2_DISPATCH_AVX2) || defined(ARGON2_DISPATCH_AVX512))
+#define ARGON2_FILL_SEGMENT fill_segment_sse
+#define ARGON2_DISPATCH 1
+#endif
+
+#ifndef ARGON2_FILL_SEGMENT
+#define ARGON2_FILL_SEGMENT fill_segment
+#endif
+
 /*
  * Function fills a new memory block and optionally XORs the old block over the new one.
  * Memory must be initialized.
@@ -171,8 +185,10 @@ static void next_addresses(block *address_block, block *input_block) {
     fill_block(zero2_block, address_block, address_block, 0);
 }
 
-void fill_segment(const argon2_instance_t *instance,
-                  argon2_position_t position) {
+void ARGON2_FILL_SEGMENT(const argon2_instance_t *instance,
+                         argon2_position_t position);
+void ARGON2_FILL_SEGMENT(const argon2_instance_t *instance,
+                         argon2_position_t position) {
     block *ref_block = NULL, *curr_block = NULL;
     block address_block, input_block;
     uint64_t pseudo_rand, ref_index, ref_lane;
@@ -281,3 +297,27 @@ void fill_segment(const argon2_instance_t *instance,
         }
     }
 }
+
+#if defined(ARGON2_DISPATCH)
+void fill_segment_avx2(const argon2_instance_t *instance,
+                       argon2_position_t position);
+void fill_segment_avx512(const argon2_instance_t *instance,
+                         argon2_position_t position);
+
+void fill_segment(const argon2_instance_t *instance,
+                  argon2_position_t position) {
+#if defined(ARGON2_DISPATCH_AVX512)
+    if (__builtin_cpu_supports("avx512f")) {
+        fill_segment_avx512(instance, position);
+        return;
+    }
+#endif
+#if defined(ARGON2_DISPATCH_AVX2)
+    if (__builtin_cpu_supports("avx2")) {
+        fill_segment_avx2(instance, position);
+        return;
+    }
+#endif
+    fill_segment_sse(instance, position);
+}
+#endif
@@ -54,4 +54,175 @@ void argon2_thread_exit(void) {
 #endif
 }
 
+#if defined(_WIN32)
+int argon2_thread_pool_run(void (*func)(void *), void *args, size_t stride,
+                           uint32_t count, uint32_t threads) {
+    (void)func; (void)args; (void)stride; (void)count; (void)threads;
+    return -1;
+}
+
+void argon2_thread_pool_destroy(void) {}
+#else
+
+#define ARGON2_POOL_MAX_WORKERS 15
+
+/*
+ * Library-owned pool of lane workers, created lazily and reused for every
+ * slice in every pass (instead of thread create/join per segment).
+ * Only one job set runs at a time; concurrent callers fall back.
+ * Workers are detached, they exit on their own once the pool is stopped.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    uint32_t nworkers;
+    int busy;
+    int quit;
+    void (*func)(void *);
+    uint8_t *args;
+    size_t stride;
+    uint32_t count, next, pending, active, max_active;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_once_t pool_atfork_once = PTHREAD_ONCE_INIT;
+
+static void pool_atfork_prepare(void) {
+    pthread_mutex_lock(&pool.lock);
+}
+
+static void pool_atfork_parent(void) {
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* Only the forking thread exists in the child, start with an empty pool */
+static void pool_atfork_child(void) {
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    pool.nworkers = 0;
+    pool.busy = 0;
+    pool.func = NULL;
+    pool.args = NULL;
+    pool.count = pool.next = pool.pending = pool.active = 0;
+}
+
+static void pool_atfork_register(void) {
+    pthread_atfork(pool_atfork_prepare, pool_atfork_parent, pool_atfork_child);
+}
+
+/* Must be called with pool lock held, returns with it held */
+static void pool_process(void) {
+    uint32_t i;
+
+    while (pool.next < pool.count && pool.active < pool.max_active) {
+        i = pool.next++;
+        pool.active++;
+        pthread_mutex_unlock(&pool.lock);
+
+        pool.func(pool.args + i * pool.stride);
+
+        pthread_mutex_lock(&pool.lock);
+        pool.active--;
+        if (--pool.pending == 0) {
+            pthread_cond_broadcast(&pool.done);
+        }
+    }
+}
+
+static void *pool_worker(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&pool.lock);
+    while (!pool.quit) {
+        if (pool.next < pool.count && pool.active < pool.max_active) {
+            pool_process();
+        } else {
+            pthread_cond_wait(&pool.work, &pool.lock);
+        }
+    }
+    pool.nworkers--;
+    pthread_mutex_unlock(&pool.lock);
+
+    return NULL;
+}
+
+static int pool_worker_create(void) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    int r;
+
+    if (pthread_attr_init(&attr)) {
+        return -1;
+    }
+
+    r = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) ||
+        pthread_create(&thread, &attr, pool_worker, NULL) ? -1 : 0;
+
+    pthread_attr_destroy(&attr);
+    return r;
+}
+
+int argon2_thread_pool_run(void (*func)(void *), void *args, size_t stride,
+                           uint32_t count, uint32_t threads) {
+    if (func == NULL || args == NULL || threads == 0 ||
+        threads > ARGON2_POOL_MAX_WORKERS + 1) {
+        return -1;
+    }
+
+    pthread_once(&pool_atfork_once, pool_atfork_register);
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.busy || pool.quit) {
+        pthread_mutex_unlock(&pool.lock);
+        return -1;
+    }
+    pool.busy = 1;
+
+    /* Grow lazily, the calling thread is one of the workers */
+    while (pool.nworkers < threads - 1 && !pool_worker_create()) {
+        pool.nworkers++;
+    }
+
+    pool.func = func;
+    pool.args = args;
+    pool.stride = stride;
+    pool.count = count;
+    pool.next = 0;
+    pool.pending = count;
+    pool.active = 0;
+    pool.max_active = threads;
+    pthread_cond_broadcast(&pool.work);
+
+    pool_process();
+    while (pool.pending) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+
+    pool.count = pool.next = 0;
+    pool.func = NULL;
+    pool.args = NULL;
+    pool.busy = 0;
+    pthread_cond_broadcast(&pool.done);
+    pthread_mutex_unlock(&pool.lock);
+
+    return 0;
+}
+
+/*
+ * Called from library destructor, must not wait for anything.
+ * A job set still running in another thread is finished by its caller.
+ */
+void argon2_thread_pool_destroy(void) {
+    pthread_mutex_lock(&pool.lock);
+    pool.quit = 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+}
+#endif
+
 #endif /* ARGON2_NO_THREADS */
@@ -20,6 +20,9 @@
 
 #if !defined(ARGON2_NO_THREADS)
 
+#include <stddef.h>
+#include <stdint.h>
+
 /*
         Here we implement an abstraction layer for the simpĺe requirements
         of the Argon2 code. We only require 3 primitives---thread creation,
@@ -63,5 +66,18 @@ int argon2_thread_join(argon2_thread_handle_t handle);
 */
 void argon2_thread_exit(void);
 
+/* Runs @func for @count jobs (@args array with @stride bytes per job) in
+ * the persistent worker pool, with at most @threads jobs running at once.
+ * The calling thread takes part in processing.
+ * @return 0 if all jobs were processed, nonzero if the pool is not
+ * available (busy or not supported); no job was run in that case.
+ */
+int argon2_thread_pool_run(void (*func)(void *), void *args, size_t stride,
+                           uint32_t count, uint32_t threads);
+
+/* Stops all pool worker threads (does not wait for them), pool is not used
+ * afterwards. */
+void argon2_thread_pool_destroy(void);
+
 #endif /* ARGON2_NO_THREADS */
 #endif
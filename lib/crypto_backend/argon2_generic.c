@@ -20,15 +20,126 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include "crypto_backend_internal.h"
 #if HAVE_ARGON2_H
 #include <argon2.h>
 #else
 #include "argon2/argon2.h"
+#if USE_INTERNAL_ARGON2
+#include "argon2/thread.h"
+#endif
 #endif
 
 #define CONST_CAST(x) (x)(uintptr_t)
 
+#if USE_INTERNAL_ARGON2 || HAVE_ARGON2_H
+#define ARGON2_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+/*
+ * Argon2 working memory arena, mapped with huge pages if possible.
+ * One mapping is kept after derivation so the following calls
+ * (benchmark, derivation and verification) do not fault in memory again.
+ */
+static struct {
+	pthread_mutex_t lock;
+	void *ptr;
+	size_t size;
+	bool in_use;
+} arena = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void *arena_map(size_t size)
+{
+	void *ptr;
+
+#ifdef MAP_HUGETLB
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (ptr != MAP_FAILED)
+		return ptr;
+#endif
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	(void)madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+	return ptr;
+}
+
+static size_t arena_size(size_t size)
+{
+	return (size + ARGON2_HUGEPAGE_SIZE - 1) & ~((size_t)ARGON2_HUGEPAGE_SIZE - 1);
+}
+
+static int arena_alloc(uint8_t **memory, size_t bytes)
+{
+	size_t size = arena_size(bytes);
+
+	*memory = NULL;
+	if (size < bytes)
+		return -1;
+
+	pthread_mutex_lock(&arena.lock);
+	if (!arena.in_use && arena.size >= size) {
+		arena.in_use = true;
+		*memory = arena.ptr;
+	} else if (!arena.in_use && arena.ptr) {
+		/* Too small, replace it (it is already wiped) */
+		munmap(arena.ptr, arena.size);
+		arena.ptr = NULL;
+		arena.size = 0;
+	}
+	pthread_mutex_unlock(&arena.lock);
+
+	if (!*memory)
+		*memory = arena_map(size);
+
+	return *memory ? 0 : -1;
+}
+
+static void arena_free(uint8_t *memory, size_t bytes)
+{
+	size_t size = arena_size(bytes);
+
+	if (!memory)
+		return;
+
+	crypt_backend_memzero(memory, bytes);
+
+	pthread_mutex_lock(&arena.lock);
+	if (memory == arena.ptr) {
+		arena.in_use = false;
+		memory = NULL;
+	} else if (!arena.ptr) {
+		arena.ptr = memory;
+		arena.size = size;
+		memory = NULL;
+	}
+	pthread_mutex_unlock(&arena.lock);
+
+	if (memory)
+		munmap(memory, size);
+}
+#endif
+
+void crypt_pbkdf_arena_release(void)
+{
+#if USE_INTERNAL_ARGON2 || HAVE_ARGON2_H
+	pthread_mutex_lock(&arena.lock);
+	if (arena.ptr && !arena.in_use) {
+		munmap(arena.ptr, arena.size);
+		arena.ptr = NULL;
+		arena.size = 0;
+	}
+	pthread_mutex_unlock(&arena.lock);
+#endif
+}
+
 int argon2(const char *type, const char *password, size_t password_length,
 	   const char *salt, size_t salt_length,
 	   char *key, size_t key_length,
@@ -51,6 +162,8 @@ int argon2(const char *type, const char *password, size_t password_length,
 		.pwdlen = (uint32_t)password_length,
 		.salt = CONST_CAST(uint8_t *)salt,
 		.saltlen = (uint32_t)salt_length,
+		.allocate_cbk = arena_alloc,
+		.free_cbk = arena_free,
 	};
 	int r;
 
@@ -77,3 +190,12 @@ int argon2(const char *type, const char *password, size_t password_length,
 	return r;
 #endif
 }
+
+/* Release internal Argon2 worker threads */
+void argon2_destroy(void)
+{
+	crypt_pbkdf_arena_release();
+#if USE_INTERNAL_ARGON2 && !HAVE_ARGON2_H && !defined(ARGON2_NO_THREADS)
+	argon2_thread_pool_destroy();
+#endif
+}
@@ -22,7 +22,7 @@
 #include <string.h>
 #include <stdbool.h>
 #include <errno.h>
-#include "crypto_backend.h"
+#include "crypto_backend_internal.h"
 
 struct cipher_alg {
 	const char *name;
@@ -87,3 +87,109 @@ int crypt_cipher_wrapped_key(const char *name, const char *mode)
 
 	return ca ? (int)ca->wrapped_key : 0;
 }
+
+/*
+ * CBC and XTS modes built on ECB function of a backend (for backends
+ * providing only block primitives). ECB is always called for many blocks
+ * at once where the mode allows it (CBC decryption and XTS).
+ */
+#define GENERIC_CHUNK		4096
+#define GENERIC_BLOCK_MAX	16
+#define XTS_BLOCK_SIZE		16
+
+int crypt_cbc_encrypt_generic(crypt_ecb_func encrypt, void *ctx, size_t block_size,
+			      const char *in, char *out, size_t length, const char *iv)
+{
+	unsigned char block[GENERIC_BLOCK_MAX];
+	size_t i, j;
+	int r = 0;
+
+	if (!iv || !block_size || block_size > sizeof(block) || length % block_size)
+		return -EINVAL;
+
+	memcpy(block, iv, block_size);
+	for (i = 0; i < length && !r; i += block_size) {
+		for (j = 0; j < block_size; j++)
+			block[j] ^= (unsigned char)in[i + j];
+		r = encrypt(ctx, block, block, block_size);
+		memcpy(&out[i], block, block_size);
+	}
+
+	crypt_backend_memzero(block, sizeof(block));
+	return r;
+}
+
+int crypt_cbc_decrypt_generic(crypt_ecb_func decrypt, void *ctx, size_t block_size,
+			      const char *in, char *out, size_t length, const char *iv)
+{
+	unsigned char prev[GENERIC_BLOCK_MAX], chunk[GENERIC_CHUNK];
+	size_t i, j, step = GENERIC_CHUNK;
+	int r = 0;
+
+	if (!iv || !block_size || block_size > sizeof(prev) || length % block_size)
+		return -EINVAL;
+
+	memcpy(prev, iv, block_size);
+	for (i = 0; i < length && !r; i += step) {
+		if (step > length - i)
+			step = length - i;
+
+		/* keep ciphertext, output can be the same buffer */
+		memcpy(chunk, &in[i], step);
+		r = decrypt(ctx, chunk, (unsigned char *)&out[i], step);
+
+		for (j = 0; j < step; j++)
+			out[i + j] ^= j < block_size ? prev[j] : chunk[j - block_size];
+		memcpy(prev, &chunk[step - block_size], block_size);
+	}
+
+	crypt_backend_memzero(prev, sizeof(prev));
+	crypt_backend_memzero(chunk, sizeof(chunk));
+	return r;
+}
+
+/* Multiply tweak by primitive element (x) in GF(2^128), little-endian as in IEEE 1619 */
+static void xts_mul_alpha(unsigned char *t)
+{
+	unsigned char carry = t[XTS_BLOCK_SIZE - 1] >> 7;
+	int i;
+
+	for (i = XTS_BLOCK_SIZE - 1; i > 0; i--)
+		t[i] = (t[i] << 1) | (t[i - 1] >> 7);
+	t[0] = (t[0] << 1) ^ (carry * 0x87);
+}
+
+/* XTS without ciphertext stealing (length must be multiple of block size) */
+int crypt_xts_crypt_generic(crypt_ecb_func crypt, void *ctx,
+			    crypt_ecb_func tweak_encrypt, void *tweak_ctx,
+			    const char *in, char *out, size_t length, const char *iv)
+{
+	unsigned char t[XTS_BLOCK_SIZE], tweaks[GENERIC_CHUNK];
+	size_t i, j, step = GENERIC_CHUNK;
+	int r;
+
+	if (!iv || !length || length % XTS_BLOCK_SIZE)
+		return -EINVAL;
+
+	r = tweak_encrypt(tweak_ctx, (const unsigned char *)iv, t, XTS_BLOCK_SIZE);
+
+	for (i = 0; i < length && !r; i += step) {
+		if (step > length - i)
+			step = length - i;
+
+		for (j = 0; j < step; j += XTS_BLOCK_SIZE) {
+			memcpy(&tweaks[j], t, XTS_BLOCK_SIZE);
+			xts_mul_alpha(t);
+		}
+
+		for (j = 0; j < step; j++)
+			out[i + j] = in[i + j] ^ tweaks[j];
+		r = crypt(ctx, (unsigned char *)&out[i], (unsigned char *)&out[i], step);
+		for (j = 0; j < step; j++)
+			out[i + j] ^= tweaks[j];
+	}
+
+	crypt_backend_memzero(t, sizeof(t));
+	crypt_backend_memzero(tweaks, sizeof(tweaks));
+	return r;
+}
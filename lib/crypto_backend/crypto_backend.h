@@ -44,8 +44,16 @@ int crypt_hash_size(const char *name);
 int crypt_hash_init(struct crypt_hash **ctx, const char *name);
 int crypt_hash_write(struct crypt_hash *ctx, const char *buffer, size_t length);
 int crypt_hash_final(struct crypt_hash *ctx, char *buffer, size_t length);
+int crypt_hash_copy(struct crypt_hash *dst, struct crypt_hash *src);
 void crypt_hash_destroy(struct crypt_hash *ctx);
 
+/* Hash of equal-sized blocks, digest_i = H(prefix || block_i || suffix) */
+int crypt_hash_blocks(const char *name,
+		      const char *prefix, size_t prefix_len,
+		      const char *suffix, size_t suffix_len,
+		      const char *blocks, size_t block_size, size_t count,
+		      char *digests, size_t digest_stride, size_t digest_size);
+
 /* HMAC */
 int crypt_hmac_size(const char *name);
 int crypt_hmac_init(struct crypt_hmac **ctx, const char *name,
@@ -79,9 +87,19 @@ int crypt_pbkdf_perf(const char *kdf, const char *hash,
 		uint32_t max_memory_kb, uint32_t parallel_threads,
 		uint32_t *iterations_out, uint32_t *memory_out,
 		int (*progress)(uint32_t time_ms, void *usrptr), void *usrptr);
+int crypt_pbkdf_measure(const char *kdf, const char *hash,
+		const char *password, size_t password_size,
+		const char *salt, size_t salt_size,
+		size_t volume_key_size, uint32_t iterations,
+		uint32_t memory_kb, uint32_t parallel_threads,
+		uint32_t warmup, uint32_t samples,
+		uint64_t *min_us, uint64_t *avg_us);
+void crypt_pbkdf_arena_release(void);
 
 /* CRC32 */
 uint32_t crypt_crc32(uint32_t seed, const unsigned char *buf, size_t len);
+uint32_t crypt_crc32c(uint32_t seed, const unsigned char *buf, size_t len);
+uint32_t crypt_crc32_trace(uint32_t seed, const unsigned char *buf, size_t len, uint32_t *trace);
 
 /* Block ciphers */
 int crypt_cipher_ivsize(const char *name, const char *mode);
@@ -96,6 +114,7 @@ int crypt_cipher_decrypt(struct crypt_cipher *ctx,
 			 const char *in, char *out, size_t length,
 			 const char *iv, size_t iv_length);
 bool crypt_cipher_kernel_only(struct crypt_cipher *ctx);
+int crypt_cipher_zerocopy(struct crypt_cipher *ctx);
 
 /* Benchmark of kernel cipher performance */
 int crypt_cipher_perf_kernel(const char *name, const char *mode, char *buffer, size_t buffer_size,
@@ -110,6 +129,10 @@ int crypt_cipher_check_kernel(const char *name, const char *mode,
 int crypt_storage_init(struct crypt_storage **ctx, size_t sector_size,
 		       const char *cipher, const char *cipher_mode,
 		       const void *key, size_t key_length, bool large_iv);
+int crypt_storage_init_threads(struct crypt_storage **ctx, size_t sector_size,
+		       const char *cipher, const char *cipher_mode,
+		       const void *key, size_t key_length, bool large_iv,
+		       unsigned threads);
 void crypt_storage_destroy(struct crypt_storage *ctx);
 int crypt_storage_decrypt(struct crypt_storage *ctx, uint64_t iv_offset,
 			  uint64_t length, char *buffer);
@@ -117,6 +140,7 @@ int crypt_storage_encrypt(struct crypt_storage *ctx, uint64_t iv_offset,
 			  uint64_t length, char *buffer);
 
 bool crypt_storage_kernel_only(struct crypt_storage *ctx);
+int crypt_storage_zerocopy(struct crypt_storage *ctx);
 
 /* Temporary Bitlk helper */
 int crypt_bitlk_decrypt_key(const void *key, size_t key_length,
@@ -124,6 +148,10 @@ int crypt_bitlk_decrypt_key(const void *key, size_t key_length,
 			    const char *iv, size_t iv_length,
 			    const char *tag, size_t tag_length);
 
+/* BITLK iterated SHA-256 key derivation (internal implementation) */
+int crypt_bitlk_kdf_sha256(const char *initial_sha256, const char *salt,
+			   uint64_t iterations, char *key);
+
 /* Memzero helper (memset on stack can be optimized out) */
 static inline void crypt_backend_memzero(void *s, size_t n)
 {
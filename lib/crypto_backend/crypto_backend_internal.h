@@ -31,17 +31,39 @@ int pkcs5_pbkdf2(const char *hash,
 		 unsigned int dkLen, char *DK,
 		 unsigned int hash_block_size);
 
+/* internal multi-buffer (SIMD lanes) hash, used by crypt_hash_blocks() */
+int crypt_hash_vec_blocks(const char *name,
+			  const char *prefix, size_t prefix_len,
+			  const char *suffix, size_t suffix_len,
+			  const char *blocks, size_t block_size, size_t count,
+			  char *digests, size_t digest_stride, size_t digest_size);
+
 /* Argon2 implementation wrapper */
 int argon2(const char *type, const char *password, size_t password_length,
 	   const char *salt, size_t salt_length,
 	   char *key, size_t key_length,
 	   uint32_t iterations, uint32_t memory, uint32_t parallel);
+void argon2_destroy(void);
+
+/* Block cipher modes built on backend ECB primitive */
+typedef int (*crypt_ecb_func)(void *ctx, const unsigned char *in, unsigned char *out, size_t length);
+
+int crypt_cbc_encrypt_generic(crypt_ecb_func encrypt, void *ctx, size_t block_size,
+			      const char *in, char *out, size_t length, const char *iv);
+int crypt_cbc_decrypt_generic(crypt_ecb_func decrypt, void *ctx, size_t block_size,
+			      const char *in, char *out, size_t length, const char *iv);
+int crypt_xts_crypt_generic(crypt_ecb_func crypt, void *ctx,
+			    crypt_ecb_func tweak_encrypt, void *tweak_ctx,
+			    const char *in, char *out, size_t length, const char *iv);
 
 /* Block ciphers: fallback to kernel crypto API */
 
 struct crypt_cipher_kernel {
 	int tfmfd;
 	int opfd;
+	/* zero-copy (vmsplice/splice) submission */
+	int pipefd[2];
+	size_t page_size;
 };
 
 int crypt_cipher_init_kernel(struct crypt_cipher_kernel *ctx, const char *name,
@@ -53,6 +75,7 @@ int crypt_cipher_decrypt_kernel(struct crypt_cipher_kernel *ctx,
 				const char *in, char *out, size_t length,
 				const char *iv, size_t iv_length);
 void crypt_cipher_destroy_kernel(struct crypt_cipher_kernel *ctx);
+int crypt_cipher_zerocopy_kernel(struct crypt_cipher_kernel *ctx);
 int crypt_bitlk_decrypt_key_kernel(const void *key, size_t key_length,
 				   const char *in, char *out, size_t length,
 				   const char *iv, size_t iv_length,
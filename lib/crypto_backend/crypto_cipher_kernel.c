@@ -25,8 +25,10 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include "crypto_backend_internal.h"
 
 #ifdef ENABLE_AF_ALG
@@ -59,6 +61,7 @@ static int _crypt_cipher_init(struct crypt_cipher_kernel *ctx,
 		return -EINVAL;
 
 	ctx->opfd = -1;
+	ctx->pipefd[0] = ctx->pipefd[1] = -1;
 	ctx->tfmfd = socket(AF_ALG, SOCK_SEQPACKET, 0);
 	if (ctx->tfmfd < 0) {
 		crypt_cipher_destroy_kernel(ctx);
@@ -105,6 +108,51 @@ int crypt_cipher_init_kernel(struct crypt_cipher_kernel *ctx, const char *name,
 	return _crypt_cipher_init(ctx, key, key_length, 0, &sa);
 }
 
+/*
+ * Zero-copy mode, input pages are spliced to the socket instead of copied by sendmsg.
+ * Op and IV are already set by sendmsg with MSG_MORE.
+ */
+static int _crypt_cipher_splice(struct crypt_cipher_kernel *ctx,
+				const char *in, size_t in_length)
+{
+	struct iovec iov = {
+		.iov_base = (void*)(uintptr_t)in,
+		.iov_len = in_length,
+	};
+	ssize_t len;
+
+	while (iov.iov_len) {
+		len = vmsplice(ctx->pipefd[1], &iov, 1, 0);
+		if (len <= 0)
+			return -EIO;
+		iov.iov_base = (char *)iov.iov_base + len;
+		iov.iov_len -= len;
+
+		while (len) {
+			/* the last splice without SPLICE_F_MORE completes the request */
+			ssize_t spliced = splice(ctx->pipefd[0], NULL, ctx->opfd, NULL, len,
+						 iov.iov_len ? SPLICE_F_MORE : 0);
+			if (spliced <= 0)
+				return -EIO;
+			len -= spliced;
+		}
+	}
+
+	return 0;
+}
+
+static bool _crypt_cipher_can_splice(struct crypt_cipher_kernel *ctx,
+				     const char *in, size_t in_length)
+{
+	if (ctx->pipefd[1] < 0 || !ctx->page_size)
+		return false;
+
+	/* full pages only, pipe capacity is 16 pages by default */
+	return !((uintptr_t)in & (ctx->page_size - 1)) &&
+	       !(in_length & (ctx->page_size - 1)) &&
+	       in_length <= 16 * ctx->page_size;
+}
+
 /* The in/out should be aligned to page boundary */
 static int _crypt_cipher_crypt(struct crypt_cipher_kernel *ctx,
 			       const char *in, size_t in_length,
@@ -163,8 +211,18 @@ static int _crypt_cipher_crypt(struct crypt_cipher_kernel *ctx,
 		memcpy(alg_iv->iv, iv, iv_length);
 	}
 
-	len = sendmsg(ctx->opfd, &msg, 0);
-	if (len != (ssize_t)(in_length))
+	if (_crypt_cipher_can_splice(ctx, in, in_length)) {
+		msg.msg_iov = NULL;
+		msg.msg_iovlen = 0;
+		len = sendmsg(ctx->opfd, &msg, MSG_MORE);
+		if (len || _crypt_cipher_splice(ctx, in, in_length))
+			r = -EIO;
+		else {
+			len = read(ctx->opfd, out, out_length);
+			if (len != (ssize_t)out_length)
+				r = -EIO;
+		}
+	} else if ((len = sendmsg(ctx->opfd, &msg, 0)) != (ssize_t)(in_length))
 		r = -EIO;
 	else {
 		len = read(ctx->opfd, out, out_length);
@@ -198,9 +256,34 @@ void crypt_cipher_destroy_kernel(struct crypt_cipher_kernel *ctx)
 		close(ctx->tfmfd);
 	if (ctx->opfd >= 0)
 		close(ctx->opfd);
+	if (ctx->pipefd[0] >= 0)
+		close(ctx->pipefd[0]);
+	if (ctx->pipefd[1] >= 0)
+		close(ctx->pipefd[1]);
 
 	ctx->tfmfd = -1;
 	ctx->opfd = -1;
+	ctx->pipefd[0] = ctx->pipefd[1] = -1;
+}
+
+int crypt_cipher_zerocopy_kernel(struct crypt_cipher_kernel *ctx)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+
+	if (ctx->opfd < 0 || page_size <= 0)
+		return -EINVAL;
+
+	if (ctx->pipefd[1] >= 0)
+		return 0;
+
+	if (pipe2(ctx->pipefd, O_CLOEXEC) < 0) {
+		ctx->pipefd[0] = ctx->pipefd[1] = -1;
+		return -ENOTSUP;
+	}
+
+	ctx->page_size = (size_t)page_size;
+
+	return 0;
 }
 
 int crypt_cipher_check_kernel(const char *name, const char *mode,
@@ -317,6 +400,11 @@ void crypt_cipher_destroy_kernel(struct crypt_cipher_kernel *ctx)
 	return;
 }
 
+int crypt_cipher_zerocopy_kernel(struct crypt_cipher_kernel *ctx)
+{
+	return -ENOTSUP;
+}
+
 int crypt_cipher_encrypt_kernel(struct crypt_cipher_kernel *ctx,
 				const char *in, char *out, size_t length,
 				const char *iv, size_t iv_length)
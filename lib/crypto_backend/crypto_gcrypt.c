@@ -45,6 +45,7 @@ struct crypt_hmac {
 
 struct crypt_cipher {
 	bool use_kernel;
+	int mode_id;
 	union {
 	struct crypt_cipher_kernel kernel;
 	gcry_cipher_hd_t hd;
@@ -136,6 +137,8 @@ int crypt_backend_init(void)
 
 void crypt_backend_destroy(void)
 {
+	argon2_destroy();
+
 	if (crypto_backend_initialised)
 		gcry_control(GCRYCTL_TERM_SECMEM);
 
@@ -261,6 +264,20 @@ int crypt_hash_final(struct crypt_hash *ctx, char *buffer, size_t length)
 	return 0;
 }
 
+/* Copy (intermediate) hash state, both contexts use the same algorithm */
+int crypt_hash_copy(struct crypt_hash *dst, struct crypt_hash *src)
+{
+	gcry_md_hd_t hd;
+
+	if (gcry_md_copy(&hd, src->hd))
+		return -EINVAL;
+
+	gcry_md_close(dst->hd);
+	dst->hd = hd;
+
+	return 0;
+}
+
 void crypt_hash_destroy(struct crypt_hash *ctx)
 {
 	gcry_md_close(ctx->hd);
@@ -403,28 +420,39 @@ int crypt_pbkdf(const char *kdf, const char *hash,
 	return -EINVAL;
 }
 
-/* Block ciphers */
-static int _cipher_init(gcry_cipher_hd_t *hd, const char *name,
+/*
+ * Block ciphers
+ * The handle is opened and keyed once for the context lifetime, every call
+ * then only sets IV (or counter for CTR mode). Modes not known here
+ * fall back to kernel AF_ALG ciphers (one syscall per sector in storage wrapper).
+ */
+static int _cipher_init(gcry_cipher_hd_t *hd, int *mode_id, const char *name,
 			const char *mode, const void *buffer, size_t length)
 {
-	int cipher_id, mode_id;
+	int cipher_id;
 
 	cipher_id = gcry_cipher_map_name(name);
 	if (cipher_id == GCRY_CIPHER_MODE_NONE)
 		return -ENOENT;
 
 	if (!strcmp(mode, "ecb"))
-		mode_id = GCRY_CIPHER_MODE_ECB;
+		*mode_id = GCRY_CIPHER_MODE_ECB;
 	else if (!strcmp(mode, "cbc"))
-		mode_id = GCRY_CIPHER_MODE_CBC;
+		*mode_id = GCRY_CIPHER_MODE_CBC;
+	else if (!strcmp(mode, "ctr"))
+		*mode_id = GCRY_CIPHER_MODE_CTR;
+	else if (!strcmp(mode, "cfb"))
+		*mode_id = GCRY_CIPHER_MODE_CFB;
+	else if (!strcmp(mode, "ofb"))
+		*mode_id = GCRY_CIPHER_MODE_OFB;
 #if HAVE_DECL_GCRY_CIPHER_MODE_XTS
 	else if (!strcmp(mode, "xts"))
-		mode_id = GCRY_CIPHER_MODE_XTS;
+		*mode_id = GCRY_CIPHER_MODE_XTS;
 #endif
 	else
 		return -ENOENT;
 
-	if (gcry_cipher_open(hd, cipher_id, mode_id, 0))
+	if (gcry_cipher_open(hd, cipher_id, *mode_id, 0))
 		return -EINVAL;
 
 	if (gcry_cipher_setkey(*hd, buffer, length)) {
@@ -445,7 +473,7 @@ int crypt_cipher_init(struct crypt_cipher **ctx, const char *name,
 	if (!h)
 		return -ENOMEM;
 
-	if (!_cipher_init(&h->u.hd, name, mode, key, key_length)) {
+	if (!_cipher_init(&h->u.hd, &h->mode_id, name, mode, key, key_length)) {
 		h->use_kernel = false;
 		*ctx = h;
 		return 0;
@@ -458,6 +486,7 @@ int crypt_cipher_init(struct crypt_cipher **ctx, const char *name,
 	}
 
 	h->use_kernel = true;
+	h->mode_id = GCRY_CIPHER_MODE_NONE;
 	*ctx = h;
 	return 0;
 }
@@ -471,6 +500,18 @@ void crypt_cipher_destroy(struct crypt_cipher *ctx)
 	free(ctx);
 }
 
+static int _cipher_setiv(struct crypt_cipher *ctx, const char *iv, size_t iv_length)
+{
+	if (!iv)
+		return 0;
+
+	/* CTR IV is the initial counter block (the same as in kernel ctr mode) */
+	if (ctx->mode_id == GCRY_CIPHER_MODE_CTR)
+		return gcry_cipher_setctr(ctx->u.hd, iv, iv_length) ? -EINVAL : 0;
+
+	return gcry_cipher_setiv(ctx->u.hd, iv, iv_length) ? -EINVAL : 0;
+}
+
 int crypt_cipher_encrypt(struct crypt_cipher *ctx,
 			 const char *in, char *out, size_t length,
 			 const char *iv, size_t iv_length)
@@ -478,10 +519,12 @@ int crypt_cipher_encrypt(struct crypt_cipher *ctx,
 	if (ctx->use_kernel)
 		return crypt_cipher_encrypt_kernel(&ctx->u.kernel, in, out, length, iv, iv_length);
 
-	if (iv && gcry_cipher_setiv(ctx->u.hd, iv, iv_length))
+	if (_cipher_setiv(ctx, iv, iv_length))
 		return -EINVAL;
 
-	if (gcry_cipher_encrypt(ctx->u.hd, out, length, in, length))
+	/* storage wrapper works in-place, use gcrypt in-place variant then */
+	if (in == out ? gcry_cipher_encrypt(ctx->u.hd, out, length, NULL, 0) :
+			gcry_cipher_encrypt(ctx->u.hd, out, length, in, length))
 		return -EINVAL;
 
 	return 0;
@@ -494,10 +537,12 @@ int crypt_cipher_decrypt(struct crypt_cipher *ctx,
 	if (ctx->use_kernel)
 		return crypt_cipher_decrypt_kernel(&ctx->u.kernel, in, out, length, iv, iv_length);
 
-	if (iv && gcry_cipher_setiv(ctx->u.hd, iv, iv_length))
+	if (_cipher_setiv(ctx, iv, iv_length))
 		return -EINVAL;
 
-	if (gcry_cipher_decrypt(ctx->u.hd, out, length, in, length))
+	/* storage wrapper works in-place, use gcrypt in-place variant then */
+	if (in == out ? gcry_cipher_decrypt(ctx->u.hd, out, length, NULL, 0) :
+			gcry_cipher_decrypt(ctx->u.hd, out, length, in, length))
 		return -EINVAL;
 
 	return 0;
@@ -508,6 +553,14 @@ bool crypt_cipher_kernel_only(struct crypt_cipher *ctx)
 	return ctx->use_kernel;
 }
 
+int crypt_cipher_zerocopy(struct crypt_cipher *ctx)
+{
+	if (!ctx->use_kernel)
+		return -ENOTSUP;
+
+	return crypt_cipher_zerocopy_kernel(&ctx->u.kernel);
+}
+
 int crypt_bitlk_decrypt_key(const void *key, size_t key_length,
 			    const char *in, char *out, size_t length,
 			    const char *iv, size_t iv_length,
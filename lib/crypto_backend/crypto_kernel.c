@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/utsname.h>
 #include <linux/if_alg.h>
@@ -72,8 +73,16 @@ static struct hash_alg hash_algs[] = {
 	{ NULL,        NULL,           0,   0 }
 };
 
-struct crypt_hash {
+#define HASH_ALGS_COUNT (sizeof(hash_algs) / sizeof(hash_algs[0]))
+
+/* bound tfm socket per hash algorithm, kept for next hash contexts */
+static struct {
+	bool cached;
 	int tfmfd;
+} hash_tfms[HASH_ALGS_COUNT];
+static pthread_mutex_t hash_tfm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct crypt_hash {
 	int opfd;
 	int hash_len;
 };
@@ -88,10 +97,11 @@ struct crypt_cipher {
 	struct crypt_cipher_kernel ck;
 };
 
-static int crypt_kernel_socket_init(struct sockaddr_alg *sa, int *tfmfd, int *opfd,
+static int crypt_kernel_socket_bind(struct sockaddr_alg *sa, int *tfmfd,
 				    const void *key, size_t key_length)
 {
-	*tfmfd = socket(AF_ALG, SOCK_SEQPACKET, 0);
+	/* cached tfm outlives the caller context, do not leak it to exec'd children */
+	*tfmfd = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
 	if (*tfmfd < 0)
 		return -ENOTSUP;
 
@@ -107,7 +117,19 @@ static int crypt_kernel_socket_init(struct sockaddr_alg *sa, int *tfmfd, int *op
 		return -EINVAL;
 	}
 
-	*opfd = accept(*tfmfd, NULL, 0);
+	return 0;
+}
+
+static int crypt_kernel_socket_init(struct sockaddr_alg *sa, int *tfmfd, int *opfd,
+				    const void *key, size_t key_length)
+{
+	int r;
+
+	r = crypt_kernel_socket_bind(sa, tfmfd, key, key_length);
+	if (r < 0)
+		return r;
+
+	*opfd = accept4(*tfmfd, NULL, 0, SOCK_CLOEXEC);
 	if (*opfd < 0) {
 		close(*tfmfd);
 		*tfmfd = -1;
@@ -117,15 +139,61 @@ static int crypt_kernel_socket_init(struct sockaddr_alg *sa, int *tfmfd, int *op
 	return 0;
 }
 
-int crypt_backend_init(void)
+/*
+ * Unkeyed hash tfm can serve any number of operation sockets, so the bound
+ * socket is kept per algorithm and a new hash context costs only accept().
+ * Keyed (HMAC, cipher) tfms are not cached, the kernel refuses setkey while
+ * operation sockets exist and a cache keyed by key would keep secrets around.
+ */
+static int crypt_kernel_hash_opfd(struct hash_alg *ha, int *opfd)
 {
-	struct utsname uts;
 	struct sockaddr_alg sa = {
 		.salg_family = AF_ALG,
 		.salg_type = "hash",
-		.salg_name = "sha256",
 	};
-	int tfmfd = -1, opfd = -1;
+	size_t i = ha - hash_algs;
+	int r = 0;
+
+	pthread_mutex_lock(&hash_tfm_lock);
+
+	if (!hash_tfms[i].cached) {
+		strncpy((char *)sa.salg_name, ha->kernel_name, sizeof(sa.salg_name)-1);
+		r = crypt_kernel_socket_bind(&sa, &hash_tfms[i].tfmfd, NULL, 0);
+		hash_tfms[i].cached = (r == 0);
+	}
+
+	if (!r) {
+		*opfd = accept4(hash_tfms[i].tfmfd, NULL, 0, SOCK_CLOEXEC);
+		if (*opfd < 0)
+			r = -EINVAL;
+	}
+
+	pthread_mutex_unlock(&hash_tfm_lock);
+	return r;
+}
+
+static void crypt_kernel_hash_tfm_cache_drop(void)
+{
+	size_t i;
+
+	pthread_mutex_lock(&hash_tfm_lock);
+	for (i = 0; i < HASH_ALGS_COUNT; i++) {
+		if (!hash_tfms[i].cached)
+			continue;
+		close(hash_tfms[i].tfmfd);
+		hash_tfms[i].tfmfd = -1;
+		hash_tfms[i].cached = false;
+	}
+	pthread_mutex_unlock(&hash_tfm_lock);
+}
+
+/*
+ * AF_ALG support is not probed here (it costs socket pair setup on every
+ * library start), missing support is reported by the first crypto operation.
+ */
+int crypt_backend_init(void)
+{
+	struct utsname uts;
 
 	if (crypto_backend_initialised)
 		return 0;
@@ -133,12 +201,6 @@ int crypt_backend_init(void)
 	if (uname(&uts) == -1 || strcmp(uts.sysname, "Linux"))
 		return -EINVAL;
 
-	if (crypt_kernel_socket_init(&sa, &tfmfd, &opfd, NULL, 0) < 0)
-		return -EINVAL;
-
-	close(tfmfd);
-	close(opfd);
-
 	snprintf(version, sizeof(version), "%s %s kernel cryptoAPI",
 		 uts.sysname, uts.release);
 
@@ -148,6 +210,8 @@ int crypt_backend_init(void)
 
 void crypt_backend_destroy(void)
 {
+	crypt_kernel_hash_tfm_cache_drop();
+	argon2_destroy();
 	crypto_backend_initialised = 0;
 }
 
@@ -185,10 +249,6 @@ int crypt_hash_init(struct crypt_hash **ctx, const char *name)
 {
 	struct crypt_hash *h;
 	struct hash_alg *ha;
-	struct sockaddr_alg sa = {
-		.salg_family = AF_ALG,
-		.salg_type = "hash",
-	};
 
 	h = malloc(sizeof(*h));
 	if (!h)
@@ -201,9 +261,7 @@ int crypt_hash_init(struct crypt_hash **ctx, const char *name)
 	}
 	h->hash_len = ha->length;
 
-	strncpy((char *)sa.salg_name, ha->kernel_name, sizeof(sa.salg_name)-1);
-
-	if (crypt_kernel_socket_init(&sa, &h->tfmfd, &h->opfd, NULL, 0) < 0) {
+	if (crypt_kernel_hash_opfd(ha, &h->opfd) < 0) {
 		free(h);
 		return -EINVAL;
 	}
@@ -237,10 +295,18 @@ int crypt_hash_final(struct crypt_hash *ctx, char *buffer, size_t length)
 	return 0;
 }
 
+/*
+ * Copying state requires accept() on operation socket, in PBKDF2 it would cost
+ * more syscalls than it saves (internal PBKDF2 uses userspace code instead).
+ */
+int crypt_hash_copy(struct crypt_hash *dst __attribute__((unused)),
+		    struct crypt_hash *src __attribute__((unused)))
+{
+	return -ENOTSUP;
+}
+
 void crypt_hash_destroy(struct crypt_hash *ctx)
 {
-	if (ctx->tfmfd >= 0)
-		close(ctx->tfmfd);
 	if (ctx->opfd >= 0)
 		close(ctx->opfd);
 	memset(ctx, 0, sizeof(*ctx));
@@ -401,6 +467,11 @@ bool crypt_cipher_kernel_only(struct crypt_cipher *ctx __attribute__((unused)))
 	return true;
 }
 
+int crypt_cipher_zerocopy(struct crypt_cipher *ctx)
+{
+	return crypt_cipher_zerocopy_kernel(&ctx->ck);
+}
+
 int crypt_bitlk_decrypt_key(const void *key, size_t key_length,
 			    const char *in, char *out, size_t length,
 			    const char *iv, size_t iv_length,
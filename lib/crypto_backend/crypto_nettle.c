@@ -26,6 +26,7 @@
 #include <nettle/sha3.h>
 #include <nettle/hmac.h>
 #include <nettle/pbkdf2.h>
+#include <nettle/nettle-meta.h>
 #include "crypto_backend_internal.h"
 
 #if HAVE_NETTLE_VERSION_H
@@ -192,8 +193,24 @@ struct crypt_hmac {
 	uint8_t *key;
 };
 
+typedef enum { NETTLE_ECB = 0, NETTLE_CBC, NETTLE_XTS } nettle_mode;
+
+struct nettle_key {
+	const struct nettle_cipher *alg;
+	void *ctx;
+};
+
 struct crypt_cipher {
-	struct crypt_cipher_kernel ck;
+	bool use_kernel;
+	union {
+	struct crypt_cipher_kernel kernel;
+	struct {
+		nettle_mode mode;
+		struct nettle_key enc;
+		struct nettle_key dec;
+		struct nettle_key tweak; /* XTS only, second half of the key */
+	} lib;
+	} u;
 };
 
 uint32_t crypt_backend_flags(void)
@@ -220,7 +237,7 @@ int crypt_backend_init(void)
 
 void crypt_backend_destroy(void)
 {
-	return;
+	argon2_destroy();
 }
 
 const char *crypt_backend_version(void)
@@ -277,6 +294,17 @@ int crypt_hash_final(struct crypt_hash *ctx, char *buffer, size_t length)
 	return 0;
 }
 
+/* Copy (intermediate) hash state, both contexts use the same algorithm */
+int crypt_hash_copy(struct crypt_hash *dst, struct crypt_hash *src)
+{
+	if (dst->hash != src->hash)
+		return -EINVAL;
+
+	memcpy(&dst->nettle_ctx, &src->nettle_ctx, sizeof(dst->nettle_ctx));
+
+	return 0;
+}
+
 void crypt_hash_destroy(struct crypt_hash *ctx)
 {
 	memset(ctx, 0, sizeof(*ctx));
@@ -392,7 +420,129 @@ int crypt_pbkdf(const char *kdf, const char *hash,
 	return -EINVAL;
 }
 
-/* Block ciphers */
+/*
+ * Block ciphers
+ * ECB, CBC and XTS modes are processed in userspace on Nettle block
+ * primitives (CBC and XTS via generic mode code), anything else
+ * falls back to kernel crypto API.
+ */
+static const struct {
+	const char *name;
+	size_t key_length;
+	const struct nettle_cipher *alg;
+} cipher_algs[] = {
+	{ "aes",      16, &nettle_aes128 },
+	{ "aes",      24, &nettle_aes192 },
+	{ "aes",      32, &nettle_aes256 },
+	{ "serpent",  16, &nettle_serpent128 },
+	{ "serpent",  24, &nettle_serpent192 },
+	{ "serpent",  32, &nettle_serpent256 },
+	{ "twofish",  16, &nettle_twofish128 },
+	{ "twofish",  24, &nettle_twofish192 },
+	{ "twofish",  32, &nettle_twofish256 },
+	{ "camellia", 16, &nettle_camellia128 },
+	{ "camellia", 24, &nettle_camellia192 },
+	{ "camellia", 32, &nettle_camellia256 },
+	{ NULL,        0, NULL }
+};
+
+static const struct nettle_cipher *_get_cipher(const char *name, size_t key_length)
+{
+	int i;
+
+	for (i = 0; cipher_algs[i].name; i++)
+		if (!strcasecmp(name, cipher_algs[i].name) &&
+		    key_length == cipher_algs[i].key_length)
+			return cipher_algs[i].alg;
+
+	return NULL;
+}
+
+static int _key_init(struct nettle_key *k, const struct nettle_cipher *alg,
+		     const void *key, bool decrypt)
+{
+	k->alg = alg;
+	k->ctx = malloc(alg->context_size);
+	if (!k->ctx)
+		return -ENOMEM;
+
+	if (decrypt)
+		alg->set_decrypt_key(k->ctx, key);
+	else
+		alg->set_encrypt_key(k->ctx, key);
+
+	return 0;
+}
+
+static void _key_destroy(struct nettle_key *k)
+{
+	if (!k->ctx)
+		return;
+
+	crypt_backend_memzero(k->ctx, k->alg->context_size);
+	free(k->ctx);
+	k->ctx = NULL;
+}
+
+static int _ecb_encrypt(void *key, const unsigned char *in, unsigned char *out, size_t length)
+{
+	struct nettle_key *k = key;
+
+	k->alg->encrypt(k->ctx, length, out, in);
+	return 0;
+}
+
+static int _ecb_decrypt(void *key, const unsigned char *in, unsigned char *out, size_t length)
+{
+	struct nettle_key *k = key;
+
+	k->alg->decrypt(k->ctx, length, out, in);
+	return 0;
+}
+
+static void _cipher_destroy(struct crypt_cipher *h)
+{
+	_key_destroy(&h->u.lib.enc);
+	_key_destroy(&h->u.lib.dec);
+	_key_destroy(&h->u.lib.tweak);
+}
+
+static int _cipher_init(struct crypt_cipher *h, const char *name,
+			const char *mode, const void *key, size_t key_length)
+{
+	const struct nettle_cipher *alg;
+	int r;
+
+	memset(&h->u.lib, 0, sizeof(h->u.lib));
+
+	if (!strcmp(mode, "ecb"))
+		h->u.lib.mode = NETTLE_ECB;
+	else if (!strcmp(mode, "cbc"))
+		h->u.lib.mode = NETTLE_CBC;
+	else if (!strcmp(mode, "xts") && !(key_length & 1))
+		h->u.lib.mode = NETTLE_XTS;
+	else
+		return -ENOENT;
+
+	if (h->u.lib.mode == NETTLE_XTS)
+		key_length /= 2;
+
+	alg = _get_cipher(name, key_length);
+	if (!alg || alg->block_size > 16 ||
+	    (h->u.lib.mode == NETTLE_XTS && alg->block_size != 16))
+		return -ENOENT;
+
+	r = _key_init(&h->u.lib.enc, alg, key, false);
+	if (!r)
+		r = _key_init(&h->u.lib.dec, alg, key, true);
+	if (!r && h->u.lib.mode == NETTLE_XTS)
+		r = _key_init(&h->u.lib.tweak, alg, (const char *)key + key_length, false);
+	if (r)
+		_cipher_destroy(h);
+
+	return r;
+}
+
 int crypt_cipher_init(struct crypt_cipher **ctx, const char *name,
 		    const char *mode, const void *key, size_t key_length)
 {
@@ -403,19 +553,33 @@ int crypt_cipher_init(struct crypt_cipher **ctx, const char *name,
 	if (!h)
 		return -ENOMEM;
 
-	r = crypt_cipher_init_kernel(&h->ck, name, mode, key, key_length);
+	r = _cipher_init(h, name, mode, key, key_length);
+	if (!r) {
+		h->use_kernel = false;
+		*ctx = h;
+		return 0;
+	} else if (r != -ENOENT) {
+		free(h);
+		return r;
+	}
+
+	r = crypt_cipher_init_kernel(&h->u.kernel, name, mode, key, key_length);
 	if (r < 0) {
 		free(h);
 		return r;
 	}
 
+	h->use_kernel = true;
 	*ctx = h;
 	return 0;
 }
 
 void crypt_cipher_destroy(struct crypt_cipher *ctx)
 {
-	crypt_cipher_destroy_kernel(&ctx->ck);
+	if (ctx->use_kernel)
+		crypt_cipher_destroy_kernel(&ctx->u.kernel);
+	else
+		_cipher_destroy(ctx);
 	free(ctx);
 }
 
@@ -423,19 +587,69 @@ int crypt_cipher_encrypt(struct crypt_cipher *ctx,
 			 const char *in, char *out, size_t length,
 			 const char *iv, size_t iv_length)
 {
-	return crypt_cipher_encrypt_kernel(&ctx->ck, in, out, length, iv, iv_length);
+	struct nettle_key *k = &ctx->u.lib.enc;
+
+	if (ctx->use_kernel)
+		return crypt_cipher_encrypt_kernel(&ctx->u.kernel, in, out, length, iv, iv_length);
+
+	if (ctx->u.lib.mode != NETTLE_ECB && iv_length != k->alg->block_size)
+		return -EINVAL;
+
+	switch (ctx->u.lib.mode) {
+	case NETTLE_ECB:
+		if (length % k->alg->block_size)
+			return -EINVAL;
+		return _ecb_encrypt(k, (const unsigned char *)in, (unsigned char *)out, length);
+	case NETTLE_CBC:
+		return crypt_cbc_encrypt_generic(_ecb_encrypt, k, k->alg->block_size,
+						 in, out, length, iv);
+	case NETTLE_XTS:
+		return crypt_xts_crypt_generic(_ecb_encrypt, k, _ecb_encrypt, &ctx->u.lib.tweak,
+					       in, out, length, iv);
+	}
+
+	return -EINVAL;
 }
 
 int crypt_cipher_decrypt(struct crypt_cipher *ctx,
 			 const char *in, char *out, size_t length,
 			 const char *iv, size_t iv_length)
 {
-	return crypt_cipher_decrypt_kernel(&ctx->ck, in, out, length, iv, iv_length);
+	struct nettle_key *k = &ctx->u.lib.dec;
+
+	if (ctx->use_kernel)
+		return crypt_cipher_decrypt_kernel(&ctx->u.kernel, in, out, length, iv, iv_length);
+
+	if (ctx->u.lib.mode != NETTLE_ECB && iv_length != k->alg->block_size)
+		return -EINVAL;
+
+	switch (ctx->u.lib.mode) {
+	case NETTLE_ECB:
+		if (length % k->alg->block_size)
+			return -EINVAL;
+		return _ecb_decrypt(k, (const unsigned char *)in, (unsigned char *)out, length);
+	case NETTLE_CBC:
+		return crypt_cbc_decrypt_generic(_ecb_decrypt, k, k->alg->block_size,
+						 in, out, length, iv);
+	case NETTLE_XTS:
+		return crypt_xts_crypt_generic(_ecb_decrypt, k, _ecb_encrypt, &ctx->u.lib.tweak,
+					       in, out, length, iv);
+	}
+
+	return -EINVAL;
+}
+
+bool crypt_cipher_kernel_only(struct crypt_cipher *ctx)
+{
+	return ctx->use_kernel;
 }
 
-bool crypt_cipher_kernel_only(struct crypt_cipher *ctx __attribute__((unused)))
+int crypt_cipher_zerocopy(struct crypt_cipher *ctx)
 {
-	return true;
+	if (!ctx->use_kernel)
+		return -ENOTSUP;
+
+	return crypt_cipher_zerocopy_kernel(&ctx->u.kernel);
 }
 
 int crypt_bitlk_decrypt_key(const void *key, size_t key_length,
@@ -21,6 +21,7 @@
 
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <nss.h>
 #include <pk11pub.h>
 #include "crypto_backend_internal.h"
@@ -59,8 +60,26 @@ struct crypt_hmac {
 	const struct hash_alg *hash;
 };
 
+typedef enum { NSS_ECB = 0, NSS_CBC, NSS_XTS } nss_mode;
+
+struct nss_key {
+	PK11SymKey *key;
+	PK11Context *ctx;
+};
+
 struct crypt_cipher {
-	struct crypt_cipher_kernel ck;
+	bool use_kernel;
+	union {
+	struct crypt_cipher_kernel kernel;
+	struct {
+		nss_mode mode;
+		size_t block_size;
+		PK11SlotInfo *slot;
+		struct nss_key enc;
+		struct nss_key dec;
+		struct nss_key tweak; /* XTS only, second half of the key */
+	} lib;
+	} u;
 };
 
 static struct hash_alg *_get_alg(const char *name)
@@ -94,6 +113,7 @@ int crypt_backend_init(void)
 
 void crypt_backend_destroy(void)
 {
+	argon2_destroy();
 	crypto_backend_initialised = 0;
 }
 
@@ -184,6 +204,21 @@ int crypt_hash_final(struct crypt_hash *ctx, char *buffer, size_t length)
 	return 0;
 }
 
+/* Copy (intermediate) hash state, both contexts use the same algorithm */
+int crypt_hash_copy(struct crypt_hash *dst, struct crypt_hash *src)
+{
+	PK11Context *md;
+
+	md = PK11_CloneContext(src->md);
+	if (!md)
+		return -EINVAL;
+
+	PK11_DestroyContext(dst->md, PR_TRUE);
+	dst->md = md;
+
+	return 0;
+}
+
 void crypt_hash_destroy(struct crypt_hash *ctx)
 {
 	PK11_DestroyContext(ctx->md, PR_TRUE);
@@ -336,7 +371,129 @@ int crypt_pbkdf(const char *kdf, const char *hash,
 	return -EINVAL;
 }
 
-/* Block ciphers */
+/*
+ * Block ciphers
+ * ECB, CBC and XTS modes are processed in userspace on NSS ECB contexts
+ * (CBC and XTS via generic mode code), anything else falls back
+ * to kernel crypto API.
+ */
+static const struct {
+	const char *name;
+	CK_MECHANISM_TYPE mech;
+	size_t block_size;
+} cipher_algs[] = {
+	{ "aes",      CKM_AES_ECB,      16 },
+	{ "camellia", CKM_CAMELLIA_ECB, 16 },
+	{ NULL,       0,                 0 }
+};
+
+static int _key_init(struct nss_key *k, PK11SlotInfo *slot, CK_MECHANISM_TYPE mech,
+		     CK_ATTRIBUTE_TYPE operation, const void *key, size_t key_length)
+{
+	SECItem keyItem;
+	SECItem noParams;
+
+	keyItem.type = siBuffer;
+	keyItem.data = CONST_CAST(unsigned char *)key;
+	keyItem.len = (int)key_length;
+
+	noParams.type = siBuffer;
+	noParams.data = 0;
+	noParams.len = 0;
+
+	k->key = PK11_ImportSymKey(slot, mech, PK11_OriginUnwrap, operation, &keyItem, NULL);
+	if (!k->key)
+		return -EINVAL;
+
+	k->ctx = PK11_CreateContextBySymKey(mech, operation, k->key, &noParams);
+	if (!k->ctx)
+		return -EINVAL;
+
+	return 0;
+}
+
+static void _key_destroy(struct nss_key *k)
+{
+	if (k->ctx)
+		PK11_DestroyContext(k->ctx, PR_TRUE);
+	if (k->key)
+		PK11_FreeSymKey(k->key);
+	k->ctx = NULL;
+	k->key = NULL;
+}
+
+/* ECB context does not chain blocks, every call is independent */
+static int _ecb_crypt(void *key, const unsigned char *in, unsigned char *out, size_t length)
+{
+	struct nss_key *k = key;
+	int out_len;
+
+	if (length > INT_MAX ||
+	    PK11_CipherOp(k->ctx, out, &out_len, length, CONST_CAST(unsigned char *)in, length) != SECSuccess ||
+	    out_len != (int)length)
+		return -EINVAL;
+
+	return 0;
+}
+
+static void _cipher_destroy(struct crypt_cipher *h)
+{
+	_key_destroy(&h->u.lib.enc);
+	_key_destroy(&h->u.lib.dec);
+	_key_destroy(&h->u.lib.tweak);
+	if (h->u.lib.slot)
+		PK11_FreeSlot(h->u.lib.slot);
+	h->u.lib.slot = NULL;
+}
+
+static int _cipher_init(struct crypt_cipher *h, const char *name,
+			const char *mode, const void *key, size_t key_length)
+{
+	CK_MECHANISM_TYPE mech;
+	int i, r;
+
+	memset(&h->u.lib, 0, sizeof(h->u.lib));
+
+	if (!strcmp(mode, "ecb"))
+		h->u.lib.mode = NSS_ECB;
+	else if (!strcmp(mode, "cbc"))
+		h->u.lib.mode = NSS_CBC;
+	else if (!strcmp(mode, "xts") && !(key_length & 1))
+		h->u.lib.mode = NSS_XTS;
+	else
+		return -ENOENT;
+
+	if (h->u.lib.mode == NSS_XTS)
+		key_length /= 2;
+
+	if (key_length != 16 && key_length != 24 && key_length != 32)
+		return -ENOENT;
+
+	for (i = 0; cipher_algs[i].name; i++)
+		if (!strcmp(name, cipher_algs[i].name))
+			break;
+	if (!cipher_algs[i].name)
+		return -ENOENT;
+
+	mech = cipher_algs[i].mech;
+	h->u.lib.block_size = cipher_algs[i].block_size;
+
+	h->u.lib.slot = PK11_GetBestSlot(mech, NULL);
+	if (!h->u.lib.slot)
+		return -ENOENT;
+
+	r = _key_init(&h->u.lib.enc, h->u.lib.slot, mech, CKA_ENCRYPT, key, key_length);
+	if (!r)
+		r = _key_init(&h->u.lib.dec, h->u.lib.slot, mech, CKA_DECRYPT, key, key_length);
+	if (!r && h->u.lib.mode == NSS_XTS)
+		r = _key_init(&h->u.lib.tweak, h->u.lib.slot, mech, CKA_ENCRYPT,
+			      (const char *)key + key_length, key_length);
+	if (r)
+		_cipher_destroy(h);
+
+	return r;
+}
+
 int crypt_cipher_init(struct crypt_cipher **ctx, const char *name,
 		    const char *mode, const void *key, size_t key_length)
 {
@@ -347,19 +504,29 @@ int crypt_cipher_init(struct crypt_cipher **ctx, const char *name,
 	if (!h)
 		return -ENOMEM;
 
-	r = crypt_cipher_init_kernel(&h->ck, name, mode, key, key_length);
+	if (!_cipher_init(h, name, mode, key, key_length)) {
+		h->use_kernel = false;
+		*ctx = h;
+		return 0;
+	}
+
+	r = crypt_cipher_init_kernel(&h->u.kernel, name, mode, key, key_length);
 	if (r < 0) {
 		free(h);
 		return r;
 	}
 
+	h->use_kernel = true;
 	*ctx = h;
 	return 0;
 }
 
 void crypt_cipher_destroy(struct crypt_cipher *ctx)
 {
-	crypt_cipher_destroy_kernel(&ctx->ck);
+	if (ctx->use_kernel)
+		crypt_cipher_destroy_kernel(&ctx->u.kernel);
+	else
+		_cipher_destroy(ctx);
 	free(ctx);
 }
 
@@ -367,19 +534,69 @@ int crypt_cipher_encrypt(struct crypt_cipher *ctx,
 			 const char *in, char *out, size_t length,
 			 const char *iv, size_t iv_length)
 {
-	return crypt_cipher_encrypt_kernel(&ctx->ck, in, out, length, iv, iv_length);
+	size_t block_size = ctx->u.lib.block_size;
+
+	if (ctx->use_kernel)
+		return crypt_cipher_encrypt_kernel(&ctx->u.kernel, in, out, length, iv, iv_length);
+
+	if (ctx->u.lib.mode != NSS_ECB && iv_length != block_size)
+		return -EINVAL;
+
+	switch (ctx->u.lib.mode) {
+	case NSS_ECB:
+		if (length % block_size)
+			return -EINVAL;
+		return _ecb_crypt(&ctx->u.lib.enc, (const unsigned char *)in, (unsigned char *)out, length);
+	case NSS_CBC:
+		return crypt_cbc_encrypt_generic(_ecb_crypt, &ctx->u.lib.enc, block_size,
+						 in, out, length, iv);
+	case NSS_XTS:
+		return crypt_xts_crypt_generic(_ecb_crypt, &ctx->u.lib.enc, _ecb_crypt, &ctx->u.lib.tweak,
+					       in, out, length, iv);
+	}
+
+	return -EINVAL;
 }
 
 int crypt_cipher_decrypt(struct crypt_cipher *ctx,
 			 const char *in, char *out, size_t length,
 			 const char *iv, size_t iv_length)
 {
-	return crypt_cipher_decrypt_kernel(&ctx->ck, in, out, length, iv, iv_length);
+	size_t block_size = ctx->u.lib.block_size;
+
+	if (ctx->use_kernel)
+		return crypt_cipher_decrypt_kernel(&ctx->u.kernel, in, out, length, iv, iv_length);
+
+	if (ctx->u.lib.mode != NSS_ECB && iv_length != block_size)
+		return -EINVAL;
+
+	switch (ctx->u.lib.mode) {
+	case NSS_ECB:
+		if (length % block_size)
+			return -EINVAL;
+		return _ecb_crypt(&ctx->u.lib.dec, (const unsigned char *)in, (unsigned char *)out, length);
+	case NSS_CBC:
+		return crypt_cbc_decrypt_generic(_ecb_crypt, &ctx->u.lib.dec, block_size,
+						 in, out, length, iv);
+	case NSS_XTS:
+		return crypt_xts_crypt_generic(_ecb_crypt, &ctx->u.lib.dec, _ecb_crypt, &ctx->u.lib.tweak,
+					       in, out, length, iv);
+	}
+
+	return -EINVAL;
 }
 
-bool crypt_cipher_kernel_only(struct crypt_cipher *ctx __attribute__((unused)))
+bool crypt_cipher_kernel_only(struct crypt_cipher *ctx)
 {
-	return true;
+	return ctx->use_kernel;
+}
+
+int crypt_cipher_zerocopy(struct crypt_cipher *ctx)
+{
+	if (!ctx->use_kernel)
+		return -ENOTSUP;
+
+	return crypt_cipher_zerocopy_kernel(&ctx->u.kernel);
 }
 
 int crypt_bitlk_decrypt_key(const void *key, size_t key_length,
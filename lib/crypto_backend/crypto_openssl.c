@@ -30,6 +30,7 @@
 
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
 #include <openssl/rand.h>
@@ -42,6 +43,7 @@ static int crypto_backend_initialised = 0;
 struct crypt_hash {
 	EVP_MD_CTX *md;
 	const EVP_MD *hash_id;
+	const EVP_MD_CTX *md_tmpl;
 	int hash_len;
 };
 
@@ -68,6 +70,27 @@ struct hash_alg {
 	const char *openssl_name;
 };
 
+/*
+ * Cache of algorithms resolved by name (with OpenSSL 3 providers the implicit
+ * fetch on every lookup is expensive). Every cached digest has also
+ * initialized template context that is copied on hash init and restart.
+ */
+#define ALG_CACHE_SIZE	16
+#define ALG_NAME_MAX	64
+
+static struct {
+	char name[ALG_NAME_MAX];
+	const EVP_MD *hash_id;
+	EVP_MD_CTX *md_tmpl;
+} digest_cache[ALG_CACHE_SIZE];
+
+static struct {
+	char name[ALG_NAME_MAX];
+	const EVP_CIPHER *type;
+} cipher_cache[ALG_CACHE_SIZE];
+
+static pthread_mutex_t alg_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*
  * Compatible wrappers for OpenSSL < 1.1.0 and LibreSSL < 2.7.0
  */
@@ -137,8 +160,12 @@ int crypt_backend_init(void)
 	return 0;
 }
 
+static void alg_cache_destroy(void);
+
 void crypt_backend_destroy(void)
 {
+	argon2_destroy();
+	alg_cache_destroy();
 	crypto_backend_initialised = 0;
 }
 
@@ -176,18 +203,169 @@ static const char *crypt_hash_compat_name(const char *name)
 	return hash_name;
 }
 
+#if OPENSSL_VERSION_MAJOR >= 3
+static const EVP_MD *alg_digest_fetch(const char *name)
+{
+	return EVP_MD_fetch(NULL, name, NULL);
+}
+
+static const EVP_CIPHER *alg_cipher_fetch(const char *name)
+{
+	return EVP_CIPHER_fetch(NULL, name, NULL);
+}
+
+static void alg_digest_free(const EVP_MD *hash_id)
+{
+	EVP_MD_free(CONST_CAST(EVP_MD *)hash_id);
+}
+
+static void alg_cipher_free(const EVP_CIPHER *type)
+{
+	EVP_CIPHER_free(CONST_CAST(EVP_CIPHER *)type);
+}
+#else
+static const EVP_MD *alg_digest_fetch(const char *name)
+{
+	return EVP_get_digestbyname(name);
+}
+
+static const EVP_CIPHER *alg_cipher_fetch(const char *name)
+{
+	return EVP_get_cipherbyname(name);
+}
+
+static void alg_digest_free(const EVP_MD *hash_id __attribute__((unused)))
+{
+}
+
+static void alg_cipher_free(const EVP_CIPHER *type __attribute__((unused)))
+{
+}
+#endif
+
+static void alg_cache_destroy(void)
+{
+	int i;
+
+	pthread_mutex_lock(&alg_cache_lock);
+	for (i = 0; i < ALG_CACHE_SIZE; i++) {
+		if (digest_cache[i].md_tmpl)
+			EVP_MD_CTX_free(digest_cache[i].md_tmpl);
+		if (digest_cache[i].hash_id)
+			alg_digest_free(digest_cache[i].hash_id);
+		if (cipher_cache[i].type)
+			alg_cipher_free(cipher_cache[i].type);
+	}
+	memset(digest_cache, 0, sizeof(digest_cache));
+	memset(cipher_cache, 0, sizeof(cipher_cache));
+	pthread_mutex_unlock(&alg_cache_lock);
+}
+
+/* Returned digest (and template) is valid until crypt_backend_destroy() */
+static const EVP_MD *alg_digest_get(const char *name, const EVP_MD_CTX **md_tmpl)
+{
+	const char *hash_name = crypt_hash_compat_name(name);
+	const EVP_MD *hash_id = NULL;
+	EVP_MD_CTX *tmpl = NULL;
+	int i;
+
+	if (md_tmpl)
+		*md_tmpl = NULL;
+
+	if (!hash_name)
+		return NULL;
+
+	pthread_mutex_lock(&alg_cache_lock);
+
+	for (i = 0; i < ALG_CACHE_SIZE && digest_cache[i].hash_id; i++)
+		if (!strcmp(digest_cache[i].name, hash_name))
+			goto out;
+
+	/* Cache is full, use plain lookup (also if fetch fails) */
+	if (i == ALG_CACHE_SIZE || strlen(hash_name) >= ALG_NAME_MAX) {
+		pthread_mutex_unlock(&alg_cache_lock);
+		return EVP_get_digestbyname(hash_name);
+	}
+
+	hash_id = alg_digest_fetch(hash_name);
+	if (!hash_id) {
+		pthread_mutex_unlock(&alg_cache_lock);
+		return EVP_get_digestbyname(hash_name);
+	}
+
+	tmpl = EVP_MD_CTX_new();
+	if (tmpl && EVP_DigestInit_ex(tmpl, hash_id, NULL) != 1) {
+		EVP_MD_CTX_free(tmpl);
+		tmpl = NULL;
+	}
+
+	strcpy(digest_cache[i].name, hash_name);
+	digest_cache[i].md_tmpl = tmpl;
+	digest_cache[i].hash_id = hash_id;
+out:
+	hash_id = digest_cache[i].hash_id;
+	if (md_tmpl)
+		*md_tmpl = digest_cache[i].md_tmpl;
+	pthread_mutex_unlock(&alg_cache_lock);
+
+	return hash_id;
+}
+
+static const EVP_CIPHER *alg_cipher_get(const char *name)
+{
+	const EVP_CIPHER *type;
+	int i;
+
+	pthread_mutex_lock(&alg_cache_lock);
+
+	for (i = 0; i < ALG_CACHE_SIZE && cipher_cache[i].type; i++)
+		if (!strcmp(cipher_cache[i].name, name))
+			goto out;
+
+	if (i == ALG_CACHE_SIZE || strlen(name) >= ALG_NAME_MAX) {
+		pthread_mutex_unlock(&alg_cache_lock);
+		return EVP_get_cipherbyname(name);
+	}
+
+	type = alg_cipher_fetch(name);
+	if (!type) {
+		pthread_mutex_unlock(&alg_cache_lock);
+		return EVP_get_cipherbyname(name);
+	}
+
+	strcpy(cipher_cache[i].name, name);
+	cipher_cache[i].type = type;
+out:
+	type = cipher_cache[i].type;
+	pthread_mutex_unlock(&alg_cache_lock);
+
+	return type;
+}
+
 /* HASH */
 int crypt_hash_size(const char *name)
 {
 	const EVP_MD *hash_id;
 
-	hash_id = EVP_get_digestbyname(crypt_hash_compat_name(name));
+	hash_id = alg_digest_get(name, NULL);
 	if (!hash_id)
 		return -EINVAL;
 
 	return EVP_MD_size(hash_id);
 }
 
+static int crypt_hash_restart(struct crypt_hash *ctx)
+{
+	/* Copy of initialized template is cheaper than new digest init */
+	if (ctx->md_tmpl)
+		return EVP_MD_CTX_copy_ex(ctx->md, ctx->md_tmpl) == 1 ? 0 : -EINVAL;
+
+	if (EVP_DigestInit_ex(ctx->md, ctx->hash_id, NULL) != 1)
+		return -EINVAL;
+
+	return 0;
+}
+
 int crypt_hash_init(struct crypt_hash **ctx, const char *name)
 {
 	struct crypt_hash *h;
@@ -202,14 +380,14 @@ int crypt_hash_init(struct crypt_hash **ctx, const char *name)
 		return -ENOMEM;
 	}
 
-	h->hash_id = EVP_get_digestbyname(crypt_hash_compat_name(name));
+	h->hash_id = alg_digest_get(name, &h->md_tmpl);
 	if (!h->hash_id) {
 		EVP_MD_CTX_free(h->md);
 		free(h);
 		return -EINVAL;
 	}
 
-	if (EVP_DigestInit_ex(h->md, h->hash_id, NULL) != 1) {
+	if (crypt_hash_restart(h)) {
 		EVP_MD_CTX_free(h->md);
 		free(h);
 		return -EINVAL;
@@ -220,14 +398,6 @@ int crypt_hash_init(struct crypt_hash **ctx, const char *name)
 	return 0;
 }
 
-static int crypt_hash_restart(struct crypt_hash *ctx)
-{
-	if (EVP_DigestInit_ex(ctx->md, ctx->hash_id, NULL) != 1)
-		return -EINVAL;
-
-	return 0;
-}
-
 int crypt_hash_write(struct crypt_hash *ctx, const char *buffer, size_t length)
 {
 	if (EVP_DigestUpdate(ctx->md, buffer, length) != 1)
@@ -259,6 +429,15 @@ int crypt_hash_final(struct crypt_hash *ctx, char *buffer, size_t length)
 	return 0;
 }
 
+/* Copy (intermediate) hash state, both contexts use the same algorithm */
+int crypt_hash_copy(struct crypt_hash *dst, struct crypt_hash *src)
+{
+	if (EVP_MD_CTX_copy_ex(dst->md, src->md) != 1)
+		return -EINVAL;
+
+	return 0;
+}
+
 void crypt_hash_destroy(struct crypt_hash *ctx)
 {
 	EVP_MD_CTX_free(ctx->md);
@@ -287,7 +466,7 @@ int crypt_hmac_init(struct crypt_hmac **ctx, const char *name,
 		return -ENOMEM;
 	}
 
-	h->hash_id = EVP_get_digestbyname(crypt_hash_compat_name(name));
+	h->hash_id = alg_digest_get(name, NULL);
 	if (!h->hash_id) {
 		HMAC_CTX_free(h->md);
 		free(h);
@@ -364,7 +543,7 @@ int crypt_pbkdf(const char *kdf, const char *hash,
 		return -EINVAL;
 
 	if (!strcmp(kdf, "pbkdf2")) {
-		hash_id = EVP_get_digestbyname(crypt_hash_compat_name(hash));
+		hash_id = alg_digest_get(hash, NULL);
 		if (!hash_id)
 			return -EINVAL;
 
@@ -406,7 +585,7 @@ static int _cipher_init(EVP_CIPHER_CTX **hd_enc, EVP_CIPHER_CTX **hd_dec, const
 	if (r < 0 || r >= (int)sizeof(cipher_name))
 		return -EINVAL;
 
-	type = EVP_get_cipherbyname(cipher_name);
+	type = alg_cipher_get(cipher_name);
 	if (!type)
 		return -ENOENT;
 
@@ -539,6 +718,14 @@ bool crypt_cipher_kernel_only(struct crypt_cipher *ctx)
 	return ctx->use_kernel;
 }
 
+int crypt_cipher_zerocopy(struct crypt_cipher *ctx)
+{
+	if (!ctx->use_kernel)
+		return -ENOTSUP;
+
+	return crypt_cipher_zerocopy_kernel(&ctx->u.kernel);
+}
+
 int crypt_bitlk_decrypt_key(const void *key, size_t key_length __attribute__((unused)),
 			    const char *in, char *out, size_t length,
 			    const char *iv, size_t iv_length,
@@ -22,11 +22,22 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <strings.h>
+#include <pthread.h>
 #include "bitops.h"
 #include "crypto_backend.h"
 
 #define SECTOR_SHIFT	9
 
+/* Multi-threaded processing limits */
+#define STORAGE_THREADS_MAX	16
+#define STORAGE_STRIPE_MIN	(256 * 1024)
+
+/* Max. data submitted in one cipher call if sectors do not use IV (16 pages for AF_ALG) */
+#define STORAGE_BATCH_MAX	(64 * 1024)
+
+/* Max. IVs generated at once (sectors in one batch) */
+#define STORAGE_IV_BATCH	(STORAGE_BATCH_MAX >> SECTOR_SHIFT)
+
 /*
  * Internal IV helper
  * IV documentation: https://gitlab.com/cryptsetup/cryptsetup/wikis/DMCrypt
@@ -39,12 +50,42 @@ struct crypt_sector_iv {
 	int shift;
 };
 
+#define XTS_BLOCK_SIZE		16
+
+/*
+ * XTS with computed tweaks, many sectors are processed in one ECB call
+ * (for kernel AF_ALG ciphers XTS otherwise needs a syscall per sector).
+ */
+struct crypt_storage_xts {
+	struct crypt_cipher *data;	/* ECB, first half of the key */
+	struct crypt_cipher *tweak;	/* ECB, second half of the key */
+	char *tweaks;			/* tweak of each block in batch */
+};
+
+/* Independent cipher and IV context, one per worker thread */
+struct crypt_storage_lane {
+	struct crypt_cipher *cipher;
+	struct crypt_sector_iv cipher_iv;
+	struct crypt_storage_xts xts;
+};
+
 /* Block encryption storage context */
 struct crypt_storage {
 	size_t sector_size;
 	unsigned iv_shift;
-	struct crypt_cipher *cipher;
-	struct crypt_sector_iv cipher_iv;
+	unsigned lanes_count;
+	struct crypt_storage_lane lanes[];
+};
+
+struct crypt_storage_job {
+	struct crypt_storage *ctx;
+	struct crypt_storage_lane *lane;
+	uint64_t iv_offset;
+	uint64_t length;
+	char *buffer;
+	bool encrypt;
+	int r;
+	pthread_t thread;
 };
 
 static int int_log2(unsigned int x)
@@ -142,56 +183,69 @@ static int crypt_sector_iv_init(struct crypt_sector_iv *ctx,
 	} else
 		return -ENOENT;
 
-	ctx->iv = malloc(ctx->iv_size);
+	/* IV array for the whole batch, the first IV is used for a single sector */
+	ctx->iv = malloc(ctx->iv_size * STORAGE_IV_BATCH);
 	if (!ctx->iv)
 		return -ENOMEM;
 
 	return 0;
 }
 
-static int crypt_sector_iv_generate(struct crypt_sector_iv *ctx, uint64_t sector)
+/*
+ * Generate IVs for count sectors starting with sector, each following sector
+ * number is increased by step. IVs are stored in ivs array (count * iv_size).
+ * Encrypted IVs (ESSIV, EBOIV) are processed in one ECB cipher call.
+ */
+static int crypt_sector_iv_generate_bulk(struct crypt_sector_iv *ctx, uint64_t sector,
+					 uint64_t step, size_t count, char *ivs)
 {
 	uint64_t val;
+	uint32_t val32;
+	size_t i;
+	char *iv;
+
+	if (ctx->type == IV_NONE)
+		return 0;
 
-	switch (ctx->type) {
-	case IV_NONE:
-		break;
-	case IV_NULL:
-		memset(ctx->iv, 0, ctx->iv_size);
-		break;
-	case IV_PLAIN:
-		memset(ctx->iv, 0, ctx->iv_size);
-		*(uint32_t *)ctx->iv = cpu_to_le32(sector & 0xffffffff);
-		break;
-	case IV_PLAIN64:
-		memset(ctx->iv, 0, ctx->iv_size);
-		*(uint64_t *)ctx->iv = cpu_to_le64(sector);
-		break;
-	case IV_PLAIN64BE:
-		memset(ctx->iv, 0, ctx->iv_size);
-		*(uint64_t *)&ctx->iv[ctx->iv_size - sizeof(uint64_t)] = cpu_to_be64(sector);
-		break;
-	case IV_ESSIV:
-		memset(ctx->iv, 0, ctx->iv_size);
-		*(uint64_t *)ctx->iv = cpu_to_le64(sector);
-		return crypt_cipher_encrypt(ctx->cipher,
-			ctx->iv, ctx->iv, ctx->iv_size, NULL, 0);
-		break;
-	case IV_BENBI:
-		memset(ctx->iv, 0, ctx->iv_size);
-		val = cpu_to_be64((sector << ctx->shift) + 1);
-		memcpy(ctx->iv + ctx->iv_size - sizeof(val), &val, sizeof(val));
-		break;
-	case IV_EBOIV:
-		memset(ctx->iv, 0, ctx->iv_size);
-		*(uint64_t *)ctx->iv = cpu_to_le64(sector << ctx->shift);
-		return crypt_cipher_encrypt(ctx->cipher,
-			ctx->iv, ctx->iv, ctx->iv_size, NULL, 0);
-		break;
-	default:
+	if (count > STORAGE_IV_BATCH)
 		return -EINVAL;
+
+	memset(ivs, 0, count * ctx->iv_size);
+
+	for (i = 0, iv = ivs; i < count; i++, iv += ctx->iv_size, sector += step) {
+		switch (ctx->type) {
+		case IV_NULL:
+			break;
+		case IV_PLAIN:
+			val32 = cpu_to_le32(sector & 0xffffffff);
+			memcpy(iv, &val32, sizeof(val32));
+			break;
+		case IV_PLAIN64:
+		case IV_ESSIV:
+			val = cpu_to_le64(sector);
+			memcpy(iv, &val, sizeof(val));
+			break;
+		case IV_PLAIN64BE:
+			val = cpu_to_be64(sector);
+			memcpy(iv + ctx->iv_size - sizeof(val), &val, sizeof(val));
+			break;
+		case IV_BENBI:
+			val = cpu_to_be64((sector << ctx->shift) + 1);
+			memcpy(iv + ctx->iv_size - sizeof(val), &val, sizeof(val));
+			break;
+		case IV_EBOIV:
+			val = cpu_to_le64(sector << ctx->shift);
+			memcpy(iv, &val, sizeof(val));
+			break;
+		default:
+			return -EINVAL;
+		}
 	}
 
+	if (ctx->type == IV_ESSIV || ctx->type == IV_EBOIV)
+		return crypt_cipher_encrypt(ctx->cipher, ivs, ivs,
+					    count * ctx->iv_size, NULL, 0);
+
 	return 0;
 }
 
@@ -201,25 +255,147 @@ static void crypt_sector_iv_destroy(struct crypt_sector_iv *ctx)
 		crypt_cipher_destroy(ctx->cipher);
 
 	if (ctx->iv) {
-		memset(ctx->iv, 0, ctx->iv_size);
+		memset(ctx->iv, 0, ctx->iv_size * STORAGE_IV_BATCH);
 		free(ctx->iv);
 	}
 
 	memset(ctx, 0, sizeof(*ctx));
 }
 
+static void crypt_storage_xts_destroy(struct crypt_storage_xts *xts)
+{
+	if (xts->data)
+		crypt_cipher_destroy(xts->data);
+	if (xts->tweak)
+		crypt_cipher_destroy(xts->tweak);
+	if (xts->tweaks) {
+		crypt_backend_memzero(xts->tweaks, STORAGE_BATCH_MAX);
+		free(xts->tweaks);
+	}
+
+	memset(xts, 0, sizeof(*xts));
+}
+
+/*
+ * Batched XTS is used only with plain64 IV if the XTS cipher itself
+ * is available only as a kernel cipher, userspace XTS is already fast.
+ */
+static void crypt_storage_xts_init(struct crypt_storage_lane *lane,
+			 const char *cipher_name, const char *mode_name,
+			 const void *key, size_t key_length)
+{
+	struct crypt_storage_xts *xts = &lane->xts;
+	size_t half = key_length / 2;
+
+	if (strcmp(mode_name, "xts") || lane->cipher_iv.type != IV_PLAIN64 ||
+	    lane->cipher_iv.iv_size != XTS_BLOCK_SIZE || (key_length & 1) ||
+	    !crypt_cipher_kernel_only(lane->cipher))
+		return;
+
+	if (crypt_cipher_init(&xts->data, cipher_name, "ecb", key, half) ||
+	    crypt_cipher_init(&xts->tweak, cipher_name, "ecb", (const char *)key + half, half) ||
+	    !(xts->tweaks = malloc(STORAGE_BATCH_MAX)))
+		crypt_storage_xts_destroy(xts);
+}
+
+/* Multiply tweak by primitive element (x) in GF(2^128), little-endian as in IEEE 1619 */
+static void xts_mul_alpha(uint64_t t[2])
+{
+	uint64_t carry = t[1] >> 63;
+
+	t[1] = (t[1] << 1) | (t[0] >> 63);
+	t[0] = (t[0] << 1) ^ (carry * 0x87);
+}
+
+static void xts_xor(char *buffer, const char *tweaks, size_t length)
+{
+	uint64_t a, b;
+	size_t i;
+
+	for (i = 0; i < length; i += sizeof(a)) {
+		memcpy(&a, &buffer[i], sizeof(a));
+		memcpy(&b, &tweaks[i], sizeof(b));
+		a ^= b;
+		memcpy(&buffer[i], &a, sizeof(a));
+	}
+}
+
+static int crypt_storage_xts_crypt(struct crypt_storage *ctx,
+		       struct crypt_storage_lane *lane,
+		       uint64_t iv_offset,
+		       uint64_t length, char *buffer, bool encrypt)
+{
+	struct crypt_storage_xts *xts = &lane->xts;
+	uint64_t i, j, k, step, iv_step, t[2], le[2];
+	size_t sectors;
+	int r = 0;
+
+	step = STORAGE_BATCH_MAX - (STORAGE_BATCH_MAX % ctx->sector_size);
+	iv_step = (ctx->sector_size >> SECTOR_SHIFT) >> ctx->iv_shift;
+
+	for (i = 0; i < length && !r; i += step) {
+		if (step > length - i)
+			step = length - i;
+		sectors = step / ctx->sector_size;
+
+		/* plain64 IV of all sectors encrypted at once */
+		r = crypt_sector_iv_generate_bulk(&lane->cipher_iv,
+						  (iv_offset + (i >> SECTOR_SHIFT)) >> ctx->iv_shift,
+						  iv_step, sectors, lane->cipher_iv.iv);
+		if (!r)
+			r = crypt_cipher_encrypt(xts->tweak, lane->cipher_iv.iv, lane->cipher_iv.iv,
+						 sectors * XTS_BLOCK_SIZE, NULL, 0);
+		if (r)
+			break;
+
+		for (j = 0; j < sectors; j++) {
+			memcpy(t, &lane->cipher_iv.iv[j * XTS_BLOCK_SIZE], sizeof(t));
+			t[0] = le64_to_cpu(t[0]);
+			t[1] = le64_to_cpu(t[1]);
+			for (k = j * ctx->sector_size; k < (j + 1) * ctx->sector_size; k += XTS_BLOCK_SIZE) {
+				le[0] = cpu_to_le64(t[0]);
+				le[1] = cpu_to_le64(t[1]);
+				memcpy(&xts->tweaks[k], le, sizeof(le));
+				xts_mul_alpha(t);
+			}
+		}
+
+		xts_xor(&buffer[i], xts->tweaks, step);
+		if (encrypt)
+			r = crypt_cipher_encrypt(xts->data, &buffer[i], &buffer[i], step, NULL, 0);
+		else
+			r = crypt_cipher_decrypt(xts->data, &buffer[i], &buffer[i], step, NULL, 0);
+		xts_xor(&buffer[i], xts->tweaks, step);
+	}
+
+	crypt_backend_memzero(t, sizeof(t));
+	crypt_backend_memzero(le, sizeof(le));
+	return r;
+}
+
 /* Block encryption storage wrappers */
 
-int crypt_storage_init(struct crypt_storage **ctx,
+static void crypt_storage_lane_destroy(struct crypt_storage_lane *lane)
+{
+	crypt_storage_xts_destroy(&lane->xts);
+	crypt_sector_iv_destroy(&lane->cipher_iv);
+
+	if (lane->cipher)
+		crypt_cipher_destroy(lane->cipher);
+	lane->cipher = NULL;
+}
+
+int crypt_storage_init_threads(struct crypt_storage **ctx,
 		       size_t sector_size,
 		       const char *cipher,
 		       const char *cipher_mode,
 		       const void *key, size_t key_length,
-		       bool large_iv)
+		       bool large_iv, unsigned threads)
 {
 	struct crypt_storage *s;
 	char mode_name[64];
 	char *cipher_iv = NULL;
+	unsigned i;
 	int r = -EIO;
 
 	if (sector_size < (1 << SECTOR_SHIFT) ||
@@ -227,10 +403,15 @@ int crypt_storage_init(struct crypt_storage **ctx,
 	    sector_size & (sector_size - 1))
 		return -EINVAL;
 
-	s = malloc(sizeof(*s));
+	if (!threads)
+		threads = 1;
+	if (threads > STORAGE_THREADS_MAX)
+		threads = STORAGE_THREADS_MAX;
+
+	s = malloc(sizeof(*s) + threads * sizeof(*s->lanes));
 	if (!s)
 		return -ENOMEM;
-	memset(s, 0, sizeof(*s));
+	memset(s, 0, sizeof(*s) + threads * sizeof(*s->lanes));
 
 	/* Remove IV if present */
 	strncpy(mode_name, cipher_mode, sizeof(mode_name));
@@ -241,14 +422,23 @@ int crypt_storage_init(struct crypt_storage **ctx,
 		cipher_iv++;
 	}
 
-	r = crypt_cipher_init(&s->cipher, cipher, mode_name, key, key_length);
-	if (r) {
-		crypt_storage_destroy(s);
-		return r;
+	for (i = 0; i < threads; i++) {
+		r = crypt_cipher_init(&s->lanes[i].cipher, cipher, mode_name, key, key_length);
+		if (r)
+			break;
+
+		r = crypt_sector_iv_init(&s->lanes[i].cipher_iv, cipher, mode_name, cipher_iv, key, key_length, sector_size);
+		if (r) {
+			crypt_storage_lane_destroy(&s->lanes[i]);
+			break;
+		}
+		/* optional, regular per-sector processing is used otherwise */
+		crypt_storage_xts_init(&s->lanes[i], cipher, mode_name, key, key_length);
+		s->lanes_count++;
 	}
 
-	r = crypt_sector_iv_init(&s->cipher_iv, cipher, mode_name, cipher_iv, key, key_length, sector_size);
-	if (r) {
+	/* Additional lanes are optional (e.g. limited number of kernel sockets) */
+	if (!s->lanes_count) {
 		crypt_storage_destroy(s);
 		return r;
 	}
@@ -260,41 +450,94 @@ int crypt_storage_init(struct crypt_storage **ctx,
 	return 0;
 }
 
-int crypt_storage_decrypt(struct crypt_storage *ctx,
+int crypt_storage_init(struct crypt_storage **ctx,
+		       size_t sector_size,
+		       const char *cipher,
+		       const char *cipher_mode,
+		       const void *key, size_t key_length,
+		       bool large_iv)
+{
+	return crypt_storage_init_threads(ctx, sector_size, cipher, cipher_mode,
+					  key, key_length, large_iv, 1);
+}
+
+static int crypt_storage_lane_crypt(struct crypt_storage *ctx,
+		       struct crypt_storage_lane *lane,
 		       uint64_t iv_offset,
-		       uint64_t length, char *buffer)
+		       uint64_t length, char *buffer, bool encrypt)
 {
-	uint64_t i;
+	uint64_t i, j, step, iv_step, sectors;
+	char *iv;
 	int r = 0;
 
-	if (length & (ctx->sector_size - 1))
-		return -EINVAL;
-
-	if (iv_offset & ((ctx->sector_size >> SECTOR_SHIFT) - 1))
-		return -EINVAL;
+	if (lane->xts.data)
+		return crypt_storage_xts_crypt(ctx, lane, iv_offset, length, buffer, encrypt);
+
+	/*
+	 * Without IV all sectors are processed the same way, so many sectors
+	 * can be submitted at once (saves syscalls for kernel AF_ALG ciphers).
+	 * Otherwise IVs are generated for the whole batch of sectors at once.
+	 */
+	step = STORAGE_BATCH_MAX - (STORAGE_BATCH_MAX % ctx->sector_size);
+	iv_step = (ctx->sector_size >> SECTOR_SHIFT) >> ctx->iv_shift;
+
+	for (i = 0; i < length && !r; i += step) {
+		if (step > length - i)
+			step = length - i;
+
+		if (lane->cipher_iv.type == IV_NONE) {
+			if (encrypt)
+				r = crypt_cipher_encrypt(lane->cipher, &buffer[i], &buffer[i],
+							 step, NULL, 0);
+			else
+				r = crypt_cipher_decrypt(lane->cipher, &buffer[i], &buffer[i],
+							 step, NULL, 0);
+			continue;
+		}
 
-	for (i = 0; i < length; i += ctx->sector_size) {
-		r = crypt_sector_iv_generate(&ctx->cipher_iv, (iv_offset + (i >> SECTOR_SHIFT)) >> ctx->iv_shift);
-		if (r)
-			break;
-		r = crypt_cipher_decrypt(ctx->cipher,
-					 &buffer[i],
-					 &buffer[i],
-					 ctx->sector_size,
-					 ctx->cipher_iv.iv,
-					 ctx->cipher_iv.iv_size);
-		if (r)
-			break;
+		sectors = step / ctx->sector_size;
+		r = crypt_sector_iv_generate_bulk(&lane->cipher_iv,
+						  (iv_offset + (i >> SECTOR_SHIFT)) >> ctx->iv_shift,
+						  iv_step, sectors, lane->cipher_iv.iv);
+
+		for (j = 0, iv = lane->cipher_iv.iv; j < sectors && !r; j++, iv += lane->cipher_iv.iv_size) {
+			if (encrypt)
+				r = crypt_cipher_encrypt(lane->cipher,
+							 &buffer[i + j * ctx->sector_size],
+							 &buffer[i + j * ctx->sector_size],
+							 ctx->sector_size,
+							 iv,
+							 lane->cipher_iv.iv_size);
+			else
+				r = crypt_cipher_decrypt(lane->cipher,
+							 &buffer[i + j * ctx->sector_size],
+							 &buffer[i + j * ctx->sector_size],
+							 ctx->sector_size,
+							 iv,
+							 lane->cipher_iv.iv_size);
+		}
 	}
 
 	return r;
 }
 
-int crypt_storage_encrypt(struct crypt_storage *ctx,
+static void *crypt_storage_job_run(void *arg)
+{
+	struct crypt_storage_job *job = arg;
+
+	job->r = crypt_storage_lane_crypt(job->ctx, job->lane, job->iv_offset,
+					  job->length, job->buffer, job->encrypt);
+	return NULL;
+}
+
+static int crypt_storage_crypt(struct crypt_storage *ctx,
 		       uint64_t iv_offset,
-		       uint64_t length, char *buffer)
+		       uint64_t length, char *buffer, bool encrypt)
 {
-	uint64_t i;
+	struct crypt_storage_job jobs[STORAGE_THREADS_MAX];
+	bool started[STORAGE_THREADS_MAX] = {};
+	uint64_t sectors, stripe, offset;
+	unsigned i, jobs_count;
 	int r = 0;
 
 	if (length & (ctx->sector_size - 1))
@@ -303,32 +546,70 @@ int crypt_storage_encrypt(struct crypt_storage *ctx,
 	if (iv_offset & ((ctx->sector_size >> SECTOR_SHIFT) - 1))
 		return -EINVAL;
 
-	for (i = 0; i < length; i += ctx->sector_size) {
-		r = crypt_sector_iv_generate(&ctx->cipher_iv, (iv_offset + (i >> SECTOR_SHIFT)) >> ctx->iv_shift);
-		if (r)
-			break;
-		r = crypt_cipher_encrypt(ctx->cipher,
-					 &buffer[i],
-					 &buffer[i],
-					 ctx->sector_size,
-					 ctx->cipher_iv.iv,
-					 ctx->cipher_iv.iv_size);
-		if (r)
-			break;
+	jobs_count = length / STORAGE_STRIPE_MIN;
+	if (jobs_count > ctx->lanes_count)
+		jobs_count = ctx->lanes_count;
+
+	if (jobs_count < 2)
+		return crypt_storage_lane_crypt(ctx, &ctx->lanes[0], iv_offset, length, buffer, encrypt);
+
+	/* Split buffer to stripes aligned to sector size, each sector is independent */
+	sectors = length / ctx->sector_size;
+	stripe = ((sectors + jobs_count - 1) / jobs_count) * ctx->sector_size;
+
+	for (i = 0, offset = 0; i < jobs_count && offset < length; i++, offset += stripe) {
+		jobs[i].ctx = ctx;
+		jobs[i].lane = &ctx->lanes[i];
+		jobs[i].iv_offset = iv_offset + (offset >> SECTOR_SHIFT);
+		jobs[i].length = (length - offset) < stripe ? (length - offset) : stripe;
+		jobs[i].buffer = &buffer[offset];
+		jobs[i].encrypt = encrypt;
+		jobs[i].r = 0;
+	}
+	jobs_count = i;
+
+	/* The first stripe is processed by the calling thread */
+	for (i = 1; i < jobs_count; i++)
+		started[i] = !pthread_create(&jobs[i].thread, NULL, crypt_storage_job_run, &jobs[i]);
+
+	crypt_storage_job_run(&jobs[0]);
+
+	for (i = 1; i < jobs_count; i++) {
+		if (started[i])
+			pthread_join(jobs[i].thread, NULL);
+		else
+			crypt_storage_job_run(&jobs[i]);
 	}
 
+	for (i = 0; i < jobs_count && !r; i++)
+		r = jobs[i].r;
+
 	return r;
 }
 
+int crypt_storage_decrypt(struct crypt_storage *ctx,
+		       uint64_t iv_offset,
+		       uint64_t length, char *buffer)
+{
+	return crypt_storage_crypt(ctx, iv_offset, length, buffer, false);
+}
+
+int crypt_storage_encrypt(struct crypt_storage *ctx,
+		       uint64_t iv_offset,
+		       uint64_t length, char *buffer)
+{
+	return crypt_storage_crypt(ctx, iv_offset, length, buffer, true);
+}
+
 void crypt_storage_destroy(struct crypt_storage *ctx)
 {
+	unsigned i;
+
 	if (!ctx)
 		return;
 
-	crypt_sector_iv_destroy(&ctx->cipher_iv);
-
-	if (ctx->cipher)
-		crypt_cipher_destroy(ctx->cipher);
+	for (i = 0; i < ctx->lanes_count; i++)
+		crypt_storage_lane_destroy(&ctx->lanes[i]);
 
 	memset(ctx, 0, sizeof(*ctx));
 	free(ctx);
@@ -336,5 +617,20 @@ void crypt_storage_destroy(struct crypt_storage *ctx)
 
 bool crypt_storage_kernel_only(struct crypt_storage *ctx)
 {
-	return crypt_cipher_kernel_only(ctx->cipher);
+	return crypt_cipher_kernel_only(ctx->lanes[0].cipher);
+}
+
+/* Opt-in zero-copy submission for kernel (AF_ALG) ciphers, page aligned buffers only */
+int crypt_storage_zerocopy(struct crypt_storage *ctx)
+{
+	unsigned i;
+	int r = 0;
+
+	for (i = 0; i < ctx->lanes_count && !r; i++) {
+		r = crypt_cipher_zerocopy(ctx->lanes[i].cipher);
+		if (!r && ctx->lanes[i].xts.data)
+			r = crypt_cipher_zerocopy(ctx->lanes[i].xts.data);
+	}
+
+	return r;
 }
@@ -0,0 +1,71 @@
+/*
+ * Generic hash utilities
+ *
+ * Copyright (C) 2021 Red Hat, Inc. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this file; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include "crypto_backend_internal.h"
+
+/*
+ * Hash count blocks of block_size bytes, each with optional prefix and suffix
+ * (e.g. salt). Digests are stored with digest_stride distance in output.
+ *
+ * The library hash implementations are usually fast for one stream
+ * (SHA extensions), only kernel crypto API has significant overhead per call,
+ * then multiple blocks are hashed at once in SIMD lanes (if supported).
+ * Otherwise one hash context is reused for all blocks.
+ */
+int crypt_hash_blocks(const char *name,
+		      const char *prefix, size_t prefix_len,
+		      const char *suffix, size_t suffix_len,
+		      const char *blocks, size_t block_size, size_t count,
+		      char *digests, size_t digest_stride, size_t digest_size)
+{
+	struct crypt_hash *h;
+	size_t i;
+	int r;
+
+	if (digest_stride < digest_size)
+		return -EINVAL;
+
+#if USE_INTERNAL_PBKDF2
+	if (crypt_backend_flags() & CRYPT_BACKEND_KERNEL) {
+		r = crypt_hash_vec_blocks(name, prefix, prefix_len, suffix, suffix_len,
+					  blocks, block_size, count,
+					  digests, digest_stride, digest_size);
+		if (r != -ENOTSUP)
+			return r;
+	}
+#endif
+	if (crypt_hash_init(&h, name))
+		return -EINVAL;
+
+	for (r = 0, i = 0; i < count && !r; i++) {
+		if (prefix_len)
+			r = crypt_hash_write(h, prefix, prefix_len);
+		if (!r)
+			r = crypt_hash_write(h, blocks + i * block_size, block_size);
+		if (!r && suffix_len)
+			r = crypt_hash_write(h, suffix, suffix_len);
+		if (!r)
+			r = crypt_hash_final(h, digests + i * digest_stride, digest_size);
+	}
+
+	crypt_hash_destroy(h);
+	return r;
+}
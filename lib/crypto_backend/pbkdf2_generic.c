@@ -24,6 +24,7 @@
  */
 
 #include <errno.h>
+#include <stdlib.h>
 #include <alloca.h>
 #include "crypto_backend_internal.h"
 
@@ -82,6 +83,587 @@ static int hash_buf(const char *src, size_t src_len,
 
 #define MAX_PRF_BLOCK_LEN 80
 
+#if defined(__GNUC__)
+/*
+ * PBKDF2-HMAC computing PBKDF2_LANES output blocks at once, one per
+ * SIMD vector lane (GCC vector extension, SSE2/NEON/...) for SHA-1,
+ * SHA-256 and SHA-512. HMAC ipad/opad states are computed once and every
+ * iteration then costs exactly two compression function calls.
+ */
+#define PBKDF2_LANES 4
+
+typedef uint32_t vec32 __attribute__((vector_size(PBKDF2_LANES * sizeof(uint32_t))));
+typedef uint64_t vec64 __attribute__((vector_size(PBKDF2_LANES * sizeof(uint64_t))));
+
+#define V32(x) ((vec32){ (x), (x), (x), (x) })
+#define V64(x) ((vec64){ (x), (x), (x), (x) })
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROTR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+static const uint32_t sha1_iv[5] = {
+	0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint64_t sha512_k[80] = {
+	0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+	0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+	0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+	0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+	0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+	0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+	0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+	0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+	0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+	0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+	0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+	0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+	0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+	0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+	0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+	0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+	0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+	0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+	0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+	0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+static const uint64_t sha512_iv[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static void sha1_vec_compress(vec32 st[8], const vec32 in[16])
+{
+	vec32 w[80], a, b, c, d, e, f, t;
+	uint32_t k;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = in[i];
+	for (; i < 80; i++)
+		w[i] = ROTL32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	a = st[0]; b = st[1]; c = st[2]; d = st[3]; e = st[4];
+
+	for (i = 0; i < 80; i++) {
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+		t = ROTL32(a, 5) + f + e + V32(k) + w[i];
+		e = d; d = c; c = ROTL32(b, 30); b = a; a = t;
+	}
+
+	st[0] += a; st[1] += b; st[2] += c; st[3] += d; st[4] += e;
+
+	crypt_backend_memzero(w, sizeof(w));
+}
+
+static void sha256_vec_compress(vec32 st[8], const vec32 in[16])
+{
+	vec32 w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = in[i];
+	for (; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7] +
+		       (ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+		       (ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+	a = st[0]; b = st[1]; c = st[2]; d = st[3];
+	e = st[4]; f = st[5]; g = st[6]; h = st[7];
+
+	for (i = 0; i < 64; i++) {
+		t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) +
+		     ((e & f) ^ (~e & g)) + V32(sha256_k[i]) + w[i];
+		t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) +
+		     ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	st[0] += a; st[1] += b; st[2] += c; st[3] += d;
+	st[4] += e; st[5] += f; st[6] += g; st[7] += h;
+
+	crypt_backend_memzero(w, sizeof(w));
+}
+
+static void sha512_vec_compress(vec64 st[8], const vec64 in[16])
+{
+	vec64 w[80], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = in[i];
+	for (; i < 80; i++)
+		w[i] = w[i - 16] + w[i - 7] +
+		       (ROTR64(w[i - 15], 1) ^ ROTR64(w[i - 15], 8) ^ (w[i - 15] >> 7)) +
+		       (ROTR64(w[i - 2], 19) ^ ROTR64(w[i - 2], 61) ^ (w[i - 2] >> 6));
+
+	a = st[0]; b = st[1]; c = st[2]; d = st[3];
+	e = st[4]; f = st[5]; g = st[6]; h = st[7];
+
+	for (i = 0; i < 80; i++) {
+		t1 = h + (ROTR64(e, 14) ^ ROTR64(e, 18) ^ ROTR64(e, 41)) +
+		     ((e & f) ^ (~e & g)) + V64(sha512_k[i]) + w[i];
+		t2 = (ROTR64(a, 28) ^ ROTR64(a, 34) ^ ROTR64(a, 39)) +
+		     ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	st[0] += a; st[1] += b; st[2] += c; st[3] += d;
+	st[4] += e; st[5] += f; st[6] += g; st[7] += h;
+
+	crypt_backend_memzero(w, sizeof(w));
+}
+
+struct pbkdf2_vec_hash {
+	const char *name;
+	unsigned int words;		/* digest words */
+	unsigned int word_size;		/* 4 or 8 bytes */
+	const void *iv;
+	void (*compress32)(vec32 st[8], const vec32 in[16]);
+	void (*compress64)(vec64 st[8], const vec64 in[16]);
+};
+
+static const struct pbkdf2_vec_hash pbkdf2_vec_hashes[] = {
+	{ "sha1",   5, 4, sha1_iv,   sha1_vec_compress,   NULL },
+	{ "sha256", 8, 4, sha256_iv, sha256_vec_compress, NULL },
+	{ "sha512", 8, 8, sha512_iv, NULL, sha512_vec_compress },
+	{ NULL,     0, 0, NULL,      NULL, NULL }
+};
+
+/*
+ * Vector state for both word sizes, per-lane words are accessed
+ * through lane_get()/lane_set() to share the PBKDF2 driver code.
+ */
+union vec_state {
+	vec32 v32[16];
+	vec64 v64[16];
+};
+
+#define VEC_SIZE(h) ((h)->word_size == 4 ? sizeof(vec32) : sizeof(vec64))
+#define VEC_WORDS_SIZE(h) ((h)->words * VEC_SIZE(h))
+#define VEC_STATE_SIZE(h) (8 * VEC_SIZE(h))
+
+static uint64_t lane_get(const struct pbkdf2_vec_hash *h, const union vec_state *s,
+			 unsigned int word, unsigned int lane)
+{
+	return h->word_size == 4 ? s->v32[word][lane] : s->v64[word][lane];
+}
+
+static void lane_set(const struct pbkdf2_vec_hash *h, union vec_state *s,
+		     unsigned int word, unsigned int lane, uint64_t value)
+{
+	if (h->word_size == 4)
+		s->v32[word][lane] = (uint32_t)value;
+	else
+		s->v64[word][lane] = value;
+}
+
+static void vec_splat(const struct pbkdf2_vec_hash *h, union vec_state *s,
+		      unsigned int word, uint64_t value)
+{
+	if (h->word_size == 4)
+		s->v32[word] = V32((uint32_t)value);
+	else
+		s->v64[word] = V64(value);
+}
+
+static void vec_init(const struct pbkdf2_vec_hash *h, union vec_state *st)
+{
+	unsigned int i;
+
+	/* IV has only h->words words (5 for sha1), unused state words are zeroed */
+	for (i = 0; i < 8; i++)
+		vec_splat(h, st, i, i >= h->words ? 0 : h->word_size == 4 ?
+			  ((const uint32_t *)h->iv)[i] : ((const uint64_t *)h->iv)[i]);
+}
+
+static void vec_compress(const struct pbkdf2_vec_hash *h, union vec_state *st,
+			 const union vec_state *w)
+{
+	if (h->word_size == 4)
+		h->compress32(st->v32, w->v32);
+	else
+		h->compress64(st->v64, w->v64);
+}
+
+static uint64_t be_word(const uint8_t *p, unsigned int size)
+{
+	uint64_t v = 0;
+	unsigned int i;
+
+	for (i = 0; i < size; i++)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+/* Load one message block per lane */
+static void vec_load(const struct pbkdf2_vec_hash *h, union vec_state *w,
+		     const uint8_t *msg[PBKDF2_LANES], size_t off)
+{
+	unsigned int j, l;
+
+	for (j = 0; j < 16; j++)
+		for (l = 0; l < PBKDF2_LANES; l++)
+			lane_set(h, w, j, l, be_word(msg[l] + off + j * h->word_size, h->word_size));
+}
+
+/*
+ * Finish hash of equal-length messages (one per lane), the state
+ * has already absorbed prefix_len bytes (multiple of block size).
+ */
+static void vec_final(const struct pbkdf2_vec_hash *h, union vec_state *st,
+		      const uint8_t *msg[PBKDF2_LANES], size_t len, uint64_t prefix_len)
+{
+	uint8_t tail_buf[PBKDF2_LANES][2 * 128];
+	const uint8_t *tail[PBKDF2_LANES];
+	union vec_state w;
+	size_t block = 16 * h->word_size, off, tail_len, l, k;
+	uint64_t bits = (prefix_len + len) * 8;
+
+	for (off = 0; off + block <= len; off += block) {
+		vec_load(h, &w, msg, off);
+		vec_compress(h, st, &w);
+	}
+
+	/* padding, length field is 2 words */
+	tail_len = (len - off + 1 + 2 * h->word_size > block) ? 2 * block : block;
+	for (l = 0; l < PBKDF2_LANES; l++) {
+		memset(tail_buf[l], 0, tail_len);
+		memcpy(tail_buf[l], msg[l] + off, len - off);
+		tail_buf[l][len - off] = 0x80;
+		for (k = 0; k < 8; k++)
+			tail_buf[l][tail_len - 1 - k] = (uint8_t)(bits >> (8 * k));
+		tail[l] = tail_buf[l];
+	}
+
+	for (off = 0; off < tail_len; off += block) {
+		vec_load(h, &w, tail, off);
+		vec_compress(h, st, &w);
+	}
+
+	crypt_backend_memzero(tail_buf, sizeof(tail_buf));
+	crypt_backend_memzero(&w, sizeof(w));
+}
+
+static int pbkdf2_vec(const struct pbkdf2_vec_hash *h,
+		      const char *P, size_t Plen,
+		      const char *S, size_t Slen,
+		      unsigned int c, unsigned int dkLen, char *DK)
+{
+	union vec_state ipad, opad, st, U, T, w;
+	uint8_t key[128];
+	const uint8_t *msg[PBKDF2_LANES];
+	uint8_t *salt;
+	uint64_t word;
+	size_t block = 16 * h->word_size, hLen = h->words * h->word_size;
+	unsigned int i, u, l, j, blocks, out;
+
+	salt = malloc(PBKDF2_LANES * (Slen + 4));
+	if (!salt)
+		return -ENOMEM;
+
+	/* HMAC key, hashed if longer than block */
+	memset(key, 0, sizeof(key));
+	if (Plen > block) {
+		for (l = 0; l < PBKDF2_LANES; l++)
+			msg[l] = (const uint8_t *)P;
+		vec_init(h, &st);
+		vec_final(h, &st, msg, Plen, 0);
+		for (j = 0; j < h->words; j++)
+			for (i = 0; i < h->word_size; i++)
+				key[j * h->word_size + i] =
+					(uint8_t)(lane_get(h, &st, j, 0) >> (8 * (h->word_size - 1 - i)));
+	} else
+		memcpy(key, P, Plen);
+
+	/* precomputed HMAC inner and outer keyed states */
+	for (j = 0; j < 16; j++)
+		vec_splat(h, &w, j, be_word(key + j * h->word_size, h->word_size) ^
+			  (0x3636363636363636ULL >> (64 - 8 * h->word_size)));
+	vec_init(h, &ipad);
+	vec_compress(h, &ipad, &w);
+
+	for (j = 0; j < 16; j++)
+		vec_splat(h, &w, j, be_word(key + j * h->word_size, h->word_size) ^
+			  (0x5c5c5c5c5c5c5c5cULL >> (64 - 8 * h->word_size)));
+	vec_init(h, &opad);
+	vec_compress(h, &opad, &w);
+
+	blocks = (dkLen + hLen - 1) / hLen;
+
+	for (i = 1; i <= blocks; i += PBKDF2_LANES) {
+		/* U_1 = PRF(P, S || INT(i)), lane l computes block i + l */
+		for (l = 0; l < PBKDF2_LANES; l++) {
+			uint8_t *p = salt + l * (Slen + 4);
+			uint32_t idx = i + l;
+
+			memcpy(p, S, Slen);
+			p[Slen + 0] = (idx >> 24) & 0xff;
+			p[Slen + 1] = (idx >> 16) & 0xff;
+			p[Slen + 2] = (idx >> 8) & 0xff;
+			p[Slen + 3] = idx & 0xff;
+			msg[l] = p;
+		}
+		st = ipad;
+		vec_final(h, &st, msg, Slen + 4, block);
+
+		/* outer message is digest with fixed padding */
+		for (j = h->words; j < 16; j++)
+			vec_splat(h, &w, j, 0);
+		vec_splat(h, &w, h->words, 0x8000000000000000ULL >> (64 - 8 * h->word_size));
+		vec_splat(h, &w, 15, (block + hLen) * 8);
+
+		memcpy(&w, &st, VEC_WORDS_SIZE(h));
+		U = opad;
+		vec_compress(h, &U, &w);
+		T = U;
+
+		/* U_n = PRF(P, U_{n-1}), the padding words stay in place */
+		for (u = 2; u <= c; u++) {
+			memcpy(&w, &U, VEC_WORDS_SIZE(h));
+			memcpy(&st, &ipad, VEC_STATE_SIZE(h));
+			vec_compress(h, &st, &w);
+
+			memcpy(&w, &st, VEC_WORDS_SIZE(h));
+			memcpy(&U, &opad, VEC_STATE_SIZE(h));
+			vec_compress(h, &U, &w);
+
+			if (h->word_size == 4)
+				for (j = 0; j < h->words; j++)
+					T.v32[j] ^= U.v32[j];
+			else
+				for (j = 0; j < h->words; j++)
+					T.v64[j] ^= U.v64[j];
+		}
+
+		for (l = 0; l < PBKDF2_LANES && i + l <= blocks; l++) {
+			out = (i + l - 1) * hLen;
+			for (j = 0; j < h->words && out < dkLen; j++) {
+				word = lane_get(h, &T, j, l);
+				for (u = 0; u < h->word_size && out < dkLen; u++)
+					DK[out++] = (char)(word >> (8 * (h->word_size - 1 - u)));
+			}
+		}
+	}
+
+	crypt_backend_memzero(&ipad, sizeof(ipad));
+	crypt_backend_memzero(&opad, sizeof(opad));
+	crypt_backend_memzero(&st, sizeof(st));
+	crypt_backend_memzero(&U, sizeof(U));
+	crypt_backend_memzero(&T, sizeof(T));
+	crypt_backend_memzero(&w, sizeof(w));
+	crypt_backend_memzero(key, sizeof(key));
+	crypt_backend_memzero(salt, PBKDF2_LANES * (Slen + 4));
+	free(salt);
+
+	return 0;
+}
+
+static const struct pbkdf2_vec_hash *pbkdf2_vec_get(const char *hash)
+{
+	const struct pbkdf2_vec_hash *h;
+
+	for (h = pbkdf2_vec_hashes; h->name; h++)
+		if (!strcmp(h->name, hash))
+			return h;
+
+	return NULL;
+}
+
+/*
+ * Hash count messages (prefix || block_i || suffix), one message per lane.
+ * Unused lanes in the last round just repeat the last message.
+ */
+int crypt_hash_vec_blocks(const char *name,
+			  const char *prefix, size_t prefix_len,
+			  const char *suffix, size_t suffix_len,
+			  const char *blocks, size_t block_size, size_t count,
+			  char *digests, size_t digest_stride, size_t digest_size)
+{
+	const struct pbkdf2_vec_hash *h = pbkdf2_vec_get(name);
+	const uint8_t *msg[PBKDF2_LANES];
+	union vec_state st;
+	uint8_t *buf, *p;
+	uint64_t word;
+	size_t i, l, j, u, idx, len, out;
+
+	if (!h)
+		return -ENOTSUP;
+
+	if (digest_size != h->words * h->word_size)
+		return -EINVAL;
+
+	len = prefix_len + block_size + suffix_len;
+	buf = malloc(PBKDF2_LANES * len);
+	if (!buf)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i += PBKDF2_LANES) {
+		for (l = 0; l < PBKDF2_LANES; l++) {
+			idx = (i + l) < count ? i + l : count - 1;
+			p = buf + l * len;
+			if (prefix_len)
+				memcpy(p, prefix, prefix_len);
+			memcpy(p + prefix_len, blocks + idx * block_size, block_size);
+			if (suffix_len)
+				memcpy(p + prefix_len + block_size, suffix, suffix_len);
+			msg[l] = p;
+		}
+
+		vec_init(h, &st);
+		vec_final(h, &st, msg, len, 0);
+
+		for (l = 0; l < PBKDF2_LANES && (i + l) < count; l++) {
+			out = (i + l) * digest_stride;
+			for (j = 0; j < h->words; j++) {
+				word = lane_get(h, &st, j, l);
+				for (u = 0; u < h->word_size; u++)
+					digests[out++] = (char)(word >> (8 * (h->word_size - 1 - u)));
+			}
+		}
+	}
+
+	free(buf);
+	return 0;
+}
+#else
+int crypt_hash_vec_blocks(const char *name,
+			  const char *prefix, size_t prefix_len,
+			  const char *suffix, size_t suffix_len,
+			  const char *blocks, size_t block_size, size_t count,
+			  char *digests, size_t digest_stride, size_t digest_size)
+{
+	return -ENOTSUP;
+}
+#endif
+
+#define MAX_HASH_BLOCK_LEN 128
+
+/*
+ * HMAC built on hash contexts, ipad and opad keyed states are computed
+ * once and only copied in every iteration (no key schedule per HMAC call).
+ * Returns -ENOTSUP if backend cannot copy hash state.
+ */
+static int pbkdf2_hash_copy(const char *hash,
+			    const char *P, size_t Plen,
+			    const char *S, size_t Slen,
+			    unsigned int c, unsigned int dkLen, char *DK,
+			    unsigned int hLen, unsigned int hash_block_size)
+{
+	struct crypt_hash *ipad = NULL, *opad = NULL, *h = NULL;
+	char K[MAX_HASH_BLOCK_LEN], pad[MAX_HASH_BLOCK_LEN];
+	char U[MAX_PRF_BLOCK_LEN], T[MAX_PRF_BLOCK_LEN];
+	char idx[4];
+	unsigned int i, u, k, blocks, len;
+	int r = -EINVAL;
+
+	if (hash_block_size > MAX_HASH_BLOCK_LEN || hLen > hash_block_size)
+		return -ENOTSUP;
+
+	memset(K, 0, sizeof(K));
+	if (Plen > hash_block_size) {
+		if (hash_buf(P, Plen, K, hLen, hash))
+			return -EINVAL;
+	} else
+		memcpy(K, P, Plen);
+
+	if (crypt_hash_init(&ipad, hash) || crypt_hash_init(&opad, hash) ||
+	    crypt_hash_init(&h, hash))
+		goto out;
+
+	for (k = 0; k < hash_block_size; k++)
+		pad[k] = K[k] ^ 0x36;
+	if (crypt_hash_write(ipad, pad, hash_block_size))
+		goto out;
+
+	for (k = 0; k < hash_block_size; k++)
+		pad[k] = K[k] ^ 0x5c;
+	if (crypt_hash_write(opad, pad, hash_block_size))
+		goto out;
+
+	r = crypt_hash_copy(h, ipad);
+	if (r < 0)
+		goto out;
+	r = -EINVAL;
+
+	blocks = (dkLen + hLen - 1) / hLen;
+	for (i = 1; i <= blocks; i++) {
+		idx[0] = (i >> 24) & 0xff;
+		idx[1] = (i >> 16) & 0xff;
+		idx[2] = (i >> 8) & 0xff;
+		idx[3] = i & 0xff;
+
+		for (u = 1; u <= c; u++) {
+			if (crypt_hash_copy(h, ipad))
+				goto out;
+			if (u == 1) {
+				if (crypt_hash_write(h, S, Slen) || crypt_hash_write(h, idx, 4))
+					goto out;
+			} else if (crypt_hash_write(h, U, hLen))
+				goto out;
+			if (crypt_hash_final(h, U, hLen))
+				goto out;
+
+			if (crypt_hash_copy(h, opad) || crypt_hash_write(h, U, hLen) ||
+			    crypt_hash_final(h, U, hLen))
+				goto out;
+
+			if (u == 1)
+				memcpy(T, U, hLen);
+			else
+				for (k = 0; k < hLen; k++)
+					T[k] ^= U[k];
+		}
+
+		len = (i == blocks) ? dkLen - (i - 1) * hLen : hLen;
+		memcpy(DK + (i - 1) * hLen, T, len);
+	}
+	r = 0;
+out:
+	if (ipad)
+		crypt_hash_destroy(ipad);
+	if (opad)
+		crypt_hash_destroy(opad);
+	if (h)
+		crypt_hash_destroy(h);
+	crypt_backend_memzero(K, sizeof(K));
+	crypt_backend_memzero(pad, sizeof(pad));
+	crypt_backend_memzero(U, sizeof(U));
+	crypt_backend_memzero(T, sizeof(T));
+
+	return r;
+}
+
 int pkcs5_pbkdf2(const char *hash,
 			const char *P, size_t Plen,
 			const char *S, size_t Slen,
@@ -96,6 +678,9 @@ int pkcs5_pbkdf2(const char *hash,
 	unsigned int u, hLen, l, r;
 	size_t tmplen = Slen + 4;
 	char *tmp;
+#if defined(__GNUC__)
+	const struct pbkdf2_vec_hash *vh;
+#endif
 
 	tmp = alloca(tmplen);
 	if (tmp == NULL)
@@ -181,6 +766,23 @@ int pkcs5_pbkdf2(const char *hash,
 	 *
 	 */
 
+#if defined(__GNUC__)
+	/*
+	 * Vectorized code wins for multiple blocks or if HMAC is expensive (kernel
+	 * API round trip per call); for single block, backend SHA extensions are faster.
+	 */
+	vh = pbkdf2_vec_get(hash);
+	if (vh && (dkLen > hLen || (crypt_backend_flags() & CRYPT_BACKEND_KERNEL)))
+		return pbkdf2_vec(vh, P, Plen, S, Slen, c, dkLen, DK);
+#endif
+
+	if (hash_block_size > 0) {
+		rc = pbkdf2_hash_copy(hash, P, Plen, S, Slen, c, dkLen, DK, hLen, hash_block_size);
+		if (rc != -ENOTSUP)
+			return rc;
+		rc = -EINVAL;
+	}
+
 	/* If hash_block_size is provided, hash password in advance. */
 	if (hash_block_size > 0 && Plen > hash_block_size) {
 		if (hash_buf(P, Plen, P_hash, hLen, hash))
@@ -31,12 +31,13 @@
 #define CLOCK_MONOTONIC_RAW CLOCK_MONOTONIC
 #endif
 
-#define BENCH_MIN_MS 250
 #define BENCH_MIN_MS_FAST 10
 #define BENCH_PERCENT_ATLEAST 95
 #define BENCH_PERCENT_ATMOST 110
 #define BENCH_SAMPLES_FAST 3
 #define BENCH_SAMPLES_SLOW 1
+#define BENCH_MODEL_MS 50
+#define BENCH_MODEL_PROBE_KB (16*1024)
 
 /* These PBKDF2 limits must be never violated */
 int crypt_pbkdf_get_limits(const char *kdf, struct crypt_pbkdf_limits *limits)
@@ -203,6 +204,33 @@ static int next_argon2_params(uint32_t *t_cost, uint32_t *m_cost,
 	return CONTINUE;
 }
 
+/* Measure and report parameters to caller and progress callback */
+static int argon2_probe(const char *kdf, const char *password, size_t password_length,
+			const char *salt, size_t salt_length,
+			char *key, size_t key_length,
+			uint32_t t_cost, uint32_t m_cost, uint32_t parallel,
+			size_t samples, long ms_atleast, long *ms,
+			uint32_t *out_t_cost, uint32_t *out_m_cost,
+			int (*progress)(uint32_t time_ms, void *usrptr),
+			void *usrptr)
+{
+	int r;
+
+	r = measure_argon2(kdf, password, password_length, salt, salt_length,
+			   key, key_length, t_cost, m_cost, parallel,
+			   samples, ms_atleast, ms);
+	if (r < 0)
+		return r;
+
+	/* Update parameters to actual measurement */
+	*out_t_cost = t_cost;
+	*out_m_cost = m_cost;
+	if (progress && progress((uint32_t)*ms, usrptr))
+		return -EINTR;
+
+	return 0;
+}
+
 static int crypt_argon2_check(const char *kdf, const char *password,
 			      size_t password_length, const char *salt,
 			      size_t salt_length, size_t key_length,
@@ -215,7 +243,9 @@ static int crypt_argon2_check(const char *kdf, const char *password,
 	int r = 0;
 	char *key = NULL;
 	uint32_t t_cost, m_cost;
-	long ms;
+	uint64_t new_t_cost, new_m_cost;
+	double a, b, work;
+	long ms, ms_probe;
 	long ms_atleast = (long)target_ms * BENCH_PERCENT_ATLEAST / 100;
 	long ms_atmost = (long)target_ms * BENCH_PERCENT_ATMOST / 100;
 
@@ -232,59 +262,102 @@ static int crypt_argon2_check(const char *kdf, const char *password,
 	if (!key)
 		return -ENOMEM;
 
+	/*
+	 * 1. Probe with small memory cost until ms >= BENCH_MODEL_MS
+	 *    (with large max_m_cost probing near the target is too expensive).
+	 */
 	t_cost = min_t_cost;
-	m_cost = min_m_cost;
+	m_cost = max_m_cost < BENCH_MODEL_PROBE_KB ? max_m_cost : BENCH_MODEL_PROBE_KB;
+	if (m_cost < min_m_cost)
+		m_cost = min_m_cost;
 
-	/* 1. Find some small parameters, s. t. ms >= BENCH_MIN_MS: */
 	while (1) {
-		r = measure_argon2(kdf, password, password_length, salt, salt_length,
-		                   key, key_length, t_cost, m_cost, parallel,
-		                   BENCH_SAMPLES_FAST, BENCH_MIN_MS, &ms);
-		if (!r) {
-			/* Update parameters to actual measurement */
-			*out_t_cost = t_cost;
-			*out_m_cost = m_cost;
-			if (progress && progress((uint32_t)ms, usrptr))
-				r = -EINTR;
-		}
-
+		r = argon2_probe(kdf, password, password_length, salt, salt_length,
+				 key, key_length, t_cost, m_cost, parallel,
+				 BENCH_SAMPLES_FAST, BENCH_MODEL_MS, &ms,
+				 out_t_cost, out_m_cost, progress, usrptr);
 		if (r < 0)
 			goto out;
 
-		if (ms >= BENCH_MIN_MS)
+		if (ms >= BENCH_MODEL_MS)
 			break;
 
-		if (m_cost == max_m_cost) {
-			if (ms < BENCH_MIN_MS_FAST)
-				t_cost *= 16;
-			else {
-				uint32_t new = (t_cost * BENCH_MIN_MS) / (uint32_t)ms;
-				if (new == t_cost)
-					break;
+		if (t_cost > UINT32_MAX / 16) {
+			r = -EINVAL;
+			goto out;
+		}
+		t_cost *= ms < BENCH_MIN_MS_FAST ? 16 : 2;
+	}
 
-				t_cost = new;
-			}
+	/*
+	 * 2. Unless the probe is already close to target, take the second
+	 *    probe with double cost (memory if possible), fit
+	 *    ms = a * t_cost * m_cost + b and jump directly to the target
+	 *    estimate (prefer max memory).
+	 */
+	if (ms < ms_atleast && t_cost <= UINT32_MAX / 2) {
+		work = (double)t_cost * m_cost;
+		ms_probe = ms;
+
+		if (m_cost <= max_m_cost / 2)
+			m_cost *= 2;
+		else
+			t_cost *= 2;
+
+		r = argon2_probe(kdf, password, password_length, salt, salt_length,
+				 key, key_length, t_cost, m_cost, parallel,
+				 BENCH_SAMPLES_FAST, 0, &ms,
+				 out_t_cost, out_m_cost, progress, usrptr);
+		if (r < 0)
+			goto out;
+
+		if (ms > ms_probe) {
+			a = (double)(ms - ms_probe) / work;
+			b = (double)ms_probe - a * work;
 		} else {
-			if (ms < BENCH_MIN_MS_FAST)
-				m_cost *= 16;
-			else {
-				uint32_t new = (m_cost * BENCH_MIN_MS) / (uint32_t)ms;
-				if (new == m_cost)
-					break;
-
-				m_cost = new;
-			}
-			if (m_cost > max_m_cost) {
-				m_cost = max_m_cost;
+			a = (double)ms / (2 * work);
+			b = 0.;
+		}
+
+		if (ms < ms_atleast && a > 0.) {
+			work = ((double)target_ms - b) / a;
+			if (work < (double)min_t_cost * min_m_cost)
+				work = (double)min_t_cost * min_m_cost;
+
+			new_t_cost = work / max_m_cost;
+			if (work > (double)max_m_cost * new_t_cost)
+				new_t_cost++;
+			if (new_t_cost < min_t_cost)
+				new_t_cost = min_t_cost;
+			if (new_t_cost > UINT32_MAX) {
+				r = -EINVAL;
+				goto out;
 			}
+
+			new_m_cost = work / new_t_cost;
+			if (new_m_cost > max_m_cost)
+				new_m_cost = max_m_cost;
+			if (new_m_cost < min_m_cost)
+				new_m_cost = min_m_cost;
+
+			t_cost = (uint32_t)new_t_cost;
+			m_cost = (uint32_t)new_m_cost;
+
+			/* 3. Confirm the estimate with one measurement */
+			r = argon2_probe(kdf, password, password_length, salt, salt_length,
+					 key, key_length, t_cost, m_cost, parallel,
+					 BENCH_SAMPLES_SLOW, ms_atleast, &ms,
+					 out_t_cost, out_m_cost, progress, usrptr);
+			if (r < 0)
+				goto out;
 		}
 	}
+
 	/*
-	 * 2. Use the params obtained in (1.) to estimate the target params.
-	 * 3. Then repeatedly measure the candidate params and if they fall out of
-	 * the acceptance range (+-5 %), try to improve the estimate:
+	 * 4. If the measurement falls out of the acceptance range (-5 %, +10 %),
+	 * try to improve the estimate proportionally:
 	 */
-	do {
+	while (ms < ms_atleast || ms > ms_atmost) {
 		if (next_argon2_params(&t_cost, &m_cost, min_t_cost, min_m_cost,
 				       max_m_cost, ms, target_ms)) {
 			/* Update parameters to final computation */
@@ -293,22 +366,13 @@ static int crypt_argon2_check(const char *kdf, const char *password,
 			break;
 		}
 
-		r = measure_argon2(kdf, password, password_length, salt, salt_length,
-		                   key, key_length, t_cost, m_cost, parallel,
-		                   BENCH_SAMPLES_SLOW, ms_atleast, &ms);
-
-		if (!r) {
-			/* Update parameters to actual measurement */
-			*out_t_cost = t_cost;
-			*out_m_cost = m_cost;
-			if (progress && progress((uint32_t)ms, usrptr))
-				r = -EINTR;
-		}
-
+		r = argon2_probe(kdf, password, password_length, salt, salt_length,
+				 key, key_length, t_cost, m_cost, parallel,
+				 BENCH_SAMPLES_SLOW, ms_atleast, &ms,
+				 out_t_cost, out_m_cost, progress, usrptr);
 		if (r < 0)
 			break;
-
-	} while (ms < ms_atleast || ms > ms_atmost);
+	}
 out:
 	if (key) {
 		crypt_backend_memzero(key, key_length);
@@ -398,6 +462,68 @@ out:
 	return r;
 }
 
+/*
+ * Fixed cost measurement (no calibration), warm-up runs are not counted.
+ * Uses real time as measure_argon2 (multiple threads).
+ */
+int crypt_pbkdf_measure(const char *kdf, const char *hash,
+		const char *password, size_t password_size,
+		const char *salt, size_t salt_size,
+		size_t volume_key_size, uint32_t iterations,
+		uint32_t memory_kb, uint32_t parallel_threads,
+		uint32_t warmup, uint32_t samples,
+		uint64_t *min_us, uint64_t *avg_us)
+{
+	struct timespec tstart, tend;
+	uint64_t us, us_min = UINT64_MAX, us_sum = 0;
+	char *key;
+	uint32_t i;
+	int r = 0;
+
+	if (!kdf || !samples || !volume_key_size || !min_us || !avg_us)
+		return -EINVAL;
+
+	key = malloc(volume_key_size);
+	if (!key)
+		return -ENOMEM;
+
+	for (i = 0; i < warmup + samples; i++) {
+		if (clock_gettime(CLOCK_MONOTONIC_RAW, &tstart) < 0) {
+			r = -EINVAL;
+			break;
+		}
+
+		r = crypt_pbkdf(kdf, hash, password, password_size, salt, salt_size,
+				key, volume_key_size, iterations, memory_kb, parallel_threads);
+		if (r < 0)
+			break;
+
+		if (clock_gettime(CLOCK_MONOTONIC_RAW, &tend) < 0) {
+			r = -EINVAL;
+			break;
+		}
+
+		if (i < warmup)
+			continue;
+
+		us = (uint64_t)(tend.tv_sec - tstart.tv_sec) * 1000000 +
+		     (tend.tv_nsec - tstart.tv_nsec) / 1000;
+		if (us < us_min)
+			us_min = us;
+		us_sum += us;
+	}
+
+	crypt_backend_memzero(key, volume_key_size);
+	free(key);
+
+	if (r < 0)
+		return r;
+
+	*min_us = us_min;
+	*avg_us = us_sum / samples;
+	return 0;
+}
+
 int crypt_pbkdf_perf(const char *kdf, const char *hash,
 		const char *password, size_t password_size,
 		const char *salt, size_t salt_size,
@@ -0,0 +1,254 @@
+/*
+ * SHA-256 compression function for iterated key derivation
+ *
+ * Copyright (C) 2021 Red Hat, Inc. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this file; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "crypto_backend.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SHA256_SHANI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))
+#define SHA256_ARMV8 1
+#include <arm_neon.h>
+#endif
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+typedef void (*sha256_compress_fn)(uint32_t st[8], const unsigned char *data, size_t blocks);
+
+static void sha256_compress_generic(uint32_t st[8], const unsigned char *data, size_t blocks)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (; blocks; blocks--, data += 64) {
+		for (i = 0; i < 16; i++)
+			w[i] = (uint32_t)data[4 * i] << 24 | (uint32_t)data[4 * i + 1] << 16 |
+			       (uint32_t)data[4 * i + 2] << 8 | (uint32_t)data[4 * i + 3];
+		for (; i < 64; i++)
+			w[i] = w[i - 16] + w[i - 7] +
+			       (ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+			       (ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+		a = st[0]; b = st[1]; c = st[2]; d = st[3];
+		e = st[4]; f = st[5]; g = st[6]; h = st[7];
+
+		for (i = 0; i < 64; i++) {
+			t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) +
+			     ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+			t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) +
+			     ((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		st[0] += a; st[1] += b; st[2] += c; st[3] += d;
+		st[4] += e; st[5] += f; st[6] += g; st[7] += h;
+	}
+
+	crypt_backend_memzero(w, sizeof(w));
+}
+
+#ifdef SHA256_SHANI
+/* Intel SHA extensions, four rounds per message vector */
+__attribute__((target("sha,sse4.1")))
+static void sha256_compress_shani(uint32_t st[8], const unsigned char *data, size_t blocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i st0, st1, abef, cdgh, msg, tmp, m[4];
+	int i;
+
+	/* state to ABEF/CDGH order */
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&st[0]), 0xb1);
+	st1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&st[4]), 0x1b);
+	st0 = _mm_alignr_epi8(tmp, st1, 8);
+	st1 = _mm_blend_epi16(st1, tmp, 0xf0);
+
+	for (; blocks; blocks--, data += 64) {
+		abef = st0;
+		cdgh = st1;
+
+		for (i = 0; i < 16; i++) {
+			if (i < 4)
+				m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), mask);
+			else {
+				tmp = _mm_add_epi32(_mm_sha256msg1_epu32(m[i & 3], m[(i + 1) & 3]),
+						    _mm_alignr_epi8(m[(i + 3) & 3], m[(i + 2) & 3], 4));
+				m[i & 3] = _mm_sha256msg2_epu32(tmp, m[(i + 3) & 3]);
+			}
+
+			msg = _mm_add_epi32(m[i & 3], _mm_loadu_si128((const __m128i *)&sha256_k[4 * i]));
+			st1 = _mm_sha256rnds2_epu32(st1, st0, msg);
+			st0 = _mm_sha256rnds2_epu32(st0, st1, _mm_shuffle_epi32(msg, 0x0e));
+		}
+
+		st0 = _mm_add_epi32(st0, abef);
+		st1 = _mm_add_epi32(st1, cdgh);
+	}
+
+	/* back to ABCD/EFGH order */
+	tmp = _mm_shuffle_epi32(st0, 0x1b);
+	st1 = _mm_shuffle_epi32(st1, 0xb1);
+	_mm_storeu_si128((__m128i *)&st[0], _mm_blend_epi16(tmp, st1, 0xf0));
+	_mm_storeu_si128((__m128i *)&st[4], _mm_alignr_epi8(st1, tmp, 8));
+}
+
+static bool sha256_shani_supported(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1) || !(ecx & bit_SSSE3))
+		return false;
+
+	if (__get_cpuid_max(0, NULL) < 7)
+		return false;
+
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return ebx & (1U << 29); /* SHA */
+}
+#endif
+
+#ifdef SHA256_ARMV8
+/* ARMv8 SHA2 extensions (enabled at build time) */
+static void sha256_compress_armv8(uint32_t st[8], const unsigned char *data, size_t blocks)
+{
+	uint32x4_t st0, st1, abcd, efgh, msg, tmp, m[4];
+	int i;
+
+	st0 = vld1q_u32(&st[0]);
+	st1 = vld1q_u32(&st[4]);
+
+	for (; blocks; blocks--, data += 64) {
+		abcd = st0;
+		efgh = st1;
+
+		for (i = 0; i < 16; i++) {
+			if (i < 4)
+				m[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+			else
+				m[i & 3] = vsha256su1q_u32(vsha256su0q_u32(m[i & 3], m[(i + 1) & 3]),
+							   m[(i + 2) & 3], m[(i + 3) & 3]);
+
+			msg = vaddq_u32(m[i & 3], vld1q_u32(&sha256_k[4 * i]));
+			tmp = abcd;
+			abcd = vsha256hq_u32(abcd, efgh, msg);
+			efgh = vsha256h2q_u32(efgh, tmp, msg);
+		}
+
+		st0 = vaddq_u32(st0, abcd);
+		st1 = vaddq_u32(st1, efgh);
+	}
+
+	vst1q_u32(&st[0], st0);
+	vst1q_u32(&st[4], st1);
+}
+#endif
+
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+static sha256_compress_fn sha256_compress = sha256_compress_generic;
+
+static void sha256_init(void)
+{
+#ifdef SHA256_SHANI
+	if (sha256_shani_supported())
+		sha256_compress = sha256_compress_shani;
+#endif
+#ifdef SHA256_ARMV8
+	sha256_compress = sha256_compress_armv8;
+#endif
+}
+
+static void sha256_digest(const uint32_t st[8], unsigned char *out)
+{
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		out[4 * i]     = st[i] >> 24;
+		out[4 * i + 1] = st[i] >> 16;
+		out[4 * i + 2] = st[i] >> 8;
+		out[4 * i + 3] = st[i];
+	}
+}
+
+/*
+ * BITLK key derivation, iterated
+ *   last = SHA256(last || initial || salt || count_le64), count = 0 .. iterations - 1
+ * The 88 bytes message is always two padded SHA-256 blocks, these are updated
+ * in place (previous digest and counter) and compressed directly, without
+ * any allocation or hash backend call per iteration.
+ */
+int crypt_bitlk_kdf_sha256(const char *initial_sha256, const char *salt,
+			   uint64_t iterations, char *key)
+{
+	unsigned char msg[128];
+	uint32_t st[8];
+	uint64_t count;
+	int i;
+
+	if (!initial_sha256 || !salt || !key)
+		return -EINVAL;
+
+	pthread_once(&sha256_once, sha256_init);
+
+	memset(msg, 0, sizeof(msg));
+	memcpy(&msg[32], initial_sha256, 32);
+	memcpy(&msg[64], salt, 16);
+	/* padding and message length in bits (88 * 8) */
+	msg[88] = 0x80;
+	msg[126] = 0x02;
+	msg[127] = 0xc0;
+
+	for (count = 0; count < iterations; count++) {
+		for (i = 0; i < 8; i++)
+			msg[80 + i] = (unsigned char)(count >> (8 * i));
+
+		memcpy(st, sha256_iv, sizeof(st));
+		sha256_compress(st, msg, 2);
+		sha256_digest(st, msg);
+	}
+
+	memcpy(key, msg, 32);
+
+	crypt_backend_memzero(msg, sizeof(msg));
+	crypt_backend_memzero(st, sizeof(st));
+
+	return 0;
+}
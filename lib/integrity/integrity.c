@@ -19,9 +19,12 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <uuid/uuid.h>
 
 #include "integrity.h"
@@ -76,6 +79,773 @@ int INTEGRITY_read_sb(struct crypt_device *cd,
 	return 0;
 }
 
+/*
+ * Userspace initialization of integrity tags for zeroed data area.
+ *
+ * Data area is zeroed (by offload if possible) and tags are computed
+ * in parallel and written directly to metadata runs, so data do not pass
+ * through kernel dm-integrity write path. Layout and tag calculation
+ * are verified on probe blocks written by kernel first; any mismatch
+ * means -ENOTSUP and the caller should use in-kernel wipe instead.
+ */
+
+/* dm-integrity metadata run padding, without fixed padding it is 256x larger */
+#define METADATA_PADDING_SECTORS	8
+
+/* the first data sector (after journal) is searched in this area */
+#define TAGS_PROBE_SCAN_MAX		(1024 * 1024 * 1024)
+#define TAGS_PROBE_SCAN_CHUNK		(1024 * 1024)
+
+#define TAGS_THREADS_MAX		16
+#define TAGS_DIGEST_MAX			64
+
+struct integrity_layout {
+	uint64_t initial_sectors;	/* metadata of area 0 */
+	uint64_t metadata_run;		/* metadata sectors per area */
+	uint64_t interleave_sectors;	/* data sectors per area */
+	uint64_t data_sectors;		/* provided data sectors */
+	uint64_t areas;
+	unsigned sectors_per_block;
+	unsigned tag_size;
+
+	char hash_name[32];
+	bool crc32c;
+	struct volume_key *vk;		/* HMAC key */
+	bool use_salt;
+	uint8_t salt[SB_SALT_SIZE];
+	uint32_t crc_zero[4][256];	/* crc32c "append zero block" operator */
+};
+
+struct integrity_hasher {
+	const struct integrity_layout *l;
+	struct crypt_hash *hash;
+	struct crypt_hmac *hmac;
+	char *zero;
+};
+
+static uint64_t tags_area_offset(const struct integrity_layout *l, uint64_t area)
+{
+	return (l->initial_sectors + area * (l->interleave_sectors + l->metadata_run)) << SECTOR_SHIFT;
+}
+
+static uint64_t tags_area_data_sectors(const struct integrity_layout *l, uint64_t area)
+{
+	uint64_t sectors = l->data_sectors - area * l->interleave_sectors;
+
+	return sectors < l->interleave_sectors ? sectors : l->interleave_sectors;
+}
+
+/*
+ * Processing zero bytes is linear in crc state, so the whole zero block
+ * can be applied by four table lookups.
+ */
+static int tags_crc_zero_init(struct integrity_layout *l)
+{
+	uint32_t basis[32];
+	char *zero;
+	size_t block = l->sectors_per_block << SECTOR_SHIFT;
+	unsigned i, j, v;
+
+	zero = calloc(1, block);
+	if (!zero)
+		return -ENOMEM;
+
+	for (i = 0; i < 32; i++)
+		basis[i] = crypt_crc32c(1U << i, (const unsigned char *)zero, block);
+	free(zero);
+
+	for (i = 0; i < 4; i++)
+		for (v = 0; v < 256; v++) {
+			l->crc_zero[i][v] = 0;
+			for (j = 0; j < 8; j++)
+				if (v & (1 << j))
+					l->crc_zero[i][v] ^= basis[i * 8 + j];
+		}
+
+	return 0;
+}
+
+static uint32_t tags_crc_zero(const struct integrity_layout *l, uint32_t crc)
+{
+	return l->crc_zero[0][crc & 0xff] ^ l->crc_zero[1][(crc >> 8) & 0xff] ^
+	       l->crc_zero[2][(crc >> 16) & 0xff] ^ l->crc_zero[3][crc >> 24];
+}
+
+static int tags_hasher_init(struct integrity_hasher *h, const struct integrity_layout *l)
+{
+	int r = 0;
+
+	memset(h, 0, sizeof(*h));
+	h->l = l;
+
+	if (l->crc32c)
+		return 0;
+
+	h->zero = calloc(1, l->sectors_per_block << SECTOR_SHIFT);
+	if (!h->zero)
+		return -ENOMEM;
+
+	if (l->vk)
+		r = crypt_hmac_init(&h->hmac, l->hash_name, l->vk->key, l->vk->keylength);
+	else
+		r = crypt_hash_init(&h->hash, l->hash_name);
+	if (r) {
+		free(h->zero);
+		h->zero = NULL;
+	}
+
+	return r;
+}
+
+static void tags_hasher_destroy(struct integrity_hasher *h)
+{
+	if (h->hmac)
+		crypt_hmac_destroy(h->hmac);
+	if (h->hash)
+		crypt_hash_destroy(h->hash);
+	free(h->zero);
+	memset(h, 0, sizeof(*h));
+}
+
+/* The same as kernel integrity_sector_checksum(), zeroed block if data is NULL */
+static int tags_sector_tag(struct integrity_hasher *h, uint64_t sector,
+			   const char *data, char *tag)
+{
+	const struct integrity_layout *l = h->l;
+	size_t block = l->sectors_per_block << SECTOR_SHIFT;
+	uint64_t sector_le = htole64(sector);
+	char digest[TAGS_DIGEST_MAX];
+	uint32_t crc;
+	size_t digest_size;
+	int r = 0;
+
+	if (l->crc32c) {
+		crc = ~0U;
+		if (l->use_salt)
+			crc = crypt_crc32c(crc, l->salt, SB_SALT_SIZE);
+		crc = crypt_crc32c(crc, (const unsigned char *)&sector_le, sizeof(sector_le));
+		if (data)
+			crc = crypt_crc32c(crc, (const unsigned char *)data, block);
+		else
+			crc = tags_crc_zero(l, crc);
+		crc = htole32(~crc);
+		memcpy(digest, &crc, sizeof(crc));
+		digest_size = sizeof(crc);
+	} else if (h->hmac) {
+		digest_size = crypt_hmac_size(l->hash_name);
+		if (l->use_salt)
+			r = crypt_hmac_write(h->hmac, (const char *)l->salt, SB_SALT_SIZE);
+		if (!r)
+			r = crypt_hmac_write(h->hmac, (const char *)&sector_le, sizeof(sector_le));
+		if (!r)
+			r = crypt_hmac_write(h->hmac, data ?: h->zero, block);
+		if (!r)
+			r = crypt_hmac_final(h->hmac, digest, digest_size);
+	} else {
+		digest_size = crypt_hash_size(l->hash_name);
+		if (l->use_salt)
+			r = crypt_hash_write(h->hash, (const char *)l->salt, SB_SALT_SIZE);
+		if (!r)
+			r = crypt_hash_write(h->hash, (const char *)&sector_le, sizeof(sector_le));
+		if (!r)
+			r = crypt_hash_write(h->hash, data ?: h->zero, block);
+		if (!r)
+			r = crypt_hash_final(h->hash, digest, digest_size);
+	}
+
+	if (r)
+		return r;
+
+	if (digest_size >= l->tag_size)
+		memcpy(tag, digest, l->tag_size);
+	else {
+		memcpy(tag, digest, digest_size);
+		memset(tag + digest_size, 0, l->tag_size - digest_size);
+	}
+	crypt_backend_memzero(digest, sizeof(digest));
+
+	return 0;
+}
+
+/* Returns digest size of integrity algorithm supported in userspace */
+static int tags_hash_init(struct crypt_device *cd, struct integrity_layout *l,
+			  const char *integrity, struct volume_key *vk)
+{
+	size_t len;
+	int digest_size;
+
+	memset(l, 0, sizeof(*l));
+
+	if (!integrity)
+		return -ENOTSUP;
+
+	if (!strcmp(integrity, "crc32c")) {
+		l->crc32c = true;
+		return sizeof(uint32_t);
+	}
+
+	if (!strncmp(integrity, "hmac(", 5)) {
+		len = strlen(integrity) - 6;
+		if (!vk || integrity[strlen(integrity) - 1] != ')' || len >= sizeof(l->hash_name))
+			return -ENOTSUP;
+		memcpy(l->hash_name, integrity + 5, len);
+		l->vk = vk;
+	} else if (strlen(integrity) < sizeof(l->hash_name))
+		strcpy(l->hash_name, integrity);
+	else
+		return -ENOTSUP;
+
+	digest_size = l->vk ? crypt_hmac_size(l->hash_name) : crypt_hash_size(l->hash_name);
+	if (digest_size <= 0 || digest_size > TAGS_DIGEST_MAX) {
+		log_dbg(cd, "Integrity %s is not supported in userspace.", integrity);
+		return -ENOTSUP;
+	}
+
+	return digest_size;
+}
+
+static int tags_layout_init(struct crypt_device *cd, struct integrity_layout *l,
+			    const struct crypt_params_integrity *params,
+			    struct volume_key *vk, struct superblock *sb)
+{
+	uint64_t padding;
+	int r;
+
+	r = tags_hash_init(cd, l, params ? params->integrity : NULL, vk);
+	if (r < 0)
+		return r;
+
+	if (sb->log2_interleave_sectors < sb->log2_sectors_per_block)
+		return -ENOTSUP;
+
+	l->sectors_per_block = 1 << sb->log2_sectors_per_block;
+	l->tag_size = sb->integrity_tag_size;
+	l->interleave_sectors = 1ULL << sb->log2_interleave_sectors;
+	l->data_sectors = sb->provided_data_sectors;
+	l->areas = (l->data_sectors + l->interleave_sectors - 1) / l->interleave_sectors;
+
+	padding = (sb->flags & SB_FLAG_FIXED_PADDING) ?
+		  (METADATA_PADDING_SECTORS << SECTOR_SHIFT) :
+		  (1ULL << SECTOR_SHIFT << METADATA_PADDING_SECTORS);
+	l->metadata_run = ((uint64_t)l->tag_size << (sb->log2_interleave_sectors - sb->log2_sectors_per_block));
+	l->metadata_run = ((l->metadata_run + padding - 1) / padding * padding) >> SECTOR_SHIFT;
+
+	if (sb->flags & SB_FLAG_FIXED_HMAC) {
+		l->use_salt = true;
+		memcpy(l->salt, sb->salt, SB_SALT_SIZE);
+	}
+
+	return l->crc32c ? tags_crc_zero_init(l) : 0;
+}
+
+/* Find kernel written probe block on raw device, returns sector or 0 */
+static uint64_t tags_probe_find(struct crypt_device *cd, struct device *device,
+				const char *block, size_t block_size, uint64_t dev_size)
+{
+	int devfd;
+	char *buf = NULL;
+	uint64_t offset, found = 0;
+	size_t i, chunk = TAGS_PROBE_SCAN_CHUNK + block_size;
+
+	devfd = device_open(cd, device, O_RDONLY);
+	if (devfd < 0 || !(buf = device_alloc_buffer(device, chunk)))
+		return 0;
+
+	if (dev_size > TAGS_PROBE_SCAN_MAX)
+		dev_size = TAGS_PROBE_SCAN_MAX;
+
+	for (offset = SB_SECTORS << SECTOR_SHIFT; !found && offset + chunk <= dev_size;
+	     offset += TAGS_PROBE_SCAN_CHUNK) {
+		if (read_lseek_blockwise(devfd, device_block_size(cd, device),
+			device_alignment(device), buf, chunk, offset) != (ssize_t)chunk)
+			break;
+		for (i = 0; i < TAGS_PROBE_SCAN_CHUNK; i += SECTOR_SIZE)
+			if (!memcmp(&buf[i], block, block_size)) {
+				found = (offset + i) >> SECTOR_SHIFT;
+				break;
+			}
+	}
+
+	free(buf);
+	return found;
+}
+
+static bool tags_probe_check(struct crypt_device *cd, struct device *device,
+			     struct integrity_hasher *h, uint64_t sector,
+			     const char *block, uint64_t data_offset, uint64_t tag_offset)
+{
+	const struct integrity_layout *l = h->l;
+	size_t block_size = l->sectors_per_block << SECTOR_SHIFT;
+	char tag[TAGS_DIGEST_MAX], *buf;
+	bool ok = false;
+	int devfd;
+
+	devfd = device_open(cd, device, O_RDONLY);
+	if (devfd < 0 || !(buf = device_alloc_buffer(device, block_size)))
+		return false;
+
+	if (read_lseek_blockwise(devfd, device_block_size(cd, device), device_alignment(device),
+				 buf, block_size, data_offset) != (ssize_t)block_size ||
+	    memcmp(buf, block, block_size))
+		log_dbg(cd, "Integrity probe data of sector %" PRIu64 " not found.", sector);
+	else if (read_lseek_blockwise(devfd, device_block_size(cd, device), device_alignment(device),
+				      buf, l->tag_size, tag_offset) != (ssize_t)l->tag_size ||
+		 tags_sector_tag(h, sector, block, tag) || memcmp(buf, tag, l->tag_size))
+		log_dbg(cd, "Integrity probe tag of sector %" PRIu64 " does not match.", sector);
+	else
+		ok = true;
+
+	free(buf);
+	return ok;
+}
+
+/*
+ * Write random probe blocks to three sectors (two in the first area and one
+ * in the second area) through kernel and locate them on raw device.
+ */
+static int tags_probe_layout(struct crypt_device *cd, struct integrity_layout *l,
+			     const struct crypt_params_integrity *params,
+			     struct volume_key *vk,
+			     struct volume_key *journal_crypt_key,
+			     struct volume_key *journal_mac_key,
+			     uint32_t sb_flags)
+{
+	struct device *device = crypt_data_device(cd);
+	struct integrity_hasher h;
+	char tmp_name[64], tmp_path[128], tmp_uuid[40], *probe = NULL;
+	size_t block_size = l->sectors_per_block << SECTOR_SHIFT;
+	uint64_t sectors[3], dev_size, data0;
+	uuid_t tmp_uuid_bin;
+	unsigned i, count;
+	int r, fd;
+
+	if (device_size(device, &dev_size))
+		return -ENOTSUP;
+
+	sectors[0] = 0;
+	sectors[1] = l->sectors_per_block;
+	sectors[2] = l->interleave_sectors;
+	if (l->data_sectors < 2 * l->sectors_per_block)
+		return -ENOTSUP;
+	count = l->areas > 1 ? 3 : 2;
+
+	r = tags_hasher_init(&h, l);
+	if (r)
+		return -ENOTSUP;
+
+	if (!(probe = device_alloc_buffer(device, count * block_size))) {
+		tags_hasher_destroy(&h);
+		return -ENOMEM;
+	}
+
+	r = crypt_random_get(cd, probe, count * block_size, CRYPT_RND_NORMAL);
+	if (r)
+		goto out;
+
+	uuid_generate(tmp_uuid_bin);
+	uuid_unparse(tmp_uuid_bin, tmp_uuid);
+	snprintf(tmp_name, sizeof(tmp_name), "temporary-cryptsetup-%s", tmp_uuid);
+	snprintf(tmp_path, sizeof(tmp_path), "%s/%s", dm_get_dir(), tmp_name);
+
+	r = INTEGRITY_activate(cd, tmp_name, params, vk, journal_crypt_key, journal_mac_key,
+			       CRYPT_ACTIVATE_PRIVATE | CRYPT_ACTIVATE_NO_JOURNAL, sb_flags);
+	if (r)
+		goto out;
+
+	fd = open(tmp_path, O_RDWR);
+	if (fd < 0)
+		r = -EINVAL;
+	for (i = 0; !r && i < count; i++)
+		if (pwrite(fd, &probe[i * block_size], block_size,
+			   sectors[i] << SECTOR_SHIFT) != (ssize_t)block_size)
+			r = -EIO;
+	if (!r && fsync(fd))
+		r = -EIO;
+	if (fd >= 0)
+		close(fd);
+
+	if (dm_remove_device(cd, tmp_name, CRYPT_DEACTIVATE_FORCE | DM_DEACTIVATE_PRIVATE) && !r)
+		r = -EINVAL;
+	if (r)
+		goto out;
+
+	r = -ENOTSUP;
+	data0 = tags_probe_find(cd, device, probe, block_size, dev_size);
+	if (data0 < SB_SECTORS + l->metadata_run) {
+		log_dbg(cd, "Integrity probe data not found.");
+		goto out;
+	}
+	l->initial_sectors = data0 - l->metadata_run;
+
+	for (i = 0; i < count; i++) {
+		uint64_t area = sectors[i] / l->interleave_sectors;
+		uint64_t block = (sectors[i] % l->interleave_sectors) / l->sectors_per_block;
+
+		if (!tags_probe_check(cd, device, &h, sectors[i], &probe[i * block_size],
+				      tags_area_offset(l, area) + (l->metadata_run << SECTOR_SHIFT) +
+				      ((sectors[i] % l->interleave_sectors) << SECTOR_SHIFT),
+				      tags_area_offset(l, area) + block * l->tag_size))
+			goto out;
+	}
+
+	if (tags_area_offset(l, l->areas - 1) + ((l->metadata_run +
+	    tags_area_data_sectors(l, l->areas - 1)) << SECTOR_SHIFT) > dev_size) {
+		log_dbg(cd, "Integrity layout exceeds device size.");
+		goto out;
+	}
+
+	log_dbg(cd, "Integrity layout verified: initial sectors %" PRIu64 ", metadata run %" PRIu64 ".",
+		l->initial_sectors, l->metadata_run);
+	r = 0;
+out:
+	tags_hasher_destroy(&h);
+	free(probe);
+	return r;
+}
+
+struct tags_shared {
+	const struct integrity_layout *l;
+	int devfd;
+	uint64_t progress_base;
+	uint64_t progress_size;
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr);
+	void *usrptr;
+
+	pthread_mutex_t lock;
+	uint64_t done;
+	bool stop;
+};
+
+struct tags_job {
+	struct tags_shared *s;
+	pthread_t thread;
+	uint64_t area;
+	uint64_t area_end;
+	int r;
+};
+
+static bool tags_job_area_done(struct tags_job *job, uint64_t sectors)
+{
+	struct tags_shared *s = job->s;
+	bool stop;
+
+	pthread_mutex_lock(&s->lock);
+	s->done += sectors << SECTOR_SHIFT;
+	if (!s->stop && s->progress &&
+	    s->progress(s->progress_size, s->progress_base + s->done, s->usrptr)) {
+		s->stop = true;
+		job->r = -EINTR;
+	}
+	stop = s->stop;
+	pthread_mutex_unlock(&s->lock);
+
+	return stop;
+}
+
+static void tags_job_fail(struct tags_job *job, int r)
+{
+	pthread_mutex_lock(&job->s->lock);
+	job->s->stop = true;
+	pthread_mutex_unlock(&job->s->lock);
+	job->r = r;
+}
+
+static void *tags_job_run(void *arg)
+{
+	struct tags_job *job = arg;
+	const struct integrity_layout *l = job->s->l;
+	size_t run_size = l->metadata_run << SECTOR_SHIFT;
+	struct integrity_hasher h;
+	uint64_t sectors, b;
+	char *run;
+
+	run = malloc(run_size);
+	if (!run) {
+		tags_job_fail(job, -ENOMEM);
+		return NULL;
+	}
+
+	if (tags_hasher_init(&h, l)) {
+		free(run);
+		tags_job_fail(job, -EINVAL);
+		return NULL;
+	}
+
+	for (; job->area < job->area_end; job->area++) {
+		sectors = tags_area_data_sectors(l, job->area);
+
+		memset(run, 0, run_size);
+		for (b = 0; b < sectors / l->sectors_per_block; b++)
+			if (tags_sector_tag(&h, job->area * l->interleave_sectors + b * l->sectors_per_block,
+					    NULL, run + b * l->tag_size)) {
+				tags_job_fail(job, -EINVAL);
+				goto out;
+			}
+
+		if (pwrite(job->s->devfd, run, run_size, tags_area_offset(l, job->area)) != (ssize_t)run_size) {
+			tags_job_fail(job, -EIO);
+			goto out;
+		}
+
+		if (tags_job_area_done(job, sectors))
+			break;
+	}
+out:
+	tags_hasher_destroy(&h);
+	free(run);
+	return NULL;
+}
+
+static int tags_write(struct crypt_device *cd, struct tags_shared *s)
+{
+	struct tags_job jobs[TAGS_THREADS_MAX];
+	bool started[TAGS_THREADS_MAX] = {};
+	uint64_t per_job, area;
+	unsigned i, jobs_count;
+	int r = 0;
+
+	jobs_count = crypt_cpusonline();
+	if (jobs_count > TAGS_THREADS_MAX)
+		jobs_count = TAGS_THREADS_MAX;
+	if (jobs_count > s->l->areas)
+		jobs_count = s->l->areas;
+	if (!jobs_count)
+		jobs_count = 1;
+
+	per_job = (s->l->areas + jobs_count - 1) / jobs_count;
+	for (i = 0, area = 0; i < jobs_count && area < s->l->areas; i++, area += per_job) {
+		jobs[i].s = s;
+		jobs[i].area = area;
+		jobs[i].area_end = (s->l->areas - area) < per_job ? s->l->areas : area + per_job;
+		jobs[i].r = 0;
+	}
+	jobs_count = i;
+
+	if (pthread_mutex_init(&s->lock, NULL))
+		return -EINVAL;
+
+	log_dbg(cd, "Writing integrity tags for %" PRIu64 " areas using %u threads.",
+		s->l->areas, jobs_count);
+
+	/* The first job is processed by the calling thread */
+	for (i = 1; i < jobs_count; i++)
+		started[i] = !pthread_create(&jobs[i].thread, NULL, tags_job_run, &jobs[i]);
+
+	tags_job_run(&jobs[0]);
+
+	for (i = 1; i < jobs_count; i++) {
+		if (started[i])
+			pthread_join(jobs[i].thread, NULL);
+		else
+			tags_job_run(&jobs[i]);
+	}
+
+	pthread_mutex_destroy(&s->lock);
+
+	for (i = 0; i < jobs_count; i++) {
+		if (jobs[i].r && jobs[i].r != -EINTR)
+			return jobs[i].r;
+		if (jobs[i].r)
+			r = jobs[i].r;
+	}
+
+	return r;
+}
+
+struct tags_wipe_progress {
+	uint64_t size;
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr);
+	void *usrptr;
+};
+
+static int tags_wipe_progress(uint64_t size __attribute__((unused)), uint64_t offset, void *usrptr)
+{
+	struct tags_wipe_progress *p = usrptr;
+
+	return p->progress(p->size, offset, p->usrptr);
+}
+
+int INTEGRITY_init_tags(struct crypt_device *cd,
+			const struct crypt_params_integrity *params,
+			struct volume_key *vk,
+			struct volume_key *journal_crypt_key,
+			struct volume_key *journal_mac_key,
+			uint32_t sb_flags,
+			int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+			void *usrptr)
+{
+	struct device *device = crypt_data_device(cd);
+	struct integrity_layout *l;
+	struct tags_wipe_progress wp;
+	struct tags_shared s = {};
+	struct superblock sb;
+	uint64_t wipe_offset, wipe_length;
+	int r;
+
+	if (crypt_metadata_device(cd) != device)
+		return -ENOTSUP;
+
+	r = INTEGRITY_read_superblock(cd, device, 0, &sb);
+	if (r)
+		return r;
+
+	l = malloc(sizeof(*l));
+	if (!l)
+		return -ENOMEM;
+
+	r = tags_layout_init(cd, l, params, vk, &sb);
+	if (!r)
+		r = tags_probe_layout(cd, l, params, vk, journal_crypt_key,
+				      journal_mac_key, sb_flags);
+	if (r)
+		goto out;
+
+	/* Zero everything after journal, metadata runs included */
+	wipe_offset = tags_area_offset(l, 0);
+	wipe_length = tags_area_offset(l, l->areas - 1) - wipe_offset +
+		      ((l->metadata_run + tags_area_data_sectors(l, l->areas - 1)) << SECTOR_SHIFT);
+
+	s.l = l;
+	s.progress_base = wipe_length;
+	s.progress_size = wipe_length + (l->data_sectors << SECTOR_SHIFT);
+	s.progress = progress;
+	s.usrptr = usrptr;
+
+	wp.size = s.progress_size;
+	wp.progress = progress;
+	wp.usrptr = usrptr;
+
+	log_dbg(cd, "Zeroing integrity data area (0x%06" PRIx64 " - 0x%06" PRIx64").",
+		wipe_offset, wipe_offset + wipe_length);
+
+	r = crypt_wipe_device(cd, device, CRYPT_WIPE_ZERO, wipe_offset, wipe_length,
+			      1024 * 1024, progress ? tags_wipe_progress : NULL, &wp);
+	if (r) {
+		if (r != -EINTR)
+			log_err(cd, _("Cannot wipe device %s."), device_path(device));
+		goto out;
+	}
+
+	s.devfd = open(device_path(device), O_RDWR);
+	if (s.devfd < 0) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	r = tags_write(cd, &s);
+	if (!r && fdatasync(s.devfd))
+		r = -EIO;
+	close(s.devfd);
+
+	if (r && r != -EINTR)
+		log_err(cd, _("Cannot write integrity tags to device %s."), device_path(device));
+out:
+	crypt_safe_memzero(l, sizeof(*l));
+	free(l);
+	return r;
+}
+
+/*
+ * Informational benchmark of tag calculation (userspace crypto backend),
+ * one tag per sector_size block of the buffer.
+ */
+int INTEGRITY_benchmark_tags(struct crypt_device *cd, const char *integrity,
+			     struct volume_key *vk, uint32_t sector_size,
+			     char *buffer, size_t buffer_size, double *ms)
+{
+	struct integrity_layout *l;
+	struct integrity_hasher h;
+	struct timespec start, end;
+	char tag[TAGS_DIGEST_MAX];
+	size_t i;
+	int r;
+
+	if (sector_size < SECTOR_SIZE || sector_size % SECTOR_SIZE || buffer_size < sector_size)
+		return -EINVAL;
+
+	l = malloc(sizeof(*l));
+	if (!l)
+		return -ENOMEM;
+
+	r = tags_hash_init(cd, l, integrity, vk);
+	if (r < 0)
+		goto out;
+
+	l->tag_size = r;
+	l->sectors_per_block = sector_size >> SECTOR_SHIFT;
+
+	r = tags_hasher_init(&h, l);
+	if (r)
+		goto out;
+
+	if (clock_gettime(CLOCK_MONOTONIC_RAW, &start) < 0) {
+		r = -EINVAL;
+		goto out_hasher;
+	}
+
+	for (i = 0; !r && i + sector_size <= buffer_size; i += sector_size)
+		r = tags_sector_tag(&h, i >> SECTOR_SHIFT, &buffer[i], tag);
+
+	if (!r && clock_gettime(CLOCK_MONOTONIC_RAW, &end) < 0)
+		r = -EINVAL;
+
+	if (!r)
+		*ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / (1000.0 * 1000);
+out_hasher:
+	tags_hasher_destroy(&h);
+out:
+	crypt_safe_memzero(l, sizeof(*l));
+	free(l);
+	return r;
+}
+
+int INTEGRITY_recalculate_init(struct crypt_device *cd,
+			       struct volume_key *journal_mac_key,
+			       uint32_t *sb_flags)
+{
+	struct device *device = crypt_metadata_device(cd);
+	struct superblock sb;
+	int devfd, r;
+
+	r = INTEGRITY_read_superblock(cd, device, 0, &sb);
+	if (r)
+		return r;
+
+	/* Superblock is authenticated by journal MAC, kernel must update it itself */
+	if ((sb.flags & SB_FLAG_FIXED_HMAC) && journal_mac_key) {
+		log_err(cd, _("Lazy initialization is not supported with authenticated superblock."));
+		return -ENOTSUP;
+	}
+
+	/* Recalculation needs V2 superblock, the V1 layout is otherwise the same */
+	if (sb.version < SB_VERSION_2)
+		sb.version = SB_VERSION_2;
+	sb.flags |= SB_FLAG_RECALCULATING;
+	sb.recalc_sector = 0;
+
+	log_dbg(cd, "Marking INTEGRITY superblock on %s for recalculation.", device_path(device));
+
+	if (sb_flags)
+		*sb_flags = sb.flags;
+
+	sb.integrity_tag_size = htole16(sb.integrity_tag_size);
+	sb.journal_sections = htole32(sb.journal_sections);
+	sb.provided_data_sectors = htole64(sb.provided_data_sectors);
+	sb.recalc_sector = htole64(sb.recalc_sector);
+	sb.flags = htole32(sb.flags);
+
+	devfd = device_open(cd, device, O_RDWR);
+	if (devfd < 0)
+		return -EINVAL;
+
+	if (write_lseek_blockwise(devfd, device_block_size(cd, device),
+		device_alignment(device), &sb, sizeof(sb), 0) != sizeof(sb))
+		r = -EIO;
+
+	device_sync(cd, device);
+	return r;
+}
+
 int INTEGRITY_dump(struct crypt_device *cd, struct device *device, uint64_t offset)
 {
 	struct superblock sb;
@@ -372,5 +1142,5 @@ int INTEGRITY_format(struct crypt_device *cd,
 	if (r)
 		return r;
 
-	return dm_remove_device(cd, tmp_name, CRYPT_DEACTIVATE_FORCE);
+	return dm_remove_device(cd, tmp_name, CRYPT_DEACTIVATE_FORCE | DM_DEACTIVATE_PRIVATE);
 }
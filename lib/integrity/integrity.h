@@ -43,6 +43,9 @@ struct crypt_dm_active_device;
 #define SB_FLAG_FIXED_PADDING		(1 << 3) /* V4 only */
 #define SB_FLAG_FIXED_HMAC		(1 << 4) /* V5 only */
 
+#define SB_SECTORS	8
+#define SB_SALT_SIZE	16
+
 struct superblock {
 	uint8_t magic[8];
 	uint8_t version;
@@ -55,12 +58,31 @@ struct superblock {
 	uint8_t log2_blocks_per_bitmap_bit; /* V3 only */
 	uint8_t pad[2];
 	uint64_t recalc_sector; /* V2 only */
+	uint8_t pad2[8];
+	uint8_t salt[SB_SALT_SIZE]; /* V5 only */
 } __attribute__ ((packed));
 
 int INTEGRITY_read_sb(struct crypt_device *cd,
 		      struct crypt_params_integrity *params,
 		      uint32_t *flags);
 
+int INTEGRITY_init_tags(struct crypt_device *cd,
+			const struct crypt_params_integrity *params,
+			struct volume_key *vk,
+			struct volume_key *journal_crypt_key,
+			struct volume_key *journal_mac_key,
+			uint32_t sb_flags,
+			int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+			void *usrptr);
+
+int INTEGRITY_benchmark_tags(struct crypt_device *cd, const char *integrity,
+			     struct volume_key *vk, uint32_t sector_size,
+			     char *buffer, size_t buffer_size, double *ms);
+
+int INTEGRITY_recalculate_init(struct crypt_device *cd,
+			       struct volume_key *journal_mac_key,
+			       uint32_t *sb_flags);
+
 int INTEGRITY_dump(struct crypt_device *cd, struct device *device, uint64_t offset);
 
 int INTEGRITY_data_sectors(struct crypt_device *cd,
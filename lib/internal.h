@@ -43,6 +43,7 @@
 #include "utils_io.h"
 #include "crypto_backend/crypto_backend.h"
 #include "utils_storage_wrappers.h"
+#include "utils_trace.h"
 
 #include "libcryptsetup.h"
 
@@ -113,7 +114,10 @@ void device_release_excl(struct crypt_device *cd, struct device *device);
 void device_disable_direct_io(struct device *device);
 int device_is_identical(struct device *device1, struct device *device2);
 int device_is_rotational(struct device *device);
+int device_numa_node(struct device *device);
+int device_is_discardable(struct device *device);
 size_t device_alignment(struct device *device);
+void *device_alloc_buffer(struct device *device, size_t size);
 int device_direct_io(const struct device *device);
 int device_fallocate(struct device *device, uint64_t size);
 void device_sync(struct crypt_device *cd, struct device *device);
@@ -121,9 +125,12 @@ int device_check_size(struct crypt_device *cd,
 		      struct device *device,
 		      uint64_t req_offset, int falloc);
 void device_set_block_size(struct device *device, size_t size);
+size_t device_min_encryption_sector_size(struct crypt_device *cd, struct device *device);
 size_t device_optimal_encryption_sector_size(struct crypt_device *cd, struct device *device);
+void device_topology_invalidate(struct device *device);
 
 int device_open_locked(struct crypt_device *cd, struct device *device, int flags);
+void device_set_lockless_read(struct device *device, bool enable);
 int device_read_lock(struct crypt_device *cd, struct device *device);
 int device_write_lock(struct crypt_device *cd, struct device *device);
 void device_read_unlock(struct crypt_device *cd, struct device *device);
@@ -134,6 +141,7 @@ enum devcheck { DEV_OK = 0, DEV_EXCL = 1 };
 int device_check_access(struct crypt_device *cd,
 			struct device *device,
 			enum devcheck device_check);
+void device_prepare_batch(struct crypt_device **cds, struct device **devices, size_t count);
 int device_block_adjust(struct crypt_device *cd,
 			struct device *device,
 			enum devcheck device_check,
@@ -153,22 +161,70 @@ int create_or_reload_device_with_integrity(struct crypt_device *cd, const char *
 struct device *crypt_metadata_device(struct crypt_device *cd);
 struct device *crypt_data_device(struct crypt_device *cd);
 
+/* Reused per-device metadata buffers (LUKS2 header copies) */
+#define CRYPT_METADATA_BUFFERS 2
+void *crypt_metadata_buffer(struct crypt_device *cd, int idx, size_t size);
+void crypt_metadata_buffers_free(struct crypt_device *cd, int idx);
+
+/* Idle temporary dm-crypt storage wrappers, see crypt_storage_wrapper_destroy() */
+struct crypt_storage_wrapper **crypt_storage_wrapper_pool(struct crypt_device *cd);
+uint32_t *crypt_token_handlers_used(struct crypt_device *cd);
+char **crypt_keyslot_hint_path(struct crypt_device *cd);
+uint32_t *crypt_token_validated(struct crypt_device *cd, const char *uuid, uint64_t seqid);
+void crypt_lock_stats_add(struct crypt_device *cd, uint64_t wait_usec, bool contended, unsigned retries);
+void crypt_lock_stats_lockless_read(struct crypt_device *cd);
+
+/* Activation timing, see crypt_get_last_operation_stats() */
+typedef enum {
+	CRYPT_OP_TOKEN = 0,
+	CRYPT_OP_KDF,
+	CRYPT_OP_DM,
+	CRYPT_OP_UDEV
+} crypt_op_phase;
+uint64_t crypt_op_usec(void);
+void crypt_op_stats_add(struct crypt_device *cd, crypt_op_phase phase, uint64_t usec);
+uint32_t crypt_token_concurrent_timeout(struct crypt_device *cd);
+uint32_t crypt_token_timeout(struct crypt_device *cd);
+uint32_t crypt_volume_key_handoff_timeout(struct crypt_device *cd);
+void crypt_volume_key_handoff_enable(struct crypt_device *cd, bool enable);
+struct keyring_cache *crypt_keyring_cache(struct crypt_device *cd);
+int crypt_token_context_clone(struct crypt_device *cd, struct crypt_device **clone);
+
+/* Parallel passphrase unlock of more devices, see utils_activate_multi.c */
+int crypt_activate_unlocked_check(struct crypt_device *cd, const char *name, uint32_t flags);
+int crypt_unlock_volume_key(struct crypt_device *cd, int keyslot,
+	const char *passphrase, size_t passphrase_size,
+	uint32_t flags, struct volume_key **vk);
+int crypt_activate_unlocked(struct crypt_device *cd, const char *name,
+	int keyslot, struct volume_key *vk, uint32_t flags);
+
 int crypt_confirm(struct crypt_device *cd, const char *msg);
 
 char *crypt_lookup_dev(const char *dev_id);
 int crypt_dev_is_rotational(int major, int minor);
+int crypt_dev_is_discardable(int major, int minor);
+int crypt_dev_numa_node(int major, int minor);
 int crypt_dev_is_partition(const char *dev_path);
 char *crypt_get_partition_device(const char *dev_path, uint64_t offset, uint64_t size);
 char *crypt_get_base_device(const char *dev_path);
 uint64_t crypt_dev_partition_offset(const char *dev_path);
+int crypt_dev_io_stats(const char *dev_path, uint64_t *ios, uint64_t *ticks_ms);
 int lookup_by_disk_id(const char *dm_uuid);
 int lookup_by_sysfs_uuid_field(const char *dm_uuid);
 int crypt_uuid_cmp(const char *dm_uuid, const char *hdr_uuid);
 
 size_t crypt_getpagesize(void);
 unsigned crypt_cpusonline(void);
+unsigned crypt_threads_acquire(unsigned extra);
+void crypt_threads_release(unsigned extra);
 uint64_t crypt_getphysmemory_kb(void);
 
+bool crypt_numa_multinode(void);
+unsigned crypt_numa_cpus(int node);
+void crypt_numa_bind_thread(int node);
+void crypt_numa_bind_memory(void *buffer, size_t size, int node);
+int crypt_numa_node(struct crypt_device *cd, struct device *device);
+
 int init_crypto(struct crypt_device *ctx);
 
 #define log_dbg(c, x...) crypt_logf(c, CRYPT_LOG_DEBUG, x)
@@ -178,10 +234,12 @@ int init_crypto(struct crypt_device *ctx);
 
 int crypt_get_debug_level(void);
 
+int crypt_memlock_policy(int policy);
 int crypt_memlock_inc(struct crypt_device *ctx);
 int crypt_memlock_dec(struct crypt_device *ctx);
 
 int crypt_metadata_locking_enabled(void);
+int crypt_private_udev_sync_enabled(void);
 
 int crypt_random_init(struct crypt_device *ctx);
 int crypt_random_get(struct crypt_device *ctx, char *buf, size_t len, int quality);
@@ -201,6 +259,7 @@ int PLAIN_activate(struct crypt_device *cd,
 void *crypt_get_hdr(struct crypt_device *cd, const char *type);
 void crypt_set_luks2_reencrypt(struct crypt_device *cd, struct luks2_reencrypt *rh);
 struct luks2_reencrypt *crypt_get_luks2_reencrypt(struct crypt_device *cd);
+const char *crypt_get_reencrypt_journal(struct crypt_device *cd);
 
 int onlyLUKS2(struct crypt_device *cd);
 int onlyLUKS2mask(struct crypt_device *cd, uint32_t mask);
@@ -233,9 +292,17 @@ static inline uint64_t compact_version(uint16_t major, uint16_t minor, uint16_t
 
 int kernel_version(uint64_t *kversion);
 
+bool crypt_serialize_enabled(struct crypt_device *cd);
 int crypt_serialize_lock(struct crypt_device *cd);
 void crypt_serialize_unlock(struct crypt_device *cd);
 
+/* Memory budget of memory-hard PBKDF, see crypt_pbkdf_memory_budget() */
+struct crypt_pbkdf_memory;
+int crypt_pbkdf_memory_acquire(struct crypt_device *cd, uint64_t memory_kb,
+			       struct crypt_pbkdf_memory **mem);
+void crypt_pbkdf_memory_release(struct crypt_device *cd, struct crypt_pbkdf_memory *mem);
+uint64_t crypt_pbkdf_memory_budget_kb(void);
+
 bool crypt_string_in(const char *str, char **list, size_t list_size);
 int crypt_strcmp(const char *a, const char *b);
 int crypt_compare_dm_devices(struct crypt_device *cd,
@@ -27,6 +27,15 @@
  *
  * For more verbose examples of LUKS related use cases,
  * please read @ref index "examples".
+ *
+ * Thread safety: a @e crypt_device context must be used by one thread
+ * at a time, but operations on distinct contexts can run concurrently
+ * in different threads. Shared state (crypto backend, RNG, device-mapper
+ * backend) is initialized only once, on first use from any thread.
+ * Process wide settings (default log callback set with @e NULL context,
+ * debug level, crypt_set_* calls without context) should be configured
+ * before threads are started. Activation batch
+ * (@link crypt_activate_batch_begin @endlink) is per thread.
  */
 
 #ifndef _LIBCRYPTSETUP_H
@@ -112,6 +121,38 @@ int crypt_init_by_name_and_header(struct crypt_device **cd,
  */
 int crypt_init_by_name(struct crypt_device **cd, const char *name);
 
+/** Do not load on-disk header, use active device table and DM UUID only */
+#define CRYPT_INIT_BY_NAME_NO_HEADER (UINT32_C(1) << 0)
+
+/**
+ * Initialize crypt device handle from provided active device name
+ * with additional flags.
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @param cd returns crypt device handle for active device
+ * @param name name of active crypt device
+ * @param header_device optional device containing on-disk header
+ * 	  (@e NULL if it the same as underlying device on there is no on-disk header)
+ * @param flags @e CRYPT_INIT_BY_NAME_NO_HEADER or @e 0
+ *
+ * @note With @e CRYPT_INIT_BY_NAME_NO_HEADER the LUKS or BITLK header is not read
+ * 	 during initialization. @link crypt_get_type @endlink returns type from
+ * 	 DM UUID, status and deactivation use only the active device table.
+ * 	 The header is loaded on first call that needs it (for example
+ * 	 @link crypt_get_uuid @endlink, @link crypt_dump @endlink,
+ * 	 @link crypt_get_data_offset @endlink, @link crypt_get_metadata_size @endlink,
+ * 	 @link crypt_get_sector_size @endlink, @link crypt_reencrypt_status @endlink,
+ * 	 activation, keyslot, token or persistent flags operations).
+ * 	 If this delayed load fails, context behaves as initialized without header.
+ *
+ * @sa crypt_init_by_name_and_header
+ */
+int crypt_init_by_name_flags(struct crypt_device **cd,
+	const char *name,
+	const char *header_device,
+	uint32_t flags);
+
 /**
  * Release crypt device context and used memory.
  *
@@ -255,6 +296,26 @@ void crypt_set_rng_type(struct crypt_device *cd, int rng_type);
  */
 int crypt_get_rng_type(struct crypt_device *cd);
 
+/** CRYPT_NUMA_NODE_AUTO - use NUMA node of the data device (default) */
+#define CRYPT_NUMA_NODE_AUTO -1
+/** CRYPT_NUMA_NODE_NONE - do not bind worker threads and buffers */
+#define CRYPT_NUMA_NODE_NONE -2
+
+/**
+ * Set NUMA node for worker threads and bulk buffers of parallel
+ * storage transforms (reencryption, wipe, verity hash and FEC computation).
+ *
+ * @param cd crypt device handle
+ * @param node NUMA node number, @e CRYPT_NUMA_NODE_AUTO or @e CRYPT_NUMA_NODE_NONE
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note With @e CRYPT_NUMA_NODE_AUTO workers are bound only on multi-node systems
+ *	 and only if the data device reports its node in sysfs.
+ * @note Calling thread is never bound, only additional workers are.
+ */
+int crypt_set_numa_node(struct crypt_device *cd, int node);
+
 /**
  * PBKDF parameters.
  */
@@ -295,6 +356,30 @@ struct crypt_pbkdf_type {
 int crypt_set_pbkdf_type(struct crypt_device *cd,
 	 const struct crypt_pbkdf_type *pbkdf);
 
+/** coordinate PBKDF memory budget with other processes using lock files */
+#define CRYPT_PBKDF_BUDGET_GLOBAL (UINT32_C(1) << 0)
+
+/**
+ * Set total memory budget for concurrent memory-hard PBKDF (Argon2)
+ * keyslot unlocks.
+ *
+ * Keyslot unlock waits (in queue) until memory cost of its PBKDF fits
+ * in the budget together with other running unlocks. An unlock bigger
+ * than the whole budget runs alone. Keyslot PBKDF parameters are never changed.
+ *
+ * @param memory_kb budget in kilobytes, @e 0 disables budget (default)
+ * @param flags @e CRYPT_PBKDF_BUDGET_GLOBAL to share the budget with other
+ *        processes (the same budget is expected in all processes), otherwise
+ *        only unlocks in this process are coordinated
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note The setting is global on the library level.
+ * @note Global budget uses lock files in locking directory,
+ *       it does not apply if metadata locking is disabled.
+ */
+int crypt_pbkdf_memory_budget(uint64_t memory_kb, uint32_t flags);
+
 /**
  * Get PBKDF (Password-Based Key Derivation Algorithm) parameters.
  *
@@ -349,10 +434,31 @@ void crypt_set_iteration_time(struct crypt_device *cd, uint64_t iteration_time_m
  * @returns Value indicating whether the memory is locked (function can be called multiple times).
  *
  * @note Only root can do this.
- * @note It locks/unlocks all process memory, not only crypt context.
+ * @note With @e CRYPT_MEMORY_LOCK_ALL policy (default) it locks/unlocks all process
+ *	 memory, not only crypt context.
  */
 int crypt_memory_lock(struct crypt_device *cd, int lock);
 
+/** CRYPT_MEMORY_LOCK_ALL - lock all process memory with mlockall (default) */
+#define CRYPT_MEMORY_LOCK_ALL 0
+/** CRYPT_MEMORY_LOCK_SECRETS - lock only memory holding secrets */
+#define CRYPT_MEMORY_LOCK_SECRETS 1
+
+/**
+ * Set process-wide policy for @link crypt_memory_lock @endlink.
+ *
+ * @param policy @e CRYPT_MEMORY_LOCK_ALL or @e CRYPT_MEMORY_LOCK_SECRETS
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note With @e CRYPT_MEMORY_LOCK_SECRETS only safe memory allocations
+ *	 (@link crypt_safe_alloc @endlink), volume keys and derived keys are locked
+ *	 and excluded from core dumps; KDF work areas and data buffers stay unlocked.
+ *	 Such allocations are locked regardless of policy (best effort).
+ * @note Policy change applies on the next first lock of memory.
+ */
+int crypt_set_memory_lock_policy(int policy);
+
 /**
  * Set global lock protection for on-disk metadata (file-based locking).
  *
@@ -367,6 +473,96 @@ int crypt_memory_lock(struct crypt_device *cd, int lock);
  */
 int crypt_metadata_locking(struct crypt_device *cd, int enable);
 
+/**
+ * Set udev synchronization for private (temporary) helper devices.
+ *
+ * Helper devices (reencryption hotzone and overlay devices, temporary
+ * dm-integrity device used for wipe or TCRYPT chained segments) have all
+ * udev rules disabled. With synchronization disabled the library does not
+ * wait for udev to process them and device nodes are created directly
+ * by libdevmapper.
+ *
+ * @param cd crypt device handle, can be @e NULL
+ * @param enable 0 to disable udev synchronization for helper devices
+ * 	  otherwise enable it (default)
+ *
+ * @returns @e 0 on success or negative errno value otherwise.
+ *
+ * @note The switch is global on the library level.
+ * @note Devices visible to user (activated without private flag) are
+ * 	 always synchronized with udev if supported.
+ */
+int crypt_private_udev_sync(struct crypt_device *cd, int enable);
+
+/**
+ * Set global persistent cache for PBKDF benchmark results.
+ *
+ * @param cd crypt device handle, can be @e NULL
+ * @param path absolute path to the cache file or @e NULL to disable cache (default)
+ * @param ttl_sec seconds after which cached result is benchmarked again, @e 0 means no expiry
+ *
+ * @returns @e 0 on success or negative errno value otherwise.
+ *
+ * @note Results are keyed by PBKDF type, hash, requested time and memory cost,
+ *	 threads, key size, CPU model and crypto backend version.
+ * @note The switch is global on the library level.
+ */
+int crypt_pbkdf_cache(struct crypt_device *cd, const char *path, uint32_t ttl_sec);
+
+/**
+ * Set host-local cache of last successfully opened LUKS2 keyslots.
+ *
+ * If keyslot is not specified, the keyslot last opened for the device UUID
+ * is tried first within its priority class, avoiding failed PBKDF runs
+ * on devices with many keyslots.
+ *
+ * @param cd crypt device handle, @e NULL sets global cache used by all contexts
+ *        without own cache
+ * @param path absolute path to the cache file or @e NULL to disable cache (default),
+ *        for context with @e cd set @e NULL means the global cache is used
+ *
+ * @returns @e 0 on success or negative errno value otherwise.
+ *
+ * @note The file contains only device UUIDs and keyslot numbers, no secrets.
+ */
+int crypt_keyslot_hint_cache(struct crypt_device *cd, const char *path);
+
+/**
+ * Enable or disable global in-process cache of verified LUKS2 volume keys.
+ *
+ * Repeated verification of the same volume key against the same PBKDF2
+ * key digest (keyslot open, token unlock, reencryption load) is then skipped.
+ *
+ * @param cd crypt device handle, can be @e NULL
+ * @param enable @e 1 to enable, @e 0 to disable and wipe cache (default)
+ *
+ * @returns @e 0 on success or negative errno value otherwise.
+ *
+ * @note Cache stores only keyed hashes (random per-process key) of digest
+ *	 parameters and verified volume keys, nothing is stored on disk.
+ * @note The switch is global on the library level.
+ */
+int crypt_digest_cache(struct crypt_device *cd, int enable);
+
+/**
+ * Enable or disable process-wide cache of parsed LUKS2 headers.
+ *
+ * Repeated @link crypt_load @endlink of the same device then reads only
+ * the primary binary header; if it matches the cached one (sequence id, salt
+ * and checksum), the parsed and validated metadata are reused.
+ *
+ * @param cd crypt device handle, can be @e NULL
+ * @param enable flag enabling or disabling (and flushing) the cache (disabled by default)
+ *
+ * @returns @e 0 on success or negative errno value otherwise.
+ *
+ * @note Any header write through libcryptsetup invalidates the device entry.
+ * @note With cache hit, the secondary header is not checked (and not
+ *	 auto-recovered) during load.
+ * @note The switch is global on the library level.
+ */
+int crypt_luks2_header_cache(struct crypt_device *cd, int enable);
+
 /**
  * Set metadata header area sizes. This applies only to LUKS2.
  * These values limit amount of metadata anf number of supportable keyslots.
@@ -518,6 +714,18 @@ struct crypt_params_verity {
 #define CRYPT_VERITY_CREATE_HASH (1 << 2)
 /** Root hash signature required for activation */
 #define CRYPT_VERITY_ROOT_HASH_SIGNATURE (1 << 3)
+/** Verify hash area (but not data) in userspace before activation */
+#define CRYPT_VERITY_CHECK_HASH_ONLY (1 << 4)
+
+/**
+ * Range of data blocks for dm-verity hash update or verification.
+ *
+ * @see crypt_verity_update, crypt_verity_verify
+ */
+struct crypt_verity_range {
+	uint64_t offset; /**< first data block */
+	uint64_t length; /**< number of data blocks */
+};
 
 /**
  *
@@ -735,6 +943,28 @@ int crypt_set_label(struct crypt_device *cd,
  */
 int crypt_volume_key_keyring(struct crypt_device *cd, int enable);
 
+/**
+ * Enable handoff of unlocked LUKS2 volume key via kernel session keyring.
+ *
+ * After a keyslot is unlocked by passphrase during activation, resume
+ * or reencryption initialization, the verified volume key is stored in
+ * session keyring (accessible only by possessor) for the given time.
+ * Subsequent such operation on the same device (another process in the same
+ * session with handoff enabled) then uses the key without running keyslot KDF.
+ * A key from keyring is always verified against the LUKS2 digest first.
+ *
+ * @param cd crypt device handle
+ * @param timeout key lifetime in keyring in seconds, @e 0 disables handoff (default)
+ *
+ * @returns @e 0 on success or negative errno value otherwise.
+ *
+ * @note With handoff, the passphrase is not checked if the volume key is
+ *       already present in keyring. Passphrase check without activation
+ *       (@e NULL name) never uses the handoff.
+ * @note Only LUKS2 devices are supported.
+ */
+int crypt_volume_key_handoff(struct crypt_device *cd, uint32_t timeout);
+
 /**
  * Load crypt device parameters from on-disk header.
  *
@@ -754,6 +984,37 @@ int crypt_load(struct crypt_device *cd,
 	const char *requested_type,
 	void *params);
 
+/** Secondary LUKS2 binary header must match primary, otherwise full load is used */
+#define CRYPT_LUKS_PROBE_STRICT (UINT32_C(1) << 0)
+
+/**
+ * Fast probe for LUKS header without loading metadata.
+ *
+ * Only binary header(s) are checked: magic, version, header size, checksum algorithm
+ * and UUID. For LUKS2 primary header the checksum is verified too, LUKS2 JSON
+ * metadata are not parsed nor validated and no device lock is taken.
+ *
+ * @param cd crypt device handle (not loaded)
+ * @param requested_type @link crypt-type @endlink (LUKS1 or LUKS2) or @e NULL for both
+ * @param flags @e CRYPT_LUKS_PROBE_STRICT or @e 0
+ * @param type on success set to @e CRYPT_LUKS1 or @e CRYPT_LUKS2 (can be @e NULL)
+ * @param uuid buffer for header UUID (can be @e NULL)
+ * @param uuid_size size of @e uuid buffer
+ *
+ * @returns 0 if LUKS header was found or negative errno value otherwise.
+ *
+ * @note With @e CRYPT_LUKS_PROBE_STRICT and primary and secondary LUKS2 binary
+ *       headers that do not match (or damaged or wiped primary header), full
+ *       @link crypt_load @endlink of LUKS2 metadata is used instead and the context
+ *       is then loaded.
+ */
+int crypt_luks_probe(struct crypt_device *cd,
+	const char *requested_type,
+	uint32_t flags,
+	const char **type,
+	char *uuid,
+	size_t uuid_size);
+
 /**
  * Try to repair crypt device LUKS on-disk header if invalid.
  *
@@ -911,6 +1172,34 @@ int crypt_keyslot_add_by_passphrase(struct crypt_device *cd,
 	const char *new_passphrase,
 	size_t new_passphrase_size);
 
+/**
+ * Add several key slots using provided passphrase at once.
+ *
+ * PBKDF is benchmarked only once, new keyslot keys are derived in parallel
+ * and LUKS2 metadata are written only once for all new keyslots.
+ *
+ * @pre @e cd contains initialized and formatted LUKS2 device context
+ *
+ * @param cd crypt device handle
+ * @param passphrase passphrase used to unlock volume key
+ * @param passphrase_size size of passphrase (binary data)
+ * @param new_passphrases passphrases for new keyslots
+ * @param new_passphrase_sizes sizes of @e new_passphrases (binary data)
+ * @param keyslots requested keyslots or @e CRYPT_ANY_SLOT, allocated keyslot numbers on return
+ * @param count number of new keyslots
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note On failure no keyslot is added.
+ */
+int crypt_keyslot_add_by_passphrase_batch(struct crypt_device *cd,
+	const char *passphrase,
+	size_t passphrase_size,
+	const char * const *new_passphrases,
+	const size_t *new_passphrase_sizes,
+	int *keyslots,
+	size_t count);
+
 /**
  * Change defined key slot using provided passphrase.
  *
@@ -1160,6 +1449,103 @@ int crypt_get_active_device(struct crypt_device *cd,
  */
 uint64_t crypt_get_active_integrity_failures(struct crypt_device *cd,
 	const char *name);
+
+/**
+ * Corruption monitor of active dm-verity and dm-integrity devices.
+ */
+struct crypt_monitor;
+
+/**
+ * Start monitoring of active dm-verity and dm-integrity devices.
+ *
+ * @param monitor pointer to new monitor handle
+ * @param cd crypt device handle (can be @e NULL)
+ * @param names names of active dm-verity or dm-integrity devices
+ * @param count number of names
+ * @param event callback called with new failure count of device
+ *        (for dm-verity @e 1 if device is corrupted, @e 0 otherwise)
+ * @param usrptr provided identification in callback
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Already detected failures are reported from this call.
+ */
+int crypt_monitor_init(struct crypt_monitor **monitor,
+	struct crypt_device *cd,
+	const char * const *names,
+	size_t count,
+	void (*event)(const char *name, uint64_t failures, void *usrptr),
+	void *usrptr);
+
+/**
+ * Wait for device-mapper event or timeout and report changed failure counts.
+ *
+ * @param monitor monitor handle
+ * @param timeout_ms timeout in milliseconds, negative value to wait for event only
+ *
+ * @return number of devices with changed failure count or negative errno value otherwise.
+ *
+ * @note Not all corruptions raise device-mapper event, status is read
+ *       after timeout as well. Without kernel event support (device-mapper
+ *       ioctl 4.37) devices are only polled (every second for negative timeout).
+ */
+int crypt_monitor_wait(struct crypt_monitor *monitor, int timeout_ms);
+
+/**
+ * Release monitor handle.
+ *
+ * @param monitor monitor handle
+ */
+void crypt_monitor_free(struct crypt_monitor *monitor);
+
+/**
+ * Get progress of in-kernel integrity tags recalculation.
+ *
+ * @param cd crypt device handle (can be @e NULL)
+ * @param name name of active device
+ * @param recalc_sector first sector with not yet calculated tags
+ * @param size size of device data area in sectors
+ *
+ * @return @e 0 on success or negative errno value otherwise
+ *
+ * @note If no recalculation is running, @e recalc_sector is set to @e size.
+ */
+int crypt_get_active_integrity_recalc(struct crypt_device *cd,
+	const char *name,
+	uint64_t *recalc_sector,
+	uint64_t *size);
+
+/**
+ * Progress of in-kernel integrity tags recalculation.
+ */
+struct crypt_integrity_recalc_progress {
+	uint64_t recalc_sector; /**< first sector with not yet calculated tags */
+	uint64_t size; /**< size of device data area in sectors */
+	uint64_t timestamp_ms; /**< monotonic time of the sample in milliseconds */
+	double sectors_per_sec; /**< recalculation rate estimate (0 if unknown) */
+};
+
+/**
+ * Get progress and rate estimate of in-kernel integrity tags recalculation.
+ *
+ * The rate is calculated against the previous sample if @e progress contains
+ * one (non-zero @e timestamp_ms from the previous call), otherwise
+ * the status is sampled twice with @e sample_ms delay (if non-zero).
+ *
+ * @param cd crypt device handle (can be @e NULL)
+ * @param name name of active device
+ * @param sample_ms delay between status samples in milliseconds (or 0)
+ * @param progress progress structure (in/out)
+ *
+ * @return @e 0 on success or negative errno value otherwise
+ *
+ * @note If no recalculation is running, @e recalc_sector is set to @e size
+ * and @e sectors_per_sec is @e 0.
+ */
+int crypt_get_integrity_recalc_progress(struct crypt_device *cd,
+	const char *name,
+	uint32_t sample_ms,
+	struct crypt_integrity_recalc_progress *progress);
 /** @} */
 
 /**
@@ -1247,6 +1633,54 @@ int crypt_activate_by_passphrase(struct crypt_device *cd,
 	size_t passphrase_size,
 	uint32_t flags);
 
+/**
+ * Device for @link crypt_activate_by_passphrase_multi @endlink.
+ */
+struct crypt_activate_volume {
+	struct crypt_device *cd; /**< device context with loaded header */
+	const char *name;        /**< name of device to create, if @e NULL only check passphrase */
+	int keyslot;             /**< requested keyslot to check or CRYPT_ANY_SLOT */
+	uint32_t flags;          /**< activation flags */
+
+	int result;              /**< unlocked key slot number or negative errno (output) */
+	uint64_t wait_usec;      /**< time waiting for PBKDF memory budget or worker thread (output) */
+	uint64_t unlock_usec;    /**< time of keyslot unlock (output) */
+	uint64_t activate_usec;  /**< time of device activation (output) */
+};
+
+/**
+ * Activate (or check) more devices using the same passphrase.
+ *
+ * Keyslots of all devices are unlocked in parallel. PBKDF of a keyslot is
+ * started only if the sum of memory costs of running PBKDFs
+ * fits in the memory budget, otherwise the keyslot waits in queue
+ * (a keyslot bigger than the whole budget runs alone).
+ * Devices are then activated sequentially with one udev synchronization
+ * (see @link crypt_activate_batch_begin @endlink).
+ *
+ * @param volumes array of devices, result and timing of every device is set on return
+ * @param count number of devices
+ * @param passphrase passphrase used to unlock volume keys
+ * @param passphrase_size size of @e passphrase
+ * @param memory_kb PBKDF memory budget in kilobytes, @e 0 means budget set by
+ *        @link crypt_pbkdf_memory_budget @endlink or half of physical memory
+ * @param threads maximal number of parallel unlocks, @e 0 means number of online CPUs
+ *
+ * @return @e 0 if all devices were activated, otherwise the first error
+ *         (negative errno value), see @e result of every device.
+ *
+ * @note Every device must use its own context, contexts must not be used
+ *       by other threads during the call.
+ * @note The PBKDF runs for every device separately (keyslots use different salts),
+ *       only the waiting for them is shared.
+ */
+int crypt_activate_by_passphrase_multi(struct crypt_activate_volume *volumes,
+	size_t count,
+	const char *passphrase,
+	size_t passphrase_size,
+	uint64_t memory_kb,
+	uint32_t threads);
+
 /**
  * Activate device or check using key file.
  *
@@ -1362,6 +1796,107 @@ int crypt_activate_by_keyring(struct crypt_device *cd,
 	int keyslot,
 	uint32_t flags);
 
+/**
+ * Activate device using volume key stored in kernel keyring.
+ *
+ * The key is verified against metadata digest (as in
+ * @link crypt_activate_by_volume_key @endlink), keyslot PBKDF is not used.
+ *
+ * @param cd crypt device handle
+ * @param name name of device to create, if @e NULL only check volume key in keyring
+ * @param key_description kernel keyring key description library should look
+ *        for volume key in
+ * @param flags activation flags
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Volume key must be stored in 'user' key type (logon keys cannot be read
+ *       from userspace) and the key has to be reachable for process context
+ *       on behalf of which this function is called.
+ */
+int crypt_activate_by_keyring_volume_key(struct crypt_device *cd,
+	const char *name,
+	const char *key_description,
+	uint32_t flags);
+
+/**
+ * Start batch of device activations.
+ *
+ * Until @link crypt_activate_batch_end @endlink is called, device-mapper
+ * devices created by any activation call (or removed by any deactivation call)
+ * in the calling thread share one udev synchronization cookie and the library does
+ * not wait for udev to process each device separately.
+ *
+ * @return @e 0 on success or negative errno value otherwise
+ *         (@e -EBUSY if batch is already started).
+ *
+ * @note Device nodes of devices activated in batch may not exist
+ *       until @link crypt_activate_batch_end @endlink returns.
+ * @note Batch state is per thread, activations running in other
+ *       threads are not part of the batch.
+ */
+int crypt_activate_batch_begin(void);
+
+/**
+ * Finish batch of device activations started by
+ * @link crypt_activate_batch_begin @endlink and wait once for udev
+ * to process all devices activated in the batch.
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_activate_batch_end(void);
+
+/**
+ * Deactivate (remove) several active devices with one udev synchronization.
+ *
+ * Devices still used by other devices in the list are deactivated after
+ * their holders, devices that are no longer active (for example helper devices
+ * already removed with their parent) are skipped.
+ *
+ * @param names array of active device names
+ * @param count number of names
+ * @param flags deactivation flags, see @link crypt_deactivate_by_name @endlink
+ *
+ * @return @e 0 if all devices were deactivated, otherwise the first error
+ *         (negative errno value).
+ *
+ * @note Devices are removed in one activation batch,
+ *       see @link crypt_activate_batch_begin @endlink.
+ */
+int crypt_deactivate_by_names(const char * const *names, size_t count, uint32_t flags);
+
+/**
+ * Timing of the last metadata load and activation, all times in microseconds.
+ */
+struct crypt_operation_stats {
+	uint64_t load_usec;   /**< last @link crypt_load @endlink call */
+	uint64_t total_usec;  /**< whole last activation call */
+	uint64_t token_usec;  /**< token handlers open (secret retrieval) */
+	uint64_t kdf_usec;    /**< keyslot PBKDF */
+	uint32_t kdf_count;   /**< number of PBKDF runs (tried keyslots, parallel batch counts once) */
+	uint64_t dm_usec;     /**< device-mapper table load, without udev wait */
+	uint64_t udev_usec;   /**< udev synchronization wait */
+};
+
+/**
+ * Get timing breakdown of the last crypt_load and crypt_activate_* call.
+ *
+ * Timing is reset by @link crypt_load @endlink (all values) and by every
+ * activation call (all values except @e load_usec).
+ *
+ * @param cd crypt device handle
+ * @param stats timing @link crypt_operation_stats @endlink
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note udev wait of devices created in batch (@link crypt_activate_batch_begin @endlink)
+ *       is not counted, it happens at the end of the batch.
+ * @note With concurrent token open (@link crypt_token_concurrent_open @endlink)
+ *       @e token_usec includes keyslot unlock done in the token job.
+ */
+int crypt_get_last_operation_stats(struct crypt_device *cd,
+	struct crypt_operation_stats *stats);
+
 /** lazy deactivation - remove once last user releases it */
 #define CRYPT_DEACTIVATE_DEFERRED (1 << 0)
 /** force deactivation - if the device is busy, it is replaced by error device */
@@ -1462,6 +1997,40 @@ typedef enum {
  */
 crypt_status_info crypt_status(struct crypt_device *cd, const char *name);
 
+/**
+ * Active device entry, see @link crypt_list_active_devices @endlink.
+ */
+struct crypt_active_device_entry {
+	char *name;                      /**< active device name */
+	char *type;                      /**< device type from DM-UUID (e.g. LUKS2, PLAIN) */
+	crypt_status_info status;        /**< @e CRYPT_ACTIVE or @e CRYPT_BUSY */
+	struct crypt_active_device info; /**< runtime attributes */
+};
+
+/**
+ * List all active devices managed by cryptsetup (with CRYPT- DM-UUID prefix).
+ *
+ * @param cd crypt device handle, can be @e NULL
+ * @param entries allocated array of active device entries
+ * @param count number of entries in array
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Devices are listed in one device-mapper context, volume keys are never read.
+ * @note Returned array must be released by @link crypt_free_active_devices @endlink.
+ */
+int crypt_list_active_devices(struct crypt_device *cd,
+	struct crypt_active_device_entry **entries,
+	size_t *count);
+
+/**
+ * Release array returned by @link crypt_list_active_devices @endlink.
+ *
+ * @param entries array of active device entries
+ * @param count number of entries in array
+ */
+void crypt_free_active_devices(struct crypt_active_device_entry *entries, size_t count);
+
 /**
  * Dump text-formatted information about crypt or verity device to log output.
  *
@@ -1602,9 +2171,133 @@ int crypt_get_verity_info(struct crypt_device *cd,
 	struct crypt_params_verity *vp);
 
 /**
- * Get device parameters for INTEGRITY device.
+ * Update VERITY hash area after data in given ranges changed.
  *
- * @param cd crypt device handle
+ * Only hash blocks covering changed data blocks and their ancestors up
+ * to the root are recalculated, the rest of existing hash area is trusted.
+ * FEC (if configured) is recalculated completely.
+ *
+ * @param cd crypt device handle (VERITY device type with data device set)
+ * @param ranges array of changed data block ranges
+ * @param ranges_count number of items in @e ranges
+ * @param root_hash buffer for new root hash
+ * @param root_hash_size size of @e root_hash buffer
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_verity_update(struct crypt_device *cd,
+	const struct crypt_verity_range *ranges,
+	size_t ranges_count,
+	char *root_hash,
+	size_t root_hash_size);
+
+/**
+ * Verify VERITY data area and hash tree in userspace.
+ *
+ * Unlike activation with @e CRYPT_VERITY_CHECK_HASH flag, verification
+ * does not stop on the first mismatch; all corrupted data blocks are reported.
+ * A data block is corrupted if its digest or a hash block on the path
+ * to the root does not match.
+ *
+ * @param cd crypt device handle (VERITY device type with data device set)
+ * @param ranges array of data block ranges to verify or @e NULL to verify whole data area
+ * @param ranges_count number of items in @e ranges
+ * @param bad_ranges if not @e NULL, allocated array of corrupted data block ranges
+ *        is returned here, it must be released by free()
+ * @param bad_ranges_count number of items in @e bad_ranges
+ * @param root_hash expected root hash
+ * @param root_hash_size size of @e root_hash
+ *
+ * @return @e 0 on success, @e -EPERM if corrupted data blocks were found,
+ * @e -EFAULT if root hash does not match or negative errno value otherwise.
+ */
+int crypt_verity_verify(struct crypt_device *cd,
+	const struct crypt_verity_range *ranges,
+	size_t ranges_count,
+	struct crypt_verity_range **bad_ranges,
+	size_t *bad_ranges_count,
+	const char *root_hash,
+	size_t root_hash_size);
+
+/**
+ * Repair VERITY data and hash area in place using FEC device.
+ *
+ * All Reed-Solomon blocks are decoded in parallel. Every corrected data and hash
+ * block is checked against the hash tree first, only if all of them match,
+ * corrected blocks are written back to data, hash and FEC devices.
+ * The whole tree is then verified.
+ *
+ * @param cd crypt device handle (VERITY device type with data and FEC device set)
+ * @param repaired if not @e NULL, allocated array of repaired block ranges is returned
+ *        here, it must be released by free(); blocks below data size are data
+ *        device blocks, following blocks are hash area blocks (from hash offset)
+ * @param repaired_count number of items in @e repaired
+ * @param root_hash expected root hash
+ * @param root_hash_size size of @e root_hash
+ *
+ * @return @e 0 on success, @e -EPERM if corrupted blocks remain or cannot be repaired
+ * (devices are not modified if a corrected block does not match the hash tree),
+ * @e -EBUSY if the device is active,
+ * @e -EFAULT if root hash does not match or negative errno value otherwise.
+ *
+ * @note Device must not be active, data are modified in place.
+ */
+int crypt_verity_repair(struct crypt_device *cd,
+	struct crypt_verity_range **repaired,
+	size_t *repaired_count,
+	const char *root_hash,
+	size_t root_hash_size);
+
+/**
+ * Initialize integrity tags of formatted dm-integrity device lazily.
+ * The superblock is marked for recalculation, kernel then calculates
+ * all tags in background on (every) activation until it is finished.
+ * The device can be used immediately, but it is fully integrity protected
+ * only after the recalculation is finished.
+ * This replaces the initial wipe of the device after @link crypt_format @endlink.
+ *
+ * @param cd crypt device handle
+ *
+ * @return @e 0 on success or negative errno value otherwise
+ *
+ * @note Only standalone @e CRYPT_INTEGRITY type with internal hash is supported.
+ *       Keyed internal hash (hmac) is rejected with @e -EINVAL.
+ *
+ * @see crypt_get_active_integrity_recalc
+ */
+int crypt_integrity_lazy_init(struct crypt_device *cd);
+
+/**
+ * Initialize integrity tags of formatted dm-integrity device in userspace.
+ * The data area is zeroed and tags for zeroed blocks are calculated
+ * in parallel and written directly to the device metadata area.
+ * The layout is verified against in-kernel dm-integrity on a few probe
+ * blocks first.
+ * This replaces the initial wipe of the device after @link crypt_format @endlink.
+ *
+ * @param cd crypt device handle
+ * @param integrity_key integrity key (for keyed hash), can be @e NULL
+ * @param integrity_key_size size of @e integrity_key
+ * @param progress function can interrupt initialization by returning non-zero status
+ * @param usrptr provided identification in callback
+ *
+ * @return @e 0 on success, @e -ENOTSUP if the configuration cannot be
+ * initialized in userspace (and device must be wiped through kernel)
+ * or negative errno value otherwise.
+ *
+ * @note Only standalone @e CRYPT_INTEGRITY type with internal hash
+ * and without separate metadata device is supported.
+ */
+int crypt_integrity_init_tags(struct crypt_device *cd,
+	const char *integrity_key,
+	size_t integrity_key_size,
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+	void *usrptr);
+
+/**
+ * Get device parameters for INTEGRITY device.
+ *
+ * @param cd crypt device handle
  * @param ip verity device info
  *
  * @e 0 on success or negative errno value otherwise.
@@ -1647,6 +2340,129 @@ int crypt_benchmark(struct crypt_device *cd,
 	double *encryption_mbs,
 	double *decryption_mbs);
 
+/**
+ * Informational benchmark for dm-integrity tags calculation.
+ * The tags are calculated by the crypto backend in userspace,
+ * the same way as they are stored on dm-integrity device.
+ *
+ * @param cd crypt device handle
+ * @param integrity integrity algorithm (e.g. "crc32c", "sha256" or "hmac(sha256)")
+ * @param integrity_key_size size of integrity key in bytes (for keyed hash)
+ * @param sector_size sector size in bytes (one tag per sector)
+ * @param buffer_size size of data buffer in bytes used in test
+ * @param tags_mbs measured data throughput in MiB/s
+ *
+ * @return @e 0 on success, @e -ENOTSUP if the algorithm is not supported
+ * or negative errno value otherwise.
+ *
+ * @note If buffer_size is too small and time cannot be properly measured,
+ *       -ERANGE is returned.
+ */
+int crypt_benchmark_integrity(struct crypt_device *cd,
+	const char *integrity,
+	size_t integrity_key_size,
+	uint32_t sector_size,
+	size_t buffer_size,
+	double *tags_mbs);
+
+/** Run storage benchmark through temporary dm-crypt device */
+#define CRYPT_BENCHMARK_DMCRYPT (UINT32_C(1) << 0)
+
+/**
+ * Informational benchmark for ciphers with storage semantics.
+ * Unlike @link crypt_benchmark @endlink, data are processed in sectors with IV
+ * generator, optionally in several threads or through temporary
+ * dm-crypt device (mapped over dm-zero device, no storage IO).
+ *
+ * @param cd crypt device handle
+ * @param cipher (e.g. "aes")
+ * @param cipher_mode including IV generator (e.g. "xts-plain64")
+ * @param volume_key_size size of volume key in bytes
+ * @param sector_size encryption sector size in bytes (0 means 512 bytes)
+ * @param threads number of userspace threads (ignored for dm-crypt)
+ * @param buffer_size size of data buffer in bytes (multiple of sector size)
+ * @param flags CRYPT_BENCHMARK_* flags
+ * @param encryption_mbs measured encryption speed in MiB/s
+ * @param decryption_mbs measured decryption speed in MiB/s
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note dm-crypt benchmark requires privileges to create device-mapper devices.
+ */
+int crypt_benchmark_storage(struct crypt_device *cd,
+	const char *cipher,
+	const char *cipher_mode,
+	size_t volume_key_size,
+	uint32_t sector_size,
+	uint32_t threads,
+	size_t buffer_size,
+	uint32_t flags,
+	double *encryption_mbs,
+	double *decryption_mbs);
+
+/**
+ * Measure dm-crypt throughput for encryption sector sizes 512 to 4096 bytes
+ * and select the fastest one usable on the data device (not smaller than
+ * its logical block size and aligned to device size). A bigger sector size
+ * is selected only if it is noticeably faster.
+ *
+ * @param cd crypt device handle
+ * @param data_device path to data device or @e NULL for data device in context
+ * @param cipher (e.g. "aes")
+ * @param cipher_mode including IV generator (e.g. "xts-plain64")
+ * @param volume_key_size size of volume key in bytes
+ * @param sector_size selected encryption sector size in bytes
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note The measurement runs through temporary dm-crypt device, see
+ *       @link crypt_benchmark_storage @endlink with @e CRYPT_BENCHMARK_DMCRYPT.
+ *       If dm-crypt does not support sector size option, 512 bytes is returned
+ *       (or @e -ENOTSUP if the device logical block size is bigger).
+ * @note Only LUKS2 can use other than 512-byte sectors, the call fails
+ *       with @e -EINVAL if a different format is already set in context.
+ */
+int crypt_benchmark_sector_size(struct crypt_device *cd,
+	const char *data_device,
+	const char *cipher,
+	const char *cipher_mode,
+	size_t volume_key_size,
+	uint32_t *sector_size);
+
+/** choose latency profile for non-rotational and throughput for rotational device */
+#define CRYPT_PERF_PROFILE_AUTO       0
+/** minimize latency of single small reads */
+#define CRYPT_PERF_PROFILE_LATENCY    1
+/** maximize throughput of parallel sequential reads */
+#define CRYPT_PERF_PROFILE_THROUGHPUT 2
+
+/**
+ * Probe dm-crypt performance flags on the data device in context and select
+ * the best combination of @e CRYPT_ACTIVATE_NO_READ_WORKQUEUE,
+ * @e CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE, @e CRYPT_ACTIVATE_SAME_CPU_CRYPT and
+ * @e CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS for the profile. Every candidate
+ * supported by dm-crypt is measured for a short time through temporary private
+ * read-only mapping. Default flags (no flag) are kept unless a candidate is
+ * noticeably better.
+ *
+ * @param cd crypt device handle with loaded device type
+ * @param volume_key verified volume key
+ * @param volume_key_size size of volume key in bytes
+ * @param profile @e CRYPT_PERF_PROFILE_* value
+ * @param flags selected @e CRYPT_ACTIVATE_* performance flags
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note The probe only reads data, at most first 1 GiB of data area is used.
+ * @note Write workqueue flag follows read workqueue flag, writes are never probed.
+ * @note Devices with integrity protection are not supported.
+ */
+int crypt_benchmark_perf_flags(struct crypt_device *cd,
+	const char *volume_key,
+	size_t volume_key_size,
+	uint32_t profile,
+	uint32_t *flags);
+
 /**
  * Informational benchmark for PBKDF.
  *
@@ -1671,6 +2487,38 @@ int crypt_benchmark_pbkdf(struct crypt_device *cd,
 	size_t volume_key_size,
 	int (*progress)(uint32_t time_ms, void *usrptr),
 	void *usrptr);
+
+/**
+ * Measure PBKDF with fixed cost parameters (no calibration).
+ *
+ * @param cd crypt device handle
+ * @param pbkdf PBKDF parameters, @e iterations, @e max_memory_kb and
+ *	  @e parallel_threads are used as they are
+ * @param password password for benchmark
+ * @param password_size size of password
+ * @param salt salt for benchmark
+ * @param salt_size size of salt
+ * @param volume_key_size output volume key size
+ * @param warmup number of runs before measurement (not counted)
+ * @param samples number of measured runs
+ * @param min_us shortest measured run in microseconds
+ * @param avg_us average measured run in microseconds
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Time is wall clock time (Argon2 can use more threads).
+ */
+int crypt_benchmark_pbkdf_cost(struct crypt_device *cd,
+	const struct crypt_pbkdf_type *pbkdf,
+	const char *password,
+	size_t password_size,
+	const char *salt,
+	size_t salt_size,
+	size_t volume_key_size,
+	uint32_t warmup,
+	uint32_t samples,
+	uint64_t *min_us,
+	uint64_t *avg_us);
 /** @} */
 
 /**
@@ -1733,6 +2581,29 @@ crypt_keyslot_priority crypt_keyslot_get_priority(struct crypt_device *cd, int k
  */
 int crypt_keyslot_set_priority(struct crypt_device *cd, int keyslot, crypt_keyslot_priority priority);
 
+/**
+ * Set keyslot hint for activation by token (LUKS2)
+ *
+ * The hint is short truncated HMAC of the passphrase stored in keyslot
+ * metadata. On activation by token assigned to several keyslots, keyslots
+ * with matching hint are tried first, so KDF of other keyslots is not run.
+ *
+ * @param cd crypt device handle
+ * @param keyslot keyslot number
+ * @param passphrase passphrase provided by token (verified against keyslot),
+ *        @e NULL removes the hint
+ * @param passphrase_size size of @e passphrase (at least 32 bytes)
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note The hint allows to check passphrase candidates without KDF,
+ *       use it only for random secrets generated by tokens, never for
+ *       passphrases chosen by user.
+ * @note The hint is removed when the keyslot passphrase is changed.
+ */
+int crypt_keyslot_set_token_hint(struct crypt_device *cd, int keyslot,
+	const char *passphrase, size_t passphrase_size);
+
 /**
  * Get number of keyslots supported for device type.
  *
@@ -1759,6 +2630,27 @@ int crypt_keyslot_area(struct crypt_device *cd,
 	uint64_t *offset,
 	uint64_t *length);
 
+/**
+ * Move LUKS2 keyslot areas towards the start of the keyslots area.
+ * This merges free space left by removed keyslots into one larger gap
+ * (usable for example as reencryption resilience area).
+ *
+ * Each area is first copied to free space not overlapping its current
+ * location, then the metadata is committed and only after that the old
+ * area is wiped, so an interrupted run never loses a keyslot.
+ * All keyslots area space not referenced by a keyslot is wiped at the start
+ * and at the end of each run, so a stale copy left by an interrupted run
+ * is destroyed by the next one.
+ *
+ * @param cd crypt device handle
+ *
+ * @return number of moved keyslot areas or negative errno value otherwise.
+ *
+ * @note Devices with unmet requirements (e.g. reencryption in progress)
+ *       are refused.
+ */
+int crypt_keyslot_areas_compact(struct crypt_device *cd);
+
 /**
  * Get size (in bytes) of stored key in particular keyslot.
  * Use for LUKS2 unbound keyslots, for other keyslots it is the same as @ref crypt_get_volume_key_size
@@ -1956,6 +2848,12 @@ typedef enum {
  *
  * @note A @e progress callback can interrupt wipe process by returning non-zero code.
  *
+ * @note A non-rotational device can be wiped by several threads in parallel.
+ *       The @e progress callback can then be called from any of these threads,
+ *       but never concurrently (calls are serialized by the library).
+ *       Reported offsets are the total amount wiped so far, not a position
+ *       of the last written block.
+ *
  * @note If the error values is -EIO or -EINTR, some part of the device could
  *       be overwritten. Other error codes (-EINVAL, -ENOMEM) means that no IO was performed.
  */
@@ -2234,6 +3132,60 @@ typedef void (*crypt_token_dump_func) (struct crypt_device *cd, const char *json
  */
 typedef const char * (*crypt_token_version_func) (void);
 
+/**
+ * Token handler asynchronous open start function prototype.
+ * This function starts retrieving password from a token and returns file
+ * descriptor the library waits on for input (POLLIN) before it calls
+ * @link crypt_token_open_finish_func @endlink.
+ *
+ * @param cd crypt device handle
+ * @param token token id
+ * @param pin passphrase (or PIN) to unlock token (may be binary data), @e NULL if not set
+ * @param pin_size size of @e pin
+ * @param usrptr user data in @link crypt_activate_by_token @endlink
+ * @param timeout_ms time before the library cancels open, @e 0 if not limited
+ * @param ctx returned private context of the open operation
+ * @param fd returned file descriptor to poll
+ *
+ * @return @e 0 if open started or negative errno value otherwise
+ *
+ * @note Arguments @e cd, @e pin and @e usrptr are valid until the open
+ *       operation is finished or cancelled.
+ */
+typedef int (*crypt_token_open_async_func) (
+	struct crypt_device *cd,
+	int token,
+	const char *pin,
+	size_t pin_size,
+	void *usrptr,
+	uint32_t timeout_ms,
+	void **ctx,
+	int *fd);
+
+/**
+ * Token handler asynchronous open finish function prototype.
+ * This function is called every time the file descriptor is readable.
+ *
+ * @param ctx private context of the open operation
+ * @param buffer returned allocated buffer with password
+ * @param buffer_len length of the buffer
+ *
+ * @return @e 0 on success, @e -EAGAIN if more input is needed (the file
+ *         descriptor is polled again) or negative errno value otherwise
+ *
+ * @note Unless @e -EAGAIN is returned, the handler releases @e ctx.
+ */
+typedef int (*crypt_token_open_finish_func) (void *ctx, char **buffer, size_t *buffer_len);
+
+/**
+ * Token handler asynchronous open cancel function prototype.
+ * This function aborts the open operation (for example after timeout)
+ * and releases @e ctx.
+ *
+ * @param ctx private context of the open operation
+ */
+typedef void (*crypt_token_cancel_func) (void *ctx);
+
 /**
  * Token handler
  */
@@ -2254,6 +3206,21 @@ typedef struct  {
  */
 int crypt_token_register(const crypt_token_handler *handler);
 
+/**
+ * Unload external token handler plugin.
+ *
+ * External token handlers (libcryptsetup-token-<name>.so) are loaded once
+ * and shared by all contexts in process. Handler that is used by any active
+ * context cannot be unloaded. Unloading all handlers also forgets
+ * previously failed load attempts (so newly installed plugins are found).
+ *
+ * @param name token type name or @e NULL for all unused handlers
+ *
+ * @return @e 0 on success, @e -EBUSY if handler is in use, @e -ENOENT if
+ * handler is not loaded or negative errno value otherwise.
+ */
+int crypt_token_unload_external(const char *name);
+
 /** ABI version for external token in libcryptsetup-token-<name>.so */
 #define CRYPT_TOKEN_ABI_VERSION1    "CRYPTSETUP_TOKEN_1.0"
 
@@ -2265,6 +3232,14 @@ int crypt_token_register(const crypt_token_handler *handler);
 #define CRYPT_TOKEN_ABI_DUMP        "cryptsetup_token_dump"
 #define CRYPT_TOKEN_ABI_VERSION     "cryptsetup_token_version"
 
+/** ABI version for asynchronous open in external token */
+#define CRYPT_TOKEN_ABI_VERSION2    "CRYPTSETUP_TOKEN_1.1"
+
+/** ABI exported symbols for asynchronous open (all or none) */
+#define CRYPT_TOKEN_ABI_OPEN_ASYNC  "cryptsetup_token_open_async"
+#define CRYPT_TOKEN_ABI_OPEN_FINISH "cryptsetup_token_open_finish"
+#define CRYPT_TOKEN_ABI_CANCEL      "cryptsetup_token_cancel"
+
 /**
  * Activate device or check key using a token.
  *
@@ -2348,6 +3323,44 @@ int crypt_activate_by_token_pin(struct crypt_device *cd,
 	size_t pin_size,
 	void *usrptr,
 	uint32_t flags);
+
+/**
+ * Set concurrent open of tokens for activation with CRYPT_ANY_TOKEN.
+ *
+ * With concurrent open enabled, all eligible tokens are opened in parallel
+ * threads and the first token that unlocks a keyslot is used. Tokens still
+ * running when the timeout expires are not waited for; their passphrase
+ * buffers are released in the background.
+ *
+ * @param cd crypt device handle
+ * @param timeout_ms timeout in milliseconds, @e 0 disables concurrent open (default)
+ *
+ * @returns @e 0 on success or negative errno value otherwise.
+ *
+ * @note Token handlers run with a private context (with the same LUKS2 metadata)
+ *       and the @e usrptr argument of activation is not passed to them.
+ * @note Handlers run in other threads, keys in thread keyring of caller
+ *       are not available for them.
+ * @note ETIMEDOUT errno means no token unlocked a keyslot before timeout.
+ */
+int crypt_token_concurrent_open(struct crypt_device *cd, uint32_t timeout_ms);
+
+/**
+ * Set timeout for token open.
+ *
+ * Token handlers with asynchronous open (see @link CRYPT_TOKEN_ABI_OPEN_ASYNC @endlink)
+ * are cancelled if the secret is not retrieved before timeout,
+ * the activation then fails with ETIMEDOUT errno for such token.
+ *
+ * @param cd crypt device handle
+ * @param timeout_ms timeout in milliseconds for each token, @e 0 means no timeout (default)
+ *
+ * @returns @e 0 on success or negative errno value otherwise.
+ *
+ * @note Timeout cannot be applied on handlers with synchronous open only.
+ * @note With concurrent open, timeout of concurrent open is used instead.
+ */
+int crypt_token_open_timeout(struct crypt_device *cd, uint32_t timeout_ms);
 /** @} */
 
 /**
@@ -2367,6 +3380,19 @@ int crypt_activate_by_token_pin(struct crypt_device *cd,
 #define CRYPT_REENCRYPT_RESUME_ONLY        (1 << 2)
 /** Run reencryption recovery only. (in) */
 #define CRYPT_REENCRYPT_RECOVERY           (1 << 3)
+/** Adapt hotzone size to measured throughput and device latency, online only. (in) */
+#define CRYPT_REENCRYPT_ADAPTIVE_HOTZONE   (1 << 4)
+/** Do not encrypt unallocated areas (holes in backing file), encryption without data shift only. (in) */
+#define CRYPT_REENCRYPT_SKIP_UNALLOCATED   (1 << 5)
+/** Use zero-copy splice for kernel (AF_ALG) cipher, effective only if not run as root. (in) */
+#define CRYPT_REENCRYPT_KCAPI_ZEROCOPY     (1 << 6)
+/**
+ * Allow "crc32c" checksum resilience hash. (in)
+ * Releases without crc32c support can neither resume nor recover such reencryption.
+ * The 32-bit checksum may fail to tell old and new data of a sector apart
+ * (about 1 in 2^32 per sector), such sector is then recovered incorrectly.
+ */
+#define CRYPT_REENCRYPT_ALLOW_CRC32C       (1 << 7)
 
 /**
  * Reencryption direction
@@ -2392,7 +3418,7 @@ struct crypt_params_reencrypt {
 	crypt_reencrypt_mode_info mode;           /**< Reencryption mode, immutable after first init. */
 	crypt_reencrypt_direction_info direction; /**< Reencryption direction, immutable after first init. */
 	const char *resilience;                   /**< Resilience mode: "none", "checksum", "journal" or "shift" (only "shift" is immutable after init) */
-	const char *hash;                         /**< Used hash for "checksum" resilience type, ignored otherwise. */
+	const char *hash;                         /**< Used hash for "checksum" resilience type, ignored otherwise ("crc32c" requires @e CRYPT_REENCRYPT_ALLOW_CRC32C). */
 	uint64_t data_shift;                      /**< Used in "shift" mode, must be non-zero, immutable after first init. */
 	uint64_t max_hotzone_size;                /**< Exact hotzone size for "none" mode. Maximum hotzone size for "checksum" and "journal" modes. */
 	uint64_t device_size;			  /**< Reencrypt only initial part of the data device. */
@@ -2472,6 +3498,121 @@ int crypt_reencrypt(struct crypt_device *cd,
 		    int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
 		    void *usrptr);
 
+/**
+ * Limit data reencryption speed.
+ *
+ * The limit is enforced between reencryption hotzones. It can be set after
+ * reencryption initialization and also changed while reencryption runs
+ * (from @e progress callback of @link crypt_reencrypt @endlink).
+ *
+ * @param cd crypt device handle
+ * @param max_throughput maximal throughput in bytes per second or @e 0 for no limit
+ * @param max_iops maximal number of hotzone I/O operations per second or @e 0 for no limit
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_reencrypt_set_rate_limit(struct crypt_device *cd,
+	uint64_t max_throughput,
+	uint32_t max_iops);
+
+/**
+ * Set periodic metadata commit for reencryption with "none" resilience.
+ *
+ * Without resilience the metadata is updated only when reencryption stops.
+ * If reencryption is interrupted by crash, the progress since start (or resume)
+ * is lost and the whole area processed in meantime is in unknown state.
+ * With commit interval the data are synced and the metadata written after
+ * the specified amount of data or time, only the area since last commit is lost.
+ *
+ * @param cd crypt device handle
+ * @param bytes commit after this amount of reencrypted data or @e 0
+ * @param msec commit after this time in milliseconds or @e 0
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Setting is ignored for other resilience types, these commit
+ *       metadata after every hotzone.
+ */
+int crypt_reencrypt_set_commit_interval(struct crypt_device *cd,
+	uint64_t bytes,
+	uint32_t msec);
+
+/**
+ * Use separate device (or file) for "journal" resilience instead of
+ * reencryption keyslot area in LUKS2 metadata.
+ *
+ * Hotzone can be as large as the journal device (without its first 4 KiB
+ * header block). The device path is stored in reencryption keyslot and it is
+ * used later for resume and crash recovery. Set it before reencryption
+ * initialization or load; for already initialized reencryption the setting
+ * overrides the stored path (for example if device node name changed).
+ *
+ * @param cd crypt device handle
+ * @param path path to journal device or @e NULL to use keyslot area,
+ *        the device must exist, relative path is stored as absolute one
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note The journal device must not be the data or metadata device, its content
+ *       is overwritten. It contains old data of the last hotzone, for encryption
+ *       of unencrypted device it is plaintext.
+ */
+int crypt_reencrypt_set_journal_device(struct crypt_device *cd, const char *path);
+
+/** number of buckets in suspend window histogram */
+#define CRYPT_REENCRYPT_SUSPEND_BUCKETS 24
+
+/**
+ * Device suspend windows (time from suspend to resume) during online reencryption.
+ * Bucket @e i of histogram counts windows shorter than 2^i microseconds
+ * (and not counted in lower bucket), the last bucket counts all longer windows.
+ */
+struct crypt_reencrypt_suspend_stats {
+	uint64_t count;    /**< number of suspend windows */
+	uint64_t total_ns; /**< cumulative suspend time */
+	uint64_t max_ns;   /**< longest suspend window */
+	uint64_t hist[CRYPT_REENCRYPT_SUSPEND_BUCKETS]; /**< windows histogram */
+};
+
+/**
+ * Reencryption cumulative per-phase counters.
+ * Times are in nanoseconds, sizes in bytes.
+ *
+ * @note Caller must set @e struct_size before calling
+ *       @link crypt_reencrypt_get_stats @endlink, members beyond it are not filled.
+ */
+struct crypt_reencrypt_stats {
+	size_t struct_size;        /**< sizeof(struct crypt_reencrypt_stats) known to caller */
+	uint64_t hotzones;         /**< number of processed hotzones */
+	uint64_t read_ns;          /**< hotzone read */
+	uint64_t read_bytes;
+	uint64_t resilience_ns;    /**< resilience (checksum or journal) metadata write */
+	uint64_t resilience_bytes;
+	uint64_t decrypt_ns;       /**< hotzone decryption */
+	uint64_t encrypt_ns;       /**< hotzone encryption (not with dm-crypt wrapper) */
+	uint64_t write_ns;         /**< hotzone write */
+	uint64_t write_bytes;
+	uint64_t datasync_ns;      /**< data device sync */
+	uint64_t metadata_ns;      /**< LUKS2 metadata commit */
+	uint64_t dm_ns;            /**< device-mapper reload and resume (online only) */
+	struct crypt_reencrypt_suspend_stats overlay_suspend; /**< active device table swap (online only) */
+	struct crypt_reencrypt_suspend_stats hotzone_suspend; /**< I/O to hotzone blocked (online only) */
+};
+
+/**
+ * Get reencryption performance counters.
+ *
+ * Counters are available while reencryption context exists, for example
+ * in @e progress callback of @link crypt_reencrypt @endlink.
+ *
+ * @param cd crypt device handle
+ * @param stats counters @link crypt_reencrypt_stats @endlink with @e struct_size set
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_reencrypt_get_stats(struct crypt_device *cd,
+	struct crypt_reencrypt_stats *stats);
+
 /**
  * Reencryption status info
  */
@@ -2494,6 +3635,178 @@ crypt_reencrypt_info crypt_reencrypt_status(struct crypt_device *cd,
 		struct crypt_params_reencrypt *params);
 /** @} */
 
+/**
+ * @defgroup crypt-async Asynchronous operations
+ * Long running operations started in library worker thread
+ * @addtogroup crypt-async
+ * @{
+ */
+
+/**
+ * Asynchronous operation handle.
+ */
+struct crypt_async;
+
+/**
+ * Asynchronous operation state.
+ *
+ * @note Caller must set @e struct_size before calling
+ *       @link crypt_async_status @endlink, members beyond it are not filled.
+ */
+struct crypt_async_status {
+	size_t struct_size; /**< sizeof(struct crypt_async_status) known to caller */
+	int done;          /**< non-zero if operation finished */
+	int result;        /**< operation return value, @e -EINPROGRESS while running */
+	uint64_t size;     /**< size reported by last progress (wipe and reencryption) */
+	uint64_t offset;   /**< offset reported by last progress (wipe and reencryption) */
+	uint64_t elapsed_usec; /**< time since operation start (or total time) */
+	struct crypt_reencrypt_stats reencrypt_stats; /**< counters of last reencryption progress */
+};
+
+/**
+ * Start @link crypt_activate_by_passphrase @endlink in worker thread.
+ *
+ * @param job pointer to new operation handle
+ * @param cd crypt device handle
+ * @param name name of device to create, if @e NULL only check passphrase
+ * @param keyslot requested keyslot to check or @e CRYPT_ANY_SLOT
+ * @param passphrase passphrase used to unlock volume key (copied)
+ * @param passphrase_size size of @e passphrase
+ * @param flags activation flags
+ *
+ * @return @e 0 if operation started or negative errno value otherwise.
+ */
+int crypt_async_activate_by_passphrase(struct crypt_async **job,
+	struct crypt_device *cd,
+	const char *name,
+	int keyslot,
+	const char *passphrase,
+	size_t passphrase_size,
+	uint32_t flags);
+
+/**
+ * Start @link crypt_format @endlink in worker thread.
+ *
+ * @param job pointer to new operation handle
+ * @param cd crypt device handle
+ * @param type type of device (optional params struct must be of this type)
+ * @param cipher (e.g. "aes")
+ * @param cipher_mode including IV specification (e.g. "xts-plain")
+ * @param uuid requested UUID or @e NULL if it should be generated
+ * @param volume_key pre-generated volume key or @e NULL if it should be generated
+ * @param volume_key_size size of volume key in bytes
+ * @param params crypt type specific parameters
+ *
+ * @return @e 0 if operation started or negative errno value otherwise.
+ *
+ * @note Strings and volume key are copied, @e params must remain valid
+ *       until the operation is finished.
+ */
+int crypt_async_format(struct crypt_async **job,
+	struct crypt_device *cd,
+	const char *type,
+	const char *cipher,
+	const char *cipher_mode,
+	const char *uuid,
+	const char *volume_key,
+	size_t volume_key_size,
+	void *params);
+
+/**
+ * Start @link crypt_wipe @endlink in worker thread.
+ *
+ * @param job pointer to new operation handle
+ * @param cd crypt device handle
+ * @param dev_path path to device to wipe or @e NULL if data device should be used
+ * @param pattern selected wipe pattern
+ * @param offset offset on device (in bytes)
+ * @param length length of area to be wiped (in bytes)
+ * @param wipe_block_size used block for wiping (one step) (in bytes)
+ * @param flags wipe flags
+ *
+ * @return @e 0 if operation started or negative errno value otherwise.
+ */
+int crypt_async_wipe(struct crypt_async **job,
+	struct crypt_device *cd,
+	const char *dev_path,
+	crypt_wipe_pattern pattern,
+	uint64_t offset,
+	uint64_t length,
+	size_t wipe_block_size,
+	uint32_t flags);
+
+/**
+ * Start @link crypt_reencrypt @endlink in worker thread.
+ *
+ * Reencryption must be initialized before, see
+ * @link crypt_reencrypt_init_by_passphrase @endlink.
+ *
+ * @param job pointer to new operation handle
+ * @param cd crypt device handle
+ *
+ * @return @e 0 if operation started or negative errno value otherwise.
+ */
+int crypt_async_reencrypt(struct crypt_async **job, struct crypt_device *cd);
+
+/**
+ * Get event file descriptor of asynchronous operation.
+ *
+ * The descriptor (eventfd) is readable after every progress update
+ * and when the operation finishes. It can be used in poll or epoll,
+ * it is reset by @link crypt_async_status @endlink.
+ *
+ * @param job operation handle
+ *
+ * @return file descriptor or negative errno value otherwise.
+ *
+ * @note The descriptor is owned by the handle, it must not be closed.
+ */
+int crypt_async_fd(struct crypt_async *job);
+
+/**
+ * Get state of asynchronous operation.
+ *
+ * @param job operation handle
+ * @param status operation state @link crypt_async_status @endlink
+ *        with @e struct_size set
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_async_status(struct crypt_async *job, struct crypt_async_status *status);
+
+/**
+ * Request cancellation of asynchronous operation.
+ *
+ * Wipe and reencryption are interrupted at the next progress update.
+ * Interrupted wipe finishes with an error, interrupted reencryption
+ * finishes with @e 0 and remains in clean state to be resumed later.
+ *
+ * @param job operation handle
+ *
+ * @return @e 0 on success, @e -EALREADY if operation already finished,
+ *         @e -ENOTSUP if operation cannot be interrupted (activation, format)
+ *         or negative errno value otherwise.
+ */
+int crypt_async_cancel(struct crypt_async *job);
+
+/**
+ * Wait for asynchronous operation to finish.
+ *
+ * @param job operation handle
+ *
+ * @return operation return value.
+ */
+int crypt_async_wait(struct crypt_async *job);
+
+/**
+ * Cancel (if possible), wait for and release asynchronous operation.
+ *
+ * @param job operation handle
+ */
+void crypt_async_free(struct crypt_async *job);
+
+/** @} */
+
 /**
  * @defgroup crypt-memory Safe memory helpers functions
  * @addtogroup crypt-memory
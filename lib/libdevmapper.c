@@ -25,8 +25,12 @@
 #include <stdbool.h>
 #include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
 #include <libdevmapper.h>
+#include <linux/dm-ioctl.h>
 #include <uuid/uuid.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #ifdef HAVE_SYS_SYSMACROS_H
 # include <sys/sysmacros.h>     /* for major, minor */
@@ -48,11 +52,29 @@ static bool _dm_crypt_checked = false;
 static bool _dm_verity_checked = false;
 static bool _dm_integrity_checked = false;
 
-static int _quiet_log = 0;
+/* Per thread, probing versions must not silence errors in other threads */
+static __thread int _quiet_log = 0;
 static uint32_t _dm_flags = 0;
 
-static struct crypt_device *_context = NULL;
+/*
+ * Probed versions are shared by all contexts in the process.
+ * Mask of target types for which target module load and version list
+ * was already done, the list is repeated only if a new module can appear.
+ */
+static uint32_t _dm_targets_probed = 0;
+static pthread_mutex_t _dm_versions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Context for libdevmapper log callback, set in the thread running DM call */
+static __thread struct crypt_device *_context = NULL;
 static int _dm_use_count = 0;
+/* Contexts can be released in token open worker threads */
+static pthread_mutex_t _dm_use_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Activation batch (per thread), created devices share one udev cookie */
+static __thread bool _dm_batch = false;
+static __thread uint32_t _dm_batch_cookie = 0;
+/* Time spent in udev wait in this thread, see dm_create_device() */
+static __thread uint64_t _dm_udev_usec = 0;
 
 /* Check if we have DM flag to instruct kernel to force wipe buffers */
 #if !HAVE_DECL_DM_TASK_SECURE_DATA
@@ -64,14 +86,34 @@ static int dm_task_secure_data(struct dm_task *dmt) { return 1; }
 #define CRYPT_TEMP_UDEV_FLAGS	DM_UDEV_DISABLE_SUBSYSTEM_RULES_FLAG | \
 				DM_UDEV_DISABLE_DISK_RULES_FLAG | \
 				DM_UDEV_DISABLE_OTHER_RULES_FLAG
+#define CRYPT_NOSYNC_UDEV_FLAGS	CRYPT_TEMP_UDEV_FLAGS | \
+				DM_UDEV_DISABLE_DM_RULES_FLAG
 #define _dm_task_set_cookie	dm_task_set_cookie
 #define _dm_udev_wait		dm_udev_wait
+/*
+ * Udev flags without cookie (no semaphore to wait for), the device node
+ * is then created (or removed) directly by libdevmapper for this task only.
+ */
+static int _dm_task_set_udev_flags(struct dm_task *dmt, uint16_t flags)
+{
+	return dm_task_set_event_nr(dmt, (uint32_t)flags << DM_UDEV_FLAGS_SHIFT);
+}
 #else
 #define CRYPT_TEMP_UDEV_FLAGS	0
+#define CRYPT_NOSYNC_UDEV_FLAGS	0
 static int _dm_task_set_cookie(struct dm_task *dmt, uint32_t *cookie, uint16_t flags) { return 0; }
 static int _dm_udev_wait(uint32_t cookie) { return 0; };
+static int _dm_task_set_udev_flags(struct dm_task *dmt, uint16_t flags) { return 1; }
 #endif
 
+static void _dm_udev_wait_timed(uint32_t cookie)
+{
+	uint64_t start = crypt_op_usec();
+
+	(void)_dm_udev_wait(cookie);
+	_dm_udev_usec += crypt_op_usec() - start;
+}
+
 static int _dm_use_udev(void)
 {
 #ifdef USE_UDEV /* cannot be enabled if devmapper is too old */
@@ -81,6 +123,17 @@ static int _dm_use_udev(void)
 #endif
 }
 
+/*
+ * Private helper devices can skip udev synchronization completely.
+ * All udev rules are disabled for them and device node is created
+ * (and removed) directly by libdevmapper, no udev cookie is waited for.
+ * This is set per task (no global libdevmapper state is changed).
+ */
+static bool _dm_private_nosync(bool private)
+{
+	return private && !crypt_private_udev_sync_enabled() && _dm_use_udev();
+}
+
 __attribute__((format(printf, 4, 5)))
 static void set_dm_error(int level,
 			 const char *file __attribute__((unused)),
@@ -278,12 +331,19 @@ static int _dm_check_versions(struct crypt_device *cd, dm_target_type target_typ
 	unsigned dm_maj, dm_min, dm_patch;
 	int r = 0;
 
+	if ((target_type == DM_LINEAR) || (target_type == DM_ZERO))
+		return 1;
+
+	pthread_mutex_lock(&_dm_versions_lock);
+
 	if ((target_type == DM_CRYPT	 && _dm_crypt_checked) ||
 	    (target_type == DM_VERITY    && _dm_verity_checked) ||
 	    (target_type == DM_INTEGRITY && _dm_integrity_checked) ||
-	    (target_type == DM_LINEAR) || (target_type == DM_ZERO) ||
-	    (_dm_crypt_checked && _dm_verity_checked && _dm_integrity_checked))
+	    (_dm_crypt_checked && _dm_verity_checked && _dm_integrity_checked) ||
+	    (_dm_ioctl_checked && (_dm_targets_probed & (1 << target_type)))) {
+		pthread_mutex_unlock(&_dm_versions_lock);
 		return 1;
+	}
 
 	/* Shut up DM while checking */
 	_quiet_log = 1;
@@ -341,50 +401,79 @@ static int _dm_check_versions(struct crypt_device *cd, dm_target_type target_typ
 			_dm_use_udev() ? "en" : "dis");
 
 	_dm_ioctl_checked = true;
+	_dm_targets_probed |= (1 << target_type);
 out:
 	if (dmt)
 		dm_task_destroy(dmt);
 
 	_quiet_log = 0;
+	pthread_mutex_unlock(&_dm_versions_lock);
 	return r;
 }
 
+/*
+ * Device create can load target module that was not available
+ * during previous probe, only then the version list is repeated.
+ */
+static void _dm_check_versions_created(struct crypt_device *cd, dm_target_type target_type)
+{
+	if (target_type >= DM_UNKNOWN)
+		return;
+
+	pthread_mutex_lock(&_dm_versions_lock);
+	if (!(target_type == DM_CRYPT	 && _dm_crypt_checked) &&
+	    !(target_type == DM_VERITY	 && _dm_verity_checked) &&
+	    !(target_type == DM_INTEGRITY && _dm_integrity_checked))
+		_dm_targets_probed &= ~(1 << target_type);
+	pthread_mutex_unlock(&_dm_versions_lock);
+
+	_dm_check_versions(cd, target_type);
+}
+
 int dm_flags(struct crypt_device *cd, dm_target_type target, uint32_t *flags)
 {
+	int r = -ENODEV;
+
 	_dm_check_versions(cd, target);
+
+	pthread_mutex_lock(&_dm_versions_lock);
 	*flags = _dm_flags;
 
 	if (target == DM_UNKNOWN &&
 	    _dm_crypt_checked && _dm_verity_checked && _dm_integrity_checked)
-		return 0;
-
-	if ((target == DM_CRYPT	    && _dm_crypt_checked) ||
+		r = 0;
+	else if ((target == DM_CRYPT	 && _dm_crypt_checked) ||
 	    (target == DM_VERITY    && _dm_verity_checked) ||
 	    (target == DM_INTEGRITY && _dm_integrity_checked) ||
 	    (target == DM_LINEAR) || (target == DM_ZERO)) /* nothing to check */
-		return 0;
+		r = 0;
+	pthread_mutex_unlock(&_dm_versions_lock);
 
-	return -ENODEV;
+	return r;
 }
 
 /* This doesn't run any kernel checks, just set up userspace libdevmapper */
 void dm_backend_init(struct crypt_device *cd)
 {
+	pthread_mutex_lock(&_dm_use_lock);
 	if (!_dm_use_count++) {
 		log_dbg(cd, "Initialising device-mapper backend library.");
 		dm_log_init(set_dm_error);
 		dm_log_init_verbose(10);
 	}
+	pthread_mutex_unlock(&_dm_use_lock);
 }
 
 void dm_backend_exit(struct crypt_device *cd)
 {
+	pthread_mutex_lock(&_dm_use_lock);
 	if (_dm_use_count && (!--_dm_use_count)) {
 		log_dbg(cd, "Releasing device-mapper backend.");
 		dm_log_init_verbose(0);
 		dm_log_init(NULL);
 		dm_lib_release();
 	}
+	pthread_mutex_unlock(&_dm_use_lock);
 }
 
 /* libdevmapper is not context friendly, switch context on every DM call. */
@@ -591,11 +680,68 @@ static int cipher_dm2c(char **org_c, char **org_i, const char *c_dm, const char
 	return 0;
 }
 
+/*
+ * "<cipher> <key>" part of dm-crypt table, it does not depend on segment
+ * position and can be precomputed for repeated table loads.
+ */
+char *dm_crypt_key_params(const struct dm_target *tgt, uint32_t flags)
+{
+	int r, max_size, null_cipher = 0, keystr_len = 0;
+	char *params = NULL, *hexkey;
+	char integrity_dm[256], cipher_dm[256];
+
+	if (!tgt || tgt->type != DM_CRYPT)
+		return NULL;
+
+	r = cipher_c2dm(tgt->u.crypt.cipher, tgt->u.crypt.integrity, tgt->u.crypt.tag_size,
+			cipher_dm, sizeof(cipher_dm), integrity_dm, sizeof(integrity_dm));
+	if (r < 0)
+		return NULL;
+
+	if (crypt_is_cipher_null(cipher_dm))
+		null_cipher = 1;
+
+	if (null_cipher)
+		hexkey = crypt_safe_alloc(2);
+	else if (flags & CRYPT_ACTIVATE_KEYRING_KEY) {
+		keystr_len = strlen(tgt->u.crypt.vk->key_description) + int_log10(tgt->u.crypt.vk->keylength) + 10;
+		hexkey = crypt_safe_alloc(keystr_len);
+	} else
+		hexkey = crypt_safe_alloc(tgt->u.crypt.vk->keylength * 2 + 1);
+
+	if (!hexkey)
+		return NULL;
+
+	if (null_cipher)
+		strncpy(hexkey, "-", 2);
+	else if (flags & CRYPT_ACTIVATE_KEYRING_KEY) {
+		r = snprintf(hexkey, keystr_len, ":%zu:logon:%s", tgt->u.crypt.vk->keylength, tgt->u.crypt.vk->key_description);
+		if (r < 0 || r >= keystr_len)
+			goto out;
+	} else
+		hex_key(hexkey, tgt->u.crypt.vk->keylength, tgt->u.crypt.vk->key);
+
+	max_size = strlen(hexkey) + strlen(cipher_dm) + 2;
+	params = crypt_safe_alloc(max_size);
+	if (!params)
+		goto out;
+
+	r = snprintf(params, max_size, "%s %s", cipher_dm, hexkey);
+	if (r < 0 || r >= max_size) {
+		crypt_safe_free(params);
+		params = NULL;
+	}
+out:
+	crypt_safe_free(hexkey);
+	return params;
+}
+
 /* https://gitlab.com/cryptsetup/cryptsetup/wikis/DMCrypt */
 static char *get_dm_crypt_params(const struct dm_target *tgt, uint32_t flags)
 {
-	int r, max_size, null_cipher = 0, num_options = 0, keystr_len = 0;
-	char *params, *hexkey;
+	int r, max_size, num_options = 0;
+	char *params, *key_params = NULL;
+	const char *kp;
 	char sector_feature[32], features[512], integrity_dm[256], cipher_dm[256];
 
 	if (!tgt)
@@ -639,40 +785,19 @@ static char *get_dm_crypt_params(const struct dm_target *tgt, uint32_t flags)
 	} else
 		*features = '\0';
 
-	if (crypt_is_cipher_null(cipher_dm))
-		null_cipher = 1;
-
-	if (null_cipher)
-		hexkey = crypt_safe_alloc(2);
-	else if (flags & CRYPT_ACTIVATE_KEYRING_KEY) {
-		keystr_len = strlen(tgt->u.crypt.vk->key_description) + int_log10(tgt->u.crypt.vk->keylength) + 10;
-		hexkey = crypt_safe_alloc(keystr_len);
-	} else
-		hexkey = crypt_safe_alloc(tgt->u.crypt.vk->keylength * 2 + 1);
-
-	if (!hexkey)
+	/* Key formatting is skipped if caller provided precomputed table part */
+	kp = tgt->u.crypt.key_params;
+	if (!kp && !(kp = key_params = dm_crypt_key_params(tgt, flags)))
 		return NULL;
 
-	if (null_cipher)
-		strncpy(hexkey, "-", 2);
-	else if (flags & CRYPT_ACTIVATE_KEYRING_KEY) {
-		r = snprintf(hexkey, keystr_len, ":%zu:logon:%s", tgt->u.crypt.vk->keylength, tgt->u.crypt.vk->key_description);
-		if (r < 0 || r >= keystr_len) {
-			params = NULL;
-			goto out;
-		}
-	} else
-		hex_key(hexkey, tgt->u.crypt.vk->keylength, tgt->u.crypt.vk->key);
-
-	max_size = strlen(hexkey) + strlen(cipher_dm) +
-		   strlen(device_block_path(tgt->data_device)) +
+	max_size = strlen(kp) + strlen(device_block_path(tgt->data_device)) +
 		   strlen(features) + 64;
 	params = crypt_safe_alloc(max_size);
 	if (!params)
 		goto out;
 
-	r = snprintf(params, max_size, "%s %s %" PRIu64 " %s %" PRIu64 "%s",
-		     cipher_dm, hexkey, tgt->u.crypt.iv_offset,
+	r = snprintf(params, max_size, "%s %" PRIu64 " %s %" PRIu64 "%s",
+		     kp, tgt->u.crypt.iv_offset,
 		     device_block_path(tgt->data_device), tgt->u.crypt.offset,
 		     features);
 	if (r < 0 || r >= max_size) {
@@ -680,7 +805,7 @@ static char *get_dm_crypt_params(const struct dm_target *tgt, uint32_t flags)
 		params = NULL;
 	}
 out:
-	crypt_safe_free(hexkey);
+	crypt_safe_free(key_params);
 	return params;
 }
 
@@ -1002,15 +1127,31 @@ static char *get_dm_zero_params(const struct dm_target *tgt __attribute__((unuse
 }
 
 /* DM helpers */
-static int _dm_remove(const char *name, int udev_wait, int deferred)
+static int _dm_remove(const char *name, int udev_wait, int deferred, bool private)
 {
 	int r = 0;
 	struct dm_task *dmt;
 	uint32_t cookie = 0;
+	uint16_t udev_flags = DM_UDEV_DISABLE_LIBRARY_FALLBACK;
+	bool batch, nosync;
 
 	if (!_dm_use_udev())
 		udev_wait = 0;
 
+	/* in batch, udev is synchronized once for all removed devices */
+	batch = udev_wait && _dm_batch && !private;
+
+	/*
+	 * Private device node could be created by libdevmapper directly
+	 * (without udev synchronization), let library remove it as well.
+	 */
+	if (private)
+		udev_flags = CRYPT_TEMP_UDEV_FLAGS;
+
+	nosync = _dm_private_nosync(udev_wait && private);
+	if (nosync)
+		udev_wait = 0;
+
 	if (!(dmt = dm_task_create(DM_DEVICE_REMOVE)))
 		return 0;
 
@@ -1025,13 +1166,17 @@ static int _dm_remove(const char *name, int udev_wait, int deferred)
 	if (deferred && !dm_task_deferred_remove(dmt))
 		goto out;
 #endif
-	if (udev_wait && !_dm_task_set_cookie(dmt, &cookie, DM_UDEV_DISABLE_LIBRARY_FALLBACK))
+	if (nosync && !_dm_task_set_udev_flags(dmt, CRYPT_NOSYNC_UDEV_FLAGS))
+		goto out;
+
+	if (udev_wait && !_dm_task_set_cookie(dmt, batch ? &_dm_batch_cookie : &cookie,
+					      udev_flags))
 		goto out;
 
 	r = dm_task_run(dmt);
 
-	if (udev_wait)
-		(void)_dm_udev_wait(cookie);
+	if (udev_wait && !batch)
+		_dm_udev_wait_timed(cookie);
 out:
 	dm_task_destroy(dmt);
 	return r;
@@ -1147,6 +1292,7 @@ int dm_remove_device(struct crypt_device *cd, const char *name, uint32_t flags)
 	int r = -EINVAL;
 	int retries = (flags & CRYPT_DEACTIVATE_FORCE) ? RETRY_COUNT : 1;
 	int deferred = (flags & CRYPT_DEACTIVATE_DEFERRED) ? 1 : 0;
+	bool private = (flags & DM_DEACTIVATE_PRIVATE) ? true : false;
 	int error_target = 0;
 	uint32_t dmt_flags;
 
@@ -1163,7 +1309,8 @@ int dm_remove_device(struct crypt_device *cd, const char *name, uint32_t flags)
 	}
 
 	do {
-		r = _dm_remove(name, 1, deferred) ? 0 : -EINVAL;
+		r = _dm_remove(name, 1, deferred, private) ? 0 : -EINVAL;
+		TRACE2(dm__remove, name, r);
 		if (--retries && r) {
 			log_dbg(cd, "WARNING: other process locked internal device %s, %s.",
 				name, retries ? "retrying remove" : "giving up");
@@ -1349,10 +1496,18 @@ static int _dm_create_device(struct crypt_device *cd, const char *name, const ch
 	int r = -EINVAL;
 	uint32_t cookie = 0, read_ahead = 0;
 	uint16_t udev_flags = DM_UDEV_DISABLE_LIBRARY_FALLBACK;
+	bool private = (dmd->flags & CRYPT_ACTIVATE_PRIVATE) ? true : false;
+	/* Private (temporary) devices are used immediately, never batch them */
+	bool batch = _dm_batch && _dm_use_udev() && !private;
+	bool use_udev = _dm_use_udev(), nosync;
 
-	if (dmd->flags & CRYPT_ACTIVATE_PRIVATE)
+	if (private)
 		udev_flags |= CRYPT_TEMP_UDEV_FLAGS;
 
+	nosync = _dm_private_nosync(private);
+	if (nosync)
+		use_udev = false;
+
 	/* All devices must have DM_UUID, only resize on old device is exception */
 	if (!dm_prepare_uuid(cd, name, type, dmd->uuid, dev_uuid, sizeof(dev_uuid)))
 		goto out;
@@ -1386,7 +1541,10 @@ static int _dm_create_device(struct crypt_device *cd, const char *name, const ch
 	    !dm_task_set_read_ahead(dmt, read_ahead, DM_READ_AHEAD_MINIMUM_FLAG))
 		goto out;
 #endif
-	if (_dm_use_udev() && !_dm_task_set_cookie(dmt, &cookie, udev_flags))
+	if (nosync && !_dm_task_set_udev_flags(dmt, CRYPT_NOSYNC_UDEV_FLAGS))
+		goto out;
+
+	if (use_udev && !_dm_task_set_cookie(dmt, batch ? &_dm_batch_cookie : &cookie, udev_flags))
 		goto out;
 
 	if (!dm_task_run(dmt)) {
@@ -1398,17 +1556,20 @@ static int _dm_create_device(struct crypt_device *cd, const char *name, const ch
 	if (dm_task_get_info(dmt, &dmi))
 		r = 0;
 
-	if (_dm_use_udev()) {
-		(void)_dm_udev_wait(cookie);
+	if (use_udev && !batch) {
+		_dm_udev_wait_timed(cookie);
 		cookie = 0;
 	}
 
-	if (r < 0)
-		_dm_remove(name, 1, 0);
+	if (r < 0) {
+		if (batch)
+			dm_udev_batch_sync();
+		_dm_remove(name, 1, 0, private);
+	}
 
 out:
-	if (cookie && _dm_use_udev())
-		(void)_dm_udev_wait(cookie);
+	if (cookie && use_udev)
+		_dm_udev_wait_timed(cookie);
 
 	if (dmt)
 		dm_task_destroy(dmt);
@@ -1416,23 +1577,60 @@ out:
 	dm_task_update_nodes();
 
 	/* If code just loaded target module, update versions */
-	_dm_check_versions(cd, dmd->segment.type);
+	_dm_check_versions_created(cd, dmd->segment.type);
 
 	_destroy_dm_targets_params(dmd);
 
 	return r;
 }
 
+int dm_udev_batch_begin(void)
+{
+	if (_dm_batch)
+		return -EBUSY;
+
+	_dm_batch = true;
+	_dm_batch_cookie = 0;
+
+	return 0;
+}
+
+/* Wait for udev to process all devices created or removed in batch so far */
+void dm_udev_batch_sync(void)
+{
+	if (_dm_batch_cookie && _dm_use_udev())
+		_dm_udev_wait_timed(_dm_batch_cookie);
+	_dm_batch_cookie = 0;
+}
+
+int dm_udev_batch_end(void)
+{
+	if (!_dm_batch)
+		return -EINVAL;
+
+	dm_udev_batch_sync();
+	_dm_batch = false;
+
+	dm_task_update_nodes();
+
+	return 0;
+}
+
 static int _dm_resume_device(const char *name, uint32_t dmflags)
 {
 	struct dm_task *dmt;
 	int r = -EINVAL;
 	uint32_t cookie = 0;
 	uint16_t udev_flags = DM_UDEV_DISABLE_LIBRARY_FALLBACK;
+	bool use_udev = _dm_use_udev(), nosync;
 
 	if (dmflags & DM_RESUME_PRIVATE)
 		udev_flags |= CRYPT_TEMP_UDEV_FLAGS;
 
+	nosync = _dm_private_nosync(dmflags & DM_RESUME_PRIVATE);
+	if (nosync)
+		use_udev = false;
+
 	if (!(dmt = dm_task_create(DM_DEVICE_RESUME)))
 		return r;
 
@@ -1445,14 +1643,17 @@ static int _dm_resume_device(const char *name, uint32_t dmflags)
 	if ((dmflags & DM_SUSPEND_NOFLUSH) && !dm_task_no_flush(dmt))
 		goto out;
 
-	if (_dm_use_udev() && !_dm_task_set_cookie(dmt, &cookie, udev_flags))
+	if (nosync && !_dm_task_set_udev_flags(dmt, CRYPT_NOSYNC_UDEV_FLAGS))
+		goto out;
+
+	if (use_udev && !_dm_task_set_cookie(dmt, &cookie, udev_flags))
 		goto out;
 
 	if (dm_task_run(dmt))
 		r = 0;
 out:
-	if (cookie && _dm_use_udev())
-		(void)_dm_udev_wait(cookie);
+	if (cookie && use_udev)
+		_dm_udev_wait_timed(cookie);
 
 	dm_task_destroy(dmt);
 
@@ -1503,7 +1704,7 @@ out:
 		dm_task_destroy(dmt);
 
 	/* If code just loaded target module, update versions */
-	_dm_check_versions(cd, dmd->segment.type);
+	_dm_check_versions_created(cd, dmd->segment.type);
 
 	_destroy_dm_targets_params(dmd);
 
@@ -1645,7 +1846,9 @@ int dm_create_device(struct crypt_device *cd, const char *name,
 		     const char *type,
 		     struct crypt_dm_active_device *dmd)
 {
+	struct dm_target *tgt;
 	uint32_t dmt_flags = 0;
+	uint64_t start, udev_usec;
 	int r = -EINVAL;
 
 	if (!type || !dmd)
@@ -1654,7 +1857,11 @@ int dm_create_device(struct crypt_device *cd, const char *name,
 	if (dm_init_context(cd, dmd->segment.type))
 		return -ENOTSUP;
 
+	start = crypt_op_usec();
+	udev_usec = _dm_udev_usec;
+
 	r = _dm_create_device(cd, name, type, dmd);
+	TRACE2(dm__create, name, r);
 
 	if (r < 0 && dm_flags(cd, dmd->segment.type, &dmt_flags))
 		goto out;
@@ -1662,7 +1869,12 @@ int dm_create_device(struct crypt_device *cd, const char *name,
 	if (r && (dmd->segment.type == DM_CRYPT || dmd->segment.type == DM_LINEAR || dmd->segment.type == DM_ZERO) &&
 		check_retry(cd, &dmd->flags, dmt_flags)) {
 		log_dbg(cd, "Retrying open without incompatible options.");
+		/* key format may depend on dropped keyring flag */
+		for (tgt = &dmd->segment; tgt; tgt = tgt->next)
+			if (tgt->type == DM_CRYPT)
+				tgt->u.crypt.key_params = NULL;
 		r = _dm_create_device(cd, name, type, dmd);
+		TRACE2(dm__create, name, r);
 	}
 
 	/*
@@ -1721,6 +1933,9 @@ int dm_create_device(struct crypt_device *cd, const char *name,
 	    !(dmt_flags & DM_INTEGRITY_BITMAP_SUPPORTED))
 		log_err(cd, _("Requested dm-integrity bitmap mode is not supported."));
 out:
+	udev_usec = _dm_udev_usec - udev_usec;
+	crypt_op_stats_add(cd, CRYPT_OP_UDEV, udev_usec);
+	crypt_op_stats_add(cd, CRYPT_OP_DM, crypt_op_usec() - start - udev_usec);
 	dm_exit_context();
 	return r;
 }
@@ -1741,6 +1956,7 @@ int dm_reload_device(struct crypt_device *cd, const char *name,
 		dmd->flags &= ~CRYPT_ACTIVATE_RECALCULATE;
 
 	r = _dm_reload_device(cd, name, dmd);
+	TRACE2(dm__reload, name, r);
 
 	if (r == -EINVAL && (dmd->segment.type == DM_CRYPT || dmd->segment.type == DM_LINEAR)) {
 		if ((dmd->flags & (CRYPT_ACTIVATE_SAME_CPU_CRYPT|CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS)) &&
@@ -1757,8 +1973,10 @@ int dm_reload_device(struct crypt_device *cd, const char *name,
 			log_err(cd, _("Discard/TRIM is not supported."));
 	}
 
-	if (!r && resume)
+	if (!r && resume) {
 		r = _dm_resume_device(name, dmflags | act2dmflags(dmd->flags));
+		TRACE2(dm__resume, name, r);
+	}
 
 	dm_exit_context();
 	return r;
@@ -1914,6 +2132,47 @@ int dm_status_integrity_failures(struct crypt_device *cd, const char *name, uint
 	return 0;
 }
 
+/* Status line is "<mismatches> <provided sectors> <recalc sector or ->" */
+int dm_status_integrity_recalc(struct crypt_device *cd, const char *name,
+			       uint64_t *recalc_sector, uint64_t *size)
+{
+	int r;
+	struct dm_info dmi;
+	char *status_line = NULL, *p;
+
+	if (dm_init_context(cd, DM_INTEGRITY))
+		return -ENOTSUP;
+
+	r = dm_status_dmi(name, &dmi, DM_INTEGRITY_TARGET, &status_line);
+	if (r < 0 || !status_line) {
+		free(status_line);
+		dm_exit_context();
+		return r;
+	}
+
+	log_dbg(cd, "Integrity volume %s recalculation status is %s.", name, status_line ?: "");
+
+	r = -EINVAL;
+	(void)strtoull(status_line, &p, 10);
+	if (*p == ' ') {
+		*size = strtoull(p, &p, 10);
+		while (*p == ' ')
+			p++;
+		if (*p == '-') {
+			*recalc_sector = *size;
+			r = 0;
+		} else if (isdigit(*p)) {
+			*recalc_sector = strtoull(p, NULL, 10);
+			r = 0;
+		}
+	}
+
+	free(status_line);
+	dm_exit_context();
+
+	return r;
+}
+
 /* FIXME use hex wrapper, user val wrappers for line parsing */
 static int _dm_target_query_crypt(struct crypt_device *cd, uint32_t get_flags,
 				  char *params, struct dm_target *tgt,
@@ -2746,6 +3005,70 @@ int dm_query_device(struct crypt_device *cd, const char *name,
 	return r;
 }
 
+/*
+ * Query all active devices with cryptsetup DM-UUID in one DM context.
+ * Devices are listed with single ioctl, the callback receives parsed
+ * active device (without key) and open count status.
+ */
+int dm_query_devices(struct crypt_device *cd, uint32_t get_flags,
+		     int (*fn)(struct crypt_device *cd, const char *name,
+			       struct crypt_dm_active_device *dmd, int busy, void *usrptr),
+		     void *usrptr)
+{
+	struct crypt_dm_active_device dmd;
+	struct dm_task *dmt;
+	struct dm_names *names;
+	unsigned next = 0;
+	int r;
+
+	if (!fn)
+		return -EINVAL;
+
+	/* Never read key material here */
+	get_flags &= ~DM_ACTIVE_CRYPT_KEY;
+	get_flags |= DM_ACTIVE_UUID;
+
+	if (dm_init_context(cd, DM_UNKNOWN))
+		return -ENOTSUP;
+
+	r = -EINVAL;
+	if (!(dmt = dm_task_create(DM_DEVICE_LIST)))
+		goto out;
+
+	if (!dm_task_run(dmt) || !(names = dm_task_get_names(dmt)))
+		goto out;
+
+	r = 0;
+	if (!names->dev)
+		goto out;
+
+	do {
+		names = (struct dm_names *)((char *) names + next);
+		next = names->next;
+
+		memset(&dmd, 0, sizeof(dmd));
+		r = _dm_query_device(cd, names->name, get_flags, &dmd);
+		if (r < 0) {
+			/* device removed meanwhile or unsupported table */
+			r = 0;
+			continue;
+		}
+
+		if (dmd.uuid)
+			r = fn(cd, names->name, &dmd, r, usrptr);
+		else
+			r = 0;
+
+		dm_targets_free(cd, &dmd);
+		free(CONST_CAST(void*)dmd.uuid);
+	} while (next && !r);
+out:
+	if (dmt)
+		dm_task_destroy(dmt);
+	dm_exit_context();
+	return r;
+}
+
 static int _process_deps(struct crypt_device *cd, const char *prefix, struct dm_deps *deps, char **names, size_t names_offset, size_t names_length)
 {
 #if HAVE_DECL_DM_DEVICE_GET_NAME
@@ -2920,6 +3243,7 @@ int dm_resume_device(struct crypt_device *cd, const char *name, uint32_t dmflags
 		return -ENOTSUP;
 
 	r = _dm_resume_device(name, dmflags);
+	TRACE2(dm__resume, name, r);
 
 	dm_exit_context();
 
@@ -2983,6 +3307,41 @@ const char *dm_get_dir(void)
 	return dm_dir();
 }
 
+/*
+ * Own DM control file descriptor can be polled for device-mapper events
+ * of any device (kernel dm-ioctl 4.37+), libdevmapper does not provide
+ * access to its internal control descriptor.
+ */
+int dm_event_fd_open(void)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	if (snprintf(path, sizeof(path), "%s/%s", dm_dir(), DM_CONTROL_NODE) < 0)
+		return -EINVAL;
+
+	fd = open(path, O_RDWR | O_CLOEXEC);
+
+	return fd < 0 ? -errno : fd;
+}
+
+int dm_event_fd_arm(int fd)
+{
+#ifdef DM_DEV_ARM_POLL
+	struct dm_ioctl dmi = {
+		.version = { DM_VERSION_MAJOR, 0, 0 },
+		.data_size = sizeof(dmi),
+	};
+
+	if (fd < 0)
+		return -EINVAL;
+
+	return ioctl(fd, DM_DEV_ARM_POLL, &dmi) < 0 ? -ENOTSUP : 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
 int dm_is_dm_device(int major)
 {
 	return dm_is_dm_major((uint32_t)major);
@@ -3012,6 +3371,7 @@ int dm_crypt_target_set(struct dm_target *tgt, uint64_t seg_offset, uint64_t seg
 	tgt->type = DM_CRYPT;
 	tgt->direction = TARGET_SET;
 	tgt->u.crypt.vk = vk;
+	tgt->u.crypt.key_params = NULL;
 	tgt->offset = seg_offset;
 	tgt->size = seg_size;
 
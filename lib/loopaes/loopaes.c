@@ -52,24 +52,6 @@ static unsigned char get_tweak(unsigned int keys_count)
 	return 0x00;
 }
 
-static int hash_key(const char *src, size_t src_len,
-		    char *dst, size_t dst_len,
-		    const char *hash_name)
-{
-	struct crypt_hash *hd = NULL;
-	int r;
-
-	if (crypt_hash_init(&hd, hash_name))
-		return -EINVAL;
-
-	r = crypt_hash_write(hd, src, src_len);
-	if (!r)
-		r = crypt_hash_final(hd, dst, dst_len);
-
-	crypt_hash_destroy(hd);
-	return r;
-}
-
 static int hash_keys(struct crypt_device *cd,
 		     struct volume_key **vk,
 		     const char *hash_override,
@@ -78,6 +60,7 @@ static int hash_keys(struct crypt_device *cd,
 		     unsigned int key_len_output,
 		     unsigned int key_len_input)
 {
+	struct crypt_hash *hd = NULL;
 	const char *hash_name;
 	char tweak, *key_ptr;
 	unsigned int i;
@@ -92,20 +75,29 @@ static int hash_keys(struct crypt_device *cd,
 		return -EINVAL;
 	}
 
+	/* one hash context for all keys, final resets it for the next one */
+	if (crypt_hash_init(&hd, hash_name))
+		return -EINVAL;
+
 	*vk = crypt_alloc_volume_key((size_t)key_len_output * keys_count, NULL);
-	if (!*vk)
+	if (!*vk) {
+		crypt_hash_destroy(hd);
 		return -ENOMEM;
+	}
 
 	for (i = 0; i < keys_count; i++) {
 		key_ptr = &(*vk)->key[i * key_len_output];
-		r = hash_key(input_keys[i], key_len_input, key_ptr,
-			     key_len_output, hash_name);
+		r = crypt_hash_write(hd, input_keys[i], key_len_input);
+		if (!r)
+			r = crypt_hash_final(hd, key_ptr, key_len_output);
 		if (r < 0)
 			break;
 
 		key_ptr[0] ^= tweak;
 	}
 
+	crypt_hash_destroy(hd);
+
 	if (r < 0 && *vk) {
 		crypt_free_volume_key(*vk);
 		*vk = NULL;
@@ -29,66 +29,66 @@
 #include "internal.h"
 #include "af.h"
 
+/* XOR in machine words, dst can be the same buffer as one of sources */
 static void XORblock(const char *src1, const char *src2, char *dst, size_t n)
 {
-	size_t j;
+	uint64_t w1, w2;
+	size_t j = 0;
+
+	for (; j + sizeof(w1) <= n; j += sizeof(w1)) {
+		memcpy(&w1, src1 + j, sizeof(w1));
+		memcpy(&w2, src2 + j, sizeof(w2));
+		w1 ^= w2;
+		memcpy(dst + j, &w1, sizeof(w1));
+	}
 
-	for (j = 0; j < n; j++)
+	for (; j < n; j++)
 		dst[j] = src1[j] ^ src2[j];
 }
 
-static int hash_buf(const char *src, char *dst, uint32_t iv,
-		    size_t len, const char *hash_name)
+/* Hash context is reset after crypt_hash_final() and reused for next block */
+static int hash_buf(struct crypt_hash *hd, const char *src, char *dst,
+		    uint32_t iv, size_t len)
 {
-	struct crypt_hash *hd = NULL;
 	char *iv_char = (char *)&iv;
 	int r;
 
 	iv = be32_to_cpu(iv);
-	if (crypt_hash_init(&hd, hash_name))
-		return -EINVAL;
 
 	if ((r = crypt_hash_write(hd, iv_char, sizeof(uint32_t))))
-		goto out;
+		return r;
 
 	if ((r = crypt_hash_write(hd, src, len)))
-		goto out;
+		return r;
 
-	r = crypt_hash_final(hd, dst, len);
-out:
-	crypt_hash_destroy(hd);
-	return r;
+	return crypt_hash_final(hd, dst, len);
 }
 
 /*
  * diffuse: Information spreading over the whole dataset with
  * the help of hash function.
  */
-static int diffuse(char *src, char *dst, size_t size, const char *hash_name)
+static int diffuse(struct crypt_hash *hd, unsigned int digest_size,
+		   char *src, char *dst, size_t size)
 {
-	int r, hash_size = crypt_hash_size(hash_name);
-	unsigned int digest_size;
+	int r;
 	unsigned int i, blocks, padding;
 
-	if (hash_size <= 0)
-		return -EINVAL;
-	digest_size = hash_size;
-
 	blocks = size / digest_size;
 	padding = size % digest_size;
 
 	for (i = 0; i < blocks; i++) {
-		r = hash_buf(src + digest_size * i,
+		r = hash_buf(hd, src + digest_size * i,
 			    dst + digest_size * i,
-			    i, (size_t)digest_size, hash_name);
+			    i, (size_t)digest_size);
 		if (r < 0)
 			return r;
 	}
 
 	if (padding) {
-		r = hash_buf(src + digest_size * i,
+		r = hash_buf(hd, src + digest_size * i,
 			    dst + digest_size * i,
-			    i, (size_t)padding, hash_name);
+			    i, (size_t)padding);
 		if (r < 0)
 			return r;
 	}
@@ -96,6 +96,18 @@ static int diffuse(char *src, char *dst, size_t size, const char *hash_name)
 	return 0;
 }
 
+static int diffuse_init(struct crypt_hash **hd, unsigned int *digest_size,
+			const char *hash_name)
+{
+	int hash_size = crypt_hash_size(hash_name);
+
+	if (hash_size <= 0)
+		return -EINVAL;
+	*digest_size = hash_size;
+
+	return crypt_hash_init(hd, hash_name) ? -EINVAL : 0;
+}
+
 /*
  * Information splitting. The amount of data is multiplied by
  * blocknumbers. The same blocksize and blocknumbers values
@@ -104,13 +116,20 @@ static int diffuse(char *src, char *dst, size_t size, const char *hash_name)
 int AF_split(struct crypt_device *ctx, const char *src, char *dst,
 	     size_t blocksize, unsigned int blocknumbers, const char *hash)
 {
-	unsigned int i;
+	struct crypt_hash *hd = NULL;
+	unsigned int i, digest_size;
 	char *bufblock;
 	int r;
 
+	r = diffuse_init(&hd, &digest_size, hash);
+	if (r < 0)
+		return r;
+
 	bufblock = crypt_safe_alloc(blocksize);
-	if (!bufblock)
+	if (!bufblock) {
+		crypt_hash_destroy(hd);
 		return -ENOMEM;
+	}
 
 	/* process everything except the last block */
 	for (i = 0; i < blocknumbers - 1; i++) {
@@ -119,7 +138,7 @@ int AF_split(struct crypt_device *ctx, const char *src, char *dst,
 			goto out;
 
 		XORblock(dst + blocksize * i, bufblock, bufblock, blocksize);
-		r = diffuse(bufblock, bufblock, blocksize, hash);
+		r = diffuse(hd, digest_size, bufblock, bufblock, blocksize);
 		if (r < 0)
 			goto out;
 	}
@@ -128,23 +147,31 @@ int AF_split(struct crypt_device *ctx, const char *src, char *dst,
 	r = 0;
 out:
 	crypt_safe_free(bufblock);
+	crypt_hash_destroy(hd);
 	return r;
 }
 
 int AF_merge(struct crypt_device *ctx __attribute__((unused)), const char *src, char *dst,
 	     size_t blocksize, unsigned int blocknumbers, const char *hash)
 {
-	unsigned int i;
+	struct crypt_hash *hd = NULL;
+	unsigned int i, digest_size;
 	char *bufblock;
 	int r;
 
+	r = diffuse_init(&hd, &digest_size, hash);
+	if (r < 0)
+		return r;
+
 	bufblock = crypt_safe_alloc(blocksize);
-	if (!bufblock)
+	if (!bufblock) {
+		crypt_hash_destroy(hd);
 		return -ENOMEM;
+	}
 
 	for(i = 0; i < blocknumbers - 1; i++) {
 		XORblock(src + blocksize * i, bufblock, bufblock, blocksize);
-		r = diffuse(bufblock, bufblock, blocksize, hash);
+		r = diffuse(hd, digest_size, bufblock, bufblock, blocksize);
 		if (r < 0)
 			goto out;
 	}
@@ -152,6 +179,7 @@ int AF_merge(struct crypt_device *ctx __attribute__((unused)), const char *src,
 	r = 0;
 out:
 	crypt_safe_free(bufblock);
+	crypt_hash_destroy(hd);
 	return r;
 }
 
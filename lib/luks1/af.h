@@ -64,4 +64,7 @@ int LUKS_decrypt_from_storage(
 	unsigned int sector,
 	struct crypt_device *ctx);
 
+void LUKS_keystore_scan_begin(void);
+void LUKS_keystore_scan_end(struct crypt_device *ctx);
+
 #endif
@@ -46,6 +46,38 @@ static void _error_hint(struct crypt_device *ctx, const char *device,
 		log_err(ctx, _("Cipher specification should be in [cipher]-[mode]-[iv] format."));
 }
 
+/*
+ * Within a keyslot scan, the temporary keystore device used for reads is not
+ * removed after each keyslot, the next keyslot only reloads its table with
+ * a new key and offset. It is always removed when the scan ends, so no
+ * mapping keyed with a keyslot key outlives the scan.
+ */
+static __thread bool _keystore_scan = false;
+static __thread bool _keystore_active = false;
+
+static int keystore_name(char *name, size_t name_size)
+{
+	if (snprintf(name, name_size, "temporary-cryptsetup-%d", getpid()) < 0)
+		return -ENOMEM;
+	return 0;
+}
+
+void LUKS_keystore_scan_begin(void)
+{
+	_keystore_scan = true;
+}
+
+void LUKS_keystore_scan_end(struct crypt_device *ctx)
+{
+	char name[PATH_MAX];
+
+	if (_keystore_active && !keystore_name(name, sizeof(name)))
+		dm_remove_device(ctx, name, CRYPT_DEACTIVATE_FORCE | DM_DEACTIVATE_PRIVATE);
+
+	_keystore_active = false;
+	_keystore_scan = false;
+}
+
 static int LUKS_endec_template(char *src, size_t srcLength,
 			       const char *cipher, const char *cipher_mode,
 			       struct volume_key *vk,
@@ -60,6 +92,7 @@ static int LUKS_endec_template(char *src, size_t srcLength,
 		.flags = CRYPT_ACTIVATE_PRIVATE,
 	};
 	int r, devfd = -1, remove_dev = 0;
+	bool keep = _keystore_scan && mode == O_RDONLY;
 	size_t bsize, keyslot_alignment, alignment;
 
 	log_dbg(ctx, "Using dmcrypt to access keyslot area.");
@@ -78,7 +111,7 @@ static int LUKS_endec_template(char *src, size_t srcLength,
 	if (mode == O_RDONLY)
 		dmd.flags |= CRYPT_ACTIVATE_READONLY;
 
-	if (snprintf(name, sizeof(name), "temporary-cryptsetup-%d", getpid()) < 0)
+	if (keystore_name(name, sizeof(name)))
 		return -ENOMEM;
 	if (snprintf(path, sizeof(path), "%s/%s", dm_get_dir(), name) < 0)
 		return -ENOMEM;
@@ -105,7 +138,18 @@ static int LUKS_endec_template(char *src, size_t srcLength,
 	if (r)
 		goto out;
 
-	r = dm_create_device(ctx, name, "TEMP", &dmd);
+	/* reuse device from the previous keyslot in scan, recreate it on failure */
+	if (keep && _keystore_active) {
+		log_dbg(ctx, "Reloading temporary keystore device.");
+		r = dm_reload_device(ctx, name, &dmd, 0, 1);
+		if (r < 0) {
+			dm_remove_device(ctx, name, CRYPT_DEACTIVATE_FORCE | DM_DEACTIVATE_PRIVATE);
+			_keystore_active = false;
+		}
+	}
+
+	if (!_keystore_active || !keep)
+		r = dm_create_device(ctx, name, "TEMP", &dmd);
 	if (r < 0) {
 		if (r != -EACCES && r != -ENOTSUP)
 			_error_hint(ctx, device_path(crypt_metadata_device(ctx)),
@@ -132,8 +176,12 @@ static int LUKS_endec_template(char *src, size_t srcLength,
 	dm_targets_free(ctx, &dmd);
 	if (devfd != -1)
 		close(devfd);
-	if (remove_dev)
-		dm_remove_device(ctx, name, CRYPT_DEACTIVATE_FORCE);
+	if (remove_dev && keep && !r)
+		_keystore_active = true;
+	else if (remove_dev) {
+		dm_remove_device(ctx, name, CRYPT_DEACTIVATE_FORCE | DM_DEACTIVATE_PRIVATE);
+		_keystore_active = false;
+	}
 	return r;
 }
 
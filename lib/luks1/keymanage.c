@@ -887,10 +887,13 @@ int LUKS_set_key(unsigned int keyIndex,
 	if (r < 0)
 		goto out;
 
+	TRACE5(kdf__start, CRYPT_KDF_PBKDF2, hdr->hashSpec,
+	       hdr->keyblock[keyIndex].passwordIterations, 0, 0);
 	r = crypt_pbkdf(CRYPT_KDF_PBKDF2, hdr->hashSpec, password, passwordLen,
 			hdr->keyblock[keyIndex].passwordSalt, LUKS_SALTSIZE,
 			derived_key->key, hdr->keyBytes,
 			hdr->keyblock[keyIndex].passwordIterations, 0, 0);
+	TRACE2(kdf__end, CRYPT_KDF_PBKDF2, r);
 	if (r < 0)
 		goto out;
 
@@ -969,6 +972,7 @@ static int LUKS_open_key(unsigned int keyIndex,
 	struct volume_key *derived_key;
 	char *AfKey = NULL;
 	size_t AFEKSize;
+	uint64_t start;
 	int r;
 
 	log_dbg(ctx, "Trying to open key slot %d [%s].", keyIndex,
@@ -994,10 +998,15 @@ static int LUKS_open_key(unsigned int keyIndex,
 		goto out;
 	}
 
+	TRACE5(kdf__start, CRYPT_KDF_PBKDF2, hdr->hashSpec,
+	       hdr->keyblock[keyIndex].passwordIterations, 0, 0);
+	start = crypt_op_usec();
 	r = crypt_pbkdf(CRYPT_KDF_PBKDF2, hdr->hashSpec, password, passwordLen,
 			hdr->keyblock[keyIndex].passwordSalt, LUKS_SALTSIZE,
 			derived_key->key, hdr->keyBytes,
 			hdr->keyblock[keyIndex].passwordIterations, 0, 0);
+	crypt_op_stats_add(ctx, CRYPT_OP_KDF, crypt_op_usec() - start);
+	TRACE2(kdf__end, CRYPT_KDF_PBKDF2, r);
 	if (r < 0) {
 		log_err(ctx, _("Cannot open keyslot (using hash %s)."), hdr->hashSpec);
 		goto out;
@@ -1047,20 +1056,30 @@ int LUKS_open_key_with_hdr(int keyIndex,
 		return (r < 0) ? r : keyIndex;
 	}
 
+	/* temporary dm-crypt keystore (if needed) is shared by all keyslots */
+	LUKS_keystore_scan_begin();
+
 	for (i = 0; i < LUKS_NUMKEYS; i++) {
 		r = LUKS_open_key(i, password, passwordLen, hdr, vk, ctx);
-		if (r == 0)
-			return i;
+		if (r == 0) {
+			r = i;
+			break;
+		}
 
 		/* Do not retry for errors that are no -EPERM or -ENOENT,
 		   former meaning password wrong, latter key slot inactive */
 		if ((r != -EPERM) && (r != -ENOENT))
-			return r;
+			break;
 		if (r == -EPERM)
 			tried++;
 	}
-	/* Warning, early returns above */
-	return tried ? -EPERM : -ENOENT;
+
+	LUKS_keystore_scan_end(ctx);
+
+	if (i == LUKS_NUMKEYS)
+		r = tried ? -EPERM : -ENOENT;
+
+	return r;
 }
 
 int LUKS_del_key(unsigned int keyIndex,
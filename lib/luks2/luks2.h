@@ -59,6 +59,9 @@
 /* 20 MiBs */
 #define LUKS2_DEFAULT_NONE_REENCRYPTION_LENGTH 0x1400000
 
+/* 128 MiBs, rotational data device (seek per hotzone is expensive) */
+#define LUKS2_DEFAULT_NONE_REENCRYPTION_LENGTH_ROTATIONAL 0x8000000
+
 /* 1 GiB */
 #define LUKS2_REENCRYPT_MAX_HOTZONE_LENGTH 0x40000000
 
@@ -113,6 +116,8 @@ struct luks2_hdr {
 	uint8_t		salt2[LUKS2_SALT_L];
 	char		uuid[LUKS2_UUID_L];
 	void		*jobj;
+	/* used (possibly non-zero) JSON area length on disk per copy, 0 if unknown */
+	size_t		json_len_disk[2];
 };
 
 struct luks2_keyslot_params {
@@ -155,10 +160,13 @@ struct luks2_keyslot_params {
 
 int LUKS2_hdr_version_unlocked(struct crypt_device *cd,
 	const char *backup_file);
+int LUKS2_hdr_probe_unlocked(struct crypt_device *cd, char *uuid, size_t uuid_size, bool strict);
 
 int LUKS2_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr, int repair);
+void LUKS2_hdr_cache_enable(bool enable);
 int LUKS2_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr);
 int LUKS2_hdr_write_force(struct crypt_device *cd, struct luks2_hdr *hdr);
+int LUKS2_hdr_write_segments(struct crypt_device *cd, struct luks2_hdr *hdr);
 int LUKS2_hdr_dump(struct crypt_device *cd, struct luks2_hdr *hdr);
 int LUKS2_hdr_dump_json(struct crypt_device *cd, struct luks2_hdr *hdr,	const char **json);
 
@@ -212,6 +220,15 @@ int LUKS2_keyslot_store(struct crypt_device *cd,
 	const struct volume_key *vk,
 	const struct luks2_keyslot_params *params);
 
+int LUKS2_keyslot_store_batch(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	const int *keyslots,
+	const char * const *passwords,
+	const size_t *password_lens,
+	size_t count,
+	const struct volume_key *vk,
+	const struct luks2_keyslot_params *params);
+
 int LUKS2_keyslot_wipe(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int keyslot,
@@ -227,11 +244,29 @@ int LUKS2_keyslot_priority_set(struct crypt_device *cd,
 	crypt_keyslot_priority priority,
 	int commit);
 
+/* Minimal size of token secret for keyslot hint */
+#define LUKS2_HINT_SECRET_MIN 32
+
+int LUKS2_keyslot_hint_set(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int keyslot,
+	const char *password,
+	size_t password_len);
+
+int LUKS2_keyslot_hint_match(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int keyslot,
+	const char *password,
+	size_t password_len);
+
 int LUKS2_keyslot_swap(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int keyslot,
 	int keyslot2);
 
+int LUKS2_keyslot_areas_compact(struct crypt_device *cd,
+	struct luks2_hdr *hdr);
+
 /*
  * Generic LUKS2 token
  */
@@ -287,7 +322,11 @@ int LUKS2_token_keyring_get(struct crypt_device *cd,
 int LUKS2_token_keyring_json(char *buffer, size_t buffer_size,
 	const struct crypt_token_params_luks2_keyring *keyring_params);
 
+int LUKS2_token_keyring_resolve(struct crypt_device *cd,
+	struct luks2_hdr *hdr);
+
 void crypt_token_unload_external_all(struct crypt_device *cd);
+void crypt_token_handlers_release(struct crypt_device *cd);
 
 /*
  * Generic LUKS2 digest
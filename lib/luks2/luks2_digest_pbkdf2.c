@@ -19,22 +19,138 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <pthread.h>
 #include "luks2_internal.h"
 
 #define LUKS_DIGESTSIZE 20 // since SHA1
 #define LUKS_SALTSIZE 32
 #define LUKS_MKD_ITERATIONS_MS 125
 
+/*
+ * In-process cache of successfully verified volume keys. Entry is only
+ * a keyed hash (per-process random key) of all digest parameters and
+ * the volume key, so a hit means the same PBKDF2 computation already
+ * matched the same stored digest. Only positive results are cached.
+ */
+#define DIGEST_CACHE_ENTRIES	16
+#define DIGEST_CACHE_HASH	"sha256"
+#define DIGEST_CACHE_FP_SIZE	32
+
+static pthread_mutex_t digest_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool digest_cache_enabled = false;
+static bool digest_cache_keyed = false;
+static char digest_cache_key[DIGEST_CACHE_FP_SIZE];
+static char digest_cache[DIGEST_CACHE_ENTRIES][DIGEST_CACHE_FP_SIZE];
+static unsigned digest_cache_used, digest_cache_next;
+
+int crypt_digest_cache(struct crypt_device *cd, int enable)
+{
+	int r = 0;
+
+	pthread_mutex_lock(&digest_cache_lock);
+	if (enable && !digest_cache_keyed) {
+		r = crypt_random_get(cd, digest_cache_key, sizeof(digest_cache_key), CRYPT_RND_KEY);
+		digest_cache_keyed = !r;
+	}
+
+	if (!enable) {
+		crypt_safe_memzero(digest_cache_key, sizeof(digest_cache_key));
+		crypt_safe_memzero(digest_cache, sizeof(digest_cache));
+		digest_cache_keyed = false;
+		digest_cache_used = digest_cache_next = 0;
+	}
+	digest_cache_enabled = enable && !r;
+	pthread_mutex_unlock(&digest_cache_lock);
+
+	log_dbg(cd, "Digest verification cache %s.", digest_cache_enabled ? "enabled" : "disabled");
+
+	return r;
+}
+
+static int digest_cache_fingerprint(const char *key, const char *hashSpec,
+	unsigned int iterations, const char *salt, const char *digest, size_t digest_len,
+	const char *volume_key, size_t volume_key_len, char *fp)
+{
+	struct crypt_hmac *hmac;
+	uint32_t iter_le = cpu_to_le32(iterations);
+	int r;
+
+	if (crypt_hmac_init(&hmac, DIGEST_CACHE_HASH, key, DIGEST_CACHE_FP_SIZE))
+		return -EINVAL;
+
+	r = crypt_hmac_write(hmac, hashSpec, strlen(hashSpec) + 1);
+	if (!r)
+		r = crypt_hmac_write(hmac, (const char *)&iter_le, sizeof(iter_le));
+	if (!r)
+		r = crypt_hmac_write(hmac, salt, LUKS_SALTSIZE);
+	if (!r)
+		r = crypt_hmac_write(hmac, digest, digest_len);
+	if (!r)
+		r = crypt_hmac_write(hmac, volume_key, volume_key_len);
+	if (!r)
+		r = crypt_hmac_final(hmac, fp, DIGEST_CACHE_FP_SIZE);
+
+	crypt_hmac_destroy(hmac);
+	return r ? -EINVAL : 0;
+}
+
+/* Returns true on hit, computes fingerprint for later store if cache is enabled */
+static bool digest_cache_lookup(const char *hashSpec, unsigned int iterations,
+	const char *salt, const char *digest, size_t digest_len,
+	const char *volume_key, size_t volume_key_len, char *fp, bool *fp_valid)
+{
+	char key[DIGEST_CACHE_FP_SIZE];
+	bool enabled, hit = false;
+	unsigned i;
+
+	*fp_valid = false;
+
+	pthread_mutex_lock(&digest_cache_lock);
+	enabled = digest_cache_enabled;
+	if (enabled)
+		memcpy(key, digest_cache_key, sizeof(key));
+	pthread_mutex_unlock(&digest_cache_lock);
+
+	if (!enabled)
+		return false;
+
+	*fp_valid = !digest_cache_fingerprint(key, hashSpec, iterations, salt, digest,
+					     digest_len, volume_key, volume_key_len, fp);
+	crypt_safe_memzero(key, sizeof(key));
+	if (!*fp_valid)
+		return false;
+
+	pthread_mutex_lock(&digest_cache_lock);
+	for (i = 0; digest_cache_enabled && i < digest_cache_used && !hit; i++)
+		hit = !memcmp(digest_cache[i], fp, DIGEST_CACHE_FP_SIZE);
+	pthread_mutex_unlock(&digest_cache_lock);
+
+	return hit;
+}
+
+static void digest_cache_store(const char *fp)
+{
+	pthread_mutex_lock(&digest_cache_lock);
+	if (digest_cache_enabled) {
+		memcpy(digest_cache[digest_cache_next], fp, DIGEST_CACHE_FP_SIZE);
+		digest_cache_next = (digest_cache_next + 1) % DIGEST_CACHE_ENTRIES;
+		if (digest_cache_used < DIGEST_CACHE_ENTRIES)
+			digest_cache_used++;
+	}
+	pthread_mutex_unlock(&digest_cache_lock);
+}
+
 static int PBKDF2_digest_verify(struct crypt_device *cd,
 	int digest,
 	const char *volume_key,
 	size_t volume_key_len)
 {
-	char checkHashBuf[64];
+	char checkHashBuf[64], fp[DIGEST_CACHE_FP_SIZE];
 	json_object *jobj_digest, *jobj1;
 	const char *hashSpec;
 	char *mkDigest = NULL, mkDigestSalt[LUKS_SALTSIZE];
 	unsigned int mkDigestIterations;
+	bool fp_valid;
 	size_t len;
 	int r;
 
@@ -73,6 +189,14 @@ static int PBKDF2_digest_verify(struct crypt_device *cd,
 		return -EINVAL;
 	}
 
+	if (digest_cache_lookup(hashSpec, mkDigestIterations, mkDigestSalt, mkDigest, len,
+				volume_key, volume_key_len, fp, &fp_valid)) {
+		log_dbg(cd, "Digest %d verified from cache.", digest);
+		free(mkDigest);
+		crypt_safe_memzero(fp, sizeof(fp));
+		return 0;
+	}
+
 	r = -EPERM;
 	if (crypt_pbkdf(CRYPT_KDF_PBKDF2, hashSpec, volume_key, volume_key_len,
 			mkDigestSalt, LUKS_SALTSIZE,
@@ -84,7 +208,12 @@ static int PBKDF2_digest_verify(struct crypt_device *cd,
 			r = 0;
 	}
 
+	if (!r && fp_valid)
+		digest_cache_store(fp);
+
 	free(mkDigest);
+	crypt_safe_memzero(fp, sizeof(fp));
+	crypt_safe_memzero(checkHashBuf, sizeof(checkHashBuf));
 	return r;
 }
 
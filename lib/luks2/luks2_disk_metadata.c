@@ -20,6 +20,8 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "luks2_internal.h"
 
@@ -128,6 +130,92 @@ static int hdr_checksum_check(struct crypt_device *cd,
 	return 0;
 }
 
+/* Minimal JSON area size to verify checksums of header copies in parallel */
+#define LUKS2_HDR_CSUM_PARALLEL_MIN 0x40000
+
+struct hdr_csum_job {
+	struct luks2_hdr_disk hdr_tmp;
+	const char *json_area;
+	size_t json_len;
+	int r;
+};
+
+static void *hdr_csum_thread(void *arg)
+{
+	struct hdr_csum_job *job = arg;
+
+	job->r = hdr_checksum_calculate(job->hdr_tmp.checksum_alg, &job->hdr_tmp,
+					job->json_area, job->json_len);
+	return NULL;
+}
+
+static void hdr_csum_job_init(struct hdr_csum_job *job, const struct luks2_hdr_disk *hdr_disk,
+			      const char *json_area)
+{
+	memcpy(&job->hdr_tmp, hdr_disk, LUKS2_HDR_BIN_LEN);
+	memset(&job->hdr_tmp.csum, 0, sizeof(job->hdr_tmp.csum));
+	job->json_area = json_area;
+	job->json_len = be64_to_cpu(hdr_disk->hdr_size) - LUKS2_HDR_BIN_LEN;
+	job->r = -EINVAL;
+}
+
+static int hdr_csum_job_check(struct crypt_device *cd, struct hdr_csum_job *job,
+			      struct luks2_hdr_disk *hdr_disk)
+{
+	int hash_size, r = job->r;
+
+	hash_size = crypt_hash_size(hdr_disk->checksum_alg);
+	if (!r && hash_size <= 0)
+		r = -EINVAL;
+
+	if (!r) {
+		log_dbg_checksum(cd, hdr_disk->csum, hdr_disk->checksum_alg, "on-disk");
+		log_dbg_checksum(cd, job->hdr_tmp.csum, hdr_disk->checksum_alg, "in-memory");
+		if (memcmp(job->hdr_tmp.csum, hdr_disk->csum, (size_t)hash_size))
+			r = -EINVAL;
+	}
+
+	if (r)
+		log_dbg(cd, "LUKS2 header checksum error (offset %" PRIu64 ").",
+			be64_to_cpu(hdr_disk->hdr_offset));
+
+	memset(hdr_disk->csum, 0, LUKS2_CHECKSUM_L);
+
+	return r;
+}
+
+/*
+ * Verify checksums of both header copies read without checksum check.
+ * Large secondary header is verified in another thread concurrently.
+ * If *r2 is set (secondary header read failed), only primary is verified.
+ */
+static void hdr_checksums_check(struct crypt_device *cd,
+				struct luks2_hdr_disk *hdr_disk1, const char *json_area1, int *r1,
+				struct luks2_hdr_disk *hdr_disk2, const char *json_area2, int *r2)
+{
+	struct hdr_csum_job job1, job2;
+	pthread_t thread;
+	bool threaded = false;
+
+	hdr_csum_job_init(&job1, hdr_disk1, json_area1);
+	if (!*r2) {
+		hdr_csum_job_init(&job2, hdr_disk2, json_area2);
+		threaded = job2.json_len >= LUKS2_HDR_CSUM_PARALLEL_MIN && crypt_cpusonline() > 1 &&
+			   !pthread_create(&thread, NULL, hdr_csum_thread, &job2);
+	}
+
+	hdr_csum_thread(&job1);
+
+	if (threaded)
+		pthread_join(thread, NULL);
+	else if (!*r2)
+		hdr_csum_thread(&job2);
+
+	*r1 = hdr_csum_job_check(cd, &job1, hdr_disk1);
+	if (!*r2)
+		*r2 = hdr_csum_job_check(cd, &job2, hdr_disk2);
+}
+
 /*
  * Convert header from on-disk format to in-memory struct
  */
@@ -228,9 +316,69 @@ static int hdr_disk_sanity_check_pre(struct crypt_device *cd,
 /*
  * Read LUKS2 header from disk at specific offset.
  */
+/*
+ * The start of device is read once and both headers (with default 16KiB size)
+ * are then served from memory; it saves round-trips on network devices.
+ * The span also contains secondary binary header at 32KiB offset.
+ */
+#define LUKS2_HDR_PREFETCH_LEN 0x10000
+
+struct hdr_prefetch {
+	char *buf;
+	size_t len;
+};
+
+static void hdr_prefetch(struct crypt_device *cd, struct device *device,
+			 struct hdr_prefetch *pf)
+{
+	ssize_t len;
+	int devfd;
+
+	pf->buf = NULL;
+	pf->len = 0;
+
+	devfd = device_open_locked(cd, device, O_RDONLY);
+	if (devfd < 0)
+		return;
+
+	if (!(pf->buf = device_alloc_buffer(device, LUKS2_HDR_PREFETCH_LEN)))
+		return;
+
+	len = read_lseek_blockwise(devfd, device_block_size(cd, device),
+				   device_alignment(device), pf->buf,
+				   LUKS2_HDR_PREFETCH_LEN, 0);
+	if (len <= 0) {
+		free(pf->buf);
+		pf->buf = NULL;
+		return;
+	}
+
+	pf->len = len;
+}
+
+static void hdr_prefetch_free(struct hdr_prefetch *pf)
+{
+	free(pf->buf);
+	pf->buf = NULL;
+	pf->len = 0;
+}
+
+static ssize_t hdr_read_range(struct crypt_device *cd, struct device *device, int devfd,
+			      const struct hdr_prefetch *pf, void *buf, size_t len, uint64_t offset)
+{
+	if (pf && offset + len <= pf->len) {
+		memcpy(buf, pf->buf + offset, len);
+		return len;
+	}
+
+	return read_lseek_blockwise(devfd, device_block_size(cd, device),
+				    device_alignment(device), buf, len, offset);
+}
+
 static int hdr_read_disk(struct crypt_device *cd,
 			 struct device *device, struct luks2_hdr_disk *hdr_disk,
-			 char **json_area, uint64_t offset, int secondary)
+			 char **json_area, uint64_t offset, int secondary,
+			 const struct hdr_prefetch *pf, bool verify_checksum)
 {
 	size_t hdr_json_size = 0;
 	int devfd, r;
@@ -246,9 +394,8 @@ static int hdr_read_disk(struct crypt_device *cd,
 	 * Read binary header and run sanity check before reading
 	 * JSON area and validating checksum.
 	 */
-	if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-				 device_alignment(device), hdr_disk,
-				 LUKS2_HDR_BIN_LEN, offset) != LUKS2_HDR_BIN_LEN) {
+	if (hdr_read_range(cd, device, devfd, pf, hdr_disk,
+			   LUKS2_HDR_BIN_LEN, offset) != LUKS2_HDR_BIN_LEN) {
 		return -EIO;
 	}
 
@@ -258,21 +405,24 @@ static int hdr_read_disk(struct crypt_device *cd,
 	}
 
 	/*
-	 * Allocate and read JSON area. Always the whole area must be read.
+	 * Read JSON area to per-device metadata buffer (one for each copy).
+	 * Always the whole area must be read.
 	 */
-	*json_area = malloc(hdr_json_size);
+	*json_area = crypt_metadata_buffer(cd, secondary ? 1 : 0, hdr_json_size);
 	if (!*json_area) {
 		return -ENOMEM;
 	}
 
-	if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-				 device_alignment(device), *json_area, hdr_json_size,
-				 offset + LUKS2_HDR_BIN_LEN) != (ssize_t)hdr_json_size) {
-		free(*json_area);
+	if (hdr_read_range(cd, device, devfd, pf, *json_area, hdr_json_size,
+			   offset + LUKS2_HDR_BIN_LEN) != (ssize_t)hdr_json_size) {
 		*json_area = NULL;
 		return -EIO;
 	}
 
+	/* Checksum is verified later by caller (see hdr_checksums_check). */
+	if (!verify_checksum)
+		return 0;
+
 	/*
 	 * Calculate and validate checksum and zero it afterwards.
 	 */
@@ -286,27 +436,214 @@ static int hdr_read_disk(struct crypt_device *cd,
 	return r;
 }
 
+/*
+ * Optional process-wide cache of parsed and validated headers (global on
+ * library level). An entry is keyed by device identity and revalidated
+ * by comparing the primary binary header (seqid, salt, size, checksum) on disk.
+ */
+#define LUKS2_HDR_CACHE_MAX 64
+
+struct hdr_cache_entry {
+	dev_t dev;
+	ino_t ino;
+	uint64_t size;
+	uint64_t used;
+	struct luks2_hdr_disk hdr_disk;
+	struct luks2_hdr hdr;
+};
+
+static pthread_mutex_t _hdr_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hdr_cache_entry *_hdr_cache[LUKS2_HDR_CACHE_MAX];
+static bool _hdr_cache_enabled = false;
+static uint64_t _hdr_cache_counter = 0;
+
+static void hdr_cache_entry_free(struct hdr_cache_entry *e)
+{
+	if (!e)
+		return;
+	json_object_put(e->hdr.jobj);
+	free(e);
+}
+
+void LUKS2_hdr_cache_enable(bool enable)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&_hdr_cache_lock);
+	_hdr_cache_enabled = enable;
+	if (!enable)
+		for (i = 0; i < LUKS2_HDR_CACHE_MAX; i++) {
+			hdr_cache_entry_free(_hdr_cache[i]);
+			_hdr_cache[i] = NULL;
+		}
+	pthread_mutex_unlock(&_hdr_cache_lock);
+}
+
+static int hdr_cache_key(struct crypt_device *cd, struct device *device,
+			 dev_t *dev, ino_t *ino, uint64_t *size)
+{
+	struct stat st;
+	int devfd;
+
+	devfd = device_open_locked(cd, device, O_RDONLY);
+	if (devfd < 0 || fstat(devfd, &st) < 0)
+		return -EINVAL;
+
+	if (S_ISBLK(st.st_mode)) {
+		*dev = st.st_rdev;
+		*ino = 0;
+	} else {
+		*dev = st.st_dev;
+		*ino = st.st_ino;
+	}
+
+	return device_size(device, size);
+}
+
+static int hdr_cache_find(dev_t dev, ino_t ino, uint64_t size)
+{
+	int i;
+
+	for (i = 0; i < LUKS2_HDR_CACHE_MAX; i++)
+		if (_hdr_cache[i] && _hdr_cache[i]->dev == dev &&
+		    _hdr_cache[i]->ino == ino && _hdr_cache[i]->size == size)
+			return i;
+
+	return -1;
+}
+
+static int hdr_cache_lookup(struct crypt_device *cd, struct device *device,
+			    struct luks2_hdr *hdr)
+{
+	struct luks2_hdr_disk hdr_disk;
+	struct hdr_cache_entry *e;
+	uint64_t size;
+	dev_t dev;
+	ino_t ino;
+	int devfd, i, r = -ENOENT;
+
+	if (!_hdr_cache_enabled || hdr_cache_key(cd, device, &dev, &ino, &size))
+		return -ENOENT;
+
+	devfd = device_open_locked(cd, device, O_RDONLY);
+	if (devfd < 0 || read_lseek_blockwise(devfd, device_block_size(cd, device),
+	    device_alignment(device), &hdr_disk, LUKS2_HDR_BIN_LEN, 0) != LUKS2_HDR_BIN_LEN)
+		return -ENOENT;
+
+	pthread_mutex_lock(&_hdr_cache_lock);
+	i = hdr_cache_find(dev, ino, size);
+	if (i >= 0) {
+		e = _hdr_cache[i];
+		if (memcmp(&e->hdr_disk, &hdr_disk, LUKS2_HDR_BIN_LEN)) {
+			log_dbg(cd, "Cached LUKS2 header is stale.");
+			hdr_cache_entry_free(e);
+			_hdr_cache[i] = NULL;
+		} else {
+			memcpy(hdr, &e->hdr, sizeof(*hdr));
+			hdr->jobj = NULL;
+			r = json_object_copy(e->hdr.jobj, (json_object **)&hdr->jobj) ? -ENOMEM : 0;
+			e->used = ++_hdr_cache_counter;
+		}
+	}
+	pthread_mutex_unlock(&_hdr_cache_lock);
+
+	if (!r)
+		log_dbg(cd, "Using cached LUKS2 header (seqid %" PRIu64 ").", hdr->seqid);
+
+	return r;
+}
+
+/* Stored binary header includes on-disk checksum (it covers JSON area too) */
+static void hdr_cache_store(struct crypt_device *cd, struct device *device,
+			    const struct luks2_hdr_disk *hdr_disk, const uint8_t *csum,
+			    const struct luks2_hdr *hdr)
+{
+	struct hdr_cache_entry *e;
+	uint64_t size;
+	dev_t dev;
+	ino_t ino;
+	int i, j;
+
+	if (!_hdr_cache_enabled || hdr_cache_key(cd, device, &dev, &ino, &size))
+		return;
+
+	e = malloc(sizeof(*e));
+	if (!e)
+		return;
+
+	e->dev = dev;
+	e->ino = ino;
+	e->size = size;
+	memcpy(&e->hdr_disk, hdr_disk, LUKS2_HDR_BIN_LEN);
+	memcpy(e->hdr_disk.csum, csum, LUKS2_CHECKSUM_L);
+	memcpy(&e->hdr, hdr, sizeof(*hdr));
+	e->hdr.jobj = NULL;
+	if (json_object_copy(hdr->jobj, (json_object **)&e->hdr.jobj)) {
+		free(e);
+		return;
+	}
+
+	pthread_mutex_lock(&_hdr_cache_lock);
+	e->used = ++_hdr_cache_counter;
+	i = hdr_cache_find(dev, ino, size);
+	/* Replace the same device entry, a free one or the least recently used one */
+	for (j = 0; i < 0 && j < LUKS2_HDR_CACHE_MAX; j++)
+		if (!_hdr_cache[j])
+			i = j;
+	if (i < 0)
+		for (i = 0, j = 1; j < LUKS2_HDR_CACHE_MAX; j++)
+			if (_hdr_cache[j]->used < _hdr_cache[i]->used)
+				i = j;
+	hdr_cache_entry_free(_hdr_cache[i]);
+	_hdr_cache[i] = e;
+	pthread_mutex_unlock(&_hdr_cache_lock);
+}
+
+static void hdr_cache_invalidate(struct crypt_device *cd, struct device *device)
+{
+	uint64_t size;
+	dev_t dev;
+	ino_t ino;
+	int i;
+
+	if (!_hdr_cache_enabled || hdr_cache_key(cd, device, &dev, &ino, &size))
+		return;
+
+	pthread_mutex_lock(&_hdr_cache_lock);
+	i = hdr_cache_find(dev, ino, size);
+	if (i >= 0) {
+		hdr_cache_entry_free(_hdr_cache[i]);
+		_hdr_cache[i] = NULL;
+	}
+	pthread_mutex_unlock(&_hdr_cache_lock);
+}
+
 /*
  * Write LUKS2 header to disk at specific offset.
+ * Only first write_len bytes of json area are written (whole area if 0),
+ * the rest of the area must be already zeroed on disk.
  */
 static int hdr_write_disk(struct crypt_device *cd,
 			  struct device *device, struct luks2_hdr *hdr,
-			  const char *json_area, int secondary)
+			  const char *json_area, size_t write_len,
+			  const uint8_t *csum, int secondary)
 {
 	struct luks2_hdr_disk hdr_disk;
 	uint64_t offset = secondary ? hdr->hdr_size : 0;
 	size_t hdr_json_len;
 	int devfd, r;
 
-	log_dbg(cd, "Trying to write LUKS2 header (%zu bytes) at offset %" PRIu64 ".",
-		hdr->hdr_size, offset);
+	hdr_json_len = hdr->hdr_size - LUKS2_HDR_BIN_LEN;
+	if (!write_len || write_len > hdr_json_len)
+		write_len = hdr_json_len;
+
+	log_dbg(cd, "Trying to write LUKS2 header (%zu bytes, %zu bytes of JSON area) at offset %" PRIu64 ".",
+		hdr->hdr_size, write_len, offset);
 
 	devfd = device_open_locked(cd, device, O_RDWR);
 	if (devfd < 0)
 		return devfd == -1 ? -EINVAL : devfd;
 
-	hdr_json_len = hdr->hdr_size - LUKS2_HDR_BIN_LEN;
-
 	hdr_to_disk(hdr, &hdr_disk, secondary, offset);
 
 	/*
@@ -323,16 +660,20 @@ static int hdr_write_disk(struct crypt_device *cd,
 	 */
 	if (write_lseek_blockwise(devfd, device_block_size(cd, device),
 				  device_alignment(device),
-				  CONST_CAST(char*)json_area, hdr_json_len,
-				  LUKS2_HDR_BIN_LEN + offset) < (ssize_t)hdr_json_len) {
+				  CONST_CAST(char*)json_area, write_len,
+				  LUKS2_HDR_BIN_LEN + offset) < (ssize_t)write_len) {
 		return -EIO;
 	}
 
 	/*
-	 * Calculate checksum and write header with checksum.
+	 * Calculate (or use precalculated) checksum and write header with checksum.
 	 */
-	r = hdr_checksum_calculate(hdr_disk.checksum_alg, &hdr_disk,
-				   json_area, hdr_json_len);
+	if (csum) {
+		memcpy(hdr_disk.csum, csum, LUKS2_CHECKSUM_L);
+		r = 0;
+	} else
+		r = hdr_checksum_calculate(hdr_disk.checksum_alg, &hdr_disk,
+					   json_area, hdr_json_len);
 	if (r < 0) {
 		return r;
 	}
@@ -347,6 +688,33 @@ static int hdr_write_disk(struct crypt_device *cd,
 	return r;
 }
 
+/*
+ * Both copies (with verified checksum) carry the same metadata.
+ * Sequence id must match, otherwise one of copies is obsolete.
+ */
+static bool hdr_json_area_same(const struct luks2_hdr_disk *hdr_disk1, const char *json_area1,
+			       const struct luks2_hdr_disk *hdr_disk2, const char *json_area2)
+{
+	if (hdr_disk1->hdr_size != hdr_disk2->hdr_size ||
+	    hdr_disk1->seqid != hdr_disk2->seqid)
+		return false;
+
+	return !memcmp(json_area1, json_area2, be64_to_cpu(hdr_disk1->hdr_size) - LUKS2_HDR_BIN_LEN);
+}
+
+/*
+ * Track used JSON area length only for header copies placed
+ * at the offsets implied by the in-memory header size.
+ */
+static void hdr_json_len_disk(struct luks2_hdr *hdr,
+			      const struct luks2_hdr_disk *hdr_disk1,
+			      const struct luks2_hdr_disk *hdr_disk2,
+			      size_t json_len1, size_t json_len2)
+{
+	hdr->json_len_disk[0] = be64_to_cpu(hdr_disk1->hdr_size) == hdr->hdr_size ? json_len1 : 0;
+	hdr->json_len_disk[1] = be64_to_cpu(hdr_disk2->hdr_size) == hdr->hdr_size ? json_len2 : 0;
+}
+
 static int LUKS2_check_sequence_id(struct crypt_device *cd, struct luks2_hdr *hdr, struct device *device)
 {
 	int devfd;
@@ -399,12 +767,60 @@ int LUKS2_device_write_lock(struct crypt_device *cd, struct luks2_hdr *hdr, stru
  * Convert in-memory LUKS2 header and write it to disk.
  * This will increase sequence id, write both header copies and calculate checksum.
  */
-int LUKS2_disk_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr, struct device *device, bool seqid_check)
+/*
+ * Serialize JSON directly to zeroed JSON area and calculate checksums
+ * of both header copies (with current seqid) in the same pass.
+ */
+static int hdr_json_area_generate(struct crypt_device *cd, struct luks2_hdr *hdr,
+				  char *json_area, size_t json_area_len,
+				  struct luks2_hdr_disk *hdr_disk, size_t *json_len)
+{
+	struct crypt_hash *hd[2] = {};
+	int i, hash_size, r = 0;
+
+	hash_size = crypt_hash_size(hdr->checksum_alg);
+	if (hash_size <= 0)
+		return -EINVAL;
+
+	/* Binary headers, csum zeroed. */
+	for (i = 0; i < 2 && !r; i++) {
+		hdr_to_disk(hdr, &hdr_disk[i], i, i ? hdr->hdr_size : 0);
+		if (crypt_hash_init(&hd[i], hdr->checksum_alg))
+			r = -EINVAL;
+		else
+			r = crypt_hash_write(hd[i], (char*)&hdr_disk[i], LUKS2_HDR_BIN_LEN);
+	}
+
+	/* Space-efficient JSON text, at least one trailing zero byte is required. */
+	if (!r) {
+		r = LUKS2_json_serialize(hdr->jobj, json_area, json_area_len - 1, hd, 2, json_len);
+		if (r == -ENOSPC) {
+			log_dbg(cd, "JSON is too large (> %zu).", json_area_len - 1);
+			r = -EINVAL;
+		} else if (r)
+			log_dbg(cd, "Cannot parse JSON object to text representation.");
+	}
+
+	/* Unused JSON area space */
+	for (i = 0; i < 2 && !r; i++) {
+		r = crypt_hash_write(hd[i], json_area + *json_len, json_area_len - *json_len);
+		if (!r)
+			r = crypt_hash_final(hd[i], (char*)hdr_disk[i].csum, (size_t)hash_size);
+	}
+
+	for (i = 0; i < 2; i++)
+		if (hd[i])
+			crypt_hash_destroy(hd[i]);
+
+	return r;
+}
+
+static int hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr, struct device *device, bool seqid_check)
 {
+	struct luks2_hdr_disk hdr_disk[2];
 	char *json_area;
-	const char *json_text;
-	size_t json_area_len;
-	int r;
+	size_t json_area_len, json_len, write_len;
+	int i, r;
 
 	if (hdr->version != 2) {
 		log_dbg(cd, "Unsupported LUKS2 header version (%u).", hdr->version);
@@ -416,55 +832,87 @@ int LUKS2_disk_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr, struct
 		return r;
 
 	/*
-	 * Allocate and zero JSON area (of proper header size).
+	 * Zeroed JSON area (of proper header size) in reused per-device buffer.
+	 * Aligned buffer is written directly, without bounce buffer.
 	 */
 	json_area_len = hdr->hdr_size - LUKS2_HDR_BIN_LEN;
-	json_area = crypt_zalloc(json_area_len);
+	json_area = crypt_metadata_buffer(cd, 0, json_area_len);
 	if (!json_area)
 		return -ENOMEM;
 
-	/*
-	 * Generate text space-efficient JSON representation to json area.
-	 */
-	json_text = json_object_to_json_string_ext(hdr->jobj,
-			JSON_C_TO_STRING_PLAIN | JSON_C_TO_STRING_NOSLASHESCAPE);
-	if (!json_text || !*json_text) {
-		log_dbg(cd, "Cannot parse JSON object to text representation.");
-		free(json_area);
-		return -ENOMEM;
-	}
-	if (strlen(json_text) > (json_area_len - 1)) {
-		log_dbg(cd, "JSON is too large (%zu > %zu).", strlen(json_text), json_area_len);
-		free(json_area);
-		return -EINVAL;
-	}
-	strncpy(json_area, json_text, json_area_len);
-
 	if (seqid_check)
 		r = LUKS2_device_write_lock(cd, hdr, device);
 	else
 		r = device_write_lock(cd, device);
-	if (r < 0) {
-		free(json_area);
+	if (r < 0)
 		return r;
-	}
+
+	hdr_cache_invalidate(cd, device);
 
 	/* Increase sequence id before writing it to disk. */
 	hdr->seqid++;
 
-	/* Write primary and secondary header */
-	r = hdr_write_disk(cd, device, hdr, json_area, 0);
-	if (!r)
-		r = hdr_write_disk(cd, device, hdr, json_area, 1);
+	r = hdr_json_area_generate(cd, hdr, json_area, json_area_len, hdr_disk, &json_len);
+	if (r) {
+		hdr->seqid--;
+		device_write_unlock(cd, device);
+		return r;
+	}
+
+	/*
+	 * Without sequence id check the on-disk content is not known,
+	 * rewrite whole JSON areas then.
+	 */
+	if (!seqid_check)
+		hdr->json_len_disk[0] = hdr->json_len_disk[1] = 0;
+
+	/*
+	 * Write primary and secondary header. Only the used JSON length and
+	 * the area that was used by previous metadata (zeroed now) is written.
+	 */
+	for (i = 0, r = 0; i < 2 && !r; i++) {
+		write_len = hdr->json_len_disk[i];
+		if (write_len && write_len < json_len)
+			write_len = json_len;
+		r = hdr_write_disk(cd, device, hdr, json_area, write_len, hdr_disk[i].csum, i);
+		hdr->json_len_disk[i] = r ? 0 : json_len;
+	}
 
 	if (r)
 		log_dbg(cd, "LUKS2 header write failed (%d).", r);
 
 	device_write_unlock(cd, device);
 
-	free(json_area);
 	return r;
 }
+
+int LUKS2_disk_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr, struct device *device, bool seqid_check)
+{
+	int r;
+
+	TRACE2(hdr__write__start, device_path(device), hdr->seqid);
+	r = hdr_write(cd, hdr, device, seqid_check);
+	TRACE2(hdr__write__end, device_path(device), r);
+
+	return r;
+}
+
+static bool json_area_nonzero(const char *buf, uint64_t len)
+{
+	static const char zero[4096];
+	uint64_t block;
+
+	while (len) {
+		block = len > sizeof(zero) ? sizeof(zero) : len;
+		if (memcmp(buf, zero, block))
+			return true;
+		buf += block;
+		len -= block;
+	}
+
+	return false;
+}
+
 static int validate_json_area(struct crypt_device *cd, const char *json_area,
 			      uint64_t json_len, uint64_t max_length)
 {
@@ -487,6 +935,10 @@ static int validate_json_area(struct crypt_device *cd, const char *json_area,
 	 *	'json_area' and 'json_area + json_len'
 	 */
 
+	/* Fast check of the (usually whole) zeroed area, locate offending byte only on failure. */
+	if (!json_area_nonzero(json_area + json_len, max_length - json_len))
+		return 0;
+
 	do {
 		c = *(json_area + json_len);
 		if (c != '\0') {
@@ -601,17 +1053,20 @@ static int detect_device_signatures(struct crypt_device *cd, const char *path)
  * Read and convert on-disk LUKS2 header to in-memory representation..
  * Try to do recovery if on-disk state is not consistent.
  */
-int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
-			struct device *device, int do_recovery, int do_blkprobe)
+static int hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
+		    struct device *device, int do_recovery, int do_blkprobe, bool lockless)
 {
 	enum { HDR_OK, HDR_OBSOLETE, HDR_FAIL, HDR_FAIL_IO } state_hdr1, state_hdr2;
 	struct luks2_hdr_disk hdr_disk1, hdr_disk2;
 	char *json_area1 = NULL, *json_area2 = NULL;
+	uint8_t csum1[LUKS2_CHECKSUM_L];
 	json_object *jobj_hdr1 = NULL, *jobj_hdr2 = NULL;
+	size_t json_len1 = 0, json_len2 = 0;
 	unsigned int i;
-	int r;
+	int r, r2 = -EINVAL;
 	uint64_t hdr_size;
 	uint64_t hdr2_offsets[] = LUKS2_HDR2_OFFSETS;
+	struct hdr_prefetch pf;
 
 	/* Skip auto-recovery if locks are disabled and we're not doing LUKS2 explicit repair */
 	if (do_recovery && do_blkprobe && !crypt_metadata_locking_enabled()) {
@@ -619,42 +1074,70 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 		log_dbg(cd, "Disabling header auto-recovery due to locking being disabled.");
 	}
 
+	/* Cache is used only for standard (auto-recovery) load */
+	if (do_recovery && do_blkprobe && !hdr_cache_lookup(cd, device, hdr))
+		return 0;
+
+	hdr_prefetch(cd, device, &pf);
+
 	/*
-	 * Read primary LUKS2 header (offset 0).
+	 * Read primary LUKS2 header (offset 0) and secondary header (follows primary),
+	 * checksums of both are verified at once.
 	 */
 	state_hdr1 = HDR_FAIL;
-	r = hdr_read_disk(cd, device, &hdr_disk1, &json_area1, 0, 0);
+	r = hdr_read_disk(cd, device, &hdr_disk1, &json_area1, 0, 0, &pf, false);
+	if (r == 0) {
+		/* checksum is zeroed by verification, cache compares it */
+		memcpy(csum1, hdr_disk1.csum, LUKS2_CHECKSUM_L);
+		r2 = hdr_read_disk(cd, device, &hdr_disk2, &json_area2, be64_to_cpu(hdr_disk1.hdr_size), 1, &pf, false);
+		hdr_checksums_check(cd, &hdr_disk1, json_area1, &r, &hdr_disk2, json_area2, &r2);
+	}
 	if (r == 0) {
 		jobj_hdr1 = parse_and_validate_json(cd, json_area1, be64_to_cpu(hdr_disk1.hdr_size) - LUKS2_HDR_BIN_LEN);
 		state_hdr1 = jobj_hdr1 ? HDR_OK : HDR_OBSOLETE;
+		/* validated JSON area is zeroed beyond JSON string */
+		if (jobj_hdr1)
+			json_len1 = strnlen(json_area1, be64_to_cpu(hdr_disk1.hdr_size) - LUKS2_HDR_BIN_LEN);
 	} else if (r == -EIO)
 		state_hdr1 = HDR_FAIL_IO;
 
 	/*
-	 * Read secondary LUKS2 header (follows primary).
+	 * Secondary LUKS2 header (follows primary).
 	 */
 	state_hdr2 = HDR_FAIL;
 	if (state_hdr1 != HDR_FAIL && state_hdr1 != HDR_FAIL_IO) {
-		r = hdr_read_disk(cd, device, &hdr_disk2, &json_area2, be64_to_cpu(hdr_disk1.hdr_size), 1);
-		if (r == 0) {
+		r = r2;
+		if (r == 0 && jobj_hdr1 && hdr_json_area_same(&hdr_disk1, json_area1, &hdr_disk2, json_area2)) {
+			/* Secondary header is consistent, do not parse and validate the same JSON again. */
+			log_dbg(cd, "Secondary LUKS2 header JSON area matches primary header.");
+			state_hdr2 = HDR_OK;
+			json_len2 = json_len1;
+		} else if (r == 0) {
 			jobj_hdr2 = parse_and_validate_json(cd, json_area2, be64_to_cpu(hdr_disk2.hdr_size) - LUKS2_HDR_BIN_LEN);
 			state_hdr2 = jobj_hdr2 ? HDR_OK : HDR_OBSOLETE;
+			if (jobj_hdr2)
+				json_len2 = strnlen(json_area2, be64_to_cpu(hdr_disk2.hdr_size) - LUKS2_HDR_BIN_LEN);
 		} else if (r == -EIO)
 			state_hdr2 = HDR_FAIL_IO;
 	} else {
 		/*
 		 * No header size, check all known offsets.
+		 * (The lowest ones are already in the prefetched area.)
 		 */
 		for (r = -EINVAL,i = 0; r < 0 && i < ARRAY_SIZE(hdr2_offsets); i++)
-			r = hdr_read_disk(cd, device, &hdr_disk2, &json_area2, hdr2_offsets[i], 1);
+			r = hdr_read_disk(cd, device, &hdr_disk2, &json_area2, hdr2_offsets[i], 1, &pf, true);
 
 		if (r == 0) {
 			jobj_hdr2 = parse_and_validate_json(cd, json_area2, be64_to_cpu(hdr_disk2.hdr_size) - LUKS2_HDR_BIN_LEN);
 			state_hdr2 = jobj_hdr2 ? HDR_OK : HDR_OBSOLETE;
+			if (jobj_hdr2 && hdr2_offsets[i - 1] == be64_to_cpu(hdr_disk2.hdr_size))
+				json_len2 = strnlen(json_area2, be64_to_cpu(hdr_disk2.hdr_size) - LUKS2_HDR_BIN_LEN);
 		} else if (r == -EIO)
 			state_hdr2 = HDR_FAIL_IO;
 	}
 
+	hdr_prefetch_free(&pf);
+
 	/*
 	 * Check sequence id if both headers are read correctly.
 	 */
@@ -665,6 +1148,12 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 			state_hdr1 = HDR_OBSOLETE;
 	}
 
+	/* Without lock, header copies may differ due to concurrent write */
+	if (lockless && (state_hdr1 != HDR_OK || state_hdr2 != HDR_OK)) {
+		r = -EAGAIN;
+		goto err;
+	}
+
 	/* check header with keyslots to fit the device */
 	if (state_hdr1 == HDR_OK)
 		hdr_size = LUKS2_hdr_and_areas_size_jobj(jobj_hdr1);
@@ -698,7 +1187,8 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 				log_dbg(cd, "Cannot generate master salt.");
 			else {
 				hdr_from_disk(&hdr_disk1, &hdr_disk2, hdr, 0);
-				r = hdr_write_disk(cd, device, hdr, json_area1, 1);
+				r = hdr_write_disk(cd, device, hdr, json_area1, 0, NULL, 1);
+				json_len2 = r ? 0 : json_len1;
 			}
 			if (r)
 				log_dbg(cd, "Secondary LUKS2 header recovery failed.");
@@ -719,17 +1209,16 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 				log_dbg(cd, "Cannot generate master salt.");
 			else {
 				hdr_from_disk(&hdr_disk2, &hdr_disk1, hdr, 1);
-				r = hdr_write_disk(cd, device, hdr, json_area2, 0);
+				r = hdr_write_disk(cd, device, hdr, json_area2, 0, NULL, 0);
+				json_len1 = r ? 0 : json_len2;
 			}
 			if (r)
 				log_dbg(cd, "Primary LUKS2 header recovery failed.");
 		}
 	}
 
-	free(json_area1);
-	json_area1 = NULL;
-	free(json_area2);
-	json_area2 = NULL;
+	/* JSON areas are in per-device buffers, reused on the next access */
+	json_area1 = json_area2 = NULL;
 
 	/* wrong lock for write mode during recovery attempt */
 	if (r == -EAGAIN)
@@ -742,10 +1231,15 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 		hdr_from_disk(&hdr_disk1, &hdr_disk2, hdr, 0);
 		hdr->jobj = jobj_hdr1;
 		json_object_put(jobj_hdr2);
+		hdr_json_len_disk(hdr, &hdr_disk1, &hdr_disk2, json_len1, json_len2);
+		/* Only consistent headers (no recovery needed) are cached */
+		if (do_recovery && do_blkprobe && state_hdr2 == HDR_OK)
+			hdr_cache_store(cd, device, &hdr_disk1, csum1, hdr);
 	} else if (state_hdr2 == HDR_OK) {
 		hdr_from_disk(&hdr_disk2, &hdr_disk1, hdr, 1);
 		hdr->jobj = jobj_hdr2;
 		json_object_put(jobj_hdr1);
+		hdr_json_len_disk(hdr, &hdr_disk1, &hdr_disk2, json_len1, json_len2);
 	}
 
 	/*
@@ -756,14 +1250,49 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 err:
 	log_dbg(cd, "LUKS2 header read failed (%d).", r);
 
-	free(json_area1);
-	free(json_area2);
 	json_object_put(jobj_hdr1);
 	json_object_put(jobj_hdr2);
 	hdr->jobj = NULL;
 	return r;
 }
 
+int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
+			struct device *device, int do_recovery, int do_blkprobe)
+{
+	int r;
+
+	TRACE1(hdr__read__start, device_path(device));
+	r = hdr_read(cd, hdr, device, do_recovery, do_blkprobe, false);
+	TRACE2(hdr__read__end, device_path(device), r);
+
+	return r;
+}
+
+/*
+ * Optimistic header read without metadata lock. The result is used only
+ * if both header copies are consistent and the sequence id on disk did not
+ * change after the read (no writer intervened). Otherwise returns -EAGAIN
+ * and caller must read header again under lock.
+ */
+int LUKS2_disk_hdr_read_lockless(struct crypt_device *cd, struct luks2_hdr *hdr,
+				 struct device *device)
+{
+	int r;
+
+	device_set_lockless_read(device, true);
+
+	r = hdr_read(cd, hdr, device, 1, 1, true);
+	if (!r && LUKS2_check_sequence_id(cd, hdr, device)) {
+		log_dbg(cd, "LUKS2 header changed during lockless read.");
+		LUKS2_hdr_free(cd, hdr);
+		r = -EAGAIN;
+	}
+
+	device_set_lockless_read(device, false);
+
+	return r;
+}
+
 int LUKS2_hdr_version_unlocked(struct crypt_device *cd, const char *backup_file)
 {
 	struct {
@@ -799,3 +1328,103 @@ int LUKS2_hdr_version_unlocked(struct crypt_device *cd, const char *backup_file)
 
 	return r;
 }
+
+/*
+ * Fast probe of binary header(s) only, JSON area is read for checksum
+ * verification of the primary header but it is not parsed and no lock is taken.
+ * With strict check the secondary binary header must match the primary one
+ * (-EAGAIN is returned otherwise, caller should then use full header load
+ * that can recover from the other copy).
+ */
+int LUKS2_hdr_probe_unlocked(struct crypt_device *cd, char *uuid, size_t uuid_size, bool strict)
+{
+	uint64_t hdr2_offsets[] = LUKS2_HDR2_OFFSETS;
+	struct luks2_hdr_disk hdr1, hdr2;
+	struct device *device = crypt_metadata_device(cd);
+	uint64_t hdr_size;
+	size_t json_len;
+	char *json_area;
+	int r = -EINVAL, devfd, flags;
+	unsigned i;
+
+	if (!device)
+		return -EINVAL;
+
+	flags = O_RDONLY;
+	if (device_direct_io(device))
+		flags |= O_DIRECT;
+
+	devfd = open(device_path(device), flags);
+	if (devfd < 0)
+		return -EINVAL;
+
+	if (read_lseek_blockwise(devfd, device_block_size(cd, device), device_alignment(device),
+	    &hdr1, LUKS2_HDR_BIN_LEN, 0) != LUKS2_HDR_BIN_LEN)
+		goto out;
+
+	if (memcmp(hdr1.magic, LUKS2_MAGIC_1ST, LUKS2_MAGIC_L) ||
+	    be16_to_cpu(hdr1.version) != 2 || be64_to_cpu(hdr1.hdr_offset))
+		goto fallback;
+
+	hdr_size = be64_to_cpu(hdr1.hdr_size);
+	for (i = 0; i < ARRAY_SIZE(hdr2_offsets); i++)
+		if (hdr_size == hdr2_offsets[i])
+			break;
+	if (i == ARRAY_SIZE(hdr2_offsets)) {
+		log_dbg(cd, "LUKS2 header size 0x%" PRIx64 " is not valid.", hdr_size);
+		goto fallback;
+	}
+
+	hdr1.checksum_alg[LUKS2_CHECKSUM_ALG_L - 1] = '\0';
+	if (crypt_hash_size(hdr1.checksum_alg) <= 0) {
+		log_dbg(cd, "Unknown LUKS2 header checksum algorithm %s.", hdr1.checksum_alg);
+		goto fallback;
+	}
+
+	if (!memchr(hdr1.uuid, '\0', LUKS2_UUID_L))
+		goto fallback;
+
+	json_len = hdr_size - LUKS2_HDR_BIN_LEN;
+	json_area = malloc(json_len);
+	if (!json_area) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	if (read_lseek_blockwise(devfd, device_block_size(cd, device), device_alignment(device),
+	    json_area, json_len, LUKS2_HDR_BIN_LEN) != (ssize_t)json_len ||
+	    hdr_checksum_check(cd, hdr1.checksum_alg, &hdr1, json_area, json_len)) {
+		log_dbg(cd, "LUKS2 primary header checksum error.");
+		free(json_area);
+		goto fallback;
+	}
+	free(json_area);
+
+	if (strict) {
+		if (read_lseek_blockwise(devfd, device_block_size(cd, device), device_alignment(device),
+		    &hdr2, LUKS2_HDR_BIN_LEN, hdr_size) != LUKS2_HDR_BIN_LEN ||
+		    memcmp(hdr2.magic, LUKS2_MAGIC_2ND, LUKS2_MAGIC_L) ||
+		    be16_to_cpu(hdr2.version) != 2 ||
+		    be64_to_cpu(hdr2.hdr_offset) != hdr_size ||
+		    be64_to_cpu(hdr2.hdr_size) != hdr_size ||
+		    hdr1.seqid != hdr2.seqid ||
+		    memcmp(hdr1.uuid, hdr2.uuid, LUKS2_UUID_L)) {
+			log_dbg(cd, "LUKS2 binary headers differ.");
+			r = -EAGAIN;
+			goto out;
+		}
+	}
+
+	if (uuid && snprintf(uuid, uuid_size, "%s", hdr1.uuid) >= (int)uuid_size)
+		r = -ENOMEM;
+	else
+		r = 0;
+	goto out;
+fallback:
+	/* primary header is damaged, only full load can use secondary one */
+	if (strict)
+		r = -EAGAIN;
+out:
+	close(devfd);
+	return r;
+}
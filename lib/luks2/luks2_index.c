@@ -0,0 +1,289 @@
+/*
+ * LUKS - Linux Unified Key Setup v2, indexed view of JSON metadata
+ *
+ * Copyright (C) 2021 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "luks2_internal.h"
+
+/* JSON object keys are validated numbers */
+static int index_id(const char *key, int max)
+{
+	char *endptr;
+	long id;
+
+	errno = 0;
+	id = strtol(key, &endptr, 10);
+	if (*endptr || errno || id < 0 || id >= max)
+		return -EINVAL;
+
+	return id;
+}
+
+static int index_ids_mask(json_object *jobj_array, int max, uint32_t *mask)
+{
+	int i, id;
+
+	*mask = 0;
+
+	for (i = 0; i < (int) json_object_array_length(jobj_array); i++) {
+		id = index_id(json_object_get_string(json_object_array_get_idx(jobj_array, i)), max);
+		if (id < 0)
+			return id;
+		*mask |= 1U << id;
+	}
+
+	return 0;
+}
+
+static int index_keyslots(json_object *jobj_keyslots, struct luks2_index *idx)
+{
+	int id;
+
+	json_object_object_foreach(jobj_keyslots, key, val) {
+		if ((id = index_id(key, LUKS2_KEYSLOTS_MAX)) < 0)
+			return id;
+		idx->keyslots[id].jobj = val;
+	}
+
+	return 0;
+}
+
+static int index_tokens(json_object *jobj_tokens, struct luks2_index *idx)
+{
+	json_object *jobj;
+	int id, r;
+
+	json_object_object_foreach(jobj_tokens, key, val) {
+		if ((id = index_id(key, LUKS2_TOKENS_MAX)) < 0)
+			return id;
+		idx->tokens[id].jobj = val;
+		if (json_object_object_get_ex(val, "keyslots", &jobj) &&
+		    (r = index_ids_mask(jobj, LUKS2_KEYSLOTS_MAX, &idx->tokens[id].keyslots)))
+			return r;
+	}
+
+	return 0;
+}
+
+static int index_digests(json_object *jobj_digests, struct luks2_index *idx)
+{
+	json_object *jobj;
+	int id, r;
+
+	json_object_object_foreach(jobj_digests, key, val) {
+		if ((id = index_id(key, LUKS2_DIGEST_MAX)) < 0)
+			return id;
+		idx->digests[id].jobj = val;
+		if (json_object_object_get_ex(val, "keyslots", &jobj) &&
+		    (r = index_ids_mask(jobj, LUKS2_KEYSLOTS_MAX, &idx->digests[id].keyslots)))
+			return r;
+		if (json_object_object_get_ex(val, "segments", &jobj) &&
+		    (r = index_ids_mask(jobj, LUKS2_SEGMENT_MAX, &idx->digests[id].segments)))
+			return r;
+	}
+
+	return 0;
+}
+
+static int index_segments(json_object *jobj_segments, struct luks2_index *idx)
+{
+	json_object *jobj;
+	int id;
+
+	json_object_object_foreach(jobj_segments, key, val) {
+		if ((id = index_id(key, LUKS2_SEGMENT_MAX)) < 0)
+			return id;
+		idx->segments[id].jobj = val;
+		idx->segments[id].offset = json_segment_get_offset(val, 0);
+		idx->segments[id].size = json_segment_get_size(val, 0);
+		idx->segments[id].backup = json_segment_is_backup(val);
+		if (!idx->segments[id].backup)
+			idx->segments_count++;
+		if (idx->default_segment < 0 && json_object_object_get_ex(val, "flags", &jobj) &&
+		    LUKS2_array_jobj(jobj, "backup-final"))
+			idx->default_segment = id;
+	}
+
+	return 0;
+}
+
+static int index_sections(struct luks2_hdr *hdr, struct luks2_index *idx)
+{
+	json_object *jobj;
+	int r = 0;
+
+	if (json_object_object_get_ex(hdr->jobj, "keyslots", &jobj))
+		r = index_keyslots(jobj, idx);
+	if (!r && json_object_object_get_ex(hdr->jobj, "tokens", &jobj))
+		r = index_tokens(jobj, idx);
+	if (!r && json_object_object_get_ex(hdr->jobj, "digests", &jobj))
+		r = index_digests(jobj, idx);
+	if (!r && json_object_object_get_ex(hdr->jobj, "segments", &jobj))
+		r = index_segments(jobj, idx);
+
+	return r;
+}
+
+/*
+ * Build typed snapshot of header metadata. Objects are borrowed from hdr,
+ * so the index is valid only until the JSON metadata is modified;
+ * after a modification the caller has to rebuild it.
+ */
+int LUKS2_index_build(struct luks2_hdr *hdr, struct luks2_index *idx)
+{
+	int i, j, r;
+
+	if (!hdr || !hdr->jobj || !idx)
+		return -EINVAL;
+
+	memset(idx, 0, sizeof(*idx));
+	idx->jobj_hdr = hdr->jobj;
+	idx->default_segment = -EINVAL;
+
+	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++)
+		idx->keyslots[i].digest = -ENOENT;
+	for (i = 0; i < LUKS2_SEGMENT_MAX; i++)
+		idx->segments[i].digest = -ENOENT;
+
+	r = index_sections(hdr, idx);
+	if (r) {
+		idx->jobj_hdr = NULL;
+		return r;
+	}
+
+	/* Validated header has every keyslot and segment assigned to one digest only */
+	for (i = LUKS2_DIGEST_MAX - 1; i >= 0; i--) {
+		if (!idx->digests[i].jobj)
+			continue;
+		for (j = 0; j < LUKS2_KEYSLOTS_MAX; j++)
+			if (idx->digests[i].keyslots & (1U << j))
+				idx->keyslots[j].digest = i;
+		for (j = 0; j < LUKS2_SEGMENT_MAX; j++)
+			if (idx->digests[i].segments & (1U << j))
+				idx->segments[j].digest = i;
+	}
+
+	if (idx->default_segment < 0 && idx->segments_count == 1)
+		idx->default_segment = 0;
+
+	return 0;
+}
+
+static bool index_valid(const struct luks2_index *idx)
+{
+	return idx && idx->jobj_hdr;
+}
+
+json_object *LUKS2_index_keyslot(const struct luks2_index *idx, int keyslot)
+{
+	if (!index_valid(idx) || keyslot < 0 || keyslot >= LUKS2_KEYSLOTS_MAX)
+		return NULL;
+
+	return idx->keyslots[keyslot].jobj;
+}
+
+json_object *LUKS2_index_token(const struct luks2_index *idx, int token)
+{
+	if (!index_valid(idx) || token < 0 || token >= LUKS2_TOKENS_MAX)
+		return NULL;
+
+	return idx->tokens[token].jobj;
+}
+
+json_object *LUKS2_index_digest(const struct luks2_index *idx, int digest)
+{
+	if (!index_valid(idx) || digest < 0 || digest >= LUKS2_DIGEST_MAX)
+		return NULL;
+
+	return idx->digests[digest].jobj;
+}
+
+json_object *LUKS2_index_segment(const struct luks2_index *idx, int segment)
+{
+	if (!index_valid(idx))
+		return NULL;
+
+	if (segment == CRYPT_DEFAULT_SEGMENT)
+		segment = idx->default_segment;
+
+	if (segment < 0 || segment >= LUKS2_SEGMENT_MAX)
+		return NULL;
+
+	return idx->segments[segment].jobj;
+}
+
+int LUKS2_index_default_segment(const struct luks2_index *idx)
+{
+	return index_valid(idx) ? idx->default_segment : -EINVAL;
+}
+
+int LUKS2_index_digest_by_keyslot(const struct luks2_index *idx, int keyslot)
+{
+	if (!LUKS2_index_keyslot(idx, keyslot))
+		return -ENOENT;
+
+	return idx->keyslots[keyslot].digest;
+}
+
+int LUKS2_index_digest_by_segment(const struct luks2_index *idx, int segment)
+{
+	if (segment == CRYPT_DEFAULT_SEGMENT)
+		segment = LUKS2_index_default_segment(idx);
+
+	if (!LUKS2_index_segment(idx, segment))
+		return -ENOENT;
+
+	return idx->segments[segment].digest;
+}
+
+/* The same semantics as LUKS2_keyslot_for_segment() */
+int LUKS2_index_keyslot_for_segment(const struct luks2_index *idx, int keyslot, int segment)
+{
+	int s, digest;
+
+	if (segment == CRYPT_ANY_SEGMENT)
+		return 0;
+
+	if (segment == CRYPT_DEFAULT_SEGMENT) {
+		segment = LUKS2_index_default_segment(idx);
+		if (segment < 0)
+			return segment;
+	}
+
+	digest = LUKS2_index_digest_by_keyslot(idx, keyslot);
+	if (digest < 0)
+		return digest;
+
+	if (segment >= 0)
+		return digest == LUKS2_index_digest_by_segment(idx, segment) ? 0 : -ENOENT;
+
+	/* CRYPT_ONE_SEGMENT: any of non-backup segments */
+	for (s = 0; s < idx->segments_count; s++)
+		if (digest == LUKS2_index_digest_by_segment(idx, s))
+			return 0;
+
+	return -ENOENT;
+}
+
+int LUKS2_index_token_is_assigned(const struct luks2_index *idx, int keyslot, int token)
+{
+	if (!LUKS2_index_token(idx, token) || keyslot < 0 || keyslot >= LUKS2_KEYSLOTS_MAX)
+		return -ENOENT;
+
+	return (idx->tokens[token].keyslots & (1U << keyslot)) ? 0 : -ENOENT;
+}
@@ -40,11 +40,19 @@
  */
 int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 			struct device *device, int do_recovery, int do_blkprobe);
+int LUKS2_disk_hdr_read_lockless(struct crypt_device *cd, struct luks2_hdr *hdr,
+				 struct device *device);
 int LUKS2_disk_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr,
 			 struct device *device, bool seqid_check);
 int LUKS2_device_write_lock(struct crypt_device *cd,
 	struct luks2_hdr *hdr, struct device *device);
 
+/*
+ * JSON serializer writing directly to preallocated buffer
+ */
+int LUKS2_json_serialize(json_object *jobj, char *buf, size_t buf_size,
+			 struct crypt_hash **hd, int hd_count, size_t *json_len);
+
 /*
  * JSON struct access helpers
  */
@@ -78,6 +86,7 @@ json_object *json_contains(struct crypt_device *cd, json_object *jobj, const cha
 			   const char *section, const char *key, json_type type);
 
 int LUKS2_hdr_validate(struct crypt_device *cd, json_object *hdr_jobj, uint64_t json_size);
+int LUKS2_hdr_validate_segments(struct crypt_device *cd, json_object *hdr_jobj, uint64_t json_size);
 int LUKS2_check_json_size(struct crypt_device *cd, const struct luks2_hdr *hdr);
 int LUKS2_token_validate(struct crypt_device *cd, json_object *hdr_jobj,
 			 json_object *jobj_token, const char *key);
@@ -95,6 +104,46 @@ void LUKS2_keyslots_repair(struct crypt_device *cd, json_object *jobj_hdr);
 json_object *LUKS2_array_jobj(json_object *array, const char *num);
 json_object *LUKS2_array_remove(json_object *array, const char *num);
 
+/*
+ * Indexed view of JSON metadata (snapshot, rebuild after any modification)
+ */
+struct luks2_index {
+	json_object *jobj_hdr;
+	struct {
+		json_object *jobj;
+		int digest;
+	} keyslots[LUKS2_KEYSLOTS_MAX];
+	struct {
+		json_object *jobj;
+		uint32_t keyslots;
+	} tokens[LUKS2_TOKENS_MAX];
+	struct {
+		json_object *jobj;
+		uint32_t keyslots;
+		uint32_t segments;
+	} digests[LUKS2_DIGEST_MAX];
+	struct {
+		json_object *jobj;
+		uint64_t offset;
+		uint64_t size; /* 0 for dynamic size */
+		bool backup;
+		int digest;
+	} segments[LUKS2_SEGMENT_MAX];
+	int segments_count;
+	int default_segment;
+};
+
+int LUKS2_index_build(struct luks2_hdr *hdr, struct luks2_index *idx);
+json_object *LUKS2_index_keyslot(const struct luks2_index *idx, int keyslot);
+json_object *LUKS2_index_token(const struct luks2_index *idx, int token);
+json_object *LUKS2_index_digest(const struct luks2_index *idx, int digest);
+json_object *LUKS2_index_segment(const struct luks2_index *idx, int segment);
+int LUKS2_index_default_segment(const struct luks2_index *idx);
+int LUKS2_index_digest_by_keyslot(const struct luks2_index *idx, int keyslot);
+int LUKS2_index_digest_by_segment(const struct luks2_index *idx, int segment);
+int LUKS2_index_keyslot_for_segment(const struct luks2_index *idx, int keyslot, int segment);
+int LUKS2_index_token_is_assigned(const struct luks2_index *idx, int keyslot, int token);
+
 /*
  * Plugins API
  */
@@ -128,6 +177,10 @@ int placeholder_keyslot_alloc(struct crypt_device *cd,
 /* validate all keyslot implementations in hdr json */
 int LUKS2_keyslots_validate(struct crypt_device *cd, json_object *hdr_jobj);
 
+/* validate implementation of single keyslot in hdr json */
+int LUKS2_keyslot_impl_validate(struct crypt_device *cd, json_object *hdr_jobj,
+	json_object *jobj_keyslot, int keyslot);
+
 typedef struct  {
 	const char *name;
 	keyslot_alloc_func alloc;
@@ -146,6 +199,20 @@ int reenc_keyslot_alloc(struct crypt_device *cd,
 	int keyslot,
 	const struct crypt_params_reencrypt *params);
 
+/* luks2 keyslot open split to KDF and keyslot area decryption (parallel unlock) */
+int LUKS2_keyslot_luks2_derive_key(json_object *jobj_keyslot,
+	const char *password, size_t passwordLen,
+	struct volume_key **derived_key);
+int LUKS2_keyslot_luks2_open_derived(struct crypt_device *cd,
+	json_object *jobj_keyslot,
+	struct volume_key *derived_key,
+	char *volume_key, size_t volume_key_len);
+uint32_t LUKS2_keyslot_luks2_memory_kb(json_object *jobj_keyslot);
+int LUKS2_keyslot_luks2_store_derived(struct crypt_device *cd,
+	json_object *jobj_keyslot,
+	const struct volume_key *derived_key,
+	const char *volume_key, size_t volume_key_len);
+
 /**
  * LUKS2 digest handlers (EXPERIMENTAL)
  */
@@ -187,6 +254,23 @@ struct crypt_token_handler_v2 {
 	void *dlhandle;
 };
 
+struct crypt_token_handler_v3 {
+	const char *name;
+	crypt_token_open_func open;
+	crypt_token_buffer_free_func buffer_free;
+	crypt_token_validate_func validate;
+	crypt_token_dump_func dump;
+	crypt_token_open_pin_func open_pin;
+	crypt_token_version_func version;
+	void *dlhandle;
+
+	/* here ends v2. Do not touch anything above */
+
+	crypt_token_open_async_func open_async;
+	crypt_token_open_finish_func open_finish;
+	crypt_token_cancel_func cancel;
+};
+
 /*
  * Initial sequence of structure members in union 'u' must be always
  * identical. Version 4 must fully contain version 3 which must
@@ -196,9 +280,11 @@ struct crypt_token_handler_v2 {
  */
 struct crypt_token_handler_internal {
 	uint32_t version;
+	unsigned refs; /* contexts using the handler */
 	union {
 		crypt_token_handler v1; /* deprecated public structure */
 		struct crypt_token_handler_v2 v2; /* internal helper v2 structure */
+		struct crypt_token_handler_v3 v3; /* internal helper v3 structure */
 	} u;
 };
 
@@ -206,6 +292,10 @@ int LUKS2_find_area_gap(struct crypt_device *cd, struct luks2_hdr *hdr,
 			size_t keylength, uint64_t *area_offset, uint64_t *area_length);
 int LUKS2_find_area_max_gap(struct crypt_device *cd, struct luks2_hdr *hdr,
 			    uint64_t *area_offset, uint64_t *area_length);
+int LUKS2_find_area_move(struct crypt_device *cd, struct luks2_hdr *hdr,
+			 int *keyslot, uint64_t *new_offset);
+int LUKS2_find_area_unused(struct luks2_hdr *hdr, uint64_t from,
+			   uint64_t *area_offset, uint64_t *area_length);
 
 uint64_t LUKS2_hdr_and_areas_size_jobj(json_object *jobj);
 
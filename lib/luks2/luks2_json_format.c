@@ -185,6 +185,94 @@ int LUKS2_find_area_gap(struct crypt_device *cd, struct luks2_hdr *hdr,
 	return 0;
 }
 
+/*
+ * Find a keyslot area that can be moved closer to the keyslots area start.
+ * The highest placed area is tried first, into the lowest gap that fits.
+ * Only gaps ending before the current area are used, so the old copy stays
+ * intact until the new offset is committed to metadata.
+ */
+int LUKS2_find_area_move(struct crypt_device *cd, struct luks2_hdr *hdr,
+			 int *keyslot, uint64_t *new_offset)
+{
+	struct area areas[LUKS2_KEYSLOTS_MAX];
+	int i, j, tmp, count = 0, order[LUKS2_KEYSLOTS_MAX];
+	uint64_t offset;
+
+	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++) {
+		if (LUKS2_keyslot_area(hdr, i, &areas[i].offset, &areas[i].length) ||
+		    !areas[i].length)
+			continue;
+		order[count++] = i;
+	}
+
+	/* sort by area offset */
+	for (i = 1; i < count; i++)
+		for (j = i; j > 0 && areas[order[j - 1]].offset > areas[order[j]].offset; j--) {
+			tmp = order[j];
+			order[j] = order[j - 1];
+			order[j - 1] = tmp;
+		}
+
+	for (i = count - 1; i >= 0; i--) {
+		offset = get_min_offset(hdr);
+		for (j = 0; j < count; j++) {
+			if (offset + areas[order[i]].length <= areas[order[j]].offset)
+				break;
+			offset = areas[order[j]].offset + areas[order[j]].length;
+		}
+
+		if (offset + areas[order[i]].length <= areas[order[i]].offset) {
+			log_dbg(cd, "Keyslot %d area can move %" PRIu64 " -> %" PRIu64 ".",
+				order[i], areas[order[i]].offset, offset);
+			*keyslot = order[i];
+			*new_offset = offset;
+			return 0;
+		}
+	}
+
+	return -ENOENT;
+}
+
+/*
+ * Find the lowest keyslots area range at or above offset 'from' that is not
+ * referenced by any keyslot.
+ */
+int LUKS2_find_area_unused(struct luks2_hdr *hdr, uint64_t from,
+			   uint64_t *area_offset, uint64_t *area_length)
+{
+	struct area areas[LUKS2_KEYSLOTS_MAX];
+	uint64_t offset, end = get_max_offset(hdr);
+	int i, moved;
+
+	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++)
+		if (LUKS2_keyslot_area(hdr, i, &areas[i].offset, &areas[i].length))
+			areas[i].offset = areas[i].length = 0;
+
+	offset = from > get_min_offset(hdr) ? from : get_min_offset(hdr);
+
+	/* skip over allocated areas covering the current offset */
+	do {
+		moved = 0;
+		for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++)
+			if (areas[i].length && areas[i].offset <= offset &&
+			    offset < areas[i].offset + areas[i].length) {
+				offset = areas[i].offset + areas[i].length;
+				moved = 1;
+			}
+	} while (moved);
+
+	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++)
+		if (areas[i].length && areas[i].offset > offset && areas[i].offset < end)
+			end = areas[i].offset;
+
+	if (offset >= end)
+		return -ENOENT;
+
+	*area_offset = offset;
+	*area_length = end - offset;
+	return 0;
+}
+
 int LUKS2_check_metadata_area_size(uint64_t metadata_size)
 {
 	/* see LUKS2_HDR2_OFFSETS */
@@ -278,6 +366,7 @@ int LUKS2_generate_hdr(
 
 	hdr->seqid = 1;
 	hdr->version = 2;
+	hdr->json_len_disk[0] = hdr->json_len_disk[1] = 0;
 	memset(hdr->label, 0, LUKS2_LABEL_L);
 	strcpy(hdr->checksum_alg, "sha256");
 	crypt_random_get(cd, (char*)hdr->salt1, LUKS2_SALT_L, CRYPT_RND_SALT);
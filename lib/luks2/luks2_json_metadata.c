@@ -448,16 +448,16 @@ int LUKS2_token_validate(struct crypt_device *cd,
 static int hdr_validate_json_size(struct crypt_device *cd, json_object *hdr_jobj, uint64_t hdr_json_size)
 {
 	json_object *jobj, *jobj1;
-	const char *json;
-	uint64_t json_area_size, json_size;
+	uint64_t json_area_size;
+	size_t json_size;
 
 	json_object_object_get_ex(hdr_jobj, "config", &jobj);
 	json_object_object_get_ex(jobj, "json_size", &jobj1);
 
-	json = json_object_to_json_string_ext(hdr_jobj,
-		JSON_C_TO_STRING_PLAIN | JSON_C_TO_STRING_NOSLASHESCAPE);
+	/* only length is needed, do not materialize JSON text */
+	if (LUKS2_json_serialize(hdr_jobj, NULL, 0, NULL, 0, &json_size))
+		return 1;
 	json_area_size = crypt_jobj_get_uint64(jobj1);
-	json_size = (uint64_t)strlen(json);
 
 	if (hdr_json_size != json_area_size) {
 		log_dbg(cd, "JSON area size does not match value in binary header.");
@@ -950,11 +950,65 @@ int LUKS2_hdr_validate(struct crypt_device *cd, json_object *hdr_jobj, uint64_t
 	return 0;
 }
 
+static int hdr_validate_reencrypt_keyslot(struct crypt_device *cd, json_object *hdr_jobj)
+{
+	json_object *jobj_keyslots, *jobj_type;
+
+	if (!json_object_object_get_ex(hdr_jobj, "keyslots", &jobj_keyslots)) {
+		log_dbg(cd, "Missing keyslots section.");
+		return 1;
+	}
+
+	json_object_object_foreach(jobj_keyslots, key, val) {
+		if (!json_object_object_get_ex(val, "type", &jobj_type) ||
+		    strcmp(json_object_get_string(jobj_type), "reencrypt"))
+			continue;
+		if (!numbered(cd, "Keyslot", key) ||
+		    LUKS2_keyslot_validate(cd, hdr_jobj, val, key) ||
+		    LUKS2_keyslot_impl_validate(cd, hdr_jobj, val, atoi(key)))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Reduced validation for metadata commits during reencryption where only
+ * segments, their digest assignment and reencrypt keyslot parameters change.
+ * Full validation can be forced with CRYPT_DEBUG_JSON debug level.
+ */
+int LUKS2_hdr_validate_segments(struct crypt_device *cd, json_object *hdr_jobj, uint64_t json_size)
+{
+	if (!hdr_jobj)
+		return 1;
+
+	if (crypt_get_debug_level() == CRYPT_DEBUG_JSON)
+		return LUKS2_hdr_validate(cd, hdr_jobj, json_size);
+
+	if (hdr_validate_digests(cd, hdr_jobj) ||
+	    hdr_validate_segments(cd, hdr_jobj) ||
+	    hdr_validate_reencrypt_keyslot(cd, hdr_jobj))
+		return 1;
+
+	return hdr_validate_json_size(cd, hdr_jobj, json_size);
+}
+
 /* FIXME: should we expose do_recovery parameter explicitly? */
 int LUKS2_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr, int repair)
 {
 	int r;
 
+	/* Readers do not serialize on the lock unless writer intervened */
+	if (!repair && crypt_metadata_locking_enabled() &&
+	    !device_is_locked(crypt_metadata_device(cd))) {
+		r = LUKS2_disk_hdr_read_lockless(cd, hdr, crypt_metadata_device(cd));
+		if (!r)
+			crypt_lock_stats_lockless_read(cd);
+		if (r != -EAGAIN)
+			return r;
+		log_dbg(cd, "Lockless LUKS2 header read not possible, reading under lock.");
+	}
+
 	r = device_read_lock(cd, crypt_metadata_device(cd));
 	if (r) {
 		log_err(cd, _("Failed to acquire read lock on device %s."),
@@ -1007,6 +1061,14 @@ int LUKS2_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr)
 	return LUKS2_disk_hdr_write(cd, hdr, crypt_metadata_device(cd), true);
 }
 
+int LUKS2_hdr_write_segments(struct crypt_device *cd, struct luks2_hdr *hdr)
+{
+	if (LUKS2_hdr_validate_segments(cd, hdr->jobj, hdr->hdr_size - LUKS2_HDR_BIN_LEN))
+		return -EINVAL;
+
+	return LUKS2_disk_hdr_write(cd, hdr, crypt_metadata_device(cd), true);
+}
+
 int LUKS2_hdr_uuid(struct crypt_device *cd, struct luks2_hdr *hdr, const char *uuid)
 {
 	uuid_t partitionUuid;
@@ -1074,13 +1136,40 @@ uint64_t LUKS2_hdr_and_areas_size(struct luks2_hdr *hdr)
 	return LUKS2_hdr_and_areas_size_jobj(hdr->jobj);
 }
 
+/*
+ * Backup contains only binary headers with JSON areas and areas of existing
+ * keyslots, the rest of keyslots area is left as a hole in the (sparse) file.
+ * The file keeps the full on-disk layout, so it restores as before.
+ */
+static int hdr_backup_extents(struct luks2_hdr *hdr, uint64_t hdr_size,
+			      uint64_t offset[LUKS2_KEYSLOTS_MAX + 1],
+			      uint64_t length[LUKS2_KEYSLOTS_MAX + 1])
+{
+	int i, count = 0;
+
+	offset[count] = 0;
+	length[count++] = 2 * LUKS2_metadata_size(hdr);
+
+	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++) {
+		if (LUKS2_keyslot_area(hdr, i, &offset[count], &length[count]) < 0)
+			continue;
+		if (!length[count] || offset[count] + length[count] > hdr_size ||
+		    offset[count] < length[0])
+			continue;
+		count++;
+	}
+
+	return count;
+}
+
 int LUKS2_hdr_backup(struct crypt_device *cd, struct luks2_hdr *hdr,
 		     const char *backup_file)
 {
 	struct device *device = crypt_metadata_device(cd);
-	int fd, devfd, r = 0;
+	uint64_t offset[LUKS2_KEYSLOTS_MAX + 1], length[LUKS2_KEYSLOTS_MAX + 1], stored = 0;
+	int i, count, fd, devfd, r = 0;
 	ssize_t hdr_size;
-	ssize_t ret, buffer_size;
+	ssize_t buffer_size;
 	char *buffer = NULL;
 
 	hdr_size = LUKS2_hdr_and_areas_size(hdr);
@@ -1090,30 +1179,37 @@ int LUKS2_hdr_backup(struct crypt_device *cd, struct luks2_hdr *hdr,
 	if (!buffer)
 		return -ENOMEM;
 
-	log_dbg(cd, "Storing backup of header (%zu bytes).", hdr_size);
+	count = hdr_backup_extents(hdr, hdr_size, offset, length);
+	for (i = 0; i < count; i++)
+		stored += length[i];
+
+	log_dbg(cd, "Storing backup of header (%zu bytes, %" PRIu64 " bytes in %d extents).",
+		hdr_size, stored, count);
 	log_dbg(cd, "Output backup file size: %zu bytes.", buffer_size);
 
 	r = device_read_lock(cd, device);
 	if (r) {
 		log_err(cd, _("Failed to acquire read lock on device %s."),
 			device_path(crypt_metadata_device(cd)));
-		crypt_safe_free(buffer);
-		return r;
+		goto out;
 	}
 
 	devfd = device_open_locked(cd, device, O_RDONLY);
 	if (devfd < 0) {
 		device_read_unlock(cd, device);
 		log_err(cd, _("Device %s is not a valid LUKS device."), device_path(device));
-		crypt_safe_free(buffer);
-		return devfd == -1 ? -EINVAL : devfd;
+		r = devfd == -1 ? -EINVAL : devfd;
+		goto out;
 	}
 
-	if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-			   device_alignment(device), buffer, hdr_size, 0) < hdr_size) {
-		device_read_unlock(cd, device);
-		crypt_safe_free(buffer);
-		return -EIO;
+	for (i = 0; i < count; i++) {
+		if (read_lseek_blockwise(devfd, device_block_size(cd, device),
+				   device_alignment(device), buffer + offset[i],
+				   length[i], offset[i]) < (ssize_t)length[i]) {
+			device_read_unlock(cd, device);
+			r = -EIO;
+			goto out;
+		}
 	}
 
 	device_read_unlock(cd, device);
@@ -1124,17 +1220,22 @@ int LUKS2_hdr_backup(struct crypt_device *cd, struct luks2_hdr *hdr,
 			log_err(cd, _("Requested header backup file %s already exists."), backup_file);
 		else
 			log_err(cd, _("Cannot create header backup file %s."), backup_file);
-		crypt_safe_free(buffer);
-		return -EINVAL;
+		r = -EINVAL;
+		goto out;
+	}
+
+	/* unused areas read back as zeroes */
+	r = ftruncate(fd, buffer_size) ? -EIO : 0;
+	for (i = 0; !r && i < count; i++) {
+		if (lseek(fd, offset[i], SEEK_SET) < 0 ||
+		    write_buffer(fd, buffer + offset[i], length[i]) < (ssize_t)length[i])
+			r = -EIO;
 	}
-	ret = write_buffer(fd, buffer, buffer_size);
 	close(fd);
-	if (ret < buffer_size) {
-		log_err(cd, _("Cannot write header backup file %s."), backup_file);
-		r = -EIO;
-	} else
-		r = 0;
 
+	if (r)
+		log_err(cd, _("Cannot write header backup file %s."), backup_file);
+out:
 	crypt_safe_free(buffer);
 	return r;
 }
@@ -2319,7 +2420,7 @@ int LUKS2_deactivate(struct crypt_device *cd, const char *name, struct luks2_hdr
 	/* TODO: We have LUKS2 dependencies now */
 	if (r >= 0 && namei) {
 		log_dbg(cd, "Deactivating integrity device %s.", namei);
-		r = dm_remove_device(cd, namei, 0);
+		r = dm_remove_device(cd, namei, DM_DEACTIVATE_PRIVATE);
 	}
 
 	if (!r) {
@@ -2333,7 +2434,7 @@ int LUKS2_deactivate(struct crypt_device *cd, const char *name, struct luks2_hdr
 				dmdc.segment.type = DM_UNKNOWN;
 			}
 
-			r = dm_remove_device(cd, *dep, flags);
+			r = dm_remove_device(cd, *dep, flags | DM_DEACTIVATE_PRIVATE);
 			if (r < 0) {
 				ci = crypt_status(cd, *dep);
 				if (ci == CRYPT_BUSY)
@@ -0,0 +1,207 @@
+/*
+ * LUKS - Linux Unified Key Setup v2, JSON metadata serializer
+ *
+ * Copyright (C) 2021 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "luks2_internal.h"
+
+/* output is hashed in blocks while still in cache */
+#define JSON_WRITER_HASH_BLOCK 4096
+
+struct json_writer {
+	char *buf;
+	size_t buf_size;
+	size_t len;
+	size_t hashed;
+	struct crypt_hash **hd;
+	int hd_count;
+	int r;
+};
+
+static void json_writer_hash(struct json_writer *w)
+{
+	int i;
+
+	for (i = 0; i < w->hd_count && !w->r; i++)
+		if (crypt_hash_write(w->hd[i], w->buf + w->hashed, w->len - w->hashed))
+			w->r = -EINVAL;
+
+	w->hashed = w->len;
+}
+
+static void json_writer_append(struct json_writer *w, const char *data, size_t len)
+{
+	if (w->r || !len)
+		return;
+
+	if (w->buf) {
+		if (len > w->buf_size - w->len) {
+			w->r = -ENOSPC;
+			return;
+		}
+		memcpy(w->buf + w->len, data, len);
+	}
+
+	w->len += len;
+
+	if (w->hd_count && (w->len - w->hashed) >= JSON_WRITER_HASH_BLOCK)
+		json_writer_hash(w);
+}
+
+/* The same escaping as json-c with JSON_C_TO_STRING_NOSLASHESCAPE */
+static void json_writer_string(struct json_writer *w, const char *str, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	char esc[6] = { '\\', 'u', '0', '0' };
+	size_t pos, start = 0;
+	unsigned char c;
+
+	json_writer_append(w, "\"", 1);
+
+	for (pos = 0; pos < len; pos++) {
+		c = (unsigned char)str[pos];
+		if (c >= ' ' && c != '"' && c != '\\')
+			continue;
+
+		json_writer_append(w, str + start, pos - start);
+		start = pos + 1;
+
+		switch (c) {
+		case '\b': json_writer_append(w, "\\b", 2); break;
+		case '\n': json_writer_append(w, "\\n", 2); break;
+		case '\r': json_writer_append(w, "\\r", 2); break;
+		case '\t': json_writer_append(w, "\\t", 2); break;
+		case '\f': json_writer_append(w, "\\f", 2); break;
+		case '"':  json_writer_append(w, "\\\"", 2); break;
+		case '\\': json_writer_append(w, "\\\\", 2); break;
+		default:
+			esc[4] = hex[c >> 4];
+			esc[5] = hex[c & 0xf];
+			json_writer_append(w, esc, sizeof(esc));
+		}
+	}
+
+	json_writer_append(w, str + start, len - start);
+	json_writer_append(w, "\"", 1);
+}
+
+static void json_writer_value(struct json_writer *w, json_object *jobj);
+
+static void json_writer_object(struct json_writer *w, json_object *jobj)
+{
+	bool first = true;
+
+	json_writer_append(w, "{", 1);
+
+	json_object_object_foreach(jobj, key, val) {
+		if (!first)
+			json_writer_append(w, ",", 1);
+		first = false;
+		json_writer_string(w, key, strlen(key));
+		json_writer_append(w, ":", 1);
+		json_writer_value(w, val);
+	}
+
+	json_writer_append(w, "}", 1);
+}
+
+static void json_writer_array(struct json_writer *w, json_object *jobj)
+{
+	int i;
+
+	json_writer_append(w, "[", 1);
+
+	for (i = 0; i < (int) json_object_array_length(jobj); i++) {
+		if (i)
+			json_writer_append(w, ",", 1);
+		json_writer_value(w, json_object_array_get_idx(jobj, i));
+	}
+
+	json_writer_append(w, "]", 1);
+}
+
+static void json_writer_value(struct json_writer *w, json_object *jobj)
+{
+	char num[32];
+	const char *str;
+
+	switch (json_object_get_type(jobj)) {
+	case json_type_null:
+		json_writer_append(w, "null", 4);
+		break;
+	case json_type_boolean:
+		if (json_object_get_boolean(jobj))
+			json_writer_append(w, "true", 4);
+		else
+			json_writer_append(w, "false", 5);
+		break;
+	case json_type_int:
+		snprintf(num, sizeof(num), "%" PRId64, json_object_get_int64(jobj));
+		json_writer_append(w, num, strlen(num));
+		break;
+	case json_type_string:
+		json_writer_string(w, json_object_get_string(jobj), json_object_get_string_len(jobj));
+		break;
+	case json_type_object:
+		json_writer_object(w, jobj);
+		break;
+	case json_type_array:
+		json_writer_array(w, jobj);
+		break;
+	default:
+		/* not used in LUKS2 metadata, keep json-c number formatting */
+		str = json_object_to_json_string_ext(jobj,
+			JSON_C_TO_STRING_PLAIN | JSON_C_TO_STRING_NOSLASHESCAPE);
+		if (str)
+			json_writer_append(w, str, strlen(str));
+		else
+			w->r = -ENOMEM;
+	}
+}
+
+/*
+ * Serialize JSON object in plain format (the same output as
+ * json_object_to_json_string_ext() with JSON_C_TO_STRING_PLAIN and
+ * JSON_C_TO_STRING_NOSLASHESCAPE flags) directly to preallocated buffer.
+ * The written data are fed to all hash contexts as well.
+ *
+ * If buf is NULL, only length of JSON text is calculated.
+ * Returns -ENOSPC if JSON text does not fit in buf_size bytes.
+ */
+int LUKS2_json_serialize(json_object *jobj, char *buf, size_t buf_size,
+			 struct crypt_hash **hd, int hd_count, size_t *json_len)
+{
+	struct json_writer w = {
+		.buf = buf,
+		.buf_size = buf_size,
+		.hd = hd,
+		.hd_count = buf ? hd_count : 0
+	};
+
+	if (!jobj || !json_len)
+		return -EINVAL;
+
+	json_writer_value(&w, jobj);
+
+	if (!w.r && w.hashed < w.len)
+		json_writer_hash(&w);
+
+	*json_len = w.len;
+
+	return w.r;
+}
@@ -19,6 +19,9 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
 #include "luks2_internal.h"
 
 /* Internal implementations */
@@ -137,16 +140,16 @@ int LUKS2_keyslot_for_segment(struct luks2_hdr *hdr, int keyslot, int segment)
 /* Number of keyslots assigned to a segment or all keyslots for CRYPT_ANY_SEGMENT */
 int LUKS2_keyslot_active_count(struct luks2_hdr *hdr, int segment)
 {
-	int num = 0;
-	json_object *jobj_keyslots;
+	struct luks2_index idx;
+	int keyslot, num = 0;
 
-	json_object_object_get_ex(hdr->jobj, "keyslots", &jobj_keyslots);
+	if (LUKS2_index_build(hdr, &idx))
+		return 0;
 
-	json_object_object_foreach(jobj_keyslots, slot, val) {
-		UNUSED(val);
-		if (!LUKS2_keyslot_for_segment(hdr, atoi(slot), segment))
+	for (keyslot = 0; keyslot < LUKS2_KEYSLOTS_MAX; keyslot++)
+		if (LUKS2_index_keyslot(&idx, keyslot) &&
+		    !LUKS2_index_keyslot_for_segment(&idx, keyslot, segment))
 			num++;
-	}
 
 	return num;
 }
@@ -406,7 +409,11 @@ static int LUKS2_open_and_verify(struct crypt_device *cd,
 		return r;
 	}
 
-	return _open_and_verify(cd, hdr, h, keyslot, password, password_len, vk);
+	TRACE1(keyslot__open__start, keyslot);
+	r = _open_and_verify(cd, hdr, h, keyslot, password, password_len, vk);
+	TRACE2(keyslot__open__end, keyslot, r);
+
+	return r;
 }
 
 static int LUKS2_keyslot_open_priority_digest(struct crypt_device *cd,
@@ -447,17 +454,402 @@ static int LUKS2_keyslot_open_priority_digest(struct crypt_device *cd,
 	return r;
 }
 
-static int LUKS2_keyslot_open_priority(struct crypt_device *cd,
+struct keyslot_kdf_lane {
+	pthread_t thread;
+	struct crypt_device *cd;
+	int keyslot;
+	json_object *jobj_keyslot;
+	const char *password;
+	size_t password_len;
+	struct volume_key *derived_key;
+	bool *stop;
+	int r;
+};
+
+static void *keyslot_kdf_thread(void *arg)
+{
+	struct keyslot_kdf_lane *lane = arg;
+	struct crypt_pbkdf_memory *mem;
+
+	if (__atomic_load_n(lane->stop, __ATOMIC_ACQUIRE)) {
+		lane->r = -ECANCELED;
+		return NULL;
+	}
+
+	/* every lane waits for PBKDF memory budget separately */
+	lane->r = crypt_pbkdf_memory_acquire(lane->cd,
+			LUKS2_keyslot_luks2_memory_kb(lane->jobj_keyslot), &mem);
+	if (lane->r < 0)
+		return NULL;
+
+	/* result could be already known while waiting for memory */
+	if (__atomic_load_n(lane->stop, __ATOMIC_ACQUIRE)) {
+		crypt_pbkdf_memory_release(lane->cd, mem);
+		lane->r = -ECANCELED;
+		return NULL;
+	}
+
+	lane->r = LUKS2_keyslot_luks2_derive_key(lane->jobj_keyslot, lane->password,
+						 lane->password_len, &lane->derived_key);
+
+	crypt_pbkdf_memory_release(lane->cd, mem);
+	return NULL;
+}
+
+static int keyslot_kdf_lane_verify(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	struct keyslot_kdf_lane *lane,
+	struct volume_key **vk)
+{
+	int r, key_size = LUKS2_get_keyslot_stored_key_size(hdr, lane->keyslot);
+
+	if (lane->r < 0) {
+		log_dbg(cd, "Keyslot %d (luks2) open failed with %d.", lane->keyslot, lane->r);
+		return lane->r;
+	}
+
+	if (key_size < 0)
+		return -EINVAL;
+
+	*vk = crypt_alloc_volume_key(key_size, NULL);
+	if (!*vk)
+		return -ENOMEM;
+
+	r = LUKS2_keyslot_luks2_open_derived(cd, lane->jobj_keyslot, lane->derived_key,
+					     (*vk)->key, (*vk)->keylength);
+	if (r < 0)
+		log_dbg(cd, "Keyslot %d (luks2) open failed with %d.", lane->keyslot, r);
+	else
+		r = LUKS2_digest_verify(cd, hdr, *vk, lane->keyslot);
+
+	if (r < 0) {
+		crypt_free_volume_key(*vk);
+		*vk = NULL;
+	}
+
+	crypt_volume_key_set_id(*vk, r);
+
+	return r < 0 ? r : lane->keyslot;
+}
+
+/*
+ * Called in lane order once a lane KDF finished. Sets *stop to cancel
+ * the remaining lanes, the return value of the last call is returned
+ * from keyslot_kdf_lanes_run().
+ */
+typedef int (*keyslot_kdf_lane_done_func)(struct crypt_device *cd,
+	struct keyslot_kdf_lane *lane, void *arg, bool *stop);
+
+/*
+ * Run KDF of prepared lanes in batches, bounded by online CPUs and half of
+ * physical memory for memory-hard KDF. With memory-hard serialization
+ * requested, a batch contains only one memory-hard KDF and the serialize
+ * lock is held just for that batch.
+ */
+static int keyslot_kdf_lanes_run(struct crypt_device *cd,
+	struct keyslot_kdf_lane *lanes,
+	size_t count,
+	bool stats,
+	keyslot_kdf_lane_done_func done_fn,
+	void *arg,
+	int r)
+{
+	uint64_t mem, mem_limit, start;
+	size_t i, first, batch, cpus, extra;
+	bool serialize, done = false, stop = false;
+
+	cpus = crypt_cpusonline() ?: 1;
+	serialize = crypt_serialize_enabled(cd);
+	mem_limit = crypt_getphysmemory_kb() / 2;
+
+	for (i = 0; i < count; i++)
+		lanes[i].stop = &stop;
+
+	for (first = 0; first < count && !done; first += batch) {
+		for (mem = 0, batch = 0; first + batch < count && batch < cpus; batch++) {
+			i = LUKS2_keyslot_luks2_memory_kb(lanes[first + batch].jobj_keyslot);
+			if (batch && serialize && (mem || i))
+				break;
+			if (batch && mem_limit && mem + i > mem_limit)
+				break;
+			mem += i;
+		}
+
+		log_dbg(cd, "Running %zu LUKS2 keyslot KDFs in parallel (first keyslot %d).",
+			batch, lanes[first].keyslot);
+
+		if (mem && crypt_serialize_lock(cd))
+			return -EINVAL;
+
+		/* lanes without granted thread run in caller thread after the others */
+		start = crypt_op_usec();
+		extra = crypt_threads_acquire(batch - 1);
+		for (i = 1; i < batch; i++)
+			if (i > extra || pthread_create(&lanes[first + i].thread, NULL, keyslot_kdf_thread, &lanes[first + i]))
+				lanes[first + i].thread = pthread_self();
+
+		keyslot_kdf_thread(&lanes[first]);
+
+		for (i = first; i < first + batch; i++) {
+			if (i != first) {
+				if (pthread_equal(lanes[i].thread, pthread_self()))
+					keyslot_kdf_thread(&lanes[i]);
+				else
+					pthread_join(lanes[i].thread, NULL);
+			}
+
+			if (!done) {
+				r = done_fn(cd, &lanes[i], arg, &done);
+				/* cancel lanes still waiting for PBKDF memory */
+				if (done)
+					__atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+			}
+			crypt_free_volume_key(lanes[i].derived_key);
+			lanes[i].derived_key = NULL;
+		}
+		crypt_threads_release(extra);
+		/* lanes run in parallel, the batch is counted as one PBKDF run */
+		if (stats)
+			crypt_op_stats_add(cd, CRYPT_OP_KDF, crypt_op_usec() - start);
+
+		if (mem)
+			crypt_serialize_unlock(cd);
+	}
+
+	return r;
+}
+
+struct keyslot_open_lanes {
+	struct luks2_hdr *hdr;
+	struct volume_key **vk;
+};
+
+static int keyslot_open_lane_done(struct crypt_device *cd,
+	struct keyslot_kdf_lane *lane, void *arg, bool *stop)
+{
+	struct keyslot_open_lanes *ol = arg;
+	int r;
+
+	r = keyslot_kdf_lane_verify(cd, ol->hdr, lane, ol->vk);
+	/* Do not retry for errors that are no -EPERM or -ENOENT */
+	if (r >= 0 || ((r != -EPERM) && (r != -ENOENT)))
+		*stop = true;
+
+	return r;
+}
+
+/*
+ * Run KDF of several luks2 keyslots with the same priority concurrently,
+ * bounded by online CPUs and half of physical memory for memory-hard KDF.
+ * With memory-hard serialization requested, memory-hard KDF runs for one
+ * keyslot at a time. The keyslot area decryption and digest check is done
+ * in keyslot order as lanes finish, so the result is the same as in serial
+ * unlock. Once the result is known, lanes not yet running are cancelled.
+ * Returns -EAGAIN if parallel unlock is not applicable.
+ */
+static int LUKS2_keyslot_open_priority_parallel(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	crypt_keyslot_priority priority,
 	const char *password,
 	size_t password_len,
 	int segment,
+	int skip,
 	struct volume_key **vk)
 {
+	struct keyslot_kdf_lane lanes[LUKS2_KEYSLOTS_MAX];
+	struct keyslot_open_lanes ol = { .hdr = hdr, .vk = vk };
+	struct luks2_index idx;
 	json_object *jobj_keyslots, *jobj;
+	const keyslot_handler *h;
 	crypt_keyslot_priority slot_priority;
+	size_t count = 0;
+	int keyslot, r;
+
+	if (crypt_cpusonline() < 2 || LUKS2_index_build(hdr, &idx))
+		return -EAGAIN;
+
+	json_object_object_get_ex(hdr->jobj, "keyslots", &jobj_keyslots);
+
+	json_object_object_foreach(jobj_keyslots, slot, val) {
+		if (!json_object_object_get_ex(val, "priority", &jobj))
+			slot_priority = CRYPT_SLOT_PRIORITY_NORMAL;
+		else
+			slot_priority = json_object_get_int(jobj);
+
+		keyslot = atoi(slot);
+		if (slot_priority != priority || keyslot == skip)
+			continue;
+
+		h = LUKS2_keyslot_handler(cd, keyslot);
+		if (!h || strcmp(h->name, "luks2") || h->validate(cd, val))
+			return -EAGAIN;
+
+		r = LUKS2_index_keyslot_for_segment(&idx, keyslot, segment);
+		if (r == -ENOENT)
+			continue;
+		if (r || count == LUKS2_KEYSLOTS_MAX)
+			return -EAGAIN;
+
+		lanes[count].cd = cd;
+		lanes[count].keyslot = keyslot;
+		lanes[count].jobj_keyslot = val;
+		lanes[count].password = password;
+		lanes[count].password_len = password_len;
+		lanes[count].derived_key = NULL;
+		lanes[count].r = -EINVAL;
+		count++;
+	}
+
+	if (count < 2)
+		return -EAGAIN;
+
+	return keyslot_kdf_lanes_run(cd, lanes, count, true, keyslot_open_lane_done, &ol, -ENOENT);
+}
+
+/*
+ * Host-local hint cache, each line is "<UUID> <keyslot>" of the last keyslot
+ * successfully opened without keyslot argument. No secrets are stored,
+ * the hinted keyslot is only tried first within its priority class.
+ */
+#define KEYSLOT_HINT_LINE_MAX 256
+
+static pthread_mutex_t _keyslot_hint_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *_keyslot_hint_path = NULL;
+
+int crypt_keyslot_hint_cache(struct crypt_device *cd, const char *path)
+{
+	char *tmp = NULL, **cd_path;
+
+	if (path && *path != '/')
+		return -EINVAL;
+
+	if (path && !(tmp = strdup(path)))
+		return -ENOMEM;
+
+	if ((cd_path = crypt_keyslot_hint_path(cd))) {
+		free(*cd_path);
+		*cd_path = tmp;
+		return 0;
+	}
+
+	pthread_mutex_lock(&_keyslot_hint_lock);
+	free(_keyslot_hint_path);
+	_keyslot_hint_path = tmp;
+	pthread_mutex_unlock(&_keyslot_hint_lock);
+
+	return 0;
+}
+
+/* Copy of the context path or the global one, global path can change in other thread */
+static char *keyslot_hint_path(struct crypt_device *cd)
+{
+	char **cd_path = crypt_keyslot_hint_path(cd), *path;
+
+	if (cd_path && *cd_path)
+		return strdup(*cd_path);
+
+	pthread_mutex_lock(&_keyslot_hint_lock);
+	path = _keyslot_hint_path ? strdup(_keyslot_hint_path) : NULL;
+	pthread_mutex_unlock(&_keyslot_hint_lock);
+
+	return path;
+}
+
+static bool keyslot_hint_parse(const char *line, char *uuid, int *keyslot)
+{
+	return sscanf(line, "%39s %d", uuid, keyslot) == 2 &&
+	       *keyslot >= 0 && *keyslot < LUKS2_KEYSLOTS_MAX;
+}
+
+static int keyslot_hint_get(struct crypt_device *cd, const char *path)
+{
+	char line[KEYSLOT_HINT_LINE_MAX], line_uuid[LUKS2_UUID_L];
+	const char *uuid = crypt_get_uuid(cd);
 	int keyslot, r = -ENOENT;
+	FILE *f;
+
+	if (!path || !uuid || !(f = fopen(path, "r")))
+		return -ENOENT;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (keyslot_hint_parse(line, line_uuid, &keyslot) && !strcmp(line_uuid, uuid)) {
+			r = keyslot;
+			break;
+		}
+	}
+	fclose(f);
+
+	return r;
+}
+
+static void keyslot_hint_put(struct crypt_device *cd, const char *path, int keyslot)
+{
+	char line[KEYSLOT_HINT_LINE_MAX], line_uuid[LUKS2_UUID_L], *tmp_path;
+	const char *uuid = crypt_get_uuid(cd);
+	int fd, line_keyslot;
+	FILE *f, *f_tmp;
+
+	if (!path || !uuid || keyslot < 0 || keyslot_hint_get(cd, path) == keyslot)
+		return;
+
+	if (asprintf(&tmp_path, "%s.XXXXXX", path) < 0)
+		return;
+
+	fd = mkstemp(tmp_path);
+	if (fd < 0 || !(f_tmp = fdopen(fd, "w"))) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp_path);
+		}
+		log_dbg(cd, "Cannot create keyslot hint cache %s.", path);
+		free(tmp_path);
+		return;
+	}
+
+	/* Keep entries of other devices, replace this one */
+	if ((f = fopen(path, "r"))) {
+		while (fgets(line, sizeof(line), f))
+			if (keyslot_hint_parse(line, line_uuid, &line_keyslot) && strcmp(line_uuid, uuid))
+				fprintf(f_tmp, "%s %d\n", line_uuid, line_keyslot);
+		fclose(f);
+	}
+
+	fprintf(f_tmp, "%s %d\n", uuid, keyslot);
+
+	if (fclose(f_tmp) || rename(tmp_path, path)) {
+		log_dbg(cd, "Cannot update keyslot hint cache %s.", path);
+		unlink(tmp_path);
+	}
+
+	free(tmp_path);
+}
+
+static int LUKS2_keyslot_open_priority(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	crypt_keyslot_priority priority,
+	const char *password,
+	size_t password_len,
+	int segment,
+	int hint,
+	struct volume_key **vk)
+{
+	json_object *jobj_keyslots, *jobj;
+	crypt_keyslot_priority slot_priority;
+	int keyslot, r, r_hint = -ENOENT;
+
+	/* last successfully opened keyslot first, if it is in this priority class */
+	if (hint >= 0 && LUKS2_keyslot_priority_get(cd, hdr, hint) == priority) {
+		log_dbg(cd, "Trying hinted keyslot %d first.", hint);
+		r_hint = LUKS2_open_and_verify(cd, hdr, hint, segment, password, password_len, vk);
+		if ((r_hint != -EPERM) && (r_hint != -ENOENT))
+			return r_hint;
+	} else
+		hint = -1;
+
+	r = LUKS2_keyslot_open_priority_parallel(cd, hdr, priority, password, password_len, segment, hint, vk);
+	if (r != -EAGAIN)
+		return (r == -ENOENT) ? r_hint : r;
+	r = -ENOENT;
 
 	json_object_object_get_ex(hdr->jobj, "keyslots", &jobj_keyslots);
 
@@ -473,6 +865,8 @@ static int LUKS2_keyslot_open_priority(struct crypt_device *cd,
 				keyslot, slot_priority, priority);
 			continue;
 		}
+		if (keyslot == hint)
+			continue;
 
 		r = LUKS2_open_and_verify(cd, hdr, keyslot, segment, password, password_len, vk);
 
@@ -482,7 +876,85 @@ static int LUKS2_keyslot_open_priority(struct crypt_device *cd,
 			break;
 	}
 
-	return r;
+	/* hinted keyslot password mismatch is not lost by following unusable keyslots */
+	return (r == -ENOENT) ? r_hint : r;
+}
+
+/*
+ * Volume key handoff, verified volume key is stored in session keyring
+ * for subsequent operations (in other processes), see crypt_volume_key_handoff().
+ */
+static int keyslot_handoff_desc(struct crypt_device *cd, int digest, char *desc, size_t desc_size)
+{
+	const char *uuid = crypt_get_uuid(cd);
+	int r;
+
+	if (!uuid || digest < 0)
+		return -EINVAL;
+
+	r = snprintf(desc, desc_size, "cryptsetup:handoff-%s-d%d", uuid, digest);
+	return (r < 0 || (size_t)r >= desc_size) ? -EINVAL : 0;
+}
+
+static int keyslot_handoff_get(struct crypt_device *cd, struct luks2_hdr *hdr,
+	int keyslot, int digest, struct volume_key **vk)
+{
+	char desc[128], *key = NULL;
+	size_t key_size = 0;
+	int i;
+
+	if (!crypt_volume_key_handoff_timeout(cd) ||
+	    keyslot_handoff_desc(cd, digest, desc, sizeof(desc)))
+		return -ENOENT;
+
+	if (keyslot != CRYPT_ANY_SLOT && LUKS2_digest_by_keyslot(hdr, keyslot) != digest)
+		return -ENOENT;
+
+	if (keyring_get_key(desc, &key, &key_size) < 0)
+		return -ENOENT;
+
+	*vk = crypt_alloc_volume_key(key_size, key);
+	crypt_safe_memzero(key, key_size);
+	free(key);
+	if (!*vk)
+		return -ENOMEM;
+
+	if (LUKS2_digest_verify_by_digest(cd, hdr, digest, *vk) != digest) {
+		log_dbg(cd, "Volume key in keyring handoff does not match digest %d.", digest);
+		crypt_free_volume_key(*vk);
+		*vk = NULL;
+		return -ENOENT;
+	}
+
+	log_dbg(cd, "Using volume key (digest %d) from keyring handoff.", digest);
+
+	if (keyslot != CRYPT_ANY_SLOT)
+		return keyslot;
+
+	/* report the first keyslot containing the key */
+	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++)
+		if (LUKS2_digest_by_keyslot(hdr, i) == digest)
+			return i;
+
+	crypt_free_volume_key(*vk);
+	*vk = NULL;
+	return -ENOENT;
+}
+
+static void keyslot_handoff_put(struct crypt_device *cd, int digest, const struct volume_key *vk)
+{
+	uint32_t timeout = crypt_volume_key_handoff_timeout(cd);
+	char desc[128];
+	int r;
+
+	if (!timeout || !vk || keyslot_handoff_desc(cd, digest, desc, sizeof(desc)))
+		return;
+
+	r = keyring_add_key_in_session_keyring(USER_KEY, desc, vk->key, vk->keylength, timeout);
+	if (r < 0)
+		log_dbg(cd, "Failed to store volume key (digest %d) in keyring handoff (%d).", digest, r);
+	else
+		log_dbg(cd, "Volume key (digest %d) stored in keyring handoff for %" PRIu32 " s.", digest, timeout);
 }
 
 static int LUKS2_keyslot_open_by_digest(struct crypt_device *cd,
@@ -498,6 +970,10 @@ static int LUKS2_keyslot_open_by_digest(struct crypt_device *cd,
 	if (digest < 0)
 		return r;
 
+	r = keyslot_handoff_get(cd, hdr, keyslot, digest, vk);
+	if (r != -ENOENT)
+		return r;
+
 	if (keyslot == CRYPT_ANY_SLOT) {
 		r_prio = LUKS2_keyslot_open_priority_digest(cd, hdr, CRYPT_SLOT_PRIORITY_PREFER,
 			password, password_len, digest, vk);
@@ -514,6 +990,9 @@ static int LUKS2_keyslot_open_by_digest(struct crypt_device *cd,
 	} else
 		r = LUKS2_open_and_verify_by_digest(cd, hdr, keyslot, digest, password, password_len, vk);
 
+	if (r >= 0)
+		keyslot_handoff_put(cd, digest, *vk);
+
 	return r;
 }
 
@@ -566,23 +1045,43 @@ int LUKS2_keyslot_open(struct crypt_device *cd,
 	struct volume_key **vk)
 {
 	struct luks2_hdr *hdr;
-	int r_prio, r = -EINVAL;
+	char *hint_path;
+	int digest = -ENOENT, hint = -ENOENT, r_prio, r = -EINVAL;
 
 	hdr = crypt_get_hdr(cd, CRYPT_LUKS2);
 
+	/* handoff key is bound to digest, segment must be known */
+	if (segment != CRYPT_ANY_SEGMENT) {
+		if (keyslot == CRYPT_ANY_SLOT)
+			digest = LUKS2_digest_by_segment(hdr, segment);
+		else if (LUKS2_keyslot_for_segment(hdr, keyslot, segment) >= 0)
+			digest = LUKS2_digest_by_keyslot(hdr, keyslot);
+	}
+
+	if (digest >= 0) {
+		r = keyslot_handoff_get(cd, hdr, keyslot, digest, vk);
+		if (r != -ENOENT)
+			return r;
+	}
+
 	if (keyslot == CRYPT_ANY_SLOT) {
+		hint_path = keyslot_hint_path(cd);
+		hint = keyslot_hint_get(cd, hint_path);
 		r_prio = LUKS2_keyslot_open_priority(cd, hdr, CRYPT_SLOT_PRIORITY_PREFER,
-			password, password_len, segment, vk);
+			password, password_len, segment, hint, vk);
 		if (r_prio >= 0)
 			r = r_prio;
 		else if (r_prio != -EPERM && r_prio != -ENOENT)
 			r = r_prio;
 		else
 			r = LUKS2_keyslot_open_priority(cd, hdr, CRYPT_SLOT_PRIORITY_NORMAL,
-				password, password_len, segment, vk);
+				password, password_len, segment, hint, vk);
 		/* Prefer password wrong to no entry from priority slot */
 		if (r_prio == -EPERM && r == -ENOENT)
 			r = r_prio;
+		if (r >= 0)
+			keyslot_hint_put(cd, hint_path, r);
+		free(hint_path);
 	} else
 		r = LUKS2_open_and_verify(cd, hdr, keyslot, segment, password, password_len, vk);
 
@@ -591,7 +1090,8 @@ int LUKS2_keyslot_open(struct crypt_device *cd,
 			log_err(cd, _("Not enough available memory to open a keyslot."));
 		else if (r != -EPERM)
 			log_err(cd, _("Keyslot open failed."));
-	}
+	} else if (digest >= 0)
+		keyslot_handoff_put(cd, digest, *vk);
 
 	return r;
 }
@@ -687,6 +1187,9 @@ int LUKS2_keyslot_store(struct crypt_device *cd,
 		}
 	}
 
+	/* passphrase changed, old hint must not be kept */
+	LUKS2_keyslot_hint_set(cd, hdr, keyslot, NULL, 0);
+
 	r = h->validate(cd, LUKS2_get_keyslot_jobj(hdr, keyslot));
 	if (r) {
 		log_dbg(cd, "Keyslot validation failed.");
@@ -700,6 +1203,104 @@ int LUKS2_keyslot_store(struct crypt_device *cd,
 			vk->key, vk->keylength);
 }
 
+static int keyslot_store_lane_done(struct crypt_device *cd,
+	struct keyslot_kdf_lane *lane, void *arg, bool *stop)
+{
+	const struct volume_key *vk = arg;
+	int r = lane->r;
+
+	if (!r)
+		r = LUKS2_keyslot_luks2_store_derived(cd, lane->jobj_keyslot,
+			lane->derived_key, vk->key, vk->keylength);
+	if (r < 0)
+		*stop = true;
+
+	return r;
+}
+
+/*
+ * Enroll several new luks2 keyslots for the same volume key at once.
+ * PBKDF is benchmarked only for the first keyslot, keys are derived
+ * in parallel (as in parallel unlock), all keyslot areas are written
+ * and synced together and the header is written only once.
+ */
+int LUKS2_keyslot_store_batch(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	const int *keyslots,
+	const char * const *passwords,
+	const size_t *password_lens,
+	size_t count,
+	const struct volume_key *vk,
+	const struct luks2_keyslot_params *params)
+{
+	struct keyslot_kdf_lane lanes[LUKS2_KEYSLOTS_MAX];
+	struct crypt_pbkdf_type *pbkdf;
+	const keyslot_handler *h;
+	uint32_t pbkdf_flags;
+	size_t i;
+	int r = 0;
+
+	if (!count || count > LUKS2_KEYSLOTS_MAX || !vk)
+		return -EINVAL;
+
+	h = LUKS2_keyslot_handler_type(cd, "luks2");
+	pbkdf = CONST_CAST(struct crypt_pbkdf_type *)crypt_get_pbkdf_type(cd);
+	if (!h || !pbkdf)
+		return -EINVAL;
+	pbkdf_flags = pbkdf->flags;
+
+	for (i = 0; i < count && !r; i++) {
+		if (keyslots[i] < 0 || LUKS2_get_keyslot_jobj(hdr, keyslots[i])) {
+			r = -EINVAL;
+			break;
+		}
+
+		r = h->alloc(cd, keyslots[i], vk->keylength, params);
+		/* the first allocation benchmarks PBKDF, others reuse the result */
+		pbkdf->flags |= CRYPT_PBKDF_NO_BENCHMARK;
+		if (r)
+			break;
+
+		LUKS2_keyslot_hint_set(cd, hdr, keyslots[i], NULL, 0);
+
+		lanes[i].cd = cd;
+		lanes[i].keyslot = keyslots[i];
+		lanes[i].jobj_keyslot = LUKS2_get_keyslot_jobj(hdr, keyslots[i]);
+		lanes[i].password = passwords[i];
+		lanes[i].password_len = password_lens[i];
+		lanes[i].derived_key = NULL;
+		lanes[i].r = -EINVAL;
+
+		r = h->validate(cd, lanes[i].jobj_keyslot);
+		if (r)
+			log_dbg(cd, "Keyslot validation failed.");
+	}
+	pbkdf->flags = pbkdf_flags;
+
+	if (r)
+		return r;
+
+	if (LUKS2_hdr_validate(cd, hdr->jobj, hdr->hdr_size - LUKS2_HDR_BIN_LEN))
+		return -EINVAL;
+
+	r = LUKS2_device_write_lock(cd, hdr, crypt_metadata_device(cd));
+	if (r)
+		return r;
+
+	r = keyslot_kdf_lanes_run(cd, lanes, count, false, keyslot_store_lane_done,
+				  CONST_CAST(void *)vk, 0);
+
+	/* all keyslot areas must be on disk before header references them */
+	if (!r) {
+		device_sync(cd, crypt_metadata_device(cd));
+		r = LUKS2_hdr_write(cd, hdr);
+	}
+
+	device_write_unlock(cd, crypt_metadata_device(cd));
+
+	return r;
+}
+
 int LUKS2_keyslot_wipe(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int keyslot,
@@ -765,6 +1366,132 @@ out:
 	return r;
 }
 
+static int keyslot_area_copy(struct crypt_device *cd, struct device *device,
+	uint64_t offset_from, uint64_t offset_to, size_t length)
+{
+	int devfd, r = -EIO;
+	void *buf = NULL;
+
+	if (posix_memalign(&buf, crypt_getpagesize(), length))
+		return -ENOMEM;
+
+	devfd = device_open_locked(cd, device, O_RDWR);
+	if (devfd < 0)
+		goto out;
+
+	if (read_lseek_blockwise(devfd, device_block_size(cd, device),
+				 device_alignment(device), buf, length,
+				 offset_from) != (ssize_t)length)
+		goto out;
+
+	if (write_lseek_blockwise(devfd, device_block_size(cd, device),
+				  device_alignment(device), buf, length,
+				  offset_to) != (ssize_t)length)
+		goto out;
+
+	device_sync(cd, device);
+	r = 0;
+out:
+	crypt_safe_memzero(buf, length);
+	free(buf);
+	return r;
+}
+
+/*
+ * Wipe all keyslots area ranges not referenced by any keyslot. An interrupted
+ * compaction may leave a stale copy of key material in such a range.
+ */
+static int keyslot_areas_wipe_unused(struct crypt_device *cd, struct luks2_hdr *hdr,
+				     struct device *device)
+{
+	uint64_t offset = 0, length;
+	int r;
+
+	while (!LUKS2_find_area_unused(hdr, offset, &offset, &length)) {
+		log_dbg(cd, "Wiping unused keyslots area %" PRIu64 " -> %" PRIu64 ".",
+			offset, offset + length);
+		r = crypt_wipe_device(cd, device, CRYPT_WIPE_SPECIAL, offset,
+				      length, length, NULL, NULL);
+		if (r < 0) {
+			log_err(cd, _("Cannot wipe device %s."), device_path(device));
+			return r;
+		}
+		offset += length;
+	}
+
+	return 0;
+}
+
+/*
+ * Pack keyslot areas towards the keyslots area start, one area at a time:
+ * copy it to the new location, commit metadata and only then wipe the old
+ * copy. Unused ranges are wiped before and after the run, so leftovers of
+ * an interrupted run are destroyed too. Returns the number of moved areas.
+ */
+int LUKS2_keyslot_areas_compact(struct crypt_device *cd, struct luks2_hdr *hdr)
+{
+	struct device *device = crypt_metadata_device(cd);
+	json_object *jobj_keyslot, *jobj_area;
+	uint64_t area_offset, area_length, new_offset;
+	int keyslot, moved = 0, r;
+
+	r = LUKS2_device_write_lock(cd, hdr, device);
+	if (r)
+		return r;
+
+	r = keyslot_areas_wipe_unused(cd, hdr, device);
+	if (r < 0)
+		goto out;
+
+	while (!LUKS2_find_area_move(cd, hdr, &keyslot, &new_offset)) {
+		r = LUKS2_keyslot_area(hdr, keyslot, &area_offset, &area_length);
+		if (r < 0)
+			break;
+
+		jobj_keyslot = LUKS2_get_keyslot_jobj(hdr, keyslot);
+		if (!jobj_keyslot || !json_object_object_get_ex(jobj_keyslot, "area", &jobj_area)) {
+			r = -EINVAL;
+			break;
+		}
+
+		log_dbg(cd, "Moving keyslot %d area from %" PRIu64 " to %" PRIu64 ".",
+			keyslot, area_offset, new_offset);
+
+		r = keyslot_area_copy(cd, device, area_offset, new_offset, area_length);
+		if (r < 0) {
+			log_err(cd, _("IO error while moving keyslot %d area."), keyslot);
+			break;
+		}
+
+		json_object_object_add(jobj_area, "offset", crypt_jobj_new_uint64(new_offset));
+		r = LUKS2_hdr_write(cd, hdr);
+		if (r < 0) {
+			/* old area is still referenced on disk, keep it in memory too */
+			json_object_object_add(jobj_area, "offset", crypt_jobj_new_uint64(area_offset));
+			break;
+		}
+
+		r = crypt_wipe_device(cd, device, CRYPT_WIPE_SPECIAL, area_offset,
+				      area_length, area_length, NULL, NULL);
+		if (r < 0) {
+			log_err(cd, _("Cannot wipe device %s."), device_path(device));
+			break;
+		}
+		moved++;
+	}
+
+	if (r >= 0)
+		r = keyslot_areas_wipe_unused(cd, hdr, device);
+out:
+	device_write_unlock(cd, device);
+
+	if (r < 0)
+		return r;
+
+	log_dbg(cd, "Moved %d keyslot areas.", moved);
+	return moved;
+}
+
 int LUKS2_keyslot_dump(struct crypt_device *cd, int keyslot)
 {
 	const keyslot_handler *h;
@@ -807,6 +1534,109 @@ int LUKS2_keyslot_priority_set(struct crypt_device *cd, struct luks2_hdr *hdr,
 	return commit ? LUKS2_hdr_write(cd, hdr) : 0;
 }
 
+/*
+ * Keyslot hint is truncated HMAC of keyslot passphrase under a random salt.
+ * It is intended only for high entropy secrets provided by tokens, it allows
+ * to skip KDF of keyslots that cannot be unlocked by token passphrase.
+ */
+#define LUKS2_HINT_HASH "sha256"
+#define LUKS2_HINT_SALT_L 16
+#define LUKS2_HINT_L 4
+
+static int keyslot_hint_compute(const char *salt, size_t salt_len,
+	const char *password, size_t password_len, char *hint)
+{
+	struct crypt_hmac *hd;
+	char digest[32];
+	int r;
+
+	if (crypt_hmac_init(&hd, LUKS2_HINT_HASH, salt, salt_len))
+		return -EINVAL;
+
+	r = crypt_hmac_write(hd, password, password_len);
+	if (!r)
+		r = crypt_hmac_final(hd, digest, sizeof(digest));
+	crypt_hmac_destroy(hd);
+
+	if (!r)
+		memcpy(hint, digest, LUKS2_HINT_L);
+	crypt_safe_memzero(digest, sizeof(digest));
+
+	return r;
+}
+
+int LUKS2_keyslot_hint_set(struct crypt_device *cd, struct luks2_hdr *hdr,
+	int keyslot, const char *password, size_t password_len)
+{
+	char salt[LUKS2_HINT_SALT_L], hint[LUKS2_HINT_L], *salt_base64 = NULL, *hint_base64 = NULL;
+	json_object *jobj_keyslot, *jobj_hint;
+	int r;
+
+	jobj_keyslot = LUKS2_get_keyslot_jobj(hdr, keyslot);
+	if (!jobj_keyslot)
+		return -EINVAL;
+
+	if (!password) {
+		json_object_object_del(jobj_keyslot, "token_hint");
+		return 0;
+	}
+
+	r = crypt_random_get(cd, salt, sizeof(salt), CRYPT_RND_SALT);
+	if (!r)
+		r = keyslot_hint_compute(salt, sizeof(salt), password, password_len, hint);
+	if (r < 0)
+		return r;
+
+	base64_encode_alloc(salt, sizeof(salt), &salt_base64);
+	base64_encode_alloc(hint, sizeof(hint), &hint_base64);
+	jobj_hint = json_object_new_object();
+	if (!salt_base64 || !hint_base64 || !jobj_hint) {
+		json_object_put(jobj_hint);
+		r = -ENOMEM;
+		goto out;
+	}
+
+	json_object_object_add(jobj_hint, "salt", json_object_new_string(salt_base64));
+	json_object_object_add(jobj_hint, "hint", json_object_new_string(hint_base64));
+	json_object_object_add(jobj_keyslot, "token_hint", jobj_hint);
+out:
+	free(salt_base64);
+	free(hint_base64);
+	return r;
+}
+
+/* Returns 1 if hint matches, 0 if keyslot has no (usable) hint, -1 on mismatch */
+int LUKS2_keyslot_hint_match(struct crypt_device *cd, struct luks2_hdr *hdr,
+	int keyslot, const char *password, size_t password_len)
+{
+	json_object *jobj_keyslot, *jobj_hint, *jobj_salt, *jobj;
+	char *salt = NULL, *hint = NULL, computed[LUKS2_HINT_L];
+	size_t salt_len, hint_len;
+	int r = 0;
+
+	jobj_keyslot = LUKS2_get_keyslot_jobj(hdr, keyslot);
+	if (!jobj_keyslot || !json_object_object_get_ex(jobj_keyslot, "token_hint", &jobj_hint) ||
+	    !json_object_object_get_ex(jobj_hint, "salt", &jobj_salt) ||
+	    !json_object_object_get_ex(jobj_hint, "hint", &jobj))
+		return 0;
+
+	if (!base64_decode_alloc(json_object_get_string(jobj_salt), json_object_get_string_len(jobj_salt),
+				 &salt, &salt_len) ||
+	    !base64_decode_alloc(json_object_get_string(jobj), json_object_get_string_len(jobj),
+				 &hint, &hint_len) || !salt || !hint || hint_len != LUKS2_HINT_L)
+		goto out;
+
+	if (keyslot_hint_compute(salt, salt_len, password, password_len, computed))
+		goto out;
+
+	r = memcmp(computed, hint, LUKS2_HINT_L) ? -1 : 1;
+	log_dbg(cd, "Keyslot %d token hint %s.", keyslot, r > 0 ? "matches" : "does not match");
+out:
+	free(salt);
+	free(hint);
+	return r;
+}
+
 int placeholder_keyslot_alloc(struct crypt_device *cd,
 	int keyslot,
 	uint64_t area_offset,
@@ -873,30 +1703,41 @@ static unsigned LUKS2_get_keyslot_digests_count(json_object *hdr_jobj, int keysl
 }
 
 /* run only on header that passed basic format validation */
-int LUKS2_keyslots_validate(struct crypt_device *cd, json_object *hdr_jobj)
+int LUKS2_keyslot_impl_validate(struct crypt_device *cd, json_object *hdr_jobj,
+	json_object *jobj_keyslot, int keyslot)
 {
 	const keyslot_handler *h;
-	int keyslot;
-	json_object *jobj_keyslots, *jobj_type;
+	json_object *jobj_type;
+
+	json_object_object_get_ex(jobj_keyslot, "type", &jobj_type);
+	h = LUKS2_keyslot_handler_type(cd, json_object_get_string(jobj_type));
+	if (!h)
+		return 0;
+	if (h->validate && h->validate(cd, jobj_keyslot)) {
+		log_dbg(cd, "Keyslot type %s validation failed on keyslot %d.", h->name, keyslot);
+		return -EINVAL;
+	}
+
+	if (!strcmp(h->name, "luks2") && LUKS2_get_keyslot_digests_count(hdr_jobj, keyslot) != 1) {
+		log_dbg(cd, "Keyslot %d is not assigned to exactly 1 digest.", keyslot);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int LUKS2_keyslots_validate(struct crypt_device *cd, json_object *hdr_jobj)
+{
+	json_object *jobj_keyslots;
+	int r;
 
 	if (!json_object_object_get_ex(hdr_jobj, "keyslots", &jobj_keyslots))
 		return -EINVAL;
 
 	json_object_object_foreach(jobj_keyslots, slot, val) {
-		keyslot = atoi(slot);
-		json_object_object_get_ex(val, "type", &jobj_type);
-		h = LUKS2_keyslot_handler_type(cd, json_object_get_string(jobj_type));
-		if (!h)
-			continue;
-		if (h->validate && h->validate(cd, val)) {
-			log_dbg(cd, "Keyslot type %s validation failed on keyslot %d.", h->name, keyslot);
-			return -EINVAL;
-		}
-
-		if (!strcmp(h->name, "luks2") && LUKS2_get_keyslot_digests_count(hdr_jobj, keyslot) != 1) {
-			log_dbg(cd, "Keyslot %d is not assigned to exactly 1 digest.", keyslot);
-			return -EINVAL;
-		}
+		r = LUKS2_keyslot_impl_validate(cd, hdr_jobj, val, atoi(slot));
+		if (r)
+			return r;
 	}
 
 	return 0;
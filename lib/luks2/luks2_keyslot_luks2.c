@@ -34,9 +34,10 @@
 static int luks2_encrypt_to_storage(char *src, size_t srcLength,
 	const char *cipher, const char *cipher_mode,
 	struct volume_key *vk, unsigned int sector,
-	struct crypt_device *cd)
+	bool sync, struct crypt_device *cd)
 {
 #ifndef ENABLE_AF_ALG /* Support for old kernel without Crypto API */
+	/* always synced */
 	return LUKS_encrypt_to_storage(src, srcLength, cipher, cipher_mode, vk, sector, cd);
 #else
 	struct crypt_storage *s;
@@ -70,7 +71,8 @@ static int luks2_encrypt_to_storage(char *src, size_t srcLength,
 		else
 			r = 0;
 
-		device_sync(cd, device);
+		if (sync)
+			device_sync(cd, device);
 	} else
 		r = -EIO;
 
@@ -192,23 +194,25 @@ static int luks2_keyslot_get_pbkdf_params(json_object *jobj_keyslot,
 	return 0;
 }
 
-static int luks2_keyslot_set_key(struct crypt_device *cd,
+/*
+ * Split volume key and store it encrypted by derived keyslot key to keyslot area.
+ * Without sync, caller must sync metadata device before header references the area.
+ */
+static int luks2_keyslot_write_key(struct crypt_device *cd,
 	json_object *jobj_keyslot,
-	const char *password, size_t passwordLen,
-	const char *volume_key, size_t volume_key_len)
+	const struct volume_key *derived_key,
+	const char *volume_key, size_t volume_key_len,
+	bool sync)
 {
-	struct volume_key *derived_key;
-	char salt[LUKS_SALTSIZE], cipher[MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN];
+	char cipher[MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN];
 	char *AfKey = NULL;
 	const char *af_hash = NULL;
-	size_t AFEKSize, keyslot_key_len;
-	json_object *jobj2, *jobj_kdf, *jobj_af, *jobj_area;
+	size_t AFEKSize;
+	json_object *jobj2, *jobj_af, *jobj_area;
 	uint64_t area_offset;
-	struct crypt_pbkdf_type pbkdf;
 	int r;
 
-	if (!json_object_object_get_ex(jobj_keyslot, "kdf", &jobj_kdf) ||
-	    !json_object_object_get_ex(jobj_keyslot, "af", &jobj_af) ||
+	if (!json_object_object_get_ex(jobj_keyslot, "af", &jobj_af) ||
 	    !json_object_object_get_ex(jobj_keyslot, "area", &jobj_area))
 		return -EINVAL;
 
@@ -228,43 +232,15 @@ static int luks2_keyslot_set_key(struct crypt_device *cd,
 	if (r < 0)
 		return r;
 
-	if (!json_object_object_get_ex(jobj_area, "key_size", &jobj2))
-		return -EINVAL;
-	keyslot_key_len = json_object_get_int(jobj2);
-
 	if (!json_object_object_get_ex(jobj_af, "hash", &jobj2))
 		return -EINVAL;
 	af_hash = json_object_get_string(jobj2);
 
-	if (luks2_keyslot_get_pbkdf_params(jobj_keyslot, &pbkdf, salt))
-		return -EINVAL;
-
-	/*
-	 * Allocate derived key storage.
-	 */
-	derived_key = crypt_alloc_volume_key(keyslot_key_len, NULL);
-	if (!derived_key)
-		return -ENOMEM;
-	/*
-	 * Calculate keyslot content, split and store it to keyslot area.
-	 */
-	r = crypt_pbkdf(pbkdf.type, pbkdf.hash, password, passwordLen,
-			salt, LUKS_SALTSIZE,
-			derived_key->key, derived_key->keylength,
-			pbkdf.iterations, pbkdf.max_memory_kb,
-			pbkdf.parallel_threads);
-	if (r < 0) {
-		crypt_free_volume_key(derived_key);
-		return r;
-	}
-
 	// FIXME: verity key_size to AFEKSize
 	AFEKSize = AF_split_sectors(volume_key_len, LUKS_STRIPES) * SECTOR_SIZE;
 	AfKey = crypt_safe_alloc(AFEKSize);
-	if (!AfKey) {
-		crypt_free_volume_key(derived_key);
+	if (!AfKey)
 		return -ENOMEM;
-	}
 
 	r = AF_split(cd, volume_key, AfKey, volume_key_len, LUKS_STRIPES, af_hash);
 
@@ -272,41 +248,114 @@ static int luks2_keyslot_set_key(struct crypt_device *cd,
 		log_dbg(cd, "Updating keyslot area [0x%04x].", (unsigned)area_offset);
 		/* FIXME: sector_offset should be size_t, fix LUKS_encrypt... accordingly */
 		r = luks2_encrypt_to_storage(AfKey, AFEKSize, cipher, cipher_mode,
-				    derived_key, (unsigned)(area_offset / SECTOR_SIZE), cd);
+				    CONST_CAST(struct volume_key *)derived_key,
+				    (unsigned)(area_offset / SECTOR_SIZE), sync, cd);
 	}
 
 	crypt_safe_free(AfKey);
-	crypt_free_volume_key(derived_key);
 	if (r < 0)
 		return r;
 
 	return 0;
 }
 
-static int luks2_keyslot_get_key(struct crypt_device *cd,
+static int luks2_keyslot_set_key(struct crypt_device *cd,
 	json_object *jobj_keyslot,
 	const char *password, size_t passwordLen,
-	char *volume_key, size_t volume_key_len)
+	const char *volume_key, size_t volume_key_len)
 {
 	struct volume_key *derived_key;
+	int r;
+
+	/*
+	 * Calculate keyslot content, split and store it to keyslot area.
+	 */
+	r = LUKS2_keyslot_luks2_derive_key(jobj_keyslot, password, passwordLen, &derived_key);
+	if (r < 0)
+		return r;
+
+	r = luks2_keyslot_write_key(cd, jobj_keyslot, derived_key, volume_key, volume_key_len, true);
+	crypt_free_volume_key(derived_key);
+
+	return r;
+}
+
+/*
+ * Store keyslot area with already derived key (batch enrollment).
+ * The metadata device is not synced here.
+ */
+int LUKS2_keyslot_luks2_store_derived(struct crypt_device *cd,
+	json_object *jobj_keyslot,
+	const struct volume_key *derived_key,
+	const char *volume_key, size_t volume_key_len)
+{
+	return luks2_keyslot_write_key(cd, jobj_keyslot, derived_key, volume_key, volume_key_len, false);
+}
+
+/*
+ * Derive keyslot key from passphrase (PBKDF only).
+ * No device access nor logging here, it can run in parallel threads.
+ */
+int LUKS2_keyslot_luks2_derive_key(json_object *jobj_keyslot,
+	const char *password, size_t passwordLen,
+	struct volume_key **derived_key)
+{
 	struct crypt_pbkdf_type pbkdf;
+	char salt[LUKS_SALTSIZE];
+	json_object *jobj2, *jobj_area;
+	size_t keyslot_key_len;
+	int r;
+
+	if (!json_object_object_get_ex(jobj_keyslot, "area", &jobj_area))
+		return -EINVAL;
+
+	if (luks2_keyslot_get_pbkdf_params(jobj_keyslot, &pbkdf, salt))
+		return -EINVAL;
+
+	if (!json_object_object_get_ex(jobj_area, "key_size", &jobj2))
+		return -EINVAL;
+	keyslot_key_len = json_object_get_int(jobj2);
+
+	*derived_key = crypt_alloc_volume_key(keyslot_key_len, NULL);
+	if (!*derived_key)
+		return -ENOMEM;
+
+	TRACE5(kdf__start, pbkdf.type, pbkdf.hash, pbkdf.iterations,
+	       pbkdf.max_memory_kb, pbkdf.parallel_threads);
+	r = crypt_pbkdf(pbkdf.type, pbkdf.hash, password, passwordLen,
+			salt, LUKS_SALTSIZE,
+			(*derived_key)->key, (*derived_key)->keylength,
+			pbkdf.iterations, pbkdf.max_memory_kb,
+			pbkdf.parallel_threads);
+	TRACE2(kdf__end, pbkdf.type, r);
+	if (r < 0) {
+		crypt_free_volume_key(*derived_key);
+		*derived_key = NULL;
+	}
+
+	return r;
+}
+
+/*
+ * Decrypt keyslot content with already derived key and merge it.
+ */
+int LUKS2_keyslot_luks2_open_derived(struct crypt_device *cd,
+	json_object *jobj_keyslot,
+	struct volume_key *derived_key,
+	char *volume_key, size_t volume_key_len)
+{
 	char *AfKey;
 	size_t AFEKSize;
 	const char *af_hash = NULL;
-	char salt[LUKS_SALTSIZE], cipher[MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN];
+	char cipher[MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN];
 	json_object *jobj2, *jobj_af, *jobj_area;
 	uint64_t area_offset;
-	size_t keyslot_key_len;
-	bool try_serialize_lock = false;
 	int r;
 
 	if (!json_object_object_get_ex(jobj_keyslot, "af", &jobj_af) ||
 	    !json_object_object_get_ex(jobj_keyslot, "area", &jobj_area))
 		return -EINVAL;
 
-	if (luks2_keyslot_get_pbkdf_params(jobj_keyslot, &pbkdf, salt))
-		return -EINVAL;
-
 	if (!json_object_object_get_ex(jobj_af, "hash", &jobj2))
 		return -EINVAL;
 	af_hash = json_object_get_string(jobj2);
@@ -321,54 +370,82 @@ static int luks2_keyslot_get_key(struct crypt_device *cd,
 	if (r < 0)
 		return r;
 
-	if (!json_object_object_get_ex(jobj_area, "key_size", &jobj2))
-		return -EINVAL;
-	keyslot_key_len = json_object_get_int(jobj2);
+	AFEKSize = AF_split_sectors(volume_key_len, LUKS_STRIPES) * SECTOR_SIZE;
+	AfKey = crypt_safe_alloc(AFEKSize);
+	if (!AfKey)
+		return -ENOMEM;
+
+	log_dbg(cd, "Reading keyslot area [0x%04x].", (unsigned)area_offset);
+	/* FIXME: sector_offset should be size_t, fix LUKS_decrypt... accordingly */
+	r = luks2_decrypt_from_storage(AfKey, AFEKSize, cipher, cipher_mode,
+			      derived_key, (unsigned)(area_offset / SECTOR_SIZE), cd);
+
+	if (r == 0)
+		r = AF_merge(cd, AfKey, volume_key, volume_key_len, LUKS_STRIPES, af_hash);
+
+	crypt_safe_free(AfKey);
+
+	return r;
+}
+
+/* memory-hard KDF cost of keyslot, used to bound parallel unlocking */
+uint32_t LUKS2_keyslot_luks2_memory_kb(json_object *jobj_keyslot)
+{
+	struct crypt_pbkdf_type pbkdf;
+	char salt[LUKS_SALTSIZE];
+
+	if (luks2_keyslot_get_pbkdf_params(jobj_keyslot, &pbkdf, salt))
+		return 0;
+
+	return pbkdf.max_memory_kb;
+}
+
+static int luks2_keyslot_get_key(struct crypt_device *cd,
+	json_object *jobj_keyslot,
+	const char *password, size_t passwordLen,
+	char *volume_key, size_t volume_key_len)
+{
+	struct volume_key *derived_key = NULL;
+	struct crypt_pbkdf_memory *mem;
+	bool try_serialize_lock = false;
+	uint32_t memory_kb;
+	uint64_t start;
+	int r;
 
 	/*
 	 * If requested, serialize unlocking for memory-hard KDF. Usually NOOP.
 	 */
-	if (pbkdf.max_memory_kb > MIN_MEMORY_FOR_SERIALIZE_LOCK_KB)
+	memory_kb = LUKS2_keyslot_luks2_memory_kb(jobj_keyslot);
+	if (memory_kb > MIN_MEMORY_FOR_SERIALIZE_LOCK_KB)
 		try_serialize_lock = true;
 	if (try_serialize_lock && crypt_serialize_lock(cd))
 		return -EINVAL;
-	/*
-	 * Allocate derived key storage space.
-	 */
-	derived_key = crypt_alloc_volume_key(keyslot_key_len, NULL);
-	if (!derived_key)
-		return -ENOMEM;
 
-	AFEKSize = AF_split_sectors(volume_key_len, LUKS_STRIPES) * SECTOR_SIZE;
-	AfKey = crypt_safe_alloc(AFEKSize);
-	if (!AfKey) {
-		crypt_free_volume_key(derived_key);
-		return -ENOMEM;
+	/* Wait for PBKDF memory budget (if set) */
+	r = crypt_pbkdf_memory_acquire(cd, memory_kb, &mem);
+	if (r < 0) {
+		if (try_serialize_lock)
+			crypt_serialize_unlock(cd);
+		return r;
 	}
+
 	/*
 	 * Calculate derived key, decrypt keyslot content and merge it.
 	 */
-	r = crypt_pbkdf(pbkdf.type, pbkdf.hash, password, passwordLen,
-			salt, LUKS_SALTSIZE,
-			derived_key->key, derived_key->keylength,
-			pbkdf.iterations, pbkdf.max_memory_kb,
-			pbkdf.parallel_threads);
+	start = crypt_op_usec();
+	r = LUKS2_keyslot_luks2_derive_key(jobj_keyslot, password, passwordLen, &derived_key);
+	crypt_op_stats_add(cd, CRYPT_OP_KDF, crypt_op_usec() - start);
+
+	crypt_pbkdf_memory_release(cd, mem);
 
 	if (try_serialize_lock)
 		crypt_serialize_unlock(cd);
 
-	if (r == 0) {
-		log_dbg(cd, "Reading keyslot area [0x%04x].", (unsigned)area_offset);
-		/* FIXME: sector_offset should be size_t, fix LUKS_decrypt... accordingly */
-		r = luks2_decrypt_from_storage(AfKey, AFEKSize, cipher, cipher_mode,
-				      derived_key, (unsigned)(area_offset / SECTOR_SIZE), cd);
-	}
-
 	if (r == 0)
-		r = AF_merge(cd, AfKey, volume_key, volume_key_len, LUKS_STRIPES, af_hash);
+		r = LUKS2_keyslot_luks2_open_derived(cd, jobj_keyslot, derived_key,
+						     volume_key, volume_key_len);
 
 	crypt_free_volume_key(derived_key);
-	crypt_safe_free(AfKey);
 
 	return r;
 }
@@ -169,7 +169,7 @@ static int reenc_keyslot_store(struct crypt_device *cd,
 		return r;
 	}
 
-	r = LUKS2_hdr_write(cd, hdr);
+	r = LUKS2_hdr_write_segments(cd, hdr);
 
 	device_write_unlock(cd, crypt_metadata_device(cd));
 
@@ -209,6 +209,10 @@ static int reenc_keyslot_dump(struct crypt_device *cd, int keyslot)
 	} else if (!strcmp(json_object_get_string(jobj_resilience), "datashift")) {
 		json_object_object_get_ex(jobj_area, "shift_size", &jobj1);
 		log_std(cd, "\t%-12s%" PRIu64 "[bytes]\n", "Shift size:", crypt_jobj_get_uint64(jobj1));
+	} else if (json_object_object_get_ex(jobj_area, "journal_device", &jobj1)) {
+		log_std(cd, "\t%-12s%s\n", "Journal:", json_object_get_string(jobj1));
+		json_object_object_get_ex(jobj_area, "journal_size", &jobj1);
+		log_std(cd, "\t%-12s%" PRIu64 " [bytes]\n", "Journal size:", crypt_jobj_get_uint64(jobj1));
 	}
 
 	json_object_object_get_ex(jobj_area, "offset", &jobj1);
@@ -222,7 +226,8 @@ static int reenc_keyslot_dump(struct crypt_device *cd, int keyslot)
 
 static int reenc_keyslot_validate(struct crypt_device *cd, json_object *jobj_keyslot)
 {
-	json_object *jobj_mode, *jobj_area, *jobj_type, *jobj_shift_size, *jobj_hash, *jobj_sector_size, *jobj_direction;
+	json_object *jobj_mode, *jobj_area, *jobj_type, *jobj_shift_size, *jobj_hash, *jobj_sector_size, *jobj_direction,
+		    *jobj_journal_size;
 	const char *mode, *type, *direction;
 	uint32_t sector_size;
 	uint64_t shift_size;
@@ -234,6 +239,8 @@ static int reenc_keyslot_validate(struct crypt_device *cd, json_object *jobj_key
 	 *   	hash: (string: checksum only)
 	 *   	sector_size (uint32: checksum only)
 	 *   	shift_size (uint64: datashift only)
+	 *   	journal_device (string: journal on separate device only)
+	 *   	journal_size (uint64: journal on separate device only)
 	 * }
 	 */
 
@@ -287,6 +294,12 @@ static int reenc_keyslot_validate(struct crypt_device *cd, json_object *jobj_key
 			log_dbg(cd, "Shift size field has to be aligned to sector size: %" PRIu32, SECTOR_SIZE);
 			return -EINVAL;
 		}
+	} else if (!strcmp(type, "journal") && json_object_object_get_ex(jobj_area, "journal_device", NULL)) {
+		if (!json_contains(cd, jobj_area, "type:journal", "Keyslot area", "journal_device", json_type_string) ||
+		    !(jobj_journal_size = json_contains(cd, jobj_area, "type:journal", "Keyslot area", "journal_size", json_type_string)))
+			return -EINVAL;
+		if (!crypt_jobj_get_uint64(jobj_journal_size))
+			return -EINVAL;
 	}
 
 	return 0;
@@ -430,6 +430,7 @@ static int move_keyslot_areas(struct crypt_device *cd, off_t offset_from,
 {
 	int devfd, r = -EIO;
 	struct device *device = crypt_metadata_device(cd);
+	uint64_t dev_size;
 	void *buf = NULL;
 
 	log_dbg(cd, "Moving keyslot areas of size %zu from %jd to %jd.",
@@ -448,11 +449,11 @@ static int move_keyslot_areas(struct crypt_device *cd, off_t offset_from,
 	if (posix_fallocate(devfd, offset_to, buf_size))
 		log_dbg(cd, "Preallocation (fallocate) of new keyslot area not available.");
 
-	/* Try to read *new* area to check that area is there (trimmed backup). */
-	if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-				 device_alignment(device), buf, buf_size,
-				 offset_to)!= (ssize_t)buf_size)
+	/* Check that *new* area is there (trimmed backup), no need to read it. */
+	if (device_size(device, &dev_size) || dev_size < (uint64_t)offset_to + buf_size) {
+		log_dbg(cd, "New keyslot area is not available on device.");
 		goto out;
+	}
 
 	if (read_lseek_blockwise(devfd, device_block_size(cd, device),
 				 device_alignment(device), buf, buf_size,
@@ -473,6 +474,35 @@ out:
 	return r;
 }
 
+/*
+ * Span of active LUKS1 keyslot areas (in bytes, from device start).
+ * Returns 0 if there is no active keyslot.
+ */
+static size_t luks1_keyslots_span(const struct luks_phdr *hdr1, size_t area_end, size_t *start)
+{
+	size_t ks_start, ks_end, end = 0;
+	int i;
+
+	*start = area_end;
+
+	for (i = 0; i < LUKS_NUMKEYS; i++) {
+		if (hdr1->keyblock[i].active != LUKS_KEY_ENABLED)
+			continue;
+		ks_start = (size_t)hdr1->keyblock[i].keyMaterialOffset * SECTOR_SIZE;
+		ks_end = ks_start + AF_split_sectors(hdr1->keyBytes, LUKS_STRIPES) * SECTOR_SIZE;
+		if (ks_start < *start)
+			*start = ks_start;
+		if (ks_end > end)
+			end = ks_end;
+	}
+
+	end = size_round_up(end, LUKS_ALIGN_KEYSLOTS);
+	if (end > area_end)
+		end = area_end;
+
+	return end > *start ? end - *start : 0;
+}
+
 static int luks_header_in_use(struct crypt_device *cd)
 {
 	int r;
@@ -518,7 +548,7 @@ int LUKS2_luks1_to_luks2(struct crypt_device *cd, struct luks_phdr *hdr1, struct
 {
 	int r;
 	json_object *jobj = NULL;
-	size_t buf_size, buf_offset, luks1_size, luks1_shift = 2 * LUKS2_HDR_16K_LEN - LUKS_ALIGN_KEYSLOTS;
+	size_t buf_size, buf_offset, span_offset, luks1_size, luks1_shift = 2 * LUKS2_HDR_16K_LEN - LUKS_ALIGN_KEYSLOTS;
 	uint64_t required_size, max_size = crypt_get_data_offset(cd) * SECTOR_SIZE;
 
 	/* for detached headers max size == device size */
@@ -601,7 +631,12 @@ int LUKS2_luks1_to_luks2(struct crypt_device *cd, struct luks_phdr *hdr1, struct
 		goto out;
 	}
 
-	if ((r = move_keyslot_areas(cd, 8 * SECTOR_SIZE, buf_offset, buf_size)) < 0) {
+	/* only areas of active keyslots are used in LUKS2 metadata */
+	buf_size = luks1_keyslots_span(hdr1, luks1_size, &span_offset);
+	if (!buf_size)
+		log_dbg(cd, "No active keyslot, nothing to move.");
+	else if ((r = move_keyslot_areas(cd, span_offset,
+				 buf_offset + span_offset - 8 * SECTOR_SIZE, buf_size)) < 0) {
 		log_err(cd, _("Unable to move keyslot area."));
 		goto out;
 	}
@@ -19,9 +19,40 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "luks2_internal.h"
 #include "utils_device_locking.h"
 
+/* adaptive hotzone: min length is max / RANGE, latency thresholds */
+#define REENC_ADAPT_RANGE		16
+#define REENC_ADAPT_IOS_MIN		8
+#define REENC_ADAPT_LATENCY_SLACK_US	2000
+
+/* rate limit: maximal budget consumed at once after idle period */
+#define REENC_RATE_BURST_NS		1000000000
+
+/* non-cryptographic checksum resilience hash */
+#define REENC_CSUM_CRC32C "crc32c"
+
+/* parallel hotzone checksums: max threads, min blocks per thread */
+#define REENC_CSUM_THREADS_MAX		8
+#define REENC_CSUM_BLOCKS_MIN		64
+
+/* external journal device: header block followed by old data of hotzone */
+#define REENC_JOURNAL_MAGIC		"LUKSJNL"
+#define REENC_JOURNAL_HDR_SIZE		4096
+
+struct reenc_journal_hdr {
+	char magic[8];
+	char uuid[LUKS2_UUID_L];
+	uint64_t offset;	/* big endian, hotzone offset */
+	uint64_t length;	/* big endian, journaled length */
+} __attribute__((packed));
+
 struct reenc_protection {
 	enum { REENC_PROTECTION_NONE = 0, /* none should be 0 always */
 	       REENC_PROTECTION_CHECKSUM,
@@ -33,12 +64,16 @@ struct reenc_protection {
 	} none;
 	struct {
 		char hash[LUKS2_CHECKSUM_ALG_L]; // or include luks.h
-		struct crypt_hash *ch;
+		struct crypt_hash *ch; /* NULL for crc32c */
 		size_t hash_size;
 		/* buffer for checksums */
 		void *checksums;
 		size_t checksums_len;
 	} csum;
+	struct {
+		struct device *device; /* NULL for journal in keyslot area */
+		uint64_t size;         /* data capacity without header block */
+	} journal;
 	struct {
 	} ds;
 	} p;
@@ -54,6 +89,7 @@ struct luks2_reencrypt {
 	uint64_t device_size;
 	bool online;
 	bool fixed_length;
+	bool zerocopy;
 	crypt_reencrypt_direction_info direction;
 	crypt_reencrypt_mode_info mode;
 
@@ -81,8 +117,83 @@ struct luks2_reencrypt {
 	struct volume_key *vks;
 
 	void *reenc_buffer;
+	size_t reenc_buffer_size; /* also size of read-ahead buffer, these are swapped */
 	ssize_t read;
 
+	/* NUMA node of data device for helper threads and buffers, -1 if not bound */
+	int numa_node;
+
+	/* read-ahead and write-behind hints (rotational data device only) */
+	struct reenc_io_hints {
+		bool enabled;
+		uint64_t wb_offset;  /* previous hotzone with writeback in flight */
+		uint64_t wb_length;
+	} io;
+
+	/* read-ahead of next hotzone (offline reencryption only) */
+	struct reenc_prefetch {
+		pthread_t thread;
+		bool active;
+		int devfd;
+		size_t block_size;
+		size_t alignment;
+		uint64_t data_offset;
+		void *buffer;
+		uint64_t offset;
+		uint64_t length;
+		ssize_t read;
+	} pf;
+
+	/* adaptive hotzone size (online reencryption only) */
+	struct reenc_adapt {
+		bool enabled;
+		bool grown;
+		uint64_t length;      /* planned length of the next hotzone */
+		uint64_t length_min;
+		uint64_t length_max;
+		uint64_t throughput;  /* bytes/s measured in previous step */
+		uint64_t latency_min; /* lowest seen foreground I/O latency (us) */
+		uint64_t ios;
+		uint64_t ticks;
+		char dev_path[PATH_MAX];
+	} ad;
+
+	/* unallocated plaintext areas (holes) are not encrypted */
+	struct reenc_skip {
+		bool enabled;
+		bool hole;            /* current hotzone is a hole */
+		int devfd;            /* for SEEK_DATA on regular files only */
+		uint64_t data_offset;
+		uint64_t skipped;
+	} sk;
+
+	/* dm-crypt table key parts of old and new segment (online only) */
+	struct reenc_key_params {
+		int digest;
+		uint32_t flags;
+		char *cipher;
+		char *params;
+	} kp[2];
+
+	/* cumulative per-phase counters */
+	struct crypt_reencrypt_stats stats;
+	uint64_t hotzone_suspended; /* hotzone suspend timestamp */
+
+	/* throughput and IOPS limit between hotzones (GCRA token bucket) */
+	struct reenc_rate {
+		uint64_t max_throughput; /* bytes/s, 0 unlimited */
+		uint32_t max_iops;       /* hotzone I/O operations/s, 0 unlimited */
+		uint64_t tat;            /* theoretical arrival time (ns) */
+	} rate;
+
+	/* periodic metadata commit for "none" resilience, 0 disabled */
+	struct reenc_commit {
+		uint64_t bytes;   /* commit after this amount of data */
+		uint64_t ns;      /* commit after this time */
+		uint64_t pending; /* data processed since last commit */
+		uint64_t last;    /* last commit timestamp (ns) */
+	} commit;
+
 	struct crypt_storage_wrapper *cw1;
 	struct crypt_storage_wrapper *cw2;
 
@@ -121,9 +232,19 @@ static int reencrypt_keyslot_update(struct crypt_device *cd,
 		log_dbg(cd, "Updating reencrypt keyslot for journal protection.");
 		json_object_object_add(jobj_area, "type", json_object_new_string("journal"));
 		json_object_object_del(jobj_area, "hash");
+		if (rh->rp.p.journal.device) {
+			json_object_object_add(jobj_area, "journal_device",
+				json_object_new_string(device_path(rh->rp.p.journal.device)));
+			json_object_object_add(jobj_area, "journal_size",
+				crypt_jobj_new_uint64(rh->rp.p.journal.size));
+			return 0;
+		}
 	} else
 		log_dbg(cd, "No update of reencrypt keyslot needed.");
 
+	json_object_object_del(jobj_area, "journal_device");
+	json_object_object_del(jobj_area, "journal_size");
+
 	return 0;
 }
 
@@ -229,6 +350,40 @@ static const char *reencrypt_resilience_type(struct luks2_hdr *hdr)
 	return json_object_get_string(jobj_type);
 }
 
+static const char *reencrypt_resilience_journal(struct luks2_hdr *hdr)
+{
+	json_object *jobj_keyslot, *jobj_area, *jobj_device;
+	int ks = LUKS2_find_keyslot(hdr, "reencrypt");
+
+	if (ks < 0)
+		return NULL;
+
+	jobj_keyslot = LUKS2_get_keyslot_jobj(hdr, ks);
+
+	json_object_object_get_ex(jobj_keyslot, "area", &jobj_area);
+	if (!json_object_object_get_ex(jobj_area, "journal_device", &jobj_device))
+		return NULL;
+
+	return json_object_get_string(jobj_device);
+}
+
+static uint64_t reencrypt_resilience_journal_size(struct luks2_hdr *hdr)
+{
+	json_object *jobj_keyslot, *jobj_area, *jobj_size;
+	int ks = LUKS2_find_keyslot(hdr, "reencrypt");
+
+	if (ks < 0)
+		return 0;
+
+	jobj_keyslot = LUKS2_get_keyslot_jobj(hdr, ks);
+
+	json_object_object_get_ex(jobj_keyslot, "area", &jobj_area);
+	if (!json_object_object_get_ex(jobj_area, "journal_size", &jobj_size))
+		return 0;
+
+	return crypt_jobj_get_uint64(jobj_size);
+}
+
 static const char *reencrypt_resilience_hash(struct luks2_hdr *hdr)
 {
 	json_object *jobj_keyslot, *jobj_area, *jobj_type, *jobj_hash;
@@ -723,8 +878,109 @@ static crypt_reencrypt_direction_info reencrypt_direction(struct luks2_hdr *hdr)
 
 typedef enum { REENC_OK = 0, REENC_ERR, REENC_ROLLBACK, REENC_FATAL } reenc_status_t;
 
+static void reencrypt_prefetch_wait(struct luks2_reencrypt *rh)
+{
+	if (!rh->pf.active)
+		return;
+
+	pthread_join(rh->pf.thread, NULL);
+	rh->pf.active = false;
+}
+
+#define REENC_HUGEPAGE_SIZE_DEFAULT (2 * 1024 * 1024)
+
+/* Default huge page size (can be 1 GiB), munmap of hugetlb mapping needs it */
+static size_t reencrypt_hugepage_size(void)
+{
+	static size_t hugepage_size = 0;
+	char line[128];
+	size_t size;
+	FILE *f;
+
+	if ((size = __atomic_load_n(&hugepage_size, __ATOMIC_RELAXED)))
+		return size;
+
+	size = REENC_HUGEPAGE_SIZE_DEFAULT;
+	if ((f = fopen("/proc/meminfo", "re"))) {
+		while (fgets(line, sizeof(line), f))
+			if (sscanf(line, "Hugepagesize: %zu kB", &size) == 1) {
+				size *= 1024;
+				break;
+			}
+		fclose(f);
+	}
+	if (!size || (size & (size - 1)) || size < crypt_getpagesize())
+		size = REENC_HUGEPAGE_SIZE_DEFAULT;
+
+	__atomic_store_n(&hugepage_size, size, __ATOMIC_RELAXED);
+	return size;
+}
+
+static size_t reencrypt_buffer_map_size(size_t length)
+{
+	size_t huge = reencrypt_hugepage_size();
+	size_t page = length >= huge ? huge : crypt_getpagesize();
+
+	return (length + page - 1) & ~(page - 1);
+}
+
+/*
+ * Hotzone buffer is touched in every step (read, decrypt, encrypt, checksum
+ * and write). Map it with huge pages if possible and fault it in here,
+ * not during the first hotzone. With crypt_memory_lock() (mlockall with
+ * MCL_FUTURE) the new mapping is locked as well.
+ */
+static void *reencrypt_buffer_alloc(struct crypt_device *cd, size_t length,
+	size_t alignment, int numa_node)
+{
+	size_t size = reencrypt_buffer_map_size(length);
+	void *p = MAP_FAILED;
+
+	/* mapping is always page aligned */
+	if (!length || !alignment || alignment > crypt_getpagesize())
+		return NULL;
+
+#ifdef MAP_HUGETLB
+	if (size >= reencrypt_hugepage_size())
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		if (size >= REENC_HUGEPAGE_SIZE_DEFAULT)
+			(void)madvise(p, size, MADV_HUGEPAGE);
+#endif
+	} else
+		log_dbg(cd, "Using explicit huge pages for hotzone buffer.");
+#ifdef MADV_DONTDUMP
+	(void)madvise(p, size, MADV_DONTDUMP);
+#endif
+
+	crypt_numa_bind_memory(p, size, numa_node);
+	memset(p, 0, size);
+
+	return p;
+}
+
+static void reencrypt_buffer_free(void *buffer, size_t length)
+{
+	size_t size = reencrypt_buffer_map_size(length);
+
+	if (!buffer)
+		return;
+
+	crypt_safe_memzero(buffer, size);
+	munmap(buffer, size);
+}
+
 void LUKS2_reencrypt_free(struct crypt_device *cd, struct luks2_reencrypt *rh)
 {
+	unsigned i;
+
 	if (!rh)
 		return;
 
@@ -738,6 +994,14 @@ void LUKS2_reencrypt_free(struct crypt_device *cd, struct luks2_reencrypt *rh)
 			free(rh->rp.p.csum.checksums);
 			rh->rp.p.csum.checksums = NULL;
 		}
+	} else if (rh->rp.type == REENC_PROTECTION_JOURNAL) {
+		device_free(cd, rh->rp.p.journal.device);
+		rh->rp.p.journal.device = NULL;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(rh->kp); i++) {
+		free(rh->kp[i].cipher);
+		crypt_safe_free(rh->kp[i].params);
 	}
 
 	json_object_put(rh->jobj_segs_hot);
@@ -751,12 +1015,22 @@ void LUKS2_reencrypt_free(struct crypt_device *cd, struct luks2_reencrypt *rh)
 	json_object_put(rh->jobj_segment_moved);
 	rh->jobj_segment_moved = NULL;
 
-	free(rh->reenc_buffer);
+	reencrypt_prefetch_wait(rh);
+	if (rh->pf.devfd >= 0)
+		close(rh->pf.devfd);
+	rh->pf.devfd = -1;
+	reencrypt_buffer_free(rh->pf.buffer, rh->reenc_buffer_size);
+	rh->pf.buffer = NULL;
+	if (rh->sk.devfd >= 0)
+		close(rh->sk.devfd);
+	rh->sk.devfd = -1;
+	reencrypt_buffer_free(rh->reenc_buffer, rh->reenc_buffer_size);
 	rh->reenc_buffer = NULL;
 	crypt_storage_wrapper_destroy(rh->cw1);
 	rh->cw1 = NULL;
 	crypt_storage_wrapper_destroy(rh->cw2);
 	rh->cw2 = NULL;
+	crypt_storage_wrapper_pool_free(cd);
 
 	free(rh->device_name);
 	free(rh->overlay_name);
@@ -927,7 +1201,10 @@ static uint64_t reencrypt_length(struct crypt_device *cd,
 	unsigned long dummy, optimal_alignment;
 	uint64_t length, soft_mem_limit;
 
-	if (rh->rp.type == REENC_PROTECTION_NONE)
+	if (rh->rp.type == REENC_PROTECTION_NONE && !length_max &&
+	    device_is_rotational(crypt_data_device(cd)) == 1)
+		length = LUKS2_DEFAULT_NONE_REENCRYPTION_LENGTH_ROTATIONAL;
+	else if (rh->rp.type == REENC_PROTECTION_NONE)
 		length = length_max ?: LUKS2_DEFAULT_NONE_REENCRYPTION_LENGTH;
 	else if (rh->rp.type == REENC_PROTECTION_CHECKSUM)
 		length = (keyslot_area_length / rh->rp.p.csum.hash_size) * rh->alignment;
@@ -968,6 +1245,47 @@ static uint64_t reencrypt_length(struct crypt_device *cd,
 	return length;
 }
 
+/* Journal on separate device set by crypt_reencrypt_set_journal_device() or stored in keyslot */
+static int reencrypt_journal_init(struct crypt_device *cd, struct luks2_hdr *hdr,
+				  struct luks2_reencrypt *rh)
+{
+	const char *path = crypt_get_reencrypt_journal(cd) ?: reencrypt_resilience_journal(hdr);
+	uint64_t size, stored_size = reencrypt_resilience_journal_size(hdr);
+	int r;
+
+	if (!path)
+		return 0;
+
+	log_dbg(cd, "Using reencryption journal device %s.", path);
+
+	r = device_alloc(cd, &rh->rp.p.journal.device, path);
+	if (r < 0)
+		return r;
+
+	if (device_is_identical(rh->rp.p.journal.device, crypt_data_device(cd)) > 0 ||
+	    device_is_identical(rh->rp.p.journal.device, crypt_metadata_device(cd)) > 0) {
+		log_err(cd, _("Journal device %s must be different from data and metadata device."), path);
+		return -EINVAL;
+	}
+
+	r = device_size(rh->rp.p.journal.device, &size);
+	if (r < 0 || size <= REENC_JOURNAL_HDR_SIZE) {
+		log_err(cd, _("Cannot use journal device %s (too small or not accessible)."), path);
+		return -EINVAL;
+	}
+
+	size -= REENC_JOURNAL_HDR_SIZE;
+
+	/* hotzone in progress was sized by recorded capacity, keep it for resume and recovery */
+	if (stored_size > size) {
+		log_err(cd, _("Journal device %s is smaller than recorded journal size."), path);
+		return -EINVAL;
+	}
+
+	rh->rp.p.journal.size = stored_size ?: size;
+	return 0;
+}
+
 static int reencrypt_context_init(struct crypt_device *cd, struct luks2_hdr *hdr, struct luks2_reencrypt *rh, uint64_t device_size, const struct crypt_params_reencrypt *params)
 {
 	int r;
@@ -1008,6 +1326,12 @@ static int reencrypt_context_init(struct crypt_device *cd, struct luks2_hdr *hdr
 	} else if (!strcmp(params->resilience, "journal")) {
 		log_dbg(cd, "Initializing reencryption context with journal resilience.");
 		rh->rp.type = REENC_PROTECTION_JOURNAL;
+
+		r = reencrypt_journal_init(cd, hdr, rh);
+		if (r)
+			return r;
+		if (rh->rp.p.journal.device)
+			area_length = rh->rp.p.journal.size;
 	} else if (!strcmp(params->resilience, "checksum")) {
 		log_dbg(cd, "Initializing reencryption context with checksum resilience.");
 		rh->rp.type = REENC_PROTECTION_CHECKSUM;
@@ -1019,12 +1343,18 @@ static int reencrypt_context_init(struct crypt_device *cd, struct luks2_hdr *hdr
 			return -EINVAL;
 		}
 
-		if (crypt_hash_init(&rh->rp.p.csum.ch, params->hash)) {
+		/*
+		 * Checksums only tell old and new data apart in recovery,
+		 * non-cryptographic crc32c is allowed here (explicit opt-in,
+		 * see reencrypt_check_crc32c()).
+		 */
+		if (!strcmp(params->hash, REENC_CSUM_CRC32C))
+			r = sizeof(uint32_t);
+		else if (crypt_hash_init(&rh->rp.p.csum.ch, params->hash)) {
 			log_dbg(cd, "Failed to initialize checksum resilience hash %s", params->hash);
 			return -EINVAL;
-		}
-
-		r = crypt_hash_size(params->hash);
+		} else
+			r = crypt_hash_size(params->hash);
 		if (r < 1) {
 			log_dbg(cd, "Invalid hash size");
 			return -EINVAL;
@@ -1085,6 +1415,24 @@ static int reencrypt_context_init(struct crypt_device *cd, struct luks2_hdr *hdr
 
 	rh->device_size = device_size;
 
+	rh->zerocopy = params->flags & CRYPT_REENCRYPT_KCAPI_ZEROCOPY;
+
+	if ((params->flags & CRYPT_REENCRYPT_SKIP_UNALLOCATED) && rh->mode == CRYPT_REENCRYPT_ENCRYPT &&
+	    rh->rp.type != REENC_PROTECTION_DATASHIFT)
+		rh->sk.enabled = true;
+
+	/* current length is upper bound (buffers, resilience area) */
+	if ((params->flags & CRYPT_REENCRYPT_ADAPTIVE_HOTZONE) && rh->rp.type != REENC_PROTECTION_DATASHIFT) {
+		rh->ad.enabled = true;
+		rh->ad.length_max = rh->length;
+		rh->ad.length_min = rh->length / REENC_ADAPT_RANGE;
+		rh->ad.length_min -= rh->ad.length_min % rh->alignment;
+		if (rh->ad.length_min < rh->alignment)
+			rh->ad.length_min = rh->alignment;
+		if (rh->ad.length_min > rh->ad.length_max)
+			rh->ad.length_min = rh->ad.length_max;
+	}
+
 	return rh->length < 512 ? -EINVAL : 0;
 }
 
@@ -1112,6 +1460,9 @@ static int reencrypt_load_clean(struct crypt_device *cd,
 	if (!tmp)
 		return -ENOMEM;
 
+	tmp->pf.devfd = -1;
+	tmp->sk.devfd = -1;
+
 	r = -EINVAL;
 	if (!hdr_reenc_params.resilience)
 		goto err;
@@ -1129,12 +1480,19 @@ static int reencrypt_load_clean(struct crypt_device *cd,
 	if (r)
 		goto err;
 
-	if (posix_memalign(&tmp->reenc_buffer, device_alignment(crypt_data_device(cd)),
-			   reencrypt_buffer_length(tmp))) {
+	tmp->numa_node = crypt_numa_node(cd, crypt_data_device(cd));
+	tmp->reenc_buffer_size = reencrypt_buffer_length(tmp);
+	tmp->reenc_buffer = reencrypt_buffer_alloc(cd, tmp->reenc_buffer_size,
+			device_alignment(crypt_data_device(cd)), tmp->numa_node);
+	if (!tmp->reenc_buffer) {
 		r = -ENOMEM;
 		goto err;
 	}
 
+	tmp->io.enabled = device_is_rotational(crypt_data_device(cd)) == 1;
+	if (tmp->io.enabled)
+		log_dbg(cd, "Using hotzone read-ahead and write-behind hints (rotational device).");
+
 	*rh = tmp;
 
 	return 0;
@@ -1246,7 +1604,12 @@ static int reencrypt_init_storage_wrappers(struct crypt_device *cd,
 {
 	int r;
 	struct volume_key *vk;
-	uint32_t wrapper_flags = (getuid() || geteuid()) ? 0 : DISABLE_KCAPI;
+	/* pooled devices hold volume keys, the pool is released with reencryption context */
+	uint32_t wrapper_flags = DMCRYPT_POOL | ((getuid() || geteuid()) ? 0 : DISABLE_KCAPI);
+
+	/* zero-copy splice only on explicit request, falls back to copy if unavailable */
+	if (rh->zerocopy && !(wrapper_flags & DISABLE_KCAPI))
+		wrapper_flags |= KCAPI_ZEROCOPY;
 
 	vk = crypt_volume_key_by_id(vks, rh->digest_old);
 	r = crypt_storage_wrapper_init(cd, &rh->cw1, crypt_data_device(cd),
@@ -1262,6 +1625,10 @@ static int reencrypt_init_storage_wrappers(struct crypt_device *cd,
 	rh->wflags1 = wrapper_flags | OPEN_READONLY;
 	log_dbg(cd, "Old cipher storage wrapper type: %d.", crypt_storage_wrapper_get_type(rh->cw1));
 
+	/* hotzone must be synced before metadata commit, sync only its range */
+	if (rh->rp.type != REENC_PROTECTION_NONE)
+		wrapper_flags |= WRITE_DSYNC;
+
 	vk = crypt_volume_key_by_id(vks, rh->digest_new);
 	r = crypt_storage_wrapper_init(cd, &rh->cw2, crypt_data_device(cd),
 			reencrypt_get_data_offset_new(hdr),
@@ -1350,13 +1717,165 @@ static int reencrypt_update_flag(struct crypt_device *cd, int enable, bool commi
 	return LUKS2_config_set_requirements(cd, hdr, reqs, commit);
 }
 
+/* journal header must describe the crashed hotzone of this device */
+static int reencrypt_journal_verify(struct crypt_device *cd, struct luks2_reencrypt *rh)
+{
+	struct device *device = rh->rp.p.journal.device;
+	struct reenc_journal_hdr *jhdr = NULL;
+	int devfd, r = -EINVAL;
+
+	if (posix_memalign((void **)&jhdr, device_alignment(device), REENC_JOURNAL_HDR_SIZE))
+		return -ENOMEM;
+
+	devfd = device_open(cd, device, O_RDONLY);
+	if (devfd < 0 ||
+	    read_lseek_blockwise(devfd, device_block_size(cd, device), device_alignment(device),
+				 jhdr, REENC_JOURNAL_HDR_SIZE, 0) != REENC_JOURNAL_HDR_SIZE) {
+		log_err(cd, _("Cannot read reencryption journal from %s."), device_path(device));
+		r = -EIO;
+		goto out;
+	}
+
+	if (memcmp(jhdr->magic, REENC_JOURNAL_MAGIC, sizeof(jhdr->magic)) ||
+	    strncmp(jhdr->uuid, crypt_get_uuid(cd) ?: "", sizeof(jhdr->uuid)) ||
+	    be64_to_cpu(jhdr->offset) != rh->offset ||
+	    be64_to_cpu(jhdr->length) < rh->length) {
+		log_err(cd, _("Journal device %s does not contain data of interrupted hotzone."), device_path(device));
+		goto out;
+	}
+
+	r = 0;
+out:
+	free(jhdr);
+	return r;
+}
+
+struct reenc_csum_lane {
+	pthread_t thread;
+	struct crypt_hash *ch;
+	const char *buffer;
+	char *checksums;
+	size_t blocks;
+	size_t alignment;
+	size_t hash_size;
+	bool crc32c;
+	int numa_node;
+	int r;
+};
+
+static void reencrypt_checksum_blocks(struct reenc_csum_lane *lane)
+{
+	const unsigned char *block;
+	uint32_t crc;
+	size_t i;
+
+	for (i = 0; i < lane->blocks; i++) {
+		if (lane->crc32c) {
+			block = (const unsigned char *)lane->buffer + i * lane->alignment;
+			crc = cpu_to_le32(crypt_crc32c(0xffffffff, block, lane->alignment) ^ 0xffffffff);
+			memcpy(lane->checksums + i * lane->hash_size, &crc, sizeof(crc));
+		} else if (crypt_hash_write(lane->ch, lane->buffer + i * lane->alignment, lane->alignment) ||
+		    crypt_hash_final(lane->ch, lane->checksums + i * lane->hash_size, lane->hash_size)) {
+			lane->r = -EINVAL;
+			return;
+		}
+	}
+
+	lane->r = 0;
+}
+
+static void *reencrypt_checksum_thread(void *arg)
+{
+	struct reenc_csum_lane *lane = arg;
+
+	crypt_numa_bind_thread(lane->numa_node);
+	reencrypt_checksum_blocks(lane);
+
+	return NULL;
+}
+
+/*
+ * Hotzone checksums of independent blocks may be computed in parallel, each
+ * lane hashes contiguous range of blocks with its own hash context and
+ * stores results at the same position as serial code would.
+ */
+static int reencrypt_checksums(struct crypt_device *cd, struct luks2_reencrypt *rh,
+	const void *buffer, size_t blocks, void *checksums)
+{
+	struct reenc_csum_lane lanes[REENC_CSUM_THREADS_MAX];
+	size_t i, lanes_count, per_lane, done = 0;
+	bool started[REENC_CSUM_THREADS_MAX] = {};
+	int r = 0;
+
+	lanes_count = crypt_numa_cpus(rh->numa_node);
+	if (lanes_count > REENC_CSUM_THREADS_MAX)
+		lanes_count = REENC_CSUM_THREADS_MAX;
+	if (lanes_count > blocks / REENC_CSUM_BLOCKS_MIN)
+		lanes_count = blocks / REENC_CSUM_BLOCKS_MIN;
+	if (!lanes_count)
+		lanes_count = 1;
+
+	per_lane = blocks / lanes_count;
+
+	for (i = 0; i < lanes_count; i++) {
+		lanes[i].ch = NULL;
+		lanes[i].buffer = (const char *)buffer + done * rh->alignment;
+		lanes[i].checksums = (char *)checksums + done * rh->rp.p.csum.hash_size;
+		lanes[i].blocks = (i == lanes_count - 1) ? blocks - done : per_lane;
+		lanes[i].alignment = rh->alignment;
+		lanes[i].hash_size = rh->rp.p.csum.hash_size;
+		lanes[i].crc32c = !rh->rp.p.csum.ch;
+		lanes[i].numa_node = rh->numa_node;
+		lanes[i].r = -EINVAL;
+		done += lanes[i].blocks;
+	}
+
+	if (lanes_count > 1)
+		log_dbg(cd, "Computing hotzone checksums in %zu threads.", lanes_count);
+
+	/* lane 0 runs in this thread with context hash */
+	lanes[0].ch = rh->rp.p.csum.ch;
+	for (i = 1; i < lanes_count; i++) {
+		if (!lanes[i].crc32c && crypt_hash_init(&lanes[i].ch, rh->rp.p.csum.hash)) {
+			lanes[i].ch = NULL;
+			continue;
+		}
+		started[i] = !pthread_create(&lanes[i].thread, NULL, reencrypt_checksum_thread, &lanes[i]);
+	}
+
+	reencrypt_checksum_blocks(&lanes[0]);
+
+	for (i = 1; i < lanes_count; i++) {
+		if (started[i])
+			pthread_join(lanes[i].thread, NULL);
+		else if (lanes[i].ch)
+			reencrypt_checksum_blocks(&lanes[i]);
+		else {
+			/* no private hash context, use the shared one */
+			lanes[i].ch = rh->rp.p.csum.ch;
+			reencrypt_checksum_blocks(&lanes[i]);
+			lanes[i].ch = NULL;
+		}
+		if (lanes[i].ch)
+			crypt_hash_destroy(lanes[i].ch);
+	}
+
+	for (i = 0; i < lanes_count; i++)
+		if (lanes[i].r) {
+			log_dbg(cd, "Failed to compute hotzone checksum.");
+			r = -EINVAL;
+		}
+
+	return r;
+}
+
 static int reencrypt_recover_segment(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	struct luks2_reencrypt *rh,
 	struct volume_key *vks)
 {
 	struct volume_key *vk_old, *vk_new;
-	size_t count, s;
+	size_t count, s, e;
 	ssize_t read, w;
 	unsigned resilience;
 	uint64_t area_offset, area_length, area_length_read, crash_iv_offset,
@@ -1423,7 +1942,7 @@ static int reencrypt_recover_segment(struct crypt_device *cd,
 			goto out;
 		}
 
-		checksum_tmp = malloc(rh->rp.p.csum.hash_size);
+		checksum_tmp = malloc(area_length_read);
 		if (!checksum_tmp) {
 			r = -ENOMEM;
 			goto out;
@@ -1450,30 +1969,34 @@ static int reencrypt_recover_segment(struct crypt_device *cd,
 			goto out;
 		}
 
-		for (s = 0; s < count; s++) {
-			if (crypt_hash_write(rh->rp.p.csum.ch, data_buffer + (s * rh->alignment), rh->alignment)) {
-				log_dbg(cd, "Failed to write hash.");
-				r = EINVAL;
-				goto out;
+		/* hash all sectors at once (in parallel), decisions are per sector as before */
+		if (reencrypt_checksums(cd, rh, data_buffer, count, checksum_tmp)) {
+			r = -EINVAL;
+			goto out;
+		}
+
+		/* matching checksum means old data, recover consecutive sectors in one run */
+		for (s = 0; s < count; s = e) {
+			for (e = s; e < count && !memcmp(checksum_tmp + e * rh->rp.p.csum.hash_size,
+				(char *)rh->rp.p.csum.checksums + e * rh->rp.p.csum.hash_size,
+				rh->rp.p.csum.hash_size); e++)
+				log_dbg(cd, "Sector %zu (size %zu, offset %zu) needs recovery", e, rh->alignment, e * rh->alignment);
+
+			if (e == s) {
+				e++;
+				continue;
 			}
-			if (crypt_hash_final(rh->rp.p.csum.ch, checksum_tmp, rh->rp.p.csum.hash_size)) {
-				log_dbg(cd, "Failed to finalize hash.");
-				r = EINVAL;
+
+			if (crypt_storage_wrapper_decrypt(cw1, s * rh->alignment, data_buffer + (s * rh->alignment), (e - s) * rh->alignment)) {
+				log_err(cd, _("Failed to decrypt sector %zu."), s);
+				r = -EINVAL;
 				goto out;
 			}
-			if (!memcmp(checksum_tmp, (char *)rh->rp.p.csum.checksums + (s * rh->rp.p.csum.hash_size), rh->rp.p.csum.hash_size)) {
-				log_dbg(cd, "Sector %zu (size %zu, offset %zu) needs recovery", s, rh->alignment, s * rh->alignment);
-				if (crypt_storage_wrapper_decrypt(cw1, s * rh->alignment, data_buffer + (s * rh->alignment), rh->alignment)) {
-					log_err(cd, _("Failed to decrypt sector %zu."), s);
-					r = -EINVAL;
-					goto out;
-				}
-				w = crypt_storage_wrapper_encrypt_write(cw2, s * rh->alignment, data_buffer + (s * rh->alignment), rh->alignment);
-				if (w < 0 || (size_t)w != rh->alignment) {
-					log_err(cd, _("Failed to recover sector %zu."), s);
-					r = -EINVAL;
-					goto out;
-				}
+			w = crypt_storage_wrapper_encrypt_write(cw2, s * rh->alignment, data_buffer + (s * rh->alignment), (e - s) * rh->alignment);
+			if (w < 0 || (size_t)w != (e - s) * rh->alignment) {
+				log_err(cd, _("Failed to recover sector %zu."), s);
+				r = -EINVAL;
+				goto out;
 			}
 		}
 
@@ -1482,6 +2005,14 @@ static int reencrypt_recover_segment(struct crypt_device *cd,
 	case  REENC_PROTECTION_JOURNAL:
 		log_dbg(cd, "Journal based recovery.");
 
+		if (rh->rp.p.journal.device) {
+			r = reencrypt_journal_verify(cd, rh);
+			if (r)
+				goto out;
+			area_length = rh->rp.p.journal.size;
+			area_offset = REENC_JOURNAL_HDR_SIZE;
+		}
+
 		/* FIXME: validation candidate */
 		if (rh->length > area_length) {
 			r = -EINVAL;
@@ -1490,7 +2021,7 @@ static int reencrypt_recover_segment(struct crypt_device *cd,
 		}
 
 		/* TODO locking */
-		r = crypt_storage_wrapper_init(cd, &cw1, crypt_metadata_device(cd),
+		r = crypt_storage_wrapper_init(cd, &cw1, rh->rp.p.journal.device ?: crypt_metadata_device(cd),
 				area_offset, crash_iv_offset, old_sector_size,
 				reencrypt_segment_cipher_old(hdr), vk_old, 0);
 		if (r) {
@@ -1737,7 +2268,7 @@ static int reencrypt_assign_segments(struct crypt_device *cd,
 		return r;
 	}
 
-	return commit ? LUKS2_hdr_write(cd, hdr) : 0;
+	return commit ? LUKS2_hdr_write_segments(cd, hdr) : 0;
 }
 
 static int reencrypt_set_encrypt_segments(struct crypt_device *cd, struct luks2_hdr *hdr, uint64_t dev_size, uint64_t data_shift, bool move_first_segment, crypt_reencrypt_direction_info di)
@@ -1801,15 +2332,61 @@ static int reencrypt_set_encrypt_segments(struct crypt_device *cd, struct luks2_
 	return r ?: LUKS2_segments_set(cd, hdr, jobj_segments, 0);
 }
 
+/*
+ * Reuse formatted "<cipher> <key>" table part for repeated overlay reloads,
+ * only segment offsets change between hotzones.
+ */
+static void reencrypt_target_key_params(struct luks2_reencrypt *rh, struct dm_target *tgt,
+	int digest, uint32_t flags)
+{
+	struct reenc_key_params *kp;
+	unsigned i;
+
+	if (!rh)
+		return;
+
+	flags &= CRYPT_ACTIVATE_KEYRING_KEY;
+
+	for (i = 0; i < ARRAY_SIZE(rh->kp); i++) {
+		kp = &rh->kp[i];
+		if (!kp->params)
+			break;
+		if (kp->digest == digest && kp->flags == flags && !strcmp(kp->cipher, tgt->u.crypt.cipher)) {
+			tgt->u.crypt.key_params = kp->params;
+			return;
+		}
+	}
+
+	/* cache is full, table part is formatted on each load */
+	if (i == ARRAY_SIZE(rh->kp))
+		return;
+
+	if (!(kp->cipher = strdup(tgt->u.crypt.cipher)))
+		return;
+
+	if (!(kp->params = dm_crypt_key_params(tgt, flags))) {
+		free(kp->cipher);
+		kp->cipher = NULL;
+		return;
+	}
+
+	kp->digest = digest;
+	kp->flags = flags;
+	tgt->u.crypt.key_params = kp->params;
+}
+
 static int reencrypt_make_targets(struct crypt_device *cd,
 				struct luks2_hdr *hdr,
+				struct luks2_reencrypt *rh,
 				struct device *hz_device,
 				struct volume_key *vks,
 				struct dm_target *result,
-				uint64_t size)
+				uint64_t size,
+				uint32_t flags)
 {
 	bool reenc_seg;
 	struct volume_key *vk;
+	int digest;
 	uint64_t segment_size, segment_offset, segment_start = 0;
 	int r;
 	int s = 0;
@@ -1835,7 +2412,8 @@ static int reencrypt_make_targets(struct crypt_device *cd,
 		}
 
 		if (!strcmp(json_segment_type(jobj), "crypt")) {
-			vk = crypt_volume_key_by_id(vks, reenc_seg ? LUKS2_reencrypt_digest_new(hdr) : LUKS2_digest_by_segment(hdr, s));
+			digest = reenc_seg ? LUKS2_reencrypt_digest_new(hdr) : LUKS2_digest_by_segment(hdr, s);
+			vk = crypt_volume_key_by_id(vks, digest);
 			if (!vk) {
 				log_err(cd, _("Missing key for dm-crypt segment %u"), s);
 				return -EINVAL;
@@ -1857,6 +2435,7 @@ static int reencrypt_make_targets(struct crypt_device *cd,
 				log_err(cd, _("Failed to set dm-crypt segment."));
 				return r;
 			}
+			reencrypt_target_key_params(rh, result, digest, flags);
 		} else if (!strcmp(json_segment_type(jobj), "linear")) {
 			r = dm_linear_target_set(result, segment_start, segment_size, reenc_seg ? hz_device : crypt_data_device(cd), segment_offset);
 			if (r) {
@@ -1881,7 +2460,7 @@ static int reencrypt_make_targets(struct crypt_device *cd,
  * 	2) can't we derive hotzone device name from crypt context? (unlocked name, device uuid, etc?)
  */
 static int reencrypt_load_overlay_device(struct crypt_device *cd, struct luks2_hdr *hdr,
-	const char *overlay, const char *hotzone, struct volume_key *vks, uint64_t size,
+	struct luks2_reencrypt *rh, const char *overlay, const char *hotzone, struct volume_key *vks, uint64_t size,
 	uint32_t flags)
 {
 	char hz_path[PATH_MAX];
@@ -1908,7 +2487,7 @@ static int reencrypt_load_overlay_device(struct crypt_device *cd, struct luks2_h
 	if (r)
 		goto out;
 
-	r = reencrypt_make_targets(cd, hdr, hz_dev, vks, &dmd.segment, size);
+	r = reencrypt_make_targets(cd, hdr, rh, hz_dev, vks, &dmd.segment, size, flags);
 	if (r < 0)
 		goto out;
 
@@ -2087,19 +2666,51 @@ static int reencrypt_init_device_stack(struct crypt_device *cd,
 	return 0;
 err:
 	/* TODO: force error helper devices on error path */
-	dm_remove_device(cd, rh->overlay_name, 0);
-	dm_remove_device(cd, rh->hotzone_name, 0);
+	dm_remove_device(cd, rh->overlay_name, DM_DEACTIVATE_PRIVATE);
+	dm_remove_device(cd, rh->hotzone_name, DM_DEACTIVATE_PRIVATE);
 
 	return r;
 }
 
+static uint64_t reencrypt_time_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* account suspend window started at start timestamp */
+static void reencrypt_suspend_account(struct crypt_reencrypt_suspend_stats *st, uint64_t start)
+{
+	uint64_t now = reencrypt_time_ns(), t;
+	int bucket = 0;
+
+	if (!start || now < start)
+		return;
+
+	t = now - start;
+	st->count++;
+	st->total_ns += t;
+	if (t > st->max_ns)
+		st->max_ns = t;
+
+	for (t /= 1000; t && bucket < CRYPT_REENCRYPT_SUSPEND_BUCKETS - 1; t >>= 1)
+		bucket++;
+	st->hist[bucket]++;
+}
+
 /* TODO:
  * 	1) audit error path. any error in this routine is fatal and should be unlikely.
  * 	   usually it would hint some collision with another userspace process touching
  * 	   dm devices directly.
  */
-static int reenc_refresh_helper_devices(struct crypt_device *cd, const char *overlay, const char *hotzone)
+static int reenc_refresh_helper_devices(struct crypt_device *cd, const char *overlay,
+					const char *hotzone, struct luks2_reencrypt *rh)
 {
+	uint64_t t;
 	int r;
 
 	/*
@@ -2108,7 +2719,11 @@ static int reenc_refresh_helper_devices(struct crypt_device *cd, const char *ove
 	 * after suspending the hotzone may lead to deadlock.
 	 *
 	 * In other words: always suspend the stack from top to bottom!
+	 *
+	 * New overlay table is already loaded (inactive), so the overlay
+	 * is suspended only for the table swap.
 	 */
+	t = reencrypt_time_ns();
 	r = dm_suspend_device(cd, overlay, DM_SUSPEND_SKIP_LOCKFS | DM_SUSPEND_NOFLUSH);
 	if (r) {
 		log_err(cd, _("Failed to suspend device %s."), overlay);
@@ -2121,30 +2736,34 @@ static int reenc_refresh_helper_devices(struct crypt_device *cd, const char *ove
 		log_err(cd, _("Failed to suspend device %s."), hotzone);
 		return r;
 	}
+	rh->hotzone_suspended = reencrypt_time_ns();
 
 	/* resume overlay device: inactive table (with hotozne) -> live */
 	r = dm_resume_device(cd, overlay, DM_RESUME_PRIVATE);
 	if (r)
 		log_err(cd, _("Failed to resume device %s."), overlay);
+	else
+		reencrypt_suspend_account(&rh->stats.overlay_suspend, t);
 
 	return r;
 }
 
 static int reencrypt_refresh_overlay_devices(struct crypt_device *cd,
 		struct luks2_hdr *hdr,
+		struct luks2_reencrypt *rh,
 		const char *overlay,
 		const char *hotzone,
 		struct volume_key *vks,
 		uint64_t device_size,
 		uint32_t flags)
 {
-	int r = reencrypt_load_overlay_device(cd, hdr, overlay, hotzone, vks, device_size, flags);
+	int r = reencrypt_load_overlay_device(cd, hdr, rh, overlay, hotzone, vks, device_size, flags);
 	if (r) {
 		log_err(cd, _("Failed to reload device %s."), overlay);
 		return REENC_ERR;
 	}
 
-	r = reenc_refresh_helper_devices(cd, overlay, hotzone);
+	r = reenc_refresh_helper_devices(cd, overlay, hotzone, rh);
 	if (r) {
 		log_err(cd, _("Failed to refresh reencryption devices stack."));
 		return REENC_ROLLBACK;
@@ -2153,55 +2772,95 @@ static int reencrypt_refresh_overlay_devices(struct crypt_device *cd,
 	return REENC_OK;
 }
 
+/* data are moved in chunks to keep memory use bounded */
+#define REENCRYPT_MOVE_CHUNK (1024 * 1024)
+#define REENCRYPT_MOVE_QUEUE_DEPTH 2
+
 static int reencrypt_move_data(struct crypt_device *cd, int devfd, uint64_t data_shift)
 {
-	void *buffer;
-	int r;
+	void *buffer = NULL, *buf;
+	int r = 0;
 	ssize_t ret;
-	uint64_t buffer_len, offset;
+	size_t bsize, alignment, chunk, len;
+	uint64_t offset, pos, moved = 0;
+	struct io_queue *q = NULL;
+	bool backward;
 	struct luks2_hdr *hdr = crypt_get_hdr(cd, CRYPT_LUKS2);
 
 	log_dbg(cd, "Going to move data from head of data device.");
 
-	buffer_len = data_shift;
-	if (!buffer_len)
+	if (!data_shift)
 		return -EINVAL;
 
 	offset = json_segment_get_offset(LUKS2_get_segment_jobj(hdr, 0), 0);
 
 	/* this is nonsense anyway */
-	if (buffer_len != json_segment_get_size(LUKS2_get_segment_jobj(hdr, 0), 0)) {
-		log_dbg(cd, "buffer_len %" PRIu64", segment size %" PRIu64, buffer_len, json_segment_get_size(LUKS2_get_segment_jobj(hdr, 0), 0));
+	if (data_shift != json_segment_get_size(LUKS2_get_segment_jobj(hdr, 0), 0)) {
+		log_dbg(cd, "data_shift %" PRIu64", segment size %" PRIu64, data_shift, json_segment_get_size(LUKS2_get_segment_jobj(hdr, 0), 0));
 		return -EINVAL;
 	}
 
-	if (posix_memalign(&buffer, device_alignment(crypt_data_device(cd)), buffer_len))
+	bsize = device_block_size(cd, crypt_data_device(cd));
+	alignment = device_alignment(crypt_data_device(cd));
+	chunk = data_shift < REENCRYPT_MOVE_CHUNK ? data_shift : REENCRYPT_MOVE_CHUNK;
+
+	/* overlapping areas are moved from the end, not yet read data are never overwritten */
+	backward = offset < data_shift;
+
+	/* with separate areas the next chunk is read while the previous one is written */
+	if (!backward && !MISALIGNED(offset, bsize) && !MISALIGNED(data_shift, bsize) &&
+	    !MISALIGNED(chunk, bsize) &&
+	    !io_queue_init(&q, devfd, alignment, chunk, REENCRYPT_MOVE_QUEUE_DEPTH) &&
+	    io_queue_depth(q) < 2) {
+		io_queue_destroy(q);
+		q = NULL;
+	}
+
+	if (!q && posix_memalign(&buffer, alignment, chunk))
 		return -ENOMEM;
 
-	ret = read_lseek_blockwise(devfd,
-			device_block_size(cd, crypt_data_device(cd)),
-			device_alignment(crypt_data_device(cd)),
-			buffer, buffer_len, 0);
-	if (ret < 0 || (uint64_t)ret != buffer_len) {
-		r = -EIO;
-		goto out;
+	log_dbg(cd, "Going to write %" PRIu64 " bytes at offset %" PRIu64 " in %zu bytes chunks%s.",
+		data_shift, offset, chunk, q ? " (queued)" : backward ? " (backward)" : "");
+
+	while (moved < data_shift) {
+		len = (data_shift - moved) < chunk ? data_shift - moved : chunk;
+		pos = backward ? data_shift - moved - len : moved;
+
+		buf = q ? io_queue_buffer(q) : buffer;
+		if (!buf) {
+			r = -EIO;
+			break;
+		}
+
+		ret = read_lseek_blockwise(devfd, bsize, alignment, buf, len, pos);
+		if (ret < 0 || (size_t)ret != len) {
+			r = -EIO;
+			break;
+		}
+
+		if (q)
+			r = io_queue_write(q, buf, len, offset + pos);
+		else {
+			ret = write_lseek_blockwise(devfd, bsize, alignment, buf, len, offset + pos);
+			if (ret < 0 || (size_t)ret != len)
+				r = -EIO;
+		}
+		if (r)
+			break;
+
+		moved += len;
+		log_dbg(cd, "Moved %" PRIu64 " of %" PRIu64 " bytes.", moved, data_shift);
 	}
 
-	log_dbg(cd, "Going to write %" PRIu64 " bytes at offset %" PRIu64, buffer_len, offset);
-	ret = write_lseek_blockwise(devfd,
-			device_block_size(cd, crypt_data_device(cd)),
-			device_alignment(crypt_data_device(cd)),
-			buffer, buffer_len, offset);
-	if (ret < 0 || (uint64_t)ret != buffer_len) {
+	if (q && io_queue_flush(q) && !r)
 		r = -EIO;
-		goto out;
-	}
 
-	r = 0;
-out:
-	memset(buffer, 0, buffer_len);
-	free(buffer);
-	return r;
+	io_queue_destroy(q);
+	if (buffer) {
+		memset(buffer, 0, chunk);
+		free(buffer);
+	}
+	return r ? -EIO : 0;
 }
 
 static int reencrypt_make_backup_segments(struct crypt_device *cd,
@@ -2525,77 +3184,142 @@ out:
 	return r;
 }
 
-static int reencrypt_hotzone_protect_final(struct crypt_device *cd,
-	struct luks2_hdr *hdr, struct luks2_reencrypt *rh,
-	const void *buffer, size_t buffer_len)
+/*
+ * Old hotzone data is written after journal header block (O_DIRECT if device
+ * supports it), header identifies the hotzone. Both are synced before
+ * the metadata commit marks hotzone in reencryption.
+ */
+static int reencrypt_journal_store(struct crypt_device *cd, struct luks2_reencrypt *rh,
+				   const void *buffer, size_t buffer_len)
 {
-	const void *pbuffer;
-	size_t data_offset, len;
-	int r;
+	struct device *device = rh->rp.p.journal.device;
+	struct reenc_journal_hdr *jhdr = NULL;
+	int devfd, r = -EIO;
 
-	if (rh->rp.type == REENC_PROTECTION_NONE)
-		return 0;
+	if ((uint64_t)buffer_len > rh->rp.p.journal.size)
+		return -EINVAL;
+
+	if (posix_memalign((void **)&jhdr, device_alignment(device), REENC_JOURNAL_HDR_SIZE))
+		return -ENOMEM;
+	memset(jhdr, 0, REENC_JOURNAL_HDR_SIZE);
+	memcpy(jhdr->magic, REENC_JOURNAL_MAGIC, sizeof(jhdr->magic));
+	strncpy(jhdr->uuid, crypt_get_uuid(cd) ?: "", sizeof(jhdr->uuid) - 1);
+	jhdr->offset = cpu_to_be64(rh->offset);
+	jhdr->length = cpu_to_be64(buffer_len);
+
+	devfd = device_open(cd, device, O_RDWR);
+	if (devfd < 0)
+		goto out;
+
+	if (write_lseek_blockwise(devfd, device_block_size(cd, device), device_alignment(device),
+				  CONST_CAST(void *)buffer, buffer_len, REENC_JOURNAL_HDR_SIZE) < 0 ||
+	    write_lseek_blockwise(devfd, device_block_size(cd, device), device_alignment(device),
+				  jhdr, REENC_JOURNAL_HDR_SIZE, 0) < 0)
+		goto out;
+
+	/* device cache flush, O_DIRECT alone is not enough */
+	r = fsync(devfd) ? -EIO : 0;
+out:
+	if (r)
+		log_err(cd, _("IO error while writing reencryption journal to %s."), device_path(device));
+	free(jhdr);
+	return r;
+}
+
+static int reencrypt_hotzone_protect_final(struct crypt_device *cd,
+	struct luks2_hdr *hdr, struct luks2_reencrypt *rh,
+	const void *buffer, size_t buffer_len)
+{
+	const void *pbuffer;
+	size_t blocks, len;
+	int r;
+
+	if (rh->rp.type == REENC_PROTECTION_NONE)
+		return 0;
 
 	if (rh->rp.type == REENC_PROTECTION_CHECKSUM) {
 		log_dbg(cd, "Checksums hotzone resilience.");
 
-		for (data_offset = 0, len = 0; data_offset < buffer_len; data_offset += rh->alignment, len += rh->rp.p.csum.hash_size) {
-			if (crypt_hash_write(rh->rp.p.csum.ch, (const char *)buffer + data_offset, rh->alignment)) {
-				log_dbg(cd, "Failed to hash sector at offset %zu.", data_offset);
-				return -EINVAL;
-			}
-			if (crypt_hash_final(rh->rp.p.csum.ch, (char *)rh->rp.p.csum.checksums + len, rh->rp.p.csum.hash_size)) {
-				log_dbg(cd, "Failed to finalize hash.");
-				return -EINVAL;
-			}
-		}
+		blocks = (buffer_len + rh->alignment - 1) / rh->alignment;
+		if (reencrypt_checksums(cd, rh, buffer, blocks, rh->rp.p.csum.checksums))
+			return -EINVAL;
+		len = blocks * rh->rp.p.csum.hash_size;
 		pbuffer = rh->rp.p.csum.checksums;
+	} else if (rh->rp.type == REENC_PROTECTION_JOURNAL && rh->rp.p.journal.device) {
+		log_dbg(cd, "Journal hotzone resilience (journal device).");
+		r = reencrypt_journal_store(cd, rh, buffer, buffer_len);
+		if (r < 0)
+			return r;
+		rh->stats.resilience_bytes += buffer_len;
+		return LUKS2_hdr_write_segments(cd, hdr);
 	} else if (rh->rp.type == REENC_PROTECTION_JOURNAL) {
 		log_dbg(cd, "Journal hotzone resilience.");
 		len = buffer_len;
 		pbuffer = buffer;
 	} else if (rh->rp.type == REENC_PROTECTION_DATASHIFT) {
 		log_dbg(cd, "Data shift hotzone resilience.");
-		return LUKS2_hdr_write(cd, hdr);
+		return LUKS2_hdr_write_segments(cd, hdr);
 	} else
 		return -EINVAL;
 
 	log_dbg(cd, "Going to store %zu bytes in reencrypt keyslot.", len);
 
 	r = LUKS2_keyslot_reencrypt_store(cd, hdr, rh->reenc_keyslot, pbuffer, len);
+	if (r > 0)
+		rh->stats.resilience_bytes += len;
 
 	return r > 0 ? 0 : r;
 }
 
-static int reencrypt_context_update(struct crypt_device *cd,
-	struct luks2_reencrypt *rh)
+/*
+ * calculates next hotzone window after 'read' bytes of current hotzone were processed,
+ * with adaptive hotzone size the planned length is used instead of the current one
+ */
+static int reencrypt_next_hotzone(struct luks2_reencrypt *rh, uint64_t read,
+	uint64_t *offset, uint64_t *length)
 {
-	if (rh->read < 0)
-		return -EINVAL;
+	uint64_t off = rh->offset, len = rh->ad.enabled ? rh->ad.length : rh->length;
 
 	if (rh->direction == CRYPT_REENCRYPT_BACKWARD) {
 		if (rh->data_shift && rh->mode == CRYPT_REENCRYPT_ENCRYPT) {
-			if (rh->offset)
-				rh->offset -= rh->data_shift;
-			if (rh->offset && (rh->offset < rh->data_shift)) {
-				rh->length = rh->offset;
-				rh->offset = rh->data_shift;
+			if (off)
+				off -= rh->data_shift;
+			if (off && (off < rh->data_shift)) {
+				len = off;
+				off = rh->data_shift;
 			}
-			if (!rh->offset)
-				rh->length = rh->data_shift;
+			if (!off)
+				len = rh->data_shift;
 		} else {
-			if (rh->offset < rh->length)
-				rh->length = rh->offset;
-			rh->offset -= rh->length;
+			if (off < len)
+				len = off;
+			off -= len;
 		}
 	} else if (rh->direction == CRYPT_REENCRYPT_FORWARD) {
-		rh->offset += (uint64_t)rh->read;
-		/* it fails in-case of device_size < rh->offset later */
-		if (rh->device_size - rh->offset < rh->length)
-			rh->length = rh->device_size - rh->offset;
+		off += read;
+		/* it fails in-case of device_size < offset later */
+		if (rh->device_size < off)
+			len = 0;
+		else if (rh->device_size - off < len)
+			len = rh->device_size - off;
 	} else
 		return -EINVAL;
 
+	*offset = off;
+	*length = len;
+
+	return 0;
+}
+
+static int reencrypt_context_update(struct crypt_device *cd,
+	struct luks2_reencrypt *rh)
+{
+	if (rh->read < 0)
+		return -EINVAL;
+
+	if (reencrypt_next_hotzone(rh, (uint64_t)rh->read, &rh->offset, &rh->length))
+		return -EINVAL;
+
 	if (rh->device_size < rh->offset) {
 		log_dbg(cd, "Calculated reencryption offset %" PRIu64 " is beyond device size %" PRIu64 ".", rh->offset, rh->device_size);
 		return -EINVAL;
@@ -2606,6 +3330,409 @@ static int reencrypt_context_update(struct crypt_device *cd,
 	return 0;
 }
 
+static uint64_t reencrypt_adapt_length(struct luks2_reencrypt *rh, uint64_t length)
+{
+	length -= length % rh->alignment;
+
+	if (length < rh->ad.length_min)
+		length = rh->ad.length_min;
+	if (length > rh->ad.length_max)
+		length = rh->ad.length_max;
+
+	return length;
+}
+
+/* only plans the length, next hotzone window is clamped in reencrypt_next_hotzone() */
+static void reencrypt_adapt_set_length(struct crypt_device *cd, struct luks2_reencrypt *rh, uint64_t length)
+{
+	if (length == rh->ad.length)
+		return;
+
+	log_dbg(cd, "Adjusting reencryption hotzone size from %" PRIu64 " to %" PRIu64 " bytes.", rh->ad.length, length);
+	rh->ad.length = length;
+}
+
+/*
+ * Adaptive hotzone size for online reencryption.
+ *
+ * The hotzone starts small and doubles while measured reencryption throughput
+ * keeps improving. It is halved whenever the average latency of I/O
+ * submitted to the active device (taken from sysfs stat) rises well above
+ * the lowest observed value or when growing the hotzone did not pay off.
+ *
+ * The hotzone never exceeds the initial length, so buffers and resilience
+ * area limits are kept intact. The actual length is stored in the reencrypt
+ * segment with each step so crash recovery needs no extra metadata.
+ */
+static void reencrypt_adapt_init(struct crypt_device *cd, struct luks2_reencrypt *rh)
+{
+	uint64_t length;
+
+	if (!rh->ad.enabled)
+		return;
+
+	if (!rh->online || !rh->device_name ||
+	    snprintf(rh->ad.dev_path, sizeof(rh->ad.dev_path), "%s/%s", dm_get_dir(), rh->device_name) < 0 ||
+	    crypt_dev_io_stats(rh->ad.dev_path, &rh->ad.ios, &rh->ad.ticks)) {
+		log_dbg(cd, "Adaptive hotzone size not available.");
+		rh->ad.enabled = false;
+		return;
+	}
+
+	log_dbg(cd, "Using adaptive hotzone size (%" PRIu64 " - %" PRIu64 " bytes).",
+		rh->ad.length_min, rh->ad.length_max);
+
+	rh->ad.length = rh->ad.length_max;
+	length = reencrypt_adapt_length(rh, rh->ad.length_min);
+	reencrypt_adapt_set_length(cd, rh, length);
+
+	/* first hotzone (possibly already clamped to device end) shrinks too */
+	if (length >= rh->length)
+		return;
+
+	/* backward direction moves offset so that hotzone end is kept */
+	if (rh->direction == CRYPT_REENCRYPT_BACKWARD)
+		rh->offset += rh->length - length;
+	rh->length = length;
+}
+
+static void reencrypt_adapt_update(struct crypt_device *cd, struct luks2_reencrypt *rh, uint64_t usec)
+{
+	uint64_t ios, ticks, throughput, latency = 0, length = rh->ad.length;
+	bool latency_valid = false;
+
+	if (!rh->ad.enabled || rh->read <= 0 || !usec)
+		return;
+
+	throughput = (uint64_t)rh->read * 1000000 / usec;
+
+	if (!crypt_dev_io_stats(rh->ad.dev_path, &ios, &ticks)) {
+		if (ios >= rh->ad.ios + REENC_ADAPT_IOS_MIN && ticks >= rh->ad.ticks) {
+			latency = (ticks - rh->ad.ticks) * 1000 / (ios - rh->ad.ios);
+			latency_valid = true;
+		}
+		rh->ad.ios = ios;
+		rh->ad.ticks = ticks;
+	}
+
+	if (latency_valid && (!rh->ad.latency_min || latency < rh->ad.latency_min))
+		rh->ad.latency_min = latency;
+
+	log_dbg(cd, "Hotzone throughput %" PRIu64 " B/s, device latency %" PRIu64 " us (min %" PRIu64 " us).",
+		throughput, latency, rh->ad.latency_min);
+
+	if (latency_valid && latency > 2 * rh->ad.latency_min &&
+	    latency > rh->ad.latency_min + REENC_ADAPT_LATENCY_SLACK_US) {
+		length /= 2;
+		rh->ad.grown = false;
+	} else if (!rh->ad.throughput || throughput > rh->ad.throughput + rh->ad.throughput / 20) {
+		length *= 2;
+		rh->ad.grown = true;
+	} else if (rh->ad.grown && throughput < rh->ad.throughput - rh->ad.throughput / 10) {
+		length /= 2;
+		rh->ad.grown = false;
+	}
+
+	rh->ad.throughput = throughput;
+	reencrypt_adapt_set_length(cd, rh, reencrypt_adapt_length(rh, length));
+}
+
+/* add time elapsed since *t to phase counter and restart measurement */
+static void reencrypt_stats_phase(uint64_t *counter, uint64_t *t, const char *phase)
+{
+	uint64_t now = reencrypt_time_ns();
+
+	if (counter && *t && now > *t) {
+		*counter += now - *t;
+		TRACE2(reencrypt__phase, phase, now - *t);
+	}
+	*t = now;
+}
+
+static void reencrypt_stats_dump(struct crypt_device *cd, const struct crypt_reencrypt_stats *st)
+{
+	log_dbg(cd, "Reencryption statistics (%" PRIu64 " hotzones, ms): read %" PRIu64 " (%" PRIu64 " bytes), "
+		"resilience %" PRIu64 " (%" PRIu64 " bytes), decrypt %" PRIu64 ", encrypt %" PRIu64 ", "
+		"write %" PRIu64 " (%" PRIu64 " bytes), datasync %" PRIu64 ", metadata %" PRIu64 ", dm %" PRIu64 ".",
+		st->hotzones, st->read_ns / 1000000, st->read_bytes,
+		st->resilience_ns / 1000000, st->resilience_bytes,
+		st->decrypt_ns / 1000000, st->encrypt_ns / 1000000,
+		st->write_ns / 1000000, st->write_bytes,
+		st->datasync_ns / 1000000, st->metadata_ns / 1000000, st->dm_ns / 1000000);
+
+	if (st->overlay_suspend.count || st->hotzone_suspend.count)
+		log_dbg(cd, "Suspend windows (us): overlay %" PRIu64 " times, total %" PRIu64 ", max %" PRIu64 "; "
+			"hotzone %" PRIu64 " times, total %" PRIu64 ", max %" PRIu64 ".",
+			st->overlay_suspend.count, st->overlay_suspend.total_ns / 1000,
+			st->overlay_suspend.max_ns / 1000,
+			st->hotzone_suspend.count, st->hotzone_suspend.total_ns / 1000,
+			st->hotzone_suspend.max_ns / 1000);
+}
+
+/*
+ * Token bucket between hotzones. Each hotzone costs read bytes and two I/O
+ * operations (hotzone read and write). Up to REENC_RATE_BURST_NS of unused
+ * budget can be consumed at once, then the loop sleeps until the budget
+ * of the just processed hotzone is refilled.
+ */
+static void reencrypt_rate_limit(struct crypt_device *cd, struct luks2_reencrypt *rh)
+{
+	uint64_t now, cost = 0, tmp;
+	struct timespec ts;
+
+	if ((!rh->rate.max_throughput && !rh->rate.max_iops) || rh->read <= 0)
+		return;
+
+	if (!(now = reencrypt_time_ns()))
+		return;
+
+	if (rh->rate.max_throughput)
+		cost = (uint64_t)rh->read * 1000000000 / rh->rate.max_throughput;
+	if (rh->rate.max_iops) {
+		tmp = 2 * (uint64_t)1000000000 / rh->rate.max_iops;
+		if (tmp > cost)
+			cost = tmp;
+	}
+
+	if (rh->rate.tat + REENC_RATE_BURST_NS < now)
+		rh->rate.tat = now - REENC_RATE_BURST_NS;
+	rh->rate.tat += cost;
+
+	if (rh->rate.tat <= now)
+		return;
+
+	tmp = rh->rate.tat - now;
+	log_dbg(cd, "Rate limit reached, sleeping %" PRIu64 " ms.", tmp / 1000000);
+
+	ts.tv_sec = tmp / 1000000000;
+	ts.tv_nsec = tmp % 1000000000;
+	/* interrupted sleep is fine, signal is handled in progress callback */
+	nanosleep(&ts, NULL);
+}
+
+/*
+ * Encryption only: hotzones not allocated in the backing file (holes) are
+ * left as they are instead of being encrypted. The data device is expected
+ * to be unused in these areas, reading them through the encrypted device
+ * returns garbage, not zeroes. Allocated areas, even if zero-filled, are
+ * always encrypted so their plaintext is preserved. There is no allocation
+ * query for block devices, nothing is skipped there.
+ */
+static void reencrypt_skip_init(struct crypt_device *cd, struct luks2_hdr *hdr,
+	struct luks2_reencrypt *rh)
+{
+	struct device *device = crypt_data_device(cd);
+	struct stat st;
+
+	if (!rh->sk.enabled || rh->sk.devfd >= 0)
+		return;
+
+	log_dbg(cd, "Skipping encryption of unallocated areas.");
+
+	rh->sk.data_offset = reencrypt_get_data_offset_old(hdr);
+	if (stat(device_path(device), &st) < 0 || !S_ISREG(st.st_mode))
+		return;
+
+	/* private fd, SEEK_DATA moves file position */
+	rh->sk.devfd = open(device_path(device), O_RDONLY | O_CLOEXEC);
+	if (rh->sk.devfd < 0)
+		log_dbg(cd, "Failed to open %s for allocation query.", device_path(device));
+}
+
+static bool reencrypt_area_is_hole(struct luks2_reencrypt *rh, uint64_t offset, uint64_t length)
+{
+	off_t start = rh->sk.data_offset + offset, data;
+
+	if (!rh->sk.enabled || rh->sk.devfd < 0)
+		return false;
+
+	data = lseek(rh->sk.devfd, start, SEEK_DATA);
+	if (data < 0)
+		return errno == ENXIO;
+
+	return (uint64_t)data >= start + length;
+}
+
+static void *reencrypt_prefetch_thread(void *arg)
+{
+	struct luks2_reencrypt *rh = arg;
+
+	crypt_numa_bind_thread(rh->numa_node);
+
+	/* same as crypt_storage_wrapper_read() but with private fd (file position) */
+	rh->pf.read = read_lseek_blockwise(rh->pf.devfd, rh->pf.block_size, rh->pf.alignment,
+			rh->pf.buffer, rh->pf.length, rh->pf.data_offset + rh->pf.offset);
+
+	return NULL;
+}
+
+/*
+ * Pipelined mode: read next hotzone while current one is being processed.
+ *
+ * Used only in offline mode without data shift. The device is opened exclusively
+ * and the next hotzone never overlaps the current one, so the prefetched data
+ * are identical to what the next step would read itself. The resilience
+ * and metadata commit ordering is not affected.
+ */
+static void reencrypt_prefetch_init(struct crypt_device *cd, struct luks2_hdr *hdr,
+	struct luks2_reencrypt *rh)
+{
+	uint64_t soft_mem_limit;
+	size_t len = rh->reenc_buffer_size;
+	struct device *device = crypt_data_device(cd);
+
+	if (rh->online || rh->data_shift || rh->pf.buffer)
+		return;
+
+	/* both hotzone buffers must fit in the 1/4 of system memory soft limit */
+	soft_mem_limit = crypt_getphysmemory_kb() << 8;
+	if (soft_mem_limit && 2 * len > soft_mem_limit) {
+		log_dbg(cd, "Not enough memory for hotzone read-ahead buffer.");
+		return;
+	}
+
+	rh->pf.block_size = device_block_size(cd, device);
+	rh->pf.alignment = device_alignment(device);
+	rh->pf.data_offset = reencrypt_get_data_offset_old(hdr);
+	if (!rh->pf.block_size || !rh->pf.alignment)
+		return;
+
+	if (!(rh->pf.buffer = reencrypt_buffer_alloc(cd, len, rh->pf.alignment, rh->numa_node))) {
+		log_dbg(cd, "Failed to allocate hotzone read-ahead buffer.");
+		return;
+	}
+
+	/* the metadata code may share cached device fds, read-ahead must not move their position */
+	rh->pf.devfd = open(device_path(device), O_RDONLY | O_CLOEXEC | (device_direct_io(device) ? O_DIRECT : 0));
+	if (rh->pf.devfd < 0) {
+		log_dbg(cd, "Failed to open device %s for hotzone read-ahead.", device_path(device));
+		reencrypt_buffer_free(rh->pf.buffer, len);
+		rh->pf.buffer = NULL;
+		return;
+	}
+
+	log_dbg(cd, "Using pipelined hotzone read-ahead (%zu bytes).", len);
+}
+
+static void reencrypt_prefetch_start(struct crypt_device *cd, struct luks2_reencrypt *rh)
+{
+	uint64_t offset, length;
+
+	if (!rh->pf.buffer || rh->pf.active || rh->read <= 0)
+		return;
+
+	if (rh->device_size <= rh->progress + (uint64_t)rh->read)
+		return;
+
+	if (reencrypt_next_hotzone(rh, (uint64_t)rh->read, &offset, &length) ||
+	    !length || offset > rh->device_size)
+		return;
+
+	/* holes are not read at all */
+	if (reencrypt_area_is_hole(rh, offset, length))
+		return;
+
+	rh->pf.offset = offset;
+	rh->pf.length = length;
+	rh->pf.read = -EINVAL;
+
+	if (pthread_create(&rh->pf.thread, NULL, reencrypt_prefetch_thread, rh)) {
+		log_dbg(cd, "Failed to start hotzone read-ahead thread.");
+		return;
+	}
+
+	rh->pf.active = true;
+}
+
+/*
+ * Rotational devices: announce the next hotzone to the kernel once the current
+ * one is read. Backward reencryption reads in descending order and that is never
+ * detected by kernel read-ahead. Not needed while pipelined read-ahead runs.
+ *
+ * In online mode the area is still written through the active device, cached
+ * pages could become stale, hints are used only if hotzone is read with direct-io.
+ */
+static void reencrypt_hint_readahead(struct crypt_device *cd, struct luks2_reencrypt *rh)
+{
+	uint64_t offset, length;
+
+	if (!rh->io.enabled || rh->read <= 0)
+		return;
+
+	if (rh->online && !device_direct_io(crypt_data_device(cd)))
+		return;
+
+	/* current hotzone is in buffer, do not keep it in page cache */
+	crypt_storage_wrapper_advise(rh->cw1, rh->offset, rh->read, POSIX_FADV_DONTNEED);
+
+	if (rh->pf.active || rh->device_size <= rh->progress + (uint64_t)rh->read)
+		return;
+
+	if (reencrypt_next_hotzone(rh, (uint64_t)rh->read, &offset, &length) ||
+	    !length || offset > rh->device_size)
+		return;
+
+	crypt_storage_wrapper_advise(rh->cw1, offset, length, POSIX_FADV_WILLNEED);
+}
+
+/*
+ * Without resilience data are not synced after each hotzone. Start writeback
+ * of the hotzone just written and wait for the previous one, so dirty data
+ * never exceed two hotzones and the device is not flooded by one huge flush.
+ */
+static void reencrypt_hint_writeback(struct luks2_reencrypt *rh)
+{
+	if (!rh->io.enabled || rh->rp.type != REENC_PROTECTION_NONE || rh->read <= 0)
+		return;
+
+	crypt_storage_wrapper_writeback(rh->cw2, rh->offset, rh->read, false);
+	if (rh->io.wb_length)
+		crypt_storage_wrapper_writeback(rh->cw2, rh->io.wb_offset, rh->io.wb_length, true);
+
+	rh->io.wb_offset = rh->offset;
+	rh->io.wb_length = rh->read;
+}
+
+static bool reencrypt_hotzone_skip(struct crypt_device *cd, struct luks2_reencrypt *rh)
+{
+	if (!rh->sk.hole || rh->read <= 0)
+		return false;
+
+	rh->sk.skipped += rh->read;
+	log_dbg(cd, "Hotzone at offset %" PRIu64 " is unallocated, skipping (%" PRIu64 " bytes skipped so far).",
+		rh->offset, rh->sk.skipped);
+
+	return true;
+}
+
+static ssize_t reencrypt_hotzone_read(struct crypt_device *cd, struct luks2_reencrypt *rh)
+{
+	void *tmp;
+
+	rh->sk.hole = reencrypt_area_is_hole(rh, rh->offset, rh->length);
+	if (rh->sk.hole) {
+		/* read-ahead of this hotzone (if any) is not needed */
+		reencrypt_prefetch_wait(rh);
+		log_dbg(cd, "Hotzone at offset %" PRIu64 " is a hole, not reading it.", rh->offset);
+		memset(rh->reenc_buffer, 0, rh->length);
+		return rh->length;
+	}
+
+	if (rh->pf.active) {
+		reencrypt_prefetch_wait(rh);
+		if (rh->pf.offset == rh->offset && rh->pf.length == rh->length && rh->pf.read >= 0) {
+			log_dbg(cd, "Using prefetched hotzone data at offset %" PRIu64 ".", rh->offset);
+			tmp = rh->reenc_buffer;
+			rh->reenc_buffer = rh->pf.buffer;
+			rh->pf.buffer = tmp;
+			return rh->pf.read;
+		}
+		log_dbg(cd, "Hotzone read-ahead mismatch, reading hotzone again.");
+	}
+
+	return crypt_storage_wrapper_read(rh->cw1, rh->offset, rh->reenc_buffer, rh->length);
+}
+
 static int reencrypt_load(struct crypt_device *cd, struct luks2_hdr *hdr,
 		uint64_t device_size,
 		const struct crypt_params_reencrypt *params,
@@ -2685,10 +3812,16 @@ int LUKS2_reencrypt_lock_by_dm_uuid(struct crypt_device *cd, const char *dm_uuid
 /* internal only */
 int LUKS2_reencrypt_lock(struct crypt_device *cd, struct crypt_lock_handle **reencrypt_lock)
 {
+	const char *uuid;
+
 	if (!cd || !crypt_get_type(cd) || strcmp(crypt_get_type(cd), CRYPT_LUKS2))
 		return -EINVAL;
 
-	return reencrypt_lock_internal(cd, crypt_get_uuid(cd), reencrypt_lock);
+	/* also loads header postponed in crypt_init_by_name_flags() */
+	if (!(uuid = crypt_get_uuid(cd)))
+		return -EINVAL;
+
+	return reencrypt_lock_internal(cd, uuid, reencrypt_lock);
 }
 
 /* internal only */
@@ -2966,6 +4099,29 @@ static int reencrypt_recovery_by_passphrase(struct crypt_device *cd,
 	return r;
 }
 
+/*
+ * Releases without crc32c support can neither resume nor recover such
+ * reencryption, switching the checksum hash to crc32c must be explicit.
+ */
+static int reencrypt_check_crc32c(struct crypt_device *cd, struct luks2_hdr *hdr,
+	const struct crypt_params_reencrypt *params)
+{
+	const char *hash;
+
+	if (!params || !params->resilience || strcmp(params->resilience, "checksum") ||
+	    !params->hash || strcmp(params->hash, REENC_CSUM_CRC32C) ||
+	    (params->flags & CRYPT_REENCRYPT_ALLOW_CRC32C))
+		return 0;
+
+	/* already used in metadata */
+	hash = reencrypt_resilience_hash(hdr);
+	if (hash && !strcmp(hash, REENC_CSUM_CRC32C))
+		return 0;
+
+	log_err(cd, _("Resilience hash crc32c is not compatible with older releases and must be explicitly allowed."));
+	return -EINVAL;
+}
+
 static int reencrypt_init_by_passphrase(struct crypt_device *cd,
 	const char *name,
 	const char *passphrase,
@@ -2986,6 +4142,10 @@ static int reencrypt_init_by_passphrase(struct crypt_device *cd,
 	if (flags & CRYPT_REENCRYPT_RECOVERY)
 		return reencrypt_recovery_by_passphrase(cd, hdr, keyslot_old, keyslot_new, passphrase, passphrase_size);
 
+	r = reencrypt_check_crc32c(cd, hdr, params);
+	if (r < 0)
+		return r;
+
 	if (cipher && !crypt_cipher_wrapped_key(cipher, cipher_mode)) {
 		r = crypt_keyslot_get_key_size(cd, keyslot_new);
 		if (r < 0)
@@ -3051,13 +4211,15 @@ int crypt_reencrypt_init_by_keyring(struct crypt_device *cd,
 	if (params && (params->flags & CRYPT_REENCRYPT_INITIALIZE_ONLY) && (params->flags & CRYPT_REENCRYPT_RESUME_ONLY))
 		return -EINVAL;
 
-	r = keyring_get_passphrase(passphrase_description, &passphrase, &passphrase_size);
+	r = keyring_cache_get_passphrase(crypt_keyring_cache(cd), passphrase_description, &passphrase, &passphrase_size);
 	if (r < 0) {
 		log_err(cd, _("Failed to read passphrase from keyring (error %d)."), r);
 		return -EINVAL;
 	}
 
+	crypt_volume_key_handoff_enable(cd, true);
 	r = reencrypt_init_by_passphrase(cd, name, passphrase, passphrase_size, keyslot_old, keyslot_new, cipher, cipher_mode, params);
+	crypt_volume_key_handoff_enable(cd, false);
 
 	crypt_safe_memzero(passphrase, passphrase_size);
 	free(passphrase);
@@ -3075,12 +4237,37 @@ int crypt_reencrypt_init_by_passphrase(struct crypt_device *cd,
 	const char *cipher_mode,
 	const struct crypt_params_reencrypt *params)
 {
+	int r;
+
 	if (onlyLUKS2mask(cd, CRYPT_REQUIREMENT_ONLINE_REENCRYPT) || !passphrase)
 		return -EINVAL;
 	if (params && (params->flags & CRYPT_REENCRYPT_INITIALIZE_ONLY) && (params->flags & CRYPT_REENCRYPT_RESUME_ONLY))
 		return -EINVAL;
 
-	return reencrypt_init_by_passphrase(cd, name, passphrase, passphrase_size, keyslot_old, keyslot_new, cipher, cipher_mode, params);
+	crypt_volume_key_handoff_enable(cd, true);
+	r = reencrypt_init_by_passphrase(cd, name, passphrase, passphrase_size, keyslot_old, keyslot_new, cipher, cipher_mode, params);
+	crypt_volume_key_handoff_enable(cd, false);
+
+	return r;
+}
+
+/*
+ * With "none" resilience metadata is written only when reencryption stops.
+ * Optional periodic commit bounds the area left in unknown state after crash.
+ */
+static bool reencrypt_commit_due(struct luks2_reencrypt *rh, uint64_t now)
+{
+	if (rh->rp.type != REENC_PROTECTION_NONE || (!rh->commit.bytes && !rh->commit.ns))
+		return false;
+
+	rh->commit.pending += rh->read;
+	if (!rh->commit.last)
+		rh->commit.last = now;
+
+	if (rh->commit.bytes && rh->commit.pending >= rh->commit.bytes)
+		return true;
+
+	return rh->commit.ns && now >= rh->commit.last + rh->commit.ns;
 }
 
 static reenc_status_t reencrypt_step(struct crypt_device *cd,
@@ -3090,6 +4277,8 @@ static reenc_status_t reencrypt_step(struct crypt_device *cd,
 		bool online)
 {
 	int r;
+	bool commit;
+	uint64_t t = reencrypt_time_ns();
 
 	/* update reencrypt keyslot protection parameters in memory only */
 	r = reencrypt_keyslot_update(cd, rh);
@@ -3108,12 +4297,14 @@ static reenc_status_t reencrypt_step(struct crypt_device *cd,
 		log_err(cd, _("Failed to set device segments for next reencryption hotzone."));
 		return REENC_ERR;
 	}
+	reencrypt_stats_phase(&rh->stats.metadata_ns, &t, "metadata");
 
 	if (online) {
-		r = reencrypt_refresh_overlay_devices(cd, hdr, rh->overlay_name, rh->hotzone_name, rh->vks, rh->device_size, rh->flags);
+		r = reencrypt_refresh_overlay_devices(cd, hdr, rh, rh->overlay_name, rh->hotzone_name, rh->vks, rh->device_size, rh->flags);
 		/* Teardown overlay devices with dm-error. None bio shall pass! */
 		if (r != REENC_OK)
 			return r;
+		reencrypt_stats_phase(&rh->stats.dm_ns, &t, "dm");
 	}
 
 	log_dbg(cd, "Reencrypting chunk starting at offset: %" PRIu64 ", size :%" PRIu64 ".", rh->offset, rh->length);
@@ -3136,12 +4327,19 @@ static reenc_status_t reencrypt_step(struct crypt_device *cd,
 		}
 	}
 
-	rh->read = crypt_storage_wrapper_read(rh->cw1, rh->offset, rh->reenc_buffer, rh->length);
+	reencrypt_stats_phase(NULL, &t, NULL);
+	rh->read = reencrypt_hotzone_read(cd, rh);
 	if (rh->read < 0) {
 		/* severity normal */
 		log_err(cd, _("Failed to read hotzone area starting at %" PRIu64 "."), rh->offset);
 		return REENC_ROLLBACK;
 	}
+	reencrypt_stats_phase(&rh->stats.read_ns, &t, "read");
+	rh->stats.read_bytes += rh->read;
+
+	/* read next hotzone in parallel (no-op unless in pipelined mode) */
+	reencrypt_prefetch_start(cd, rh);
+	reencrypt_hint_readahead(cd, rh);
 
 	/* metadata commit point */
 	r = reencrypt_hotzone_protect_final(cd, hdr, rh, rh->reenc_buffer, rh->read);
@@ -3150,6 +4348,10 @@ static reenc_status_t reencrypt_step(struct crypt_device *cd,
 		log_err(cd, _("Failed to write reencryption resilience metadata."));
 		return REENC_ROLLBACK;
 	}
+	reencrypt_stats_phase(&rh->stats.resilience_ns, &t, "resilience");
+
+	if (reencrypt_hotzone_skip(cd, rh))
+		goto commit;
 
 	r = crypt_storage_wrapper_decrypt(rh->cw1, rh->offset, rh->reenc_buffer, rh->read);
 	if (r) {
@@ -3157,24 +4359,53 @@ static reenc_status_t reencrypt_step(struct crypt_device *cd,
 		log_err(cd, _("Decryption failed."));
 		return REENC_ROLLBACK;
 	}
-	if (rh->read != crypt_storage_wrapper_encrypt_write(rh->cw2, rh->offset, rh->reenc_buffer, rh->read)) {
+	reencrypt_stats_phase(&rh->stats.decrypt_ns, &t, "decrypt");
+
+	/* dm-crypt wrapper encrypts on write, it is accounted as write only */
+	if (crypt_storage_wrapper_get_type(rh->cw2) != DMCRYPT) {
+		if (crypt_storage_wrapper_encrypt(rh->cw2, rh->offset, rh->reenc_buffer, rh->read)) {
+			/* severity normal */
+			log_err(cd, _("Encryption failed."));
+			return REENC_ROLLBACK;
+		}
+		reencrypt_stats_phase(&rh->stats.encrypt_ns, &t, "encrypt");
+		r = crypt_storage_wrapper_write(rh->cw2, rh->offset, rh->reenc_buffer, rh->read);
+	} else
+		r = crypt_storage_wrapper_encrypt_write(rh->cw2, rh->offset, rh->reenc_buffer, rh->read);
+
+	if (rh->read != r) {
 		/* severity fatal */
 		log_err(cd, _("Failed to write hotzone area starting at %" PRIu64 "."), rh->offset);
 		return REENC_FATAL;
 	}
+	reencrypt_stats_phase(&rh->stats.write_ns, &t, "write");
+	rh->stats.write_bytes += rh->read;
+	reencrypt_hint_writeback(rh);
 
 	if (rh->rp.type != REENC_PROTECTION_NONE && crypt_storage_wrapper_datasync(rh->cw2)) {
 		log_err(cd, _("Failed to sync data."));
 		return REENC_FATAL;
 	}
+	reencrypt_stats_phase(&rh->stats.datasync_ns, &t, "datasync");
+commit:
+	commit = reencrypt_commit_due(rh, t);
+	if (commit && crypt_storage_wrapper_datasync(rh->cw2)) {
+		log_err(cd, _("Failed to sync data."));
+		return REENC_FATAL;
+	}
 
 	/* metadata commit safe point */
-	r = reencrypt_assign_segments(cd, hdr, rh, 0, rh->rp.type != REENC_PROTECTION_NONE);
+	r = reencrypt_assign_segments(cd, hdr, rh, 0, rh->rp.type != REENC_PROTECTION_NONE || commit);
 	if (r) {
 		/* severity fatal */
 		log_err(cd, _("Failed to update metadata after current reencryption hotzone completed."));
 		return REENC_FATAL;
 	}
+	reencrypt_stats_phase(&rh->stats.metadata_ns, &t, "metadata");
+	if (commit) {
+		rh->commit.pending = 0;
+		rh->commit.last = t;
+	}
 
 	if (online) {
 		/* severity normal */
@@ -3184,8 +4415,13 @@ static reenc_status_t reencrypt_step(struct crypt_device *cd,
 			log_err(cd, _("Failed to resume device %s."), rh->hotzone_name);
 			return REENC_ERR;
 		}
+		reencrypt_suspend_account(&rh->stats.hotzone_suspend, rh->hotzone_suspended);
+		rh->hotzone_suspended = 0;
+		reencrypt_stats_phase(&rh->stats.dm_ns, &t, "dm");
 	}
 
+	rh->stats.hotzones++;
+
 	return REENC_OK;
 }
 
@@ -3238,7 +4474,7 @@ static int reencrypt_teardown_ok(struct crypt_device *cd, struct luks2_hdr *hdr,
 	bool finished = !(rh->device_size > rh->progress);
 
 	if (rh->rp.type == REENC_PROTECTION_NONE &&
-	    LUKS2_hdr_write(cd, hdr)) {
+	    LUKS2_hdr_write_segments(cd, hdr)) {
 		log_err(cd, _("Failed to write LUKS2 metadata."));
 		return -EINVAL;
 	}
@@ -3252,8 +4488,8 @@ static int reencrypt_teardown_ok(struct crypt_device *cd, struct luks2_hdr *hdr,
 			if (r)
 				log_err(cd, _("Failed to resume device %s."), rh->device_name);
 		}
-		dm_remove_device(cd, rh->overlay_name, 0);
-		dm_remove_device(cd, rh->hotzone_name, 0);
+		dm_remove_device(cd, rh->overlay_name, DM_DEACTIVATE_PRIVATE);
+		dm_remove_device(cd, rh->hotzone_name, DM_DEACTIVATE_PRIVATE);
 
 		if (!r && finished && rh->mode == CRYPT_REENCRYPT_DECRYPT &&
 		    !dm_flags(cd, DM_LINEAR, &dmt_flags) && (dmt_flags & DM_DEFERRED_SUPPORTED))
@@ -3336,6 +4572,7 @@ CRYPT_SYMBOL_EXPORT_NEW(int, crypt_reencrypt, 2, 4,
 	struct luks2_hdr *hdr;
 	struct luks2_reencrypt *rh;
 	reenc_status_t rs;
+	struct timespec tstart, tend;
 	bool quit = false;
 
 	if (onlyLUKS2mask(cd, CRYPT_REQUIREMENT_ONLINE_REENCRYPT))
@@ -3364,13 +4601,25 @@ CRYPT_SYMBOL_EXPORT_NEW(int, crypt_reencrypt, 2, 4,
 
 	log_dbg(cd, "Progress %" PRIu64 ", device_size %" PRIu64, rh->progress, rh->device_size);
 
+	reencrypt_prefetch_init(cd, hdr, rh);
+	reencrypt_adapt_init(cd, rh);
+	reencrypt_skip_init(cd, hdr, rh);
+
 	rs = REENC_OK;
 
 	while (!quit && (rh->device_size > rh->progress)) {
+		if (clock_gettime(CLOCK_MONOTONIC, &tstart) < 0)
+			tstart.tv_sec = tstart.tv_nsec = 0;
+
 		rs = reencrypt_step(cd, hdr, rh, rh->device_size, rh->online);
 		if (rs != REENC_OK)
 			break;
 
+		/* must plan the hotzone length before next window is calculated */
+		if (tstart.tv_sec && !clock_gettime(CLOCK_MONOTONIC, &tend))
+			reencrypt_adapt_update(cd, rh, (tend.tv_sec - tstart.tv_sec) * 1000000 +
+						       (tend.tv_nsec - tstart.tv_nsec) / 1000);
+
 		log_dbg(cd, "Progress %" PRIu64 ", device_size %" PRIu64, rh->progress, rh->device_size);
 		if (progress && progress(rh->device_size, rh->progress, usrptr))
 			quit = true;
@@ -3384,8 +4633,13 @@ CRYPT_SYMBOL_EXPORT_NEW(int, crypt_reencrypt, 2, 4,
 
 		log_dbg(cd, "Next reencryption offset will be %" PRIu64 " sectors.", rh->offset);
 		log_dbg(cd, "Next reencryption chunk size will be %" PRIu64 " sectors).", rh->length);
+
+		if (!quit && rh->device_size > rh->progress)
+			reencrypt_rate_limit(cd, rh);
 	}
 
+	reencrypt_stats_dump(cd, &rh->stats);
+
 	r = reencrypt_teardown(cd, hdr, rh, rs, quit, progress, usrptr);
 	return r;
 }
@@ -3398,6 +4652,80 @@ CRYPT_SYMBOL_EXPORT_OLD(int, crypt_reencrypt, 2, 0,
 	return crypt_reencrypt(cd, progress, NULL);
 }
 
+int crypt_reencrypt_get_stats(struct crypt_device *cd,
+	struct crypt_reencrypt_stats *stats)
+{
+	struct luks2_reencrypt *rh;
+	const size_t first = offsetof(struct crypt_reencrypt_stats, hotzones);
+
+	/* at least hotzones counter must fit */
+	if (!stats || stats->struct_size < first + sizeof(stats->hotzones) ||
+	    onlyLUKS2mask(cd, CRYPT_REQUIREMENT_ONLINE_REENCRYPT))
+		return -EINVAL;
+
+	rh = crypt_get_luks2_reencrypt(cd);
+	if (!rh)
+		return -EINVAL;
+
+	/* older callers get only counters they know about */
+	memcpy((char *)stats + first, (const char *)&rh->stats + first,
+	       (stats->struct_size < sizeof(*stats) ? stats->struct_size : sizeof(*stats)) - first);
+
+	return 0;
+}
+
+int crypt_reencrypt_set_rate_limit(struct crypt_device *cd,
+	uint64_t max_throughput,
+	uint32_t max_iops)
+{
+	struct luks2_reencrypt *rh;
+
+	if (onlyLUKS2mask(cd, CRYPT_REQUIREMENT_ONLINE_REENCRYPT))
+		return -EINVAL;
+
+	rh = crypt_get_luks2_reencrypt(cd);
+	if (!rh) {
+		log_err(cd, _("Missing or invalid reencrypt context."));
+		return -EINVAL;
+	}
+
+	if (rh->rate.max_throughput != max_throughput || rh->rate.max_iops != max_iops)
+		log_dbg(cd, "Setting reencryption rate limit to %" PRIu64 " B/s, %" PRIu32 " IOPS.",
+			max_throughput, max_iops);
+
+	rh->rate.max_throughput = max_throughput;
+	rh->rate.max_iops = max_iops;
+
+	return 0;
+}
+
+int crypt_reencrypt_set_commit_interval(struct crypt_device *cd,
+	uint64_t bytes,
+	uint32_t msec)
+{
+	struct luks2_reencrypt *rh;
+
+	if (onlyLUKS2mask(cd, CRYPT_REQUIREMENT_ONLINE_REENCRYPT))
+		return -EINVAL;
+
+	rh = crypt_get_luks2_reencrypt(cd);
+	if (!rh) {
+		log_err(cd, _("Missing or invalid reencrypt context."));
+		return -EINVAL;
+	}
+
+	if (rh->rp.type != REENC_PROTECTION_NONE && (bytes || msec))
+		log_dbg(cd, "Commit interval is used only with none resilience, ignoring.");
+	else if (bytes || msec)
+		log_dbg(cd, "Setting reencryption commit interval to %" PRIu64 " bytes, %" PRIu32 " ms.",
+			bytes, msec);
+
+	rh->commit.bytes = bytes;
+	rh->commit.ns = (uint64_t)msec * 1000000;
+
+	return 0;
+}
+
 static int reencrypt_recovery(struct crypt_device *cd,
 		struct luks2_hdr *hdr,
 		uint64_t device_size,
@@ -22,6 +22,9 @@
 #include <ctype.h>
 #include <dlfcn.h>
 #include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "luks2_internal.h"
 
@@ -38,6 +41,93 @@ static struct crypt_token_handler_internal token_handlers[LUKS2_TOKENS_MAX] = {
 	}
 };
 
+/*
+ * Handlers are shared by all contexts in process. Every context holds
+ * a reference to each handler it used (released in crypt_free), so an
+ * external handler can be unloaded explicitly only if not in use.
+ */
+static pthread_mutex_t token_handlers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* External token names that failed to load, not retried until unload call */
+static char *token_missing[LUKS2_TOKENS_MAX];
+
+/* Concurrent token open jobs still running in handler code */
+static unsigned token_jobs_running;
+
+/*
+ * Successful token validations shared by all contexts in process, so repeated
+ * loads of the same header skip handler validate call. Entry matches only
+ * the same header seqid, token id, handler and exact token JSON.
+ */
+#define TOKEN_VALID_CACHE_SIZE 32
+
+static struct token_valid_entry {
+	uint64_t seqid;
+	int token;
+	uint32_t hash;
+	char *handler;
+	char *json;
+} token_valid_cache[TOKEN_VALID_CACHE_SIZE];
+static unsigned token_valid_cache_next;
+static pthread_mutex_t token_valid_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void token_valid_entry_free(struct token_valid_entry *e)
+{
+	free(e->handler);
+	free(e->json);
+	memset(e, 0, sizeof(*e));
+}
+
+static bool token_valid_cache_lookup(uint64_t seqid, int token, const char *handler,
+				     const char *json, uint32_t hash)
+{
+	struct token_valid_entry *e;
+	bool found = false;
+	int i;
+
+	pthread_mutex_lock(&token_valid_cache_lock);
+	for (i = 0; i < TOKEN_VALID_CACHE_SIZE && !found; i++) {
+		e = &token_valid_cache[i];
+		found = e->json && e->seqid == seqid && e->token == token && e->hash == hash &&
+			!strcmp(e->handler, handler) && !strcmp(e->json, json);
+	}
+	pthread_mutex_unlock(&token_valid_cache_lock);
+
+	return found;
+}
+
+static void token_valid_cache_add(uint64_t seqid, int token, const char *handler,
+				  const char *json, uint32_t hash)
+{
+	struct token_valid_entry *e;
+
+	pthread_mutex_lock(&token_valid_cache_lock);
+	e = &token_valid_cache[token_valid_cache_next++ % TOKEN_VALID_CACHE_SIZE];
+	token_valid_entry_free(e);
+	e->handler = strdup(handler);
+	e->json = strdup(json);
+	if (e->handler && e->json) {
+		e->seqid = seqid;
+		e->token = token;
+		e->hash = hash;
+	} else
+		token_valid_entry_free(e);
+	pthread_mutex_unlock(&token_valid_cache_lock);
+}
+
+/* Drop entries validated by handler (NULL for all) */
+static void token_valid_cache_drop(const char *handler)
+{
+	int i;
+
+	pthread_mutex_lock(&token_valid_cache_lock);
+	for (i = 0; i < TOKEN_VALID_CACHE_SIZE; i++)
+		if (token_valid_cache[i].json &&
+		    (!handler || !strcmp(token_valid_cache[i].handler, handler)))
+			token_valid_entry_free(&token_valid_cache[i]);
+	pthread_mutex_unlock(&token_valid_cache_lock);
+}
+
 #if USE_EXTERNAL_TOKENS
 static void *token_dlvsym(struct crypt_device *cd,
 		void *handle,
@@ -94,6 +184,19 @@ static bool token_validate_v2(struct crypt_device *cd, const struct crypt_token_
 	return true;
 }
 
+static bool token_validate_v3(struct crypt_device *cd, const struct crypt_token_handler_internal *h)
+{
+	if (!h->u.v3.open_async && !h->u.v3.open_finish && !h->u.v3.cancel)
+		return false;
+
+	if (!h->u.v3.open_async || !h->u.v3.open_finish || !h->u.v3.cancel) {
+		log_dbg(cd, "Token handler does not provide all asynchronous open functions.");
+		return false;
+	}
+
+	return true;
+}
+
 static bool external_token_name_valid(const char *name)
 {
 	if (!*name || strlen(name) > LUKS2_TOKEN_NAME_MAX)
@@ -113,7 +216,7 @@ static int
 crypt_token_load_external(struct crypt_device *cd, const char *name, struct crypt_token_handler_internal *ret)
 {
 #if USE_EXTERNAL_TOKENS
-	struct crypt_token_handler_v2 *token;
+	struct crypt_token_handler_v3 *token;
 	void *h;
 	char buf[512];
 	int r;
@@ -126,7 +229,7 @@ crypt_token_load_external(struct crypt_device *cd, const char *name, struct cryp
 		return -EINVAL;
 	}
 
-	token = &ret->u.v2;
+	token = &ret->u.v3;
 
 	r = snprintf(buf, sizeof(buf), "libcryptsetup-token-%s.so", name);
 	if (r < 0 || (size_t)r >= sizeof(buf))
@@ -134,20 +237,27 @@ crypt_token_load_external(struct crypt_device *cd, const char *name, struct cryp
 
 	log_dbg(cd, "Trying to load %s.", buf);
 
+	/* missing (or unloadable) plugin, the only result remembered as missing */
 	h = dlopen(buf, RTLD_LAZY);
 	if (!h) {
 		log_dbg(NULL, "%s", dlerror());
-		return -EINVAL;
+		return -ENOENT;
 	}
 	dlerror();
 
-	token->name = strdup(name);
+	if (!(token->name = strdup(name))) {
+		dlclose(h);
+		return -ENOMEM;
+	}
 	token->open = token_dlvsym(cd, h, CRYPT_TOKEN_ABI_OPEN, CRYPT_TOKEN_ABI_VERSION1);
 	token->buffer_free = token_dlvsym(cd, h, CRYPT_TOKEN_ABI_BUFFER_FREE, CRYPT_TOKEN_ABI_VERSION1);
 	token->validate = token_dlvsym(cd, h, CRYPT_TOKEN_ABI_VALIDATE, CRYPT_TOKEN_ABI_VERSION1);
 	token->dump = token_dlvsym(cd, h, CRYPT_TOKEN_ABI_DUMP, CRYPT_TOKEN_ABI_VERSION1);
 	token->open_pin = token_dlvsym(cd, h, CRYPT_TOKEN_ABI_OPEN_PIN, CRYPT_TOKEN_ABI_VERSION1);
 	token->version = token_dlvsym(cd, h, CRYPT_TOKEN_ABI_VERSION, CRYPT_TOKEN_ABI_VERSION1);
+	token->open_async = token_dlvsym(cd, h, CRYPT_TOKEN_ABI_OPEN_ASYNC, CRYPT_TOKEN_ABI_VERSION2);
+	token->open_finish = token_dlvsym(cd, h, CRYPT_TOKEN_ABI_OPEN_FINISH, CRYPT_TOKEN_ABI_VERSION2);
+	token->cancel = token_dlvsym(cd, h, CRYPT_TOKEN_ABI_CANCEL, CRYPT_TOKEN_ABI_VERSION2);
 
 	if (!token_validate_v2(cd, ret)) {
 		free(CONST_CAST(void *)token->name);
@@ -166,6 +276,14 @@ crypt_token_load_external(struct crypt_device *cd, const char *name, struct cryp
 	token->dlhandle = h;
 	ret->version = 2;
 
+	if (token_validate_v3(cd, ret))
+		ret->version = 3;
+	else {
+		token->open_async = NULL;
+		token->open_finish = NULL;
+		token->cancel = NULL;
+	}
+
 	return 0;
 #else
 	return -ENOTSUP;
@@ -179,25 +297,31 @@ static int is_builtin_candidate(const char *type)
 
 static int crypt_token_find_free(struct crypt_device *cd, const char *name, int *index)
 {
-	int i;
+	int i, free_index = -1;
 
 	if (is_builtin_candidate(name)) {
 		log_dbg(cd, "'" LUKS2_BUILTIN_TOKEN_PREFIX "' is reserved prefix for builtin tokens.");
 		return -EINVAL;
 	}
 
-	for (i = 0; i < LUKS2_TOKENS_MAX && token_handlers[i].u.v1.name; i++) {
+	/* Unloaded external handlers leave empty slots in table */
+	for (i = 0; i < LUKS2_TOKENS_MAX; i++) {
+		if (!token_handlers[i].u.v1.name) {
+			if (free_index < 0)
+				free_index = i;
+			continue;
+		}
 		if (!strcmp(token_handlers[i].u.v1.name, name)) {
 			log_dbg(cd, "Keyslot handler %s is already registered.", name);
 			return -EINVAL;
 		}
 	}
 
-	if (i == LUKS2_TOKENS_MAX)
+	if (free_index < 0)
 		return -EINVAL;
 
 	if (index)
-		*index = i;
+		*index = free_index;
 
 	return 0;
 }
@@ -209,51 +333,162 @@ int crypt_token_register(const crypt_token_handler *handler)
 	if (!token_validate_v1(NULL, handler))
 		return -EINVAL;
 
+	pthread_mutex_lock(&token_handlers_lock);
 	r = crypt_token_find_free(NULL, handler->name, &i);
-	if (r < 0)
-		return r;
+	if (!r) {
+		token_handlers[i].version = 1;
+		token_handlers[i].u.v1 = *handler;
+	}
+	pthread_mutex_unlock(&token_handlers_lock);
 
-	token_handlers[i].version = 1;
-	token_handlers[i].u.v1 = *handler;
-	return 0;
+	return r;
+}
+
+static void token_unload_external(struct crypt_device *cd, int i)
+{
+	log_dbg(cd, "Unloading %s token handler.", token_handlers[i].u.v2.name);
+
+	/* reloaded handler can validate differently */
+	token_valid_cache_drop(token_handlers[i].u.v2.name);
+
+	free(CONST_CAST(void *)token_handlers[i].u.v2.name);
+
+	if (dlclose(CONST_CAST(void *)token_handlers[i].u.v2.dlhandle))
+		log_dbg(cd, "%s", dlerror());
+
+	memset(&token_handlers[i], 0, sizeof(token_handlers[i]));
+}
+
+static void token_missing_free(void)
+{
+	int i;
+
+	for (i = 0; i < LUKS2_TOKENS_MAX; i++) {
+		free(token_missing[i]);
+		token_missing[i] = NULL;
+	}
+}
+
+/* Remembers only plugins not found (-ENOENT), other errors are retried */
+static bool token_missing_check(const char *name, bool add)
+{
+	int i;
+
+	for (i = 0; i < LUKS2_TOKENS_MAX && token_missing[i]; i++)
+		if (!strcmp(token_missing[i], name))
+			return true;
+
+	/* if the list is full, loading is just retried */
+	if (add && i < LUKS2_TOKENS_MAX)
+		token_missing[i] = strdup(name);
+
+	return false;
 }
 
 void crypt_token_unload_external_all(struct crypt_device *cd)
 {
 	int i;
 
-	for (i = LUKS2_TOKENS_MAX - 1; i >= 0; i--) {
-		if (token_handlers[i].version < 2)
+	pthread_mutex_lock(&token_handlers_lock);
+	if (token_jobs_running)
+		log_dbg(cd, "Token open jobs still running, handlers not unloaded.");
+	else for (i = LUKS2_TOKENS_MAX - 1; i >= 0; i--)
+		if (token_handlers[i].version >= 2)
+			token_unload_external(cd, i);
+	token_missing_free();
+	token_valid_cache_drop(NULL);
+	pthread_mutex_unlock(&token_handlers_lock);
+}
+
+int crypt_token_unload_external(const char *name)
+{
+	int i, r = name ? -ENOENT : 0;
+
+	pthread_mutex_lock(&token_handlers_lock);
+	for (i = 0; i < LUKS2_TOKENS_MAX; i++) {
+		if (token_handlers[i].version < 2 ||
+		    (name && strcmp(token_handlers[i].u.v2.name, name)))
+			continue;
+		if (token_handlers[i].refs) {
+			log_dbg(NULL, "Token handler %s is in use.", token_handlers[i].u.v2.name);
+			if (name)
+				r = -EBUSY;
 			continue;
+		}
+		token_unload_external(NULL, i);
+		r = 0;
+	}
 
-		log_dbg(cd, "Unloading %s token handler.", token_handlers[i].u.v2.name);
+	/* Allow to retry loading of handlers installed meanwhile */
+	if (!name)
+		token_missing_free();
+	pthread_mutex_unlock(&token_handlers_lock);
 
-		free(CONST_CAST(void *)token_handlers[i].u.v2.name);
+	return r;
+}
 
-		if (dlclose(CONST_CAST(void *)token_handlers[i].u.v2.dlhandle))
-			log_dbg(cd, "%s", dlerror());
-	}
+/* Must be called with token_handlers_lock held */
+static void token_handler_ref(struct crypt_device *cd, int i)
+{
+	uint32_t *used = crypt_token_handlers_used(cd);
+
+	if (!used || (*used & (UINT32_C(1) << i)))
+		return;
+
+	*used |= UINT32_C(1) << i;
+	token_handlers[i].refs++;
+}
+
+void crypt_token_handlers_release(struct crypt_device *cd)
+{
+	uint32_t *used = crypt_token_handlers_used(cd);
+	int i;
+
+	if (!used || !*used)
+		return;
+
+	pthread_mutex_lock(&token_handlers_lock);
+	for (i = 0; i < LUKS2_TOKENS_MAX; i++)
+		if ((*used & (UINT32_C(1) << i)) && token_handlers[i].refs)
+			token_handlers[i].refs--;
+	*used = 0;
+	pthread_mutex_unlock(&token_handlers_lock);
 }
 
 static const void
 *LUKS2_token_handler_type(struct crypt_device *cd, const char *type)
 {
-	int i;
+	const void *h = NULL;
+	int i, r, free_index = -1;
 
-	for (i = 0; i < LUKS2_TOKENS_MAX && token_handlers[i].u.v1.name; i++)
-		if (!strcmp(token_handlers[i].u.v1.name, type))
-			return &token_handlers[i].u;
+	pthread_mutex_lock(&token_handlers_lock);
 
-	if (i >= LUKS2_TOKENS_MAX)
-		return NULL;
+	for (i = 0; i < LUKS2_TOKENS_MAX; i++) {
+		if (!token_handlers[i].u.v1.name) {
+			if (free_index < 0)
+				free_index = i;
+		} else if (!strcmp(token_handlers[i].u.v1.name, type))
+			break;
+	}
 
-	if (is_builtin_candidate(type))
-		return NULL;
+	if (i == LUKS2_TOKENS_MAX) {
+		/* Loading under lock, concurrent contexts do not load the same plugin twice */
+		if (free_index < 0 || is_builtin_candidate(type) || token_missing_check(type, false))
+			goto out;
 
-	if (crypt_token_load_external(cd, type, &token_handlers[i]))
-		return NULL;
+		r = crypt_token_load_external(cd, type, &token_handlers[free_index]);
+		if (r == -ENOENT)
+			token_missing_check(type, true);
+		if (r < 0)
+			goto out;
+		i = free_index;
+	}
 
-	return &token_handlers[i].u;
+	token_handler_ref(cd, i);
+	h = &token_handlers[i].u;
+out:
+	pthread_mutex_unlock(&token_handlers_lock);
+	return h;
 }
 
 static const void
@@ -297,6 +532,7 @@ int LUKS2_token_create(struct crypt_device *cd,
 	const crypt_token_handler *h;
 	json_object *jobj_tokens, *jobj_type, *jobj;
 	enum json_tokener_error jerr;
+	uint32_t *validated;
 	char num[16];
 
 	if (token == CRYPT_ANY_TOKEN) {
@@ -353,6 +589,11 @@ int LUKS2_token_create(struct crypt_device *cd,
 		}
 	}
 
+	/* in-memory change keeps seqid until commit */
+	validated = crypt_token_validated(cd, hdr->uuid, hdr->seqid);
+	if (validated)
+		*validated &= ~(1U << token);
+
 	if (commit)
 		return LUKS2_hdr_write(cd, hdr) ?: token;
 
@@ -439,20 +680,19 @@ static int translate_errno(struct crypt_device *cd, int ret_val, const char *typ
 	return ret_val;
 }
 
-static int LUKS2_token_open(struct crypt_device *cd,
+/* Checks done before token open, returns handler of usable token */
+static int token_open_check(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int token,
 	json_object *jobj_token,
 	const char *type,
 	int segment,
 	const char *pin,
-	size_t pin_size,
-	char **buffer,
-	size_t *buffer_len,
-	void *usrptr)
+	const struct crypt_token_handler_v3 **h)
 {
-	const struct crypt_token_handler_v2 *h;
 	json_object *jobj_type;
+	const char *json;
+	uint32_t *validated, hash;
 	int r;
 
 	assert(token >= 0);
@@ -472,33 +712,173 @@ static int LUKS2_token_open(struct crypt_device *cd,
 		return r;
 	}
 
-	if (!(h = LUKS2_token_handler(cd, token)))
+	if (!(*h = LUKS2_token_handler(cd, token)))
 		return -ENOENT;
 
-	if (h->validate && h->validate(cd, token_json_to_string(jobj_token))) {
-		log_dbg(cd, "Token %d (%s) validation failed.", token, h->name);
+	/* validation is done once per header change (PIN retries skip it) */
+	validated = crypt_token_validated(cd, hdr->uuid, hdr->seqid);
+	if (validated && (*validated & (1U << token)))
+		log_dbg(cd, "Token %d (%s) already validated.", token, (*h)->name);
+	else if ((*h)->validate) {
+		json = token_json_to_string(jobj_token);
+		hash = crypt_crc32c(~0U, (const unsigned char *)json, strlen(json));
+		if (token_valid_cache_lookup(hdr->seqid, token, (*h)->name, json, hash))
+			log_dbg(cd, "Token %d (%s) validated in other context.", token, (*h)->name);
+		else if ((*h)->validate(cd, json)) {
+			log_dbg(cd, "Token %d (%s) validation failed.", token, (*h)->name);
+			return -ENOENT;
+		} else
+			token_valid_cache_add(hdr->seqid, token, (*h)->name, json, hash);
+	}
+
+	if (validated)
+		*validated |= 1U << token;
+
+	if (pin && !(*h)->open_pin && !(*h)->open_async) {
+		log_dbg(cd, "Token %d (%s) does not support PIN.", token, (*h)->name);
 		return -ENOENT;
 	}
 
-	if (pin && !h->open_pin)
-		r = -ENOENT;
+	return 0;
+}
+
+static void token_deadline(struct timespec *ts, uint32_t timeout_ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += timeout_ms / 1000;
+	ts->tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+/* Remaining time for poll(), -1 without deadline */
+static int token_deadline_ms(const struct timespec *deadline)
+{
+	struct timespec now;
+	int64_t ms;
+
+	if (!deadline)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (int64_t)(deadline->tv_sec - now.tv_sec) * 1000 +
+	     (deadline->tv_nsec - now.tv_nsec) / 1000000;
+
+	if (ms <= 0)
+		return 0;
+
+	return ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
+static int token_open_async(struct crypt_device *cd,
+	const struct crypt_token_handler_v3 *h,
+	int token,
+	const char *pin,
+	size_t pin_size,
+	char **buffer,
+	size_t *buffer_len,
+	void *usrptr,
+	const struct timespec *deadline)
+{
+	struct pollfd pfd = { .fd = -1, .events = POLLIN };
+	void *ctx = NULL;
+	int r, timeout;
+
+	if (!(timeout = token_deadline_ms(deadline)))
+		return -ETIMEDOUT;
+
+	r = h->open_async(cd, token, pin, pin_size, usrptr, timeout < 0 ? 0 : timeout, &ctx, &pfd.fd);
+	if (r < 0)
+		return r;
+
+	for (;;) {
+		timeout = token_deadline_ms(deadline);
+		r = timeout ? poll(&pfd, 1, timeout) : 0;
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0) {
+			r = -errno;
+			break;
+		}
+		if (!r) {
+			r = -ETIMEDOUT;
+			break;
+		}
+
+		/* ctx is released by handler unless more input is needed */
+		r = h->open_finish(ctx, buffer, buffer_len);
+		if (r != -EAGAIN)
+			return r;
+	}
+
+	log_dbg(cd, "Cancelling token %d (%s) open (%d).", token, h->name, r);
+	h->cancel(ctx);
+
+	return r;
+}
+
+static int token_open_call(struct crypt_device *cd,
+	const struct crypt_token_handler_v3 *h,
+	int token,
+	const char *pin,
+	size_t pin_size,
+	char **buffer,
+	size_t *buffer_len,
+	void *usrptr,
+	const struct timespec *deadline)
+{
+	uint64_t start = crypt_op_usec();
+	int r;
+
+	if (h->open_async)
+		r = translate_errno(cd, token_open_async(cd, h, token, pin, pin_size, buffer,
+					buffer_len, usrptr, deadline), h->name);
 	else if (pin)
 		r = translate_errno(cd, h->open_pin(cd, token, pin, pin_size, buffer, buffer_len, usrptr), h->name);
 	else
 		r = translate_errno(cd, h->open(cd, token, buffer, buffer_len, usrptr), h->name);
 	if (r < 0)
 		log_dbg(cd, "Token %d (%s) open failed with %d.", token, h->name, r);
+	TRACE3(token__open, token, h->name, r);
+	crypt_op_stats_add(cd, CRYPT_OP_TOKEN, crypt_op_usec() - start);
 
 	return r;
 }
 
-static void LUKS2_token_buffer_free(struct crypt_device *cd,
-		int token,
+static int LUKS2_token_open(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int token,
+	json_object *jobj_token,
+	const char *type,
+	int segment,
+	const char *pin,
+	size_t pin_size,
+	char **buffer,
+	size_t *buffer_len,
+	void *usrptr)
+{
+	const struct crypt_token_handler_v3 *h;
+	struct timespec deadline;
+	uint32_t timeout = crypt_token_timeout(cd);
+	int r;
+
+	r = token_open_check(cd, hdr, token, jobj_token, type, segment, pin, &h);
+	if (r < 0)
+		return r;
+
+	if (timeout)
+		token_deadline(&deadline, timeout);
+
+	return token_open_call(cd, h, token, pin, pin_size, buffer, buffer_len, usrptr,
+			       timeout ? &deadline : NULL);
+}
+
+static void token_buffer_free(const struct crypt_token_handler_v3 *h,
 		void *buffer,
 		size_t buffer_len)
 {
-	const crypt_token_handler *h = LUKS2_token_handler(cd, token);
-
 	if (h && h->buffer_free)
 		h->buffer_free(buffer, buffer_len);
 	else {
@@ -507,6 +887,14 @@ static void LUKS2_token_buffer_free(struct crypt_device *cd,
 	}
 }
 
+static void LUKS2_token_buffer_free(struct crypt_device *cd,
+		int token,
+		void *buffer,
+		size_t buffer_len)
+{
+	token_buffer_free(LUKS2_token_handler(cd, token), buffer, buffer_len);
+}
+
 static int LUKS2_keyslot_open_by_token(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int token,
@@ -516,8 +904,9 @@ static int LUKS2_keyslot_open_by_token(struct crypt_device *cd,
 	struct volume_key **vk)
 {
 	json_object *jobj_token, *jobj_token_keyslots, *jobj_type, *jobj;
+	int hints[LUKS2_KEYSLOTS_MAX];
 	unsigned int num = 0;
-	int i, r;
+	int i, len, hint, r;
 
 	jobj_token = LUKS2_get_token_jobj(hdr, token);
 	if (!jobj_token)
@@ -530,13 +919,29 @@ static int LUKS2_keyslot_open_by_token(struct crypt_device *cd,
 	if (!jobj_token_keyslots)
 		return -EINVAL;
 
-	/* Try to open keyslot referenced in token */
+	len = json_object_array_length(jobj_token_keyslots);
+	if (len > LUKS2_KEYSLOTS_MAX)
+		return -EINVAL;
+
+	for (i = 0; i < len; i++)
+		hints[i] = LUKS2_keyslot_hint_match(cd, hdr,
+			atoi(json_object_get_string(json_object_array_get_idx(jobj_token_keyslots, i))),
+			buffer, buffer_len);
+
+	/*
+	 * Try to open keyslot referenced in token, keyslots with matching hint
+	 * first, then without hint. Mismatching hint can be stale, try it last.
+	 */
 	r = -ENOENT;
-	for (i = 0; i < (int) json_object_array_length(jobj_token_keyslots) && r < 0; i++) {
-		jobj = json_object_array_get_idx(jobj_token_keyslots, i);
-		num = atoi(json_object_get_string(jobj));
-		log_dbg(cd, "Trying to open keyslot %u with token %d (type %s).", num, token, json_object_get_string(jobj_type));
-		r = LUKS2_keyslot_open(cd, num, segment, buffer, buffer_len, vk);
+	for (hint = 1; hint >= -1 && r < 0; hint--) {
+		for (i = 0; i < len && r < 0; i++) {
+			if (hints[i] != hint)
+				continue;
+			jobj = json_object_array_get_idx(jobj_token_keyslots, i);
+			num = atoi(json_object_get_string(jobj));
+			log_dbg(cd, "Trying to open keyslot %u with token %d (type %s).", num, token, json_object_get_string(jobj_type));
+			r = LUKS2_keyslot_open(cd, num, segment, buffer, buffer_len, vk);
+		}
 	}
 
 	if (r < 0)
@@ -545,6 +950,272 @@ static int LUKS2_keyslot_open_by_token(struct crypt_device *cd,
 	return num;
 }
 
+/*
+ * Concurrent open of CRYPT_ANY_TOKEN. Every job runs token handler open with
+ * its own context, passphrases are verified by caller in order of completion.
+ * Handler calls cannot be cancelled, jobs finished after caller stopped waiting
+ * release the passphrase buffer and their context themselves.
+ */
+struct token_jobs;
+
+struct token_job {
+	struct token_jobs *jobs;
+	struct crypt_device *cd;
+	const struct crypt_token_handler_v3 *h;
+	int token;
+	int r;
+	bool done;
+	bool used;
+	char *buffer;
+	size_t buffer_len;
+};
+
+struct token_jobs {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned refs;
+	bool abandoned;
+	struct timespec deadline;
+	char *pin;
+	size_t pin_size;
+	int count;
+	struct token_job job[LUKS2_TOKENS_MAX];
+};
+
+static void token_jobs_running_add(int n)
+{
+	pthread_mutex_lock(&token_handlers_lock);
+	token_jobs_running += n;
+	pthread_mutex_unlock(&token_handlers_lock);
+}
+
+static void token_jobs_put(struct token_jobs *jobs)
+{
+	bool last;
+
+	pthread_mutex_lock(&jobs->lock);
+	last = !--jobs->refs;
+	pthread_mutex_unlock(&jobs->lock);
+
+	if (!last)
+		return;
+
+	pthread_cond_destroy(&jobs->cond);
+	pthread_mutex_destroy(&jobs->lock);
+	crypt_safe_free(jobs->pin);
+	free(jobs);
+}
+
+static void *token_job_run(void *arg)
+{
+	struct token_job *job = arg;
+	struct token_jobs *jobs = job->jobs;
+	char *buffer = NULL;
+	size_t buffer_len = 0;
+	int r;
+
+	/* usrptr of caller may not be valid when job finishes */
+	r = token_open_call(job->cd, job->h, job->token, jobs->pin, jobs->pin_size,
+			    &buffer, &buffer_len, NULL, &jobs->deadline);
+
+	pthread_mutex_lock(&jobs->lock);
+	if (jobs->abandoned) {
+		log_dbg(job->cd, "Token %d open finished after timeout.", job->token);
+		if (!r)
+			token_buffer_free(job->h, buffer, buffer_len);
+	} else {
+		job->r = r;
+		job->buffer = buffer;
+		job->buffer_len = buffer_len;
+	}
+	job->done = true;
+	pthread_cond_signal(&jobs->cond);
+	pthread_mutex_unlock(&jobs->lock);
+
+	/* releases reference to handler */
+	crypt_free(job->cd);
+	token_jobs_running_add(-1);
+	token_jobs_put(jobs);
+
+	return NULL;
+}
+
+/* Prefer the same error as sequential open would return */
+static int token_open_error(int r, int r_job)
+{
+	if (r != -ENOENT && r != -EPERM && r != -ETIMEDOUT)
+		return r;
+	if (r_job != -ENOENT && r_job != -EPERM && r_job != -ETIMEDOUT)
+		return r_job;
+	if (r == -ETIMEDOUT || r_job == -ETIMEDOUT)
+		return -ETIMEDOUT;
+	if (r == -EPERM || r_job == -EPERM)
+		return -EPERM;
+	return -ENOENT;
+}
+
+static struct token_jobs *token_jobs_alloc(const char *pin, size_t pin_size)
+{
+	struct token_jobs *jobs;
+	pthread_condattr_t attr;
+
+	if (!(jobs = calloc(1, sizeof(*jobs))))
+		return NULL;
+
+	if (pin) {
+		if (!(jobs->pin = crypt_safe_alloc(pin_size))) {
+			free(jobs);
+			return NULL;
+		}
+		memcpy(jobs->pin, pin, pin_size);
+		jobs->pin_size = pin_size;
+	}
+
+	pthread_mutex_init(&jobs->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&jobs->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	jobs->refs = 1;
+
+	return jobs;
+}
+
+static int token_jobs_start(struct crypt_device *cd, struct token_jobs *jobs)
+{
+	struct token_job *job;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int i, started = 0;
+
+	if (pthread_attr_init(&attr))
+		return 0;
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (i = 0; i < jobs->count; i++) {
+		job = &jobs->job[i];
+
+		pthread_mutex_lock(&jobs->lock);
+		jobs->refs++;
+		pthread_mutex_unlock(&jobs->lock);
+		token_jobs_running_add(1);
+
+		if (!pthread_create(&thread, &attr, token_job_run, job)) {
+			started++;
+			continue;
+		}
+
+		log_dbg(cd, "Cannot start open job for token %d.", job->token);
+		token_jobs_running_add(-1);
+		crypt_free(job->cd);
+		pthread_mutex_lock(&jobs->lock);
+		jobs->refs--;
+		job->r = -ENOMEM;
+		job->done = true;
+		pthread_mutex_unlock(&jobs->lock);
+	}
+
+	pthread_attr_destroy(&attr);
+	return started;
+}
+
+static int token_open_concurrent(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	const char *type,
+	int segment,
+	const char *pin,
+	size_t pin_size,
+	uint32_t timeout_ms,
+	struct volume_key **vk)
+{
+	const struct crypt_token_handler_v3 *h;
+	struct token_jobs *jobs;
+	struct token_job *job;
+	json_object *jobj_tokens;
+	int i, pending, r_job, keyslot = -ENOENT, r = -ENOENT;
+
+	json_object_object_get_ex(hdr->jobj, "tokens", &jobj_tokens);
+
+	if (!(jobs = token_jobs_alloc(pin, pin_size)))
+		return -ENOMEM;
+
+	json_object_object_foreach(jobj_tokens, slot, val) {
+		job = &jobs->job[jobs->count];
+		job->token = atoi(slot);
+
+		r_job = token_open_check(cd, hdr, job->token, val, type, segment, pin, &h);
+		if (!r_job)
+			r_job = crypt_token_context_clone(cd, &job->cd);
+		/* the same handler, referenced by private context */
+		if (!r_job && !(job->h = LUKS2_token_handler(job->cd, job->token))) {
+			crypt_free(job->cd);
+			r_job = -ENOENT;
+		}
+		if (r_job < 0) {
+			r = token_open_error(r, r_job);
+			memset(job, 0, sizeof(*job));
+			continue;
+		}
+
+		job->jobs = jobs;
+		jobs->count++;
+	}
+
+	log_dbg(cd, "Opening %d tokens concurrently (timeout %" PRIu32 " ms).", jobs->count, timeout_ms);
+
+	/* asynchronous handlers in jobs are cancelled at the same deadline */
+	token_deadline(&jobs->deadline, timeout_ms);
+	token_jobs_start(cd, jobs);
+
+	pthread_mutex_lock(&jobs->lock);
+	for (pending = jobs->count; pending && keyslot < 0;) {
+		for (i = 0; i < jobs->count; i++)
+			if (jobs->job[i].done && !jobs->job[i].used)
+				break;
+
+		if (i == jobs->count) {
+			if (pthread_cond_timedwait(&jobs->cond, &jobs->lock, &jobs->deadline) == ETIMEDOUT) {
+				log_dbg(cd, "Concurrent token open timed out, %d tokens pending.", pending);
+				r = token_open_error(r, -ETIMEDOUT);
+				break;
+			}
+			continue;
+		}
+
+		job = &jobs->job[i];
+		job->used = true;
+		pending--;
+		pthread_mutex_unlock(&jobs->lock);
+
+		if (!job->r) {
+			r_job = LUKS2_keyslot_open_by_token(cd, hdr, job->token, segment,
+							    job->buffer, job->buffer_len, vk);
+			token_buffer_free(job->h, job->buffer, job->buffer_len);
+			job->buffer = NULL;
+			if (r_job >= 0)
+				keyslot = r_job;
+			else
+				r = token_open_error(r, r_job);
+		} else
+			r = token_open_error(r, job->r);
+
+		pthread_mutex_lock(&jobs->lock);
+	}
+
+	/* Passphrases not needed anymore, late jobs free their own */
+	jobs->abandoned = true;
+	for (i = 0; i < jobs->count; i++) {
+		job = &jobs->job[i];
+		if (job->done && !job->used && !job->r)
+			token_buffer_free(job->h, job->buffer, job->buffer_len);
+	}
+	pthread_mutex_unlock(&jobs->lock);
+
+	token_jobs_put(jobs);
+
+	return keyslot >= 0 ? keyslot : r;
+}
+
 int LUKS2_token_open_and_activate(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int token,
@@ -561,6 +1232,7 @@ int LUKS2_token_open_and_activate(struct crypt_device *cd,
 	json_object *jobj_tokens, *jobj_token;
 	int keyslot, segment, r = -ENOENT;
 	struct volume_key *vk = NULL;
+	uint64_t start;
 
 	if (flags & CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY)
 		segment = CRYPT_ANY_SEGMENT;
@@ -579,6 +1251,12 @@ int LUKS2_token_open_and_activate(struct crypt_device *cd,
 				LUKS2_token_buffer_free(cd, token, buffer, buffer_size);
 			}
 		}
+	} else if (token == CRYPT_ANY_TOKEN && crypt_token_concurrent_timeout(cd)) {
+		/* token jobs use cloned contexts, whole concurrent open is counted here */
+		start = crypt_op_usec();
+		r = token_open_concurrent(cd, hdr, type, segment, pin, pin_size,
+					  crypt_token_concurrent_timeout(cd), &vk);
+		crypt_op_stats_add(cd, CRYPT_OP_TOKEN, crypt_op_usec() - start);
 	} else if (token == CRYPT_ANY_TOKEN) {
 		json_object_object_get_ex(hdr->jobj, "tokens", &jobj_tokens);
 
@@ -586,6 +1264,9 @@ int LUKS2_token_open_and_activate(struct crypt_device *cd,
 		if (!type)
 			usrptr = NULL;
 
+		if (!type || !strcmp(type, LUKS2_TOKEN_KEYRING))
+			LUKS2_token_keyring_resolve(cd, hdr);
+
 		json_object_object_foreach(jobj_tokens, slot, val) {
 			token = atoi(slot);
 			r = LUKS2_token_open(cd, hdr, token, val, type, segment, pin, pin_size, &buffer, &buffer_size, usrptr);
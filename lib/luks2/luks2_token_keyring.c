@@ -42,7 +42,7 @@ int keyring_open(struct crypt_device *cd,
 
 	json_object_object_get_ex(jobj_token, "key_description", &jobj_key);
 
-	r = keyring_get_passphrase(json_object_get_string(jobj_key), buffer, buffer_len);
+	r = keyring_cache_get_passphrase(crypt_keyring_cache(cd), json_object_get_string(jobj_key), buffer, buffer_len);
 	if (r == -ENOTSUP) {
 		log_dbg(cd, "Kernel keyring features disabled.");
 		return -ENOENT;
@@ -135,3 +135,28 @@ int LUKS2_token_keyring_get(struct crypt_device *cd __attribute__((unused)), str
 
 	return token;
 }
+
+/* Search keys of all keyring tokens at once, serials are cached in context */
+int LUKS2_token_keyring_resolve(struct crypt_device *cd, struct luks2_hdr *hdr)
+{
+	const char *descs[LUKS2_TOKENS_MAX];
+	json_object *jobj_tokens, *jobj;
+	size_t count = 0;
+
+	if (!json_object_object_get_ex(hdr->jobj, "tokens", &jobj_tokens))
+		return 0;
+
+	json_object_object_foreach(jobj_tokens, slot, val) {
+		UNUSED(slot);
+		if (!json_object_object_get_ex(val, "type", &jobj) ||
+		    strcmp(json_object_get_string(jobj), LUKS2_TOKEN_KEYRING) ||
+		    !json_object_object_get_ex(val, "key_description", &jobj))
+			continue;
+		descs[count++] = json_object_get_string(jobj);
+	}
+
+	if (!count)
+		return 0;
+
+	return keyring_cache_resolve(crypt_keyring_cache(cd), descs, count);
+}
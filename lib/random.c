@@ -22,11 +22,18 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/select.h>
+#ifdef HAVE_SYS_RANDOM_H
+#include <sys/random.h>
+#endif
 
 #include "libcryptsetup.h"
 #include "internal.h"
 
+/* Both descriptors are opened once for all contexts in the process */
+static pthread_mutex_t random_init_lock = PTHREAD_MUTEX_INITIALIZER;
 static int random_initialised = 0;
 
 #define URANDOM_DEVICE	"/dev/urandom"
@@ -41,6 +48,14 @@ static int random_fd = -1;
 /* Timeout to print warning if no random data (entropy) */
 #define RANDOM_DEVICE_TIMEOUT	5
 
+/* Buffer for small non-key requests (salts, AF splitter material...) */
+#define RANDOM_BUFFER_SIZE	4096
+
+static pthread_mutex_t random_buffer_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *random_buffer = NULL;
+static size_t random_buffer_avail = 0;
+static pid_t random_buffer_pid = 0;
+
 /* URANDOM_DEVICE access */
 static int _get_urandom(struct crypt_device *ctx __attribute__((unused)),
 			char *buf, size_t len)
@@ -52,7 +67,14 @@ static int _get_urandom(struct crypt_device *ctx __attribute__((unused)),
 	assert(urandom_fd != -1);
 
 	while(len) {
+#if defined(HAVE_GETRANDOM) && defined(HAVE_SYS_RANDOM_H)
+		/* The same source as URANDOM_DEVICE, without per-read file access */
+		r = getrandom(buf, len, 0);
+		if (r == -1 && errno == ENOSYS)
+			r = read(urandom_fd, buf, len);
+#else
 		r = read(urandom_fd, buf, len);
+#endif
 		if (r == -1 && errno != EINTR)
 			return -EINVAL;
 		if (r > 0) {
@@ -67,6 +89,87 @@ static int _get_urandom(struct crypt_device *ctx __attribute__((unused)),
 	return 0;
 }
 
+/* Buffer is locked in memory and it is not inherited by forked process */
+static int _random_buffer_alloc(void)
+{
+	void *p;
+
+	p = mmap(NULL, RANDOM_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return -ENOMEM;
+
+	(void)mlock(p, RANDOM_BUFFER_SIZE);
+#ifdef MADV_WIPEONFORK
+	(void)madvise(p, RANDOM_BUFFER_SIZE, MADV_WIPEONFORK);
+#endif
+#ifdef MADV_DONTDUMP
+	(void)madvise(p, RANDOM_BUFFER_SIZE, MADV_DONTDUMP);
+#endif
+	random_buffer = p;
+	return 0;
+}
+
+static void _random_buffer_free(void)
+{
+	pthread_mutex_lock(&random_buffer_lock);
+	if (random_buffer) {
+		crypt_safe_memzero(random_buffer, RANDOM_BUFFER_SIZE);
+		(void)munlock(random_buffer, RANDOM_BUFFER_SIZE);
+		(void)munmap(random_buffer, RANDOM_BUFFER_SIZE);
+		random_buffer = NULL;
+	}
+	random_buffer_avail = 0;
+	pthread_mutex_unlock(&random_buffer_lock);
+}
+
+/*
+ * URANDOM_DEVICE access for small requests, read in large chunks.
+ * Consumed data are wiped immediately, the buffer is discarded after fork
+ * (detected by pid change if MADV_WIPEONFORK is not available).
+ */
+static int _get_urandom_buffered(struct crypt_device *ctx, char *buf, size_t len)
+{
+	size_t n;
+	int r = 0;
+
+	if (len >= RANDOM_BUFFER_SIZE / 4)
+		return _get_urandom(ctx, buf, len);
+
+	pthread_mutex_lock(&random_buffer_lock);
+
+	if (!random_buffer && _random_buffer_alloc()) {
+		pthread_mutex_unlock(&random_buffer_lock);
+		return _get_urandom(ctx, buf, len);
+	}
+
+	if (random_buffer_pid != getpid()) {
+		crypt_safe_memzero(random_buffer, RANDOM_BUFFER_SIZE);
+		random_buffer_avail = 0;
+		random_buffer_pid = getpid();
+	}
+
+	while (len && !r) {
+		if (!random_buffer_avail) {
+			r = _get_urandom(ctx, random_buffer, RANDOM_BUFFER_SIZE);
+			if (r)
+				break;
+			random_buffer_avail = RANDOM_BUFFER_SIZE;
+		}
+
+		/* Data are consumed from the buffer end */
+		n = len < random_buffer_avail ? len : random_buffer_avail;
+		random_buffer_avail -= n;
+		memcpy(buf, &random_buffer[random_buffer_avail], n);
+		crypt_safe_memzero(&random_buffer[random_buffer_avail], n);
+		buf += n;
+		len -= n;
+	}
+
+	pthread_mutex_unlock(&random_buffer_lock);
+	return r;
+}
+
 static void _get_random_progress(struct crypt_device *ctx, int warn,
 				 size_t expected_len, size_t read_len)
 {
@@ -143,11 +246,32 @@ static int _get_random(struct crypt_device *ctx, char *buf, size_t len)
 
 	return 0;
 }
+
+static void _random_close(void)
+{
+	__atomic_store_n(&random_initialised, 0, __ATOMIC_RELEASE);
+
+	_random_buffer_free();
+
+	if(random_fd != -1) {
+		(void)close(random_fd);
+		random_fd = -1;
+	}
+
+	if(urandom_fd != -1) {
+		(void)close(urandom_fd);
+		urandom_fd = -1;
+	}
+}
+
 /* Initialisation of both RNG file descriptors is mandatory */
 int crypt_random_init(struct crypt_device *ctx)
 {
-	if (random_initialised)
-		return 0;
+	int r = 0;
+
+	pthread_mutex_lock(&random_init_lock);
+	if (__atomic_load_n(&random_initialised, __ATOMIC_ACQUIRE))
+		goto out;
 
 	/* Used for CRYPT_RND_NORMAL */
 	if(urandom_fd == -1)
@@ -164,27 +288,35 @@ int crypt_random_init(struct crypt_device *ctx)
 	if (crypt_fips_mode())
 		log_verbose(ctx, _("Running in FIPS mode."));
 
-	random_initialised = 1;
-	return 0;
+	__atomic_store_n(&random_initialised, 1, __ATOMIC_RELEASE);
+	goto out;
 err:
-	crypt_random_exit();
+	_random_close();
 	log_err(ctx, _("Fatal error during RNG initialisation."));
-	return -ENOSYS;
+	r = -ENOSYS;
+out:
+	pthread_mutex_unlock(&random_init_lock);
+	return r;
 }
 
 int crypt_random_get(struct crypt_device *ctx, char *buf, size_t len, int quality)
 {
 	int status, rng_type;
 
+	/* RNG devices are opened on first request */
+	if (!__atomic_load_n(&random_initialised, __ATOMIC_ACQUIRE) &&
+	    (status = crypt_random_init(ctx)) < 0)
+		return status;
+
 	switch(quality) {
 	case CRYPT_RND_NORMAL:
-		status = _get_urandom(ctx, buf, len);
+		status = _get_urandom_buffered(ctx, buf, len);
 		break;
 	case CRYPT_RND_SALT:
 		if (crypt_fips_mode())
 			status = crypt_backend_rng(buf, len, quality, 1);
 		else
-			status = _get_urandom(ctx, buf, len);
+			status = _get_urandom_buffered(ctx, buf, len);
 		break;
 	case CRYPT_RND_KEY:
 		if (crypt_fips_mode()) {
@@ -217,17 +349,9 @@ int crypt_random_get(struct crypt_device *ctx, char *buf, size_t len, int qualit
 
 void crypt_random_exit(void)
 {
-	random_initialised = 0;
-
-	if(random_fd != -1) {
-		(void)close(random_fd);
-		random_fd = -1;
-	}
-
-	if(urandom_fd != -1) {
-		(void)close(urandom_fd);
-		urandom_fd = -1;
-	}
+	pthread_mutex_lock(&random_init_lock);
+	_random_close();
+	pthread_mutex_unlock(&random_init_lock);
 }
 
 int crypt_random_default_key_rng(void)
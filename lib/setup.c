@@ -27,6 +27,8 @@
 #include <stdarg.h>
 #include <sys/utsname.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "libcryptsetup.h"
 #include "luks1/luks.h"
@@ -44,6 +46,8 @@
 
 struct crypt_device {
 	char *type;
+	/* type from DM UUID, header load postponed by CRYPT_INIT_BY_NAME_NO_HEADER */
+	char *deferred_type;
 
 	struct device *device;
 	struct device *metadata_device;
@@ -64,6 +68,55 @@ struct crypt_device {
 	bool memory_hard_pbkdf_lock_enabled;
 	struct crypt_lock_handle *pbkdf_memory_hard_lock;
 
+	/* Reused metadata IO buffers, see crypt_metadata_buffer() */
+	struct {
+		void *buf;
+		size_t size;
+	} metadata_buffer[CRYPT_METADATA_BUFFERS];
+
+	/* Idle temporary dm-crypt devices of storage wrappers */
+	struct crypt_storage_wrapper *storage_wrapper_pool;
+
+	/* Token handlers referenced by this context (bitmap of handler table) */
+	uint32_t token_handlers_used;
+	/* Tokens validated by handler (bitmap), valid for header uuid and seqid only */
+	uint32_t token_validated;
+	uint64_t token_validated_seqid;
+	char token_validated_uuid[LUKS2_UUID_L];
+
+	/* Keyslot hint cache file of this context, global one if not set */
+	char *keyslot_hint_path;
+
+	/* Metadata lock statistics (reported on context release) */
+	struct {
+		uint64_t taken;
+		uint64_t contended;
+		uint64_t retries;
+		uint64_t wait_usec;
+		uint64_t lockless_reads;
+	} lock_stats;
+
+	/* Timing of last load and activation, see crypt_get_last_operation_stats() */
+	struct crypt_operation_stats op_stats;
+
+	/* NUMA node for parallel workers, see crypt_set_numa_node() */
+	int numa_node;
+
+	/* External reencryption journal, see crypt_reencrypt_set_journal_device() */
+	char *reencrypt_journal;
+
+	/* Concurrent CRYPT_ANY_TOKEN open timeout, 0 if disabled */
+	uint32_t token_concurrent_timeout;
+	/* Asynchronous token open timeout, 0 if disabled */
+	uint32_t token_timeout;
+
+	/* Volume key handoff in keyring, timeout in seconds, 0 if disabled */
+	uint32_t vk_handoff_timeout;
+	bool vk_handoff_active;
+
+	/* Resolved kernel keyring key serials (allocated on first use) */
+	struct keyring_cache *keyring_cache;
+
 	union {
 	struct { /* used in CRYPT_LUKS1 */
 		struct luks_phdr hdr;
@@ -129,6 +182,11 @@ struct crypt_device {
 	void *confirm_usrptr;
 };
 
+/*
+ * Crypto backend is shared by all contexts, initialisation
+ * can run from more threads at once.
+ */
+static pthread_mutex_t _crypto_lock = PTHREAD_MUTEX_INITIALIZER;
 /* Just to suppress redundant messages about crypto backend */
 static int _crypto_logged = 0;
 
@@ -145,6 +203,7 @@ static int _kernel_keyring_supported;
 
 /* Library allowed to use kernel keyring for loading VK in kernel crypto layer */
 static int _vk_via_keyring = 1;
+static int _private_udev_sync = 1;
 
 void crypt_set_debug_level(int level)
 {
@@ -206,6 +265,195 @@ static const char *data_device_path(struct crypt_device *cd)
 }
 
 /* internal only */
+/*
+ * Per-device aligned buffer for on-disk metadata processing.
+ * Buffer is zeroed, reused and grown if needed on every call,
+ * it is valid until the next call with the same index.
+ */
+void *crypt_metadata_buffer(struct crypt_device *cd, int idx, size_t size)
+{
+	size_t alloc_size;
+	void *buf;
+
+	if (!cd || idx < 0 || idx >= CRYPT_METADATA_BUFFERS || !size)
+		return NULL;
+
+	if (cd->metadata_buffer[idx].size < size) {
+		alloc_size = size_round_up(size, crypt_getpagesize());
+		if (posix_memalign(&buf, crypt_getpagesize(), alloc_size))
+			return NULL;
+		crypt_metadata_buffers_free(cd, idx);
+		cd->metadata_buffer[idx].buf = buf;
+		cd->metadata_buffer[idx].size = alloc_size;
+	}
+
+	memset(cd->metadata_buffer[idx].buf, 0, size);
+
+	return cd->metadata_buffer[idx].buf;
+}
+
+/* Wipe and release metadata buffer (or all buffers with negative idx) */
+void crypt_metadata_buffers_free(struct crypt_device *cd, int idx)
+{
+	int i;
+
+	if (!cd)
+		return;
+
+	for (i = 0; i < CRYPT_METADATA_BUFFERS; i++) {
+		if ((idx >= 0 && i != idx) || !cd->metadata_buffer[i].buf)
+			continue;
+		crypt_safe_memzero(cd->metadata_buffer[i].buf, cd->metadata_buffer[i].size);
+		free(cd->metadata_buffer[i].buf);
+		cd->metadata_buffer[i].buf = NULL;
+		cd->metadata_buffer[i].size = 0;
+	}
+}
+
+struct crypt_storage_wrapper **crypt_storage_wrapper_pool(struct crypt_device *cd)
+{
+	return cd ? &cd->storage_wrapper_pool : NULL;
+}
+
+uint32_t *crypt_token_handlers_used(struct crypt_device *cd)
+{
+	return cd ? &cd->token_handlers_used : NULL;
+}
+
+char **crypt_keyslot_hint_path(struct crypt_device *cd)
+{
+	return cd ? &cd->keyslot_hint_path : NULL;
+}
+
+/* Validation bitmap is dropped if header was changed (seqid) or other header (uuid) loaded */
+uint32_t *crypt_token_validated(struct crypt_device *cd, const char *uuid, uint64_t seqid)
+{
+	if (!cd || !uuid)
+		return NULL;
+
+	if (cd->token_validated_seqid != seqid ||
+	    strncmp(cd->token_validated_uuid, uuid, sizeof(cd->token_validated_uuid))) {
+		cd->token_validated = 0;
+		cd->token_validated_seqid = seqid;
+		strncpy(cd->token_validated_uuid, uuid, sizeof(cd->token_validated_uuid) - 1);
+		cd->token_validated_uuid[sizeof(cd->token_validated_uuid) - 1] = '\0';
+	}
+
+	return &cd->token_validated;
+}
+
+void crypt_lock_stats_add(struct crypt_device *cd, uint64_t wait_usec, bool contended, unsigned retries)
+{
+	if (!cd)
+		return;
+
+	cd->lock_stats.taken++;
+	cd->lock_stats.retries += retries;
+	cd->lock_stats.wait_usec += wait_usec;
+	if (contended)
+		cd->lock_stats.contended++;
+}
+
+void crypt_lock_stats_lockless_read(struct crypt_device *cd)
+{
+	if (cd)
+		cd->lock_stats.lockless_reads++;
+}
+
+uint64_t crypt_op_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void crypt_op_stats_add(struct crypt_device *cd, crypt_op_phase phase, uint64_t usec)
+{
+	if (!cd)
+		return;
+
+	switch (phase) {
+	case CRYPT_OP_TOKEN:
+		cd->op_stats.token_usec += usec;
+		break;
+	case CRYPT_OP_KDF:
+		cd->op_stats.kdf_usec += usec;
+		cd->op_stats.kdf_count++;
+		break;
+	case CRYPT_OP_DM:
+		cd->op_stats.dm_usec += usec;
+		break;
+	case CRYPT_OP_UDEV:
+		cd->op_stats.udev_usec += usec;
+		break;
+	}
+}
+
+/* Activation resets all counters except metadata load time */
+static uint64_t _op_stats_begin(struct crypt_device *cd)
+{
+	uint64_t load_usec = cd->op_stats.load_usec;
+
+	memset(&cd->op_stats, 0, sizeof(cd->op_stats));
+	cd->op_stats.load_usec = load_usec;
+
+	return crypt_op_usec();
+}
+
+static void _op_stats_end(struct crypt_device *cd, uint64_t start)
+{
+	cd->op_stats.total_usec = crypt_op_usec() - start;
+
+	log_dbg(cd, "Activation took %" PRIu64 " us (load %" PRIu64 " us, token %" PRIu64
+		" us, PBKDF %" PRIu64 " us in %" PRIu32 " runs, dm %" PRIu64 " us, udev %" PRIu64 " us).",
+		cd->op_stats.total_usec, cd->op_stats.load_usec, cd->op_stats.token_usec,
+		cd->op_stats.kdf_usec, cd->op_stats.kdf_count, cd->op_stats.dm_usec,
+		cd->op_stats.udev_usec);
+}
+
+int crypt_get_last_operation_stats(struct crypt_device *cd,
+	struct crypt_operation_stats *stats)
+{
+	if (!cd || !stats)
+		return -EINVAL;
+
+	*stats = cd->op_stats;
+
+	return 0;
+}
+
+uint32_t crypt_token_concurrent_timeout(struct crypt_device *cd)
+{
+	return cd ? cd->token_concurrent_timeout : 0;
+}
+
+uint32_t crypt_token_timeout(struct crypt_device *cd)
+{
+	return cd ? cd->token_timeout : 0;
+}
+
+/* Handoff is used only in operations where enabled */
+uint32_t crypt_volume_key_handoff_timeout(struct crypt_device *cd)
+{
+	return (cd && cd->vk_handoff_active) ? cd->vk_handoff_timeout : 0;
+}
+
+void crypt_volume_key_handoff_enable(struct crypt_device *cd, bool enable)
+{
+	if (cd)
+		cd->vk_handoff_active = enable;
+}
+
+/* Returns NULL if cache cannot be allocated, keyring functions then search directly */
+struct keyring_cache *crypt_keyring_cache(struct crypt_device *cd)
+{
+	if (cd && !cd->keyring_cache && keyring_cache_init(&cd->keyring_cache))
+		cd->keyring_cache = NULL;
+
+	return cd ? cd->keyring_cache : NULL;
+}
+
 struct device *crypt_metadata_device(struct crypt_device *cd)
 {
 	return cd->metadata_device ?: cd->device;
@@ -216,22 +464,22 @@ struct device *crypt_data_device(struct crypt_device *cd)
 	return cd->device;
 }
 
+/*
+ * RNG is opened on the first random data request (crypt_random_get),
+ * read-only queries (header load, UUID, status) do not need it.
+ */
 int init_crypto(struct crypt_device *ctx)
 {
 	struct utsname uts;
 	int r;
 
-	r = crypt_random_init(ctx);
-	if (r < 0) {
-		log_err(ctx, _("Cannot initialize crypto RNG backend."));
-		return r;
-	}
-
+	pthread_mutex_lock(&_crypto_lock);
 	r = crypt_backend_init();
 	if (r < 0)
 		log_err(ctx, _("Cannot initialize crypto backend."));
 
-	if (!r && !_crypto_logged) {
+	/* backend info is only logged, no need for uname without debug */
+	if (!r && !_crypto_logged && _debug_level <= CRYPT_LOG_DEBUG) {
 		log_dbg(ctx, "Crypto backend (%s) initialized in cryptsetup library version %s.",
 			crypt_backend_version(), PACKAGE_VERSION);
 		if (!uname(&uts))
@@ -239,6 +487,7 @@ int init_crypto(struct crypt_device *ctx)
 				uts.sysname, uts.release, uts.machine);
 		_crypto_logged = 1;
 	}
+	pthread_mutex_unlock(&_crypto_lock);
 
 	return r;
 }
@@ -323,10 +572,15 @@ static int isBITLK(const char *type)
 	return (type && !strcmp(CRYPT_BITLK, type));
 }
 
+static int _init_by_name_deferred(struct crypt_device *cd);
+
 static int _onlyLUKS(struct crypt_device *cd, uint32_t cdflags)
 {
 	int r = 0;
 
+	if (cd)
+		(void)_init_by_name_deferred(cd);
+
 	if (cd && !cd->type) {
 		if (!(cdflags & CRYPT_CD_QUIET))
 			log_err(cd, _("Cannot determine device type. Incompatible activation of device?"));
@@ -354,6 +608,9 @@ static int _onlyLUKS2(struct crypt_device *cd, uint32_t cdflags, uint32_t mask)
 {
 	int r = 0;
 
+	if (cd)
+		(void)_init_by_name_deferred(cd);
+
 	if (cd && !cd->type) {
 		if (!(cdflags & CRYPT_CD_QUIET))
 			log_err(cd, _("Cannot determine device type. Incompatible activation of device?"));
@@ -404,6 +661,8 @@ static void crypt_reset_null_type(struct crypt_device *cd)
 
 	free(cd->u.none.active_name);
 	cd->u.none.active_name = NULL;
+	free(cd->deferred_type);
+	cd->deferred_type = NULL;
 }
 
 /* keyslot helpers */
@@ -599,6 +858,7 @@ int crypt_init(struct crypt_device **cd, const char *device)
 	dm_backend_init(NULL);
 
 	h->rng_type = crypt_random_default_key_rng();
+	h->numa_node = CRYPT_NUMA_NODE_AUTO;
 
 	*cd = h;
 	return 0;
@@ -999,15 +1259,12 @@ static int _crypt_load_bitlk(struct crypt_device *cd,
 	return 0;
 }
 
-int crypt_load(struct crypt_device *cd,
+static int _crypt_load(struct crypt_device *cd,
 	       const char *requested_type,
 	       void *params)
 {
 	int r;
 
-	if (!cd)
-		return -EINVAL;
-
 	log_dbg(cd, "Trying to load %s crypt type from device %s.",
 		requested_type ?: "any", mdata_device_path(cd) ?: "(none)");
 
@@ -1056,6 +1313,87 @@ int crypt_load(struct crypt_device *cd,
 	return r;
 }
 
+int crypt_load(struct crypt_device *cd,
+	       const char *requested_type,
+	       void *params)
+{
+	uint64_t start;
+	int r;
+
+	if (!cd)
+		return -EINVAL;
+
+	memset(&cd->op_stats, 0, sizeof(cd->op_stats));
+	start = crypt_op_usec();
+
+	r = _crypt_load(cd, requested_type, params);
+
+	cd->op_stats.load_usec = crypt_op_usec() - start;
+
+	return r;
+}
+
+static int _luks_probe_load(struct crypt_device *cd, char *uuid, size_t uuid_size)
+{
+	int r;
+
+	r = crypt_load(cd, CRYPT_LUKS2, NULL);
+	if (!r && uuid && snprintf(uuid, uuid_size, "%s", crypt_get_uuid(cd) ?: "") >= (int)uuid_size)
+		r = -ENOMEM;
+
+	return r;
+}
+
+int crypt_luks_probe(struct crypt_device *cd,
+		     const char *requested_type,
+		     uint32_t flags,
+		     const char **type,
+		     char *uuid,
+		     size_t uuid_size)
+{
+	struct luks_phdr hdr;
+	const char *probed_type;
+	int r, version;
+
+	if (!cd || !crypt_metadata_device(cd) || (uuid && !uuid_size))
+		return -EINVAL;
+
+	if (requested_type && !isLUKS(requested_type))
+		return -EINVAL;
+
+	version = LUKS2_hdr_version_unlocked(cd, NULL);
+
+	if (version == 1 && (!requested_type || isLUKS1(requested_type))) {
+		probed_type = CRYPT_LUKS1;
+		r = LUKS_read_phdr(&hdr, 1, 0, cd);
+		if (!r && uuid && snprintf(uuid, uuid_size, "%s", hdr.uuid) >= (int)uuid_size)
+			r = -ENOMEM;
+		crypt_safe_memzero(&hdr, sizeof(hdr));
+	} else if (version == 2 && (!requested_type || isLUKS2(requested_type))) {
+		probed_type = CRYPT_LUKS2;
+		r = LUKS2_hdr_probe_unlocked(cd, uuid, uuid_size, flags & CRYPT_LUKS_PROBE_STRICT);
+		if (r == -EAGAIN) {
+			log_dbg(cd, "Binary headers do not match, loading full LUKS2 metadata.");
+			r = _luks_probe_load(cd, uuid, uuid_size);
+		}
+	} else if (!version && (flags & CRYPT_LUKS_PROBE_STRICT) &&
+		   (!requested_type || isLUKS2(requested_type))) {
+		/* primary header magic is damaged, only full load can use secondary LUKS2 header */
+		log_dbg(cd, "No primary LUKS header detected on %s, loading full LUKS2 metadata.",
+			mdata_device_path(cd));
+		probed_type = CRYPT_LUKS2;
+		r = _luks_probe_load(cd, uuid, uuid_size);
+	} else {
+		log_dbg(cd, "No LUKS header detected on %s.", mdata_device_path(cd));
+		return -EINVAL;
+	}
+
+	if (!r && type)
+		*type = probed_type;
+
+	return r;
+}
+
 /*
  * crypt_init() helpers
  */
@@ -1141,12 +1479,14 @@ static void crypt_free_type(struct crypt_device *cd)
 	} else if (!cd->type) {
 		free(cd->u.none.active_name);
 		cd->u.none.active_name = NULL;
+		free(cd->deferred_type);
+		cd->deferred_type = NULL;
 	}
 
 	crypt_set_null_type(cd);
 }
 
-static int _init_by_name_crypt(struct crypt_device *cd, const char *name)
+static int _init_by_name_crypt(struct crypt_device *cd, const char *name, uint32_t flags)
 {
 	bool found = false;
 	char **dep, *cipher_spec = NULL, cipher[MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN], deps_uuid_prefix[40], *deps[MAX_DM_DEPS+1] = {};
@@ -1262,6 +1602,13 @@ static int _init_by_name_crypt(struct crypt_device *cd, const char *name)
 		if (tgt->u.crypt.vk->keylength % key_nums)
 			key_nums++;
 		cd->u.loopaes.key_size = tgt->u.crypt.vk->keylength / key_nums;
+	} else if ((isLUKS1(cd->type) || isLUKS2(cd->type) || isBITLK(cd->type)) &&
+		   (flags & CRYPT_INIT_BY_NAME_NO_HEADER)) {
+		log_dbg(cd, "Postponing %s header load for active device %s.", cd->type, name);
+		if (crypt_metadata_device(cd))
+			MOVE_REF(cd->deferred_type, cd->type);
+		else
+			crypt_set_null_type(cd);
 	} else if (isLUKS1(cd->type) || isLUKS2(cd->type)) {
 		if (crypt_metadata_device(cd)) {
 			r = _crypt_load_luks(cd, cd->type, 0, 0);
@@ -1310,6 +1657,62 @@ out:
 	return r;
 }
 
+/*
+ * Load header postponed by CRYPT_INIT_BY_NAME_NO_HEADER. It is tried only once,
+ * on failure the context stays without type (as if the header was not found).
+ */
+static int _init_by_name_deferred(struct crypt_device *cd)
+{
+	struct crypt_dm_active_device dmd = {};
+	char *name;
+	int r;
+
+	if (cd->type || !cd->deferred_type || !cd->u.none.active_name)
+		return 0;
+
+	log_dbg(cd, "Loading postponed %s header for active device %s.",
+		cd->deferred_type, cd->u.none.active_name);
+
+	r = dm_query_device(cd, cd->u.none.active_name, DM_ACTIVE_UUID, &dmd);
+	if (r < 0) {
+		free(cd->deferred_type);
+		cd->deferred_type = NULL;
+		return r;
+	}
+
+	/* none and header-specific data share the same union */
+	name = cd->u.none.active_name;
+	memset(&cd->u, 0, sizeof(cd->u));
+	MOVE_REF(cd->type, cd->deferred_type);
+
+	if (isBITLK(cd->type)) {
+		r = _crypt_load_bitlk(cd, NULL);
+		if (r < 0)
+			log_dbg(cd, "BITLK device header not available.");
+	} else {
+		r = _crypt_load_luks(cd, cd->type, 0, 0);
+		if (r < 0)
+			log_dbg(cd, "LUKS device header does not match active device.");
+		else if (crypt_uuid_cmp(dmd.uuid, LUKS_UUID(cd)) < 0) {
+			log_dbg(cd, "LUKS device header uuid: %s mismatches DM returned uuid %s",
+				LUKS_UUID(cd), dmd.uuid);
+			crypt_free_type(cd);
+			r = -EINVAL;
+		}
+	}
+
+	if (r < 0) {
+		crypt_set_null_type(cd);
+		device_close(cd, cd->metadata_device);
+		device_close(cd, cd->device);
+		cd->u.none.active_name = name;
+	} else
+		free(name);
+
+	free(CONST_CAST(void*)dmd.uuid);
+	return r;
+}
+
 static int _init_by_name_verity(struct crypt_device *cd, const char *name)
 {
 	struct crypt_dm_active_device dmd;
@@ -1403,16 +1806,17 @@ out:
 	return r;
 }
 
-int crypt_init_by_name_and_header(struct crypt_device **cd,
-				  const char *name,
-				  const char *header_device)
+int crypt_init_by_name_flags(struct crypt_device **cd,
+			     const char *name,
+			     const char *header_device,
+			     uint32_t flags)
 {
 	crypt_status_info ci;
 	struct crypt_dm_active_device dmd;
 	struct dm_target *tgt = &dmd.segment;
 	int r;
 
-	if (!cd || !name)
+	if (!cd || !name || (flags & ~CRYPT_INIT_BY_NAME_NO_HEADER))
 		return -EINVAL;
 
 	log_dbg(NULL, "Allocating crypt device context by device %s.", name);
@@ -1481,7 +1885,7 @@ int crypt_init_by_name_and_header(struct crypt_device **cd,
 	/* Try to initialize basic parameters from active device */
 
 	if (tgt->type == DM_CRYPT || tgt->type == DM_LINEAR)
-		r = _init_by_name_crypt(*cd, name);
+		r = _init_by_name_crypt(*cd, name, flags);
 	else if (tgt->type == DM_VERITY)
 		r = _init_by_name_verity(*cd, name);
 	else if (tgt->type == DM_INTEGRITY)
@@ -1500,9 +1904,16 @@ out:
 	return r;
 }
 
+int crypt_init_by_name_and_header(struct crypt_device **cd,
+				  const char *name,
+				  const char *header_device)
+{
+	return crypt_init_by_name_flags(cd, name, header_device, 0);
+}
+
 int crypt_init_by_name(struct crypt_device **cd, const char *name)
 {
-	return crypt_init_by_name_and_header(cd, name, NULL);
+	return crypt_init_by_name_flags(cd, name, NULL, 0);
 }
 
 /*
@@ -2821,10 +3232,35 @@ out:
 	return r;
 }
 
+/*
+ * Reload already queried active table (including key) with changed size only.
+ * The same checks as in _reload_device() but without repeating the query.
+ */
+static int _resize_active_table(struct crypt_device *cd, const char *name,
+				struct crypt_dm_active_device *sdmd,
+				struct crypt_dm_active_device *tdmd,
+				uint32_t active_ro)
+{
+	int r;
+
+	r = crypt_compare_dm_devices(cd, sdmd, tdmd);
+	if (r) {
+		log_err(cd, _("Mismatching parameters on device %s."), name);
+		return r;
+	}
+
+	/* Changing read only flag for active device makes no sense */
+	tdmd->flags = (sdmd->flags & ~CRYPT_ACTIVATE_READONLY) | active_ro;
+	tdmd->segment.size = tdmd->size = sdmd->size;
+
+	return dm_reload_device(cd, name, tdmd, 0, 1);
+}
+
 int crypt_resize(struct crypt_device *cd, const char *name, uint64_t new_size)
 {
 	struct crypt_dm_active_device dmdq, dmd = {};
 	struct dm_target *tgt = &dmdq.segment;
+	uint32_t active_ro;
 	int r;
 
 	/*
@@ -2843,7 +3279,13 @@ int crypt_resize(struct crypt_device *cd, const char *name, uint64_t new_size)
 
 	log_dbg(cd, "Resizing device %s to %" PRIu64 " sectors.", name, new_size);
 
-	r = dm_query_device(cd, name, DM_ACTIVE_CRYPT_KEYSIZE | DM_ACTIVE_CRYPT_KEY, &dmdq);
+	/* underlying device could be resized since the properties were cached */
+	device_topology_invalidate(crypt_data_device(cd));
+
+	/* Active table is parsed only once and reused for reload */
+	r = dm_query_device(cd, name, DM_ACTIVE_DEVICE | DM_ACTIVE_CRYPT_CIPHER |
+			    DM_ACTIVE_UUID | DM_ACTIVE_CRYPT_KEYSIZE |
+			    DM_ACTIVE_CRYPT_KEY, &dmdq);
 	if (r < 0) {
 		log_err(cd, _("Device %s is not active."), name);
 		return -EINVAL;
@@ -2853,6 +3295,7 @@ int crypt_resize(struct crypt_device *cd, const char *name, uint64_t new_size)
 		r = -EINVAL;
 		goto out;
 	}
+	active_ro = dmdq.flags & CRYPT_ACTIVATE_READONLY;
 
 	if ((dmdq.flags & CRYPT_ACTIVATE_KEYRING_KEY) && !crypt_key_in_keyring(cd)) {
 		r = -EPERM;
@@ -2880,10 +3323,15 @@ int crypt_resize(struct crypt_device *cd, const char *name, uint64_t new_size)
 			log_err(cd, _("Cannot resize loop device."));
 	}
 
-	r = device_block_adjust(cd, crypt_data_device(cd), DEV_OK,
-				crypt_get_data_offset(cd), &new_size, &dmdq.flags);
-	if (r)
-		goto out;
+	/* Shrinking active mapping cannot exceed already validated device geometry */
+	if (new_size && new_size <= dmdq.size)
+		log_dbg(cd, "Skipping data device size check for shrinking device.");
+	else {
+		r = device_block_adjust(cd, crypt_data_device(cd), DEV_OK,
+					crypt_get_data_offset(cd), &new_size, &dmdq.flags);
+		if (r)
+			goto out;
+	}
 
 	if (MISALIGNED(new_size, tgt->u.crypt.sector_size >> SECTOR_SHIFT)) {
 		log_err(cd, _("Device size is not aligned to requested sector size."));
@@ -2917,12 +3365,15 @@ int crypt_resize(struct crypt_device *cd, const char *name, uint64_t new_size)
 			r = -ENOTSUP;
 		else if (isLUKS2(cd->type))
 			r = LUKS2_unmet_requirements(cd, &cd->u.luks2.hdr, 0, 0);
-		if (!r)
+		if (!r && tgt->u.crypt.tag_size)
 			r = _reload_device(cd, name, &dmd);
+		else if (!r)
+			r = _resize_active_table(cd, name, &dmd, &dmdq, active_ro);
 	}
 out:
 	dm_targets_free(cd, &dmd);
 	dm_targets_free(cd, &dmdq);
+	free(CONST_CAST(void*)dmdq.uuid);
 
 	return r;
 }
@@ -3078,6 +3529,15 @@ void crypt_free(struct crypt_device *cd)
 
 	log_dbg(cd, "Releasing crypt device %s context.", mdata_device_path(cd));
 
+	if (cd->lock_stats.taken || cd->lock_stats.lockless_reads)
+		log_dbg(cd, "Metadata locks taken %" PRIu64 " (contended %" PRIu64 ", retries %" PRIu64
+			", waited %" PRIu64 " us), lockless header reads %" PRIu64 ".",
+			cd->lock_stats.taken, cd->lock_stats.contended, cd->lock_stats.retries,
+			cd->lock_stats.wait_usec, cd->lock_stats.lockless_reads);
+
+	crypt_storage_wrapper_pool_free(cd);
+	crypt_token_handlers_release(cd);
+
 	dm_backend_exit(cd);
 	crypt_free_volume_key(cd->volume_key);
 
@@ -3089,6 +3549,16 @@ void crypt_free(struct crypt_device *cd)
 	free(CONST_CAST(void*)cd->pbkdf.type);
 	free(CONST_CAST(void*)cd->pbkdf.hash);
 
+	/* Drop cached PBKDF working memory */
+	crypt_pbkdf_arena_release();
+
+	crypt_metadata_buffers_free(cd, -1);
+
+	keyring_cache_free(cd->keyring_cache);
+
+	free(cd->reencrypt_journal);
+	free(cd->keyslot_hint_path);
+
 	/* Some structures can contain keys (TCRYPT), wipe it */
 	crypt_safe_memzero(cd, sizeof(*cd));
 	free(cd);
@@ -3247,8 +3717,11 @@ int crypt_resume_by_passphrase(struct crypt_device *cd,
 	if (isLUKS1(cd->type))
 		r = LUKS_open_key_with_hdr(keyslot, passphrase, passphrase_size,
 					   &cd->u.luks1.hdr, &vk, cd);
-	else
+	else {
+		crypt_volume_key_handoff_enable(cd, true);
 		r = LUKS2_keyslot_open(cd, keyslot, CRYPT_DEFAULT_SEGMENT, passphrase, passphrase_size, &vk);
+		crypt_volume_key_handoff_enable(cd, false);
+	}
 
 	if  (r < 0)
 		return r;
@@ -3301,8 +3774,11 @@ int crypt_resume_by_keyfile_device_offset(struct crypt_device *cd,
 	if (isLUKS1(cd->type))
 		r = LUKS_open_key_with_hdr(keyslot, passphrase_read, passphrase_size_read,
 					   &cd->u.luks1.hdr, &vk, cd);
-	else
+	else {
+		crypt_volume_key_handoff_enable(cd, true);
 		r = LUKS2_keyslot_open(cd, keyslot, CRYPT_DEFAULT_SEGMENT, passphrase_read, passphrase_size_read, &vk);
+		crypt_volume_key_handoff_enable(cd, false);
+	}
 
 	crypt_safe_free(passphrase_read);
 	if (r < 0)
@@ -3470,22 +3946,119 @@ out:
 	return keyslot;
 }
 
-int crypt_keyslot_change_by_passphrase(struct crypt_device *cd,
-	int keyslot_old,
-	int keyslot_new,
+int crypt_keyslot_add_by_passphrase_batch(struct crypt_device *cd,
 	const char *passphrase,
 	size_t passphrase_size,
-	const char *new_passphrase,
-	size_t new_passphrase_size)
+	const char * const *new_passphrases,
+	const size_t *new_passphrase_sizes,
+	int *keyslots,
+	size_t count)
 {
-	int digest = -1, r, keyslot_new_orig = keyslot_new;
+	int digest, i, j, r, active_slots;
 	struct luks2_keyslot_params params;
 	struct volume_key *vk = NULL;
+	size_t n;
 
-	if (!passphrase || !new_passphrase)
-		return -EINVAL;
+	log_dbg(cd, "Adding %zu new keyslots in batch.", count);
 
-	log_dbg(cd, "Changing passphrase from old keyslot %d to new %d.",
+	if ((r = onlyLUKS2(cd)))
+		return r;
+
+	if (!passphrase || !new_passphrases || !new_passphrase_sizes || !keyslots ||
+	    !count || count > (size_t)crypt_keyslot_max(CRYPT_LUKS2))
+		return -EINVAL;
+
+	for (n = 0; n < count; n++)
+		if (!new_passphrases[n])
+			return -EINVAL;
+
+	/* explicitly requested keyslots first, then fill free ones in order */
+	for (n = 0; n < count; n++) {
+		if (keyslots[n] == CRYPT_ANY_SLOT)
+			continue;
+		if ((r = keyslot_verify_or_find_empty(cd, &keyslots[n])))
+			return r;
+		for (j = 0; j < (int)n; j++)
+			if (keyslots[j] == keyslots[n]) {
+				log_err(cd, _("Key slot %d is requested more than once."), keyslots[n]);
+				return -EINVAL;
+			}
+	}
+
+	for (i = 0, n = 0; n < count; n++) {
+		if (keyslots[n] != CRYPT_ANY_SLOT)
+			continue;
+		for (; i < crypt_keyslot_max(CRYPT_LUKS2); i++) {
+			if (LUKS2_keyslot_info(&cd->u.luks2.hdr, i) != CRYPT_SLOT_INACTIVE)
+				continue;
+			for (j = 0; j < (int)count; j++)
+				if (keyslots[j] == i)
+					break;
+			if (j == (int)count)
+				break;
+		}
+		if (i == crypt_keyslot_max(CRYPT_LUKS2)) {
+			log_err(cd, _("All key slots full."));
+			return -EINVAL;
+		}
+		keyslots[n] = i++;
+	}
+
+	active_slots = LUKS2_keyslot_active_count(&cd->u.luks2.hdr, CRYPT_DEFAULT_SEGMENT);
+	if (active_slots == 0) {
+		/* No slots used, try to use pre-generated key in header */
+		if (cd->volume_key) {
+			vk = crypt_alloc_volume_key(cd->volume_key->keylength, cd->volume_key->key);
+			r = vk ? 0 : -ENOMEM;
+		} else {
+			log_err(cd, _("Cannot add key slot, all slots disabled and no volume key provided."));
+			return -EINVAL;
+		}
+	} else if (active_slots < 0)
+		return -EINVAL;
+	else
+		r = LUKS2_keyslot_open(cd, CRYPT_ANY_SLOT, CRYPT_DEFAULT_SEGMENT, passphrase,
+				       passphrase_size, &vk);
+	if (r < 0)
+		goto out;
+
+	r = LUKS2_digest_verify_by_segment(cd, &cd->u.luks2.hdr, CRYPT_DEFAULT_SEGMENT, vk);
+	digest = r;
+
+	if (r >= 0)
+		r = LUKS2_keyslot_params_default(cd, &cd->u.luks2.hdr, &params);
+
+	for (n = 0; n < count && r >= 0; n++)
+		r = LUKS2_digest_assign(cd, &cd->u.luks2.hdr, keyslots[n], digest, 1, 0);
+
+	if (r >= 0)
+		r = LUKS2_keyslot_store_batch(cd, &cd->u.luks2.hdr, keyslots, new_passphrases,
+					      new_passphrase_sizes, count, vk, &params);
+out:
+	crypt_free_volume_key(vk);
+	if (r < 0) {
+		_luks2_reload(cd);
+		return r;
+	}
+	return 0;
+}
+
+int crypt_keyslot_change_by_passphrase(struct crypt_device *cd,
+	int keyslot_old,
+	int keyslot_new,
+	const char *passphrase,
+	size_t passphrase_size,
+	const char *new_passphrase,
+	size_t new_passphrase_size)
+{
+	int digest = -1, r, keyslot_new_orig = keyslot_new;
+	struct luks2_keyslot_params params;
+	struct volume_key *vk = NULL;
+
+	if (!passphrase || !new_passphrase)
+		return -EINVAL;
+
+	log_dbg(cd, "Changing passphrase from old keyslot %d to new %d.",
 		keyslot_old, keyslot_new);
 
 	if ((r = onlyLUKS(cd)))
@@ -3846,6 +4419,9 @@ static int _create_device_with_integrity(struct crypt_device *cd,
 	if (r)
 		return r;
 
+	/* In activation batch, integrity device node must exist before it is used */
+	dm_udev_batch_sync();
+
 	r = device_alloc(cd, &device, ipath);
 	if (r < 0)
 		goto out;
@@ -3858,7 +4434,7 @@ static int _create_device_with_integrity(struct crypt_device *cd,
 		r = dm_create_device(cd, name, type, dmd);
 out:
 	if (r < 0)
-		dm_remove_device(cd, iname, 0);
+		dm_remove_device(cd, iname, DM_DEACTIVATE_PRIVATE);
 
 	device_free(cd, device);
 	return r;
@@ -3969,24 +4545,15 @@ static int load_all_keys(struct crypt_device *cd, struct luks2_hdr *hdr, struct
 int update_reencryption_flag(struct crypt_device *cd, int enable, bool commit);
 
 /* TODO: This function should 1:1 with pre-reencryption code */
-static int _open_and_activate(struct crypt_device *cd,
+/* Activate LUKS2 device with volume key unlocked from keyslot, vk is not released */
+static int _activate_luks2_unlocked(struct crypt_device *cd,
 	int keyslot,
 	const char *name,
-	const char *passphrase,
-	size_t passphrase_size,
+	struct volume_key *vk,
 	uint32_t flags)
 {
 	bool use_keyring;
-	int r;
-	struct volume_key *vk = NULL;
-
-	r = LUKS2_keyslot_open(cd, keyslot,
-			       (flags & CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY) ?
-			       CRYPT_ANY_SEGMENT : CRYPT_DEFAULT_SEGMENT,
-			       passphrase, passphrase_size, &vk);
-	if (r < 0)
-		return r;
-	keyslot = r;
+	int r = 0;
 
 	if (!crypt_use_keyring_for_vk(cd))
 		use_keyring = false;
@@ -4007,11 +4574,33 @@ static int _open_and_activate(struct crypt_device *cd,
 out:
 	if (r < 0)
 		crypt_drop_keyring_key(cd, vk);
-	crypt_free_volume_key(vk);
 
 	return r < 0 ? r : keyslot;
 }
 
+static int _open_and_activate(struct crypt_device *cd,
+	int keyslot,
+	const char *name,
+	const char *passphrase,
+	size_t passphrase_size,
+	uint32_t flags)
+{
+	int r;
+	struct volume_key *vk = NULL;
+
+	r = LUKS2_keyslot_open(cd, keyslot,
+			       (flags & CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY) ?
+			       CRYPT_ANY_SEGMENT : CRYPT_DEFAULT_SEGMENT,
+			       passphrase, passphrase_size, &vk);
+	if (r < 0)
+		return r;
+
+	r = _activate_luks2_unlocked(cd, r, name, vk, flags);
+	crypt_free_volume_key(vk);
+
+	return r;
+}
+
 static int _open_all_keys(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int keyslot,
@@ -4190,6 +4779,8 @@ static int _activate_by_passphrase(struct crypt_device *cd,
 	if ((flags & CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY) && name)
 		return -EINVAL;
 
+	(void)_init_by_name_deferred(cd);
+
 	r = _check_header_data_overlap(cd, name);
 	if (r < 0)
 		return r;
@@ -4197,6 +4788,10 @@ static int _activate_by_passphrase(struct crypt_device *cd,
 	if (flags & CRYPT_ACTIVATE_SERIALIZE_MEMORY_HARD_PBKDF)
 		cd->memory_hard_pbkdf_lock_enabled = true;
 
+	/* only check of passphrase must run keyslot KDF */
+	if (name)
+		crypt_volume_key_handoff_enable(cd, true);
+
 	/* plain, use hashed passphrase */
 	if (isPLAIN(cd->type)) {
 		r = -EINVAL;
@@ -4236,6 +4831,7 @@ out:
 	crypt_free_volume_key(vk);
 
 	cd->memory_hard_pbkdf_lock_enabled = false;
+	crypt_volume_key_handoff_enable(cd, false);
 
 	return r < 0 ? r : keyslot;
 }
@@ -4294,6 +4890,7 @@ int crypt_activate_by_passphrase(struct crypt_device *cd,
 	size_t passphrase_size,
 	uint32_t flags)
 {
+	uint64_t start;
 	int r;
 
 	if (!cd || !passphrase || (!name && (flags & CRYPT_ACTIVATE_REFRESH)))
@@ -4307,7 +4904,82 @@ int crypt_activate_by_passphrase(struct crypt_device *cd,
 	if (r < 0)
 		return r;
 
-	return _activate_by_passphrase(cd, name, keyslot, passphrase, passphrase_size, flags);
+	start = _op_stats_begin(cd);
+	r = _activate_by_passphrase(cd, name, keyslot, passphrase, passphrase_size, flags);
+	_op_stats_end(cd, start);
+
+	return r;
+}
+
+/*
+ * Split passphrase activation for parallel unlock (utils_activate_multi.c):
+ * checks and activation run in caller thread, only keyslot unlock in workers.
+ */
+int crypt_activate_unlocked_check(struct crypt_device *cd, const char *name, uint32_t flags)
+{
+	int r;
+
+	if (!cd || (!name && (flags & CRYPT_ACTIVATE_REFRESH)))
+		return -EINVAL;
+
+	if ((flags & CRYPT_ACTIVATE_KEYRING_KEY) && !crypt_use_keyring_for_vk(cd))
+		return -EINVAL;
+
+	if ((flags & CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY) && name)
+		return -EINVAL;
+
+	r = _activate_check_status(cd, name, flags & CRYPT_ACTIVATE_REFRESH);
+	if (r < 0)
+		return r;
+
+	return _check_header_data_overlap(cd, name);
+}
+
+/* Returns -ENOTSUP if device must be activated by passphrase in one step */
+int crypt_unlock_volume_key(struct crypt_device *cd,
+	int keyslot,
+	const char *passphrase,
+	size_t passphrase_size,
+	uint32_t flags,
+	struct volume_key **vk)
+{
+	int r = -ENOTSUP;
+
+	/* the same as in activation, unlock in worker thread takes the lock too */
+	if (flags & CRYPT_ACTIVATE_SERIALIZE_MEMORY_HARD_PBKDF)
+		cd->memory_hard_pbkdf_lock_enabled = true;
+
+	if (isLUKS1(cd->type))
+		r = LUKS_open_key_with_hdr(keyslot, passphrase, passphrase_size,
+					   &cd->u.luks1.hdr, vk, cd);
+	else if (isLUKS2(cd->type) && LUKS2_reencrypt_status(&cd->u.luks2.hdr) == CRYPT_REENCRYPT_NONE)
+		r = LUKS2_keyslot_open(cd, keyslot,
+				       (flags & CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY) ?
+				       CRYPT_ANY_SEGMENT : CRYPT_DEFAULT_SEGMENT,
+				       passphrase, passphrase_size, vk);
+
+	cd->memory_hard_pbkdf_lock_enabled = false;
+
+	return r;
+}
+
+int crypt_activate_unlocked(struct crypt_device *cd,
+	const char *name,
+	int keyslot,
+	struct volume_key *vk,
+	uint32_t flags)
+{
+	int r;
+
+	log_dbg(cd, "%s volume %s [keyslot %d] using unlocked volume key.",
+		name ? "Activating" : "Checking", name ?: "passphrase", keyslot);
+
+	if (isLUKS2(cd->type))
+		return _activate_luks2_unlocked(cd, keyslot, name, vk, flags);
+
+	r = name ? LUKS1_activate(cd, name, vk, flags) : 0;
+
+	return r < 0 ? r : keyslot;
 }
 
 int crypt_activate_by_keyfile_device_offset(struct crypt_device *cd,
@@ -4320,6 +4992,7 @@ int crypt_activate_by_keyfile_device_offset(struct crypt_device *cd,
 {
 	char *passphrase_read = NULL;
 	size_t passphrase_size_read;
+	uint64_t start;
 	int r;
 
 	if (!cd || !keyfile ||
@@ -4333,6 +5006,8 @@ int crypt_activate_by_keyfile_device_offset(struct crypt_device *cd,
 	if (r < 0)
 		return r;
 
+	start = _op_stats_begin(cd);
+
 	r = crypt_keyfile_device_read(cd, keyfile,
 				&passphrase_read, &passphrase_size_read,
 				keyfile_offset, keyfile_size, 0);
@@ -4345,6 +5020,7 @@ int crypt_activate_by_keyfile_device_offset(struct crypt_device *cd,
 		r = _activate_by_passphrase(cd, name, keyslot, passphrase_read, passphrase_size_read, flags);
 
 out:
+	_op_stats_end(cd, start);
 	crypt_safe_free(passphrase_read);
 	return r;
 }
@@ -4371,7 +5047,7 @@ int crypt_activate_by_keyfile_offset(struct crypt_device *cd,
 	return crypt_activate_by_keyfile_device_offset(cd, name, keyslot, keyfile,
 					keyfile_size, keyfile_offset, flags);
 }
-int crypt_activate_by_volume_key(struct crypt_device *cd,
+static int _activate_by_volume_key(struct crypt_device *cd,
 	const char *name,
 	const char *volume_key,
 	size_t volume_key_size,
@@ -4385,6 +5061,8 @@ int crypt_activate_by_volume_key(struct crypt_device *cd,
 	    ((flags & CRYPT_ACTIVATE_KEYRING_KEY) && !crypt_use_keyring_for_vk(cd)))
 		return -EINVAL;
 
+	(void)_init_by_name_deferred(cd);
+
 	log_dbg(cd, "%s volume %s by volume key.", name ? "Activating" : "Checking",
 		name ?: "");
 
@@ -4503,6 +5181,25 @@ int crypt_activate_by_volume_key(struct crypt_device *cd,
 	return r;
 }
 
+int crypt_activate_by_volume_key(struct crypt_device *cd,
+	const char *name,
+	const char *volume_key,
+	size_t volume_key_size,
+	uint32_t flags)
+{
+	uint64_t start;
+	int r;
+
+	if (!cd)
+		return -EINVAL;
+
+	start = _op_stats_begin(cd);
+	r = _activate_by_volume_key(cd, name, volume_key, volume_key_size, flags);
+	_op_stats_end(cd, start);
+
+	return r;
+}
+
 int crypt_activate_by_signed_key(struct crypt_device *cd,
 	const char *name,
 	const char *volume_key,
@@ -4574,6 +5271,16 @@ int crypt_activate_by_signed_key(struct crypt_device *cd,
 	return r;
 }
 
+int crypt_activate_batch_begin(void)
+{
+	return dm_udev_batch_begin();
+}
+
+int crypt_activate_batch_end(void)
+{
+	return dm_udev_batch_end();
+}
+
 int crypt_deactivate_by_name(struct crypt_device *cd, const char *name, uint32_t flags)
 {
 	struct crypt_device *fake_cd = NULL;
@@ -4655,6 +5362,90 @@ int crypt_deactivate(struct crypt_device *cd, const char *name)
 	return crypt_deactivate_by_name(cd, name, 0);
 }
 
+int crypt_deactivate_by_names(const char * const *names, size_t count, uint32_t flags)
+{
+	crypt_status_info ci;
+	bool *done, progress, batch;
+	size_t i, left = count;
+	int r, r_first = 0;
+
+	if (!names || !count)
+		return -EINVAL;
+
+	done = calloc(count, sizeof(*done));
+	if (!done)
+		return -ENOMEM;
+
+	/* caller may already run own batch */
+	batch = !dm_udev_batch_begin();
+
+	/* postpone busy devices until their holders in the list are removed */
+	do {
+		progress = false;
+		for (i = 0; i < count; i++) {
+			if (done[i])
+				continue;
+
+			ci = names[i] ? crypt_status(NULL, names[i]) : CRYPT_INACTIVE;
+			if (ci == CRYPT_INACTIVE) {
+				done[i] = true;
+				left--;
+				continue;
+			}
+
+			if (ci == CRYPT_BUSY &&
+			    !(flags & (CRYPT_DEACTIVATE_DEFERRED | CRYPT_DEACTIVATE_FORCE)))
+				continue;
+
+			r = crypt_deactivate_by_name(NULL, names[i], flags);
+			if (r < 0 && !r_first)
+				r_first = r;
+			done[i] = true;
+			left--;
+			progress = true;
+		}
+	} while (left && progress);
+
+	/* the rest is still in use, report it */
+	for (i = 0; i < count && left; i++) {
+		if (done[i])
+			continue;
+		r = crypt_deactivate_by_name(NULL, names[i], flags);
+		if (r < 0 && !r_first)
+			r_first = r;
+	}
+
+	if (batch)
+		dm_udev_batch_end();
+
+	free(done);
+	return r_first;
+}
+
+static void active_device_offsets(const struct crypt_dm_active_device *dmd,
+				  struct crypt_active_device *cad)
+{
+	const struct dm_target *tgt = &dmd->segment;
+	uint64_t min_offset = UINT64_MAX;
+
+	while (tgt) {
+		if (tgt->type == DM_CRYPT && (min_offset > tgt->u.crypt.offset)) {
+			min_offset = tgt->u.crypt.offset;
+			cad->iv_offset = tgt->u.crypt.iv_offset;
+		} else if (tgt->type == DM_INTEGRITY && (min_offset > tgt->u.integrity.offset)) {
+			min_offset = tgt->u.integrity.offset;
+			cad->iv_offset = 0;
+		} else if (tgt->type == DM_LINEAR && (min_offset > tgt->u.linear.offset)) {
+			min_offset = tgt->u.linear.offset;
+			cad->iv_offset = 0;
+		}
+		tgt = tgt->next;
+	}
+
+	if (min_offset != UINT64_MAX)
+		cad->offset = min_offset;
+}
+
 int crypt_get_active_device(struct crypt_device *cd, const char *name,
 			    struct crypt_active_device *cad)
 {
@@ -4662,7 +5453,6 @@ int crypt_get_active_device(struct crypt_device *cd, const char *name,
 	struct crypt_dm_active_device dmd, dmdi = {};
 	const char *namei = NULL;
 	struct dm_target *tgt = &dmd.segment;
-	uint64_t min_offset = UINT64_MAX;
 
 	if (!cd || !name || !cad)
 		return -EINVAL;
@@ -4671,63 +5461,268 @@ int crypt_get_active_device(struct crypt_device *cd, const char *name,
 	if (r < 0)
 		return r;
 
-	/* For LUKS2 with integrity we need flags from underlying dm-integrity */
-	if (isLUKS2(cd->type) && crypt_get_integrity_tag_size(cd) && single_segment(&dmd)) {
-		namei = device_dm_name(tgt->data_device);
-		if (namei && dm_query_device(cd, namei, 0, &dmdi) >= 0)
-			dmd.flags |= dmdi.flags;
-	}
+	/* For LUKS2 with integrity we need flags from underlying dm-integrity */
+	if (isLUKS2(cd->type) && crypt_get_integrity_tag_size(cd) && single_segment(&dmd)) {
+		namei = device_dm_name(tgt->data_device);
+		if (namei && dm_query_device(cd, namei, 0, &dmdi) >= 0)
+			dmd.flags |= dmdi.flags;
+	}
+
+	if (cd && isTCRYPT(cd->type)) {
+		cad->offset	= TCRYPT_get_data_offset(cd, &cd->u.tcrypt.hdr, &cd->u.tcrypt.params);
+		cad->iv_offset	= TCRYPT_get_iv_offset(cd, &cd->u.tcrypt.hdr, &cd->u.tcrypt.params);
+	} else
+		active_device_offsets(&dmd, cad);
+
+	cad->size	= dmd.size;
+	cad->flags	= dmd.flags;
+
+	r = 0;
+	dm_targets_free(cd, &dmd);
+	dm_targets_free(cd, &dmdi);
+
+	return r;
+}
+
+struct active_devices_list {
+	struct crypt_active_device_entry *entries;
+	size_t count;
+};
+
+static int active_devices_add(struct crypt_device *cd, const char *name,
+			      struct crypt_dm_active_device *dmd, int busy, void *usrptr)
+{
+	struct active_devices_list *list = usrptr;
+	struct crypt_active_device_entry *entry, *entries;
+	size_t type_len;
+
+	entries = realloc(list->entries, (list->count + 1) * sizeof(*entries));
+	if (!entries)
+		return -ENOMEM;
+	list->entries = entries;
+
+	entry = &entries[list->count];
+	memset(entry, 0, sizeof(*entry));
+
+	/* DM-UUID (without CRYPT- prefix) starts with device type */
+	type_len = strcspn(dmd->uuid, "-");
+	entry->name = strdup(name);
+	entry->type = strndup(dmd->uuid, type_len);
+	if (!entry->name || !entry->type) {
+		free(entry->name);
+		free(entry->type);
+		return -ENOMEM;
+	}
+
+	entry->status = busy ? CRYPT_BUSY : CRYPT_ACTIVE;
+	active_device_offsets(dmd, &entry->info);
+	entry->info.size = dmd->size;
+	entry->info.flags = dmd->flags;
+
+	list->count++;
+	return 0;
+}
+
+int crypt_list_active_devices(struct crypt_device *cd,
+			      struct crypt_active_device_entry **entries,
+			      size_t *count)
+{
+	struct active_devices_list list = {};
+	int r;
+
+	if (!entries || !count)
+		return -EINVAL;
+
+	if (!cd)
+		dm_backend_init(cd);
+
+	r = dm_query_devices(cd, DM_ACTIVE_DEVICE, active_devices_add, &list);
+
+	if (!cd)
+		dm_backend_exit(cd);
+
+	if (r < 0) {
+		crypt_free_active_devices(list.entries, list.count);
+		return r;
+	}
+
+	*entries = list.entries;
+	*count = list.count;
+
+	return 0;
+}
+
+void crypt_free_active_devices(struct crypt_active_device_entry *entries, size_t count)
+{
+	size_t i;
+
+	if (!entries)
+		return;
+
+	for (i = 0; i < count; i++) {
+		free(entries[i].name);
+		free(entries[i].type);
+	}
+	free(entries);
+}
+
+uint64_t crypt_get_active_integrity_failures(struct crypt_device *cd, const char *name)
+{
+	struct crypt_dm_active_device dmd;
+	uint64_t failures = 0;
+
+	if (!name)
+		return 0;
+
+	/* LUKS2 / dm-crypt does not provide this count. */
+	if (dm_query_device(cd, name, 0, &dmd) < 0)
+		return 0;
+
+	if (single_segment(&dmd) && dmd.segment.type == DM_INTEGRITY)
+		(void)dm_status_integrity_failures(cd, name, &failures);
+
+	dm_targets_free(cd, &dmd);
+
+	return failures;
+}
+
+int crypt_get_active_integrity_recalc(struct crypt_device *cd, const char *name,
+				      uint64_t *recalc_sector, uint64_t *size)
+{
+	struct crypt_dm_active_device dmd;
+	int r;
+
+	if (!name || !recalc_sector || !size)
+		return -EINVAL;
+
+	r = dm_query_device(cd, name, 0, &dmd);
+	if (r < 0)
+		return r;
+
+	if (single_segment(&dmd) && dmd.segment.type == DM_INTEGRITY)
+		r = dm_status_integrity_recalc(cd, name, recalc_sector, size);
+	else
+		r = -ENOTSUP;
+
+	dm_targets_free(cd, &dmd);
+
+	return r;
+}
+
+static uint64_t recalc_timestamp_ms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int crypt_get_integrity_recalc_progress(struct crypt_device *cd, const char *name,
+					uint32_t sample_ms,
+					struct crypt_integrity_recalc_progress *progress)
+{
+	struct crypt_integrity_recalc_progress prev;
+	int r;
+
+	if (!progress)
+		return -EINVAL;
+
+	prev = *progress;
+
+	r = crypt_get_active_integrity_recalc(cd, name, &progress->recalc_sector, &progress->size);
+	if (r < 0)
+		return r;
+	progress->timestamp_ms = recalc_timestamp_ms();
+	progress->sectors_per_sec = 0;
+
+	if (progress->recalc_sector >= progress->size)
+		return 0;
+
+	if (!prev.timestamp_ms || prev.timestamp_ms >= progress->timestamp_ms ||
+	    prev.recalc_sector > progress->recalc_sector) {
+		if (!sample_ms)
+			return 0;
+
+		prev = *progress;
+		usleep(sample_ms * 1000);
+		r = crypt_get_active_integrity_recalc(cd, name, &progress->recalc_sector, &progress->size);
+		if (r < 0)
+			return r;
+		progress->timestamp_ms = recalc_timestamp_ms();
+		if (progress->timestamp_ms <= prev.timestamp_ms ||
+		    prev.recalc_sector > progress->recalc_sector)
+			return 0;
+	}
+
+	progress->sectors_per_sec = (double)(progress->recalc_sector - prev.recalc_sector) * 1000. /
+				    (progress->timestamp_ms - prev.timestamp_ms);
+
+	log_dbg(cd, "Integrity recalculation at sector %" PRIu64 " of %" PRIu64 ", %.0f sectors/s.",
+		progress->recalc_sector, progress->size, progress->sectors_per_sec);
+
+	return 0;
+}
+
+int crypt_integrity_lazy_init(struct crypt_device *cd)
+{
+	uint32_t dmi_flags;
+	int r;
+
+	if (!cd || !isINTEGRITY(cd->type) || !cd->u.integrity.params.integrity)
+		return -EINVAL;
+
+	log_dbg(cd, "Initializing integrity tags lazily on device %s.", mdata_device_path(cd));
 
-	if (cd && isTCRYPT(cd->type)) {
-		cad->offset	= TCRYPT_get_data_offset(cd, &cd->u.tcrypt.hdr, &cd->u.tcrypt.params);
-		cad->iv_offset	= TCRYPT_get_iv_offset(cd, &cd->u.tcrypt.hdr, &cd->u.tcrypt.params);
-	} else {
-		while (tgt) {
-			if (tgt->type == DM_CRYPT && (min_offset > tgt->u.crypt.offset)) {
-				min_offset = tgt->u.crypt.offset;
-				cad->iv_offset = tgt->u.crypt.iv_offset;
-			} else if (tgt->type == DM_INTEGRITY && (min_offset > tgt->u.integrity.offset)) {
-				min_offset = tgt->u.integrity.offset;
-				cad->iv_offset = 0;
-			} else if (tgt->type == DM_LINEAR && (min_offset > tgt->u.linear.offset)) {
-				min_offset = tgt->u.linear.offset;
-				cad->iv_offset = 0;
-			}
-			tgt = tgt->next;
-		}
+	/* kernel recalculation cannot be trusted to use the key, tags would be invalid */
+	if (!strncmp(cd->u.integrity.params.integrity, "hmac(", 5)) {
+		log_err(cd, _("Lazy initialization is not supported with keyed integrity hash."));
+		return -EINVAL;
 	}
 
-	if (min_offset != UINT64_MAX)
-		cad->offset = min_offset;
-
-	cad->size	= dmd.size;
-	cad->flags	= dmd.flags;
+	if (dm_flags(cd, DM_INTEGRITY, &dmi_flags) || !(dmi_flags & DM_INTEGRITY_RECALC_SUPPORTED)) {
+		log_err(cd, _("Requested automatic recalculation of integrity tags is not supported."));
+		return -ENOTSUP;
+	}
 
-	r = 0;
-	dm_targets_free(cd, &dmd);
-	dm_targets_free(cd, &dmdi);
+	r = INTEGRITY_recalculate_init(cd, cd->u.integrity.journal_mac_key,
+				       &cd->u.integrity.sb_flags);
+	if (r < 0)
+		log_err(cd, _("Cannot set integrity recalculation on device %s."),
+			mdata_device_path(cd));
 
 	return r;
 }
 
-uint64_t crypt_get_active_integrity_failures(struct crypt_device *cd, const char *name)
+int crypt_integrity_init_tags(struct crypt_device *cd,
+	const char *integrity_key,
+	size_t integrity_key_size,
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+	void *usrptr)
 {
-	struct crypt_dm_active_device dmd;
-	uint64_t failures = 0;
+	struct volume_key *vk = NULL;
+	int r;
 
-	if (!name)
-		return 0;
+	if (!cd || !isINTEGRITY(cd->type) || !cd->u.integrity.params.integrity)
+		return -EINVAL;
 
-	/* LUKS2 / dm-crypt does not provide this count. */
-	if (dm_query_device(cd, name, 0, &dmd) < 0)
-		return 0;
+	log_dbg(cd, "Initializing integrity tags in userspace on device %s.", mdata_device_path(cd));
 
-	if (single_segment(&dmd) && dmd.segment.type == DM_INTEGRITY)
-		(void)dm_status_integrity_failures(cd, name, &failures);
+	if (integrity_key) {
+		vk = crypt_alloc_volume_key(integrity_key_size, integrity_key);
+		if (!vk)
+			return -ENOMEM;
+	}
 
-	dm_targets_free(cd, &dmd);
+	r = INTEGRITY_init_tags(cd, &cd->u.integrity.params, vk,
+				cd->u.integrity.journal_crypt_key,
+				cd->u.integrity.journal_mac_key,
+				cd->u.integrity.sb_flags, progress, usrptr);
 
-	return failures;
+	crypt_free_volume_key(vk);
+
+	return r;
 }
 
 /*
@@ -4746,6 +5741,8 @@ int crypt_volume_key_get(struct crypt_device *cd,
 	if (!cd || !volume_key || !volume_key_size || (!isTCRYPT(cd->type) && !isVERITY(cd->type) && !passphrase))
 		return -EINVAL;
 
+	(void)_init_by_name_deferred(cd);
+
 	if (isLUKS2(cd->type) && keyslot != CRYPT_ANY_SLOT)
 		key_len = LUKS2_get_keyslot_stored_key_size(&cd->u.luks2.hdr, keyslot);
 	else
@@ -4849,11 +5846,41 @@ int crypt_get_rng_type(struct crypt_device *cd)
 	return cd->rng_type;
 }
 
+int crypt_set_numa_node(struct crypt_device *cd, int node)
+{
+	if (!cd || node < CRYPT_NUMA_NODE_NONE)
+		return -EINVAL;
+
+	log_dbg(cd, "NUMA node for workers set to %d.", node);
+	cd->numa_node = node;
+	return 0;
+}
+
+int crypt_numa_node(struct crypt_device *cd, struct device *device)
+{
+	if (!cd || cd->numa_node == CRYPT_NUMA_NODE_NONE)
+		return -1;
+
+	if (cd->numa_node >= 0)
+		return cd->numa_node;
+
+	/* single node system, binding makes no difference */
+	if (!crypt_numa_multinode())
+		return -1;
+
+	return device ? device_numa_node(device) : -1;
+}
+
 int crypt_memory_lock(struct crypt_device *cd, int lock)
 {
 	return lock ? crypt_memlock_inc(cd) : crypt_memlock_dec(cd);
 }
 
+int crypt_set_memory_lock_policy(int policy)
+{
+	return crypt_memlock_policy(policy);
+}
+
 void crypt_set_compatibility(struct crypt_device *cd, uint32_t flags)
 {
 	if (cd)
@@ -4977,6 +6004,8 @@ int crypt_dump(struct crypt_device *cd)
 {
 	if (!cd)
 		return -EINVAL;
+
+	(void)_init_by_name_deferred(cd);
 	if (isLUKS1(cd->type))
 		return _luks_dump(cd);
 	else if (isLUKS2(cd->type))
@@ -5134,6 +6163,8 @@ int crypt_get_sector_size(struct crypt_device *cd)
 	if (!cd)
 		return SECTOR_SIZE;
 
+	(void)_init_by_name_deferred(cd);
+
 	if (isPLAIN(cd->type))
 		return cd->u.plain.hdr.sector_size;
 
@@ -5151,6 +6182,8 @@ const char *crypt_get_uuid(struct crypt_device *cd)
 	if (!cd)
 		return NULL;
 
+	(void)_init_by_name_deferred(cd);
+
 	if (isLUKS1(cd->type))
 		return cd->u.luks1.hdr.uuid;
 
@@ -5367,6 +6400,8 @@ int crypt_get_metadata_size(struct crypt_device *cd,
 	if (!cd)
 		return -EINVAL;
 
+	(void)_init_by_name_deferred(cd);
+
 	if (!cd->type) {
 		msize = cd->metadata_size;
 		ksize = cd->keyslots_size;
@@ -5392,6 +6427,8 @@ uint64_t crypt_get_data_offset(struct crypt_device *cd)
 	if (!cd)
 		return 0;
 
+	(void)_init_by_name_deferred(cd);
+
 	if (isPLAIN(cd->type))
 		return cd->u.plain.hdr.offset;
 
@@ -5500,9 +6537,61 @@ int crypt_keyslot_set_priority(struct crypt_device *cd, int keyslot, crypt_keysl
 	return LUKS2_keyslot_priority_set(cd, &cd->u.luks2.hdr, keyslot, priority, 1);
 }
 
+int crypt_keyslot_areas_compact(struct crypt_device *cd)
+{
+	int r;
+
+	log_dbg(cd, "Compacting keyslot areas.");
+
+	if ((r = onlyLUKS2(cd)))
+		return r;
+
+	return LUKS2_keyslot_areas_compact(cd, &cd->u.luks2.hdr);
+}
+
+int crypt_keyslot_set_token_hint(struct crypt_device *cd, int keyslot,
+	const char *passphrase, size_t passphrase_size)
+{
+	struct volume_key *vk = NULL;
+	int r;
+
+	log_dbg(cd, "%s token hint for keyslot %d.", passphrase ? "Setting" : "Removing", keyslot);
+
+	if ((r = onlyLUKS2(cd)))
+		return r;
+
+	if (keyslot < 0 || keyslot >= crypt_keyslot_max(cd->type))
+		return -EINVAL;
+
+	if (!passphrase)
+		return LUKS2_keyslot_hint_set(cd, &cd->u.luks2.hdr, keyslot, NULL, 0) ?:
+		       LUKS2_hdr_write(cd, &cd->u.luks2.hdr);
+
+	if (passphrase_size < LUKS2_HINT_SECRET_MIN) {
+		log_err(cd, _("Token hint requires secret of at least %d bytes."), LUKS2_HINT_SECRET_MIN);
+		return -EINVAL;
+	}
+
+	/* Hint must not be stored for wrong passphrase */
+	r = LUKS2_keyslot_open(cd, keyslot, CRYPT_ANY_SEGMENT, passphrase, passphrase_size, &vk);
+	crypt_free_volume_key(vk);
+	if (r < 0)
+		return r;
+
+	r = LUKS2_keyslot_hint_set(cd, &cd->u.luks2.hdr, keyslot, passphrase, passphrase_size);
+	if (r < 0)
+		return r;
+
+	return LUKS2_hdr_write(cd, &cd->u.luks2.hdr);
+}
+
 const char *crypt_get_type(struct crypt_device *cd)
 {
-	return cd ? cd->type : NULL;
+	if (!cd)
+		return NULL;
+
+	/* postponed header is not loaded here, type is known from DM UUID */
+	return cd->type ?: cd->deferred_type;
 }
 
 const char *crypt_get_default_type(void)
@@ -5533,12 +6622,121 @@ int crypt_get_verity_info(struct crypt_device *cd,
 	return 0;
 }
 
+int crypt_verity_update(struct crypt_device *cd,
+	const struct crypt_verity_range *ranges,
+	size_t ranges_count,
+	char *root_hash,
+	size_t root_hash_size)
+{
+	int r;
+
+	if (!cd || !isVERITY(cd->type) || !root_hash || (ranges_count && !ranges))
+		return -EINVAL;
+
+	if (root_hash_size < cd->u.verity.root_hash_size)
+		return -EINVAL;
+
+	log_dbg(cd, "Updating VERITY hash area for %zu changed data ranges.", ranges_count);
+
+	r = VERITY_update(cd, &cd->u.verity.hdr, ranges, ranges_count,
+			  root_hash, cd->u.verity.root_hash_size);
+	if (!r && cd->u.verity.fec_device)
+		r = VERITY_FEC_process(cd, &cd->u.verity.hdr, cd->u.verity.fec_device, 0, NULL);
+
+	if (!r && cd->u.verity.root_hash)
+		memcpy(CONST_CAST(void*)cd->u.verity.root_hash, root_hash,
+		       cd->u.verity.root_hash_size);
+
+	return r;
+}
+
+int crypt_verity_verify(struct crypt_device *cd,
+	const struct crypt_verity_range *ranges,
+	size_t ranges_count,
+	struct crypt_verity_range **bad_ranges,
+	size_t *bad_ranges_count,
+	const char *root_hash,
+	size_t root_hash_size)
+{
+	if (!cd || !isVERITY(cd->type) || !root_hash || (ranges_count && !ranges) ||
+	    (bad_ranges && !bad_ranges_count))
+		return -EINVAL;
+
+	if (root_hash_size != cd->u.verity.root_hash_size)
+		return -EINVAL;
+
+	if (bad_ranges) {
+		*bad_ranges = NULL;
+		*bad_ranges_count = 0;
+	}
+
+	if (ranges)
+		log_dbg(cd, "Verifying %zu VERITY data ranges.", ranges_count);
+	else
+		log_dbg(cd, "Verifying VERITY data area.");
+
+	return VERITY_verify_ranges(cd, &cd->u.verity.hdr, ranges, ranges_count,
+				    bad_ranges, bad_ranges_count, root_hash, root_hash_size);
+}
+
+int crypt_verity_repair(struct crypt_device *cd,
+	struct crypt_verity_range **repaired,
+	size_t *repaired_count,
+	const char *root_hash,
+	size_t root_hash_size)
+{
+	unsigned int errors = 0;
+	int r;
+
+	if (!cd || !isVERITY(cd->type) || !root_hash || (repaired && !repaired_count))
+		return -EINVAL;
+
+	if (root_hash_size != cd->u.verity.root_hash_size)
+		return -EINVAL;
+
+	if (repaired) {
+		*repaired = NULL;
+		*repaired_count = 0;
+	}
+
+	if (!cd->u.verity.fec_device) {
+		log_err(cd, _("Repair requires FEC device."));
+		return -ENOTSUP;
+	}
+
+	/* Active device holds data device (or it is found by UUID in superblock) */
+	if ((cd->u.verity.uuid && lookup_dm_dev_by_uuid(cd, cd->u.verity.uuid, CRYPT_VERITY) > 0) ||
+	    device_open_excl(cd, crypt_data_device(cd), O_RDONLY) == -EBUSY) {
+		log_err(cd, _("Cannot repair active device %s."), device_path(crypt_data_device(cd)));
+		return -EBUSY;
+	}
+
+	log_dbg(cd, "Repairing VERITY device with FEC device %s.",
+		device_path(cd->u.verity.fec_device));
+
+	r = VERITY_FEC_repair(cd, &cd->u.verity.hdr, cd->u.verity.fec_device,
+			      root_hash, root_hash_size, &errors, repaired, repaired_count);
+	device_release_excl(cd, crypt_data_device(cd));
+	if (r < 0) {
+		log_err(cd, _("Errors cannot be repaired with FEC device."));
+		return r;
+	}
+
+	log_dbg(cd, "Repaired %u errors with FEC device.", errors);
+
+	/* Repaired device must match root hash */
+	return VERITY_verify_ranges(cd, &cd->u.verity.hdr, NULL, 0, NULL, NULL,
+				    root_hash, root_hash_size);
+}
+
 int crypt_get_integrity_info(struct crypt_device *cd,
 	struct crypt_params_integrity *ip)
 {
 	if (!cd || !ip)
 		return -EINVAL;
 
+	(void)_init_by_name_deferred(cd);
+
 	if (isINTEGRITY(cd->type)) {
 		ip->journal_size = cd->u.integrity.params.journal_size;
 		ip->journal_watermark = cd->u.integrity.params.journal_watermark;
@@ -5660,6 +6858,34 @@ void crypt_set_luks2_reencrypt(struct crypt_device *cd, struct luks2_reencrypt *
 	cd->u.luks2.rh = rh;
 }
 
+int crypt_reencrypt_set_journal_device(struct crypt_device *cd, const char *path)
+{
+	char *tmp = NULL;
+
+	if (!cd)
+		return -EINVAL;
+
+	/* path is stored in metadata, resume can run from another working directory */
+	if (path && !(tmp = realpath(path, NULL))) {
+		if (errno == ENOMEM)
+			return -ENOMEM;
+		log_err(cd, _("Cannot use journal device %s (too small or not accessible)."), path);
+		return -EINVAL;
+	}
+
+	log_dbg(cd, "Setting reencryption journal device to %s.", tmp ?: "keyslot area");
+	free(cd->reencrypt_journal);
+	cd->reencrypt_journal = tmp;
+
+	return 0;
+}
+
+/* internal only */
+const char *crypt_get_reencrypt_journal(struct crypt_device *cd)
+{
+	return cd->reencrypt_journal;
+}
+
 /*
  * Token handling
  */
@@ -5667,6 +6893,7 @@ int crypt_activate_by_token_pin(struct crypt_device *cd, const char *name,
 	const char *type, int token, const char *pin, size_t pin_size,
 	void *usrptr, uint32_t flags)
 {
+	uint64_t start;
 	int r;
 
 	log_dbg(cd, "%s volume %s using token (%s type) %d.",
@@ -5682,7 +6909,11 @@ int crypt_activate_by_token_pin(struct crypt_device *cd, const char *name,
 	if ((flags & CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY) && name)
 		return -EINVAL;
 
-	return LUKS2_token_open_and_activate(cd, &cd->u.luks2.hdr, token, name, type, pin, pin_size, flags, usrptr);
+	start = _op_stats_begin(cd);
+	r = LUKS2_token_open_and_activate(cd, &cd->u.luks2.hdr, token, name, type, pin, pin_size, flags, usrptr);
+	_op_stats_end(cd, start);
+
+	return r;
 }
 
 int crypt_activate_by_token(struct crypt_device *cd,
@@ -5698,6 +6929,65 @@ int crypt_activate_by_token_type(struct crypt_device *cd,
 	return crypt_activate_by_token_pin(cd, name, type, token, NULL, 0, usrptr, flags);
 }
 
+int crypt_token_concurrent_open(struct crypt_device *cd, uint32_t timeout_ms)
+{
+	if (!cd)
+		return -EINVAL;
+
+	log_dbg(cd, "Concurrent token open %s (timeout %" PRIu32 " ms).",
+		timeout_ms ? "enabled" : "disabled", timeout_ms);
+	cd->token_concurrent_timeout = timeout_ms;
+
+	return 0;
+}
+
+int crypt_volume_key_handoff(struct crypt_device *cd, uint32_t timeout)
+{
+	if (!cd)
+		return -EINVAL;
+
+	log_dbg(cd, "Volume key handoff %s (timeout %" PRIu32 " s).",
+		timeout ? "enabled" : "disabled", timeout);
+	cd->vk_handoff_timeout = timeout;
+
+	return 0;
+}
+
+int crypt_token_open_timeout(struct crypt_device *cd, uint32_t timeout_ms)
+{
+	if (!cd)
+		return -EINVAL;
+
+	log_dbg(cd, "Token open timeout set to %" PRIu32 " ms.", timeout_ms);
+	cd->token_timeout = timeout_ms;
+
+	return 0;
+}
+
+/*
+ * Private context for token open running in a worker thread, it can outlive
+ * the context of caller. No callbacks are inherited (log uses the default one).
+ */
+int crypt_token_context_clone(struct crypt_device *cd, struct crypt_device **clone)
+{
+	int r;
+
+	if (!cd || !isLUKS2(cd->type) || !clone)
+		return -EINVAL;
+
+	r = crypt_init_data_device(clone, mdata_device_path(cd), data_device_path(cd));
+	if (r)
+		return r;
+
+	r = crypt_load(*clone, CRYPT_LUKS2, NULL);
+	if (r) {
+		crypt_free(*clone);
+		*clone = NULL;
+	}
+
+	return r;
+}
+
 int crypt_token_json_get(struct crypt_device *cd, int token, const char **json)
 {
 	int r;
@@ -5844,6 +7134,24 @@ int crypt_metadata_locking(struct crypt_device *cd __attribute__((unused)), int
 	return 0;
 }
 
+/* Internal only */
+int crypt_private_udev_sync_enabled(void)
+{
+	return _private_udev_sync;
+}
+
+int crypt_private_udev_sync(struct crypt_device *cd __attribute__((unused)), int enable)
+{
+	_private_udev_sync = enable ? 1 : 0;
+	return 0;
+}
+
+int crypt_luks2_header_cache(struct crypt_device *cd __attribute__((unused)), int enable)
+{
+	LUKS2_hdr_cache_enable(enable);
+	return 0;
+}
+
 int crypt_persistent_flags_set(struct crypt_device *cd, crypt_flags_type type, uint32_t flags)
 {
 	int r;
@@ -6149,7 +7457,7 @@ int crypt_activate_by_keyring(struct crypt_device *cd,
 	if (r < 0)
 		return r;
 
-	r = keyring_get_passphrase(key_description, &passphrase, &passphrase_size);
+	r = keyring_cache_get_passphrase(crypt_keyring_cache(cd), key_description, &passphrase, &passphrase_size);
 	if (r < 0) {
 		log_err(cd, _("Failed to read passphrase from keyring (error %d)."), r);
 		return -EINVAL;
@@ -6163,11 +7471,51 @@ int crypt_activate_by_keyring(struct crypt_device *cd,
 	return r;
 }
 
+int crypt_activate_by_keyring_volume_key(struct crypt_device *cd,
+	const char *name,
+	const char *key_description,
+	uint32_t flags)
+{
+	char *volume_key;
+	size_t volume_key_size;
+	int r;
+
+	if (!cd || !key_description)
+		return -EINVAL;
+
+	log_dbg(cd, "%s volume %s using volume key in keyring.",
+		name ? "Activating" : "Checking", name ?: "volume key");
+
+	if (!kernel_keyring_support()) {
+		log_err(cd, _("Kernel keyring is not supported by the kernel."));
+		return -EINVAL;
+	}
+
+	r = keyring_get_key(key_description, &volume_key, &volume_key_size);
+	if (r < 0) {
+		log_err(cd, _("Failed to read volume key from keyring (error %d)."), r);
+		return -EINVAL;
+	}
+
+	/* Key is verified against digest, no keyslot PBKDF is needed */
+	r = crypt_activate_by_volume_key(cd, name, volume_key, volume_key_size, flags);
+
+	crypt_safe_memzero(volume_key, volume_key_size);
+	free(volume_key);
+
+	return r;
+}
+
 /*
  * Workaround for serialization of parallel activation and memory-hard PBKDF
  * In specific situation (systemd activation) this causes OOM killer activation.
  * For now, let's provide this ugly way to serialize unlocking of devices.
  */
+bool crypt_serialize_enabled(struct crypt_device *cd)
+{
+	return cd->memory_hard_pbkdf_lock_enabled;
+}
+
 int crypt_serialize_lock(struct crypt_device *cd)
 {
 	if (!cd->memory_hard_pbkdf_lock_enabled)
@@ -6195,7 +7543,12 @@ void crypt_serialize_unlock(struct crypt_device *cd)
 crypt_reencrypt_info crypt_reencrypt_status(struct crypt_device *cd,
 		struct crypt_params_reencrypt *params)
 {
-	if (!cd || !isLUKS2(cd->type))
+	if (!cd)
+		return CRYPT_REENCRYPT_NONE;
+
+	(void)_init_by_name_deferred(cd);
+
+	if (!isLUKS2(cd->type))
 		return CRYPT_REENCRYPT_NONE;
 
 	if (_onlyLUKS2(cd, CRYPT_CD_QUIET, CRYPT_REQUIREMENT_ONLINE_REENCRYPT))
@@ -6210,4 +7563,5 @@ static void __attribute__((destructor)) libcryptsetup_exit(void)
 
 	crypt_backend_destroy();
 	crypt_random_exit();
+	io_scratch_exit();
 }
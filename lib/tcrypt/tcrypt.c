@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "libcryptsetup.h"
 #include "tcrypt.h"
@@ -333,15 +334,79 @@ static void TCRYPT_copy_key(struct tcrypt_alg *alg, const char *mode,
 	}
 }
 
-static int TCRYPT_decrypt_hdr_one(struct tcrypt_alg *alg, const char *mode,
-				   const char *key,struct tcrypt_phdr *hdr)
+/*
+ * Cipher contexts initialized from one derived header key. The same cipher
+ * with the same key material is used by several chain variants, so it is
+ * initialized only once per key. Unavailable cipher chains are remembered
+ * for subsequent keys (KDF variants) as the failure does not depend on key.
+ */
+#define TCRYPT_CIPHER_CACHE_MAX 32
+struct tcrypt_cipher_cache {
+	struct {
+		struct tcrypt_alg *alg;
+		const char *mode;
+		struct crypt_cipher *cipher;
+	} c[TCRYPT_CIPHER_CACHE_MAX];
+	unsigned int count;
+	int unavailable[sizeof(tcrypt_cipher) / sizeof(tcrypt_cipher[0])];
+};
+
+static void TCRYPT_cipher_cache_flush(struct tcrypt_cipher_cache *cache)
+{
+	while (cache->count)
+		crypt_cipher_destroy(cache->c[--cache->count].cipher);
+}
+
+static bool TCRYPT_alg_same_key(const struct tcrypt_alg *a1, const char *mode1,
+				const struct tcrypt_alg *a2, const char *mode2)
+{
+	return a1->key_size == a2->key_size && a1->key_offset == a2->key_offset &&
+	       a1->iv_offset == a2->iv_offset && !strcmp(a1->name, a2->name) &&
+	       !strcmp(mode1, mode2);
+}
+
+/* Returns 1 if the cipher is not cached and must be destroyed by caller. */
+static int TCRYPT_cipher_get(struct tcrypt_cipher_cache *cache,
+			     struct tcrypt_alg *alg, const char *mode,
+			     const char *mode_name, const char *key,
+			     struct crypt_cipher **cipher)
 {
 	char backend_key[TCRYPT_HDR_KEY_LEN];
+	unsigned int i;
+	int r;
+
+	for (i = 0; i < cache->count; i++)
+		if (TCRYPT_alg_same_key(cache->c[i].alg, cache->c[i].mode, alg, mode)) {
+			*cipher = cache->c[i].cipher;
+			return 0;
+		}
+
+	TCRYPT_copy_key(alg, mode, backend_key, key);
+	r = crypt_cipher_init(cipher, alg->name, mode_name,
+			      backend_key, alg->key_size);
+	crypt_safe_memzero(backend_key, sizeof(backend_key));
+	if (r < 0)
+		return r;
+
+	if (cache->count == TCRYPT_CIPHER_CACHE_MAX)
+		return 1;
+
+	cache->c[cache->count].alg = alg;
+	cache->c[cache->count].mode = mode;
+	cache->c[cache->count].cipher = *cipher;
+	cache->count++;
+	return 0;
+}
+
+static int TCRYPT_decrypt_hdr_one(struct tcrypt_cipher_cache *cache,
+				  struct tcrypt_alg *alg, const char *mode,
+				  const char *key, char *buf, size_t length)
+{
 	char iv[TCRYPT_HDR_IV_LEN] = {};
 	char mode_name[MAX_CIPHER_LEN + 1];
 	struct crypt_cipher *cipher;
-	char *c, *buf = (char*)&hdr->e;
-	int r;
+	char *c;
+	int r, owned;
 
 	/* Remove IV if present */
 	mode_name[MAX_CIPHER_LEN] = '\0';
@@ -353,22 +418,21 @@ static int TCRYPT_decrypt_hdr_one(struct tcrypt_alg *alg, const char *mode,
 	if (!strncmp(mode, "lrw", 3))
 		iv[alg->iv_size - 1] = 1;
 	else if (!strncmp(mode, "cbc", 3)) {
+		assert(length == TCRYPT_HDR_LEN);
 		TCRYPT_remove_whitening(buf, &key[8]);
 		if (!strcmp(alg->name, "blowfish_le"))
 			return decrypt_blowfish_le_cbc(alg, key, buf);
 		memcpy(iv, &key[alg->iv_offset], alg->iv_size);
 	}
 
-	TCRYPT_copy_key(alg, mode, backend_key, key);
-	r = crypt_cipher_init(&cipher, alg->name, mode_name,
-			      backend_key, alg->key_size);
-	if (!r) {
-		r = crypt_cipher_decrypt(cipher, buf, buf, TCRYPT_HDR_LEN,
-					 iv, alg->iv_size);
-		crypt_cipher_destroy(cipher);
+	r = TCRYPT_cipher_get(cache, alg, mode, mode_name, key, &cipher);
+	if (r >= 0) {
+		owned = r;
+		r = crypt_cipher_decrypt(cipher, buf, buf, length, iv, alg->iv_size);
+		if (owned)
+			crypt_cipher_destroy(cipher);
 	}
 
-	crypt_safe_memzero(backend_key, sizeof(backend_key));
 	crypt_safe_memzero(iv, TCRYPT_HDR_IV_LEN);
 	return r;
 }
@@ -427,11 +491,39 @@ out:
 	return r;
 }
 
+static int TCRYPT_decrypt_chain(struct tcrypt_cipher_cache *cache,
+				struct tcrypt_algs *ciphers, const char *key,
+				char *buf, size_t length)
+{
+	int j, r = -EINVAL;
+
+	for (j = ciphers->chain_count - 1; j >= 0 ; j--) {
+		if (!ciphers->cipher[j].name)
+			continue;
+		r = TCRYPT_decrypt_hdr_one(cache, &ciphers->cipher[j],
+					   ciphers->mode, key, buf, length);
+		if (r < 0)
+			break;
+	}
+
+	return r;
+}
+
+static bool TCRYPT_magic_match(const char *magic, struct crypt_params_tcrypt *params)
+{
+	if (!strncmp(magic, TCRYPT_HDR_MAGIC, TCRYPT_HDR_MAGIC_LEN))
+		return true;
+	return (params->flags & CRYPT_TCRYPT_VERA_MODES) &&
+		!strncmp(magic, VCRYPT_HDR_MAGIC, TCRYPT_HDR_MAGIC_LEN);
+}
+
 static int TCRYPT_decrypt_hdr(struct crypt_device *cd, struct tcrypt_phdr *hdr,
-			       const char *key, struct crypt_params_tcrypt *params)
+			       const char *key, struct crypt_params_tcrypt *params,
+			       struct tcrypt_cipher_cache *cache)
 {
 	struct tcrypt_phdr hdr2;
-	int i, j, r = -EINVAL;
+	char block[TCRYPT_HDR_IV_LEN];
+	int i, r = -EINVAL;
 
 	for (i = 0; tcrypt_cipher[i].chain_count; i++) {
 		if (params->cipher && !strstr(tcrypt_cipher[i].long_name, params->cipher))
@@ -441,21 +533,39 @@ static int TCRYPT_decrypt_hdr(struct crypt_device *cd, struct tcrypt_phdr *hdr,
 		log_dbg(cd, "TCRYPT:  trying cipher %s-%s",
 			tcrypt_cipher[i].long_name, tcrypt_cipher[i].mode);
 
-		memcpy(&hdr2.e, &hdr->e, TCRYPT_HDR_LEN);
-
-		if (!strncmp(tcrypt_cipher[i].mode, "cbci", 4))
-			r = TCRYPT_decrypt_cbci(&tcrypt_cipher[i], key, &hdr2);
-		else for (j = tcrypt_cipher[i].chain_count - 1; j >= 0 ; j--) {
-			if (!tcrypt_cipher[i].cipher[j].name)
+		r = cache->unavailable[i];
+		if (r < 0)
+			goto skip;
+
+		/*
+		 * In XTS and LRW mode the first cipher block (with magic) does not
+		 * depend on the rest of header, decrypt full header only on match.
+		 */
+		if (!strncmp(tcrypt_cipher[i].mode, "xts", 3) ||
+		    !strncmp(tcrypt_cipher[i].mode, "lrw", 3)) {
+			memcpy(block, &hdr->e, sizeof(block));
+			r = TCRYPT_decrypt_chain(cache, &tcrypt_cipher[i], key,
+						 block, sizeof(block));
+			if (!r && !TCRYPT_magic_match(block, params)) {
+				r = -EPERM;
 				continue;
-			r = TCRYPT_decrypt_hdr_one(&tcrypt_cipher[i].cipher[j],
-					    tcrypt_cipher[i].mode, key, &hdr2);
-			if (r < 0)
-				break;
-		}
+			}
+		} else
+			r = 0;
+
+		if (!r) {
+			memcpy(&hdr2.e, &hdr->e, TCRYPT_HDR_LEN);
 
+			if (!strncmp(tcrypt_cipher[i].mode, "cbci", 4))
+				r = TCRYPT_decrypt_cbci(&tcrypt_cipher[i], key, &hdr2);
+			else
+				r = TCRYPT_decrypt_chain(cache, &tcrypt_cipher[i], key,
+							 hdr2.e, TCRYPT_HDR_LEN);
+		}
+skip:
 		if (r < 0) {
 			log_dbg(cd, "TCRYPT:   returned error %d, skipped.", r);
+			cache->unavailable[i] = r;
 			if (r == -ENOTSUP)
 				break;
 			r = -ENOENT;
@@ -478,6 +588,8 @@ static int TCRYPT_decrypt_hdr(struct crypt_device *cd, struct tcrypt_phdr *hdr,
 		r = -EPERM;
 	}
 
+	TCRYPT_cipher_cache_flush(cache);
+	crypt_safe_memzero(block, sizeof(block));
 	crypt_safe_memzero(&hdr2, sizeof(hdr2));
 	return r;
 }
@@ -487,8 +599,8 @@ static int TCRYPT_pool_keyfile(struct crypt_device *cd,
 				const char *keyfile, int keyfiles_pool_length)
 {
 	unsigned char *data;
-	int i, j, fd, data_size, r = -EIO;
-	uint32_t crc;
+	int i, j, k, n, fd, data_size, r = -EIO;
+	uint32_t crc, trace[TCRYPT_KEYFILE_CHUNK];
 
 	log_dbg(cd, "TCRYPT: using keyfile %s.", keyfile);
 
@@ -510,36 +622,144 @@ static int TCRYPT_pool_keyfile(struct crypt_device *cd,
 		goto out;
 	}
 
-	for (i = 0, j = 0, crc = ~0U; i < data_size; i++) {
-		crc = crypt_crc32(crc, &data[i], 1);
-		pool[j++] += (unsigned char)(crc >> 24);
-		pool[j++] += (unsigned char)(crc >> 16);
-		pool[j++] += (unsigned char)(crc >>  8);
-		pool[j++] += (unsigned char)(crc);
-		j %= keyfiles_pool_length;
+	/* Every running CRC value is mixed into pool, process keyfile in chunks */
+	for (i = 0, j = 0, crc = ~0U; i < data_size; i += n) {
+		n = data_size - i;
+		if (n > TCRYPT_KEYFILE_CHUNK)
+			n = TCRYPT_KEYFILE_CHUNK;
+
+		crc = crypt_crc32_trace(crc, &data[i], n, trace);
+		for (k = 0; k < n; k++) {
+			pool[j++] += (unsigned char)(trace[k] >> 24);
+			pool[j++] += (unsigned char)(trace[k] >> 16);
+			pool[j++] += (unsigned char)(trace[k] >>  8);
+			pool[j++] += (unsigned char)(trace[k]);
+			if (j == keyfiles_pool_length)
+				j = 0;
+		}
 	}
 	r = 0;
 out:
 	crypt_safe_memzero(&crc, sizeof(crc));
+	crypt_safe_memzero(trace, sizeof(trace));
 	crypt_safe_memzero(data, TCRYPT_KEYFILE_LEN);
 	free(data);
 
 	return r;
 }
 
+/*
+ * KDF sweep: header keys for all candidate KDF variants are derived by worker
+ * threads (up to number of online CPUs) in table order, while the caller
+ * consumes them also in table order and tries to decrypt the header with each.
+ * Once a signature matches, no new derivation is started.
+ * With more candidate headers (hidden header on both offsets), jobs for all
+ * headers are one job set sharing the same keyfile pool and passphrase.
+ */
+struct tcrypt_kdf_job {
+	unsigned int hdr;
+	unsigned int kdf;
+	unsigned int iterations;
+	char *key;
+	int r;
+	bool done;
+};
+
+struct tcrypt_kdf_sweep {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct tcrypt_kdf_job *jobs;
+	unsigned int count;
+	unsigned int next;
+	bool stop;
+	const char *pwd;
+	size_t pwd_size;
+	const struct tcrypt_phdr *hdrs;
+};
+
+static void TCRYPT_kdf_job_run(struct tcrypt_kdf_sweep *sw, unsigned int idx)
+{
+	struct tcrypt_kdf_job *job = &sw->jobs[idx];
+	int r;
+
+	r = crypt_pbkdf(tcrypt_kdf[job->kdf].name, tcrypt_kdf[job->kdf].hash,
+			sw->pwd, sw->pwd_size, sw->hdrs[job->hdr].salt, TCRYPT_HDR_SALT_LEN,
+			job->key, TCRYPT_HDR_KEY_LEN, job->iterations, 0, 0);
+
+	pthread_mutex_lock(&sw->lock);
+	job->r = r;
+	job->done = true;
+	pthread_cond_broadcast(&sw->cond);
+	pthread_mutex_unlock(&sw->lock);
+}
+
+static void *TCRYPT_kdf_thread(void *arg)
+{
+	struct tcrypt_kdf_sweep *sw = arg;
+	unsigned int idx;
+
+	pthread_mutex_lock(&sw->lock);
+	while (!sw->stop && sw->next < sw->count) {
+		idx = sw->next++;
+		pthread_mutex_unlock(&sw->lock);
+		TCRYPT_kdf_job_run(sw, idx);
+		pthread_mutex_lock(&sw->lock);
+	}
+	pthread_mutex_unlock(&sw->lock);
+
+	return NULL;
+}
+
+/* Wait for key of job idx, derive pending keys in this thread if needed. */
+static int TCRYPT_kdf_wait(struct tcrypt_kdf_sweep *sw, unsigned int idx)
+{
+	unsigned int next;
+	int r;
+
+	pthread_mutex_lock(&sw->lock);
+	while (!sw->jobs[idx].done) {
+		if (sw->next <= idx) {
+			next = sw->next++;
+			pthread_mutex_unlock(&sw->lock);
+			TCRYPT_kdf_job_run(sw, next);
+			pthread_mutex_lock(&sw->lock);
+		} else
+			pthread_cond_wait(&sw->cond, &sw->lock);
+	}
+	r = sw->jobs[idx].r;
+	pthread_mutex_unlock(&sw->lock);
+
+	return r;
+}
+
+/* On success, the matching header of hdrs is decrypted and copied to hdr. */
 static int TCRYPT_init_hdr(struct crypt_device *cd,
 			   struct tcrypt_phdr *hdr,
+			   struct tcrypt_phdr *hdrs,
+			   unsigned int hdr_count,
 			   struct crypt_params_tcrypt *params)
 {
 	unsigned char pwd[VCRYPT_KEY_POOL_LEN] = {};
+	struct tcrypt_kdf_sweep sw = {};
+	struct tcrypt_cipher_cache cache = {};
+	struct tcrypt_kdf_job *job;
+	pthread_t *threads = NULL;
 	size_t passphrase_size, max_passphrase_size;
-	char *key;
-	unsigned int i, skipped = 0, iterations;
+	char *keys = NULL;
+	unsigned int i, j, h, skipped = 0, iterations, kdf_count, threads_count = 0, extra;
 	int r = -EPERM, keyfiles_pool_length;
 
-	if (posix_memalign((void*)&key, crypt_getpagesize(), TCRYPT_HDR_KEY_LEN))
+	for (kdf_count = 0; tcrypt_kdf[kdf_count].name; kdf_count++);
+
+	sw.jobs = calloc(kdf_count * hdr_count, sizeof(*sw.jobs));
+	if (!sw.jobs)
 		return -ENOMEM;
 
+	if (posix_memalign((void*)&keys, crypt_getpagesize(), kdf_count * hdr_count * TCRYPT_HDR_KEY_LEN)) {
+		free(sw.jobs);
+		return -ENOMEM;
+	}
+
 	if (params->flags & CRYPT_TCRYPT_VERA_MODES &&
 	    params->passphrase_size > TCRYPT_KEY_POOL_LEN) {
 		/* Really. Keyfile pool length depends on passphrase size in Veracrypt. */
@@ -572,32 +792,73 @@ static int TCRYPT_init_hdr(struct crypt_device *cd,
 	for (i = 0; i < params->passphrase_size; i++)
 		pwd[i] += params->passphrase[i];
 
-	for (i = 0; tcrypt_kdf[i].name; i++) {
-		if (params->hash_name && strcmp(params->hash_name, tcrypt_kdf[i].hash))
-			continue;
-		if (!(params->flags & CRYPT_TCRYPT_LEGACY_MODES) && tcrypt_kdf[i].legacy)
-			continue;
-		if (!(params->flags & CRYPT_TCRYPT_VERA_MODES) && tcrypt_kdf[i].veracrypt)
-			continue;
-		if ((params->flags & CRYPT_TCRYPT_VERA_MODES) && params->veracrypt_pim) {
-			/* Do not try TrueCrypt modes if we have PIM value */
-			if (!tcrypt_kdf[i].veracrypt)
+	for (h = 0; h < hdr_count; h++) {
+		for (i = 0; tcrypt_kdf[i].name; i++) {
+			if (params->hash_name && strcmp(params->hash_name, tcrypt_kdf[i].hash))
 				continue;
-			/* adjust iterations to given PIM cmdline parameter */
-			iterations = tcrypt_kdf[i].veracrypt_pim_const +
-				    (tcrypt_kdf[i].veracrypt_pim_mult * params->veracrypt_pim);
-		} else
-			iterations = tcrypt_kdf[i].iterations;
+			if (!(params->flags & CRYPT_TCRYPT_LEGACY_MODES) && tcrypt_kdf[i].legacy)
+				continue;
+			if (!(params->flags & CRYPT_TCRYPT_VERA_MODES) && tcrypt_kdf[i].veracrypt)
+				continue;
+			if ((params->flags & CRYPT_TCRYPT_VERA_MODES) && params->veracrypt_pim) {
+				/* Do not try TrueCrypt modes if we have PIM value */
+				if (!tcrypt_kdf[i].veracrypt)
+					continue;
+				/* adjust iterations to given PIM cmdline parameter */
+				iterations = tcrypt_kdf[i].veracrypt_pim_const +
+					    (tcrypt_kdf[i].veracrypt_pim_mult * params->veracrypt_pim);
+			} else
+				iterations = tcrypt_kdf[i].iterations;
+
+			job = &sw.jobs[sw.count];
+			job->hdr = h;
+			job->kdf = i;
+			job->iterations = iterations;
+			job->key = &keys[sw.count * TCRYPT_HDR_KEY_LEN];
+			sw.count++;
+		}
+	}
+
+	sw.pwd = (const char *)pwd;
+	sw.pwd_size = passphrase_size;
+	sw.hdrs = hdrs;
+
+	if (pthread_mutex_init(&sw.lock, NULL)) {
+		r = -ENOMEM;
+		goto out;
+	}
+	if (pthread_cond_init(&sw.cond, NULL)) {
+		pthread_mutex_destroy(&sw.lock);
+		r = -ENOMEM;
+		goto out;
+	}
+
+	/*
+	 * The calling thread derives keys too, if no other thread is available.
+	 * Extra threads are limited process-wide (batch open of more images).
+	 */
+	j = crypt_cpusonline();
+	if (j > sw.count)
+		j = sw.count;
+	extra = crypt_threads_acquire(j > 1 ? j - 1 : 0);
+	if (extra)
+		threads = malloc(extra * sizeof(*threads));
+	if (threads)
+		for (; threads_count < extra; threads_count++)
+			if (pthread_create(&threads[threads_count], NULL, TCRYPT_kdf_thread, &sw))
+				break;
+	log_dbg(cd, "TCRYPT: deriving %u KDF variants in %u threads.", sw.count, threads_count + 1);
+
+	r = -EPERM;
+	for (j = 0; j < sw.count; j++) {
+		i = sw.jobs[j].kdf;
+		h = sw.jobs[j].hdr;
 
 		/* Derive header key */
 		log_dbg(cd, "TCRYPT: trying KDF: %s-%s-%d%s.",
 			tcrypt_kdf[i].name, tcrypt_kdf[i].hash, tcrypt_kdf[i].iterations,
 			params->veracrypt_pim && tcrypt_kdf[i].veracrypt ? "-PIM" : "");
-		r = crypt_pbkdf(tcrypt_kdf[i].name, tcrypt_kdf[i].hash,
-				(char*)pwd, passphrase_size,
-				hdr->salt, TCRYPT_HDR_SALT_LEN,
-				key, TCRYPT_HDR_KEY_LEN,
-				iterations, 0, 0);
+		r = TCRYPT_kdf_wait(&sw, j);
 		if (r < 0) {
 			log_verbose(cd, _("PBKDF2 hash algorithm %s not available, skipping."),
 				      tcrypt_kdf[i].hash);
@@ -605,7 +866,7 @@ static int TCRYPT_init_hdr(struct crypt_device *cd,
 		}
 
 		/* Decrypt header */
-		r = TCRYPT_decrypt_hdr(cd, hdr, key, params);
+		r = TCRYPT_decrypt_hdr(cd, &hdrs[h], sw.jobs[j].key, params, &cache);
 		if (r == -ENOENT) {
 			skipped++;
 			r = -EPERM;
@@ -613,8 +874,20 @@ static int TCRYPT_init_hdr(struct crypt_device *cd,
 		if (r != -EPERM)
 			break;
 	}
-
-	if ((r < 0 && r != -EPERM && skipped && skipped == i) || r == -ENOTSUP) {
+	/* Keep the KDF index semantics of serial scan if nothing matched */
+	if (j == sw.count)
+		i = kdf_count;
+
+	pthread_mutex_lock(&sw.lock);
+	sw.stop = true;
+	pthread_mutex_unlock(&sw.lock);
+	while (threads_count)
+		pthread_join(threads[--threads_count], NULL);
+	crypt_threads_release(extra);
+	pthread_cond_destroy(&sw.cond);
+	pthread_mutex_destroy(&sw.lock);
+
+	if ((r < 0 && r != -EPERM && skipped && skipped == i * hdr_count) || r == -ENOTSUP) {
 		log_err(cd, _("Required kernel crypto interface not available."));
 #ifdef ENABLE_AF_ALG
 		log_err(cd, _("Ensure you have algif_skcipher kernel module loaded."));
@@ -623,6 +896,12 @@ static int TCRYPT_init_hdr(struct crypt_device *cd,
 	if (r < 0)
 		goto out;
 
+	if (hdr != &hdrs[h])
+		memcpy(hdr, &hdrs[h], sizeof(*hdr));
+
+	if (hdr_count > 1)
+		log_dbg(cd, "TCRYPT: using header candidate %u.", h);
+
 	r = TCRYPT_hdr_from_disk(cd, hdr, params, i, r);
 	if (!r) {
 		log_dbg(cd, "TCRYPT: Magic: %s, Header version: %d, req. %d, sector %d"
@@ -636,9 +915,10 @@ static int TCRYPT_init_hdr(struct crypt_device *cd,
 	}
 out:
 	crypt_safe_memzero(pwd, TCRYPT_KEY_POOL_LEN);
-	if (key)
-		crypt_safe_memzero(key, TCRYPT_HDR_KEY_LEN);
-	free(key);
+	crypt_safe_memzero(keys, kdf_count * hdr_count * TCRYPT_HDR_KEY_LEN);
+	free(keys);
+	free(threads);
+	free(sw.jobs);
 	return r;
 }
 
@@ -648,7 +928,9 @@ int TCRYPT_read_phdr(struct crypt_device *cd,
 {
 	struct device *base_device = NULL, *device = crypt_metadata_device(cd);
 	ssize_t hdr_size = sizeof(struct tcrypt_phdr);
+	struct tcrypt_phdr hdrs[2];
 	char *base_device_path;
+	unsigned int hdr_count = 0;
 	int devfd, r;
 
 	assert(sizeof(struct tcrypt_phdr) == 512);
@@ -683,32 +965,36 @@ int TCRYPT_read_phdr(struct crypt_device *cd,
 		if (read_lseek_blockwise(devfd, device_block_size(cd, device),
 			device_alignment(device), hdr, hdr_size,
 			TCRYPT_HDR_SYSTEM_OFFSET) == hdr_size) {
-			r = TCRYPT_init_hdr(cd, hdr, params);
+			r = TCRYPT_init_hdr(cd, hdr, hdr, 1, params);
 		}
 	} else if (params->flags & CRYPT_TCRYPT_HIDDEN_HEADER) {
 		if (params->flags & CRYPT_TCRYPT_BACKUP_HEADER) {
 			if (read_lseek_blockwise(devfd, device_block_size(cd, device),
 				device_alignment(device), hdr, hdr_size,
 				TCRYPT_HDR_HIDDEN_OFFSET_BCK) == hdr_size)
-				r = TCRYPT_init_hdr(cd, hdr, params);
+				r = TCRYPT_init_hdr(cd, hdr, hdr, 1, params);
 		} else {
+			/* both hidden header locations are tried in one KDF sweep */
 			if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-				device_alignment(device), hdr, hdr_size,
+				device_alignment(device), &hdrs[hdr_count], hdr_size,
 				TCRYPT_HDR_HIDDEN_OFFSET) == hdr_size)
-				r = TCRYPT_init_hdr(cd, hdr, params);
-			if (r && read_lseek_blockwise(devfd, device_block_size(cd, device),
-				device_alignment(device), hdr, hdr_size,
+				hdr_count++;
+			if (read_lseek_blockwise(devfd, device_block_size(cd, device),
+				device_alignment(device), &hdrs[hdr_count], hdr_size,
 				TCRYPT_HDR_HIDDEN_OFFSET_OLD) == hdr_size)
-				r = TCRYPT_init_hdr(cd, hdr, params);
+				hdr_count++;
+			if (hdr_count)
+				r = TCRYPT_init_hdr(cd, hdr, hdrs, hdr_count, params);
+			crypt_safe_memzero(hdrs, sizeof(hdrs));
 		}
 	} else if (params->flags & CRYPT_TCRYPT_BACKUP_HEADER) {
 		if (read_lseek_blockwise(devfd, device_block_size(cd, device),
 			device_alignment(device), hdr, hdr_size,
 			TCRYPT_HDR_OFFSET_BCK) == hdr_size)
-			r = TCRYPT_init_hdr(cd, hdr, params);
+			r = TCRYPT_init_hdr(cd, hdr, hdr, 1, params);
 	} else if (read_lseek_blockwise(devfd, device_block_size(cd, device),
 			device_alignment(device), hdr, hdr_size, 0) == hdr_size)
-		r = TCRYPT_init_hdr(cd, hdr, params);
+		r = TCRYPT_init_hdr(cd, hdr, hdr, 1, params);
 
 	device_free(cd, base_device);
 	if (r < 0)
@@ -899,7 +1185,7 @@ static int TCRYPT_remove_one(struct crypt_device *cd, const char *name,
 
 	r = dm_query_device(cd, dm_name, DM_ACTIVE_UUID, &dmd);
 	if (!r && !strncmp(dmd.uuid, base_uuid, strlen(base_uuid)))
-		r = dm_remove_device(cd, dm_name, flags);
+		r = dm_remove_device(cd, dm_name, flags | DM_DEACTIVATE_PRIVATE);
 
 	free(CONST_CAST(void*)dmd.uuid);
 	return r;
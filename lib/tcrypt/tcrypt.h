@@ -44,6 +44,7 @@
 #define TCRYPT_KEY_POOL_LEN 64
 #define VCRYPT_KEY_POOL_LEN 128
 #define TCRYPT_KEYFILE_LEN  1048576
+#define TCRYPT_KEYFILE_CHUNK 1024
 
 #define TCRYPT_HDR_FLAG_SYSTEM    (1 << 0)
 #define TCRYPT_HDR_FLAG_NONSYSTEM (1 << 1)
@@ -23,9 +23,13 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/utsname.h>
 
 #include "internal.h"
@@ -42,6 +46,34 @@ unsigned crypt_cpusonline(void)
 	return r < 0 ? 1 : r;
 }
 
+/*
+ * Process-wide limit of CPU bound (KDF) threads. Every running job counts
+ * its calling thread, extra threads are granted only while the total stays
+ * within online CPUs, so nested parallel jobs (batch of images, each with
+ * parallel KDF) do not multiply the number of threads.
+ */
+static unsigned crypt_threads_busy;
+
+unsigned crypt_threads_acquire(unsigned extra)
+{
+	unsigned cpus = crypt_cpusonline() ?: 1, busy, granted;
+
+	busy = __atomic_add_fetch(&crypt_threads_busy, 1, __ATOMIC_SEQ_CST);
+	do {
+		granted = busy < cpus ? cpus - busy : 0;
+		if (granted > extra)
+			granted = extra;
+	} while (granted && !__atomic_compare_exchange_n(&crypt_threads_busy, &busy,
+			busy + granted, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+	return granted;
+}
+
+void crypt_threads_release(unsigned extra)
+{
+	__atomic_sub_fetch(&crypt_threads_busy, extra + 1, __ATOMIC_SEQ_CST);
+}
+
 uint64_t crypt_getphysmemory_kb(void)
 {
 	long pagesize, phys_pages;
@@ -59,21 +91,149 @@ uint64_t crypt_getphysmemory_kb(void)
 	return phys_memory_kb;
 }
 
+/*
+ * NUMA placement of worker threads and their buffers (without libnuma).
+ * All functions are no-op for negative node.
+ */
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+bool crypt_numa_multinode(void)
+{
+	return access("/sys/devices/system/node/node1", F_OK) == 0;
+}
+
+/*
+ * Parse node cpulist (like "0-7,16-23"), limited to CPUs the process
+ * is allowed to run on (taskset, cgroup cpuset).
+ */
+static int numa_node_cpus(int node, cpu_set_t *set)
+{
+	char path[64], buf[1024], *p, *end;
+	unsigned long first, last;
+	cpu_set_t allowed;
+	int fd, r;
+
+	if (node < 0 || snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node) < 0)
+		return -EINVAL;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return -errno;
+	r = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (r <= 0)
+		return -EINVAL;
+	buf[r] = '\0';
+
+	CPU_ZERO(set);
+	for (p = buf; *p && *p != '\n';) {
+		first = last = strtoul(p, &end, 10);
+		if (end == p)
+			return -EINVAL;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtoul(p, &end, 10);
+			if (end == p)
+				return -EINVAL;
+		}
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, set);
+		p = (*end == ',') ? end + 1 : end;
+	}
+
+	if (!sched_getaffinity(0, sizeof(allowed), &allowed))
+		CPU_AND(set, set, &allowed);
+
+	return CPU_COUNT(set) ? 0 : -ENOENT;
+}
+
+/* Number of worker threads, CPUs of the node if placement is used */
+unsigned crypt_numa_cpus(int node)
+{
+	cpu_set_t set;
+
+	if (node >= 0 && !numa_node_cpus(node, &set))
+		return CPU_COUNT(&set);
+
+	if (!sched_getaffinity(0, sizeof(set), &set) && CPU_COUNT(&set))
+		return CPU_COUNT(&set);
+
+	return crypt_cpusonline();
+}
+
+/* Pin calling (worker) thread to CPUs of the node, failure is not fatal */
+void crypt_numa_bind_thread(int node)
+{
+	cpu_set_t set;
+	int r;
+
+	if (node < 0)
+		return;
+
+	if ((r = numa_node_cpus(node, &set))) {
+		log_dbg(NULL, "No usable CPUs of NUMA node %d (%d), worker not bound.", node, r);
+		return;
+	}
+
+	if ((r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)))
+		log_dbg(NULL, "Cannot bind worker to NUMA node %d (%d).", node, -r);
+}
+
+/* Prefer node memory for pages of buffer (not yet touched pages only) */
+void crypt_numa_bind_memory(void *buffer, size_t size, int node)
+{
+	size_t page = crypt_getpagesize();
+	uintptr_t start, end;
+	unsigned long mask;
+
+	if (!buffer || node < 0 || node >= (int)(8 * sizeof(mask)))
+		return;
+
+	start = ((uintptr_t)buffer + page - 1) & ~(page - 1);
+	end = ((uintptr_t)buffer + size) & ~(page - 1);
+	if (end <= start)
+		return;
+
+	mask = 1UL << node;
+#ifdef SYS_mbind
+	if (syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, &mask, 8 * sizeof(mask), 0) < 0)
+		log_dbg(NULL, "Cannot prefer NUMA node %d for buffer (%d).", node, -errno);
+#endif
+}
+
 /* MEMLOCK */
 #define DEFAULT_PROCESS_PRIORITY -18
 
 static int _priority;
 static int _memlock_count = 0;
+static int _memlock_policy = CRYPT_MEMORY_LOCK_ALL;
+static bool _memlock_all = false;
+
+int crypt_memlock_policy(int policy)
+{
+	if (policy != CRYPT_MEMORY_LOCK_ALL && policy != CRYPT_MEMORY_LOCK_SECRETS)
+		return -EINVAL;
+
+	_memlock_policy = policy;
+	return 0;
+}
 
 // return 1 if memory is locked
 int crypt_memlock_inc(struct crypt_device *ctx)
 {
 	if (!_memlock_count++) {
-		log_dbg(ctx, "Locking memory.");
-		if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
-			log_dbg(ctx, "Cannot lock memory with mlockall.");
-			_memlock_count--;
-			return 0;
+		/* Secret allocations (safe memory, volume keys) are always locked */
+		_memlock_all = (_memlock_policy == CRYPT_MEMORY_LOCK_ALL);
+		if (!_memlock_all)
+			log_dbg(ctx, "Locking only memory with secrets.");
+		else {
+			log_dbg(ctx, "Locking memory.");
+			if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+				log_dbg(ctx, "Cannot lock memory with mlockall.");
+				_memlock_count--;
+				return 0;
+			}
 		}
 		errno = 0;
 		if (((_priority = getpriority(PRIO_PROCESS, 0)) == -1) && errno)
@@ -90,8 +250,9 @@ int crypt_memlock_dec(struct crypt_device *ctx)
 {
 	if (_memlock_count && (!--_memlock_count)) {
 		log_dbg(ctx, "Unlocking memory.");
-		if (munlockall() == -1)
+		if (_memlock_all && munlockall() == -1)
 			log_err(ctx, _("Cannot unlock memory."));
+		_memlock_all = false;
 		if (setpriority(PRIO_PROCESS, 0, _priority))
 			log_dbg(ctx, "setpriority %d failed: %s", _priority, strerror(errno));
 	}
@@ -145,14 +306,35 @@ static int keyfile_seek(int fd, uint64_t bytes)
 	return bytes == 0 ? 0 : -1;
 }
 
+/* Read whole buffer at offset, short read only on EOF */
+static ssize_t keyfile_pread(int fd, char *buf, size_t length, uint64_t offset)
+{
+	size_t read_size = 0;
+	ssize_t r;
+
+	while (read_size < length) {
+		r = pread64(fd, buf + read_size, length - read_size, offset + read_size);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -EIO;
+		if (r == 0)
+			break;
+		read_size += r;
+	}
+
+	return (ssize_t)read_size;
+}
+
 int crypt_keyfile_device_read(struct crypt_device *cd,  const char *keyfile,
 			      char **key, size_t *key_size_read,
 			      uint64_t keyfile_offset, size_t key_size,
 			      uint32_t flags)
 {
 	int fd, regular_file, char_to_read = 0, char_read = 0, unlimited_read = 0;
-	int r = -EINVAL, newline;
-	char *pass = NULL;
+	int r = -EINVAL, newline = 0, seekable = 0;
+	char *pass = NULL, *eol;
+	ssize_t bytes_read;
 	size_t buflen, i;
 	uint64_t file_read_size;
 	struct stat st;
@@ -213,49 +395,81 @@ int crypt_keyfile_device_read(struct crypt_device *cd,  const char *keyfile,
 		goto out;
 	}
 
-	/* Discard keyfile_offset bytes on input */
-	if (keyfile_offset && keyfile_seek(fd, keyfile_offset) < 0) {
-		log_err(cd, _("Cannot seek to requested keyfile offset."));
-		goto out;
-	}
-
-	for (i = 0, newline = 0; i < key_size; i += char_read) {
-		if (i == buflen) {
-			buflen += 4096;
-			pass = crypt_safe_realloc(pass, buflen);
-			if (!pass) {
-				log_err(cd, _("Out of memory while reading passphrase."));
-				r = -ENOMEM;
-				goto out;
-			}
-		}
-
-		if (flags & CRYPT_KEYFILE_STOP_EOL) {
-			/* If we should stop on newline, we must read the input
-			 * one character at the time. Otherwise we might end up
-			 * having read some bytes after the newline, which we
-			 * promised not to do.
-			 */
-			char_to_read = 1;
-		} else {
-			/* char_to_read = min(key_size - i, buflen - i) */
-			char_to_read = key_size < buflen ?
-				key_size - i : buflen - i;
-		}
-		char_read = read_buffer(fd, &pass[i], char_to_read);
-		if (char_read < 0) {
+	/*
+	 * Known amount of data from a regular file or block device is read
+	 * directly at offset, without reading and discarding data before it.
+	 */
+	if (keyfile && !unlimited_read && !(flags & CRYPT_KEYFILE_STOP_EOL) &&
+	    (regular_file || S_ISBLK(st.st_mode))) {
+		bytes_read = keyfile_pread(fd, pass, buflen, keyfile_offset);
+		if (bytes_read < 0) {
 			log_err(cd, _("Error reading passphrase."));
 			r = -EPIPE;
 			goto out;
 		}
+		i = bytes_read;
+	} else {
+		/* Discard keyfile_offset bytes on input */
+		if (keyfile_offset && keyfile_seek(fd, keyfile_offset) < 0) {
+			log_err(cd, _("Cannot seek to requested keyfile offset."));
+			goto out;
+		}
 
-		if (char_read == 0)
-			break;
-		/* Stop on newline only if not requested read from keyfile */
-		if ((flags & CRYPT_KEYFILE_STOP_EOL) && pass[i] == '\n') {
-			newline = 1;
-			pass[i] = '\0';
-			break;
+		/* Input redirected from a regular file can be read ahead and seek back after EOL */
+		if ((flags & CRYPT_KEYFILE_STOP_EOL) && !fstat(fd, &st) && S_ISREG(st.st_mode) &&
+		    lseek(fd, 0, SEEK_CUR) >= 0)
+			seekable = 1;
+
+		for (i = 0, newline = 0; i < key_size; i += char_read) {
+			if (i == buflen) {
+				buflen += 4096;
+				pass = crypt_safe_realloc(pass, buflen);
+				if (!pass) {
+					log_err(cd, _("Out of memory while reading passphrase."));
+					r = -ENOMEM;
+					goto out;
+				}
+			}
+
+			if ((flags & CRYPT_KEYFILE_STOP_EOL) && !seekable) {
+				/* If we should stop on newline, we must read the input
+				 * one character at the time. Otherwise we might end up
+				 * having read some bytes after the newline, which we
+				 * promised not to do.
+				 */
+				char_to_read = 1;
+			} else {
+				/* char_to_read = min(key_size - i, buflen - i) */
+				char_to_read = key_size < buflen ?
+					key_size - i : buflen - i;
+			}
+			char_read = read_buffer(fd, &pass[i], char_to_read);
+			if (char_read < 0) {
+				log_err(cd, _("Error reading passphrase."));
+				r = -EPIPE;
+				goto out;
+			}
+
+			if (char_read == 0)
+				break;
+			/* Stop on newline only if not requested read from keyfile */
+			if ((flags & CRYPT_KEYFILE_STOP_EOL) && seekable &&
+			    (eol = memchr(&pass[i], '\n', char_read))) {
+				/* return bytes after newline back to input */
+				if (lseek(fd, -(off_t)(char_read - (eol - &pass[i]) - 1), SEEK_CUR) < 0) {
+					log_err(cd, _("Error reading passphrase."));
+					r = -EPIPE;
+					goto out;
+				}
+				crypt_safe_memzero(eol, char_read - (eol - &pass[i]));
+				i = eol - pass;
+				newline = 1;
+				break;
+			} else if ((flags & CRYPT_KEYFILE_STOP_EOL) && !seekable && pass[i] == '\n') {
+				newline = 1;
+				pass[i] = '\0';
+				break;
+			}
 		}
 	}
 
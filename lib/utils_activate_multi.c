@@ -0,0 +1,274 @@
+/*
+ * utils_activate_multi - parallel unlock of more devices with one passphrase
+ *
+ * Copyright (C) 2021 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include "internal.h"
+
+/* the same limit as for the number of PBKDF threads */
+#define MULTI_THREADS_MAX 16
+
+struct multi_job {
+	struct crypt_activate_volume *v;
+	struct volume_key *vk;
+	uint64_t memory_kb;
+	uint64_t queued_usec;
+};
+
+struct multi_ctx {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct multi_job *jobs;
+	size_t count;
+	size_t next;
+	uint64_t budget_kb;
+	uint64_t used_kb;
+	unsigned running;
+	const char *passphrase;
+	size_t passphrase_size;
+};
+
+static uint64_t multi_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Memory needed by keyslot PBKDF, the biggest one if any keyslot can be used */
+static uint64_t multi_memory_kb(struct crypt_device *cd, int keyslot)
+{
+	struct crypt_pbkdf_type pbkdf;
+	uint64_t memory_kb = 0;
+	int i, first, last;
+
+	if (keyslot == CRYPT_ANY_SLOT) {
+		first = 0;
+		last = crypt_keyslot_max(crypt_get_type(cd)) - 1;
+	} else
+		first = last = keyslot;
+
+	for (i = first; i <= last; i++) {
+		if (crypt_keyslot_get_pbkdf(cd, i, &pbkdf) < 0 ||
+		    !strcmp(pbkdf.type, CRYPT_KDF_PBKDF2))
+			continue;
+		if (pbkdf.max_memory_kb > memory_kb)
+			memory_kb = pbkdf.max_memory_kb;
+	}
+
+	return memory_kb;
+}
+
+/*
+ * Jobs are started in order, a job waits until its PBKDF memory fits
+ * the budget. A job bigger than the whole budget runs alone.
+ */
+static struct multi_job *multi_job_get(struct multi_ctx *ctx)
+{
+	struct multi_job *job = NULL;
+
+	pthread_mutex_lock(&ctx->lock);
+	while (ctx->next < ctx->count) {
+		job = &ctx->jobs[ctx->next];
+		if (!ctx->running || ctx->used_kb + job->memory_kb <= ctx->budget_kb) {
+			ctx->next++;
+			ctx->used_kb += job->memory_kb;
+			ctx->running++;
+			break;
+		}
+		job = NULL;
+		pthread_cond_wait(&ctx->cond, &ctx->lock);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	return job;
+}
+
+static void multi_job_put(struct multi_ctx *ctx, struct multi_job *job)
+{
+	pthread_mutex_lock(&ctx->lock);
+	ctx->used_kb -= job->memory_kb;
+	ctx->running--;
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+static void *multi_worker(void *arg)
+{
+	struct multi_ctx *ctx = arg;
+	struct multi_job *job;
+	uint64_t start;
+
+	while ((job = multi_job_get(ctx))) {
+		start = multi_usec();
+		job->v->wait_usec = start - job->queued_usec;
+
+		job->v->result = crypt_unlock_volume_key(job->v->cd, job->v->keyslot,
+			ctx->passphrase, ctx->passphrase_size, job->v->flags, &job->vk);
+
+		job->v->unlock_usec = multi_usec() - start;
+		multi_job_put(ctx, job);
+	}
+
+	return NULL;
+}
+
+/* Activation runs in caller thread, device-mapper calls are not parallel */
+static void multi_activate(struct multi_ctx *ctx, struct multi_job *job)
+{
+	struct crypt_activate_volume *v = job->v;
+	uint64_t start = multi_usec();
+
+	if (v->result == -ENOTSUP) {
+		/* cannot be unlocked separately (reencryption, other types) */
+		v->result = crypt_activate_by_passphrase(v->cd, v->name, v->keyslot,
+				ctx->passphrase, ctx->passphrase_size, v->flags);
+		v->unlock_usec = multi_usec() - start;
+		return;
+	}
+
+	if (v->result >= 0)
+		v->result = crypt_activate_unlocked(v->cd, v->name, v->result, job->vk, v->flags);
+
+	v->activate_usec = multi_usec() - start;
+}
+
+int crypt_activate_by_passphrase_multi(struct crypt_activate_volume *volumes,
+	size_t count,
+	const char *passphrase,
+	size_t passphrase_size,
+	uint64_t memory_kb,
+	uint32_t threads)
+{
+	struct multi_ctx ctx = {
+		.passphrase = passphrase,
+		.passphrase_size = passphrase_size,
+	};
+	pthread_t tids[MULTI_THREADS_MAX];
+	struct crypt_device **cds;
+	struct device **devices;
+	unsigned i, started = 0;
+	uint64_t now;
+	size_t j;
+	int r = 0, batch;
+
+	if (!volumes || !count || !passphrase)
+		return -EINVAL;
+
+	for (j = 0; j < count; j++)
+		if (!volumes[j].cd)
+			return -EINVAL;
+
+	ctx.jobs = calloc(count, sizeof(*ctx.jobs));
+	if (!ctx.jobs)
+		return -ENOMEM;
+
+	/* loop devices for image files are allocated at once, not one by one in activation */
+	cds = calloc(count, sizeof(*cds));
+	devices = calloc(count, sizeof(*devices));
+	if (cds && devices) {
+		for (j = 0; j < count; j++) {
+			cds[j] = volumes[j].cd;
+			devices[j] = volumes[j].name ? crypt_data_device(volumes[j].cd) : NULL;
+		}
+		device_prepare_batch(cds, devices, count);
+	}
+	free(devices);
+	free(cds);
+
+	ctx.budget_kb = memory_kb ?: crypt_pbkdf_memory_budget_kb() ?: crypt_getphysmemory_kb() / 2;
+	if (!threads)
+		threads = crypt_cpusonline() ?: 1;
+	if (threads > MULTI_THREADS_MAX)
+		threads = MULTI_THREADS_MAX;
+	if (threads > count)
+		threads = count;
+
+	log_dbg(volumes[0].cd, "Unlocking %zu volumes using %u threads, PBKDF memory budget %" PRIu64 " kB.",
+		count, threads, ctx.budget_kb);
+
+	/* failed checks are not queued (and no PBKDF runs for them) */
+	now = multi_usec();
+	for (j = 0; j < count; j++) {
+		volumes[j].wait_usec = volumes[j].unlock_usec = volumes[j].activate_usec = 0;
+		volumes[j].result = crypt_activate_unlocked_check(volumes[j].cd,
+				volumes[j].name, volumes[j].flags);
+		if (volumes[j].result < 0)
+			continue;
+
+		ctx.jobs[ctx.count].v = &volumes[j];
+		ctx.jobs[ctx.count].memory_kb = multi_memory_kb(volumes[j].cd, volumes[j].keyslot);
+		ctx.jobs[ctx.count].queued_usec = now;
+		ctx.count++;
+	}
+
+	if (pthread_mutex_init(&ctx.lock, NULL)) {
+		free(ctx.jobs);
+		return -ENOMEM;
+	}
+	if (pthread_cond_init(&ctx.cond, NULL)) {
+		pthread_mutex_destroy(&ctx.lock);
+		free(ctx.jobs);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < threads && ctx.count; i++) {
+		if (pthread_create(&tids[i], NULL, multi_worker, &ctx))
+			break;
+		started++;
+	}
+
+	/* without any thread, unlock in caller thread */
+	if (!started && ctx.count)
+		multi_worker(&ctx);
+
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	pthread_cond_destroy(&ctx.cond);
+	pthread_mutex_destroy(&ctx.lock);
+
+	/* one udev synchronization for all devices (unless caller started batch) */
+	batch = crypt_activate_batch_begin();
+
+	for (j = 0; j < ctx.count; j++) {
+		multi_activate(&ctx, &ctx.jobs[j]);
+		crypt_free_volume_key(ctx.jobs[j].vk);
+	}
+
+	if (!batch)
+		crypt_activate_batch_end();
+
+	for (j = 0; j < count; j++) {
+		log_dbg(volumes[j].cd, "Volume %s: result %d, wait %" PRIu64 " us, unlock %" PRIu64
+			" us, activation %" PRIu64 " us.", volumes[j].name ?: "(check)", volumes[j].result,
+			volumes[j].wait_usec, volumes[j].unlock_usec, volumes[j].activate_usec);
+		if (!r && volumes[j].result < 0)
+			r = volumes[j].result;
+	}
+
+	free(ctx.jobs);
+
+	return r;
+}
@@ -0,0 +1,443 @@
+/*
+ * utils_async - long running operations in library worker thread
+ *
+ * Copyright (C) 2021 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "internal.h"
+
+typedef enum {
+	ASYNC_ACTIVATE = 0,
+	ASYNC_FORMAT,
+	ASYNC_WIPE,
+	ASYNC_REENCRYPT
+} async_op;
+
+struct crypt_async {
+	struct crypt_device *cd;
+	async_op op;
+	pthread_t tid;
+	bool joined;
+	int fd;
+
+	/* protected by lock */
+	pthread_mutex_t lock;
+	bool done;
+	bool cancel;
+	int result;
+	uint64_t size;
+	uint64_t offset;
+	uint64_t start_usec;
+	uint64_t end_usec;
+	struct crypt_reencrypt_stats stats;
+
+	union {
+		struct {
+			char *name;
+			int keyslot;
+			char *passphrase;
+			size_t passphrase_size;
+			uint32_t flags;
+		} activate;
+		struct {
+			char *type;
+			char *cipher;
+			char *cipher_mode;
+			char *uuid;
+			char *volume_key;
+			size_t volume_key_size;
+			void *params;
+		} format;
+		struct {
+			char *dev_path;
+			crypt_wipe_pattern pattern;
+			uint64_t offset;
+			uint64_t length;
+			size_t wipe_block_size;
+			uint32_t flags;
+		} wipe;
+	} u;
+};
+
+static uint64_t async_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* eventfd counter collapses pending notifications, overflow can be ignored */
+static void async_notify(struct crypt_async *job)
+{
+	uint64_t one = 1;
+
+	if (write(job->fd, &one, sizeof(one)) < 0)
+		log_dbg(job->cd, "Cannot signal asynchronous operation event.");
+}
+
+static int async_progress(uint64_t size, uint64_t offset, void *usrptr)
+{
+	struct crypt_async *job = usrptr;
+	int r;
+
+	pthread_mutex_lock(&job->lock);
+	job->size = size;
+	job->offset = offset;
+	/* counters exist only inside reencryption run, copy them here */
+	if (job->op == ASYNC_REENCRYPT) {
+		job->stats.struct_size = sizeof(job->stats);
+		(void)crypt_reencrypt_get_stats(job->cd, &job->stats);
+	}
+	r = job->cancel ? 1 : 0;
+	pthread_mutex_unlock(&job->lock);
+
+	async_notify(job);
+
+	return r;
+}
+
+static void *async_worker(void *arg)
+{
+	struct crypt_async *job = arg;
+	int r = -EINVAL;
+
+	switch (job->op) {
+	case ASYNC_ACTIVATE:
+		r = crypt_activate_by_passphrase(job->cd, job->u.activate.name,
+			job->u.activate.keyslot, job->u.activate.passphrase,
+			job->u.activate.passphrase_size, job->u.activate.flags);
+		break;
+	case ASYNC_FORMAT:
+		r = crypt_format(job->cd, job->u.format.type, job->u.format.cipher,
+			job->u.format.cipher_mode, job->u.format.uuid,
+			job->u.format.volume_key, job->u.format.volume_key_size,
+			job->u.format.params);
+		break;
+	case ASYNC_WIPE:
+		r = crypt_wipe(job->cd, job->u.wipe.dev_path, job->u.wipe.pattern,
+			job->u.wipe.offset, job->u.wipe.length, job->u.wipe.wipe_block_size,
+			job->u.wipe.flags, async_progress, job);
+		break;
+	case ASYNC_REENCRYPT:
+		r = crypt_reencrypt(job->cd, async_progress, job);
+		break;
+	}
+
+	pthread_mutex_lock(&job->lock);
+	job->result = r;
+	job->done = true;
+	job->end_usec = async_usec();
+	pthread_mutex_unlock(&job->lock);
+
+	log_dbg(job->cd, "Asynchronous operation finished with %d in %" PRIu64 " us.",
+		r, job->end_usec - job->start_usec);
+
+	async_notify(job);
+
+	return NULL;
+}
+
+static void async_release(struct crypt_async *job)
+{
+	if (job->fd >= 0)
+		close(job->fd);
+
+	switch (job->op) {
+	case ASYNC_ACTIVATE:
+		free(job->u.activate.name);
+		crypt_safe_free(job->u.activate.passphrase);
+		break;
+	case ASYNC_FORMAT:
+		free(job->u.format.type);
+		free(job->u.format.cipher);
+		free(job->u.format.cipher_mode);
+		free(job->u.format.uuid);
+		crypt_safe_free(job->u.format.volume_key);
+		break;
+	case ASYNC_WIPE:
+		free(job->u.wipe.dev_path);
+		break;
+	case ASYNC_REENCRYPT:
+		break;
+	}
+
+	free(job);
+}
+
+static struct crypt_async *async_alloc(struct crypt_device *cd, async_op op)
+{
+	struct crypt_async *job;
+
+	if (!(job = calloc(1, sizeof(*job))))
+		return NULL;
+
+	job->cd = cd;
+	job->op = op;
+	job->result = -EINPROGRESS;
+	job->joined = true;
+	job->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (job->fd < 0) {
+		free(job);
+		return NULL;
+	}
+
+	return job;
+}
+
+static int async_start(struct crypt_async **job, struct crypt_async *j)
+{
+	if (pthread_mutex_init(&j->lock, NULL)) {
+		async_release(j);
+		return -ENOMEM;
+	}
+
+	j->start_usec = async_usec();
+	if (pthread_create(&j->tid, NULL, async_worker, j)) {
+		log_dbg(j->cd, "Cannot start asynchronous operation thread.");
+		pthread_mutex_destroy(&j->lock);
+		async_release(j);
+		return -ENOMEM;
+	}
+	j->joined = false;
+
+	*job = j;
+	return 0;
+}
+
+static char *async_strdup(const char *s, bool *fail)
+{
+	char *r;
+
+	if (!s)
+		return NULL;
+
+	if (!(r = strdup(s)))
+		*fail = true;
+	return r;
+}
+
+static char *async_safe_dup(const char *buf, size_t size, bool *fail)
+{
+	char *r;
+
+	if (!buf)
+		return NULL;
+
+	if (!(r = crypt_safe_alloc(size ?: 1))) {
+		*fail = true;
+		return NULL;
+	}
+	memcpy(r, buf, size);
+	return r;
+}
+
+int crypt_async_activate_by_passphrase(struct crypt_async **job,
+	struct crypt_device *cd,
+	const char *name,
+	int keyslot,
+	const char *passphrase,
+	size_t passphrase_size,
+	uint32_t flags)
+{
+	struct crypt_async *j;
+	bool fail = false;
+
+	if (!job || !cd || !passphrase)
+		return -EINVAL;
+
+	if (!(j = async_alloc(cd, ASYNC_ACTIVATE)))
+		return -ENOMEM;
+
+	j->u.activate.name = async_strdup(name, &fail);
+	j->u.activate.keyslot = keyslot;
+	j->u.activate.passphrase = async_safe_dup(passphrase, passphrase_size, &fail);
+	j->u.activate.passphrase_size = passphrase_size;
+	j->u.activate.flags = flags;
+	if (fail) {
+		async_release(j);
+		return -ENOMEM;
+	}
+
+	return async_start(job, j);
+}
+
+int crypt_async_format(struct crypt_async **job,
+	struct crypt_device *cd,
+	const char *type,
+	const char *cipher,
+	const char *cipher_mode,
+	const char *uuid,
+	const char *volume_key,
+	size_t volume_key_size,
+	void *params)
+{
+	struct crypt_async *j;
+	bool fail = false;
+
+	if (!job || !cd || !type)
+		return -EINVAL;
+
+	if (!(j = async_alloc(cd, ASYNC_FORMAT)))
+		return -ENOMEM;
+
+	j->u.format.type = async_strdup(type, &fail);
+	j->u.format.cipher = async_strdup(cipher, &fail);
+	j->u.format.cipher_mode = async_strdup(cipher_mode, &fail);
+	j->u.format.uuid = async_strdup(uuid, &fail);
+	j->u.format.volume_key = async_safe_dup(volume_key, volume_key_size, &fail);
+	j->u.format.volume_key_size = volume_key_size;
+	j->u.format.params = params;
+	if (fail) {
+		async_release(j);
+		return -ENOMEM;
+	}
+
+	return async_start(job, j);
+}
+
+int crypt_async_wipe(struct crypt_async **job,
+	struct crypt_device *cd,
+	const char *dev_path,
+	crypt_wipe_pattern pattern,
+	uint64_t offset,
+	uint64_t length,
+	size_t wipe_block_size,
+	uint32_t flags)
+{
+	struct crypt_async *j;
+	bool fail = false;
+
+	if (!job || !cd)
+		return -EINVAL;
+
+	if (!(j = async_alloc(cd, ASYNC_WIPE)))
+		return -ENOMEM;
+
+	j->u.wipe.dev_path = async_strdup(dev_path, &fail);
+	j->u.wipe.pattern = pattern;
+	j->u.wipe.offset = offset;
+	j->u.wipe.length = length;
+	j->u.wipe.wipe_block_size = wipe_block_size;
+	j->u.wipe.flags = flags;
+	if (fail) {
+		async_release(j);
+		return -ENOMEM;
+	}
+
+	return async_start(job, j);
+}
+
+int crypt_async_reencrypt(struct crypt_async **job, struct crypt_device *cd)
+{
+	struct crypt_async *j;
+
+	if (!job || !cd)
+		return -EINVAL;
+
+	if (!(j = async_alloc(cd, ASYNC_REENCRYPT)))
+		return -ENOMEM;
+
+	return async_start(job, j);
+}
+
+int crypt_async_fd(struct crypt_async *job)
+{
+	if (!job)
+		return -EINVAL;
+
+	return job->fd;
+}
+
+int crypt_async_status(struct crypt_async *job, struct crypt_async_status *status)
+{
+	uint64_t events;
+
+	/* all members before reencryption counters are mandatory */
+	if (!job || !status || status->struct_size < offsetof(struct crypt_async_status, reencrypt_stats))
+		return -EINVAL;
+
+	/* reset event counter, status below is never older than the event */
+	if (read(job->fd, &events, sizeof(events)) < 0 && errno != EAGAIN)
+		log_dbg(job->cd, "Cannot read asynchronous operation event.");
+
+	pthread_mutex_lock(&job->lock);
+	status->done = job->done;
+	status->result = job->result;
+	status->size = job->size;
+	status->offset = job->offset;
+	status->elapsed_usec = (job->done ? job->end_usec : async_usec()) - job->start_usec;
+	if (status->struct_size >= offsetof(struct crypt_async_status, reencrypt_stats) + sizeof(status->reencrypt_stats))
+		status->reencrypt_stats = job->stats;
+	pthread_mutex_unlock(&job->lock);
+
+	return 0;
+}
+
+int crypt_async_cancel(struct crypt_async *job)
+{
+	int r = 0;
+
+	if (!job)
+		return -EINVAL;
+
+	/* only operations with progress callback can be interrupted */
+	if (job->op != ASYNC_WIPE && job->op != ASYNC_REENCRYPT)
+		return -ENOTSUP;
+
+	pthread_mutex_lock(&job->lock);
+	if (job->done)
+		r = -EALREADY;
+	else
+		job->cancel = true;
+	pthread_mutex_unlock(&job->lock);
+
+	return r;
+}
+
+int crypt_async_wait(struct crypt_async *job)
+{
+	if (!job)
+		return -EINVAL;
+
+	if (!job->joined) {
+		pthread_join(job->tid, NULL);
+		job->joined = true;
+	}
+
+	return job->result;
+}
+
+void crypt_async_free(struct crypt_async *job)
+{
+	if (!job)
+		return;
+
+	(void)crypt_async_cancel(job);
+	(void)crypt_async_wait(job);
+
+	pthread_mutex_destroy(&job->lock);
+	async_release(job);
+}
@@ -19,10 +19,18 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include "internal.h"
+#include "integrity/integrity.h"
+#include "utils_storage_wrappers.h"
 
 int crypt_benchmark(struct crypt_device *cd,
 	const char *cipher,
@@ -88,6 +96,614 @@ out:
 	return r;
 }
 
+int crypt_benchmark_integrity(struct crypt_device *cd,
+	const char *integrity,
+	size_t integrity_key_size,
+	uint32_t sector_size,
+	size_t buffer_size,
+	double *tags_mbs)
+{
+	struct volume_key *vk = NULL;
+	void *buffer = NULL;
+	double ms, ms_total = 0.0;
+	unsigned repeat = 0;
+	int r;
+
+	if (!integrity || !tags_mbs || !buffer_size)
+		return -EINVAL;
+
+	r = init_crypto(cd);
+	if (r < 0)
+		return r;
+
+	if (integrity_key_size) {
+		vk = crypt_generate_volume_key(cd, integrity_key_size);
+		if (!vk)
+			return -ENOMEM;
+	}
+
+	r = -ENOMEM;
+	if (posix_memalign(&buffer, crypt_getpagesize(), buffer_size))
+		goto out;
+
+	crypt_random_get(cd, buffer, buffer_size, CRYPT_RND_NORMAL);
+
+	log_dbg(cd, "Running %s integrity tags benchmark (%u bytes sector).", integrity, sector_size);
+
+	while (ms_total < 1000.0) {
+		r = INTEGRITY_benchmark_tags(cd, integrity, vk, sector_size, buffer, buffer_size, &ms);
+		if (r < 0)
+			goto out;
+		if (ms < 0.001) {
+			log_dbg(cd, "Measured integrity tags runtime is too low.");
+			r = -ERANGE;
+			goto out;
+		}
+		ms_total += ms;
+		repeat++;
+	}
+
+	*tags_mbs = (double)buffer_size * repeat / (1024 * 1024) / (ms_total / 1000.);
+	r = 0;
+out:
+	free(buffer);
+	crypt_free_volume_key(vk);
+
+	return r;
+}
+
+struct benchmark_storage {
+	struct crypt_storage *s;
+	struct crypt_storage_wrapper *cw;
+	char *buffer;
+	size_t buffer_size;
+};
+
+static int benchmark_storage_run(struct benchmark_storage *b, bool encrypt)
+{
+	ssize_t len;
+
+	if (!b->cw)
+		return encrypt ? crypt_storage_encrypt(b->s, 0, b->buffer_size, b->buffer) :
+				 crypt_storage_decrypt(b->s, 0, b->buffer_size, b->buffer);
+
+	/* dm-zero below dm-crypt, writes are discarded and reads decrypt zeroes */
+	if (encrypt)
+		len = crypt_storage_wrapper_encrypt_write(b->cw, 0, b->buffer, b->buffer_size);
+	else
+		len = crypt_storage_wrapper_read_decrypt(b->cw, 0, b->buffer, b->buffer_size);
+
+	return len == (ssize_t)b->buffer_size ? 0 : -EIO;
+}
+
+static int benchmark_storage_measure(struct benchmark_storage *b, bool encrypt, double *mbs)
+{
+	struct timespec start, end;
+	double ms = 0.0;
+	unsigned repeat = 0;
+	int r;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &start) < 0)
+		return -EINVAL;
+
+	while (ms < 1000.0) {
+		r = benchmark_storage_run(b, encrypt);
+		if (r < 0)
+			return r;
+		repeat++;
+
+		if (clock_gettime(CLOCK_MONOTONIC, &end) < 0)
+			return -EINVAL;
+		ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / (1000.0 * 1000);
+	}
+
+	*mbs = (double)b->buffer_size * repeat / (1024 * 1024) / (ms / 1000.);
+	return 0;
+}
+
+/* Temporary dm-zero device is the backing device for dm-crypt benchmark */
+static int benchmark_zero_device(struct crypt_device *cd, const char *name,
+				 size_t buffer_size, struct device **device)
+{
+	char path[PATH_MAX];
+	struct crypt_dm_active_device dmd = {
+		.size = buffer_size >> SECTOR_SHIFT,
+		.flags = CRYPT_ACTIVATE_PRIVATE,
+	};
+	int r;
+
+	r = dm_zero_target_set(&dmd.segment, 0, dmd.size);
+	if (!r)
+		r = dm_create_device(cd, name, "TEMP", &dmd);
+	dm_targets_free(cd, &dmd);
+	if (r < 0)
+		return r;
+
+	if (snprintf(path, sizeof(path), "%s/%s", dm_get_dir(), name) < 0)
+		r = -ENOMEM;
+	else
+		r = device_alloc(cd, device, path);
+
+	if (r < 0)
+		dm_remove_device(cd, name, CRYPT_DEACTIVATE_FORCE | DM_DEACTIVATE_PRIVATE);
+
+	return r;
+}
+
+int crypt_benchmark_storage(struct crypt_device *cd,
+	const char *cipher,
+	const char *cipher_mode,
+	size_t volume_key_size,
+	uint32_t sector_size,
+	uint32_t threads,
+	size_t buffer_size,
+	uint32_t flags,
+	double *encryption_mbs,
+	double *decryption_mbs)
+{
+	struct benchmark_storage b = { .buffer_size = buffer_size };
+	struct volume_key *vk = NULL;
+	struct device *device = NULL;
+	char zero_name[64], cipher_spec[MAX_CIPHER_LEN * 2 + 1];
+	void *buffer = NULL;
+	bool dm_init = false;
+	int r;
+
+	if (!cipher || !cipher_mode || !volume_key_size || !encryption_mbs || !decryption_mbs)
+		return -EINVAL;
+
+	if (!sector_size)
+		sector_size = SECTOR_SIZE;
+
+	if (sector_size < SECTOR_SIZE || sector_size > MAX_SECTOR_SIZE ||
+	    NOTPOW2(sector_size) || !buffer_size || buffer_size % sector_size)
+		return -EINVAL;
+
+	r = init_crypto(cd);
+	if (r < 0)
+		return r;
+
+	vk = crypt_generate_volume_key(cd, volume_key_size);
+	if (!vk)
+		return -ENOMEM;
+
+	r = -ENOMEM;
+	if (posix_memalign(&buffer, crypt_getpagesize(), buffer_size))
+		goto out;
+	b.buffer = buffer;
+
+	crypt_random_get(cd, buffer, buffer_size, CRYPT_RND_NORMAL);
+
+	if (flags & CRYPT_BENCHMARK_DMCRYPT) {
+		if (snprintf(cipher_spec, sizeof(cipher_spec), "%s-%s", cipher, cipher_mode) < 0 ||
+		    snprintf(zero_name, sizeof(zero_name), "temporary-cryptsetup-benchmark-%d", getpid()) < 0)
+			goto out;
+
+		if (!cd) {
+			dm_backend_init(cd);
+			dm_init = true;
+		}
+
+		log_dbg(cd, "Running %s dm-crypt benchmark (%u bytes sector, %zu bytes buffer).",
+			cipher_spec, sector_size, buffer_size);
+
+		r = benchmark_zero_device(cd, zero_name, buffer_size, &device);
+		if (r < 0)
+			goto out;
+
+		/* dm-crypt schedules sector processing on its own, threads are ignored */
+		r = crypt_storage_wrapper_init(cd, &b.cw, device, 0, 0, sector_size, cipher_spec,
+					       vk, DISABLE_USPACE | DISABLE_KCAPI);
+		if (!r && crypt_storage_wrapper_get_type(b.cw) != DMCRYPT)
+			r = -ENOTSUP;
+	} else {
+		log_dbg(cd, "Running %s-%s storage benchmark (%u bytes sector, %u threads, %zu bytes buffer).",
+			cipher, cipher_mode, sector_size, threads, buffer_size);
+
+		r = crypt_storage_init_threads(&b.s, sector_size, cipher, cipher_mode,
+					       vk->key, vk->keylength, false, threads);
+	}
+
+	if (r) {
+		log_dbg(cd, "Cannot initialize cipher %s, mode %s, key size %zu.",
+			cipher, cipher_mode, volume_key_size);
+		goto out;
+	}
+
+	r = benchmark_storage_measure(&b, true, encryption_mbs);
+	if (!r)
+		r = benchmark_storage_measure(&b, false, decryption_mbs);
+out:
+	crypt_storage_wrapper_destroy(b.cw);
+	crypt_storage_destroy(b.s);
+	if (device) {
+		device_free(cd, device);
+		dm_remove_device(cd, zero_name, CRYPT_DEACTIVATE_FORCE | DM_DEACTIVATE_PRIVATE);
+	}
+	if (dm_init)
+		dm_backend_exit(cd);
+	free(buffer);
+	crypt_free_volume_key(vk);
+
+	return r;
+}
+
+/* dm-crypt data processed for every sector size */
+#define BENCHMARK_SECTOR_BUFFER (4 * 1024 * 1024)
+/* smaller sector size is kept unless the bigger one is faster than the noise */
+#define BENCHMARK_SECTOR_TOLERANCE 0.05
+
+int crypt_benchmark_sector_size(struct crypt_device *cd,
+	const char *data_device,
+	const char *cipher,
+	const char *cipher_mode,
+	size_t volume_key_size,
+	uint32_t *sector_size)
+{
+	struct device *device = NULL;
+	double enc_mbs, dec_mbs, mbs[4] = {}, best_mbs = 0.0;
+	uint32_t ss, min_ss, dmc_flags;
+	uint64_t dev_size = 0;
+	int i, r, measured = 0;
+
+	if (!cipher || !cipher_mode || !volume_key_size || !sector_size)
+		return -EINVAL;
+
+	/* LUKS1 (and plain) formats use only 512-byte sectors */
+	if (crypt_get_type(cd) && strcmp(crypt_get_type(cd), CRYPT_LUKS2)) {
+		log_err(cd, _("Encryption sector size can be selected only for LUKS2 format."));
+		return -EINVAL;
+	}
+
+	if (data_device) {
+		r = device_alloc(cd, &device, data_device);
+		if (r < 0)
+			return r;
+	}
+
+	min_ss = device_min_encryption_sector_size(cd, device ?: crypt_data_device(cd));
+	if (device_size(device ?: crypt_data_device(cd), &dev_size))
+		dev_size = 0;
+	device_free(cd, device);
+
+	*sector_size = min_ss;
+
+	if (dm_flags(cd, DM_CRYPT, &dmc_flags) || !(dmc_flags & DM_SECTOR_SIZE_SUPPORTED)) {
+		log_dbg(cd, "dm-crypt does not support encryption sector size option.");
+		/* device with bigger logical block cannot use 512-byte sectors */
+		return min_ss > SECTOR_SIZE ? -ENOTSUP : 0;
+	}
+
+	for (i = 0, ss = SECTOR_SIZE; ss <= MAX_SECTOR_SIZE; ss <<= 1, i++) {
+		if (ss < min_ss || (dev_size && MISALIGNED(dev_size, ss)))
+			continue;
+
+		r = crypt_benchmark_storage(cd, cipher, cipher_mode, volume_key_size, ss, 0,
+					    BENCHMARK_SECTOR_BUFFER, CRYPT_BENCHMARK_DMCRYPT,
+					    &enc_mbs, &dec_mbs);
+		if (r == -EINTR)
+			return r;
+		if (r < 0) {
+			log_dbg(cd, "Sector size %u benchmark failed (%d).", ss, r);
+			continue;
+		}
+
+		mbs[i] = enc_mbs + dec_mbs;
+		if (mbs[i] > best_mbs)
+			best_mbs = mbs[i];
+		measured++;
+		log_dbg(cd, "Sector size %u: encryption %.1f MiB/s, decryption %.1f MiB/s.",
+			ss, enc_mbs, dec_mbs);
+	}
+
+	if (!measured)
+		return -ENOTSUP;
+
+	for (i = 0, ss = SECTOR_SIZE; ss <= MAX_SECTOR_SIZE; ss <<= 1, i++)
+		if (mbs[i] > 0.0 && mbs[i] >= best_mbs * (1.0 - BENCHMARK_SECTOR_TOLERANCE)) {
+			*sector_size = ss;
+			break;
+		}
+
+	log_dbg(cd, "Selected encryption sector size %u bytes.", *sector_size);
+
+	return 0;
+}
+
+/* probed part of data area and time spent with every flags candidate */
+#define BENCHMARK_PERF_AREA (UINT64_C(1024) * 1024 * 1024)
+#define BENCHMARK_PERF_USEC (250 * 1000)
+/* latency: single 4 KiB random reads, throughput: parallel 1 MiB sequential reads */
+#define BENCHMARK_PERF_LATENCY_IO 4096
+#define BENCHMARK_PERF_LATENCY_SAMPLES 16384
+#define BENCHMARK_PERF_THROUGHPUT_IO (1024 * 1024)
+#define BENCHMARK_PERF_READERS 4
+/* default flags are kept unless a candidate is better than the noise */
+#define BENCHMARK_PERF_TOLERANCE 0.10
+
+static const uint32_t benchmark_perf_candidates[] = {
+	0,
+	CRYPT_ACTIVATE_NO_READ_WORKQUEUE | CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE,
+	CRYPT_ACTIVATE_SAME_CPU_CRYPT,
+	CRYPT_ACTIVATE_SAME_CPU_CRYPT | CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS,
+};
+
+struct benchmark_perf_job {
+	pthread_t thread;
+	int fd;
+	uint64_t offset;
+	uint64_t length;
+	size_t io_size;
+	bool random;
+	uint64_t seed;
+	uint64_t deadline;
+	void *buffer;
+	uint64_t bytes;
+	uint32_t *samples;
+	unsigned samples_count;
+	int r;
+};
+
+static uint64_t benchmark_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *benchmark_perf_read(void *arg)
+{
+	struct benchmark_perf_job *job = arg;
+	uint64_t start, now, pos = 0, blocks = job->length / job->io_size;
+	ssize_t len;
+
+	now = benchmark_usec();
+	do {
+		if (job->random) {
+			/* xorshift, offsets have to be unpredictable for readahead only */
+			job->seed ^= job->seed << 13;
+			job->seed ^= job->seed >> 7;
+			job->seed ^= job->seed << 17;
+			pos = (job->seed % blocks) * job->io_size;
+		}
+
+		start = now;
+		len = pread(job->fd, job->buffer, job->io_size, job->offset + pos);
+		now = benchmark_usec();
+		if (len != (ssize_t)job->io_size) {
+			job->r = -EIO;
+			break;
+		}
+		job->bytes += len;
+
+		if (job->samples) {
+			job->samples[job->samples_count++] = now - start;
+			if (job->samples_count == BENCHMARK_PERF_LATENCY_SAMPLES)
+				break;
+		}
+
+		if (!job->random && (pos += job->io_size) >= job->length)
+			pos = 0;
+	} while (now < job->deadline);
+
+	return NULL;
+}
+
+static int benchmark_perf_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Read-only probe, score is higher for better flags (reads/s or MiB/s) */
+static int benchmark_perf_measure(int fd, uint64_t size, uint32_t profile, double *score)
+{
+	struct benchmark_perf_job jobs[BENCHMARK_PERF_READERS] = {};
+	uint64_t start, bytes = 0;
+	unsigned i, count, started;
+	int r = 0;
+
+	count = profile == CRYPT_PERF_PROFILE_THROUGHPUT ? BENCHMARK_PERF_READERS : 1;
+	start = benchmark_usec();
+
+	for (i = 0; i < count; i++) {
+		jobs[i].fd = fd;
+		jobs[i].deadline = start + BENCHMARK_PERF_USEC;
+		if (count == 1) {
+			jobs[i].io_size = BENCHMARK_PERF_LATENCY_IO;
+			jobs[i].length = size;
+			jobs[i].random = true;
+			jobs[i].seed = size | 1;
+			jobs[i].samples = malloc(BENCHMARK_PERF_LATENCY_SAMPLES * sizeof(uint32_t));
+			if (!jobs[i].samples)
+				r = -ENOMEM;
+		} else {
+			jobs[i].io_size = BENCHMARK_PERF_THROUGHPUT_IO;
+			jobs[i].length = size / count;
+			jobs[i].offset = i * jobs[i].length;
+		}
+		if (!r && posix_memalign(&jobs[i].buffer, crypt_getpagesize(), jobs[i].io_size))
+			r = -ENOMEM;
+	}
+
+	/* job 0 runs in this thread */
+	for (started = 1; started < count && !r; started++)
+		if (pthread_create(&jobs[started].thread, NULL, benchmark_perf_read, &jobs[started])) {
+			r = -ENOMEM;
+			break;
+		}
+
+	if (!r)
+		benchmark_perf_read(&jobs[0]);
+
+	for (i = 1; i < started; i++)
+		pthread_join(jobs[i].thread, NULL);
+
+	for (i = 0; i < count; i++) {
+		if (!r)
+			r = jobs[i].r;
+		bytes += jobs[i].bytes;
+	}
+
+	if (!r && count == 1) {
+		if (!jobs[0].samples_count)
+			r = -EIO;
+		else {
+			qsort(jobs[0].samples, jobs[0].samples_count, sizeof(uint32_t), benchmark_perf_cmp);
+			*score = 1000000.0 / (jobs[0].samples[jobs[0].samples_count / 2] ?: 1);
+		}
+	} else if (!r)
+		*score = (double)bytes / (1024 * 1024) / ((benchmark_usec() - start) / 1000000.0);
+
+	for (i = 0; i < count; i++) {
+		free(jobs[i].buffer);
+		free(jobs[i].samples);
+	}
+
+	return r;
+}
+
+static int benchmark_perf_candidate(struct crypt_device *cd, struct volume_key *vk,
+				    const char *cipher_spec, uint64_t size,
+				    uint32_t flags, uint32_t profile, double *score)
+{
+	char name[64], path[PATH_MAX];
+	struct crypt_dm_active_device dmd = {
+		.size = size >> SECTOR_SHIFT,
+		.flags = CRYPT_ACTIVATE_PRIVATE | CRYPT_ACTIVATE_READONLY | flags,
+	};
+	int fd, r;
+
+	if (snprintf(name, sizeof(name), "temporary-cryptsetup-perf-%d", getpid()) < 0 ||
+	    snprintf(path, sizeof(path), "%s/%s", dm_get_dir(), name) < 0)
+		return -ENOMEM;
+
+	r = dm_crypt_target_set(&dmd.segment, 0, dmd.size, crypt_data_device(cd), vk,
+				cipher_spec, crypt_get_iv_offset(cd), crypt_get_data_offset(cd),
+				NULL, 0, crypt_get_sector_size(cd));
+	if (!r)
+		r = dm_create_device(cd, name, "TEMP", &dmd);
+	dm_targets_free(cd, &dmd);
+	if (r < 0)
+		return r;
+
+	fd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+	if (fd < 0)
+		r = -EIO;
+	else {
+		r = benchmark_perf_measure(fd, size, profile, score);
+		close(fd);
+	}
+
+	dm_remove_device(cd, name, CRYPT_DEACTIVATE_FORCE | DM_DEACTIVATE_PRIVATE);
+
+	return r;
+}
+
+int crypt_benchmark_perf_flags(struct crypt_device *cd,
+	const char *volume_key,
+	size_t volume_key_size,
+	uint32_t profile,
+	uint32_t *flags)
+{
+	struct volume_key *vk;
+	char cipher_spec[MAX_CIPHER_LEN * 2 + 1];
+	double score[ARRAY_SIZE(benchmark_perf_candidates)] = {}, best = 0.0;
+	uint32_t dmc_flags, required;
+	uint64_t size;
+	unsigned i;
+	int r = 0;
+
+	if (!cd || !volume_key || !volume_key_size || !flags ||
+	    profile > CRYPT_PERF_PROFILE_THROUGHPUT)
+		return -EINVAL;
+
+	*flags = 0;
+
+	if (!crypt_get_cipher(cd) || !crypt_get_cipher_mode(cd))
+		return -EINVAL;
+
+	if (crypt_get_integrity_tag_size(cd)) {
+		log_dbg(cd, "Performance flags probe is not supported with integrity protection.");
+		return -ENOTSUP;
+	}
+
+	if (dm_flags(cd, DM_CRYPT, &dmc_flags))
+		return -ENOTSUP;
+
+	if (device_size(crypt_data_device(cd), &size) ||
+	    size <= crypt_get_data_offset(cd) * SECTOR_SIZE)
+		return -EINVAL;
+	size -= crypt_get_data_offset(cd) * SECTOR_SIZE;
+	if (size > BENCHMARK_PERF_AREA)
+		size = BENCHMARK_PERF_AREA;
+	size -= size % BENCHMARK_PERF_THROUGHPUT_IO;
+	if (size < BENCHMARK_PERF_READERS * BENCHMARK_PERF_THROUGHPUT_IO) {
+		log_dbg(cd, "Data area is too small for performance flags probe.");
+		return 0;
+	}
+
+	if (profile == CRYPT_PERF_PROFILE_AUTO)
+		profile = device_is_rotational(crypt_data_device(cd)) == 1 ?
+			  CRYPT_PERF_PROFILE_THROUGHPUT : CRYPT_PERF_PROFILE_LATENCY;
+
+	if (snprintf(cipher_spec, sizeof(cipher_spec), "%s-%s",
+		     crypt_get_cipher(cd), crypt_get_cipher_mode(cd)) < 0)
+		return -ENOMEM;
+
+	vk = crypt_alloc_volume_key(volume_key_size, volume_key);
+	if (!vk)
+		return -ENOMEM;
+
+	log_dbg(cd, "Probing dm-crypt performance flags for %s profile.",
+		profile == CRYPT_PERF_PROFILE_THROUGHPUT ? "throughput" : "latency");
+
+	for (i = 0; i < ARRAY_SIZE(benchmark_perf_candidates); i++) {
+		required = 0;
+		if (benchmark_perf_candidates[i] & CRYPT_ACTIVATE_SAME_CPU_CRYPT)
+			required |= DM_SAME_CPU_CRYPT_SUPPORTED;
+		if (benchmark_perf_candidates[i] & CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS)
+			required |= DM_SUBMIT_FROM_CRYPT_CPUS_SUPPORTED;
+		if (benchmark_perf_candidates[i] & (CRYPT_ACTIVATE_NO_READ_WORKQUEUE | CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE))
+			required |= DM_CRYPT_NO_WORKQUEUE_SUPPORTED;
+		if ((dmc_flags & required) != required)
+			continue;
+
+		r = benchmark_perf_candidate(cd, vk, cipher_spec, size, benchmark_perf_candidates[i],
+					     profile, &score[i]);
+		if (r < 0) {
+			log_dbg(cd, "Performance flags 0x%x probe failed (%d).", benchmark_perf_candidates[i], r);
+			score[i] = 0.0;
+			/* without the default mapping there is nothing to compare with */
+			if (!i)
+				break;
+			continue;
+		}
+
+		log_dbg(cd, "Performance flags 0x%x: score %.1f.", benchmark_perf_candidates[i], score[i]);
+		if (score[i] > best)
+			best = score[i];
+	}
+
+	crypt_free_volume_key(vk);
+
+	if (score[0] <= 0.0)
+		return r < 0 ? r : -EIO;
+
+	/* default flags are the first candidate */
+	for (i = 0; i < ARRAY_SIZE(benchmark_perf_candidates); i++)
+		if (score[i] > 0.0 && score[i] >= best * (1.0 - BENCHMARK_PERF_TOLERANCE)) {
+			*flags = benchmark_perf_candidates[i];
+			break;
+		}
+
+	log_dbg(cd, "Selected dm-crypt performance flags 0x%x.", *flags);
+
+	return 0;
+}
+
 int crypt_benchmark_pbkdf(struct crypt_device *cd,
 	struct crypt_pbkdf_type *pbkdf,
 	const char *password,
@@ -112,10 +728,13 @@ int crypt_benchmark_pbkdf(struct crypt_device *cd,
 
 	log_dbg(cd, "Running %s(%s) benchmark.", pbkdf->type, kdf_opt);
 
+	TRACE5(kdf__start, pbkdf->type, pbkdf->hash, 0, pbkdf->max_memory_kb,
+	       pbkdf->parallel_threads);
 	r = crypt_pbkdf_perf(pbkdf->type, pbkdf->hash, password, password_size,
 			     salt, salt_size, volume_key_size, pbkdf->time_ms,
 			     pbkdf->max_memory_kb, pbkdf->parallel_threads,
 			     &pbkdf->iterations, &pbkdf->max_memory_kb, progress, usrptr);
+	TRACE2(kdf__end, pbkdf->type, r);
 
 	if (!r)
 		log_dbg(cd, "Benchmark returns %s(%s) %u iterations, %u memory, %u threads (for %zu-bits key).",
@@ -124,6 +743,42 @@ int crypt_benchmark_pbkdf(struct crypt_device *cd,
 	return r;
 }
 
+int crypt_benchmark_pbkdf_cost(struct crypt_device *cd,
+	const struct crypt_pbkdf_type *pbkdf,
+	const char *password,
+	size_t password_size,
+	const char *salt,
+	size_t salt_size,
+	size_t volume_key_size,
+	uint32_t warmup,
+	uint32_t samples,
+	uint64_t *min_us,
+	uint64_t *avg_us)
+{
+	int r;
+
+	if (!pbkdf || !pbkdf->type || (!password && password_size) || !samples)
+		return -EINVAL;
+
+	r = init_crypto(cd);
+	if (r < 0)
+		return r;
+
+	log_dbg(cd, "Measuring %s with %u iterations, %u memory, %u threads (%u runs, %u warm-up).",
+		pbkdf->type, pbkdf->iterations, pbkdf->max_memory_kb,
+		pbkdf->parallel_threads, samples, warmup);
+
+	TRACE5(kdf__start, pbkdf->type, pbkdf->hash, pbkdf->iterations, pbkdf->max_memory_kb,
+	       pbkdf->parallel_threads);
+	r = crypt_pbkdf_measure(pbkdf->type, pbkdf->hash, password, password_size,
+				salt, salt_size, volume_key_size, pbkdf->iterations,
+				pbkdf->max_memory_kb, pbkdf->parallel_threads,
+				warmup, samples, min_us, avg_us);
+	TRACE2(kdf__end, pbkdf->type, r);
+
+	return r;
+}
+
 struct benchmark_usrptr {
 	struct crypt_device *cd;
 	struct crypt_pbkdf_type *pbkdf;
@@ -140,6 +795,258 @@ static int benchmark_callback(uint32_t time_ms, void *usrptr)
 	return 0;
 }
 
+/*
+ * Optional persistent PBKDF benchmark cache (global on library level).
+ * Each line is "<key> <timestamp> <iterations> <memory_kb>", the key
+ * describes benchmark input and the system (CPU model, crypto backend).
+ */
+#define PBKDF_CACHE_LINE_MAX 1024
+
+static pthread_mutex_t _pbkdf_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *_pbkdf_cache_path = NULL;
+static uint32_t _pbkdf_cache_ttl = 0;
+
+int crypt_pbkdf_cache(struct crypt_device *cd __attribute__((unused)),
+	const char *path, uint32_t ttl_sec)
+{
+	char *tmp = NULL;
+
+	if (path && *path != '/')
+		return -EINVAL;
+
+	if (path && !(tmp = strdup(path)))
+		return -ENOMEM;
+
+	pthread_mutex_lock(&_pbkdf_cache_lock);
+	free(_pbkdf_cache_path);
+	_pbkdf_cache_path = tmp;
+	_pbkdf_cache_ttl = ttl_sec;
+	pthread_mutex_unlock(&_pbkdf_cache_lock);
+
+	return 0;
+}
+
+/* Returns copy of the cache path (or NULL if not set), cache can be reset meanwhile */
+static char *pbkdf_cache_path(uint32_t *ttl)
+{
+	char *path = NULL;
+
+	pthread_mutex_lock(&_pbkdf_cache_lock);
+	if (_pbkdf_cache_path)
+		path = strdup(_pbkdf_cache_path);
+	*ttl = _pbkdf_cache_ttl;
+	pthread_mutex_unlock(&_pbkdf_cache_lock);
+
+	return path;
+}
+
+static void pbkdf_cache_sanitize(char *str)
+{
+	for (; *str; str++)
+		if (isspace((unsigned char)*str) || !isprint((unsigned char)*str))
+			*str = '_';
+}
+
+static void pbkdf_cache_cpu_model(char *model, size_t len)
+{
+	char line[256], *c;
+	FILE *f;
+
+	snprintf(model, len, "unknown");
+
+	f = fopen("/proc/cpuinfo", "r");
+	if (!f)
+		return;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, "model name", 10) || !(c = strchr(line, ':')))
+			continue;
+		while (*++c == ' ');
+		c[strcspn(c, "\n")] = '\0';
+		snprintf(model, len, "%s", c);
+		break;
+	}
+	fclose(f);
+}
+
+static int pbkdf_cache_key(const struct crypt_pbkdf_type *pbkdf, size_t volume_key_size,
+	char *key, size_t len)
+{
+	char model[128];
+	int r;
+
+	pbkdf_cache_cpu_model(model, sizeof(model));
+
+	r = snprintf(key, len, "%s:%s:%u:%u:%u:%zu:%u:%s:%s", pbkdf->type,
+		     pbkdf->hash ?: "", pbkdf->time_ms, pbkdf->max_memory_kb,
+		     pbkdf->parallel_threads, volume_key_size, crypt_cpusonline(),
+		     model, crypt_backend_version() ?: "");
+	if (r < 0 || (size_t)r >= len)
+		return -EINVAL;
+
+	pbkdf_cache_sanitize(key);
+	return 0;
+}
+
+static bool pbkdf_cache_parse(const char *line, char *key, size_t key_len,
+	uint64_t *timestamp, uint32_t *iterations, uint32_t *memory_kb)
+{
+	unsigned long long ts;
+	unsigned int it, mem;
+	const char *c = strchr(line, ' ');
+
+	if (!c || (size_t)(c - line) >= key_len)
+		return false;
+
+	if (sscanf(c, " %llu %u %u", &ts, &it, &mem) != 3)
+		return false;
+
+	memcpy(key, line, c - line);
+	key[c - line] = '\0';
+	*timestamp = ts;
+	*iterations = it;
+	*memory_kb = mem;
+
+	return true;
+}
+
+static bool pbkdf_cache_stale(uint64_t timestamp, uint64_t now, uint32_t ttl)
+{
+	if (timestamp > now)
+		return true;
+
+	return ttl && (now - timestamp) > ttl;
+}
+
+/* Cache file is not trusted, entry must be within PBKDF limits and requested memory */
+static bool pbkdf_cache_valid(const struct crypt_pbkdf_type *pbkdf,
+	uint32_t iterations, uint32_t memory_kb)
+{
+	struct crypt_pbkdf_limits limits;
+
+	if (crypt_pbkdf_get_limits(pbkdf->type, &limits))
+		return false;
+
+	if (iterations < limits.min_iterations || iterations > limits.max_iterations)
+		return false;
+
+	if (!strcmp(pbkdf->type, CRYPT_KDF_PBKDF2))
+		return memory_kb == 0;
+
+	return memory_kb >= limits.min_memory && memory_kb <= limits.max_memory &&
+	       memory_kb <= pbkdf->max_memory_kb;
+}
+
+static int pbkdf_cache_lookup(struct crypt_device *cd, const char *path, uint32_t ttl,
+	const char *key, struct crypt_pbkdf_type *pbkdf)
+{
+	char line[PBKDF_CACHE_LINE_MAX], line_key[PBKDF_CACHE_LINE_MAX];
+	uint64_t timestamp, now = time(NULL);
+	uint32_t it, mem;
+	int r = -ENOENT;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -ENOENT;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (!pbkdf_cache_parse(line, line_key, sizeof(line_key), &timestamp, &it, &mem) ||
+		    strcmp(line_key, key))
+			continue;
+
+		if (pbkdf_cache_stale(timestamp, now, ttl)) {
+			log_dbg(cd, "Cached PBKDF benchmark is stale.");
+			break;
+		}
+
+		if (!pbkdf_cache_valid(pbkdf, it, mem)) {
+			log_dbg(cd, "Ignoring invalid cached PBKDF benchmark (%u iterations, %u memory).", it, mem);
+			break;
+		}
+
+		pbkdf->iterations = it;
+		pbkdf->max_memory_kb = mem;
+		r = 0;
+		break;
+	}
+	fclose(f);
+
+	return r;
+}
+
+static void pbkdf_cache_store(struct crypt_device *cd, const char *path, uint32_t ttl,
+	const char *key, uint32_t iterations, uint32_t memory_kb)
+{
+	char line[PBKDF_CACHE_LINE_MAX], line_key[PBKDF_CACHE_LINE_MAX], *tmp_path;
+	uint64_t timestamp, now = time(NULL);
+	uint32_t it, mem;
+	FILE *f, *f_tmp;
+	int fd;
+
+	if (asprintf(&tmp_path, "%s.XXXXXX", path) < 0)
+		return;
+
+	fd = mkstemp(tmp_path);
+	if (fd < 0 || !(f_tmp = fdopen(fd, "w"))) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp_path);
+		}
+		log_dbg(cd, "Cannot create PBKDF benchmark cache %s.", path);
+		free(tmp_path);
+		return;
+	}
+
+	/* Keep other valid entries, drop stale ones and the replaced one */
+	if ((f = fopen(path, "r"))) {
+		while (fgets(line, sizeof(line), f))
+			if (pbkdf_cache_parse(line, line_key, sizeof(line_key), &timestamp, &it, &mem) &&
+			    strcmp(line_key, key) && !pbkdf_cache_stale(timestamp, now, ttl))
+				fprintf(f_tmp, "%s %" PRIu64 " %u %u\n", line_key, timestamp, it, mem);
+		fclose(f);
+	}
+
+	fprintf(f_tmp, "%s %" PRIu64 " %u %u\n", key, now, iterations, memory_kb);
+
+	if (fclose(f_tmp) || rename(tmp_path, path)) {
+		log_dbg(cd, "Cannot update PBKDF benchmark cache %s.", path);
+		unlink(tmp_path);
+	}
+
+	free(tmp_path);
+}
+
+static int benchmark_pbkdf_cached(struct crypt_device *cd,
+	struct crypt_pbkdf_type *pbkdf,
+	const char *salt,
+	size_t salt_size,
+	size_t volume_key_size,
+	struct benchmark_usrptr *u)
+{
+	char key[PBKDF_CACHE_LINE_MAX];
+	uint32_t ttl;
+	char *path = pbkdf_cache_path(&ttl);
+	bool cached = path && !pbkdf_cache_key(pbkdf, volume_key_size, key, sizeof(key));
+	int r;
+
+	if (cached && !pbkdf_cache_lookup(cd, path, ttl, key, pbkdf)) {
+		log_dbg(cd, "Using cached %s benchmark: %u iterations, %u memory.",
+			pbkdf->type, pbkdf->iterations, pbkdf->max_memory_kb);
+		free(path);
+		return 0;
+	}
+
+	r = crypt_benchmark_pbkdf(cd, pbkdf, "foo", 3, salt, salt_size,
+				  volume_key_size, &benchmark_callback, u);
+
+	if (!r && cached)
+		pbkdf_cache_store(cd, path, ttl, key, pbkdf->iterations, pbkdf->max_memory_kb);
+
+	free(path);
+	return r;
+}
+
 /*
  * Used in internal places to benchmark crypt_device context PBKDF.
  * Once requested parameters are benchmarked, iterations attribute is set,
@@ -184,8 +1091,7 @@ int crypt_benchmark_pbkdf_internal(struct crypt_device *cd,
 		pbkdf->parallel_threads = 0; /* N/A in PBKDF2 */
 		pbkdf->max_memory_kb = 0; /* N/A in PBKDF2 */
 
-		r = crypt_benchmark_pbkdf(cd, pbkdf, "foo", 3, "bar", 3,
-					volume_key_size, &benchmark_callback, &u);
+		r = benchmark_pbkdf_cached(cd, pbkdf, "bar", 3, volume_key_size, &u);
 		pbkdf->time_ms = ms_tmp;
 		if (r < 0) {
 			log_err(cd, _("Not compatible PBKDF2 options (using hash algorithm %s)."),
@@ -204,9 +1110,8 @@ int crypt_benchmark_pbkdf_internal(struct crypt_device *cd,
 			return 0;
 		}
 
-		r = crypt_benchmark_pbkdf(cd, pbkdf, "foo", 3,
-			"0123456789abcdef0123456789abcdef", 32,
-			volume_key_size, &benchmark_callback, &u);
+		r = benchmark_pbkdf_cached(cd, pbkdf, "0123456789abcdef0123456789abcdef", 32,
+					   volume_key_size, &u);
 		if (r < 0)
 			log_err(cd, _("Not compatible PBKDF options."));
 	}
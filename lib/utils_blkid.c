@@ -19,6 +19,7 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -321,3 +322,57 @@ off_t blk_get_offset(struct blkid_handle *h)
 #endif
 	return offset_value;
 }
+
+/*
+ * Partition table and superblock magic areas probed by blkid are placed
+ * in the first megabytes of device or close to its end (backup GPT,
+ * MD 0.90/1.0, ZFS labels). If both areas read as zeroes, no signature
+ * can be found and full probe can be skipped.
+ */
+#define BLK_BLANK_HEAD (2 * 1024 * 1024)
+#define BLK_BLANK_TAIL (1024 * 1024)
+
+static int blk_area_blank(int fd, char *buf, size_t len, off_t offset)
+{
+	if (lseek(fd, offset, SEEK_SET) < 0 ||
+	    read_buffer(fd, buf, len) != (ssize_t)len)
+		return -EIO;
+
+	return !buf[0] && !memcmp(buf, buf + 1, len - 1);
+}
+
+/* Returns 1 if device is blank, 0 if it contains data, negative errno on error */
+int blk_is_blank(const char *path)
+{
+	char *buf;
+	off_t size;
+	size_t len;
+	int fd, r;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -EINVAL;
+
+	size = lseek(fd, 0, SEEK_END);
+	if (size <= 0) {
+		close(fd);
+		return size < 0 ? -EINVAL : 1;
+	}
+
+	/* small device is read at once */
+	len = size > BLK_BLANK_HEAD + BLK_BLANK_TAIL ? BLK_BLANK_HEAD : (size_t)size;
+
+	buf = malloc(len);
+	if (!buf) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	r = blk_area_blank(fd, buf, len, 0);
+	if (r == 1 && (size_t)size > len)
+		r = blk_area_blank(fd, buf, BLK_BLANK_TAIL, size - BLK_BLANK_TAIL);
+
+	free(buf);
+	close(fd);
+	return r;
+}
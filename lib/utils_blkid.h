@@ -63,4 +63,6 @@ int blk_supported(void);
 
 off_t blk_get_offset(struct blkid_handle *h);
 
+int blk_is_blank(const char *path);
+
 #endif
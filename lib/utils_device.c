@@ -50,14 +50,39 @@ struct device {
 	int dev_fd_excl;
 
 	struct crypt_lock_handle *lh;
+	/* lock generation the cached fds were verified against (0 unverified) */
+	unsigned lock_gen;
+	unsigned ro_dev_fd_gen;
+	unsigned dev_fd_gen;
 
 	unsigned int o_direct:1;
 	unsigned int init_done:1; /* path is bdev or loop already initialized */
+	unsigned int lockless_read:1; /* optimistic metadata read, validated by caller */
 
 	/* cached values */
 	size_t alignment;
 	size_t block_size;
 	size_t loop_block_size;
+	size_t opt_sector_size;
+
+	/* block device properties, probed once (see device_topology_invalidate) */
+	struct {
+		unsigned int done:1;
+		unsigned int io_size_valid:1;
+		unsigned int read_ahead_valid:1;
+		unsigned int size_valid:1;
+		unsigned int rotational_done:1;
+		unsigned int discardable_done:1;
+		unsigned int numa_node_done:1;
+		unsigned int min_io_size;
+		unsigned int opt_io_size;
+		int alignment_offset;
+		uint32_t read_ahead;
+		uint64_t size;
+		int rotational;
+		int discardable;
+		int numa_node;
+	} topo;
 };
 
 static size_t device_fs_block_size_fd(int fd)
@@ -227,7 +252,15 @@ static int device_ready(struct crypt_device *cd, struct device *device)
 	if (tmp_size > device->block_size)
 		device->block_size = tmp_size;
 
-	close(devfd);
+	/*
+	 * Tested fd is kept for later metadata reads, it is opened with the same
+	 * flags as in device_open(). Files are attached to loop device later.
+	 */
+	if (!r && device->ro_dev_fd < 0) {
+		device->ro_dev_fd = devfd;
+		device->ro_dev_fd_gen = 0;
+	} else
+		close(devfd);
 	return r;
 }
 
@@ -277,6 +310,30 @@ void device_sync(struct crypt_device *cd, struct device *device)
  * 	-EINVAL : invalid lock fd state
  * 	-1	: all other errors
  */
+/*
+ * Cached fd can be reused in locked section only if it was verified
+ * against the lock (fd could be opened before the lock was taken).
+ * The verification is done once per lock.
+ */
+static bool device_reuse_fd(struct crypt_device *cd, struct device *device, int *fd, unsigned *gen)
+{
+	if (*fd < 0)
+		return false;
+
+	if (!device_locked(device->lh) || *gen == device->lock_gen)
+		return true;
+
+	if (!device_locked_verify(cd, *fd, device->lh)) {
+		*gen = device->lock_gen;
+		return true;
+	}
+
+	log_dbg(cd, "Cached fd for device %s does not match locked resource.", device_path(device));
+	close(*fd);
+	*fd = -1;
+	return false;
+}
+
 static int device_open_internal(struct crypt_device *cd, struct device *device, int flags)
 {
 	int access, devfd;
@@ -288,10 +345,10 @@ static int device_open_internal(struct crypt_device *cd, struct device *device,
 	if (access == O_WRONLY)
 		access = O_RDWR;
 
-	if (access == O_RDONLY && device->ro_dev_fd >= 0) {
+	if (access == O_RDONLY && device_reuse_fd(cd, device, &device->ro_dev_fd, &device->ro_dev_fd_gen)) {
 		log_dbg(cd, "Reusing open r%c fd on device %s", 'o', device_path(device));
 		return device->ro_dev_fd;
-	} else if (access == O_RDWR && device->dev_fd >= 0) {
+	} else if (access == O_RDWR && device_reuse_fd(cd, device, &device->dev_fd, &device->dev_fd_gen)) {
 		log_dbg(cd, "Reusing open r%c fd on device %s", 'w', device_path(device));
 		return device->dev_fd;
 	}
@@ -308,10 +365,13 @@ static int device_open_internal(struct crypt_device *cd, struct device *device,
 		return devfd;
 	}
 
-	if (access == O_RDONLY)
+	if (access == O_RDONLY) {
 		device->ro_dev_fd = devfd;
-	else
+		device->ro_dev_fd_gen = device_locked(device->lh) ? device->lock_gen : 0;
+	} else {
 		device->dev_fd = devfd;
+		device->dev_fd_gen = device_locked(device->lh) ? device->lock_gen : 0;
+	}
 
 	return devfd;
 }
@@ -339,6 +399,8 @@ int device_open_excl(struct crypt_device *cd, struct device *device, int flags)
 		path = device_path(device);
 		if (stat(path, &st))
 			return -EINVAL;
+		/* Idle temporary dm-crypt devices would block exclusive open */
+		crypt_storage_wrapper_pool_free(cd);
 		if (!S_ISBLK(st.st_mode))
 			log_dbg(cd, "%s is not a block device. Can't open in exclusive mode.",
 				path);
@@ -378,10 +440,21 @@ int device_open_locked(struct crypt_device *cd, struct device *device, int flags
 	if (!device)
 		return -EINVAL;
 
-	assert(!crypt_metadata_locking_enabled() || device_locked(device->lh));
+	assert(!crypt_metadata_locking_enabled() || device_locked(device->lh) ||
+	       (device->lockless_read && (flags & O_ACCMODE) == O_RDONLY));
 	return device_open_internal(cd, device, flags);
 }
 
+/*
+ * Allow read-only access to metadata without lock. The caller must detect
+ * concurrent update itself (LUKS2 header sequence id).
+ */
+void device_set_lockless_read(struct device *device, bool enable)
+{
+	if (device)
+		device->lockless_read = enable;
+}
+
 /* Avoid any read from device, expects direct-io to work. */
 int device_alloc_no_check(struct device **device, const char *path)
 {
@@ -505,16 +578,71 @@ const char *device_path(const struct device *device)
 #define BLKALIGNOFF _IO(0x12,122)
 #endif
 
+/*
+ * Read all ioctl based properties of block device at once.
+ * Size of regular files is never cached (header file can grow).
+ */
+static void device_topology_probe(struct device *device)
+{
+	struct stat st;
+	long read_ahead;
+	int fd;
+
+	if (device->topo.done)
+		return;
+
+	fd = open(device->path, O_RDONLY);
+	if (fd == -1)
+		return;
+
+	device->topo.done = 1;
+
+	if (fstat(fd, &st) < 0 || !S_ISBLK(st.st_mode))
+		goto out;
+
+	if (ioctl(fd, BLKGETSIZE64, &device->topo.size) >= 0)
+		device->topo.size_valid = 1;
+
+	if (!ioctl(fd, BLKRAGET, &read_ahead)) {
+		device->topo.read_ahead = (uint32_t)read_ahead;
+		device->topo.read_ahead_valid = 1;
+	}
+
+	/* minimum io size */
+	if (ioctl(fd, BLKIOMIN, &device->topo.min_io_size) == -1)
+		goto out;
+	device->topo.io_size_valid = 1;
+
+	/* optimal io size */
+	if (ioctl(fd, BLKIOOPT, &device->topo.opt_io_size) == -1)
+		device->topo.opt_io_size = device->topo.min_io_size;
+
+	/* alignment offset, bogus -1 means misaligned/unknown */
+	if (ioctl(fd, BLKALIGNOFF, &device->topo.alignment_offset) == -1 ||
+	    device->topo.alignment_offset < 0)
+		device->topo.alignment_offset = 0;
+out:
+	close(fd);
+}
+
+/* Properties are probed again on next use (device was resized or replaced) */
+void device_topology_invalidate(struct device *device)
+{
+	if (!device)
+		return;
+
+	memset(&device->topo, 0, sizeof(device->topo));
+	device->opt_sector_size = 0;
+}
+
 void device_topology_alignment(struct crypt_device *cd,
 			       struct device *device,
 			       unsigned long *required_alignment, /* bytes */
 			       unsigned long *alignment_offset,   /* bytes */
 			       unsigned long default_alignment)
 {
-	int dev_alignment_offset = 0;
 	unsigned int min_io_size = 0, opt_io_size = 0;
 	unsigned long temp_alignment = 0;
-	int fd;
 
 	*required_alignment = default_alignment;
 	*alignment_offset = 0;
@@ -522,25 +650,19 @@ void device_topology_alignment(struct crypt_device *cd,
 	if (!device || !device->path) //FIXME
 		return;
 
-	fd = open(device->path, O_RDONLY);
-	if (fd == -1)
+	device_topology_probe(device);
+	if (!device->topo.done)
 		return;
 
-	/* minimum io size */
-	if (ioctl(fd, BLKIOMIN, &min_io_size) == -1) {
+	if (!device->topo.io_size_valid) {
 		log_dbg(cd, "Topology info for %s not supported, using default offset %lu bytes.",
 			device->path, default_alignment);
-		goto out;
+		return;
 	}
 
-	/* optimal io size */
-	if (ioctl(fd, BLKIOOPT, &opt_io_size) == -1)
-		opt_io_size = min_io_size;
-
-	/* alignment offset, bogus -1 means misaligned/unknown */
-	if (ioctl(fd, BLKALIGNOFF, &dev_alignment_offset) == -1 || dev_alignment_offset < 0)
-		dev_alignment_offset = 0;
-	*alignment_offset = (unsigned long)dev_alignment_offset;
+	min_io_size = device->topo.min_io_size;
+	opt_io_size = device->topo.opt_io_size;
+	*alignment_offset = (unsigned long)device->topo.alignment_offset;
 
 	temp_alignment = (unsigned long)min_io_size;
 
@@ -561,8 +683,6 @@ void device_topology_alignment(struct crypt_device *cd,
 
 	log_dbg(cd, "Topology: IO (%u/%u), offset = %lu; Required alignment is %lu bytes.",
 		min_io_size, opt_io_size, *alignment_offset, *required_alignment);
-out:
-	(void)close(fd);
 }
 
 size_t device_block_size(struct crypt_device *cd, struct device *device)
@@ -587,6 +707,25 @@ size_t device_block_size(struct crypt_device *cd, struct device *device)
 	return device->block_size;
 }
 
+/* The smallest encryption sector size usable on device (logical block size) */
+size_t device_min_encryption_sector_size(struct crypt_device *cd, struct device *device)
+{
+	size_t bsize;
+
+	if (!device)
+		return SECTOR_SIZE;
+
+	/* file is attached to loop device with requested block size later */
+	if (!device->init_done)
+		return device->loop_block_size ?: SECTOR_SIZE;
+
+	bsize = device_block_size(cd, device);
+	if (bsize < SECTOR_SIZE)
+		return SECTOR_SIZE;
+
+	return bsize > MAX_SECTOR_SIZE ? MAX_SECTOR_SIZE : bsize;
+}
+
 size_t device_optimal_encryption_sector_size(struct crypt_device *cd, struct device *device)
 {
 	int fd;
@@ -595,6 +734,9 @@ size_t device_optimal_encryption_sector_size(struct crypt_device *cd, struct dev
 	if (!device)
 		return SECTOR_SIZE;
 
+	if (device->opt_sector_size)
+		return device->opt_sector_size;
+
 	fd = open(device->file_path ?: device->path, O_RDONLY);
 	if (fd < 0) {
 		log_dbg(cd, "Cannot get optimal encryption sector size for device %s.", device_path(device));
@@ -611,36 +753,32 @@ size_t device_optimal_encryption_sector_size(struct crypt_device *cd, struct dev
 
 	if (device->block_size >= MAX_SECTOR_SIZE) {
 		close(fd);
-		return MISALIGNED(device->block_size, MAX_SECTOR_SIZE) ? SECTOR_SIZE : MAX_SECTOR_SIZE;
+		device->opt_sector_size = MISALIGNED(device->block_size, MAX_SECTOR_SIZE) ? SECTOR_SIZE : MAX_SECTOR_SIZE;
+		return device->opt_sector_size;
 	}
 
 	phys_block_size = device_block_phys_size_fd(fd);
 	close(fd);
 
 	if (device->block_size >= phys_block_size || phys_block_size <= SECTOR_SIZE || phys_block_size > MAX_SECTOR_SIZE || MISALIGNED(phys_block_size, device->block_size))
-		return device->block_size;
+		device->opt_sector_size = device->block_size;
+	else
+		device->opt_sector_size = phys_block_size;
 
-	return phys_block_size;
+	return device->opt_sector_size;
 }
 
 int device_read_ahead(struct device *device, uint32_t *read_ahead)
 {
-	int fd, r = 0;
-	long read_ahead_long;
-
 	if (!device)
 		return 0;
 
-	if ((fd = open(device->path, O_RDONLY)) < 0)
+	device_topology_probe(device);
+	if (!device->topo.read_ahead_valid)
 		return 0;
 
-	r = ioctl(fd, BLKRAGET, &read_ahead_long) ? 0 : 1;
-	close(fd);
-
-	if (r)
-		*read_ahead = (uint32_t) read_ahead_long;
-
-	return r;
+	*read_ahead = device->topo.read_ahead;
+	return 1;
 }
 
 /* Get data size in bytes */
@@ -652,6 +790,12 @@ int device_size(struct device *device, uint64_t *size)
 	if (!device)
 		return -EINVAL;
 
+	device_topology_probe(device);
+	if (device->topo.size_valid) {
+		*size = device->topo.size;
+		return 0;
+	}
+
 	devfd = open(device->path, O_RDONLY);
 	if (devfd == -1)
 		return -EINVAL;
@@ -682,11 +826,15 @@ int device_fallocate(struct device *device, uint64_t size)
 	if (devfd == -1)
 		return -EINVAL;
 
+	/* Allocate only the extension, existing holes in the file are kept */
 	if (!fstat(devfd, &st) && S_ISREG(st.st_mode) &&
-	    ((uint64_t)st.st_size >= size || !posix_fallocate(devfd, 0, size))) {
+	    ((uint64_t)st.st_size >= size ||
+	     !posix_fallocate(devfd, st.st_size, size - st.st_size))) {
 		r = 0;
 		if (device->file_path && crypt_loop_resize(device->path))
 			r = -EINVAL;
+		/* loop device size changed */
+		device_topology_invalidate(device);
 	}
 
 	close(devfd);
@@ -813,10 +961,40 @@ int device_check_access(struct crypt_device *cd,
 	return device_info(cd, device, device_check, NULL, NULL);
 }
 
+static int device_loop_attached(struct crypt_device *cd, struct device *device,
+			       char *loop_device, int loop_fd)
+{
+	char *file_path;
+	int r;
+
+	file_path = device->path;
+	device->path = loop_device;
+
+	r = device_ready(cd, device);
+	if (r < 0) {
+		device->path = file_path;
+		crypt_loop_detach(loop_device);
+		close(loop_fd);
+		free(loop_device);
+		return r;
+	}
+
+	log_dbg(cd, "Attached loop device block size is %zu bytes.", device_block_size_fd(loop_fd, NULL));
+
+	device->loop_fd = loop_fd;
+	device->file_path = file_path;
+	device->init_done = 1;
+
+	/* properties of the file are not valid for the loop device */
+	device_topology_invalidate(device);
+
+	return 0;
+}
+
 static int device_internal_prepare(struct crypt_device *cd, struct device *device)
 {
-	char *loop_device = NULL, *file_path = NULL;
-	int r, loop_fd, readonly = 0;
+	char *loop_device = NULL;
+	int loop_fd, readonly = 0;
 
 	if (device->init_done)
 		return 0;
@@ -839,24 +1017,64 @@ static int device_internal_prepare(struct crypt_device *cd, struct device *devic
 		return -EINVAL;
 	}
 
-	file_path = device->path;
-	device->path = loop_device;
+	return device_loop_attached(cd, device, loop_device, loop_fd);
+}
 
-	r = device_ready(cd, device);
-	if (r < 0) {
-		device->path = file_path;
-		crypt_loop_detach(loop_device);
-		free(loop_device);
-		return r;
+/*
+ * Attach loop devices for more file-backed devices at once (in parallel).
+ * The backing file page cache is bypassed (direct-io) if alignment allows it.
+ * Devices that fail here are attached later one by one (with error report).
+ */
+void device_prepare_batch(struct crypt_device **cds, struct device **devices, size_t count)
+{
+	struct crypt_loop_batch *b;
+	size_t i, n = 0, *idx;
+
+	if (!count || getuid() || geteuid())
+		return;
+
+	b = calloc(count, sizeof(*b));
+	idx = calloc(count, sizeof(*idx));
+	if (!b || !idx) {
+		free(b);
+		free(idx);
+		return;
 	}
 
-	log_dbg(cd, "Attached loop device block size is %zu bytes.", device_block_size_fd(loop_fd, NULL));
+	for (i = 0; i < count; i++) {
+		if (!devices[i] || devices[i]->init_done)
+			continue;
+		/* the same device can be listed more times */
+		devices[i]->init_done = 1;
+		b[n].file = devices[i]->path;
+		b[n].autoclear = 1;
+		b[n].blocksize = devices[i]->loop_block_size;
+		b[n].direct_io = 1;
+		idx[n++] = i;
+	}
 
-	device->loop_fd = loop_fd;
-	device->file_path = file_path;
-	device->init_done = 1;
+	if (n) {
+		log_dbg(cds[0], "Attaching %zu loop devices.", n);
+		crypt_loop_attach_batch(b, n);
+	}
 
-	return 0;
+	for (i = 0; i < n; i++) {
+		struct device *device = devices[idx[i]];
+		struct crypt_device *cd = cds[idx[i]];
+
+		device->init_done = 0;
+		if (b[i].loop_fd < 0) {
+			free(b[i].loop);
+			continue;
+		}
+
+		log_dbg(cd, "Attached loop device %s for %s%s.", b[i].loop, device->path,
+			crypt_loop_direct_io(b[i].loop_fd) ? " (direct-io)" : "");
+		(void)device_loop_attached(cd, device, b[i].loop, b[i].loop_fd);
+	}
+
+	free(idx);
+	free(b);
 }
 
 int device_block_adjust(struct crypt_device *cd,
@@ -921,8 +1139,13 @@ size_t size_round_up(size_t size, size_t block)
 
 void device_disable_direct_io(struct device *device)
 {
-	if (device)
-		device->o_direct = 0;
+	if (!device || !device->o_direct)
+		return;
+
+	device->o_direct = 0;
+
+	/* cached fds were opened with direct-io */
+	device_close(NULL, device);
 }
 
 int device_direct_io(const struct device *device)
@@ -968,13 +1191,64 @@ int device_is_rotational(struct device *device)
 	if (!device)
 		return -EINVAL;
 
+	if (device->topo.rotational_done)
+		return device->topo.rotational;
+
 	if (stat(device_path(device), &st) < 0)
 		return -EINVAL;
 
 	if (!S_ISBLK(st.st_mode))
-		return 0;
+		device->topo.rotational = 0;
+	else
+		device->topo.rotational = crypt_dev_is_rotational(major(st.st_rdev), minor(st.st_rdev));
+	device->topo.rotational_done = 1;
+
+	return device->topo.rotational;
+}
+
+int device_is_discardable(struct device *device)
+{
+	struct stat st;
+
+	if (!device)
+		return -EINVAL;
+
+	if (device->topo.discardable_done)
+		return device->topo.discardable;
+
+	if (stat(device_path(device), &st) < 0)
+		return -EINVAL;
+
+	if (!S_ISBLK(st.st_mode))
+		device->topo.discardable = 0;
+	else
+		device->topo.discardable = crypt_dev_is_discardable(major(st.st_rdev), minor(st.st_rdev));
+	device->topo.discardable_done = 1;
+
+	return device->topo.discardable;
+}
 
-	return crypt_dev_is_rotational(major(st.st_rdev), minor(st.st_rdev));
+/* NUMA node of block device, -1 if unknown (or not a block device) */
+int device_numa_node(struct device *device)
+{
+	struct stat st;
+
+	if (!device)
+		return -1;
+
+	if (device->topo.numa_node_done)
+		return device->topo.numa_node;
+
+	if (stat(device_path(device), &st) < 0)
+		return -1;
+
+	if (!S_ISBLK(st.st_mode))
+		device->topo.numa_node = -1;
+	else
+		device->topo.numa_node = crypt_dev_numa_node(major(st.st_rdev), minor(st.st_rdev));
+	device->topo.numa_node_done = 1;
+
+	return device->topo.numa_node;
 }
 
 size_t device_alignment(struct device *device)
@@ -995,10 +1269,32 @@ size_t device_alignment(struct device *device)
 	return device->alignment;
 }
 
+/*
+ * Zeroed buffer aligned for direct I/O on device, blockwise I/O then
+ * uses it in place without a bounce copy. Release it with free().
+ */
+void *device_alloc_buffer(struct device *device, size_t size)
+{
+	size_t alignment = device_alignment(device);
+	void *buf;
+
+	if (!size || !alignment || posix_memalign(&buf, alignment, size))
+		return NULL;
+
+	memset(buf, 0, size);
+	return buf;
+}
+
 void device_set_lock_handle(struct device *device, struct crypt_lock_handle *h)
 {
-	if (device)
-		device->lh = h;
+	if (!device)
+		return;
+
+	device->lh = h;
+
+	/* new lock, cached fds must be verified again */
+	if (h && !++device->lock_gen)
+		device->lock_gen++;
 }
 
 struct crypt_lock_handle *device_get_lock_handle(struct device *device)
@@ -27,6 +27,7 @@
 #include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #ifdef HAVE_SYS_SYSMACROS_H
 # include <sys/sysmacros.h>     /* for major, minor */
@@ -297,10 +298,21 @@ static unsigned device_lock_dec(struct crypt_lock_handle *h)
 	return --h->refcnt;
 }
 
+static uint64_t lock_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static int acquire_and_verify(struct crypt_device *cd, struct device *device, const char *resource, int flock_op, struct crypt_lock_handle **lock)
 {
 	int r;
 	struct crypt_lock_handle *h;
+	uint64_t start, wait_usec = 0;
+	unsigned retries = 0;
+	bool contended = false;
 
 	if (device && resource)
 		return -EINVAL;
@@ -313,7 +325,17 @@ static int acquire_and_verify(struct crypt_device *cd, struct device *device, co
 		if (r < 0)
 			break;
 
-		if (flock(h->flock_fd, flock_op)) {
+		/* Try uncontended lock first, so the time spent waiting can be measured */
+		r = flock(h->flock_fd, flock_op | LOCK_NB);
+		if (r && errno == EWOULDBLOCK && !(flock_op & LOCK_NB)) {
+			log_dbg(cd, "Waiting for lock on %s.", device ? device_path(device) : resource);
+			contended = true;
+			start = lock_usec();
+			r = flock(h->flock_fd, flock_op);
+			wait_usec += lock_usec() - start;
+		}
+
+		if (r) {
 			log_dbg(cd, "Flock on fd %d failed with errno %d.", h->flock_fd, errno);
 			r = (errno == EWOULDBLOCK) ? -EBUSY : -EINVAL;
 			release_lock_handle(cd, h);
@@ -332,6 +354,7 @@ static int acquire_and_verify(struct crypt_device *cd, struct device *device, co
 				log_dbg(cd, "flock on fd %d failed.", h->flock_fd);
 			release_lock_handle(cd, h);
 			log_dbg(cd, "Lock handle verification failed.");
+			retries++;
 		}
 	} while (r == -EAGAIN);
 
@@ -340,6 +363,11 @@ static int acquire_and_verify(struct crypt_device *cd, struct device *device, co
 		return r;
 	}
 
+	if (contended || retries)
+		log_dbg(cd, "Lock on %s acquired after %" PRIu64 " us wait, %u retries.",
+			device ? device_path(device) : resource, wait_usec, retries);
+	crypt_lock_stats_add(cd, wait_usec, contended, retries);
+
 	*lock = h;
 
 	return 0;
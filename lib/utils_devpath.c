@@ -220,6 +220,16 @@ int crypt_dev_is_rotational(int major, int minor)
 	return val ? 1 : 0;
 }
 
+int crypt_dev_is_discardable(int major, int minor)
+{
+	uint64_t val;
+
+	if (!_sysfs_get_uint64(major, minor, &val, "queue/discard_max_bytes"))
+		return 0; /* if failed, expect no discard support */
+
+	return val ? 1 : 0;
+}
+
 int crypt_dev_is_partition(const char *dev_path)
 {
 	uint64_t val;
@@ -256,6 +266,109 @@ uint64_t crypt_dev_partition_offset(const char *dev_path)
 	return val;
 }
 
+/*
+ * Completed I/O requests and total time (ms) spent on them
+ * (read and write fields from sysfs block device stat file).
+ */
+int crypt_dev_io_stats(const char *dev_path, uint64_t *ios, uint64_t *ticks_ms)
+{
+	char path[PATH_MAX], tmp[256] = {0};
+	uint64_t rd_ios, rd_merges, rd_sectors, rd_ticks,
+		 wr_ios, wr_merges, wr_sectors, wr_ticks;
+	struct stat st;
+	int fd, r;
+
+	if (stat(dev_path, &st) < 0)
+		return -errno;
+
+	if (!S_ISBLK(st.st_mode))
+		return -ENOTBLK;
+
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/stat",
+		     major(st.st_rdev), minor(st.st_rdev)) < 0)
+		return -EINVAL;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -errno;
+	r = read(fd, tmp, sizeof(tmp) - 1);
+	close(fd);
+
+	if (r <= 0)
+		return -EIO;
+
+	if (sscanf(tmp, "%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+		   " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64,
+		   &rd_ios, &rd_merges, &rd_sectors, &rd_ticks,
+		   &wr_ios, &wr_merges, &wr_sectors, &wr_ticks) != 8)
+		return -EINVAL;
+
+	*ios = rd_ios + wr_ios;
+	*ticks_ms = rd_ticks + wr_ticks;
+
+	return 0;
+}
+
+static int _path_get_int(const char *sysfs_path, const char *attr, int *value)
+{
+	char path[PATH_MAX], tmp[32] = {0};
+	int fd, r;
+
+	if (snprintf(path, sizeof(path), "%s/%s", sysfs_path, attr) < 0)
+		return 0;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+	r = read(fd, tmp, sizeof(tmp) - 1);
+	close(fd);
+
+	return r > 0 && sscanf(tmp, "%d", value) == 1;
+}
+
+/*
+ * Disk (or partition parent) numa_node attribute, stacked devices
+ * (dm, md) use the node of the first underlying device that has one.
+ */
+static int _sysfs_numa_node(const char *sysfs_path, int level)
+{
+	char path[PATH_MAX];
+	struct dirent *entry;
+	DIR *dir;
+	int node = -1;
+
+	if (_path_get_int(sysfs_path, "device/numa_node", &node) && node >= 0)
+		return node;
+
+	if (_path_get_int(sysfs_path, "../device/numa_node", &node) && node >= 0)
+		return node;
+
+	if (level > 4 || snprintf(path, sizeof(path), "%s/slaves", sysfs_path) < 0)
+		return -1;
+
+	if (!(dir = opendir(path)))
+		return -1;
+
+	node = -1;
+	while (node < 0 && (entry = readdir(dir))) {
+		if (entry->d_name[0] == '.' ||
+		    snprintf(path, sizeof(path), "%s/slaves/%s", sysfs_path, entry->d_name) < 0)
+			continue;
+		node = _sysfs_numa_node(path, level + 1);
+	}
+	closedir(dir);
+
+	return node;
+}
+
+int crypt_dev_numa_node(int major, int minor)
+{
+	char path[PATH_MAX];
+
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%d:%d", major, minor) < 0)
+		return -1;
+
+	return _sysfs_numa_node(path, 0);
+}
+
 /* Try to find partition which match offset and size on top level device */
 char *crypt_get_partition_device(const char *dev_path, uint64_t offset, uint64_t size)
 {
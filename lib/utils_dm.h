@@ -39,6 +39,7 @@ struct crypt_params_integrity;
 #define DM_SUSPEND_SKIP_LOCKFS (1 << 5)
 #define DM_SUSPEND_WIPE_KEY    (1 << 6)
 #define DM_SUSPEND_NOFLUSH     (1 << 7)
+#define DM_DEACTIVATE_PRIVATE  (1 << 8) /* device activated with CRYPT_ACTIVATE_PRIVATE */
 
 static inline uint32_t act2dmflags(uint32_t act_flags)
 {
@@ -107,6 +108,8 @@ struct dm_target {
 
 		/* Active key for device */
 		struct volume_key *vk;
+		/* Optional precomputed "<cipher> <key>" table part */
+		const char *key_params;
 
 		/* struct crypt_active_device */
 		uint64_t offset;	/* offset in sectors */
@@ -185,6 +188,7 @@ void dm_backend_exit(struct crypt_device *cd);
 int dm_targets_allocate(struct dm_target *first, unsigned count);
 void dm_targets_free(struct crypt_device *cd, struct crypt_dm_active_device *dmd);
 
+char *dm_crypt_key_params(const struct dm_target *tgt, uint32_t flags);
 int dm_crypt_target_set(struct dm_target *tgt, uint64_t seg_offset, uint64_t seg_size,
 	struct device *data_device, struct volume_key *vk, const char *cipher,
 	uint64_t iv_offset, uint64_t data_offset, const char *integrity,
@@ -209,12 +213,21 @@ int dm_status_device(struct crypt_device *cd, const char *name);
 int dm_status_suspended(struct crypt_device *cd, const char *name);
 int dm_status_verity_ok(struct crypt_device *cd, const char *name);
 int dm_status_integrity_failures(struct crypt_device *cd, const char *name, uint64_t *count);
+int dm_status_integrity_recalc(struct crypt_device *cd, const char *name,
+			       uint64_t *recalc_sector, uint64_t *size);
 int dm_query_device(struct crypt_device *cd, const char *name,
 		    uint32_t get_flags, struct crypt_dm_active_device *dmd);
+int dm_query_devices(struct crypt_device *cd, uint32_t get_flags,
+		     int (*fn)(struct crypt_device *cd, const char *name,
+			       struct crypt_dm_active_device *dmd, int busy, void *usrptr),
+		     void *usrptr);
 int dm_device_deps(struct crypt_device *cd, const char *name, const char *prefix,
 		   char **names, size_t names_length);
 int dm_create_device(struct crypt_device *cd, const char *name,
 		     const char *type, struct crypt_dm_active_device *dmd);
+int dm_udev_batch_begin(void);
+void dm_udev_batch_sync(void);
+int dm_udev_batch_end(void);
 int dm_reload_device(struct crypt_device *cd, const char *name,
 		     struct crypt_dm_active_device *dmd, uint32_t dmflags, unsigned resume);
 int dm_suspend_device(struct crypt_device *cd, const char *name, uint32_t dmflags);
@@ -226,6 +239,8 @@ int dm_clear_device(struct crypt_device *cd, const char *name);
 int dm_cancel_deferred_removal(const char *name);
 
 const char *dm_get_dir(void);
+int dm_event_fd_open(void);
+int dm_event_fd_arm(int fd);
 
 int lookup_dm_dev_by_uuid(struct crypt_device *cd, const char *uuid, const char *type);
 
@@ -26,9 +26,32 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 #include "utils_io.h"
 
+#ifdef ENABLE_IO_URING
+#include <liburing.h>
+#endif
+
+#define IO_QUEUE_DEPTH_MAX 64
+
+/* per-thread bounce buffers for unaligned blockwise I/O */
+#define IO_SCRATCH_MAX		(64 * 1024)
+#define IO_SCRATCH_ALIGNMENT	4096
+#define IO_SCRATCH_COUNT	3	/* bounce, partial last and first block */
+
+struct io_scratch {
+	void *buf[IO_SCRATCH_COUNT];
+	size_t size[IO_SCRATCH_COUNT];
+};
+
+static pthread_key_t _io_scratch_key;
+static pthread_once_t _io_scratch_once = PTHREAD_ONCE_INIT;
+static bool _io_scratch_key_ok = false;
+
 static ssize_t _read_buffer(int fd, void *buf, size_t length, volatile int *quit)
 {
 	size_t read_size = 0;
@@ -95,6 +118,93 @@ ssize_t write_buffer_intr(int fd, const void *buf, size_t length, volatile int *
 	return _write_buffer(fd, buf, length, quit);
 }
 
+static void io_scratch_destroy(void *arg)
+{
+	struct io_scratch *sc = arg;
+	int i;
+
+	for (i = 0; i < IO_SCRATCH_COUNT; i++)
+		free(sc->buf[i]);
+	free(sc);
+}
+
+static void io_scratch_key_init(void)
+{
+	_io_scratch_key_ok = !pthread_key_create(&_io_scratch_key, io_scratch_destroy);
+}
+
+/*
+ * Aligned temporary buffer, kept for the next call in the same thread
+ * (header, keyslot and wipe I/O do many small unaligned requests).
+ * Larger or over-aligned buffers are allocated for one call only.
+ */
+static void *io_scratch_get(int idx, size_t alignment, size_t size)
+{
+	struct io_scratch *sc = NULL;
+	void *buf;
+
+	pthread_once(&_io_scratch_once, io_scratch_key_init);
+
+	if (_io_scratch_key_ok && size <= IO_SCRATCH_MAX && alignment <= IO_SCRATCH_ALIGNMENT) {
+		sc = pthread_getspecific(_io_scratch_key);
+		if (!sc && (sc = calloc(1, sizeof(*sc))) && pthread_setspecific(_io_scratch_key, sc)) {
+			free(sc);
+			sc = NULL;
+		}
+	}
+
+	if (!sc) {
+		if (posix_memalign(&buf, alignment, size))
+			return NULL;
+		return buf;
+	}
+
+	if (sc->size[idx] < size) {
+		if (posix_memalign(&buf, IO_SCRATCH_ALIGNMENT, IO_SCRATCH_MAX))
+			return NULL;
+		free(sc->buf[idx]);
+		sc->buf[idx] = buf;
+		sc->size[idx] = IO_SCRATCH_MAX;
+	}
+
+	return sc->buf[idx];
+}
+
+/*
+ * Called from library destructor. The key destructor must not be called
+ * by threads exiting after the library is unloaded. Buffers of other threads
+ * are already wiped, they are only leaked.
+ */
+void io_scratch_exit(void)
+{
+	struct io_scratch *sc;
+
+	if (!_io_scratch_key_ok)
+		return;
+
+	sc = pthread_getspecific(_io_scratch_key);
+	if (sc) {
+		pthread_setspecific(_io_scratch_key, NULL);
+		io_scratch_destroy(sc);
+	}
+
+	pthread_key_delete(_io_scratch_key);
+	_io_scratch_key_ok = false;
+}
+
+/* Buffers can contain keyslot material, always wiped */
+static void io_scratch_put(int idx, void *buf, size_t size)
+{
+	struct io_scratch *sc = _io_scratch_key_ok ? pthread_getspecific(_io_scratch_key) : NULL;
+
+	if (!buf)
+		return;
+
+	memset(buf, 0, size);
+	if (!sc || sc->buf[idx] != buf)
+		free(buf);
+}
+
 ssize_t write_blockwise(int fd, size_t bsize, size_t alignment,
 			void *orig_buf, size_t length)
 {
@@ -108,8 +218,9 @@ ssize_t write_blockwise(int fd, size_t bsize, size_t alignment,
 	hangover = length % bsize;
 	solid = length - hangover;
 
+	/* aligned buffer is written directly (zero-copy) */
 	if ((size_t)orig_buf & (alignment - 1)) {
-		if (posix_memalign(&buf, alignment, length))
+		if (!(buf = io_scratch_get(0, alignment, length)))
 			return -1;
 		memcpy(buf, orig_buf, length);
 	} else
@@ -122,7 +233,7 @@ ssize_t write_blockwise(int fd, size_t bsize, size_t alignment,
 	}
 
 	if (hangover) {
-		if (posix_memalign(&hangover_buf, alignment, bsize))
+		if (!(hangover_buf = io_scratch_get(1, alignment, bsize)))
 			goto out;
 		memset(hangover_buf, 0, bsize);
 
@@ -141,9 +252,9 @@ ssize_t write_blockwise(int fd, size_t bsize, size_t alignment,
 	}
 	ret = length;
 out:
-	free(hangover_buf);
+	io_scratch_put(1, hangover_buf, bsize);
 	if (buf != orig_buf)
-		free(buf);
+		io_scratch_put(0, buf, length);
 	return ret;
 }
 
@@ -160,8 +271,9 @@ ssize_t read_blockwise(int fd, size_t bsize, size_t alignment,
 	hangover = length % bsize;
 	solid = length - hangover;
 
+	/* aligned buffer is read directly (zero-copy) */
 	if ((size_t)orig_buf & (alignment - 1)) {
-		if (posix_memalign(&buf, alignment, length))
+		if (!(buf = io_scratch_get(0, alignment, length)))
 			return -1;
 	} else
 		buf = orig_buf;
@@ -171,7 +283,7 @@ ssize_t read_blockwise(int fd, size_t bsize, size_t alignment,
 		goto out;
 
 	if (hangover) {
-		if (posix_memalign(&hangover_buf, alignment, bsize))
+		if (!(hangover_buf = io_scratch_get(1, alignment, bsize)))
 			goto out;
 		r = read_buffer(fd, hangover_buf, bsize);
 		if (r <  0 || r < (ssize_t)hangover)
@@ -181,11 +293,11 @@ ssize_t read_blockwise(int fd, size_t bsize, size_t alignment,
 	}
 	ret = length;
 out:
-	free(hangover_buf);
+	io_scratch_put(1, hangover_buf, bsize);
 	if (buf != orig_buf) {
 		if (ret != -1)
 			memcpy(orig_buf, buf, length);
-		free(buf);
+		io_scratch_put(0, buf, length);
 	}
 	return ret;
 }
@@ -218,7 +330,7 @@ ssize_t write_lseek_blockwise(int fd, size_t bsize, size_t alignment,
 		return -1;
 
 	if (frontHang && length) {
-		if (posix_memalign(&frontPadBuf, alignment, bsize))
+		if (!(frontPadBuf = io_scratch_get(2, alignment, bsize)))
 			return -1;
 
 		innerCount = bsize - frontHang;
@@ -246,7 +358,7 @@ ssize_t write_lseek_blockwise(int fd, size_t bsize, size_t alignment,
 	if (ret >= 0)
 		ret += innerCount;
 out:
-	free(frontPadBuf);
+	io_scratch_put(2, frontPadBuf, bsize);
 	return ret;
 }
 
@@ -272,7 +384,7 @@ ssize_t read_lseek_blockwise(int fd, size_t bsize, size_t alignment,
 		return -1;
 
 	if (frontHang && length) {
-		if (posix_memalign(&frontPadBuf, alignment, bsize))
+		if (!(frontPadBuf = io_scratch_get(2, alignment, bsize)))
 			return -1;
 
 		innerCount = bsize - frontHang;
@@ -293,6 +405,249 @@ ssize_t read_lseek_blockwise(int fd, size_t bsize, size_t alignment,
 	if (ret >= 0)
 		ret += innerCount;
 out:
-	free(frontPadBuf);
+	io_scratch_put(2, frontPadBuf, bsize);
 	return ret;
 }
+
+/*
+ * Queued write I/O with more requests in flight (io_uring backend).
+ *
+ * Buffers are owned by the queue (registered with io_uring if possible),
+ * io_queue_buffer() returns a free buffer (possibly waiting for completion
+ * of an older request). Without io_uring support (or with depth 1)
+ * the writes are synchronous.
+ */
+struct io_queue {
+	int fd;
+	unsigned depth;
+	unsigned inflight;
+	size_t buffer_size;
+	int error;
+	void *buffers[IO_QUEUE_DEPTH_MAX];
+	size_t lengths[IO_QUEUE_DEPTH_MAX];
+	bool busy[IO_QUEUE_DEPTH_MAX];
+#ifdef ENABLE_IO_URING
+	bool uring;
+	bool registered;
+	struct io_uring ring;
+#endif
+};
+
+int io_queue_init(struct io_queue **q, int fd, size_t alignment,
+		  size_t buffer_size, unsigned depth)
+{
+	struct io_queue *tmp;
+	unsigned i;
+#ifdef ENABLE_IO_URING
+	struct iovec iovs[IO_QUEUE_DEPTH_MAX];
+#endif
+
+	if (!q || fd < 0 || !alignment || !buffer_size)
+		return -EINVAL;
+
+	if (depth > IO_QUEUE_DEPTH_MAX)
+		depth = IO_QUEUE_DEPTH_MAX;
+#ifndef ENABLE_IO_URING
+	depth = 1;
+#endif
+	if (!depth)
+		depth = 1;
+
+	tmp = calloc(1, sizeof(*tmp));
+	if (!tmp)
+		return -ENOMEM;
+
+	tmp->fd = fd;
+	tmp->buffer_size = buffer_size;
+
+#ifdef ENABLE_IO_URING
+	/* runtime fallback to synchronous I/O (old kernel, seccomp filter) */
+	if (depth > 1 && !io_uring_queue_init(depth, &tmp->ring, 0))
+		tmp->uring = true;
+	else
+		depth = 1;
+#endif
+	tmp->depth = depth;
+
+	for (i = 0; i < depth; i++) {
+		if (posix_memalign(&tmp->buffers[i], alignment, buffer_size)) {
+			tmp->buffers[i] = NULL;
+			io_queue_destroy(tmp);
+			return -ENOMEM;
+		}
+		memset(tmp->buffers[i], 0, buffer_size);
+#ifdef ENABLE_IO_URING
+		iovs[i].iov_base = tmp->buffers[i];
+		iovs[i].iov_len = buffer_size;
+#endif
+	}
+
+#ifdef ENABLE_IO_URING
+	/* registered (fixed) buffers are optional, RLIMIT_MEMLOCK can be low */
+	if (tmp->uring && !io_uring_register_buffers(&tmp->ring, iovs, depth))
+		tmp->registered = true;
+#endif
+
+	*q = tmp;
+	return 0;
+}
+
+unsigned io_queue_depth(const struct io_queue *q)
+{
+	return q ? q->depth : 0;
+}
+
+#ifdef ENABLE_IO_URING
+static int io_queue_reap(struct io_queue *q)
+{
+	struct io_uring_cqe *cqe;
+	uintptr_t idx;
+	int r;
+
+	do {
+		r = io_uring_wait_cqe(&q->ring, &cqe);
+	} while (r == -EINTR);
+
+	if (r < 0) {
+		/* we cannot know the state of in-flight requests anymore */
+		q->error = -EIO;
+		return r;
+	}
+
+	idx = (uintptr_t)io_uring_cqe_get_data(cqe);
+	if (idx < q->depth) {
+		if (cqe->res < 0 || (size_t)cqe->res != q->lengths[idx])
+			q->error = -EIO;
+		q->busy[idx] = false;
+		q->inflight--;
+	}
+
+	io_uring_cqe_seen(&q->ring, cqe);
+	return 0;
+}
+#endif
+
+void *io_queue_buffer(struct io_queue *q)
+{
+	unsigned i;
+
+	if (!q)
+		return NULL;
+
+	while (!q->error) {
+		for (i = 0; i < q->depth; i++)
+			if (!q->busy[i])
+				return q->buffers[i];
+#ifdef ENABLE_IO_URING
+		if (!q->uring || io_queue_reap(q) < 0)
+			return NULL;
+#else
+		return NULL;
+#endif
+	}
+
+	return NULL;
+}
+
+static int io_queue_index(struct io_queue *q, const void *buffer)
+{
+	unsigned i;
+
+	for (i = 0; i < q->depth; i++)
+		if (q->buffers[i] == buffer)
+			return (int)i;
+
+	return -EINVAL;
+}
+
+int io_queue_write(struct io_queue *q, void *buffer, size_t length, off_t offset)
+{
+	int idx;
+	ssize_t w;
+	size_t written = 0;
+#ifdef ENABLE_IO_URING
+	struct io_uring_sqe *sqe;
+#endif
+
+	if (!q || length > q->buffer_size || offset < 0)
+		return -EINVAL;
+
+	if (q->error)
+		return q->error;
+
+	idx = io_queue_index(q, buffer);
+	if (idx < 0 || q->busy[idx])
+		return -EINVAL;
+
+#ifdef ENABLE_IO_URING
+	if (q->uring) {
+		sqe = io_uring_get_sqe(&q->ring);
+		if (!sqe)
+			return -EBUSY;
+
+		if (q->registered)
+			io_uring_prep_write_fixed(sqe, q->fd, buffer, length, offset, idx);
+		else
+			io_uring_prep_write(sqe, q->fd, buffer, length, offset);
+		io_uring_sqe_set_data(sqe, (void *)(uintptr_t)idx);
+
+		if (io_uring_submit(&q->ring) < 0)
+			return -EIO;
+
+		q->lengths[idx] = length;
+		q->busy[idx] = true;
+		q->inflight++;
+		return 0;
+	}
+#endif
+	while (written < length) {
+		w = pwrite(q->fd, (char *)buffer + written, length - written, offset + written);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0) {
+			q->error = -EIO;
+			return q->error;
+		}
+		written += w;
+	}
+
+	return 0;
+}
+
+int io_queue_flush(struct io_queue *q)
+{
+	if (!q)
+		return -EINVAL;
+
+#ifdef ENABLE_IO_URING
+	while (q->uring && q->inflight)
+		if (io_queue_reap(q) < 0)
+			break;
+#endif
+	return q->error;
+}
+
+void io_queue_destroy(struct io_queue *q)
+{
+	unsigned i;
+
+	if (!q)
+		return;
+
+#ifdef ENABLE_IO_URING
+	if (q->uring) {
+		/* buffers must not be freed while the kernel still uses them */
+		io_queue_flush(q);
+		if (q->registered)
+			io_uring_unregister_buffers(&q->ring);
+		io_uring_queue_exit(&q->ring);
+	}
+#endif
+	/* buffers can contain data read from device */
+	for (i = 0; i < q->depth; i++) {
+		if (q->buffers[i])
+			memset(q->buffers[i], 0, q->buffer_size);
+		free(q->buffers[i]);
+	}
+	free(q);
+}
@@ -39,5 +39,15 @@ ssize_t write_lseek_blockwise(int fd, size_t bsize, size_t alignment,
 			      void *buf, size_t length, off_t offset);
 ssize_t read_lseek_blockwise(int fd, size_t bsize, size_t alignment,
 			     void *buf, size_t length, off_t offset);
+void io_scratch_exit(void);
+
+struct io_queue;
+int io_queue_init(struct io_queue **q, int fd, size_t alignment,
+		  size_t buffer_size, unsigned depth);
+unsigned io_queue_depth(const struct io_queue *q);
+void *io_queue_buffer(struct io_queue *q);
+int io_queue_write(struct io_queue *q, void *buffer, size_t length, off_t offset);
+int io_queue_flush(struct io_queue *q);
+void io_queue_destroy(struct io_queue *q);
 
 #endif
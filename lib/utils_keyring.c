@@ -22,6 +22,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/syscall.h>
 
@@ -85,6 +86,32 @@ static long keyctl_unlink(key_serial_t key, key_serial_t keyring)
 {
 	return syscall(__NR_keyctl, KEYCTL_UNLINK, key, keyring);
 }
+
+/* keyctl_set_timeout */
+static long keyctl_set_timeout(key_serial_t key, unsigned int timeout)
+{
+	return syscall(__NR_keyctl, KEYCTL_SET_TIMEOUT, key, timeout);
+}
+
+/* keyctl_setperm */
+static long keyctl_setperm(key_serial_t key, uint32_t perm)
+{
+	return syscall(__NR_keyctl, KEYCTL_SETPERM, key, perm);
+}
+
+/* keyctl_link */
+static long keyctl_link(key_serial_t key, key_serial_t keyring)
+{
+	return syscall(__NR_keyctl, KEYCTL_LINK, key, keyring);
+}
+
+/* possessor permissions, not defined in kernel headers */
+#define KEY_POS_VIEW	0x01000000
+#define KEY_POS_READ	0x02000000
+#define KEY_POS_WRITE	0x04000000
+#define KEY_POS_SEARCH	0x08000000
+#define KEY_POS_LINK	0x10000000
+#define KEY_POS_SETATTR	0x20000000
 #endif
 
 int keyring_check(void)
@@ -136,6 +163,43 @@ int keyring_add_key_in_user_keyring(key_type_t ktype, const char *key_desc, cons
 #endif
 }
 
+/*
+ * Key accessible only by possessors of session keyring (processes in the same
+ * session), it expires after timeout (in seconds).
+ * The key is prepared in thread keyring and linked to session keyring only
+ * with final permissions and timeout set.
+ */
+int keyring_add_key_in_session_keyring(key_type_t ktype, const char *key_desc,
+	const void *key, size_t key_size, unsigned int timeout)
+{
+#ifdef KERNEL_KEYRING
+	const char *type_name = key_type_name(ktype);
+	key_serial_t kid;
+	int r = 0;
+
+	if (!type_name || !key_desc || !timeout)
+		return -EINVAL;
+
+	kid = add_key(type_name, key_desc, key, key_size, KEY_SPEC_THREAD_KEYRING);
+	if (kid < 0)
+		return -errno;
+
+	if (keyctl_set_timeout(kid, timeout) ||
+	    keyctl_setperm(kid, KEY_POS_VIEW | KEY_POS_READ | KEY_POS_WRITE |
+				KEY_POS_SEARCH | KEY_POS_LINK | KEY_POS_SETATTR) ||
+	    keyctl_link(kid, KEY_SPEC_SESSION_KEYRING)) {
+		r = -errno;
+		keyctl_revoke(kid);
+	}
+
+	keyctl_unlink(kid, KEY_SPEC_THREAD_KEYRING);
+
+	return r;
+#else
+	return -ENOTSUP;
+#endif
+}
+
 /* alias for the same code */
 int keyring_get_key(const char *key_desc,
 		    char **key,
@@ -144,48 +208,210 @@ int keyring_get_key(const char *key_desc,
 	return keyring_get_passphrase(key_desc, key, key_size);
 }
 
-int keyring_get_passphrase(const char *key_desc,
-		      char **passphrase,
-		      size_t *passphrase_len)
-{
 #ifdef KERNEL_KEYRING
-	int err;
+/* big enough for passphrases and volume keys, payload size is probed otherwise */
+#define KEYRING_READ_SIZE 512
+
+static key_serial_t keyring_request_user_key(const char *key_desc)
+{
 	key_serial_t kid;
-	long ret;
-	char *buf = NULL;
-	size_t len = 0;
 
 	do
 		kid = request_key(key_type_name(USER_KEY), key_desc, NULL, 0);
 	while (kid < 0 && errno == EINTR);
 
-	if (kid < 0)
-		return -errno;
+	return kid;
+}
+
+/* Read payload, keyctl_read returns full payload size even if buffer is shorter */
+static int keyring_read_key(key_serial_t kid, char **key, size_t *key_size)
+{
+	size_t size = KEYRING_READ_SIZE;
+	char *buf;
+	long ret;
+	int err;
 
-	/* just get payload size */
-	ret = keyctl_read(kid, NULL, 0);
-	if (ret > 0) {
-		len = ret;
-		buf = malloc(len);
+	while (1) {
+		buf = malloc(size);
 		if (!buf)
 			return -ENOMEM;
 
-		/* retrieve actual payload data */
-		ret = keyctl_read(kid, buf, len);
+		ret = keyctl_read(kid, buf, size);
+		if (ret < 0) {
+			err = errno;
+			crypt_safe_memzero(buf, size);
+			free(buf);
+			return -err;
+		}
+
+		if ((size_t)ret <= size)
+			break;
+
+		/* payload was truncated, retry with exact size */
+		crypt_safe_memzero(buf, size);
+		free(buf);
+		size = ret;
 	}
 
-	if (ret < 0) {
-		err = errno;
-		if (buf)
-			crypt_safe_memzero(buf, len);
+	if (!ret) {
 		free(buf);
-		return -err;
+		buf = NULL;
 	}
 
-	*passphrase = buf;
-	*passphrase_len = len;
+	*key = buf;
+	*key_size = ret;
 
 	return 0;
+}
+#endif
+
+int keyring_get_passphrase(const char *key_desc,
+		      char **passphrase,
+		      size_t *passphrase_len)
+{
+	return keyring_cache_get_passphrase(NULL, key_desc, passphrase, passphrase_len);
+}
+
+/*
+ * Cache of resolved key serials (user type keys only). Payload is always
+ * read from kernel, so only request_key keyring search is saved.
+ */
+#define KEYRING_CACHE_SIZE 16
+
+struct keyring_cache {
+	struct {
+		char *desc;
+		int32_t kid;
+	} keys[KEYRING_CACHE_SIZE];
+	unsigned next;
+};
+
+int keyring_cache_init(struct keyring_cache **cache)
+{
+	if (!cache)
+		return -EINVAL;
+
+	*cache = calloc(1, sizeof(**cache));
+
+	return *cache ? 0 : -ENOMEM;
+}
+
+void keyring_cache_free(struct keyring_cache *cache)
+{
+	unsigned i;
+
+	if (!cache)
+		return;
+
+	for (i = 0; i < KEYRING_CACHE_SIZE; i++)
+		free(cache->keys[i].desc);
+	free(cache);
+}
+
+#ifdef KERNEL_KEYRING
+static int keyring_cache_find(struct keyring_cache *cache, const char *key_desc)
+{
+	unsigned i;
+
+	for (i = 0; cache && i < KEYRING_CACHE_SIZE; i++)
+		if (cache->keys[i].desc && !strcmp(cache->keys[i].desc, key_desc))
+			return i;
+
+	return -ENOENT;
+}
+
+static void keyring_cache_drop(struct keyring_cache *cache, int i)
+{
+	free(cache->keys[i].desc);
+	cache->keys[i].desc = NULL;
+}
+
+static void keyring_cache_add(struct keyring_cache *cache, const char *key_desc, key_serial_t kid)
+{
+	char *desc;
+	unsigned i;
+
+	if (!cache || !(desc = strdup(key_desc)))
+		return;
+
+	/* replace oldest entry if full */
+	i = cache->next;
+	cache->next = (cache->next + 1) % KEYRING_CACHE_SIZE;
+
+	free(cache->keys[i].desc);
+	cache->keys[i].desc = desc;
+	cache->keys[i].kid = kid;
+}
+#endif
+
+/*
+ * Resolve key serials of all descriptions (duplicates are searched only once).
+ * Returns number of resolved keys.
+ */
+int keyring_cache_resolve(struct keyring_cache *cache, const char * const *key_descs, size_t count)
+{
+#ifdef KERNEL_KEYRING
+	key_serial_t kid;
+	size_t i;
+	int resolved = 0;
+
+	if (!cache || (!key_descs && count))
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		if (!key_descs[i])
+			continue;
+
+		if (keyring_cache_find(cache, key_descs[i]) >= 0) {
+			resolved++;
+			continue;
+		}
+
+		kid = keyring_request_user_key(key_descs[i]);
+		if (kid < 0)
+			continue;
+
+		keyring_cache_add(cache, key_descs[i], kid);
+		resolved++;
+	}
+
+	return resolved;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+/* The same as keyring_get_passphrase, cache can be NULL */
+int keyring_cache_get_passphrase(struct keyring_cache *cache,
+	const char *key_desc,
+	char **passphrase,
+	size_t *passphrase_len)
+{
+#ifdef KERNEL_KEYRING
+	key_serial_t kid;
+	int i, r;
+
+	if (!key_desc || !passphrase || !passphrase_len)
+		return -EINVAL;
+
+	i = keyring_cache_find(cache, key_desc);
+	if (i >= 0) {
+		r = keyring_read_key(cache->keys[i].kid, passphrase, passphrase_len);
+		if (r != -ENOKEY && r != -EKEYREVOKED && r != -EKEYEXPIRED && r != -EACCES)
+			return r;
+		/* key was replaced or lost, search again */
+		keyring_cache_drop(cache, i);
+	}
+
+	kid = keyring_request_user_key(key_desc);
+	if (kid < 0)
+		return -errno;
+
+	r = keyring_read_key(kid, passphrase, passphrase_len);
+	if (!r)
+		keyring_cache_add(cache, key_desc, kid);
+
+	return r;
 #else
 	return -ENOTSUP;
 #endif
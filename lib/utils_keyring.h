@@ -38,6 +38,20 @@ int keyring_get_passphrase(const char *key_desc,
 		      char **passphrase,
 		      size_t *passphrase_len);
 
+struct keyring_cache;
+
+int keyring_cache_init(struct keyring_cache **cache);
+void keyring_cache_free(struct keyring_cache *cache);
+
+int keyring_cache_resolve(struct keyring_cache *cache,
+	const char * const *key_descs,
+	size_t count);
+
+int keyring_cache_get_passphrase(struct keyring_cache *cache,
+	const char *key_desc,
+	char **passphrase,
+	size_t *passphrase_len);
+
 int keyring_add_key_in_thread_keyring(
 	key_type_t ktype,
 	const char *key_desc,
@@ -50,6 +64,13 @@ int keyring_add_key_in_user_keyring(
 	const void *key,
 	size_t key_size);
 
+int keyring_add_key_in_session_keyring(
+	key_type_t ktype,
+	const char *key_desc,
+	const void *key,
+	size_t key_size,
+	unsigned int timeout);
+
 int keyring_revoke_and_unlink_key(key_type_t ktype, const char *key_desc);
 
 #endif
@@ -26,6 +26,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #ifdef HAVE_SYS_SYSMACROS_H
@@ -51,10 +52,25 @@
 #define LOOP_SET_CAPACITY 0x4C07
 #endif
 
+#ifndef LOOP_CTL_ADD
+#define LOOP_CTL_ADD 0x4C80
+#endif
+
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#endif
+
 #ifndef LOOP_SET_BLOCK_SIZE
 #define LOOP_SET_BLOCK_SIZE 0x4C09
 #endif
 
+#ifndef LO_FLAGS_DIRECT_IO
+#define LO_FLAGS_DIRECT_IO 16
+#endif
+
+/* the same limit as for the number of PBKDF threads */
+#define LOOP_BATCH_THREADS 16
+
 #ifndef LOOP_CONFIGURE
 #define LOOP_CONFIGURE 0x4C0A
 struct loop_config {
@@ -115,8 +131,27 @@ static char *crypt_loop_get_device(void)
 	return strdup(dev);
 }
 
-int crypt_loop_attach(char **loop, const char *file, int offset,
-		      int autoclear, int *readonly, size_t blocksize)
+/* Reserved device is tried first (once), then any free one */
+static char *crypt_loop_get_candidate(int *reserved)
+{
+	char dev[64];
+	struct stat st;
+	int i = *reserved;
+
+	if (i < 0)
+		return crypt_loop_get_device();
+
+	*reserved = -1;
+	if (sprintf(dev, "/dev/loop%d", i) < 0 ||
+	    stat(dev, &st) || !S_ISBLK(st.st_mode))
+		return crypt_loop_get_device();
+
+	return strdup(dev);
+}
+
+static int loop_attach(char **loop, const char *file, int offset,
+		       int autoclear, int *readonly, size_t blocksize,
+		       int direct_io, int reserved)
 {
 	struct loop_config config = {0};
 	char *lo_file_name;
@@ -143,9 +178,12 @@ int crypt_loop_attach(char **loop, const char *file, int offset,
 		config.info.lo_flags |= LO_FLAGS_AUTOCLEAR;
 	if (blocksize > SECTOR_SIZE)
 		config.block_size = blocksize;
+	/* kernel silently uses buffered I/O if alignment does not allow it */
+	if (direct_io)
+		config.info.lo_flags |= LO_FLAGS_DIRECT_IO;
 
 	while (loop_fd < 0) {
-		*loop = crypt_loop_get_device();
+		*loop = crypt_loop_get_candidate(&reserved);
 		if (!*loop)
 			goto out;
 
@@ -175,8 +213,9 @@ int crypt_loop_attach(char **loop, const char *file, int offset,
 	}
 
 	if (fallback) {
+		config.info.lo_flags &= ~LO_FLAGS_DIRECT_IO;
 		while (loop_fd < 0) {
-			*loop = crypt_loop_get_device();
+			*loop = crypt_loop_get_candidate(&reserved);
 			if (!*loop)
 				goto out;
 
@@ -201,6 +240,9 @@ int crypt_loop_attach(char **loop, const char *file, int offset,
 			(void)ioctl(loop_fd, LOOP_CLR_FD, 0);
 			goto out;
 		}
+
+		if (direct_io)
+			(void)ioctl(loop_fd, LOOP_SET_DIRECT_IO, 1UL);
 	}
 
 	/* Verify that autoclear is really set */
@@ -226,6 +268,126 @@ out:
 	return r ? -1 : loop_fd;
 }
 
+int crypt_loop_attach(char **loop, const char *file, int offset,
+		      int autoclear, int *readonly, size_t blocksize)
+{
+	return loop_attach(loop, file, offset, autoclear, readonly, blocksize, 0, -1);
+}
+
+/*
+ * Reserve a distinct loop device for each request, so parallel attaches
+ * do not race for the same first free device (LOOP_CTL_GET_FREE returns
+ * the same one until it is configured). Missing devices are created.
+ * Index -1 means no reservation.
+ */
+static void loop_reserve(struct crypt_loop_batch *b, size_t count)
+{
+	int ctl_fd, i, base;
+	size_t j;
+
+	for (j = 0; j < count; j++)
+		b[j].reserved = -1;
+
+	ctl_fd = open("/dev/loop-control", O_RDONLY);
+	if (ctl_fd < 0)
+		return;
+
+	base = ioctl(ctl_fd, LOOP_CTL_GET_FREE);
+	for (i = base, j = 0; base >= 0 && j < count && i < base + 2 * (int)count; i++) {
+		/* existing device (maybe in use) is still a candidate, EBUSY means retry */
+		if (i > base && ioctl(ctl_fd, LOOP_CTL_ADD, i) < 0 && errno != EEXIST)
+			continue;
+		b[j++].reserved = i;
+	}
+
+	close(ctl_fd);
+}
+
+struct loop_batch_ctx {
+	pthread_mutex_t lock;
+	struct crypt_loop_batch *b;
+	size_t count;
+	size_t next;
+};
+
+static void *loop_batch_worker(void *arg)
+{
+	struct loop_batch_ctx *ctx = arg;
+	struct crypt_loop_batch *b;
+
+	while (1) {
+		pthread_mutex_lock(&ctx->lock);
+		b = ctx->next < ctx->count ? &ctx->b[ctx->next++] : NULL;
+		pthread_mutex_unlock(&ctx->lock);
+		if (!b)
+			break;
+
+		b->loop_fd = loop_attach(&b->loop, b->file, b->offset, b->autoclear,
+					 &b->readonly, b->blocksize, b->direct_io, b->reserved);
+	}
+
+	return NULL;
+}
+
+/*
+ * Attach more files at once. Every entry gets its loop device (or loop_fd -1
+ * and loop NULL on failure) as crypt_loop_attach() would set. Returns the
+ * number of failed entries.
+ */
+int crypt_loop_attach_batch(struct crypt_loop_batch *b, size_t count)
+{
+	struct loop_batch_ctx ctx = { .b = b, .count = count };
+	pthread_t tids[LOOP_BATCH_THREADS];
+	unsigned i, started = 0, threads;
+	size_t j;
+	int failed = 0;
+
+	if (!b || !count)
+		return 0;
+
+	loop_reserve(b, count);
+
+	threads = count < LOOP_BATCH_THREADS ? count : LOOP_BATCH_THREADS;
+
+	if (pthread_mutex_init(&ctx.lock, NULL))
+		threads = 0;
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&tids[i], NULL, loop_batch_worker, &ctx))
+			break;
+		started++;
+	}
+
+	/* without any thread, attach in caller thread */
+	if (!started) {
+		for (j = 0; j < count; j++)
+			b[j].loop_fd = loop_attach(&b[j].loop, b[j].file, b[j].offset, b[j].autoclear,
+						   &b[j].readonly, b[j].blocksize, b[j].direct_io, b[j].reserved);
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	if (threads)
+		pthread_mutex_destroy(&ctx.lock);
+
+	for (j = 0; j < count; j++)
+		if (b[j].loop_fd < 0)
+			failed++;
+
+	return failed;
+}
+
+int crypt_loop_direct_io(int loop_fd)
+{
+	struct loop_info64 lo64 = {0};
+
+	if (ioctl(loop_fd, LOOP_GET_STATUS64, &lo64) < 0)
+		return 0;
+
+	return (lo64.lo_flags & LO_FLAGS_DIRECT_IO) ? 1 : 0;
+}
+
 int crypt_loop_detach(const char *loop)
 {
 	int loop_fd = -1, r = 1;
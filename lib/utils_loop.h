@@ -22,12 +22,31 @@
 #ifndef _UTILS_LOOP_H
 #define _UTILS_LOOP_H
 
+#include <stddef.h>
+
 /* loopback device helpers */
 
+struct crypt_loop_batch {
+	/* input, the same as crypt_loop_attach() parameters */
+	const char *file;
+	int offset;
+	int autoclear;
+	int readonly;	/* updated if file is read-only */
+	size_t blocksize;
+	int direct_io;	/* request LO_FLAGS_DIRECT_IO */
+	/* output */
+	char *loop;
+	int loop_fd;
+	/* internal */
+	int reserved;
+};
+
 char *crypt_loop_backing_file(const char *loop);
 int crypt_loop_device(const char *loop);
 int crypt_loop_attach(char **loop, const char *file, int offset,
 		      int autoclear, int *readonly, size_t blocksize);
+int crypt_loop_attach_batch(struct crypt_loop_batch *b, size_t count);
+int crypt_loop_direct_io(int loop_fd);
 int crypt_loop_detach(const char *loop);
 int crypt_loop_resize(const char *loop);
 
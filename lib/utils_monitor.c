@@ -0,0 +1,220 @@
+/*
+ * utils_monitor - dm-verity and dm-integrity corruption monitor
+ *
+ * Copyright (C) 2021 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include "internal.h"
+
+struct monitor_device {
+	char *name;
+	dm_target_type type;
+	uint64_t failures;
+};
+
+struct crypt_monitor {
+	struct crypt_device *cd;
+	struct monitor_device *devs;
+	size_t count;
+	int fd;
+	void (*event)(const char *name, uint64_t failures, void *usrptr);
+	void *usrptr;
+};
+
+static int monitor_device_failures(struct crypt_device *cd, struct monitor_device *md,
+				   uint64_t *failures)
+{
+	int r;
+
+	if (md->type == DM_INTEGRITY)
+		return dm_status_integrity_failures(cd, md->name, failures);
+
+	/* dm-verity reports only corrupted flag */
+	r = dm_status_verity_ok(cd, md->name);
+	if (r < 0)
+		return r;
+
+	*failures = r ? 0 : 1;
+	return 0;
+}
+
+static int monitor_device_init(struct crypt_device *cd, struct monitor_device *md,
+			       const char *name)
+{
+	struct crypt_dm_active_device dmd;
+	int r;
+
+	r = dm_query_device(cd, name, 0, &dmd);
+	if (r < 0) {
+		log_err(cd, _("Device %s is not active."), name);
+		return r;
+	}
+
+	if (single_segment(&dmd) &&
+	    (dmd.segment.type == DM_VERITY || dmd.segment.type == DM_INTEGRITY))
+		md->type = dmd.segment.type;
+	else
+		r = -ENOTSUP;
+	dm_targets_free(cd, &dmd);
+
+	if (r < 0) {
+		log_err(cd, _("Device %s is not a dm-verity or dm-integrity device."), name);
+		return r;
+	}
+
+	if (!(md->name = strdup(name)))
+		return -ENOMEM;
+
+	return monitor_device_failures(cd, md, &md->failures);
+}
+
+int crypt_monitor_init(struct crypt_monitor **monitor,
+	struct crypt_device *cd,
+	const char * const *names,
+	size_t count,
+	void (*event)(const char *name, uint64_t failures, void *usrptr),
+	void *usrptr)
+{
+	struct crypt_monitor *m;
+	size_t i;
+	int r;
+
+	if (!monitor || !names || !count || !event)
+		return -EINVAL;
+
+	if (!(m = calloc(1, sizeof(*m))))
+		return -ENOMEM;
+
+	m->devs = calloc(count, sizeof(*m->devs));
+	if (!m->devs) {
+		free(m);
+		return -ENOMEM;
+	}
+
+	m->cd = cd;
+	m->count = count;
+	m->fd = -1;
+	m->event = event;
+	m->usrptr = usrptr;
+
+	if (!cd)
+		dm_backend_init(cd);
+
+	for (i = 0; i < count; i++) {
+		r = monitor_device_init(cd, &m->devs[i], names[i]);
+		if (r < 0) {
+			/* backend is released in free */
+			m->count = i + 1;
+			crypt_monitor_free(m);
+			return r;
+		}
+	}
+
+	/* Without event support the status is read after each timeout only */
+	m->fd = dm_event_fd_open();
+	if (m->fd < 0)
+		log_dbg(cd, "Device-mapper events not available, using status polling.");
+
+	/* Report already detected failures */
+	for (i = 0; i < count; i++)
+		if (m->devs[i].failures)
+			m->event(m->devs[i].name, m->devs[i].failures, m->usrptr);
+
+	*monitor = m;
+	return 0;
+}
+
+/*
+ * dm-integrity failures and dm-verity corruption do not always raise
+ * device-mapper event, status of all devices is read on each wake up.
+ */
+static int monitor_check(struct crypt_monitor *m)
+{
+	uint64_t failures;
+	size_t i;
+	int r, changed = 0;
+
+	for (i = 0; i < m->count; i++) {
+		r = monitor_device_failures(m->cd, &m->devs[i], &failures);
+		if (r < 0)
+			return r;
+
+		if (failures == m->devs[i].failures)
+			continue;
+
+		m->devs[i].failures = failures;
+		m->event(m->devs[i].name, failures, m->usrptr);
+		changed++;
+	}
+
+	return changed;
+}
+
+int crypt_monitor_wait(struct crypt_monitor *m, int timeout_ms)
+{
+	struct pollfd pfd;
+	int r;
+
+	if (!m)
+		return -EINVAL;
+
+	if (m->fd >= 0 && dm_event_fd_arm(m->fd)) {
+		log_dbg(m->cd, "Device-mapper event poll not supported, using status polling.");
+		close(m->fd);
+		m->fd = -1;
+	}
+
+	/* Changes since previous call (event armed already, none can be lost) */
+	if (m->fd >= 0 && (r = monitor_check(m)))
+		return r;
+
+	if (m->fd >= 0) {
+		pfd.fd = m->fd;
+		pfd.events = POLLIN;
+		r = poll(&pfd, 1, timeout_ms);
+	} else
+		r = poll(NULL, 0, timeout_ms < 0 ? 1000 : timeout_ms);
+
+	if (r < 0)
+		return -errno;
+
+	return monitor_check(m);
+}
+
+void crypt_monitor_free(struct crypt_monitor *m)
+{
+	size_t i;
+
+	if (!m)
+		return;
+
+	if (m->fd >= 0)
+		close(m->fd);
+
+	for (i = 0; i < m->count; i++)
+		free(m->devs[i].name);
+	free(m->devs);
+
+	if (!m->cd)
+		dm_backend_exit(m->cd);
+
+	free(m);
+}
@@ -19,10 +19,13 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "internal.h"
+#include "utils_device_locking.h"
 
 const struct crypt_pbkdf_type default_pbkdf2 = {
 	.type = CRYPT_KDF_PBKDF2,
@@ -331,3 +334,170 @@ void crypt_set_iteration_time(struct crypt_device *cd, uint64_t iteration_time_m
 
 	log_dbg(cd, "Iteration time set to %" PRIu64 " milliseconds.", iteration_time_ms);
 }
+
+/*
+ * Memory budget for concurrent memory-hard PBKDF derivations.
+ * In process, derivations wait until the sum of their memory cost fits in the budget
+ * (a derivation bigger than the whole budget runs alone).
+ *
+ * With CRYPT_PBKDF_BUDGET_GLOBAL, the budget is split into PBKDF_BUDGET_SLOTS
+ * lock files shared by all processes (with the same budget). A derivation holds
+ * write locks of as many slots as its memory cost needs. Slots are only tried
+ * (non-blocking) and all are released before waiting for a busy one, so there
+ * is no lock ordering problem.
+ */
+#define PBKDF_BUDGET_SLOTS 16
+
+struct crypt_pbkdf_memory {
+	uint64_t memory_kb;
+	struct crypt_lock_handle *slots[PBKDF_BUDGET_SLOTS];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint64_t budget_kb;
+	uint64_t used_kb;
+	unsigned running;
+	uint32_t flags;
+} pbkdf_budget = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+int crypt_pbkdf_memory_budget(uint64_t memory_kb, uint32_t flags)
+{
+	if (flags & ~CRYPT_PBKDF_BUDGET_GLOBAL)
+		return -EINVAL;
+
+	pthread_mutex_lock(&pbkdf_budget.lock);
+	pbkdf_budget.budget_kb = memory_kb;
+	pbkdf_budget.flags = memory_kb ? flags : 0;
+	/* waiting derivations may fit now */
+	pthread_cond_broadcast(&pbkdf_budget.cond);
+	pthread_mutex_unlock(&pbkdf_budget.lock);
+
+	return 0;
+}
+
+uint64_t crypt_pbkdf_memory_budget_kb(void)
+{
+	uint64_t budget_kb;
+
+	pthread_mutex_lock(&pbkdf_budget.lock);
+	budget_kb = pbkdf_budget.budget_kb;
+	pthread_mutex_unlock(&pbkdf_budget.lock);
+
+	return budget_kb;
+}
+
+static void pbkdf_slots_release(struct crypt_device *cd, struct crypt_pbkdf_memory *mem)
+{
+	int i;
+
+	for (i = 0; i < PBKDF_BUDGET_SLOTS; i++) {
+		crypt_unlock_internal(cd, mem->slots[i]);
+		mem->slots[i] = NULL;
+	}
+}
+
+static int pbkdf_slots_acquire(struct crypt_device *cd, struct crypt_pbkdf_memory *mem,
+			       uint64_t budget_kb)
+{
+	struct crypt_lock_handle *h;
+	char res[32];
+	int i, busy, need, got, r;
+
+	need = (mem->memory_kb * PBKDF_BUDGET_SLOTS + budget_kb - 1) / budget_kb;
+	if (need > PBKDF_BUDGET_SLOTS)
+		need = PBKDF_BUDGET_SLOTS;
+
+	while (1) {
+		for (i = 0, got = 0, busy = -1; i < PBKDF_BUDGET_SLOTS && got < need; i++) {
+			snprintf(res, sizeof(res), "pbkdf-memory-%d", i);
+			r = crypt_write_lock(cd, res, false, &mem->slots[i]);
+			if (!r)
+				got++;
+			else if (r == -EBUSY) {
+				mem->slots[i] = NULL;
+				if (busy < 0)
+					busy = i;
+			} else {
+				mem->slots[i] = NULL;
+				pbkdf_slots_release(cd, mem);
+				return r;
+			}
+		}
+
+		if (got == need)
+			return 0;
+
+		pbkdf_slots_release(cd, mem);
+
+		/* wait until the first busy slot is released, then try again */
+		snprintf(res, sizeof(res), "pbkdf-memory-%d", busy);
+		r = crypt_write_lock(cd, res, true, &h);
+		if (r < 0)
+			return r;
+		crypt_unlock_internal(cd, h);
+	}
+}
+
+int crypt_pbkdf_memory_acquire(struct crypt_device *cd, uint64_t memory_kb,
+			       struct crypt_pbkdf_memory **mem)
+{
+	struct crypt_pbkdf_memory *m;
+	uint64_t budget_kb;
+	uint32_t flags;
+	int r;
+
+	*mem = NULL;
+
+	if (!memory_kb || !crypt_pbkdf_memory_budget_kb())
+		return 0;
+
+	if (!(m = calloc(1, sizeof(*m))))
+		return -ENOMEM;
+	m->memory_kb = memory_kb;
+
+	pthread_mutex_lock(&pbkdf_budget.lock);
+	while (pbkdf_budget.budget_kb && pbkdf_budget.running &&
+	       pbkdf_budget.used_kb + memory_kb > pbkdf_budget.budget_kb) {
+		log_dbg(cd, "Waiting for PBKDF memory (%" PRIu64 " kB used, %" PRIu64 " kB needed).",
+			pbkdf_budget.used_kb, memory_kb);
+		pthread_cond_wait(&pbkdf_budget.cond, &pbkdf_budget.lock);
+	}
+	pbkdf_budget.used_kb += memory_kb;
+	pbkdf_budget.running++;
+	budget_kb = pbkdf_budget.budget_kb;
+	flags = pbkdf_budget.flags;
+	pthread_mutex_unlock(&pbkdf_budget.lock);
+
+	if (budget_kb && (flags & CRYPT_PBKDF_BUDGET_GLOBAL) && crypt_metadata_locking_enabled()) {
+		r = pbkdf_slots_acquire(cd, m, budget_kb);
+		if (r < 0) {
+			log_err(cd, _("Failed to acquire global PBKDF memory budget lock."));
+			crypt_pbkdf_memory_release(cd, m);
+			return r;
+		}
+	}
+
+	*mem = m;
+	return 0;
+}
+
+void crypt_pbkdf_memory_release(struct crypt_device *cd, struct crypt_pbkdf_memory *mem)
+{
+	if (!mem)
+		return;
+
+	pbkdf_slots_release(cd, mem);
+
+	pthread_mutex_lock(&pbkdf_budget.lock);
+	pbkdf_budget.used_kb -= mem->memory_kb;
+	pbkdf_budget.running--;
+	pthread_cond_broadcast(&pbkdf_budget.cond);
+	pthread_mutex_unlock(&pbkdf_budget.lock);
+
+	free(mem);
+}
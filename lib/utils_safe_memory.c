@@ -21,13 +21,170 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include "libcryptsetup.h"
+#include "internal.h"
 
 struct safe_allocation {
 	size_t	size;
+	size_t	slab_class;
 	char	data[0];
 };
 
+/*
+ * Small secrets (passphrases, keys) are allocated from mlock'ed pages
+ * excluded from core dumps. Every size class has own free list (and lock),
+ * free objects are always wiped. Pages are never returned to the system,
+ * the total locked memory is limited and excessive allocations use plain
+ * malloc. Larger allocations get own locked mapping, released on free.
+ */
+#define SAFE_SLAB_CLASSES	8	/* 32 - 4096 bytes objects (with header) */
+#define SAFE_SLAB_MIN_SHIFT	5
+#define SAFE_SLAB_MAX_SIZE	(256 * 1024)	/* locked memory limit for slab pages */
+#define SAFE_SLAB_NONE		((size_t)-1)
+#define SAFE_SLAB_MMAP		((size_t)-2)
+
+struct safe_slab_object {
+	struct safe_slab_object *next;
+};
+
+static struct safe_slab_class {
+	pthread_mutex_t lock;
+	struct safe_slab_object *free;
+} safe_slab[SAFE_SLAB_CLASSES] = {
+#define SAFE_SLAB_INIT { .lock = PTHREAD_MUTEX_INITIALIZER, .free = NULL }
+	SAFE_SLAB_INIT, SAFE_SLAB_INIT, SAFE_SLAB_INIT, SAFE_SLAB_INIT,
+	SAFE_SLAB_INIT, SAFE_SLAB_INIT, SAFE_SLAB_INIT, SAFE_SLAB_INIT
+#undef SAFE_SLAB_INIT
+};
+
+static pthread_mutex_t safe_slab_pages_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t safe_slab_pages_size;
+
+static size_t safe_slab_class(size_t size)
+{
+	size_t c = 0;
+
+	size += offsetof(struct safe_allocation, data);
+	while (c < SAFE_SLAB_CLASSES && (size_t)1 << (c + SAFE_SLAB_MIN_SHIFT) < size)
+		c++;
+
+	return c < SAFE_SLAB_CLASSES ? c : SAFE_SLAB_NONE;
+}
+
+static void *safe_slab_page(size_t page_size)
+{
+	void *page;
+
+	pthread_mutex_lock(&safe_slab_pages_lock);
+	if (safe_slab_pages_size + page_size > SAFE_SLAB_MAX_SIZE) {
+		pthread_mutex_unlock(&safe_slab_pages_lock);
+		return NULL;
+	}
+	safe_slab_pages_size += page_size;
+	pthread_mutex_unlock(&safe_slab_pages_lock);
+
+	page = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (page == MAP_FAILED) {
+		pthread_mutex_lock(&safe_slab_pages_lock);
+		safe_slab_pages_size -= page_size;
+		pthread_mutex_unlock(&safe_slab_pages_lock);
+		return NULL;
+	}
+
+	/* Both are best effort only (RLIMIT_MEMLOCK, old kernels) */
+	(void)mlock(page, page_size);
+#ifdef MADV_DONTDUMP
+	(void)madvise(page, page_size, MADV_DONTDUMP);
+#endif
+	return page;
+}
+
+static struct safe_allocation *safe_slab_alloc(size_t c)
+{
+	struct safe_slab_class *sc = &safe_slab[c];
+	size_t i, obj_size = (size_t)1 << (c + SAFE_SLAB_MIN_SHIFT);
+	size_t page_size = crypt_getpagesize();
+	struct safe_slab_object *obj;
+	char *page;
+
+	pthread_mutex_lock(&sc->lock);
+	if (!sc->free) {
+		page = safe_slab_page(page_size);
+		if (!page) {
+			pthread_mutex_unlock(&sc->lock);
+			return NULL;
+		}
+		/* mmap memory is zeroed already */
+		for (i = page_size; i >= obj_size; i -= obj_size) {
+			obj = (struct safe_slab_object *)(page + i - obj_size);
+			obj->next = sc->free;
+			sc->free = obj;
+		}
+	}
+
+	obj = sc->free;
+	sc->free = obj->next;
+	pthread_mutex_unlock(&sc->lock);
+
+	obj->next = NULL;
+	return (struct safe_allocation *)obj;
+}
+
+static void safe_slab_free(struct safe_allocation *alloc)
+{
+	struct safe_slab_class *sc = &safe_slab[alloc->slab_class];
+	struct safe_slab_object *obj = (struct safe_slab_object *)alloc;
+
+	/* data are wiped already, wipe header too */
+	crypt_safe_memzero(alloc, offsetof(struct safe_allocation, data));
+
+	pthread_mutex_lock(&sc->lock);
+	obj->next = sc->free;
+	sc->free = obj;
+	pthread_mutex_unlock(&sc->lock);
+}
+
+static size_t safe_mmap_length(size_t size)
+{
+	size_t length = size + offsetof(struct safe_allocation, data);
+	size_t page_size = crypt_getpagesize();
+
+	return (length + page_size - 1) & ~(page_size - 1);
+}
+
+static struct safe_allocation *safe_mmap_alloc(size_t size)
+{
+	size_t length = safe_mmap_length(size);
+	void *p;
+
+	if (length < size)
+		return NULL;
+
+	p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	/* Best effort only, as for slab pages */
+	(void)mlock(p, length);
+#ifdef MADV_DONTDUMP
+	(void)madvise(p, length, MADV_DONTDUMP);
+#endif
+	return p;
+}
+
+static void safe_mmap_free(struct safe_allocation *alloc)
+{
+	size_t length = safe_mmap_length(alloc->size);
+
+	crypt_safe_memzero(alloc, offsetof(struct safe_allocation, data));
+	(void)munlock(alloc, length);
+	munmap(alloc, length);
+}
+
 /*
  * Replacement for memset(s, 0, n) on stack that can be optimized out
  * Also used in safe allocations for explicit memory wipe.
@@ -48,15 +205,26 @@ void crypt_safe_memzero(void *data, size_t size)
 void *crypt_safe_alloc(size_t size)
 {
 	struct safe_allocation *alloc;
+	size_t c;
 
 	if (!size || size > (SIZE_MAX - offsetof(struct safe_allocation, data)))
 		return NULL;
 
-	alloc = malloc(size + offsetof(struct safe_allocation, data));
-	if (!alloc)
-		return NULL;
+	c = safe_slab_class(size);
+	if (c != SAFE_SLAB_NONE)
+		alloc = safe_slab_alloc(c);
+	else if ((alloc = safe_mmap_alloc(size)))
+		c = SAFE_SLAB_MMAP;
+
+	if (!alloc) {
+		alloc = malloc(size + offsetof(struct safe_allocation, data));
+		if (!alloc)
+			return NULL;
+		c = SAFE_SLAB_NONE;
+	}
 
 	alloc->size = size;
+	alloc->slab_class = c;
 	crypt_safe_memzero(&alloc->data, size);
 
 	/* coverity[leaked_storage] */
@@ -76,6 +244,16 @@ void crypt_safe_free(void *data)
 
 	crypt_safe_memzero(data, alloc->size);
 
+	if (alloc->slab_class == SAFE_SLAB_MMAP) {
+		safe_mmap_free(alloc);
+		return;
+	}
+
+	if (alloc->slab_class != SAFE_SLAB_NONE) {
+		safe_slab_free(alloc);
+		return;
+	}
+
 	s = (volatile size_t *)&alloc->size;
 	*s = 0x55aa55aa;
 	free(alloc);
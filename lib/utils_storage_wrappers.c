@@ -20,23 +20,38 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "utils_storage_wrappers.h"
 #include "internal.h"
 
+/* Max idle temporary dm-crypt devices kept per context */
+#define DMCRYPT_POOL_MAX 2
+
+/* parallel direct-io to temporary dm-crypt device: max requests, min request size */
+#define DMCRYPT_IO_LANES_MAX 16
+#define DMCRYPT_IO_LANE_MIN (256 * 1024)
+
 struct crypt_storage_wrapper {
 	crypt_storage_wrapper_type type;
+	struct crypt_device *cd;
+	struct crypt_storage_wrapper *next; /* in pool */
 	int dev_fd;
 	int block_size;
 	size_t mem_alignment;
 	uint64_t data_offset;
+	bool dsync; /* use RWF_DSYNC writes */
+	bool dirty; /* data written without RWF_DSYNC since last datasync */
+	bool pool; /* dm-crypt device may be taken from and returned to context pool */
 	union {
 	struct {
 		struct crypt_storage *s;
@@ -44,7 +59,16 @@ struct crypt_storage_wrapper {
 	} cb;
 	struct {
 		int dmcrypt_fd;
+		int mode;
 		char name[PATH_MAX];
+		/* mapped table, identifies pooled device */
+		char *device_path;
+		uint64_t device_offset;
+		uint64_t iv_start;
+		int sector_size;
+		char cipher_spec[2 * MAX_CIPHER_LEN];
+		char key_digest[32];
+		char *key_description;
 	} dm;
 	} u;
 };
@@ -61,8 +85,9 @@ static int crypt_storage_backend_init(struct crypt_device *cd,
 	int r;
 	struct crypt_storage *s;
 
-	/* iv_start, sector_size */
-	r = crypt_storage_init(&s, sector_size, cipher, cipher_mode, vk->key, vk->keylength, flags & LARGE_IV);
+	/* iv_start, sector_size, large buffers are processed in per-cpu stripes */
+	r = crypt_storage_init_threads(&s, sector_size, cipher, cipher_mode, vk->key, vk->keylength,
+				       flags & LARGE_IV, crypt_cpusonline());
 	if (r)
 		return r;
 
@@ -72,6 +97,9 @@ static int crypt_storage_backend_init(struct crypt_device *cd,
 		return -ENOTSUP;
 	}
 
+	if ((flags & KCAPI_ZEROCOPY) && crypt_storage_kernel_only(s) && crypt_storage_zerocopy(s))
+		log_dbg(cd, "Zero-copy mode for kernel block cipher is not available.");
+
 	w->type = USPACE;
 	w->u.cb.s = s;
 	w->u.cb.iv_start = iv_start;
@@ -79,6 +107,158 @@ static int crypt_storage_backend_init(struct crypt_device *cd,
 	return 0;
 }
 
+static int dmcrypt_key_digest(const struct volume_key *vk, char *digest, size_t digest_size)
+{
+	struct crypt_hash *hd = NULL;
+	int r;
+
+	if (crypt_hash_size("sha256") != (int)digest_size || crypt_hash_init(&hd, "sha256"))
+		return -EINVAL;
+
+	r = crypt_hash_write(hd, vk->key, vk->keylength);
+	if (!r)
+		r = crypt_hash_final(hd, digest, digest_size);
+	crypt_hash_destroy(hd);
+
+	return r;
+}
+
+static void dmcrypt_params_free(struct crypt_storage_wrapper *cw)
+{
+	free(cw->u.dm.device_path);
+	cw->u.dm.device_path = NULL;
+	free(cw->u.dm.key_description);
+	cw->u.dm.key_description = NULL;
+	crypt_safe_memzero(cw->u.dm.key_digest, sizeof(cw->u.dm.key_digest));
+}
+
+/* Record mapped table, on failure the device is never reused without reload */
+static void dmcrypt_params_set(struct crypt_storage_wrapper *cw,
+	struct device *device,
+	uint64_t device_offset,
+	uint64_t iv_start,
+	int sector_size,
+	const char *cipher_spec,
+	const struct volume_key *vk)
+{
+	dmcrypt_params_free(cw);
+
+	cw->u.dm.device_offset = device_offset;
+	cw->u.dm.iv_start = iv_start;
+	cw->u.dm.sector_size = sector_size;
+	if (snprintf(cw->u.dm.cipher_spec, sizeof(cw->u.dm.cipher_spec), "%s", cipher_spec) < 0 ||
+	    dmcrypt_key_digest(vk, cw->u.dm.key_digest, sizeof(cw->u.dm.key_digest)) ||
+	    (vk->key_description && !(cw->u.dm.key_description = strdup(vk->key_description))))
+		return;
+
+	cw->u.dm.device_path = strdup(device_path(device));
+}
+
+static bool dmcrypt_params_match(const struct crypt_storage_wrapper *cw,
+	struct device *device,
+	uint64_t device_offset,
+	uint64_t iv_start,
+	int sector_size,
+	const char *cipher_spec,
+	const struct volume_key *vk)
+{
+	char digest[sizeof(cw->u.dm.key_digest)];
+	bool match;
+
+	if (!cw->u.dm.device_path || strcmp(cw->u.dm.device_path, device_path(device)) ||
+	    cw->u.dm.device_offset != device_offset || cw->u.dm.iv_start != iv_start ||
+	    cw->u.dm.sector_size != sector_size || strcmp(cw->u.dm.cipher_spec, cipher_spec))
+		return false;
+
+	if (!cw->u.dm.key_description != !vk->key_description ||
+	    (vk->key_description && strcmp(cw->u.dm.key_description, vk->key_description)))
+		return false;
+
+	if (dmcrypt_key_digest(vk, digest, sizeof(digest)))
+		return false;
+
+	match = !memcmp(digest, cw->u.dm.key_digest, sizeof(digest));
+	crypt_safe_memzero(digest, sizeof(digest));
+
+	return match;
+}
+
+static void dmcrypt_device_release(struct crypt_storage_wrapper *cw)
+{
+	if (cw->u.dm.dmcrypt_fd >= 0)
+		close(cw->u.dm.dmcrypt_fd);
+	cw->u.dm.dmcrypt_fd = -1;
+	dm_remove_device(cw->cd, cw->u.dm.name, CRYPT_DEACTIVATE_FORCE | DM_DEACTIVATE_PRIVATE);
+	dmcrypt_params_free(cw);
+}
+
+/* Take idle device from context pool, preferably one with the same mapping */
+static struct crypt_storage_wrapper *dmcrypt_pool_get(struct crypt_device *cd,
+	struct device *device,
+	uint64_t device_offset,
+	uint64_t iv_start,
+	int sector_size,
+	const char *cipher_spec,
+	const struct volume_key *vk,
+	bool *match)
+{
+	struct crypt_storage_wrapper **pool = crypt_storage_wrapper_pool(cd), **p, *cw;
+
+	if (!pool || !*pool)
+		return NULL;
+
+	for (p = pool; *p; p = &(*p)->next)
+		if (dmcrypt_params_match(*p, device, device_offset, iv_start,
+					 sector_size, cipher_spec, vk))
+			break;
+
+	*match = *p != NULL;
+	if (!*p)
+		p = pool;
+
+	cw = *p;
+	*p = cw->next;
+	cw->next = NULL;
+
+	return cw;
+}
+
+static bool dmcrypt_pool_put(struct crypt_storage_wrapper *cw)
+{
+	struct crypt_storage_wrapper **pool = crypt_storage_wrapper_pool(cw->cd), **p;
+	int count = 0;
+
+	if (!pool)
+		return false;
+
+	for (p = pool; *p; p = &(*p)->next)
+		count++;
+
+	if (count >= DMCRYPT_POOL_MAX)
+		return false;
+
+	cw->next = *pool;
+	*pool = cw;
+
+	return true;
+}
+
+/* Remove all idle temporary dm-crypt devices of the context */
+void crypt_storage_wrapper_pool_free(struct crypt_device *cd)
+{
+	struct crypt_storage_wrapper **pool = crypt_storage_wrapper_pool(cd), *cw;
+
+	if (!pool)
+		return;
+
+	while ((cw = *pool)) {
+		*pool = cw->next;
+		log_dbg(cd, "Removing pooled temporary dmcrypt device %s.", cw->u.dm.name);
+		dmcrypt_device_release(cw);
+		free(cw);
+	}
+}
+
 static int crypt_storage_dmcrypt_init(
 	struct crypt_device *cd,
 	struct crypt_storage_wrapper *cw,
@@ -95,27 +275,49 @@ static int crypt_storage_dmcrypt_init(
 	struct crypt_dm_active_device dmd = {
 		.flags = CRYPT_ACTIVATE_PRIVATE,
 	};
-	int mode, r, fd = -1;
+	struct crypt_storage_wrapper *pooled;
+	bool active = false, match = false;
+	int mode, r;
 
 	log_dbg(cd, "Using temporary dmcrypt to access data.");
 
-	if (snprintf(cw->u.dm.name, sizeof(cw->u.dm.name), "temporary-cryptsetup-%d-%d", getpid(), counter++) < 0)
-		return -ENOMEM;
-	if (snprintf(path, sizeof(path), "%s/%s", dm_get_dir(), cw->u.dm.name) < 0)
+	cw->cd = cd;
+	cw->u.dm.dmcrypt_fd = -1;
+
+	pooled = cw->pool ? dmcrypt_pool_get(cd, device, device_offset, iv_start,
+					     sector_size, cipher_spec, vk, &match) : NULL;
+	if (pooled) {
+		memcpy(&cw->u.dm, &pooled->u.dm, sizeof(cw->u.dm));
+		free(pooled);
+		active = true;
+	} else if (snprintf(cw->u.dm.name, sizeof(cw->u.dm.name), "temporary-cryptsetup-%d-%d", getpid(),
+			    __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED)) < 0)
 		return -ENOMEM;
 
+	if (snprintf(path, sizeof(path), "%s/%s", dm_get_dir(), cw->u.dm.name) < 0) {
+		r = -ENOMEM;
+		goto err;
+	}
+
 	r = device_block_adjust(cd, device, DEV_OK,
 				device_offset, &dmd.size, &dmd.flags);
 	if (r < 0) {
 		log_err(cd, _("Device %s does not exist or access denied."),
 			device_path(device));
-		return -EIO;
+		r = -EIO;
+		goto err;
 	}
 
 	mode = open_flags | O_DIRECT;
 	if (dmd.flags & CRYPT_ACTIVATE_READONLY)
 		mode = (open_flags & ~O_ACCMODE) | O_RDONLY;
 
+	if (match && cw->u.dm.mode == mode) {
+		log_dbg(cd, "Reusing pooled temporary dmcrypt device %s.", cw->u.dm.name);
+		cw->type = DMCRYPT;
+		return 0;
+	}
+
 	if (vk->key_description)
 		dmd.flags |= CRYPT_ACTIVATE_KEYRING_KEY;
 
@@ -129,31 +331,47 @@ static int crypt_storage_dmcrypt_init(
 			    0,
 			    sector_size);
 	if (r)
-		return r;
+		goto err;
 
-	r = dm_create_device(cd, cw->u.dm.name, "TEMP", &dmd);
-	if (r < 0) {
-		if (r != -EACCES && r != -ENOTSUP)
+	if (active) {
+		/* Remap idle device with a table reload, no device is created */
+		log_dbg(cd, "Reloading pooled temporary dmcrypt device %s.", cw->u.dm.name);
+		close(cw->u.dm.dmcrypt_fd);
+		cw->u.dm.dmcrypt_fd = -1;
+		dmcrypt_params_free(cw);
+		r = dm_reload_device(cd, cw->u.dm.name, &dmd, 0, 1);
+	} else {
+		r = dm_create_device(cd, cw->u.dm.name, "TEMP", &dmd);
+		if (r < 0 && r != -EACCES && r != -ENOTSUP)
 			log_dbg(cd, "error hint would be nice");
-		r = -EIO;
+		active = !r;
 	}
 
 	dm_targets_free(cd, &dmd);
 
-	if (r)
-		return r;
+	if (r < 0) {
+		r = -EIO;
+		goto err;
+	}
 
-	fd = open(path, mode);
-	if (fd < 0) {
+	cw->u.dm.dmcrypt_fd = open(path, mode);
+	if (cw->u.dm.dmcrypt_fd < 0) {
 		log_dbg(cd, "Failed to open %s", path);
-		dm_remove_device(cd, cw->u.dm.name, CRYPT_DEACTIVATE_FORCE);
-		return -EINVAL;
+		r = -EINVAL;
+		goto err;
 	}
 
 	cw->type = DMCRYPT;
-	cw->u.dm.dmcrypt_fd = fd;
+	cw->u.dm.mode = mode;
+	dmcrypt_params_set(cw, device, device_offset, iv_start, sector_size, cipher_spec, vk);
 
 	return 0;
+err:
+	if (active)
+		dmcrypt_device_release(cw);
+	else
+		dmcrypt_params_free(cw);
+	return r;
 }
 
 int crypt_storage_wrapper_init(struct crypt_device *cd,
@@ -185,6 +403,8 @@ int crypt_storage_wrapper_init(struct crypt_device *cd,
 
 	memset(w, 0, sizeof(*w));
 	w->data_offset = data_offset;
+	w->dsync = flags & WRITE_DSYNC;
+	w->pool = flags & DMCRYPT_POOL;
 	w->mem_alignment = device_alignment(device);
 	w->block_size = device_block_size(cd, device);
 	if (!w->block_size || !w->mem_alignment) {
@@ -212,7 +432,10 @@ int crypt_storage_wrapper_init(struct crypt_device *cd,
 		goto err;
 	}
 
-	r = crypt_storage_backend_init(cd, w, iv_start, sector_size, _cipher, mode, vk, flags);
+	if (flags & DISABLE_USPACE)
+		r = -ENOTSUP;
+	else
+		r = crypt_storage_backend_init(cd, w, iv_start, sector_size, _cipher, mode, vk, flags);
 	if (!r) {
 		*cw = w;
 		return 0;
@@ -241,12 +464,145 @@ err:
 ssize_t crypt_storage_wrapper_read(struct crypt_storage_wrapper *cw,
 		off_t offset, void *buffer, size_t buffer_length)
 {
-	return read_lseek_blockwise(cw->dev_fd,
+	ssize_t r;
+
+	r = read_lseek_blockwise(cw->dev_fd,
 			cw->block_size,
 			cw->mem_alignment,
 			buffer,
 			buffer_length,
 			cw->data_offset + offset);
+	TRACE3(storage__read, offset, buffer_length, r);
+
+	return r;
+}
+
+struct dmcrypt_io_lane {
+	pthread_t thread;
+	int fd;
+	bool write;
+	bool dsync;      /* in: try RWF_DSYNC, out: all data written with it */
+	char *buffer;
+	size_t length;
+	off_t offset;
+	ssize_t done;
+};
+
+static void dmcrypt_io_lane_run(struct dmcrypt_io_lane *lane)
+{
+	ssize_t r;
+#if defined(HAVE_PWRITEV2) && defined(RWF_DSYNC)
+	struct iovec iov;
+#endif
+
+	lane->done = 0;
+	while ((size_t)lane->done < lane->length) {
+#if defined(HAVE_PWRITEV2) && defined(RWF_DSYNC)
+		if (lane->write && lane->dsync) {
+			iov.iov_base = lane->buffer + lane->done;
+			iov.iov_len = lane->length - lane->done;
+			r = pwritev2(lane->fd, &iov, 1, lane->offset + lane->done, RWF_DSYNC);
+			if (r < 0 && (errno == EOPNOTSUPP || errno == ENOSYS)) {
+				lane->dsync = false;
+				continue;
+			}
+		} else
+#endif
+		if (lane->write)
+			r = pwrite(lane->fd, lane->buffer + lane->done,
+				   lane->length - lane->done, lane->offset + lane->done);
+		else
+			r = pread(lane->fd, lane->buffer + lane->done,
+				  lane->length - lane->done, lane->offset + lane->done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		lane->done += r;
+	}
+#if !defined(HAVE_PWRITEV2) || !defined(RWF_DSYNC)
+	lane->dsync = false;
+#endif
+}
+
+static void *dmcrypt_io_lane_thread(void *arg)
+{
+	dmcrypt_io_lane_run(arg);
+	return NULL;
+}
+
+/*
+ * dm-crypt encrypts bios of one request in its per-cpu workqueues, but with
+ * only one request in flight it cannot use more CPUs than the request spans.
+ * Large aligned requests are split into contiguous parts issued concurrently
+ * from helper threads. Returns -ENOTSUP if request is not suitable.
+ */
+static ssize_t dmcrypt_io_parallel(struct crypt_storage_wrapper *cw,
+		void *buffer, size_t length, off_t offset, bool write)
+{
+	struct dmcrypt_io_lane lanes[DMCRYPT_IO_LANES_MAX];
+	bool started[DMCRYPT_IO_LANES_MAX] = {};
+	size_t i, count, unit, per_lane, pos = 0;
+	ssize_t done = 0;
+	bool dsync = true;
+
+	unit = (size_t)cw->block_size > cw->mem_alignment ? (size_t)cw->block_size : cw->mem_alignment;
+	if (length < 2 * DMCRYPT_IO_LANE_MIN || length % unit || offset % unit ||
+	    (uintptr_t)buffer % cw->mem_alignment)
+		return -ENOTSUP;
+
+	count = crypt_cpusonline();
+	if (count > DMCRYPT_IO_LANES_MAX)
+		count = DMCRYPT_IO_LANES_MAX;
+	if (count > length / DMCRYPT_IO_LANE_MIN)
+		count = length / DMCRYPT_IO_LANE_MIN;
+	if (count < 2)
+		return -ENOTSUP;
+
+	per_lane = (length / count) - (length / count) % unit;
+
+	for (i = 0; i < count; i++) {
+		lanes[i].fd = cw->u.dm.dmcrypt_fd;
+		lanes[i].write = write;
+		lanes[i].dsync = write && cw->dsync;
+		lanes[i].buffer = (char *)buffer + pos;
+		lanes[i].length = (i == count - 1) ? length - pos : per_lane;
+		lanes[i].offset = offset + pos;
+		lanes[i].done = 0;
+		pos += lanes[i].length;
+	}
+
+	for (i = 1; i < count; i++)
+		started[i] = !pthread_create(&lanes[i].thread, NULL, dmcrypt_io_lane_thread, &lanes[i]);
+
+	dmcrypt_io_lane_run(&lanes[0]);
+
+	for (i = 1; i < count; i++) {
+		if (started[i])
+			pthread_join(lanes[i].thread, NULL);
+		else
+			dmcrypt_io_lane_run(&lanes[i]);
+	}
+
+	/* contiguous prefix only, as a single short read or write would report */
+	for (i = 0; i < count; i++) {
+		done += lanes[i].done;
+		if (write && !lanes[i].dsync)
+			dsync = false;
+		if ((size_t)lanes[i].done != lanes[i].length)
+			break;
+	}
+
+	if (write && !dsync) {
+		if (cw->dsync)
+			log_dbg(cw->cd, "RWF_DSYNC write not supported, using data sync.");
+		cw->dsync = false;
+		cw->dirty = true;
+	}
+
+	log_dbg(cw->cd, "Parallel %s of %zu bytes in %zu requests.", write ? "write" : "read", length, count);
+
+	return done ?: -1;
 }
 
 ssize_t crypt_storage_wrapper_read_decrypt(struct crypt_storage_wrapper *cw,
@@ -255,6 +611,10 @@ ssize_t crypt_storage_wrapper_read_decrypt(struct crypt_storage_wrapper *cw,
 	int r;
 	ssize_t read;
 
+	if (cw->type == DMCRYPT &&
+	    (read = dmcrypt_io_parallel(cw, buffer, buffer_length, offset, false)) != -ENOTSUP)
+		return read;
+
 	if (cw->type == DMCRYPT)
 		return read_lseek_blockwise(cw->u.dm.dmcrypt_fd,
 				cw->block_size,
@@ -303,33 +663,74 @@ ssize_t crypt_storage_wrapper_decrypt(struct crypt_storage_wrapper *cw,
 			cw->u.cb.iv_start + (offset >> SECTOR_SHIFT),
 			buffer_length,
 			buffer);
+	TRACE3(storage__decrypt, offset, buffer_length, r);
 	if (r)
 		return r;
 
 	return 0;
 }
 
+/*
+ * RWF_DSYNC write is durable on return and it syncs only the written range,
+ * unrelated dirty data of the device are not flushed (as with fdatasync).
+ * Fallback to common write marks wrapper dirty for the next datasync.
+ */
+static ssize_t storage_write(struct crypt_storage_wrapper *cw, int fd,
+		void *buffer, size_t buffer_length, off_t offset)
+{
+#if defined(HAVE_PWRITEV2) && defined(RWF_DSYNC)
+	struct iovec iov;
+	ssize_t w, written = 0;
+
+	if (cw->dsync && !(offset % cw->block_size) && !(buffer_length % cw->block_size) &&
+	    !((uintptr_t)buffer % cw->mem_alignment)) {
+		while (written < (ssize_t)buffer_length) {
+			iov.iov_base = (char *)buffer + written;
+			iov.iov_len = buffer_length - written;
+			w = pwritev2(fd, &iov, 1, offset + written, RWF_DSYNC);
+			if (w < 0 && errno == EINTR)
+				continue;
+			if (w < 0 && !written && (errno == EOPNOTSUPP || errno == ENOSYS)) {
+				log_dbg(cw->cd, "RWF_DSYNC write not supported, using data sync.");
+				cw->dsync = false;
+				break;
+			}
+			if (w <= 0)
+				return -1;
+			written += w;
+		}
+		if (written)
+			return written;
+	}
+#endif
+	cw->dirty = true;
+
+	return write_lseek_blockwise(fd, cw->block_size, cw->mem_alignment,
+			buffer, buffer_length, offset);
+}
+
 ssize_t crypt_storage_wrapper_write(struct crypt_storage_wrapper *cw,
 		off_t offset, void *buffer, size_t buffer_length)
 {
-	return write_lseek_blockwise(cw->dev_fd,
-			cw->block_size,
-			cw->mem_alignment,
-			buffer,
-			buffer_length,
-			cw->data_offset + offset);
+	ssize_t r;
+
+	r = storage_write(cw, cw->dev_fd, buffer, buffer_length, cw->data_offset + offset);
+	TRACE3(storage__write, offset, buffer_length, r);
+
+	return r;
 }
 
 ssize_t crypt_storage_wrapper_encrypt_write(struct crypt_storage_wrapper *cw,
 		off_t offset, void *buffer, size_t buffer_length)
 {
+	ssize_t r;
+
+	if (cw->type == DMCRYPT &&
+	    (r = dmcrypt_io_parallel(cw, buffer, buffer_length, offset, true)) != -ENOTSUP)
+		return r;
+
 	if (cw->type == DMCRYPT)
-		return write_lseek_blockwise(cw->u.dm.dmcrypt_fd,
-				cw->block_size,
-				cw->mem_alignment,
-				buffer,
-				buffer_length,
-				offset);
+		return storage_write(cw, cw->u.dm.dmcrypt_fd, buffer, buffer_length, offset);
 
 	if (cw->type == USPACE &&
 	    crypt_storage_encrypt(cw->u.cb.s,
@@ -337,27 +738,26 @@ ssize_t crypt_storage_wrapper_encrypt_write(struct crypt_storage_wrapper *cw,
 		    buffer_length, buffer))
 		return -EINVAL;
 
-	return write_lseek_blockwise(cw->dev_fd,
-			cw->block_size,
-			cw->mem_alignment,
-			buffer,
-			buffer_length,
-			cw->data_offset + offset);
+	return storage_write(cw, cw->dev_fd, buffer, buffer_length, cw->data_offset + offset);
 }
 
 ssize_t crypt_storage_wrapper_encrypt(struct crypt_storage_wrapper *cw,
 		off_t offset, void *buffer, size_t buffer_length)
 {
+	int r;
+
 	if (cw->type == NONE)
 		return 0;
 
 	if (cw->type == DMCRYPT)
 		return -ENOTSUP;
 
-	if (crypt_storage_encrypt(cw->u.cb.s,
+	r = crypt_storage_encrypt(cw->u.cb.s,
 			cw->u.cb.iv_start + (offset >> SECTOR_SHIFT),
 			buffer_length,
-			buffer))
+			buffer);
+	TRACE3(storage__encrypt, offset, buffer_length, r);
+	if (r)
 		return -EINVAL;
 
 	return 0;
@@ -371,21 +771,65 @@ void crypt_storage_wrapper_destroy(struct crypt_storage_wrapper *cw)
 	if (cw->type == USPACE)
 		crypt_storage_destroy(cw->u.cb.s);
 	if (cw->type == DMCRYPT) {
-		close(cw->u.dm.dmcrypt_fd);
-		dm_remove_device(NULL, cw->u.dm.name, CRYPT_DEACTIVATE_FORCE);
+		/* Keep idle device for next wrapper in the same context (opt-in) */
+		if (cw->pool && dmcrypt_pool_put(cw))
+			return;
+		dmcrypt_device_release(cw);
 	}
 
 	free(cw);
 }
 
-int crypt_storage_wrapper_datasync(const struct crypt_storage_wrapper *cw)
+/* access hint for underlying device area, offset is relative to data_offset */
+void crypt_storage_wrapper_advise(const struct crypt_storage_wrapper *cw,
+		off_t offset, size_t length, int advice)
 {
+	if (!cw || !length)
+		return;
+
+	(void)posix_fadvise(cw->dev_fd, cw->data_offset + offset, length, advice);
+}
+
+/*
+ * Start writeback of written area, optionally wait for it to finish.
+ * No-op for data written with direct-io.
+ */
+void crypt_storage_wrapper_writeback(const struct crypt_storage_wrapper *cw,
+		off_t offset, size_t length, bool wait)
+{
+	unsigned int flags = SYNC_FILE_RANGE_WRITE;
+
+	if (!cw || !length)
+		return;
+
+	if (wait)
+		flags |= SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WAIT_AFTER;
+
+	if (cw->type == DMCRYPT)
+		(void)sync_file_range(cw->u.dm.dmcrypt_fd, offset, length, flags);
+	else
+		(void)sync_file_range(cw->dev_fd, cw->data_offset + offset, length, flags);
+}
+
+int crypt_storage_wrapper_datasync(struct crypt_storage_wrapper *cw)
+{
+	int r;
+
 	if (!cw)
 		return -EINVAL;
+
+	/* everything written since last sync is already durable */
+	if (!cw->dirty)
+		return 0;
+
 	if (cw->type == DMCRYPT)
-		return fdatasync(cw->u.dm.dmcrypt_fd);
+		r = fdatasync(cw->u.dm.dmcrypt_fd);
 	else
-		return fdatasync(cw->dev_fd);
+		r = fdatasync(cw->dev_fd);
+	if (!r)
+		cw->dirty = false;
+
+	return r;
 }
 
 crypt_storage_wrapper_type crypt_storage_wrapper_get_type(const struct crypt_storage_wrapper *cw)
@@ -22,6 +22,7 @@
 #ifndef _UTILS_STORAGE_WRAPPERS_H
 #define _UTILS_STORAGE_WRAPPERS_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <sys/types.h>
 
@@ -35,6 +36,9 @@ struct crypt_device;
 #define DISABLE_DMCRYPT	(1 << 2)
 #define OPEN_READONLY	(1 << 3)
 #define LARGE_IV	(1 << 4)
+#define KCAPI_ZEROCOPY	(1 << 5)
+#define WRITE_DSYNC	(1 << 6) /* synchronous writes of written range only */
+#define DMCRYPT_POOL	(1 << 7) /* idle dm-crypt device may stay in context pool, volume keys only */
 
 typedef enum {
 	NONE = 0,
@@ -53,6 +57,7 @@ int crypt_storage_wrapper_init(struct crypt_device *cd,
 	uint32_t flags);
 
 void crypt_storage_wrapper_destroy(struct crypt_storage_wrapper *cw);
+void crypt_storage_wrapper_pool_free(struct crypt_device *cd);
 
 /* !!! when doing 'read' or 'write' all offset values are RELATIVE to data_offset !!! */
 ssize_t crypt_storage_wrapper_read(struct crypt_storage_wrapper *cw,
@@ -69,7 +74,11 @@ ssize_t crypt_storage_wrapper_encrypt_write(struct crypt_storage_wrapper *cw,
 ssize_t crypt_storage_wrapper_encrypt(struct crypt_storage_wrapper *cw,
 		off_t offset, void *buffer, size_t buffer_length);
 
-int crypt_storage_wrapper_datasync(const struct crypt_storage_wrapper *cw);
+void crypt_storage_wrapper_advise(const struct crypt_storage_wrapper *cw,
+		off_t offset, size_t length, int advice);
+void crypt_storage_wrapper_writeback(const struct crypt_storage_wrapper *cw,
+		off_t offset, size_t length, bool wait);
+int crypt_storage_wrapper_datasync(struct crypt_storage_wrapper *cw);
 
 crypt_storage_wrapper_type crypt_storage_wrapper_get_type(const struct crypt_storage_wrapper *cw);
 #endif
@@ -0,0 +1,58 @@
+/*
+ * Static tracing probes (USDT) on library hot paths
+ *
+ * Copyright (C) 2021 Red Hat, Inc. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this file; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _UTILS_TRACE_H
+#define _UTILS_TRACE_H
+
+/*
+ * Probes are in "libcryptsetup" provider, "__" in name is shown as "-"
+ * (for example bpftrace -l 'usdt:/usr/lib64/libcryptsetup.so.12:*').
+ * A probe is a single nop instruction until a tracer is attached,
+ * arguments must be cheap to evaluate (already computed values only).
+ *
+ *   kdf__start        (type, hash, iterations, memory_kb, threads)
+ *   kdf__end          (type, result)
+ *   keyslot__open__start (keyslot)
+ *   keyslot__open__end   (keyslot, result)
+ *   hdr__read__start  (device path)
+ *   hdr__read__end    (device path, result)
+ *   hdr__write__start (device path, seqid)
+ *   hdr__write__end   (device path, result)
+ *   dm__create, dm__reload, dm__resume, dm__remove (name, result)
+ *   reencrypt__phase  (phase name, elapsed ns)
+ *   token__open       (token, handler name, result)
+ *   storage__read, storage__write     (offset, length, result)
+ *   storage__decrypt, storage__encrypt (offset, length, result)
+ */
+
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+#define TRACE1(name, a)				DTRACE_PROBE1(libcryptsetup, name, a)
+#define TRACE2(name, a, b)			DTRACE_PROBE2(libcryptsetup, name, a, b)
+#define TRACE3(name, a, b, c)			DTRACE_PROBE3(libcryptsetup, name, a, b, c)
+#define TRACE5(name, a, b, c, d, e)		DTRACE_PROBE5(libcryptsetup, name, a, b, c, d, e)
+#else
+#define TRACE1(name, a)				do {} while (0)
+#define TRACE2(name, a, b)			do {} while (0)
+#define TRACE3(name, a, b, c)			do {} while (0)
+#define TRACE5(name, a, b, c, d, e)		do {} while (0)
+#endif
+
+#endif
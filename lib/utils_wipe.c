@@ -22,6 +22,11 @@
 
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include "internal.h"
 
 /*
@@ -91,9 +96,40 @@ static int crypt_wipe_special(struct crypt_device *cd, int fd, size_t bsize,
 	return 0;
 }
 
+/* ephemeral AES-XTS key for random data stream (zeroes encrypted by crypt_storage) */
+#define WIPE_RANDOM_KEY_SIZE 64
+
+static int wipe_random_init(struct crypt_device *cd, const char *key,
+			    struct crypt_storage **rng, unsigned threads)
+{
+	int r;
+
+	*rng = NULL;
+	if (!key)
+		return -EINVAL;
+
+	r = crypt_storage_init_threads(rng, SECTOR_SIZE, "aes", "xts-plain64",
+				       key, WIPE_RANDOM_KEY_SIZE, false, threads);
+	if (r)
+		log_dbg(cd, "Cannot initialize random wipe stream (%d), using RNG directly.", r);
+	return r;
+}
+
+static int wipe_random_fill(struct crypt_device *cd, struct crypt_storage *rng,
+			    char *buffer, size_t size, uint64_t offset)
+{
+	if (!rng)
+		return crypt_random_get(cd, buffer, size, CRYPT_RND_NORMAL) ? -EIO : 0;
+
+	/* IV is the device sector, so every sector gets a unique keystream */
+	memset(buffer, 0, size);
+	return crypt_storage_encrypt(rng, offset >> SECTOR_SHIFT, size, buffer) ? -EIO : 0;
+}
+
 static int wipe_block(struct crypt_device *cd, int devfd, crypt_wipe_pattern pattern,
-		      char *sf, size_t device_block_size, size_t alignment,
-		      size_t wipe_block_size, uint64_t offset, bool *need_block_init)
+		      struct crypt_storage *rng, char *sf, size_t device_block_size,
+		      size_t alignment, size_t wipe_block_size, uint64_t offset,
+		      bool *need_block_init)
 {
 	int r;
 
@@ -106,14 +142,9 @@ static int wipe_block(struct crypt_device *cd, int devfd, crypt_wipe_pattern pat
 			memset(sf, 0, wipe_block_size);
 			*need_block_init = false;
 			r = 0;
-		} else if (pattern == CRYPT_WIPE_RANDOM) {
-			r = crypt_random_get(cd, sf, wipe_block_size,
-					     CRYPT_RND_NORMAL) ? -EIO : 0;
-			*need_block_init = true;
-		} else if (pattern == CRYPT_WIPE_ENCRYPTED_ZERO) {
-			// FIXME
-			r = crypt_random_get(cd, sf, wipe_block_size,
-					     CRYPT_RND_NORMAL) ? -EIO : 0;
+		} else if (pattern == CRYPT_WIPE_RANDOM ||
+			   pattern == CRYPT_WIPE_ENCRYPTED_ZERO) {
+			r = wipe_random_fill(cd, rng, sf, wipe_block_size, offset);
 			*need_block_init = true;
 		} else
 			r = -EINVAL;
@@ -129,6 +160,373 @@ static int wipe_block(struct crypt_device *cd, int devfd, crypt_wipe_pattern pat
 	return -EIO;
 }
 
+/* number of wipe blocks in flight with queued (io_uring) I/O */
+#define WIPE_QUEUE_DEPTH 8
+
+static int wipe_block_queued(struct crypt_device *cd, struct io_queue *q, int devfd,
+			     crypt_wipe_pattern pattern, struct crypt_storage *rng,
+			     size_t device_block_size,
+			     size_t alignment, size_t wipe_block_size, uint64_t offset)
+{
+	char *sf = io_queue_buffer(q);
+
+	if (!sf)
+		return -EIO;
+
+	/* queue buffers are zeroed on allocation */
+	if (pattern != CRYPT_WIPE_ZERO &&
+	    wipe_random_fill(cd, rng, sf, wipe_block_size, offset))
+		return -EIO;
+
+	/* unaligned last block needs read-modify-write */
+	if (wipe_block_size % device_block_size) {
+		if (io_queue_flush(q))
+			return -EIO;
+		if (write_lseek_blockwise(devfd, device_block_size, alignment, sf,
+					  wipe_block_size, offset) != (ssize_t)wipe_block_size)
+			return -EIO;
+		return 0;
+	}
+
+	return io_queue_write(q, sf, wipe_block_size, offset) ? -EIO : 0;
+}
+
+/* maximal number of parallel writers, each wipes its own device region */
+#define WIPE_THREADS_MAX 8
+/* minimal number of wipe blocks in one region */
+#define WIPE_THREAD_BLOCKS_MIN 16
+
+struct wipe_shared {
+	struct crypt_device *cd;
+	int devfd;
+	crypt_wipe_pattern pattern;
+	const char *key;
+	size_t alignment;
+	size_t wipe_block_size;
+	uint64_t offset;
+	uint64_t dev_size;
+	int numa_node;
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr);
+	void *usrptr;
+
+	pthread_mutex_t lock;
+	uint64_t done;
+	bool stop;
+};
+
+struct wipe_job {
+	struct wipe_shared *s;
+	pthread_t thread;
+	uint64_t offset;
+	uint64_t end;
+	int r;
+};
+
+static ssize_t wipe_pwrite(int fd, const char *buffer, size_t length, uint64_t offset)
+{
+	size_t done = 0;
+	ssize_t w;
+
+	while (done < length) {
+		w = pwrite(fd, buffer + done, length - done, offset + done);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return -1;
+		done += w;
+	}
+
+	return done;
+}
+
+static bool wipe_job_stopped(struct wipe_job *job)
+{
+	bool stop;
+
+	pthread_mutex_lock(&job->s->lock);
+	stop = job->s->stop;
+	pthread_mutex_unlock(&job->s->lock);
+
+	return stop;
+}
+
+static void wipe_job_block_done(struct wipe_job *job, size_t size)
+{
+	struct wipe_shared *s = job->s;
+
+	/* Progress callback is never called concurrently */
+	pthread_mutex_lock(&s->lock);
+	s->done += size;
+	if (!s->stop && s->progress &&
+	    s->progress(s->dev_size, s->offset + s->done, s->usrptr)) {
+		s->stop = true;
+		job->r = -EINTR;
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void wipe_job_fail(struct wipe_job *job, int r)
+{
+	pthread_mutex_lock(&job->s->lock);
+	job->s->stop = true;
+	pthread_mutex_unlock(&job->s->lock);
+	job->r = r;
+}
+
+static void *wipe_job_run(void *arg)
+{
+	struct wipe_job *job = arg;
+	struct wipe_shared *s = job->s;
+	struct crypt_storage *rng = NULL;
+	char *buffer = NULL;
+	size_t size;
+
+	if (posix_memalign((void **)&buffer, s->alignment, s->wipe_block_size)) {
+		wipe_job_fail(job, -ENOMEM);
+		return NULL;
+	}
+	memset(buffer, 0, s->wipe_block_size);
+
+	if (s->pattern != CRYPT_WIPE_ZERO)
+		(void)wipe_random_init(s->cd, s->key, &rng, 1);
+
+	while (job->offset < job->end && !wipe_job_stopped(job)) {
+		size = s->wipe_block_size;
+		if (size > job->end - job->offset)
+			size = job->end - job->offset;
+
+		if (s->pattern != CRYPT_WIPE_ZERO &&
+		    wipe_random_fill(s->cd, rng, buffer, size, job->offset)) {
+			wipe_job_fail(job, -EIO);
+			break;
+		}
+
+		if (wipe_pwrite(s->devfd, buffer, size, job->offset) != (ssize_t)size) {
+			wipe_job_fail(job, -EIO);
+			break;
+		}
+
+		job->offset += size;
+		wipe_job_block_done(job, size);
+	}
+
+	crypt_storage_destroy(rng);
+	free(buffer);
+	return NULL;
+}
+
+/* Additional writers run near the device, buffer is then allocated on that node */
+static void *wipe_job_thread(void *arg)
+{
+	struct wipe_job *job = arg;
+
+	crypt_numa_bind_thread(job->s->numa_node);
+
+	return wipe_job_run(arg);
+}
+
+/*
+ * Wipe [offset, dev_size) by several writers, each in its own region.
+ * Returns -ENOTSUP if the area is too small or not aligned for parallel wipe.
+ * On error, offset is set to the first failed block.
+ */
+static int wipe_device_parallel(struct crypt_device *cd, int devfd, int numa_node,
+	crypt_wipe_pattern pattern, const char *key, size_t bsize, size_t alignment,
+	size_t wipe_block_size, uint64_t *offset, uint64_t dev_size,
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+	void *usrptr)
+{
+	struct wipe_shared s = {
+		.cd = cd,
+		.devfd = devfd,
+		.pattern = pattern,
+		.key = key,
+		.alignment = alignment,
+		.wipe_block_size = wipe_block_size,
+		.offset = *offset,
+		.dev_size = dev_size,
+		.numa_node = numa_node,
+		.progress = progress,
+		.usrptr = usrptr,
+	};
+	struct wipe_job jobs[WIPE_THREADS_MAX];
+	bool started[WIPE_THREADS_MAX] = {};
+	uint64_t blocks, region, start;
+	unsigned i, jobs_count;
+	int r = 0;
+
+	if (pattern == CRYPT_WIPE_SPECIAL || *offset % bsize ||
+	    wipe_block_size % bsize || dev_size % bsize)
+		return -ENOTSUP;
+
+	blocks = (dev_size - *offset + wipe_block_size - 1) / wipe_block_size;
+
+	jobs_count = crypt_numa_cpus(numa_node);
+	if (jobs_count > WIPE_THREADS_MAX)
+		jobs_count = WIPE_THREADS_MAX;
+	if (jobs_count > blocks / WIPE_THREAD_BLOCKS_MIN)
+		jobs_count = blocks / WIPE_THREAD_BLOCKS_MIN;
+	if (jobs_count < 2)
+		return -ENOTSUP;
+
+	/* Regions are aligned to wipe block, the last one can be shorter */
+	region = ((blocks + jobs_count - 1) / jobs_count) * wipe_block_size;
+
+	for (i = 0, start = *offset; i < jobs_count && start < dev_size; i++, start += region) {
+		jobs[i].s = &s;
+		jobs[i].offset = start;
+		jobs[i].end = (dev_size - start) < region ? dev_size : start + region;
+		jobs[i].r = 0;
+	}
+	jobs_count = i;
+
+	if (pthread_mutex_init(&s.lock, NULL))
+		return -ENOTSUP;
+
+	log_dbg(cd, "Using %u parallel wipe writers (NUMA node %d).", jobs_count, numa_node);
+
+	/* The first region is wiped by the calling thread */
+	for (i = 1; i < jobs_count; i++)
+		started[i] = !pthread_create(&jobs[i].thread, NULL, wipe_job_thread, &jobs[i]);
+
+	wipe_job_run(&jobs[0]);
+
+	for (i = 1; i < jobs_count; i++) {
+		if (started[i])
+			pthread_join(jobs[i].thread, NULL);
+		else
+			wipe_job_run(&jobs[i]);
+	}
+
+	pthread_mutex_destroy(&s.lock);
+
+	/* Report the first error in device order, interruption otherwise */
+	for (i = 0; i < jobs_count; i++) {
+		if (jobs[i].r && jobs[i].r != -EINTR) {
+			*offset = jobs[i].offset;
+			return jobs[i].r;
+		}
+		if (jobs[i].r)
+			r = jobs[i].r;
+	}
+
+	*offset = r ? s.offset + s.done : dev_size;
+	return r;
+}
+
+/* size of one zeroing request passed to device or filesystem */
+#define WIPE_OFFLOAD_BLOCK (128 * 1024 * 1024)
+
+static int zero_offload(int devfd, bool blkdev, uint64_t offset, uint64_t length)
+{
+	uint64_t range[2] = { offset, length };
+
+	/* Kernel uses WRITE ZEROES or WRITE SAME (or unmap) if device supports it */
+#ifdef BLKZEROOUT
+	if (blkdev && !ioctl(devfd, BLKZEROOUT, &range))
+		return 0;
+#endif
+	/* Punched hole reads as zeroes and keeps the file sparse */
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+	if (!blkdev && !fallocate(devfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length))
+		return 0;
+#endif
+#ifdef FALLOC_FL_ZERO_RANGE
+	if (!blkdev && !fallocate(devfd, FALLOC_FL_ZERO_RANGE, offset, length))
+		return 0;
+#endif
+	return -ENOTSUP;
+}
+
+/*
+ * Zero the device from offset using offload. Returns -ENOTSUP
+ * with offset set to the first not wiped byte if offload failed.
+ */
+static int wipe_zero_offload(struct crypt_device *cd, int devfd,
+	uint64_t *offset, uint64_t dev_size,
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+	void *usrptr)
+{
+	struct stat st;
+	uint64_t length, end = dev_size;
+
+	if (fstat(devfd, &st) < 0 || (!S_ISBLK(st.st_mode) && !S_ISREG(st.st_mode)))
+		return -ENOTSUP;
+
+	/* Area past the end of file is zeroed by extending it (without allocation) */
+	if (S_ISREG(st.st_mode) && dev_size > (uint64_t)st.st_size) {
+		if (ftruncate(devfd, dev_size) < 0)
+			return -ENOTSUP;
+		end = *offset > (uint64_t)st.st_size ? *offset : (uint64_t)st.st_size;
+	}
+
+	while (*offset < end) {
+		length = end - *offset;
+		if (length > WIPE_OFFLOAD_BLOCK)
+			length = WIPE_OFFLOAD_BLOCK;
+
+		if (zero_offload(devfd, S_ISBLK(st.st_mode), *offset, length)) {
+			log_dbg(cd, "Zeroing offload failed at offset %" PRIu64 ".", *offset);
+			return -ENOTSUP;
+		}
+
+		*offset += length;
+
+		if (progress && progress(dev_size, *offset, usrptr))
+			return -EINTR;
+	}
+
+	if (*offset < dev_size) {
+		*offset = dev_size;
+		if (progress && progress(dev_size, *offset, usrptr))
+			return -EINTR;
+	}
+
+	return 0;
+}
+
+static int erase_offload(int devfd, bool *secure, uint64_t offset, uint64_t length)
+{
+	uint64_t range[2] = { offset, length };
+
+	/* Secure discard erases also old copies of data inside the device */
+#ifdef BLKSECDISCARD
+	if (*secure && !ioctl(devfd, BLKSECDISCARD, &range))
+		return 0;
+#endif
+	/* Do not try secure discard again, the rest is zeroed from this offset */
+	*secure = false;
+#ifdef BLKZEROOUT
+	if (!ioctl(devfd, BLKZEROOUT, &range))
+		return 0;
+#endif
+	return -ENOTSUP;
+}
+
+/*
+ * Let flash device erase the area before it is overwritten by random data.
+ * Failure is not fatal, the random pass follows anyway.
+ */
+static void wipe_erase_offload(struct crypt_device *cd, int devfd,
+			       uint64_t offset, uint64_t dev_size)
+{
+	uint64_t length;
+	bool secure = true;
+
+	while (offset < dev_size) {
+		length = dev_size - offset;
+		if (length > WIPE_OFFLOAD_BLOCK)
+			length = WIPE_OFFLOAD_BLOCK;
+
+		if (erase_offload(devfd, &secure, offset, length)) {
+			log_dbg(cd, "Erase offload failed at offset %" PRIu64 ".", offset);
+			return;
+		}
+
+		offset += length;
+	}
+}
+
 int crypt_wipe_device(struct crypt_device *cd,
 	struct device *device,
 	crypt_wipe_pattern pattern,
@@ -143,6 +541,10 @@ int crypt_wipe_device(struct crypt_device *cd,
 	char *sf = NULL;
 	uint64_t dev_size;
 	bool need_block_init = true;
+	struct io_queue *q = NULL;
+	struct crypt_storage *rng = NULL;
+	char key[WIPE_RANDOM_KEY_SIZE];
+	const char *wipe_key = NULL;
 
 	/* Note: LUKS1 calls it with wipe_block not aligned to multiple of bsize */
 	bsize = device_block_size(cd, device);
@@ -180,30 +582,84 @@ int crypt_wipe_device(struct crypt_device *cd,
 	if (r)
 		goto out;
 
-	if (lseek64(devfd, offset, SEEK_SET) < 0) {
-		log_err(cd, _("Cannot seek to device offset."));
-		r = -EINVAL;
-		goto out;
-	}
-
 	if (progress && progress(dev_size, offset, usrptr)) {
 		r = -EINVAL; /* No change yet, treat this as a parameter error */
 		goto out;
 	}
 
+	/* Multiple pass wipe makes sense only for rotational devices */
 	if (pattern == CRYPT_WIPE_SPECIAL && !device_is_rotational(device)) {
-		log_dbg(cd, "Non-rotational device, using random data wipe mode.");
+		if (device_is_discardable(device) > 0) {
+			log_dbg(cd, "Non-rotational device, using erase offload and random data wipe mode.");
+			wipe_erase_offload(cd, devfd, offset, dev_size);
+		} else
+			log_dbg(cd, "Non-rotational device, using random data wipe mode.");
 		pattern = CRYPT_WIPE_RANDOM;
 	}
 
+	/* let device or filesystem zero the area, write zeroes only if it fails */
+	if (pattern == CRYPT_WIPE_ZERO) {
+		r = wipe_zero_offload(cd, devfd, &offset, dev_size, progress, usrptr);
+		if (r != -ENOTSUP) {
+			device_sync(cd, device);
+			goto out;
+		}
+		r = 0;
+	}
+
+	if ((pattern == CRYPT_WIPE_RANDOM || pattern == CRYPT_WIPE_ENCRYPTED_ZERO) &&
+	    !crypt_random_get(cd, key, sizeof(key), CRYPT_RND_KEY))
+		wipe_key = key;
+
+	/* split the area between several writers if possible, writers seeking
+	   between regions would only slow down rotational devices */
+	if (device_is_rotational(device) == 1) {
+		log_dbg(cd, "Rotational device, using serial wipe.");
+		r = -ENOTSUP;
+	} else
+		r = wipe_device_parallel(cd, devfd, crypt_numa_node(cd, device), pattern,
+					 wipe_key, bsize, alignment, wipe_block_size,
+					 &offset, dev_size, progress, usrptr);
+	if (r != -ENOTSUP) {
+		if (r && r != -EINTR)
+			log_err(cd,_("Device wipe error, offset %" PRIu64 "."), offset);
+		device_sync(cd, device);
+		goto out;
+	}
+	r = 0;
+
+	if (wipe_key)
+		(void)wipe_random_init(cd, wipe_key, &rng, crypt_cpusonline());
+
+	if (lseek64(devfd, offset, SEEK_SET) < 0) {
+		log_err(cd, _("Cannot seek to device offset."));
+		r = -EINVAL;
+		goto out;
+	}
+
+	/* keep more wipe blocks in flight if the I/O backend supports it */
+	if (pattern != CRYPT_WIPE_SPECIAL && !(offset % bsize) && !(wipe_block_size % bsize) &&
+	    !io_queue_init(&q, devfd, alignment, wipe_block_size, WIPE_QUEUE_DEPTH)) {
+		if (io_queue_depth(q) > 1)
+			log_dbg(cd, "Using queued wipe I/O, depth %u.", io_queue_depth(q));
+		else {
+			io_queue_destroy(q);
+			q = NULL;
+		}
+	}
+
 	while (offset < dev_size) {
 		if ((offset + wipe_block_size) > dev_size)
 			wipe_block_size = dev_size - offset;
 
 		//log_dbg("Wipe %012" PRIu64 "-%012" PRIu64 " bytes", offset, offset + wipe_block_size);
 
-		r = wipe_block(cd, devfd, pattern, sf, bsize, alignment,
-			       wipe_block_size, offset, &need_block_init);
+		if (q)
+			r = wipe_block_queued(cd, q, devfd, pattern, rng, bsize,
+					      alignment, wipe_block_size, offset);
+		else
+			r = wipe_block(cd, devfd, pattern, rng, sf, bsize, alignment,
+				       wipe_block_size, offset, &need_block_init);
 		if (r) {
 			log_err(cd,_("Device wipe error, offset %" PRIu64 "."), offset);
 			break;
@@ -217,8 +673,16 @@ int crypt_wipe_device(struct crypt_device *cd,
 		}
 	}
 
+	if (q && io_queue_flush(q) && !r) {
+		log_err(cd,_("Device wipe error, offset %" PRIu64 "."), offset);
+		r = -EIO;
+	}
+
 	device_sync(cd, device);
 out:
+	crypt_storage_destroy(rng);
+	crypt_safe_memzero(key, sizeof(key));
+	io_queue_destroy(q);
 	free(sf);
 	return r;
 }
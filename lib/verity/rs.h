@@ -23,6 +23,8 @@
 #ifndef _LIBFEC_RS_H
 #define _LIBFEC_RS_H
 
+#include <stddef.h>
+
 /* Special reserved value encoding zero in index form. */
 #define A0 (rs->nn)
 
@@ -34,9 +36,10 @@ typedef unsigned char data_t;
 struct rs {
 	int mm;          /* Bits per symbol */
 	int nn;          /* Symbols per block (= (1<<mm)-1) */
-	data_t *alpha_to;/* log lookup table */
-	data_t *index_of;/* Antilog lookup table */
+	const data_t *alpha_to;/* log lookup table */
+	const data_t *index_of;/* Antilog lookup table */
 	data_t *genpoly; /* Generator polynomial */
+	data_t *genmul;  /* Products with generator coefficients (nroots + 1) x 256 */
 	int nroots;      /* Number of generator roots = number of parity symbols */
 	int fcr;         /* First consecutive root, index form */
 	int prim;        /* Primitive element, index form */
@@ -58,6 +61,8 @@ void free_rs_char(struct rs *rs);
 
 /* General purpose RS codec, 8-bit symbols */
 void encode_rs_char(struct rs *rs, data_t *data, data_t *parity);
+void encode_rs_char_columns(struct rs *rs, const data_t *data, size_t stride,
+			    size_t columns, data_t *parity);
 int decode_rs_char(struct rs *rs, data_t *data);
 
 #endif
@@ -270,14 +270,19 @@ int VERITY_activate(struct crypt_device *cd,
 	log_dbg(cd, "Trying to activate VERITY device %s using hash %s.",
 		name ?: "[none]", verity_hdr->hash_name);
 
-	if (verity_hdr->flags & CRYPT_VERITY_CHECK_HASH) {
+	if (verity_hdr->flags & (CRYPT_VERITY_CHECK_HASH | CRYPT_VERITY_CHECK_HASH_ONLY)) {
 		if (signature_description) {
 			log_err(cd, _("Root hash signature verification is not supported."));
 			return -EINVAL;
 		}
 
-		log_dbg(cd, "Verification of data in userspace required.");
-		r = VERITY_verify(cd, verity_hdr, root_hash, root_hash_size);
+		if (verity_hdr->flags & CRYPT_VERITY_CHECK_HASH) {
+			log_dbg(cd, "Verification of data in userspace required.");
+			r = VERITY_verify(cd, verity_hdr, root_hash, root_hash_size);
+		} else {
+			log_dbg(cd, "Verification of hash area in userspace required.");
+			r = VERITY_verify_hash_only(cd, verity_hdr, root_hash, root_hash_size);
+		}
 
 		if ((r == -EPERM || r == -EFAULT) && fec_device) {
 			v = r;
@@ -22,6 +22,7 @@
 #define _VERITY_H
 
 #include <stddef.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 #define VERITY_MAX_HASH_TYPE 1
@@ -30,6 +31,7 @@
 
 struct crypt_device;
 struct crypt_params_verity;
+struct crypt_verity_range;
 struct device;
 
 int VERITY_read_sb(struct crypt_device *cd,
@@ -61,12 +63,52 @@ int VERITY_create(struct crypt_device *cd,
 		  const char *root_hash,
 		  size_t root_hash_size);
 
+int VERITY_update(struct crypt_device *cd,
+		  struct crypt_params_verity *verity_hdr,
+		  const struct crypt_verity_range *changed,
+		  size_t changed_count,
+		  char *root_hash,
+		  size_t root_hash_size);
+
+int VERITY_verify_hash_only(struct crypt_device *cd,
+		  struct crypt_params_verity *verity_hdr,
+		  const char *root_hash,
+		  size_t root_hash_size);
+
+int VERITY_verify_ranges(struct crypt_device *cd,
+		  struct crypt_params_verity *verity_hdr,
+		  const struct crypt_verity_range *ranges,
+		  size_t ranges_count,
+		  struct crypt_verity_range **bad_ranges,
+		  size_t *bad_ranges_count,
+		  const char *root_hash,
+		  size_t root_hash_size);
+
+int VERITY_verify_block(struct crypt_device *cd,
+		  struct crypt_params_verity *verity_hdr,
+		  const char *root_hash,
+		  size_t root_hash_size,
+		  bool hash_block,
+		  uint64_t block,
+		  const char *data,
+		  int (*read_hash_block)(void *usrptr, uint64_t block, char *buf),
+		  void *usrptr);
+
 int VERITY_FEC_process(struct crypt_device *cd,
 		      struct crypt_params_verity *params,
 		      struct device *fec_device,
 		      int check_fec,
 		      unsigned int *errors);
 
+int VERITY_FEC_repair(struct crypt_device *cd,
+		      struct crypt_params_verity *params,
+		      struct device *fec_device,
+		      const char *root_hash,
+		      size_t root_hash_size,
+		      unsigned int *errors,
+		      struct crypt_verity_range **repaired,
+		      size_t *repaired_count);
+
 uint64_t VERITY_hash_offset_block(struct crypt_params_verity *params);
 
 uint64_t VERITY_hash_blocks(struct crypt_device *cd, struct crypt_params_verity *params);
@@ -21,6 +21,7 @@
 
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "verity.h"
 #include "internal.h"
@@ -33,6 +34,10 @@
 
 #define FEC_INPUT_DEVICES 2
 
+#define FEC_THREADS_MAX 16
+#define FEC_THREAD_ROUNDS_MIN 4 /* RS rounds per thread */
+#define FEC_WINDOW_SIZE (16 * 1024 * 1024) /* RS input data per read window */
+
 /* parameters to init_rs_char */
 #define FEC_PARAMS(roots) \
     8,          /* symbol size in bits */ \
@@ -58,6 +63,7 @@ struct fec_context {
 	uint32_t block_size;
 	struct fec_input_device *inputs;
 	size_t ninputs;
+	int numa_node; /* node for additional threads, -1 if not bound */
 };
 
 /* computes ceil(x / y) */
@@ -73,50 +79,527 @@ static inline uint64_t FEC_interleave(struct fec_context *ctx, uint64_t offset)
 			(offset % ctx->rsn) * ctx->rounds * ctx->block_size;
 }
 
-/* returns data for a byte at the specified RS offset */
-static int FEC_read_interleaved(struct fec_context *ctx, uint64_t i,
-				void *output, size_t count)
+static int FEC_pio(int fd, void *buf, size_t length, uint64_t offset, bool wr)
 {
-	size_t n;
-	uint64_t offset = FEC_interleave(ctx, i);
+	ssize_t r;
+
+	while (length) {
+		if (wr)
+			r = pwrite(fd, buf, length, (off_t)offset);
+		else
+			r = pread(fd, buf, length, (off_t)offset);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		buf = (char *)buf + r;
+		length -= r;
+		offset += r;
+	}
 
-	/* offsets outside input area are assumed to contain zeros */
-	if (offset >= ctx->size) {
-		memset(output, 0, count);
-		return 0;
+	return 0;
+}
+
+/* reads input area at the specified offset, data after its end are zeros */
+static int FEC_read_input(struct fec_context *ctx, uint64_t offset,
+			  uint8_t *output, size_t count)
+{
+	size_t n, len;
+
+	for (n = 0; count && n < ctx->ninputs; ++n) {
+		if (offset >= ctx->inputs[n].count) {
+			offset -= ctx->inputs[n].count;
+			continue;
+		}
+
+		/* positioned read, devices are shared by all threads */
+		len = RS_MIN(count, ctx->inputs[n].count - offset);
+		if (FEC_pio(ctx->inputs[n].fd, output, len, ctx->inputs[n].start + offset, false))
+			return -1;
+		output += len;
+		count -= len;
+		offset = 0;
 	}
 
-	/* find the correct input device and read from it */
-	for (n = 0; n < ctx->ninputs; ++n) {
+	/* offsets outside input area are assumed to contain zeros */
+	memset(output, 0, count);
+	return 0;
+}
+
+/* writes repaired block back to input area, data after its end are skipped */
+static int FEC_write_input(struct fec_context *ctx, uint64_t offset,
+			   uint8_t *input, size_t count)
+{
+	size_t n, len;
+
+	for (n = 0; count && n < ctx->ninputs; ++n) {
 		if (offset >= ctx->inputs[n].count) {
 			offset -= ctx->inputs[n].count;
 			continue;
 		}
 
-		/* FIXME: read_lseek_blockwise candidate */
-		if (lseek(ctx->inputs[n].fd, ctx->inputs[n].start + offset, SEEK_SET) < 0)
+		len = RS_MIN(count, ctx->inputs[n].count - offset);
+		if (FEC_pio(ctx->inputs[n].fd, input, len, ctx->inputs[n].start + offset, true))
+			return -1;
+		input += len;
+		count -= len;
+		offset = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads input data for a window of rounds [round, round + count).
+ * Byte i of the round n RS blocks comes from block n of the i-th interleaved
+ * stripe, so the whole window is read stripe after stripe in the device
+ * order, one contiguous read per stripe. Block i of the round (round + k)
+ * is then at output[(i * count + k) * block_size].
+ */
+static int FEC_read_interleaved(struct fec_context *ctx, uint64_t round,
+				uint64_t count, uint8_t *output, unsigned int *stripe)
+{
+	size_t length = count * ctx->block_size;
+
+	for (*stripe = 0; *stripe < ctx->rsn; ++*stripe)
+		if (FEC_read_input(ctx, FEC_interleave(ctx, round * ctx->rsn * ctx->block_size + *stripe),
+				   &output[*stripe * length], length))
 			return -1;
-		return (read_buffer(ctx->inputs[n].fd, output, count) == (ssize_t)count) ? 0 : -1;
+
+	return 0;
+}
+
+/*
+ * RS rounds are independent, every thread processes a contiguous range
+ * of rounds in windows. Parity of the window is read or written in one chunk
+ * at its final position.
+ */
+enum fec_job_err { FEC_ERR_NONE = 0, FEC_ERR_READ, FEC_ERR_READ_PARITY,
+		   FEC_ERR_REPAIR, FEC_ERR_WRITE_PARITY };
+
+/* corrected input block or parity of RS round, written only after verification */
+struct fec_block {
+	uint64_t n;
+	uint8_t *data;
+};
+
+struct fec_blocks {
+	struct fec_block *b;
+	size_t count, size;
+};
+
+struct fec_job {
+	struct fec_context *ctx;
+	struct rs *rs;
+	int fd, decode, repair;
+	uint64_t parity_offset;
+	uint64_t first, last; /* rounds [first, last) */
+	unsigned int errors;
+	struct crypt_verity_range *repaired; /* repaired input blocks */
+	size_t repaired_count, repaired_size;
+	struct fec_blocks fixes, parity_fixes;
+	enum fec_job_err err;
+	uint64_t err_round;
+	unsigned int err_byte;
+	int r;
+	pthread_t thread;
+};
+
+static int FEC_job_fail(struct fec_job *job, enum fec_job_err err,
+			uint64_t round, unsigned int byte, int r)
+{
+	job->err = err;
+	job->err_round = round;
+	job->err_byte = byte;
+	return r;
+}
+
+/* Append repaired input block, merge it with the last range if adjacent */
+static int FEC_job_repaired(struct fec_job *job, uint64_t block)
+{
+	struct crypt_verity_range *tail = job->repaired_count ?
+		&job->repaired[job->repaired_count - 1] : NULL;
+	void *r;
+
+	if (tail && tail->offset + tail->length == block) {
+		tail->length++;
+		return 0;
+	}
+
+	if (job->repaired_count == job->repaired_size) {
+		r = realloc(job->repaired, (job->repaired_size ? 2 * job->repaired_size : 16) *
+			    sizeof(*job->repaired));
+		if (!r)
+			return -ENOMEM;
+		job->repaired = r;
+		job->repaired_size = job->repaired_size ? 2 * job->repaired_size : 16;
 	}
 
-	/* should never be reached */
-	return -1;
+	job->repaired[job->repaired_count].offset = block;
+	job->repaired[job->repaired_count++].length = 1;
+	return 0;
+}
+
+static int FEC_blocks_add(struct fec_blocks *list, uint64_t n,
+			  const uint8_t *data, size_t length)
+{
+	void *r;
+
+	if (list->count == list->size) {
+		r = realloc(list->b, (list->size ? 2 * list->size : 16) * sizeof(*list->b));
+		if (!r)
+			return -ENOMEM;
+		list->b = r;
+		list->size = list->size ? 2 * list->size : 16;
+	}
+
+	list->b[list->count].data = malloc(length);
+	if (!list->b[list->count].data)
+		return -ENOMEM;
+	memcpy(list->b[list->count].data, data, length);
+	list->b[list->count++].n = n;
+	return 0;
+}
+
+static void FEC_blocks_free(struct fec_blocks *list)
+{
+	size_t i;
+
+	for (i = 0; i < list->count; i++)
+		free(list->b[i].data);
+	free(list->b);
+	memset(list, 0, sizeof(*list));
+}
+
+/*
+ * Keep blocks of round that were corrected by decoder. Block i of
+ * the round is input block (i * rounds + round), see FEC_read_interleaved().
+ * Nothing is written until all corrected blocks are checked against hash tree.
+ */
+static int FEC_job_keep_round(struct fec_job *job, uint64_t round, uint8_t *data,
+			      size_t stride, uint8_t *parity, const bool *changed)
+{
+	struct fec_context *ctx = job->ctx;
+	uint64_t block;
+	unsigned int i;
+	int r;
+
+	for (i = 0; i < ctx->rsn; i++) {
+		if (!changed[i])
+			continue;
+		block = i * ctx->rounds + round;
+		/* corrected padding after input area means miscorrection */
+		if (block >= ctx->blocks)
+			return FEC_job_fail(job, FEC_ERR_REPAIR, round, 0, -EPERM);
+		if ((r = FEC_blocks_add(&job->fixes, block, &data[i * stride], ctx->block_size)) ||
+		    (r = FEC_job_repaired(job, block)))
+			return r;
+	}
+
+	if (changed[ctx->rsn])
+		return FEC_blocks_add(&job->parity_fixes, round, parity,
+				      (size_t)ctx->block_size * ctx->roots);
+
+	return 0;
+}
+
+static int FEC_job_process(struct fec_job *job)
+{
+	struct fec_context *ctx = job->ctx;
+	size_t parity_size = (size_t)ctx->block_size * ctx->roots;
+	uint8_t rs_block[FEC_RSM];
+	uint8_t *buf, *parity, *p, *data;
+	bool changed[FEC_MAX_RSN + 1]; /* data blocks of round and parity */
+	uint64_t n, k, count, chunk;
+	size_t stride;
+	unsigned int i;
+	uint32_t b;
+	int r = 0;
+
+	/* rounds per window */
+	chunk = FEC_WINDOW_SIZE / ((size_t)ctx->block_size * ctx->rsn);
+	if (!chunk)
+		chunk = 1;
+	if (chunk > job->last - job->first)
+		chunk = job->last - job->first;
+
+	buf = malloc(chunk * ctx->block_size * ctx->rsn);
+	parity = malloc(chunk * parity_size);
+	if (!buf || !parity) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	for (n = job->first; n < job->last; n += count) {
+		count = job->last - n;
+		if (count > chunk)
+			count = chunk;
+
+		/* decoding from parity device */
+		if (job->decode && FEC_pio(job->fd, parity, count * parity_size,
+					   job->parity_offset + n * parity_size, false)) {
+			r = FEC_job_fail(job, FEC_ERR_READ_PARITY, n, 0, -EIO);
+			goto out;
+		}
+
+		if (FEC_read_interleaved(ctx, n, count, buf, &i)) {
+			r = FEC_job_fail(job, FEC_ERR_READ, n, i, -EIO);
+			goto out;
+		}
+
+		/* blocks of one round are count blocks apart in the window */
+		stride = count * ctx->block_size;
+		for (k = 0; k < count; k++) {
+			data = &buf[k * ctx->block_size];
+			p = &parity[k * parity_size];
+
+			/* encoding parity data for all block bytes at once */
+			if (!job->decode) {
+				encode_rs_char_columns(job->rs, data, stride, ctx->block_size, p);
+				continue;
+			}
+
+			memset(changed, 0, sizeof(changed));
+			for (b = 0; b < ctx->block_size; ++b) {
+				for (i = 0; i < ctx->rsn; ++i)
+					rs_block[i] = data[i * stride + b];
+				memcpy(&rs_block[ctx->rsn], &p[b * ctx->roots], ctx->roots);
+
+				/* coverity[tainted_data] */
+				r = decode_rs_char(job->rs, rs_block);
+				if (r < 0) {
+					r = FEC_job_fail(job, FEC_ERR_REPAIR, n + k, 0, -EPERM);
+					goto out;
+				}
+				/* return number of detected errors */
+				job->errors += r;
+
+				/* keep corrected bytes in window, parity is the last "block" */
+				for (i = 0; r && job->repair && i < ctx->rsn; ++i)
+					if (rs_block[i] != data[i * stride + b]) {
+						data[i * stride + b] = rs_block[i];
+						changed[i] = true;
+					}
+				if (r && job->repair && memcmp(&rs_block[ctx->rsn], &p[b * ctx->roots], ctx->roots)) {
+					memcpy(&p[b * ctx->roots], &rs_block[ctx->rsn], ctx->roots);
+					changed[ctx->rsn] = true;
+				}
+				r = 0;
+			}
+
+			if (job->repair && (r = FEC_job_keep_round(job, n + k, data, stride, p, changed)))
+				goto out;
+		}
+
+		/* writing parity data to fec device */
+		if (!job->decode && FEC_pio(job->fd, parity, count * parity_size,
+					    job->parity_offset + n * parity_size, true)) {
+			r = FEC_job_fail(job, FEC_ERR_WRITE_PARITY, n, 0, -EIO);
+			goto out;
+		}
+	}
+out:
+	free(parity);
+	free(buf);
+	return r;
+}
+
+static void *FEC_job_run(void *arg)
+{
+	struct fec_job *job = arg;
+
+	job->r = FEC_job_process(job);
+	return NULL;
+}
+
+static void *FEC_job_thread(void *arg)
+{
+	struct fec_job *job = arg;
+
+	crypt_numa_bind_thread(job->ctx->numa_node);
+
+	return FEC_job_run(arg);
+}
+
+static int FEC_range_cmp(const void *a, const void *b)
+{
+	const struct crypt_verity_range *r1 = a, *r2 = b;
+
+	if (r1->offset == r2->offset)
+		return 0;
+	return r1->offset < r2->offset ? -1 : 1;
+}
+
+/* Sorted and merged list of repaired blocks from all jobs */
+static int FEC_collect_repaired(struct fec_job *jobs, unsigned int jobs_count,
+				struct crypt_verity_range **repaired, size_t *repaired_count)
+{
+	struct crypt_verity_range *list;
+	size_t count = 0, i, j;
+	unsigned int n;
+
+	*repaired = NULL;
+	*repaired_count = 0;
+
+	for (n = 0; n < jobs_count; n++)
+		count += jobs[n].repaired_count;
+	if (!count)
+		return 0;
+
+	list = malloc(count * sizeof(*list));
+	if (!list)
+		return -ENOMEM;
+
+	for (n = 0, i = 0; n < jobs_count; n++) {
+		memcpy(&list[i], jobs[n].repaired, jobs[n].repaired_count * sizeof(*list));
+		i += jobs[n].repaired_count;
+	}
+
+	qsort(list, count, sizeof(*list), FEC_range_cmp);
+	for (i = 0, j = 0; i < count; i++) {
+		if (j && list[i].offset <= list[j - 1].offset + list[j - 1].length) {
+			if (list[i].offset + list[i].length > list[j - 1].offset + list[j - 1].length)
+				list[j - 1].length = list[i].offset + list[i].length - list[j - 1].offset;
+		} else
+			list[j++] = list[i];
+	}
+
+	*repaired = list;
+	*repaired_count = j;
+	return 0;
+}
+
+static int FEC_block_cmp(const void *a, const void *b)
+{
+	const struct fec_block *b1 = a, *b2 = b;
+
+	if (b1->n == b2->n)
+		return 0;
+	return b1->n < b2->n ? -1 : 1;
+}
+
+struct fec_verify_ctx {
+	struct fec_context *ctx;
+	struct crypt_params_verity *params;
+	struct fec_block *fixes;
+	size_t fixes_count;
+	uint64_t hash_offset;
+};
+
+/* Hash block from hash device, or its corrected version if it was repaired */
+static int FEC_read_hash_block(void *usrptr, uint64_t block, char *buf)
+{
+	struct fec_verify_ctx *vctx = usrptr;
+	struct fec_block key, *fix = NULL;
+
+	if (block >= vctx->hash_offset) {
+		key.n = vctx->params->data_size + block - vctx->hash_offset;
+		fix = bsearch(&key, vctx->fixes, vctx->fixes_count, sizeof(key), FEC_block_cmp);
+	}
+
+	if (fix) {
+		memcpy(buf, fix->data, vctx->ctx->block_size);
+		return 0;
+	}
+
+	return FEC_pio(vctx->ctx->inputs[1].fd, buf, vctx->ctx->block_size,
+		       block * vctx->ctx->block_size, false) ? -EIO : 0;
+}
+
+/*
+ * Every corrected data and hash block must match the hash tree (with other
+ * corrections applied) before anything is written, so a miscorrection
+ * cannot overwrite valid data. Parity is written only after all blocks.
+ */
+static int FEC_repair_commit(struct crypt_device *cd,
+			     struct crypt_params_verity *params,
+			     struct fec_context *ctx, int fd, uint64_t parity_offset,
+			     struct fec_job *jobs, unsigned int jobs_count,
+			     const char *root_hash, size_t root_hash_size)
+{
+	struct fec_verify_ctx vctx = {
+		.ctx = ctx,
+		.params = params,
+		.hash_offset = VERITY_hash_offset_block(params)
+	};
+	size_t parity_size = (size_t)ctx->block_size * ctx->roots;
+	struct fec_block *fix;
+	size_t count = 0, i;
+	unsigned int n;
+	int r = 0;
+
+	for (n = 0; n < jobs_count; n++)
+		count += jobs[n].fixes.count;
+
+	if (count && !(vctx.fixes = malloc(count * sizeof(*vctx.fixes))))
+		return -ENOMEM;
+
+	for (n = 0; n < jobs_count; n++) {
+		memcpy(&vctx.fixes[vctx.fixes_count], jobs[n].fixes.b,
+		       jobs[n].fixes.count * sizeof(*vctx.fixes));
+		vctx.fixes_count += jobs[n].fixes.count;
+	}
+	if (count)
+		qsort(vctx.fixes, vctx.fixes_count, sizeof(*vctx.fixes), FEC_block_cmp);
+
+	for (i = 0; i < vctx.fixes_count && !r; i++) {
+		fix = &vctx.fixes[i];
+		if (fix->n < params->data_size)
+			r = VERITY_verify_block(cd, params, root_hash, root_hash_size, false,
+						fix->n, (const char *)fix->data,
+						FEC_read_hash_block, &vctx);
+		else
+			r = VERITY_verify_block(cd, params, root_hash, root_hash_size, true,
+						vctx.hash_offset + fix->n - params->data_size,
+						(const char *)fix->data, FEC_read_hash_block, &vctx);
+		if (r == -ERANGE)
+			log_err(cd, _("Repaired block %" PRIu64 " is not covered by hash tree, "
+				"device was not modified."), fix->n);
+		else if (r)
+			log_err(cd, _("Repaired block %" PRIu64 " does not match hash tree, "
+				"device was not modified."), fix->n);
+	}
+
+	if (r) {
+		r = -EPERM;
+		goto out;
+	}
+
+	for (i = 0; i < vctx.fixes_count && !r; i++)
+		if (FEC_write_input(ctx, vctx.fixes[i].n * ctx->block_size,
+				    vctx.fixes[i].data, ctx->block_size)) {
+			log_err(cd, _("Failed to write repaired block %" PRIu64 "."), vctx.fixes[i].n);
+			r = -EIO;
+		}
+
+	for (n = 0; n < jobs_count && !r; n++)
+		for (i = 0; i < jobs[n].parity_fixes.count && !r; i++) {
+			fix = &jobs[n].parity_fixes.b[i];
+			if (FEC_pio(fd, fix->data, parity_size, parity_offset + fix->n * parity_size, true)) {
+				log_err(cd, _("Failed to write parity for RS block %" PRIu64 "."), fix->n);
+				r = -EIO;
+			}
+		}
+out:
+	free(vctx.fixes);
+	return r;
 }
 
 /* encodes/decode inputs to/from fd */
 static int FEC_process_inputs(struct crypt_device *cd,
 			      struct crypt_params_verity *params,
 			      struct fec_input_device *inputs,
-			      size_t ninputs, int fd,
-			      int decode, unsigned int *errors)
+			      size_t ninputs, int fd, uint64_t parity_offset,
+			      int decode, int repair, const char *root_hash, size_t root_hash_size,
+			      unsigned int *errors,
+			      struct crypt_verity_range **repaired, size_t *repaired_count)
 {
 	int r = 0;
-	unsigned int i;
+	unsigned int i, jobs_count;
 	struct fec_context ctx;
-	uint32_t b;
-	uint64_t n;
-	uint8_t rs_block[FEC_RSM];
-	uint8_t *buf = NULL;
+	struct fec_job jobs[FEC_THREADS_MAX];
+	bool started[FEC_THREADS_MAX] = {};
+	uint64_t n, stripe;
 	void *rs;
 
 	/* initialize parameters */
@@ -125,6 +608,7 @@ static int FEC_process_inputs(struct crypt_device *cd,
 	ctx.block_size = params->data_block_size;
 	ctx.inputs = inputs;
 	ctx.ninputs = ninputs;
+	ctx.numa_node = crypt_numa_node(cd, inputs[0].device);
 
 	rs = init_rs_char(FEC_PARAMS(ctx.roots));
 	if (!rs) {
@@ -144,69 +628,97 @@ static int FEC_process_inputs(struct crypt_device *cd,
 	ctx.blocks = FEC_div_round_up(ctx.size, ctx.block_size);
 	ctx.rounds = FEC_div_round_up(ctx.blocks, ctx.rsn);
 
-	buf = malloc((size_t)ctx.block_size * ctx.rsn);
-	if (!buf) {
-		log_err(cd, _("Failed to allocate buffer."));
-		r = -ENOMEM;
-		goto out;
+	jobs_count = crypt_numa_cpus(ctx.numa_node);
+	if (jobs_count > FEC_THREADS_MAX)
+		jobs_count = FEC_THREADS_MAX;
+	if (jobs_count > ctx.rounds / FEC_THREAD_ROUNDS_MIN)
+		jobs_count = ctx.rounds / FEC_THREAD_ROUNDS_MIN;
+	if (!jobs_count)
+		jobs_count = 1;
+
+	stripe = FEC_div_round_up(ctx.rounds, jobs_count);
+	for (i = 0, n = 0; i < jobs_count && n < ctx.rounds; i++, n += stripe) {
+		memset(&jobs[i], 0, sizeof(jobs[i]));
+		jobs[i].ctx = &ctx;
+		jobs[i].rs = rs;
+		jobs[i].fd = fd;
+		jobs[i].decode = decode;
+		jobs[i].repair = repair;
+		jobs[i].parity_offset = parity_offset;
+		jobs[i].first = n;
+		jobs[i].last = (ctx.rounds - n) < stripe ? ctx.rounds : n + stripe;
 	}
+	jobs_count = i;
 
-	/* encode/decode input */
-	for (n = 0; n < ctx.rounds; ++n) {
-		for (i = 0; i < ctx.rsn; ++i) {
-			if (FEC_read_interleaved(&ctx, n * ctx.rsn * ctx.block_size + i,
-						 &buf[i * ctx.block_size], ctx.block_size)) {
-				log_err(cd, _("Failed to read RS block %" PRIu64 " byte %d."), n, i);
-				r = -EIO;
-				goto out;
-			}
-		}
+	log_dbg(cd, "Processing %" PRIu64 " RS rounds in %u threads.", ctx.rounds, jobs_count);
 
-		for (b = 0; b < ctx.block_size; ++b) {
-			for (i = 0; i < ctx.rsn; ++i)
-				rs_block[i] = buf[i * ctx.block_size + b];
+	/* The first range is processed by the calling thread */
+	for (i = 1; i < jobs_count; i++)
+		started[i] = !pthread_create(&jobs[i].thread, NULL, FEC_job_thread, &jobs[i]);
 
-			/* decoding from parity device */
-			if (decode) {
-				if (read_buffer(fd, &rs_block[ctx.rsn], ctx.roots) < 0) {
-					log_err(cd, _("Failed to read parity for RS block %" PRIu64 "."), n);
-					r = -EIO;
-					goto out;
-				}
+	FEC_job_run(&jobs[0]);
 
-				/* coverity[tainted_data] */
-				r = decode_rs_char(rs, rs_block);
-				if (r < 0) {
-					log_err(cd, _("Failed to repair parity for block %" PRIu64 "."), n);
-					r = -EPERM;
-					goto out;
-				}
-				/* return number of detected errors */
-				if (errors)
-					*errors += r;
-				r = 0;
-			} else {
-				/* encoding and writing parity data to fec device */
-				encode_rs_char(rs, rs_block, &rs_block[ctx.rsn]);
-				if (write_buffer(fd, &rs_block[ctx.rsn], ctx.roots) < 0) {
-					log_err(cd, _("Failed to write parity for RS block %" PRIu64 "."), n);
-					r = -EIO;
-					goto out;
-				}
-			}
+	for (i = 1; i < jobs_count; i++) {
+		if (started[i])
+			pthread_join(jobs[i].thread, NULL);
+		else
+			FEC_job_run(&jobs[i]);
+	}
+
+	/* Report the first failure in the device order */
+	for (i = 0; i < jobs_count && !r; i++) {
+		r = jobs[i].r;
+		switch (jobs[i].err) {
+		case FEC_ERR_READ:
+			log_err(cd, _("Failed to read RS block %" PRIu64 " byte %d."),
+				jobs[i].err_round, jobs[i].err_byte);
+			break;
+		case FEC_ERR_READ_PARITY:
+			log_err(cd, _("Failed to read parity for RS block %" PRIu64 "."),
+				jobs[i].err_round);
+			break;
+		case FEC_ERR_REPAIR:
+			log_err(cd, _("Failed to repair parity for block %" PRIu64 "."),
+				jobs[i].err_round);
+			break;
+		case FEC_ERR_WRITE_PARITY:
+			log_err(cd, _("Failed to write parity for RS block %" PRIu64 "."),
+				jobs[i].err_round);
+			break;
+		default:
+			if (r == -ENOMEM)
+				log_err(cd, _("Failed to allocate buffer."));
+			break;
 		}
+		if (!r && errors)
+			*errors += jobs[i].errors;
 	}
-out:
+
+	if (!r && repair)
+		r = FEC_repair_commit(cd, params, &ctx, fd, parity_offset, jobs, jobs_count,
+				      root_hash, root_hash_size);
+
+	if (!r && repaired)
+		r = FEC_collect_repaired(jobs, jobs_count, repaired, repaired_count);
+
+	for (i = 0; i < jobs_count; i++) {
+		free(jobs[i].repaired);
+		FEC_blocks_free(&jobs[i].fixes);
+		FEC_blocks_free(&jobs[i].parity_fixes);
+	}
+
 	free_rs_char(rs);
-	free(buf);
 	return r;
 }
 
-int VERITY_FEC_process(struct crypt_device *cd,
-		      struct crypt_params_verity *params,
-		      struct device *fec_device, int check_fec,
-		      unsigned int *errors)
+static int FEC_process(struct crypt_device *cd,
+		       struct crypt_params_verity *params,
+		       struct device *fec_device, int check_fec, int repair,
+		       const char *root_hash, size_t root_hash_size,
+		       unsigned int *errors,
+		       struct crypt_verity_range **repaired, size_t *repaired_count)
 {
+	int flags = repair ? O_RDWR : O_RDONLY;
 	int r = -EIO, fd = -1;
 	size_t ninputs = FEC_INPUT_DEVICES;
 	struct fec_input_device inputs[FEC_INPUT_DEVICES] = {
@@ -242,7 +754,7 @@ int VERITY_FEC_process(struct crypt_device *cd,
 	if (!inputs[1].count)
 		ninputs--;
 
-	if (check_fec)
+	if (check_fec && !repair)
 		fd = open(device_path(fec_device), O_RDONLY);
 	else
 		fd = open(device_path(fec_device), O_RDWR);
@@ -252,24 +764,23 @@ int VERITY_FEC_process(struct crypt_device *cd,
 		goto out;
 	}
 
-	if (lseek(fd, params->fec_area_offset, SEEK_SET) < 0) {
-		log_dbg(cd, "Cannot seek to requested position in FEC device.");
-		goto out;
-	}
-
 	/* input devices */
-	inputs[0].fd = open(device_path(inputs[0].device), O_RDONLY);
+	inputs[0].fd = open(device_path(inputs[0].device), flags);
 	if (inputs[0].fd == -1) {
 		log_err(cd, _("Cannot open device %s."), device_path(inputs[0].device));
 		goto out;
 	}
-	inputs[1].fd = open(device_path(inputs[1].device), O_RDONLY);
+	inputs[1].fd = open(device_path(inputs[1].device), flags);
 	if (inputs[1].fd == -1) {
 		log_err(cd, _("Cannot open device %s."), device_path(inputs[1].device));
 		goto out;
 	}
 
-	r = FEC_process_inputs(cd, params, inputs, ninputs, fd, check_fec, errors);
+	r = FEC_process_inputs(cd, params, inputs, ninputs, fd, params->fec_area_offset,
+			       check_fec, repair, root_hash, root_hash_size,
+			       errors, repaired, repaired_count);
+	if (!r && repair && (fsync(inputs[0].fd) || fsync(inputs[1].fd) || fsync(fd)))
+		r = -EIO;
 out:
 	if (inputs[0].fd != -1)
 		close(inputs[0].fd);
@@ -281,6 +792,31 @@ out:
 	return r;
 }
 
+int VERITY_FEC_process(struct crypt_device *cd,
+		      struct crypt_params_verity *params,
+		      struct device *fec_device, int check_fec,
+		      unsigned int *errors)
+{
+	return FEC_process(cd, params, fec_device, check_fec, 0, NULL, 0, errors, NULL, NULL);
+}
+
+/*
+ * Decode all RS blocks and write corrected blocks back to data, hash and FEC
+ * devices, only if all corrected blocks match the hash tree.
+ */
+int VERITY_FEC_repair(struct crypt_device *cd,
+		      struct crypt_params_verity *params,
+		      struct device *fec_device,
+		      const char *root_hash,
+		      size_t root_hash_size,
+		      unsigned int *errors,
+		      struct crypt_verity_range **repaired,
+		      size_t *repaired_count)
+{
+	return FEC_process(cd, params, fec_device, 1, 1, root_hash, root_hash_size,
+			   errors, repaired, repaired_count);
+}
+
 uint64_t VERITY_FEC_blocks(struct crypt_device *cd,
 			   struct device *fec_device,
 			   struct crypt_params_verity *params)
@@ -23,6 +23,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "verity.h"
 #include "internal.h"
@@ -30,6 +33,11 @@
 #define VERITY_MAX_LEVELS	63
 #define VERITY_MAX_DIGEST_SIZE	1024
 
+#define VERITY_THREADS_MAX	16
+#define VERITY_THREAD_BLOCKS_MIN 64 /* hash blocks per thread */
+#define VERITY_IO_CHUNK		(4 * 1024 * 1024)
+#define VERITY_DIGESTS_MEM_MAX	(64 * 1024 * 1024) /* level digests kept in memory */
+
 static unsigned get_bits_up(size_t u)
 {
 	unsigned i = 0;
@@ -46,34 +54,6 @@ static unsigned get_bits_down(size_t u)
 	return i;
 }
 
-static int verify_zero(struct crypt_device *cd, FILE *wr, size_t bytes)
-{
-	char *block = NULL;
-	size_t i;
-	int r;
-
-	block = malloc(bytes);
-	if (!block)
-		return -ENOMEM;
-
-	if (fread(block, bytes, 1, wr) != 1) {
-		log_dbg(cd, "EIO while reading spare area.");
-		r = -EIO;
-		goto out;
-	}
-	for (i = 0; i < bytes; i++)
-		if (block[i]) {
-			log_err(cd, _("Spare area is not zeroed at position %" PRIu64 "."),
-				ftello(wr) - bytes);
-			r = -EPERM;
-			goto out;
-		}
-	r = 0;
-out:
-	free(block);
-	return r;
-}
-
 static int verify_hash_block(const char *hash_name, int version,
 			      char *hash, size_t hash_size,
 			      const char *data, size_t data_size,
@@ -141,25 +121,584 @@ static int hash_levels(size_t hash_block_size, size_t digest_size,
 	return 0;
 }
 
+/*
+ * Construction of one hash level. Each thread processes a contiguous range
+ * of hash blocks; hash blocks are assembled in memory (including version
+ * dependent padding) and written (or compared) at their final position.
+ * Devices are accessed in large chunks, bypassing stdio buffering.
+ */
+/* Range of blocks [first, last) */
+struct verity_range {
+	uint64_t first, last;
+};
+
+/* Growing list of block ranges */
+struct verity_ranges {
+	struct verity_range *r;
+	size_t count, size;
+};
+
+enum verity_job_err { VERITY_ERR_NONE = 0, VERITY_ERR_READ, VERITY_ERR_WRITE,
+		      VERITY_ERR_HASH, VERITY_ERR_DIGEST, VERITY_ERR_SPARE };
+
+struct verity_level {
+	int rd_fd, wr_fd;
+	uint64_t seek_rd, seek_wr;
+	size_t data_block_size, hash_block_size;
+	size_t hash_per_block, digest_size, digest_size_full;
+	uint64_t blocks;
+	int version, verify;
+	int collect; /* record corrupted blocks instead of failing */
+	const char *hash_name;
+	const char *salt;
+	size_t salt_size;
+	int numa_node; /* node for additional threads, -1 if not bound */
+	/*
+	 * Input block of an all-zero subtree (zero data block on level 0) and
+	 * its digest, these blocks are not hashed. NULL if not used.
+	 */
+	const char *zero_block;
+	const char *zero_digest;
+	uint64_t holes_end; /* holes of sparse input file below this offset are not read */
+	/*
+	 * Digests of level input blocks kept in memory from the previous level
+	 * (input is not read), and output for digests of produced hash blocks.
+	 */
+	const char *in_digests;
+	char *out_digests;
+};
+
+struct verity_job {
+	const struct verity_level *l;
+	const struct verity_range *ranges; /* hash blocks to process */
+	size_t ranges_count;
+	enum verity_job_err err;
+	uint64_t err_position;
+	struct verity_ranges bad; /* corrupted input blocks (collect mode) */
+	int r;
+	pthread_t thread;
+};
+
+static int verity_pio(int fd, void *buf, size_t length, uint64_t offset, bool wr)
+{
+	ssize_t r;
+
+	while (length) {
+		if (wr)
+			r = pwrite(fd, buf, length, (off_t)offset);
+		else
+			r = pread(fd, buf, length, (off_t)offset);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -EIO;
+		buf = (char *)buf + r;
+		length -= r;
+		offset += r;
+	}
+
+	return 0;
+}
+
+static int verity_job_fail(struct verity_job *job, enum verity_job_err err,
+			   uint64_t position, int r)
+{
+	job->err = err;
+	job->err_position = position;
+	return r;
+}
+
+/* Append range, merge it with the last one if they overlap or are adjacent */
+static int verity_ranges_add(struct verity_ranges *list, uint64_t first, uint64_t last)
+{
+	struct verity_range *tail = list->count ? &list->r[list->count - 1] : NULL;
+	void *r;
+
+	if (tail && first <= tail->last && last >= tail->first) {
+		if (first < tail->first)
+			tail->first = first;
+		if (last > tail->last)
+			tail->last = last;
+		return 0;
+	}
+
+	if (list->count == list->size) {
+		r = realloc(list->r, (list->size ? 2 * list->size : 16) * sizeof(*list->r));
+		if (!r)
+			return -ENOMEM;
+		list->r = r;
+		list->size = list->size ? 2 * list->size : 16;
+	}
+
+	list->r[list->count].first = first;
+	list->r[list->count].last = last;
+	list->count++;
+	return 0;
+}
+
+/* Input blocks [first, last) of the level do not match, fail or record them */
+static int verity_job_corrupted(struct verity_job *job, enum verity_job_err err,
+				uint64_t position, uint64_t first, uint64_t last)
+{
+	if (!job->l->collect)
+		return verity_job_fail(job, err, position, -EPERM);
+
+	return verity_ranges_add(&job->bad, first, last);
+}
+
+static bool verity_is_zero(const char *buf, size_t length)
+{
+	while (length--)
+		if (*buf++)
+			return false;
+	return true;
+}
+
+/*
+ * Read n input blocks at position and mark blocks of an all-zero subtree.
+ * Holes of sparse input file are not read at all.
+ */
+static int verity_read_blocks(const struct verity_level *l, char *data, bool *zero,
+			      uint64_t n, uint64_t position)
+{
+	size_t bs = l->data_block_size;
+	uint64_t i, first, last, end;
+	off_t off;
+
+	if (!l->zero_block)
+		return verity_pio(l->rd_fd, data, n * bs, position, false);
+
+	for (first = 0; first < n; first = last) {
+		last = n;
+		if (position + first * bs < l->holes_end) {
+			end = l->holes_end < position + n * bs ? l->holes_end : position + n * bs;
+
+			/* blocks entirely in the hole are zero */
+			off = lseek(l->rd_fd, position + first * bs, SEEK_DATA);
+			if (off < 0 || (uint64_t)off > end)
+				off = (off < 0 && errno != ENXIO) ? (off_t)(position + first * bs) : (off_t)end;
+			for (i = (off - position) / bs; first < i && first < n; first++)
+				zero[first] = true;
+			if (first == n)
+				break;
+
+			/* read only up to the next hole */
+			off = lseek(l->rd_fd, position + first * bs, SEEK_HOLE);
+			if (off >= 0 && (uint64_t)off < position + n * bs) {
+				last = (off - position + bs - 1) / bs;
+				if (last <= first)
+					last = first + 1;
+			}
+		}
+
+		if (verity_pio(l->rd_fd, &data[first * bs], (last - first) * bs,
+			       position + first * bs, false))
+			return -EIO;
+
+		for (i = first; i < last; i++)
+			zero[i] = !memcmp(&data[i * bs], l->zero_block, bs);
+	}
+
+	return 0;
+}
+
+/* Compare one on-disk hash block, in the same order as the hash block is built */
+static int verity_job_compare(struct verity_job *job, const char *read_block,
+			      const char *hash_block, uint64_t n,
+			      uint64_t data_blk, uint64_t position)
+{
+	const struct verity_level *l = job->l;
+	size_t stride = l->version ? l->digest_size_full : l->digest_size;
+	uint64_t i;
+	int r;
+
+	/* Non-zero spare area means the whole hash block is corrupted */
+	for (i = 0; i < n; i++) {
+		if (memcmp(&read_block[i * stride], &hash_block[i * stride], l->digest_size) &&
+		    (r = verity_job_corrupted(job, VERITY_ERR_DIGEST, l->seek_rd +
+				(data_blk + i) * l->data_block_size, data_blk + i, data_blk + i + 1)))
+			return r;
+		if (stride > l->digest_size &&
+		    !verity_is_zero(&read_block[i * stride + l->digest_size],
+				    stride - l->digest_size))
+			return verity_job_corrupted(job, VERITY_ERR_SPARE,
+				position + i * stride + l->digest_size, data_blk, data_blk + n);
+	}
+	if (!verity_is_zero(&read_block[n * stride], l->hash_block_size - n * stride))
+		return verity_job_corrupted(job, VERITY_ERR_SPARE, position + n * stride,
+					    data_blk, data_blk + n);
+
+	return 0;
+}
+
+/* Read n input blocks starting at data_blk and build their hash blocks */
+static int verity_job_hash(struct verity_job *job, char *data, bool *zero,
+			   char *hash_blocks, uint64_t data_blk, uint64_t n)
+{
+	const struct verity_level *l = job->l;
+	size_t stride = l->version ? l->digest_size_full : l->digest_size;
+	uint64_t i, j, k, limit, position;
+	char *dst;
+
+	position = l->seek_rd + data_blk * l->data_block_size;
+	if (verity_read_blocks(l, data, zero, n, position))
+		return verity_job_fail(job, VERITY_ERR_READ, position, -EIO);
+
+	/*
+	 * Hash runs of blocks within one hash block, digests of zero
+	 * subtree blocks are copied. Salt is prepended in version 1,
+	 * appended in version 0.
+	 */
+	memset(hash_blocks, 0, ((n + l->hash_per_block - 1) / l->hash_per_block) * l->hash_block_size);
+	for (i = 0; i < n; i = j) {
+		limit = (i / l->hash_per_block + 1) * l->hash_per_block;
+		if (limit > n)
+			limit = n;
+		for (j = i + 1; zero && j < limit && zero[j] == zero[i]; j++);
+		if (!zero)
+			j = limit;
+
+		dst = &hash_blocks[(i / l->hash_per_block) * l->hash_block_size +
+				   (i % l->hash_per_block) * stride];
+		if (zero && zero[i]) {
+			for (k = i; k < j; k++)
+				memcpy(&dst[(k - i) * stride], l->zero_digest, l->digest_size);
+			continue;
+		}
+
+		if (crypt_hash_blocks(l->hash_name,
+				l->version == 1 ? l->salt : NULL, l->version == 1 ? l->salt_size : 0,
+				l->version == 0 ? l->salt : NULL, l->version == 0 ? l->salt_size : 0,
+				&data[i * l->data_block_size], l->data_block_size, j - i,
+				dst, stride, l->digest_size))
+			return verity_job_fail(job, VERITY_ERR_HASH, 0, -EINVAL);
+	}
+
+	/* Data are read only once, do not keep them in page cache */
+	posix_fadvise(l->rd_fd, position, n * l->data_block_size, POSIX_FADV_DONTNEED);
+
+	return 0;
+}
+
+/* Process hash blocks [first, last) */
+static int verity_job_process_range(struct verity_job *job, uint64_t first, uint64_t last)
+{
+	const struct verity_level *l = job->l;
+	size_t stride = l->version ? l->digest_size_full : l->digest_size;
+	size_t chunk_data_size = l->hash_per_block * l->data_block_size;
+	char *data = NULL, *hash_blocks, *read_blocks = NULL;
+	uint64_t b, k, chunk, count, data_blk, n, i, position;
+	bool *zero = NULL;
+	int r = 0;
+
+	/* Transfer several hash blocks (and all their data blocks) at once */
+	chunk = VERITY_IO_CHUNK / chunk_data_size;
+	if (!chunk)
+		chunk = 1;
+	if (chunk > last - first)
+		chunk = last - first;
+
+	if (!l->in_digests)
+		data = malloc(chunk * chunk_data_size);
+	hash_blocks = malloc(chunk * l->hash_block_size);
+	if (l->verify)
+		read_blocks = malloc(chunk * l->hash_block_size);
+	if (l->zero_block && !l->in_digests)
+		zero = malloc(chunk * l->hash_per_block * sizeof(*zero));
+	if ((!l->in_digests && !data) || !hash_blocks || (l->verify && !read_blocks) ||
+	    (l->zero_block && !l->in_digests && !zero)) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	if (!l->in_digests)
+		posix_fadvise(l->rd_fd, l->seek_rd + first * chunk_data_size,
+			      (last - first) * chunk_data_size, POSIX_FADV_SEQUENTIAL);
+
+	for (b = first; b < last; b += count) {
+		count = last - b;
+		if (count > chunk)
+			count = chunk;
+		data_blk = b * l->hash_per_block;
+		n = l->blocks - data_blk;
+		if (n > count * l->hash_per_block)
+			n = count * l->hash_per_block;
+
+		if (l->in_digests) {
+			/* Digests of level input are known, only assemble hash blocks */
+			memset(hash_blocks, 0, count * l->hash_block_size);
+			for (i = 0; i < n; i++)
+				memcpy(&hash_blocks[(i / l->hash_per_block) * l->hash_block_size +
+						    (i % l->hash_per_block) * stride],
+				       &l->in_digests[(data_blk + i) * l->digest_size], l->digest_size);
+		} else if ((r = verity_job_hash(job, data, zero, hash_blocks, data_blk, n)))
+			goto out;
+
+		/* Digests of produced hash blocks are input of the next level */
+		if (l->out_digests &&
+		    crypt_hash_blocks(l->hash_name,
+				l->version == 1 ? l->salt : NULL, l->version == 1 ? l->salt_size : 0,
+				l->version == 0 ? l->salt : NULL, l->version == 0 ? l->salt_size : 0,
+				hash_blocks, l->hash_block_size, count,
+				&l->out_digests[b * l->digest_size], l->digest_size, l->digest_size)) {
+			r = verity_job_fail(job, VERITY_ERR_HASH, 0, -EINVAL);
+			goto out;
+		}
+
+		position = l->seek_wr + b * l->hash_block_size;
+		if (!l->verify) {
+			if (verity_pio(l->wr_fd, hash_blocks, count * l->hash_block_size, position, true)) {
+				r = verity_job_fail(job, VERITY_ERR_WRITE, position, -EIO);
+				goto out;
+			}
+			continue;
+		}
+
+		if (verity_pio(l->wr_fd, read_blocks, count * l->hash_block_size, position, false)) {
+			r = verity_job_fail(job, VERITY_ERR_READ, position, -EIO);
+			goto out;
+		}
+
+		for (k = 0; k < count; k++) {
+			r = verity_job_compare(job, &read_blocks[k * l->hash_block_size],
+					       &hash_blocks[k * l->hash_block_size],
+					       n > l->hash_per_block ? l->hash_per_block : n,
+					       data_blk, position + k * l->hash_block_size);
+			if (r)
+				goto out;
+			data_blk += l->hash_per_block;
+			n -= n > l->hash_per_block ? l->hash_per_block : n;
+		}
+	}
+out:
+	free(zero);
+	free(read_blocks);
+	free(hash_blocks);
+	free(data);
+	return r;
+}
+
+static int verity_job_process(struct verity_job *job)
+{
+	size_t i;
+	int r = 0;
+
+	for (i = 0; i < job->ranges_count && !r; i++)
+		r = verity_job_process_range(job, job->ranges[i].first, job->ranges[i].last);
+
+	return r;
+}
+
+static void *verity_job_run(void *arg)
+{
+	struct verity_job *job = arg;
+
+	job->r = verity_job_process(job);
+	return NULL;
+}
+
+static void *verity_job_thread(void *arg)
+{
+	struct verity_job *job = arg;
+
+	crypt_numa_bind_thread(job->l->numa_node);
+
+	return verity_job_run(arg);
+}
+
+/*
+ * Process sorted ranges of hash blocks of one level. Corrupted input blocks
+ * are appended to bad list in collect mode.
+ */
+static int create_or_verify_blocks(struct crypt_device *cd,
+				     const struct verity_level *l,
+				     const struct verity_range *ranges, size_t ranges_count,
+				     struct verity_ranges *bad)
+{
+	struct verity_job jobs[VERITY_THREADS_MAX];
+	bool started[VERITY_THREADS_MAX] = {};
+	struct verity_range *pieces;
+	uint64_t stripe, left, n, first, blocks = 0;
+	unsigned i, jobs_count;
+	size_t j, k;
+	int r = 0;
+
+	for (j = 0; j < ranges_count; j++)
+		blocks += ranges[j].last - ranges[j].first;
+	if (!blocks)
+		return 0;
+
+	jobs_count = crypt_numa_cpus(l->numa_node);
+	if (jobs_count > VERITY_THREADS_MAX)
+		jobs_count = VERITY_THREADS_MAX;
+	if (jobs_count > blocks / VERITY_THREAD_BLOCKS_MIN)
+		jobs_count = blocks / VERITY_THREAD_BLOCKS_MIN;
+	if (!jobs_count)
+		jobs_count = 1;
+
+	/* Split ranges to pieces, every job gets the same number of hash blocks */
+	pieces = malloc((ranges_count + jobs_count) * sizeof(*pieces));
+	if (!pieces)
+		return -ENOMEM;
+
+	stripe = (blocks + jobs_count - 1) / jobs_count;
+	first = ranges[0].first;
+	for (i = 0, j = 0, k = 0; i < jobs_count && j < ranges_count; i++) {
+		memset(&jobs[i], 0, sizeof(jobs[i]));
+		jobs[i].l = l;
+		jobs[i].ranges = &pieces[k];
+		for (left = stripe; left && j < ranges_count;) {
+			n = ranges[j].last - first;
+			if (n > left)
+				n = left;
+			if (n) {
+				pieces[k].first = first;
+				pieces[k++].last = first + n;
+				jobs[i].ranges_count++;
+			}
+			left -= n;
+			first += n;
+			if (first == ranges[j].last && ++j < ranges_count)
+				first = ranges[j].first;
+		}
+	}
+	jobs_count = i;
+
+	log_dbg(cd, "Processing %" PRIu64 " hash blocks in %u threads.",
+		blocks, jobs_count);
+
+	/* The first range is processed by the calling thread */
+	for (i = 1; i < jobs_count; i++)
+		started[i] = !pthread_create(&jobs[i].thread, NULL, verity_job_thread, &jobs[i]);
+
+	verity_job_run(&jobs[0]);
+
+	for (i = 1; i < jobs_count; i++) {
+		if (started[i])
+			pthread_join(jobs[i].thread, NULL);
+		else
+			verity_job_run(&jobs[i]);
+	}
+
+	/* Report the first failure in the device order */
+	for (i = 0; i < jobs_count && !r; i++) {
+		r = jobs[i].r;
+		switch (jobs[i].err) {
+		case VERITY_ERR_READ:
+			log_dbg(cd, "Cannot read device block at %" PRIu64 ".", jobs[i].err_position);
+			break;
+		case VERITY_ERR_WRITE:
+			log_dbg(cd, "Cannot write hash block to hash device.");
+			break;
+		case VERITY_ERR_DIGEST:
+			log_err(cd, _("Verification failed at position %" PRIu64 "."),
+				jobs[i].err_position);
+			break;
+		case VERITY_ERR_SPARE:
+			log_err(cd, _("Spare area is not zeroed at position %" PRIu64 "."),
+				jobs[i].err_position);
+			break;
+		default:
+			break;
+		}
+	}
+
+	for (i = 0; i < jobs_count; i++) {
+		for (j = 0; j < jobs[i].bad.count && !r; j++)
+			r = verity_ranges_add(bad, jobs[i].bad.r[j].first, jobs[i].bad.r[j].last);
+		free(jobs[i].bad.r);
+	}
+
+	free(pieces);
+	return r;
+}
+
+static int verity_range_cmp(const void *a, const void *b)
+{
+	const struct verity_range *r1 = a, *r2 = b;
+
+	if (r1->first == r2->first)
+		return 0;
+	return r1->first < r2->first ? -1 : 1;
+}
+
+/* Sort ranges and merge overlapping or adjacent ones, returns new count */
+static size_t verity_ranges_merge(struct verity_range *ranges, size_t count)
+{
+	size_t i, j;
+
+	qsort(ranges, count, sizeof(*ranges), verity_range_cmp);
+
+	for (i = 0, j = 0; i < count; i++) {
+		if (j && ranges[i].first <= ranges[j - 1].last) {
+			if (ranges[i].last > ranges[j - 1].last)
+				ranges[j - 1].last = ranges[i].last;
+		} else
+			ranges[j++] = ranges[i];
+	}
+
+	return j;
+}
+
+/*
+ * Convert ranges of blocks on the level input to ranges of hash blocks
+ * (containing their digests), sorted and with overlaps merged.
+ */
+static size_t verity_ranges_up(struct verity_range *ranges, size_t count,
+			       size_t hash_per_block)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		ranges[i].first /= hash_per_block;
+		ranges[i].last = (ranges[i].last - 1) / hash_per_block + 1;
+	}
+
+	return verity_ranges_merge(ranges, count);
+}
+
+/*
+ * Convert ranges [from, count) of the level input blocks to data blocks,
+ * one input block covers scale data blocks.
+ */
+static void verity_ranges_scale(struct verity_ranges *list, size_t from,
+				uint64_t scale, uint64_t data_blocks)
+{
+	size_t i;
+
+	for (i = from; i < list->count; i++) {
+		list->r[i].first *= scale;
+		if (list->r[i].last > data_blocks / scale)
+			list->r[i].last = data_blocks;
+		else
+			list->r[i].last *= scale;
+	}
+}
+
 static int create_or_verify(struct crypt_device *cd, FILE *rd, FILE *wr,
 				   uint64_t data_block, size_t data_block_size,
 				   uint64_t hash_block, size_t hash_block_size,
 				   uint64_t blocks, int version,
 				   const char *hash_name, int verify,
 				   char *calculated_digest, size_t digest_size,
-				   const char *salt, size_t salt_size)
+				   const char *salt, size_t salt_size,
+				   struct verity_range *ranges, size_t ranges_count,
+				   struct verity_ranges *bad,
+				   const char *zero_block, char *zero_next, bool holes,
+				   const char *in_digests, char *out_digests)
 {
-	char *left_block, *data_buffer;
-	char read_digest[VERITY_MAX_DIGEST_SIZE];
+	char zero_digest[VERITY_MAX_DIGEST_SIZE];
+	struct verity_range all;
+	struct stat st;
+	char *data_buffer;
+	size_t i;
 	size_t hash_per_block = 1 << get_bits_down(hash_block_size / digest_size);
 	size_t digest_size_full = 1 << get_bits_up(digest_size);
 	uint64_t blocks_to_write = (blocks + hash_per_block - 1) / hash_per_block;
 	uint64_t seek_rd, seek_wr;
-	size_t left_bytes;
-	unsigned i;
 	int r;
 
-	if (digest_size > sizeof(read_digest))
+	if (digest_size > VERITY_MAX_DIGEST_SIZE)
 		return -EINVAL;
 
 	if (uint64_mult_overflow(&seek_rd, data_block, data_block_size) ||
@@ -168,119 +707,111 @@ static int create_or_verify(struct crypt_device *cd, FILE *rd, FILE *wr,
 		return -EINVAL;
 	}
 
-	if (fseeko(rd, seek_rd, SEEK_SET)) {
-		log_dbg(cd, "Cannot seek to requested position in data device.");
-		return -EIO;
-	}
+	if (wr) {
+		struct verity_level l = {
+			.rd_fd = rd ? fileno(rd) : -1,
+			.wr_fd = fileno(wr),
+			.seek_rd = seek_rd,
+			.seek_wr = seek_wr,
+			.data_block_size = data_block_size,
+			.hash_block_size = hash_block_size,
+			.hash_per_block = hash_per_block,
+			.digest_size = digest_size,
+			.digest_size_full = digest_size_full,
+			.blocks = blocks,
+			.version = version,
+			.verify = verify,
+			.collect = verify && bad,
+			.hash_name = hash_name,
+			.salt = salt,
+			.salt_size = salt_size,
+			.numa_node = crypt_numa_node(cd, crypt_data_device(cd)),
+			.in_digests = in_digests,
+			.out_digests = out_digests
+		};
 
-	if (wr && fseeko(wr, seek_wr, SEEK_SET)) {
-		log_dbg(cd, "Cannot seek to requested position in hash device.");
-		return -EIO;
-	}
+		/*
+		 * Digest of zero subtree block is the same for the whole level,
+		 * hash block of these digests is zero subtree block of next level.
+		 */
+		if (zero_block) {
+			if (verify_hash_block(hash_name, version, zero_digest, digest_size,
+					      zero_block, data_block_size, salt, salt_size))
+				return -EINVAL;
+			l.zero_block = zero_block;
+			l.zero_digest = zero_digest;
+			if (holes && rd && !fstat(l.rd_fd, &st) && S_ISREG(st.st_mode))
+				l.holes_end = st.st_size;
 
-	left_block = malloc(hash_block_size);
-	data_buffer = malloc(data_block_size);
-	if (!left_block || !data_buffer) {
-		r = -ENOMEM;
-		goto out;
-	}
+			memset(zero_next, 0, hash_block_size);
+			for (i = 0; i < hash_per_block; i++)
+				memcpy(&zero_next[i * (version ? digest_size_full : digest_size)],
+				       zero_digest, digest_size);
+		}
 
-	memset(left_block, 0, hash_block_size);
-	while (blocks_to_write--) {
-		left_bytes = hash_block_size;
-		for (i = 0; i < hash_per_block; i++) {
-			if (!blocks)
-				break;
-			blocks--;
-			if (fread(data_buffer, data_block_size, 1, rd) != 1) {
-				log_dbg(cd, "Cannot read data device block.");
-				r = -EIO;
-				goto out;
-			}
+		if (!ranges) {
+			all.first = 0;
+			all.last = blocks_to_write;
+			ranges = &all;
+			ranges_count = 1;
+		}
 
-			if (verify_hash_block(hash_name, version,
-					calculated_digest, digest_size,
-					data_buffer, data_block_size,
-					salt, salt_size)) {
-				r = -EINVAL;
-				goto out;
-			}
+		/* Ranges are sorted, clip them to the level size */
+		while (ranges_count && ranges[ranges_count - 1].first >= blocks_to_write)
+			ranges_count--;
+		if (ranges_count && ranges[ranges_count - 1].last > blocks_to_write)
+			ranges[ranges_count - 1].last = blocks_to_write;
 
-			if (!wr)
-				break;
-			if (verify) {
-				if (fread(read_digest, digest_size, 1, wr) != 1) {
-					log_dbg(cd, "Cannot read digest form hash device.");
-					r = -EIO;
-					goto out;
-				}
-				if (memcmp(read_digest, calculated_digest, digest_size)) {
-					log_err(cd, _("Verification failed at position %" PRIu64 "."),
-						ftello(rd) - data_block_size);
-					r = -EPERM;
-					goto out;
-				}
-			} else {
-				if (fwrite(calculated_digest, digest_size, 1, wr) != 1) {
-					log_dbg(cd, "Cannot write digest to hash device.");
-					r = -EIO;
-					goto out;
-				}
-			}
-			if (version == 0) {
-				left_bytes -= digest_size;
-			} else {
-				if (digest_size_full - digest_size) {
-					if (verify) {
-						r = verify_zero(cd, wr, digest_size_full - digest_size);
-						if (r)
-							goto out;
-					} else if (fwrite(left_block, digest_size_full - digest_size, 1, wr) != 1) {
-						log_dbg(cd, "Cannot write spare area to hash device.");
-						r = -EIO;
-						goto out;
-					}
-				}
-				left_bytes -= digest_size_full;
-			}
-		}
-		if (wr && left_bytes) {
-			if (verify) {
-				r = verify_zero(cd , wr, left_bytes);
-				if (r)
-					goto out;
-			} else if (fwrite(left_block, left_bytes, 1, wr) != 1) {
-				log_dbg(cd, "Cannot write remaining spare area to hash device.");
-				r = -EIO;
-				goto out;
-			}
-		}
+		return create_or_verify_blocks(cd, &l, ranges, ranges_count, bad);
 	}
-	r = 0;
-out:
-	free(left_block);
+
+	/* No hash device, only digest of the first (root) block is calculated */
+	if (!blocks)
+		return 0;
+
+	data_buffer = malloc(data_block_size);
+	if (!data_buffer)
+		return -ENOMEM;
+
+	if (verity_pio(fileno(rd), data_buffer, data_block_size, seek_rd, false)) {
+		log_dbg(cd, "Cannot read data device block.");
+		r = -EIO;
+	} else if (verify_hash_block(hash_name, version,
+			calculated_digest, digest_size,
+			data_buffer, data_block_size,
+			salt, salt_size))
+		r = -EINVAL;
+	else
+		r = 0;
+
 	free(data_buffer);
 	return r;
 }
 
-static int VERITY_create_or_verify_hash(struct crypt_device *cd, bool verify,
+static int VERITY_create_or_verify_hash(struct crypt_device *cd, bool verify, bool hash_only,
 	struct crypt_params_verity *params,
-	char *root_hash, size_t digest_size)
+	char *root_hash, size_t digest_size,
+	struct verity_range *ranges, size_t ranges_count,
+	struct verity_ranges *bad)
 {
 	char calculated_digest[VERITY_MAX_DIGEST_SIZE];
 	FILE *data_file = NULL;
 	FILE *hash_file = NULL, *hash_file_2;
 	uint64_t hash_level_block[VERITY_MAX_LEVELS];
 	uint64_t hash_level_size[VERITY_MAX_LEVELS];
-	uint64_t data_file_blocks;
+	uint64_t data_file_blocks, scale = 1;
 	uint64_t data_device_offset_max = 0, hash_device_offset_max = 0;
 	uint64_t hash_position = VERITY_hash_offset_block(params);
 	uint64_t dev_size;
+	size_t hash_per_block, bad_count, zero_size;
+	char *zero_blocks[2] = {}, *digests[2] = {};
+	bool stream;
 	int levels, i, r;
 
 	log_dbg(cd, "Hash %s %s, data device %s, data blocks %" PRIu64
 		", hash_device %s, offset %" PRIu64 ".",
-		verify ? "verification" : "creation", params->hash_name,
+		hash_only ? "area verification" : verify ? "verification" :
+		ranges ? "update" : "creation", params->hash_name,
 		device_path(crypt_data_device(cd)), params->data_size,
 		device_path(crypt_metadata_device(cd)), hash_position);
 
@@ -314,6 +845,7 @@ static int VERITY_create_or_verify_hash(struct crypt_device *cd, bool verify,
 	log_dbg(cd, "Hash device size required: %" PRIu64 " bytes.",
 		hash_device_offset_max - params->hash_area_offset);
 	log_dbg(cd, "Using %d hash levels.", levels);
+	hash_per_block = 1 << get_bits_down(params->hash_block_size / digest_size);
 
 	data_file = fopen(device_path(crypt_data_device(cd)), "r");
 	if (!data_file) {
@@ -334,13 +866,54 @@ static int VERITY_create_or_verify_hash(struct crypt_device *cd, bool verify,
 
 	memset(calculated_digest, 0, digest_size);
 
-	for (i = 0; i < levels; i++) {
+	/* Zero subtree blocks of the current and next level, level 0 is zero data block */
+	zero_size = params->data_block_size > params->hash_block_size ?
+		    params->data_block_size : params->hash_block_size;
+	zero_blocks[0] = calloc(1, zero_size);
+	zero_blocks[1] = calloc(1, zero_size);
+	if (!zero_blocks[0] || !zero_blocks[1]) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	/*
+	 * Creation of the whole tree keeps digests of hash blocks in memory
+	 * for the next level, hash device is then only written, never read back.
+	 */
+	stream = !verify && !ranges && levels &&
+		 hash_level_size[0] <= VERITY_DIGESTS_MEM_MAX / digest_size;
+
+	/* Level 0 digests are trusted, only upper levels and root are checked */
+	for (i = hash_only ? 1 : 0; i < levels; i++) {
+		/* Only hash blocks covering changed blocks of the level below */
+		if (ranges)
+			ranges_count = verity_ranges_up(ranges, ranges_count, hash_per_block);
+		bad_count = bad ? bad->count : 0;
+		if (stream && !(digests[i & 1] = malloc(hash_level_size[i] * digest_size))) {
+			r = -ENOMEM;
+			goto out;
+		}
 		if (!i) {
 			r = create_or_verify(cd, data_file, hash_file,
 						    0, params->data_block_size,
 						    hash_level_block[i], params->hash_block_size,
 						    data_file_blocks, params->hash_type, params->hash_name, verify,
-						    calculated_digest, digest_size, params->salt, params->salt_size);
+						    calculated_digest, digest_size, params->salt, params->salt_size,
+						    ranges, ranges_count, bad,
+						    zero_blocks[0], zero_blocks[1], true,
+						    NULL, digests[0]);
+			if (r)
+				goto out;
+		} else if (stream) {
+			r = create_or_verify(cd, NULL, hash_file,
+						    hash_level_block[i - 1], params->hash_block_size,
+						    hash_level_block[i], params->hash_block_size,
+						    hash_level_size[i - 1], params->hash_type, params->hash_name, verify,
+						    calculated_digest, digest_size, params->salt, params->salt_size,
+						    NULL, 0, NULL, NULL, NULL, false,
+						    digests[!(i & 1)], digests[i & 1]);
+			free(digests[!(i & 1)]);
+			digests[!(i & 1)] = NULL;
 			if (r)
 				goto out;
 		} else {
@@ -355,28 +928,47 @@ static int VERITY_create_or_verify_hash(struct crypt_device *cd, bool verify,
 						    hash_level_block[i - 1], params->hash_block_size,
 						    hash_level_block[i], params->hash_block_size,
 						    hash_level_size[i - 1], params->hash_type, params->hash_name, verify,
-						    calculated_digest, digest_size, params->salt, params->salt_size);
+						    calculated_digest, digest_size, params->salt, params->salt_size,
+						    ranges, ranges_count, bad,
+						    zero_blocks[i & 1], zero_blocks[!(i & 1)], false,
+						    NULL, NULL);
 			fclose(hash_file_2);
 			if (r)
 				goto out;
 		}
+		/* Corrupted hash block invalidates all data blocks below it */
+		if (bad)
+			verity_ranges_scale(bad, bad_count, scale, data_file_blocks);
+		scale *= hash_per_block;
 	}
 
-	if (levels)
+	/* Top level has only one hash block, its digest is the root hash */
+	if (stream)
+		memcpy(calculated_digest, digests[(levels - 1) & 1], digest_size);
+	else if (levels)
 		r = create_or_verify(cd, hash_file, NULL,
 					    hash_level_block[levels - 1], params->hash_block_size,
 					    0, params->hash_block_size,
 					    1, params->hash_type, params->hash_name, verify,
-					    calculated_digest, digest_size, params->salt, params->salt_size);
+					    calculated_digest, digest_size, params->salt, params->salt_size,
+					    NULL, 0, NULL, NULL, NULL, false, NULL, NULL);
 	else
 		r = create_or_verify(cd, data_file, NULL,
 					    0, params->data_block_size,
 					    0, params->hash_block_size,
 					    data_file_blocks, params->hash_type, params->hash_name, verify,
-					    calculated_digest, digest_size, params->salt, params->salt_size);
+					    calculated_digest, digest_size, params->salt, params->salt_size,
+					    NULL, 0, NULL, NULL, NULL, false, NULL, NULL);
 out:
+	if (!r && bad && bad->count) {
+		bad->count = verity_ranges_merge(bad->r, bad->count);
+		r = -EPERM;
+	}
+
 	if (verify) {
-		if (r)
+		if (r && hash_only)
+			log_err(cd, _("Verification of hash area failed."));
+		else if (r)
 			log_err(cd, _("Verification of data area failed."));
 		else {
 			log_dbg(cd, "Verification of data area succeeded.");
@@ -397,6 +989,10 @@ out:
 		}
 	}
 
+	free(digests[0]);
+	free(digests[1]);
+	free(zero_blocks[0]);
+	free(zero_blocks[1]);
 	if (data_file)
 		fclose(data_file);
 	if (hash_file)
@@ -404,13 +1000,188 @@ out:
 	return r;
 }
 
+/* Check and convert data block ranges from API, skips empty ranges */
+static int verity_ranges_import(struct crypt_device *cd,
+				struct crypt_params_verity *verity_hdr,
+				const struct crypt_verity_range *in, size_t in_count,
+				struct verity_range **ranges, size_t *count)
+{
+	size_t i;
+
+	*ranges = malloc((in_count ? in_count : 1) * sizeof(**ranges));
+	if (!*ranges)
+		return -ENOMEM;
+
+	for (i = 0, *count = 0; i < in_count; i++) {
+		if (!in[i].length)
+			continue;
+		if (in[i].offset + in[i].length < in[i].offset ||
+		    in[i].offset + in[i].length > verity_hdr->data_size) {
+			log_err(cd, _("Data block range %" PRIu64 "-%" PRIu64
+				" is out of data area."), in[i].offset,
+				in[i].offset + in[i].length - 1);
+			free(*ranges);
+			*ranges = NULL;
+			return -EINVAL;
+		}
+		(*ranges)[*count].first = in[i].offset;
+		(*ranges)[*count].last = in[i].offset + in[i].length;
+		(*count)++;
+	}
+
+	return 0;
+}
+
 /* Verify verity device using userspace crypto backend */
 int VERITY_verify(struct crypt_device *cd,
 		  struct crypt_params_verity *verity_hdr,
 		  const char *root_hash,
 		  size_t root_hash_size)
 {
-	return VERITY_create_or_verify_hash(cd, 1, verity_hdr, CONST_CAST(char*)root_hash, root_hash_size);
+	return VERITY_create_or_verify_hash(cd, 1, false, verity_hdr, CONST_CAST(char*)root_hash, root_hash_size,
+					    NULL, 0, NULL);
+}
+
+/* Verify only hash area (without data) against root hash */
+int VERITY_verify_hash_only(struct crypt_device *cd,
+		  struct crypt_params_verity *verity_hdr,
+		  const char *root_hash,
+		  size_t root_hash_size)
+{
+	return VERITY_create_or_verify_hash(cd, 1, true, verity_hdr, CONST_CAST(char*)root_hash, root_hash_size,
+					    NULL, 0, NULL);
+}
+
+/* Verify data ranges (or whole device), collect all corrupted data blocks */
+int VERITY_verify_ranges(struct crypt_device *cd,
+		  struct crypt_params_verity *verity_hdr,
+		  const struct crypt_verity_range *ranges,
+		  size_t ranges_count,
+		  struct crypt_verity_range **bad_ranges,
+		  size_t *bad_ranges_count,
+		  const char *root_hash,
+		  size_t root_hash_size)
+{
+	struct verity_range *checked = NULL;
+	struct verity_ranges bad = {};
+	size_t i, count = 0;
+	int r;
+
+	if (ranges && (r = verity_ranges_import(cd, verity_hdr, ranges, ranges_count,
+						&checked, &count)))
+		return r;
+
+	r = VERITY_create_or_verify_hash(cd, 1, false, verity_hdr, CONST_CAST(char*)root_hash, root_hash_size,
+					 checked, count, &bad);
+
+	for (i = 0; i < bad.count; i++)
+		log_err(cd, _("Verification failed for data blocks %" PRIu64 "-%" PRIu64 "."),
+			bad.r[i].first, bad.r[i].last - 1);
+
+	if (bad.count && bad_ranges) {
+		*bad_ranges = malloc(bad.count * sizeof(**bad_ranges));
+		if (!*bad_ranges)
+			r = -ENOMEM;
+		else {
+			for (i = 0; i < bad.count; i++) {
+				(*bad_ranges)[i].offset = bad.r[i].first;
+				(*bad_ranges)[i].length = bad.r[i].last - bad.r[i].first;
+			}
+			*bad_ranges_count = bad.count;
+		}
+	}
+
+	free(bad.r);
+	free(checked);
+	return r;
+}
+
+/*
+ * Check a single block against the hash tree up to the root hash.
+ * Block is either a data block or a hash block (offset on hash device
+ * in hash blocks). Hash blocks on the path to the root are provided
+ * by read_hash_block, so not yet written blocks can be checked.
+ * Returns -ERANGE if the hash block is not a part of the tree.
+ */
+int VERITY_verify_block(struct crypt_device *cd,
+		  struct crypt_params_verity *verity_hdr,
+		  const char *root_hash,
+		  size_t root_hash_size,
+		  bool hash_block,
+		  uint64_t block,
+		  const char *data,
+		  int (*read_hash_block)(void *usrptr, uint64_t block, char *buf),
+		  void *usrptr)
+{
+	char digest[VERITY_MAX_DIGEST_SIZE];
+	uint64_t hash_level_block[VERITY_MAX_LEVELS];
+	uint64_t hash_level_size[VERITY_MAX_LEVELS];
+	uint64_t hash_position = VERITY_hash_offset_block(verity_hdr);
+	size_t digest_size, hash_per_block, stride, block_size;
+	int level, levels, r;
+	char *buf;
+
+	r = crypt_hash_size(verity_hdr->hash_name);
+	if (r <= 0 || (size_t)r > sizeof(digest) || (size_t)r != root_hash_size)
+		return -EINVAL;
+	digest_size = r;
+
+	if (hash_levels(verity_hdr->hash_block_size, digest_size, verity_hdr->data_size,
+			&hash_position, &levels, &hash_level_block[0], &hash_level_size[0]))
+		return -EINVAL;
+
+	hash_per_block = 1 << get_bits_down(verity_hdr->hash_block_size / digest_size);
+	stride = verity_hdr->hash_type ? (size_t)1 << get_bits_up(digest_size) : digest_size;
+
+	/* Level 0 are data blocks, level i + 1 are hash blocks at hash_level_block[i] */
+	if (!hash_block) {
+		if (block >= verity_hdr->data_size)
+			return -ERANGE;
+		level = 0;
+	} else {
+		for (level = 0; level < levels; level++)
+			if (block >= hash_level_block[level] &&
+			    block < hash_level_block[level] + hash_level_size[level])
+				break;
+		if (level == levels)
+			return -ERANGE;
+		block -= hash_level_block[level++];
+	}
+
+	buf = malloc(verity_hdr->hash_block_size);
+	if (!buf)
+		return -ENOMEM;
+
+	block_size = level ? verity_hdr->hash_block_size : verity_hdr->data_block_size;
+	for (r = 0;; level++) {
+		if (verify_hash_block(verity_hdr->hash_name, verity_hdr->hash_type, digest, digest_size,
+				      data, block_size, verity_hdr->salt, verity_hdr->salt_size)) {
+			r = -EINVAL;
+			break;
+		}
+
+		/* Top level has only one hash block, its digest is the root hash */
+		if (level == levels) {
+			r = memcmp(digest, root_hash, digest_size) ? -EPERM : 0;
+			break;
+		}
+
+		r = read_hash_block(usrptr, hash_level_block[level] + block / hash_per_block, buf);
+		if (!r && memcmp(&buf[(block % hash_per_block) * stride], digest, digest_size))
+			r = -EPERM;
+		if (r)
+			break;
+
+		data = buf;
+		block /= hash_per_block;
+		block_size = verity_hdr->hash_block_size;
+	}
+
+	if (r == -EPERM)
+		log_dbg(cd, "Block does not match hash tree at level %d.", level);
+
+	free(buf);
+	return r;
 }
 
 /* Create verity hash */
@@ -428,7 +1199,30 @@ int VERITY_create(struct crypt_device *cd,
 		log_err(cd, _("WARNING: Kernel cannot activate device if data "
 			      "block size exceeds page size (%u)."), pgsize);
 
-	return VERITY_create_or_verify_hash(cd, 0, verity_hdr, CONST_CAST(char*)root_hash, root_hash_size);
+	return VERITY_create_or_verify_hash(cd, 0, false, verity_hdr, CONST_CAST(char*)root_hash, root_hash_size,
+					    NULL, 0, NULL);
+}
+
+/* Update verity hash for changed data blocks */
+int VERITY_update(struct crypt_device *cd,
+		  struct crypt_params_verity *verity_hdr,
+		  const struct crypt_verity_range *changed,
+		  size_t changed_count,
+		  char *root_hash,
+		  size_t root_hash_size)
+{
+	struct verity_range *ranges;
+	size_t count;
+	int r;
+
+	r = verity_ranges_import(cd, verity_hdr, changed, changed_count, &ranges, &count);
+	if (r)
+		return r;
+
+	r = VERITY_create_or_verify_hash(cd, 0, false, verity_hdr, root_hash, root_hash_size,
+					 ranges, count, NULL);
+	free(ranges);
+	return r;
 }
 
 uint64_t VERITY_hash_blocks(struct crypt_device *cd, struct crypt_params_verity *params)
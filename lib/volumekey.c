@@ -33,7 +33,8 @@ struct volume_key *crypt_alloc_volume_key(size_t keylength, const char *key)
 	if (keylength > (SIZE_MAX - sizeof(*vk)))
 		return NULL;
 
-	vk = malloc(sizeof(*vk) + keylength);
+	/* key material lives in locked memory even without mlockall */
+	vk = crypt_safe_alloc(sizeof(*vk) + keylength);
 	if (!vk)
 		return NULL;
 
@@ -124,7 +125,7 @@ void crypt_free_volume_key(struct volume_key *vk)
 		vk->keylength = 0;
 		free(CONST_CAST(void*)vk->key_description);
 		vk_next = vk->next;
-		free(vk);
+		crypt_safe_free(vk);
 		vk = vk_next;
 	}
 }
@@ -1,5 +1,5 @@
 /*
- * LUKS keyslot entropy tester. Works only for header version 1.
+ * LUKS keyslot entropy tester. Works for header version 1 and 2.
  *
  * Functionality: Determines sample entropy (symbols: bytes) for
  * each (by default) 512B sector in each used keyslot. If it
@@ -11,6 +11,7 @@
  * Version history:
  *    v0.1: 09.09.2012 Initial release
  *    v0.2: 08.10.2012 Converted to use libcryptsetup
+ *    v0.3: 15.10.2026 LUKS2, more devices, parallel scan, JSON output
  *
  * Copyright (C) 2012, Arno Wagner <arno@wagner.name>
  *
@@ -31,19 +32,21 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <math.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <libcryptsetup.h>
 
 const char *help =
-"Version 0.2 [8.10.2012]\n"
+"Version 0.3 [15.10.2026]\n"
 "\n"
-"    chk_luks_keyslots [options] luks-device \n"
+"    chk_luks_keyslots [options] luks-device [luks-device ...]\n"
 "\n"
-"This tool checks all keyslots of a LUKS device for \n"
+"This tool checks all keyslots of LUKS devices for \n"
 "low entropy sections. If any are found, they are reported. \n"
 "This allows to find areas damaged by things like filesystem \n"
 "creation or RAID superblocks. \n"
@@ -61,6 +64,9 @@ const char *help =
 "            the threshold down to reduce misdetection. For values\n"
 "            larger than the default you need to adjust the threshold\n"
 "            up to retain sensitivity.\n"
+"  -p <num>  Number of keyslots scanned in parallel.\n"
+"            Default: number of online CPUs.\n"
+"  -j        Print results in JSON format.\n"
 "  -v        Print found suspicious sectors verbosely. \n"
 "  -d        Print decimal addresses instead of hex ones.\n"
 "\n";
@@ -72,42 +78,85 @@ static int sector_size = 512;
 static double threshold = 0.90;
 static int print_decimal = 0;
 static int verbose = 0;
+static int json = 0;
+static int parallel = 0;
+
+/* Keyslot areas are read at once, aligned for O_DIRECT capable devices */
+#define AREA_ALIGN 4096
+
+/* n * log2(n) for 0 ... sector_size */
+static double *nlog2n;
+
+struct device_scan {
+	const char *path;
+	const char *type;
+	const char *error; /* reason why device is not scanned */
+	int fd;
+	int first_scan;
+	int scans;
+};
+
+struct keyslot_scan {
+	struct device_scan *dev;
+	int keyslot;
+	crypt_keyslot_info ki;
+	uint64_t start;
+	uint64_t length;
+	int r;
+	char *text;      /* report, printed in keyslot order */
+	size_t text_size;
+};
+
+static struct keyslot_scan *scans;
+static int scans_count;
+static int scans_next;
+static pthread_mutex_t scans_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* tools */
 
 /* Calculates and returns sample entropy on byte level for
  * The argument.
+ * Bytes are counted into four interleaved histograms, so consecutive
+ * increments of the same symbol do not wait for each other, and merged
+ * in a loop the compiler vectorizes.
  */
-static double ent_samp(unsigned char * buf, int len)
+static double ent_samp(const unsigned char * buf, int len)
 {
-	int freq[256];   /* stores symbol frequencies */
+	uint32_t freq[4][256];   /* stores symbol frequencies */
+	uint32_t f;
 	int i;
-	double e, f;
+	double e;
 
 	/* 0. Plausibility checks */
 	if (len <= 0)
 		return 0.0;
 
 	/* 1. count all frequencies */
-	for (i = 0; i < 256; i++) {
-		freq[i] = 0.0;
+	memset(freq, 0, sizeof(freq));
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		freq[0][buf[i]]++;
+		freq[1][buf[i + 1]]++;
+		freq[2][buf[i + 2]]++;
+		freq[3][buf[i + 3]]++;
 	}
+	for (; i < len; i++)
+		freq[0][buf[i]]++;
 
-	for (i = 0; i < len; i ++)
-		freq[buf[i]]++;
+	for (i = 0; i < 256; i++)
+		freq[0][i] += freq[1][i] + freq[2][i] + freq[3][i];
 
-	/* 2. calculate sample entropy */
+	/* 2. calculate sample entropy,
+	 *    -sum(f/len * log2(f/len)) = log2(len) - sum(f * log2(f)) / len
+	 */
 	e = 0.0;
 	for (i = 0; i < 256; i++) {
-		f = freq[i];
-		if (f > 0) {
-			f =  f / (double)len;
-			e += f * log2(f);
-		}
+		f = freq[0][i];
+		if (f > 1)
+			e += nlog2n ? nlog2n[f] : f * log2(f);
 	}
 
-	if (e != 0.0)
-		e = -1.0 * e;
+	e = log2(len) - e / (double)len;
 
 	e = e / 8.0;
 	return e;
@@ -165,90 +214,363 @@ static void hexdump_sector(FILE *out, unsigned char *buf, uint64_t address, int
 	}
 }
 
-static int check_keyslots(FILE *out, struct crypt_device *cd, int f_luks)
+/* JSON string with quotes, path is arbitrary user input */
+static void print_json_string(FILE *out, const char *str)
 {
-	int i;
+	const unsigned char *c;
+
+	fputc('"', out);
+	for (c = (const unsigned char *)str; *c; c++) {
+		if (*c == '"' || *c == '\\')
+			fprintf(out, "\\%c", *c);
+		else if (*c < 0x20)
+			fprintf(out, "\\u%04x", *c);
+		else
+			fputc(*c, out);
+	}
+	fputc('"', out);
+}
+
+static const char *keyslot_status_string(crypt_keyslot_info ki)
+{
+	switch (ki) {
+	case CRYPT_SLOT_INACTIVE:
+		return "inactive";
+	case CRYPT_SLOT_ACTIVE:
+	case CRYPT_SLOT_ACTIVE_LAST:
+		return "active";
+	case CRYPT_SLOT_UNBOUND:
+		return "unbound";
+	default:
+		return "invalid";
+	}
+}
+
+static int read_area(int fd, unsigned char *buffer, uint64_t start, uint64_t length)
+{
+	uint64_t done = 0;
+	ssize_t r;
+
+	while (done < length) {
+		r = pread(fd, buffer + done, length - done, start + done);
+		if (r <= 0)
+			return -1;
+		done += r;
+	}
+
+	return 0;
+}
+
+static int scan_error(FILE *out, const char *error)
+{
+	if (json) {
+		fprintf(out, "], \"error\": ");
+		print_json_string(out, error);
+	} else
+		fprintf(stderr, "\nError: %s.\n", error);
+
+	return EXIT_FAILURE;
+}
+
+/* Scan one used keyslot area, report goes to out */
+static int scan_area(FILE *out, struct keyslot_scan *ks)
+{
+	unsigned char *buffer = NULL;
+	uint64_t ofs, end = ks->start + ks->length;
+	int low = 0;
 	double ent;
-	off_t ofs;
-	uint64_t start, length, end;
-	crypt_keyslot_info ki;
-	unsigned char buffer[sector_size];
 
-	for (i = 0; i < crypt_keyslot_max(CRYPT_LUKS1) ; i++) {
-		fprintf(out, "- processing keyslot %d:", i);
-		ki = crypt_keyslot_status(cd, i);
-		if (ki == CRYPT_SLOT_INACTIVE) {
-			fprintf(out, "  keyslot not in use\n");
+	if (!json) {
+		fprintf(out, "  start: ");
+		print_address(out, ks->start);
+		fprintf(out, "  end: ");
+		print_address(out, end);
+		fprintf(out, "\n");
+	} else
+		fprintf(out, ", \"start\": %" PRIu64 ", \"end\": %" PRIu64 ", \"low_entropy\": [",
+			ks->start, end);
+
+	/* check whether sector-size divides size */
+	if (ks->length % sector_size != 0)
+		return scan_error(out, "Argument to -s does not divide keyslot size");
+
+	if (posix_memalign((void *)&buffer, AREA_ALIGN, ks->length))
+		return scan_error(out, "Cannot allocate memory for keyslot area");
+
+	if (read_area(ks->dev->fd, buffer, ks->start, ks->length)) {
+		free(buffer);
+		return scan_error(out, "Cannot read keyslot area");
+	}
+
+	for (ofs = 0; ofs < ks->length; ofs += sector_size) {
+		ent = ent_samp(buffer + ofs, sector_size);
+		if (ent >= threshold)
 			continue;
+
+		if (json) {
+			fprintf(out, "%s{ \"offset\": %" PRIu64 ", \"entropy\": %f }",
+				low ? ", " : "", ks->start + ofs, ent);
+		} else {
+			fprintf(out, "  low entropy at: ");
+			print_address(out, ks->start + ofs);
+			fprintf(out, "   entropy: %f\n", ent);
+			if (verbose) {
+				fprintf(out, "  Binary dump:\n");
+				hexdump_sector(out, buffer + ofs, ks->start + ofs, sector_size);
+				fprintf(out,"\n");
+			}
 		}
+		low++;
+	}
+
+	if (json)
+		fprintf(out, "]");
+
+	free(buffer);
+	return EXIT_SUCCESS;
+}
+
+static void scan_keyslot(struct keyslot_scan *ks)
+{
+	FILE *out;
+
+	out = open_memstream(&ks->text, &ks->text_size);
+	if (!out) {
+		ks->r = EXIT_FAILURE;
+		return;
+	}
+
+	if (json)
+		fprintf(out, "{ \"keyslot\": %d, \"status\": \"%s\"", ks->keyslot,
+			keyslot_status_string(ks->ki));
+	else
+		fprintf(out, "- processing keyslot %d:", ks->keyslot);
 
-		if (ki == CRYPT_SLOT_INVALID) {
+	if (ks->ki == CRYPT_SLOT_INACTIVE) {
+		if (!json)
+			fprintf(out, "  keyslot not in use\n");
+		ks->r = EXIT_SUCCESS;
+	} else if (ks->ki == CRYPT_SLOT_INVALID) {
+		if (json)
+			fprintf(out, ", \"error\": \"Keyslot invalid\"");
+		else
 			fprintf(out, "\nError: keyslot invalid.\n");
-			return EXIT_FAILURE;
-		}
+		ks->r = EXIT_FAILURE;
+	} else
+		ks->r = scan_area(out, ks);
+
+	if (json)
+		fprintf(out, " }");
+
+	fclose(out);
+}
+
+static void *scan_worker(void *arg __attribute__((unused)))
+{
+	int i;
+
+	while (1) {
+		pthread_mutex_lock(&scans_lock);
+		i = scans_next++;
+		pthread_mutex_unlock(&scans_lock);
+
+		if (i >= scans_count)
+			break;
+		scan_keyslot(&scans[i]);
+	}
 
-		if (crypt_keyslot_area(cd, i, &start, &length) < 0) {
+	return NULL;
+}
+
+static void run_scans(void)
+{
+	pthread_t threads[parallel];
+	int i, started = 0;
+
+	for (i = 1; i < parallel && i < scans_count; i++) {
+		if (pthread_create(&threads[i], NULL, scan_worker, NULL))
+			break;
+		started = i;
+	}
+
+	scan_worker(NULL);
+
+	for (i = 1; i <= started; i++)
+		pthread_join(threads[i], NULL);
+}
+
+/* Queue all keyslots of device for scanning */
+static int add_device(struct device_scan *dev, struct crypt_device *cd)
+{
+	struct keyslot_scan *tmp;
+	int i, max = crypt_keyslot_max(dev->type);
+
+	if (max <= 0)
+		return -1;
+
+	tmp = realloc(scans, (scans_count + max) * sizeof(*scans));
+	if (!tmp) {
+		dev->error = "Cannot allocate memory";
+		return -1;
+	}
+	scans = tmp;
+	dev->first_scan = scans_count;
+
+	for (i = 0; i < max; i++) {
+		memset(&scans[scans_count], 0, sizeof(*scans));
+		scans[scans_count].dev = dev;
+		scans[scans_count].keyslot = i;
+		scans[scans_count].ki = crypt_keyslot_status(cd, i);
+
+		if ((scans[scans_count].ki != CRYPT_SLOT_INACTIVE &&
+		     scans[scans_count].ki != CRYPT_SLOT_INVALID) &&
+		    crypt_keyslot_area(cd, i, &scans[scans_count].start,
+				       &scans[scans_count].length) < 0) {
 			fprintf(stderr,"\nError: querying keyslot area failed for slot %d\n", i);
 			perror(NULL);
-			return EXIT_FAILURE;
+			/* device is reported only with error, no partial keyslot list */
+			scans_count = dev->first_scan;
+			dev->error = "Querying keyslot area failed";
+			return -1;
 		}
-		end = start + length;
+		scans_count++;
+	}
+	dev->scans = max;
 
-		fprintf(out, "  start: ");
-		print_address(out, start);
-		fprintf(out, "  end: ");
-		print_address(out, end);
-		fprintf(out, "\n");
+	return 0;
+}
 
-		/* check whether sector-size divides size */
-		if (length % sector_size != 0) {
-			fprintf(stderr,"\nError: Argument to -s does not divide keyslot size\n");
-			return EXIT_FAILURE;
-		}
+static int open_device(struct device_scan *dev)
+{
+	struct crypt_device *cd;
+	int res;
 
-		for (ofs = start; (uint64_t)ofs < end; ofs += sector_size) {
-			if (lseek(f_luks, ofs, SEEK_SET) != ofs) {
-				fprintf(stderr,"\nCannot seek to keyslot area.\n");
-				return EXIT_FAILURE;
-			}
-			if (read(f_luks, buffer, sector_size) != sector_size) {
-				fprintf(stderr,"\nCannot read keyslot area.\n");
-				return EXIT_FAILURE;
-			}
-			ent = ent_samp(buffer, sector_size);
-			if (ent < threshold) {
-				fprintf(out, "  low entropy at: ");
-				print_address(out, ofs);
-				fprintf(out, "   entropy: %f\n", ent);
-				if (verbose) {
-					fprintf(out, "  Binary dump:\n");
-					hexdump_sector(out, buffer, (uint64_t)ofs, sector_size);
-					fprintf(out,"\n");
-				}
-			}
+	/* test whether we can open and read device */
+	/* This is needed as we are reading the actual data
+	* in the keyslots directly from the LUKS container.
+	*/
+	dev->fd = open(dev->path, O_RDONLY);
+	if (dev->fd == -1) {
+		fprintf(stderr,"\nError: Opening of device %s failed:\n", dev->path);
+		perror(NULL);
+		dev->error = "Opening of device failed";
+		return -1;
+	}
+
+	/* now get the parameters we need via libcryptsetup */
+	/* Basically we need all active keyslots and their placement on disk */
+
+	/* first init. This does the following:
+	 *   - gets us a crypt_device struct with some values filled in
+	 *     Note: This does some init stuff we do not need, but that
+	 *     should not cause trouble.
+	 */
+
+	res = crypt_init(&cd, dev->path);
+	if (res < 0) {
+		fprintf(stderr, "crypt_init() failed. Maybe not running as root?\n");
+		dev->error = "crypt_init() failed";
+		return -1;
+	}
+
+	/* now load LUKS header into the crypt_device
+	 * This should also make sure a valid LUKS header is on disk
+	 * and hence we should be able to skip magic and version checks.
+	 * For LUKS2 the keyslot areas come from the JSON area map.
+	 */
+	res = crypt_load(cd, CRYPT_LUKS, NULL);
+	if (res < 0) {
+		fprintf(stderr, "crypt_load() failed. LUKS header too broken/absent?\n");
+		dev->error = "crypt_load() failed";
+		crypt_free(cd);
+		return -1;
+	}
+	dev->type = strcmp(crypt_get_type(cd), CRYPT_LUKS2) ? CRYPT_LUKS1 : CRYPT_LUKS2;
+
+	res = add_device(dev, cd);
+	crypt_free(cd);
+
+	return res;
+}
+
+static void print_device_json(FILE *out, struct device_scan *dev)
+{
+	int i;
+
+	fprintf(out, "\n  { \"device\": ");
+	print_json_string(out, dev->path);
+	if (dev->error) {
+		fprintf(out, ", \"error\": ");
+		print_json_string(out, dev->error);
+		fprintf(out, " }");
+		return;
+	}
+
+	fprintf(out, ", \"type\": \"%s\", \"keyslots\": [", dev->type);
+	for (i = dev->first_scan; i < dev->first_scan + dev->scans; i++) {
+		fprintf(out, "%s\n    ", i > dev->first_scan ? "," : "");
+		if (scans[i].text)
+			fwrite(scans[i].text, 1, scans[i].text_size, out);
+		else
+			fprintf(out, "{ \"keyslot\": %d, \"error\": \"Scan failed\" }",
+				scans[i].keyslot);
+	}
+	fprintf(out, " ] }");
+}
+
+static int print_results(FILE *out, struct device_scan *devs, int devs_count)
+{
+	struct device_scan *dev;
+	int i, j, r = EXIT_SUCCESS;
+
+	if (json)
+		fprintf(out, "{ \"sector_size\": %d, \"threshold\": %f, \"devices\": [",
+			sector_size, threshold);
+	else {
+		fprintf(out, "\nparameters (commandline and LUKS header):\n");
+		fprintf(out, "  sector size: %d\n", sector_size);
+		fprintf(out, "  threshold:   %0f\n\n", threshold);
+	}
+
+	for (i = 0; i < devs_count; i++) {
+		dev = &devs[i];
+		if (dev->error)
+			r = EXIT_FAILURE;
+
+		if (json) {
+			fprintf(out, "%s", i ? "," : "");
+			print_device_json(out, dev);
+		} else if (!dev->error) {
+			if (devs_count > 1)
+				fprintf(out, "%sdevice %s (%s):\n", i ? "\n" : "",
+					dev->path, dev->type);
+			for (j = dev->first_scan; j < dev->first_scan + dev->scans; j++)
+				if (scans[j].text)
+					fwrite(scans[j].text, 1, scans[j].text_size, out);
 		}
+
+		for (j = dev->first_scan; j < dev->first_scan + dev->scans; j++)
+			if (scans[j].r != EXIT_SUCCESS)
+				r = scans[j].r;
 	}
 
-	return EXIT_SUCCESS;
+	if (json)
+		fprintf(out, " ]\n}\n");
+
+	return r;
 }
 
 /* Main */
 int main(int argc, char **argv)
 {
 	/* for option processing */
-	int c, r;
-	char *device;
-
-	/* for use of libcryptsetup */
-	struct crypt_device *cd;
+	int c, r = EXIT_SUCCESS;
 
 	/* Other vars */
-	int f_luks;   /* device file for the luks device */
+	struct device_scan *devs;
+	int i, devs_count;
 	FILE *out;
 
-	/* temporary helper vars */
-	int res;
-
 	/* getopt values */
 	char *s, *end;
 	double tvalue;
@@ -258,7 +580,7 @@ int main(int argc, char **argv)
 	out = stdout;
 
 	/* get commandline parameters */
-	while ((c = getopt (argc, argv, "t:s:vd")) != -1) {
+	while ((c = getopt (argc, argv, "t:s:p:jvd")) != -1) {
 		switch (c) {
 		case 't':
 			s = optarg;
@@ -288,6 +610,18 @@ int main(int argc, char **argv)
 			}
 			sector_size = svalue;
 			break;
+		case 'p':
+			s = optarg;
+			svalue = strtol(s, &end, 10);
+			if (s == end || svalue < 1 || svalue > 1024) {
+				fprintf(stderr,"\nError: Argument to -p must be in 1 ... 1024\n");
+				exit(EXIT_FAILURE);
+			}
+			parallel = svalue;
+			break;
+		case 'j':
+			json = 1;
+			break;
 		case 'v':
 			verbose = 1;
 			break;
@@ -295,7 +629,7 @@ int main(int argc, char **argv)
 			print_decimal = 1;
 			break;
 		case '?':
-			if (optopt == 't' || optopt == 's')
+			if (optopt == 't' || optopt == 's' || optopt == 'p')
 				fprintf (stderr,"\nError: Option -%c requires an argument.\n",
 					 optopt);
 			else if (isprint (optopt)) {
@@ -312,60 +646,54 @@ int main(int argc, char **argv)
 		}
 	}
 
-	/* parse non-option stuff. Should be exactly one, the device. */
-	if (optind+1 != argc) {
-		fprintf(stderr,"\nError: exactly one non-option argument expected!\n");
+	/* parse non-option stuff. Should be one or more devices. */
+	if (optind >= argc) {
+		fprintf(stderr,"\nError: at least one non-option argument expected!\n");
 		fprintf(stderr,"\n\n%s", help);
 		exit(EXIT_FAILURE);
 	}
-	device = argv[optind];
 
-	/* test whether we can open and read device */
-	/* This is needed as we are reading the actual data
-	* in the keyslots directly from the LUKS container.
-	*/
-	f_luks = open(device, O_RDONLY);
-	if (f_luks == -1) {
-		fprintf(stderr,"\nError: Opening of device %s failed:\n", device);
-		perror(NULL);
-		exit(EXIT_FAILURE);
+	if (!parallel) {
+		parallel = sysconf(_SC_NPROCESSORS_ONLN);
+		if (parallel < 1)
+			parallel = 1;
+		else if (parallel > 1024)
+			parallel = 1024;
 	}
 
-	/* now get the parameters we need via libcryptsetup */
-	/* Basically we need all active keyslots and their placement on disk */
-
-	/* first init. This does the following:
-	 *   - gets us a crypt_device struct with some values filled in
-	 *     Note: This does some init stuff we do not need, but that
-	 *     should not cause trouble.
-	 */
-
-	res = crypt_init(&cd, device);
-	if (res < 0) {
-		fprintf(stderr, "crypt_init() failed. Maybe not running as root?\n");
-		close(f_luks);
-		exit(EXIT_FAILURE);
+	/* small sectors are common, avoid log2() for every symbol */
+	if (sector_size <= 65536 && (nlog2n = malloc((sector_size + 1) * sizeof(*nlog2n)))) {
+		nlog2n[0] = 0.0;
+		for (i = 1; i <= sector_size; i++)
+			nlog2n[i] = i * log2(i);
 	}
 
-	/* now load LUKS header into the crypt_device
-	 * This should also make sure a valid LUKS1 header is on disk
-	 * and hence we should be able to skip magic and version checks.
-	 */
-	res = crypt_load(cd, CRYPT_LUKS1, NULL);
-	if (res < 0) {
-		fprintf(stderr, "crypt_load() failed. LUKS header too broken/absent?\n");
-		crypt_free(cd);
-		close(f_luks);
+	devs_count = argc - optind;
+	devs = calloc(devs_count, sizeof(*devs));
+	if (!devs)
 		exit(EXIT_FAILURE);
+
+	/* headers are parsed in main thread, only area scans run in parallel */
+	for (i = 0; i < devs_count; i++) {
+		devs[i].path = argv[optind + i];
+		devs[i].fd = -1;
+		if (open_device(&devs[i]) < 0)
+			r = EXIT_FAILURE;
 	}
 
-	fprintf(out, "\nparameters (commandline and LUKS header):\n");
-	fprintf(out, "  sector size: %d\n", sector_size);
-	fprintf(out, "  threshold:   %0f\n\n", threshold);
+	run_scans();
 
-	r = check_keyslots(out, cd, f_luks);
+	if (print_results(out, devs, devs_count) != EXIT_SUCCESS)
+		r = EXIT_FAILURE;
+
+	for (i = 0; i < scans_count; i++)
+		free(scans[i].text);
+	free(scans);
+	for (i = 0; i < devs_count; i++)
+		if (devs[i].fd != -1)
+			close(devs[i].fd);
+	free(devs);
+	free(nlog2n);
 
-	crypt_free(cd);
-	close(f_luks);
 	return r;
 }
@@ -21,6 +21,9 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
 #include <uuid/uuid.h>
 
 #include "cryptsetup.h"
@@ -31,6 +34,8 @@ static char *keyfile_stdin = NULL;
 
 static int keyfiles_count = 0;
 static int64_t data_shift = 0;
+/* --sector-size auto-bench */
+static bool sector_size_bench = false;
 
 static const char *device_type = "luks";
 static const char *set_pbkdf = NULL;
@@ -158,6 +163,26 @@ static void _set_reencryption_flags(uint32_t *flags)
 
 	if (ARG_SET(OPT_RESUME_ONLY_ID))
 		*flags |= CRYPT_REENCRYPT_RESUME_ONLY;
+
+	if (ARG_SET(OPT_HOTZONE_ADAPTIVE_ID))
+		*flags |= CRYPT_REENCRYPT_ADAPTIVE_HOTZONE;
+
+	if (ARG_SET(OPT_SKIP_UNALLOCATED_ID))
+		*flags |= CRYPT_REENCRYPT_SKIP_UNALLOCATED;
+
+	if (ARG_SET(OPT_KCAPI_ZEROCOPY_ID))
+		*flags |= CRYPT_REENCRYPT_KCAPI_ZEROCOPY;
+
+	if (ARG_SET(OPT_ALLOW_CRC32C_ID))
+		*flags |= CRYPT_REENCRYPT_ALLOW_CRC32C;
+}
+
+static int _set_resilience_device(struct crypt_device *cd)
+{
+	if (!ARG_SET(OPT_RESILIENCE_DEVICE_ID))
+		return 0;
+
+	return crypt_reencrypt_set_journal_device(cd, ARG_STR(OPT_RESILIENCE_DEVICE_ID));
 }
 
 static int _set_keyslot_encryption_params(struct crypt_device *cd)
@@ -695,6 +720,41 @@ out:
 	return r;
 }
 
+/* Helper devices (SUBDEV) are removed together with their parent device */
+static int action_close_all(uint32_t flags)
+{
+	struct crypt_active_device_entry *entries;
+	const char **names;
+	size_t i, count, names_count = 0;
+	int r;
+
+	r = crypt_list_active_devices(NULL, &entries, &count);
+	if (r < 0)
+		return r;
+
+	if (!count) {
+		log_dbg("No active devices to close.");
+		crypt_free_active_devices(entries, count);
+		return 0;
+	}
+
+	names = malloc(count * sizeof(*names));
+	if (!names) {
+		crypt_free_active_devices(entries, count);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < count; i++)
+		if (strcmp(entries[i].type, "SUBDEV"))
+			names[names_count++] = entries[i].name;
+
+	r = names_count ? crypt_deactivate_by_names(names, names_count, flags) : 0;
+
+	free(names);
+	crypt_free_active_devices(entries, count);
+	return r;
+}
+
 static int action_close(void)
 {
 	struct crypt_device *cd = NULL;
@@ -707,6 +767,9 @@ static int action_close(void)
 	if (ARG_SET(OPT_CANCEL_DEFERRED_ID))
 		flags |= CRYPT_DEACTIVATE_DEFERRED_CANCEL;
 
+	if (ARG_SET(OPT_ALL_ID))
+		return action_close_all(flags);
+
 	r = crypt_init_by_name(&cd, action_argv[0]);
 	if (r == 0)
 		r = crypt_deactivate_by_name(cd, action_argv[0], flags);
@@ -960,6 +1023,256 @@ static int benchmark_cipher_loop(const char *cipher, const char *cipher_mode,
 	return r;
 }
 
+#define BENCHMARK_LIST_MAX 16
+
+static bool benchmark_storage_mode(void)
+{
+	return ARG_SET(OPT_SECTOR_SIZE_ID) || sector_size_bench || ARG_SET(OPT_THREADS_ID) ||
+	       ARG_SET(OPT_BUFFER_SIZE_ID) || ARG_SET(OPT_DMCRYPT_ID) ||
+	       ARG_SET(OPT_JSON_ID);
+}
+
+/* comma separated list of sizes (with optional unit) */
+static int benchmark_parse_list(const char *str, uint64_t *values, int max)
+{
+	char *list, *item, *save = NULL;
+	int count = 0;
+
+	if (!(list = strdup(str)))
+		return -ENOMEM;
+
+	for (item = strtok_r(list, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		if (count == max || tools_string_to_size(item, &values[count]) || !values[count]) {
+			count = -EINVAL;
+			break;
+		}
+		count++;
+	}
+
+	free(list);
+	return count ?: -EINVAL;
+}
+
+/*
+ * Argon2 reads two blocks and writes one for every block in each pass,
+ * the result is an estimate of memory bandwidth used by the computation.
+ */
+static double benchmark_argon2_mibs(uint32_t memory_kb, uint32_t iterations, uint64_t us)
+{
+	return us ? (double)memory_kb * iterations * 3 * 1000000 / 1024 / us : 0;
+}
+
+/* Argon2 cost surface, memory sizes x thread counts x iterations */
+static int action_benchmark_pbkdf_sweep(const char *kdf, size_t key_size)
+{
+	uint64_t memory[BENCHMARK_LIST_MAX] = { 64 * 1024 * 1024, 256 * 1024 * 1024, 1024 * 1024 * 1024 };
+	uint64_t threads[BENCHMARK_LIST_MAX] = { 1, 2, 4 };
+	uint64_t iterations[BENCHMARK_LIST_MAX] = { 4 };
+	int memory_count = 3, threads_count = 3, iterations_count = 1;
+	int i, j, k, r = 0, failed = 0, total = 0;
+	uint64_t min_us, avg_us;
+	bool first = true;
+	struct crypt_pbkdf_type pbkdf = {
+		.type = kdf,
+	};
+
+	if (strncmp(kdf, "argon2", 6)) {
+		log_err(_("PBKDF sweep is supported only for Argon2."));
+		return -EINVAL;
+	}
+
+	if (!ARG_UINT32(OPT_PBKDF_SWEEP_REPEAT_ID)) {
+		log_err(_("Invalid PBKDF sweep specification."));
+		return -EINVAL;
+	}
+
+	if ((ARG_SET(OPT_PBKDF_SWEEP_MEMORY_ID) &&
+	     (memory_count = benchmark_parse_list(ARG_STR(OPT_PBKDF_SWEEP_MEMORY_ID), memory, BENCHMARK_LIST_MAX)) < 0) ||
+	    (ARG_SET(OPT_THREADS_ID) &&
+	     (threads_count = benchmark_parse_list(ARG_STR(OPT_THREADS_ID), threads, BENCHMARK_LIST_MAX)) < 0) ||
+	    (ARG_SET(OPT_PBKDF_SWEEP_ITERATIONS_ID) &&
+	     (iterations_count = benchmark_parse_list(ARG_STR(OPT_PBKDF_SWEEP_ITERATIONS_ID), iterations, BENCHMARK_LIST_MAX)) < 0)) {
+		log_err(_("Invalid PBKDF sweep specification."));
+		return -EINVAL;
+	}
+
+	for (i = 0; i < BENCHMARK_LIST_MAX; i++)
+		if ((i < memory_count && (memory[i] < 1024 || memory[i] / 1024 > UINT32_MAX)) ||
+		    (i < threads_count && threads[i] > UINT32_MAX) ||
+		    (i < iterations_count && iterations[i] > UINT32_MAX)) {
+			log_err(_("Invalid PBKDF sweep specification."));
+			return -EINVAL;
+		}
+
+	for (i = 0; i < memory_count; i++)
+		for (j = 0; j < threads_count; j++)
+			for (k = 0; k < iterations_count; k++) {
+				pbkdf.max_memory_kb = memory[i] / 1024;
+				pbkdf.parallel_threads = threads[j];
+				pbkdf.iterations = iterations[k];
+
+				r = crypt_benchmark_pbkdf_cost(NULL, &pbkdf, "foo", 3,
+					"0123456789abcdef0123456789abcdef", 32, key_size,
+					ARG_UINT32(OPT_PBKDF_SWEEP_WARMUP_ID),
+					ARG_UINT32(OPT_PBKDF_SWEEP_REPEAT_ID), &min_us, &avg_us);
+				check_signal(&r);
+				if (r == -EINTR)
+					goto out;
+
+				log_std("%s\n  { \"pbkdf\": \"%s\", \"memory_kb\": %u, \"threads\": %u, "
+					"\"iterations\": %u, \"runs\": %u, ", first ? "[" : ",", kdf,
+					pbkdf.max_memory_kb, pbkdf.parallel_threads, pbkdf.iterations,
+					ARG_UINT32(OPT_PBKDF_SWEEP_REPEAT_ID));
+				if (r)
+					log_std("\"time_ms_min\": null, \"time_ms_avg\": null, \"memory_mibs\": null }");
+				else
+					log_std("\"time_ms_min\": %.3f, \"time_ms_avg\": %.3f, \"memory_mibs\": %.1f }",
+						min_us / 1000.0, avg_us / 1000.0,
+						benchmark_argon2_mibs(pbkdf.max_memory_kb, pbkdf.iterations, min_us));
+				first = false;
+				if (r)
+					failed++;
+				total++;
+			}
+out:
+	log_std("%s\n", first ? "[]" : "\n]");
+
+	return (r == -EINTR) ? r : (failed == total ? -ENOENT : 0);
+}
+
+static bool benchmark_json_first = true;
+
+static void benchmark_storage_print(const char *cipher, const char *cipher_mode,
+				    size_t key_size, uint32_t sector_size, uint32_t threads,
+				    size_t buffer_size, int r, double enc_mbr, double dec_mbr)
+{
+	char enc[32], dec[32], alg[MAX_CIPHER_LEN * 2 + 1];
+
+	snprintf(alg, sizeof(alg), "%s-%s", cipher, cipher_mode);
+
+	if (!ARG_SET(OPT_JSON_ID)) {
+		if (r)
+			log_std("%22s  %9zub  %6u  %7u  %8zuK %17s %17s\n", alg, key_size * 8,
+				sector_size, threads, buffer_size / 1024, _("N/A"), _("N/A"));
+		else
+			log_std("%22s  %9zub  %6u  %7u  %8zuK  %10.1f MiB/s  %10.1f MiB/s\n",
+				alg, key_size * 8, sector_size, threads, buffer_size / 1024,
+				enc_mbr, dec_mbr);
+		return;
+	}
+
+	if (r) {
+		strcpy(enc, "null");
+		strcpy(dec, "null");
+	} else {
+		snprintf(enc, sizeof(enc), "%.1f", enc_mbr);
+		snprintf(dec, sizeof(dec), "%.1f", dec_mbr);
+	}
+
+	log_std("%s\n  { \"cipher\": \"%s\", \"key_bits\": %zu, \"sector_size\": %u, "
+		"\"threads\": %u, \"buffer_size\": %zu, \"dmcrypt\": %s, "
+		"\"encryption_mbs\": %s, \"decryption_mbs\": %s }",
+		benchmark_json_first ? "[" : ",", alg, key_size * 8, sector_size,
+		threads, buffer_size, ARG_SET(OPT_DMCRYPT_ID) ? "true" : "false", enc, dec);
+	benchmark_json_first = false;
+}
+
+/*
+ * Sweep over sector sizes, thread counts and buffer sizes
+ * with the same code as used for data processing (or dm-crypt).
+ */
+static int benchmark_storage_sweep(const char *cipher, const char *cipher_mode, size_t key_size)
+{
+	uint64_t sector_sizes[BENCHMARK_LIST_MAX] = { SECTOR_SIZE, MAX_SECTOR_SIZE };
+	uint64_t threads[BENCHMARK_LIST_MAX] = { 1 };
+	uint64_t buffer_sizes[BENCHMARK_LIST_MAX] = { 1024 * 1024 };
+	int sector_sizes_count = 2, threads_count = 1, buffer_sizes_count = 1;
+	int i, j, k, r, failed = 0, total = 0;
+	double enc_mbr, dec_mbr;
+	uint32_t flags = ARG_SET(OPT_DMCRYPT_ID) ? CRYPT_BENCHMARK_DMCRYPT : 0;
+
+	if (ARG_SET(OPT_SECTOR_SIZE_ID)) {
+		sector_sizes[0] = ARG_UINT32(OPT_SECTOR_SIZE_ID);
+		sector_sizes_count = 1;
+	} else if (sector_size_bench) {
+		/* the same measurement as luksFormat --sector-size auto-bench */
+		for (sector_sizes_count = 0; (SECTOR_SIZE << sector_sizes_count) <= MAX_SECTOR_SIZE; sector_sizes_count++)
+			sector_sizes[sector_sizes_count] = SECTOR_SIZE << sector_sizes_count;
+		flags = CRYPT_BENCHMARK_DMCRYPT;
+	}
+
+	if (ARG_SET(OPT_THREADS_ID) &&
+	    (threads_count = benchmark_parse_list(ARG_STR(OPT_THREADS_ID), threads, BENCHMARK_LIST_MAX)) < 0) {
+		log_err(_("Invalid benchmark threads specification."));
+		return -EINVAL;
+	}
+
+	if (ARG_SET(OPT_BUFFER_SIZE_ID) &&
+	    (buffer_sizes_count = benchmark_parse_list(ARG_STR(OPT_BUFFER_SIZE_ID), buffer_sizes, BENCHMARK_LIST_MAX)) < 0) {
+		log_err(_("Invalid benchmark buffer size specification."));
+		return -EINVAL;
+	}
+
+	for (i = 0; i < sector_sizes_count; i++)
+		for (j = 0; j < threads_count; j++)
+			for (k = 0; k < buffer_sizes_count; k++) {
+				r = crypt_benchmark_storage(NULL, cipher, cipher_mode, key_size,
+					sector_sizes[i], threads[j], buffer_sizes[k], flags,
+					&enc_mbr, &dec_mbr);
+				check_signal(&r);
+				if (r == -EINTR)
+					return r;
+				benchmark_storage_print(cipher, cipher_mode, key_size, sector_sizes[i],
+					threads[j], buffer_sizes[k], r, enc_mbr, dec_mbr);
+				if (r)
+					failed++;
+				total++;
+			}
+
+	return failed == total ? -ENOENT : 0;
+}
+
+static int action_benchmark_storage(const char *cipher, const char *cipher_mode, size_t key_size)
+{
+	static struct {
+		const char *cipher;
+		const char *mode;
+		size_t key_size;
+	} bciphers[] = {
+		{ "aes",     "cbc-essiv:sha256", 32 },
+		{ "aes",     "xts-plain64",      32 },
+		{ "aes",     "xts-plain64",      64 },
+		{ "serpent", "xts-plain64",      64 },
+		{ "twofish", "xts-plain64",      64 },
+		{  NULL, NULL, 0 }
+	};
+	int i, r, skipped = 0;
+
+	if (!ARG_SET(OPT_JSON_ID))
+		/* TRANSLATORS: The string is header of a table and must be exactly (right side) aligned. */
+		log_std(_("#            Algorithm |       Key | Sector | Threads |   Buffer |      Encryption |      Decryption\n"));
+
+	if (cipher)
+		r = benchmark_storage_sweep(cipher, cipher_mode, key_size);
+	else for (i = 0; bciphers[i].cipher; i++) {
+		r = benchmark_storage_sweep(bciphers[i].cipher, bciphers[i].mode,
+					    ARG_SET(OPT_KEY_SIZE_ID) ? key_size : bciphers[i].key_size);
+		if (r == -EINTR || r == -EINVAL)
+			break;
+		if (r == -ENOENT)
+			skipped++;
+		r = (skipped && skipped == i + 1) ? -ENOENT : 0;
+	}
+
+	if (ARG_SET(OPT_JSON_ID))
+		log_std("%s\n", benchmark_json_first ? "[]" : "\n]");
+
+	if (r == -ENOENT && (ARG_SET(OPT_DMCRYPT_ID) || sector_size_bench))
+		log_err(_("Cannot create temporary dm-crypt device for benchmark."));
+
+	return r;
+}
+
 static int action_benchmark(void)
 {
 	static struct {
@@ -1001,8 +1314,25 @@ static int action_benchmark(void)
 	char *c;
 	int i, r;
 
-	log_std(_("# Tests are approximate using memory only (no storage IO).\n"));
-	if (set_pbkdf || ARG_SET(OPT_HASH_ID)) {
+	if (ARG_SET(OPT_PBKDF_SWEEP_ID))
+		return action_benchmark_pbkdf_sweep(set_pbkdf ?: CRYPT_KDF_ARGON2ID, key_size);
+
+	if (!ARG_SET(OPT_JSON_ID))
+		log_std(_("# Tests are approximate using memory only (no storage IO).\n"));
+	if (benchmark_storage_mode()) {
+		if (ARG_SET(OPT_CIPHER_ID)) {
+			r = crypt_parse_name_and_mode(ARG_STR(OPT_CIPHER_ID), cipher, NULL, cipher_mode);
+			if (r < 0) {
+				log_err(_("No known cipher specification pattern detected."));
+				return r;
+			}
+			/* Sector encryption needs IV generator */
+			if (!strchr(cipher_mode, '-') && strcmp(cipher_mode, "ecb"))
+				strncat(cipher_mode, "-plain64", MAX_CIPHER_LEN - strlen(cipher_mode) - 1);
+			r = action_benchmark_storage(cipher, cipher_mode, key_size);
+		} else
+			r = action_benchmark_storage(NULL, NULL, key_size);
+	} else if (set_pbkdf || ARG_SET(OPT_HASH_ID)) {
 		if (!set_pbkdf && ARG_SET(OPT_HASH_ID))
 			set_pbkdf = CRYPT_KDF_PBKDF2;
 		r = action_benchmark_kdf(set_pbkdf, ARG_STR(OPT_HASH_ID), key_size);
@@ -1219,7 +1549,8 @@ static int _wipe_data_device(struct crypt_device *cd)
 	int r;
 	struct tools_progress_params prog_parms = {
 		.frequency = ARG_UINT32(OPT_PROGRESS_FREQUENCY_ID),
-		.batch_mode = ARG_SET(OPT_BATCH_MODE_ID)
+		.batch_mode = ARG_SET(OPT_BATCH_MODE_ID),
+		.json = ARG_SET(OPT_PROGRESS_JSON_ID)
 	};
 
 	if (!ARG_SET(OPT_BATCH_MODE_ID))
@@ -1235,6 +1566,9 @@ static int _wipe_data_device(struct crypt_device *cd)
 	if (snprintf(tmp_path, sizeof(tmp_path), "%s/%s", crypt_get_dir(), tmp_name) < 0)
 		return -EINVAL;
 
+	if ((r = tools_set_numa_node(cd, ARG_SET(OPT_NUMA_NODE_ID), ARG_INT32(OPT_NUMA_NODE_ID))))
+		return r;
+
 	r = crypt_activate_by_volume_key(cd, tmp_name, NULL, 0,
 		CRYPT_ACTIVATE_PRIVATE | CRYPT_ACTIVATE_NO_JOURNAL);
 	if (r < 0)
@@ -1303,7 +1637,7 @@ static int _luksFormat(struct crypt_device **r_cd, char **r_password, size_t *r_
 	} else if (isLUKS1(type)) {
 		params = &params1;
 
-		if (ARG_UINT32(OPT_SECTOR_SIZE_ID) > SECTOR_SIZE) {
+		if (ARG_UINT32(OPT_SECTOR_SIZE_ID) > SECTOR_SIZE || sector_size_bench) {
 			log_err(_("Unsupported encryption sector size."));
 			return -EINVAL;
 		}
@@ -1405,6 +1739,18 @@ static int _luksFormat(struct crypt_device **r_cd, char **r_password, size_t *r_
 
 	keysize = get_adjusted_key_size(cipher_mode, DEFAULT_LUKS1_KEYBITS, integrity_keysize);
 
+	if (sector_size_bench) {
+		r = crypt_benchmark_sector_size(cd, ARG_SET(OPT_HEADER_ID) ? action_argv[0] : NULL,
+						cipher, cipher_mode, keysize - integrity_keysize,
+						&params2.sector_size);
+		check_signal(&r);
+		if (r < 0) {
+			log_err(_("Cannot benchmark encryption sector size."));
+			goto out;
+		}
+		log_verbose(_("Using encryption sector size %u bytes."), params2.sector_size);
+	}
+
 	if (ARG_SET(OPT_USE_RANDOM_ID))
 		crypt_set_rng_type(cd, CRYPT_RNG_RANDOM);
 	else if (ARG_SET(OPT_USE_URANDOM_ID))
@@ -1477,6 +1823,60 @@ static int action_luksFormat(void)
 	return _luksFormat(NULL, NULL, NULL);
 }
 
+static void _print_timing(struct crypt_device *cd)
+{
+	struct crypt_operation_stats st;
+
+	if (!ARG_SET(OPT_TIMING_ID) || crypt_get_last_operation_stats(cd, &st))
+		return;
+
+	log_std(_("Activation timing (ms):\n"));
+	log_std("  %-14s %" PRIu64 ".%03" PRIu64 "\n", _("header load"), st.load_usec / 1000, st.load_usec % 1000);
+	log_std("  %-14s %" PRIu64 ".%03" PRIu64 "\n", _("token"), st.token_usec / 1000, st.token_usec % 1000);
+	log_std("  %-14s %" PRIu64 ".%03" PRIu64 " (%" PRIu32 "x)\n", _("PBKDF"),
+		st.kdf_usec / 1000, st.kdf_usec % 1000, st.kdf_count);
+	log_std("  %-14s %" PRIu64 ".%03" PRIu64 "\n", _("device-mapper"), st.dm_usec / 1000, st.dm_usec % 1000);
+	log_std("  %-14s %" PRIu64 ".%03" PRIu64 "\n", _("udev wait"), st.udev_usec / 1000, st.udev_usec % 1000);
+	log_std("  %-14s %" PRIu64 ".%03" PRIu64 "\n", _("activation"), st.total_usec / 1000, st.total_usec % 1000);
+}
+
+static uint32_t _perf_profile(void)
+{
+	if (!strcmp(ARG_STR(OPT_PERF_PROFILE_ID), "latency"))
+		return CRYPT_PERF_PROFILE_LATENCY;
+	if (!strcmp(ARG_STR(OPT_PERF_PROFILE_ID), "throughput"))
+		return CRYPT_PERF_PROFILE_THROUGHPUT;
+	return CRYPT_PERF_PROFILE_AUTO;
+}
+
+/* Failed probe is not fatal, device is activated with requested flags only */
+static int _activate_perf_profile(struct crypt_device *cd, const char *activated_name,
+				  const char *key, size_t keysize, uint32_t *activate_flags)
+{
+	uint32_t flags;
+	int r;
+
+	/* volume key from file is not verified yet */
+	r = crypt_volume_key_verify(cd, key, keysize);
+	if (r < 0)
+		return r;
+
+	r = crypt_benchmark_perf_flags(cd, key, keysize, _perf_profile(), &flags);
+	if (r < 0)
+		log_std(_("Cannot probe dm-crypt performance flags, using default flags.\n"));
+	else {
+		log_verbose(_("Selected dm-crypt performance flags:%s%s%s%s."),
+			flags & CRYPT_ACTIVATE_SAME_CPU_CRYPT ? " same_cpu_crypt" : "",
+			flags & CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS ? " submit_from_crypt_cpus" : "",
+			flags & CRYPT_ACTIVATE_NO_READ_WORKQUEUE ? " no_read_workqueue" : "",
+			flags & CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE ? " no_write_workqueue" : "",
+			flags ? "" : " none");
+		*activate_flags |= flags;
+	}
+
+	return crypt_activate_by_volume_key(cd, activated_name, key, keysize, *activate_flags);
+}
+
 static int action_open_luks(void)
 {
 	struct crypt_active_device cad;
@@ -1486,7 +1886,7 @@ static int action_open_luks(void)
 	uint32_t activate_flags = 0;
 	int r, keysize, tries;
 	char *password = NULL;
-	size_t passwordLen;
+	size_t passwordLen, key_size;
 
 	if (ARG_SET(OPT_REFRESH_ID)) {
 		activated_name = action_argc > 1 ? action_argv[1] : action_argv[0];
@@ -1517,6 +1917,9 @@ static int action_open_luks(void)
 
 	_set_activation_flags(&activate_flags);
 
+	if (ARG_SET(OPT_VOLUME_KEY_HANDOFF_ID))
+		crypt_volume_key_handoff(cd, ARG_UINT32(OPT_VOLUME_KEY_HANDOFF_ID));
+
 	if (ARG_SET(OPT_MASTER_KEY_FILE_ID)) {
 		keysize = crypt_get_volume_key_size(cd);
 		if (!keysize && !ARG_SET(OPT_KEY_SIZE_ID)) {
@@ -1529,8 +1932,39 @@ static int action_open_luks(void)
 		r = tools_read_mk(ARG_STR(OPT_MASTER_KEY_FILE_ID), &key, keysize);
 		if (r < 0)
 			goto out;
-		r = crypt_activate_by_volume_key(cd, activated_name,
-						 key, keysize, activate_flags);
+		if (ARG_SET(OPT_PERF_PROFILE_ID) && activated_name)
+			r = _activate_perf_profile(cd, activated_name, key, keysize, &activate_flags);
+		else
+			r = crypt_activate_by_volume_key(cd, activated_name,
+							 key, keysize, activate_flags);
+	} else if (ARG_SET(OPT_PERF_PROFILE_ID)) {
+		/* probe needs volume key, token unlock cannot provide it */
+		key_size = crypt_get_volume_key_size(cd);
+		if (!(key = crypt_safe_alloc(key_size))) {
+			r = -ENOMEM;
+			goto out;
+		}
+
+		tries = _set_tries_tty();
+		do {
+			r = tools_get_key(NULL, &password, &passwordLen,
+					ARG_UINT64(OPT_KEYFILE_OFFSET_ID), ARG_UINT32(OPT_KEYFILE_SIZE_ID), ARG_STR(OPT_KEY_FILE_ID),
+					ARG_UINT32(OPT_TIMEOUT_ID), _verify_passphrase(0), 0, cd);
+			if (r < 0)
+				goto out;
+
+			key_size = crypt_get_volume_key_size(cd);
+			r = crypt_volume_key_get(cd, ARG_INT32(OPT_KEY_SLOT_ID), key, &key_size,
+						 password, passwordLen);
+			tools_keyslot_msg(r, UNLOCKED);
+			tools_passphrase_msg(r);
+			check_signal(&r);
+			crypt_safe_free(password);
+			password = NULL;
+		} while ((r == -EPERM || r == -ERANGE) && (--tries > 0));
+
+		if (r >= 0)
+			r = _activate_perf_profile(cd, activated_name, key, key_size, &activate_flags);
 	} else {
 		r = crypt_activate_by_token(cd, activated_name, ARG_INT32(OPT_TOKEN_ID_ID), NULL, activate_flags);
 		tools_keyslot_msg(r, UNLOCKED);
@@ -1567,6 +2001,9 @@ static int action_open_luks(void)
 		} while ((r == -EPERM || r == -ERANGE) && (--tries > 0));
 	}
 out:
+	if (cd)
+		_print_timing(cd);
+
 	if (r >= 0 && ARG_SET(OPT_PERSISTENT_ID) &&
 	    (crypt_get_active_device(cd, activated_name, &cad) ||
 	     crypt_persistent_flags_set(cd, CRYPT_FLAGS_ACTIVATION, cad.flags & activate_flags)))
@@ -1797,6 +2234,75 @@ out:
 	return r;
 }
 
+/* maximal number of LUKS2 keyslots */
+#define ADDKEY_BATCH_MAX 32
+
+/*
+ * Every batch file line contains new key file and optional keyslot number,
+ * all keyslots are added with one metadata write.
+ */
+static int luksAddKeyBatch(struct crypt_device *cd)
+{
+	char buf[4200], key_file[4096], *passwords[ADDKEY_BATCH_MAX] = {}, *password = NULL;
+	size_t password_sizes[ADDKEY_BATCH_MAX], password_size = 0, count = 0, i;
+	int keyslots[ADDKEY_BATCH_MAX], keyslot, n, r = 0;
+	unsigned int line = 0;
+	FILE *f;
+
+	if (!(f = fopen(ARG_STR(OPT_BATCH_FILE_ID), "r"))) {
+		log_err(_("Cannot open batch file %s."), ARG_STR(OPT_BATCH_FILE_ID));
+		return -EINVAL;
+	}
+
+	while (!r && fgets(buf, sizeof(buf), f)) {
+		line++;
+		keyslot = CRYPT_ANY_SLOT;
+		n = sscanf(buf, " %4095s %d", key_file, &keyslot);
+		if (n < 1 || key_file[0] == '#')
+			continue;
+		if (tools_is_stdin(key_file) || count == ADDKEY_BATCH_MAX) {
+			log_err(_("Invalid batch file line %u."), line);
+			r = -EINVAL;
+			break;
+		}
+
+		r = tools_get_key(NULL, &passwords[count], &password_sizes[count],
+				  ARG_UINT64(OPT_NEW_KEYFILE_OFFSET_ID), ARG_UINT32(OPT_NEW_KEYFILE_SIZE_ID),
+				  key_file, ARG_UINT32(OPT_TIMEOUT_ID), 0, 0, cd);
+		keyslots[count++] = keyslot;
+	}
+	fclose(f);
+
+	if (!r && !count) {
+		log_err(_("No key file found in batch file %s."), ARG_STR(OPT_BATCH_FILE_ID));
+		r = -EINVAL;
+	}
+	if (r < 0)
+		goto out;
+
+	r = tools_get_key(_("Enter any existing passphrase: "),
+		      &password, &password_size,
+		      ARG_UINT64(OPT_KEYFILE_OFFSET_ID), ARG_UINT32(OPT_KEYFILE_SIZE_ID), ARG_STR(OPT_KEY_FILE_ID),
+		      ARG_UINT32(OPT_TIMEOUT_ID), _verify_passphrase(0), 0, cd);
+	if (r < 0)
+		goto out;
+
+	r = crypt_keyslot_add_by_passphrase_batch(cd, password, password_size,
+			(const char * const *)passwords, password_sizes, keyslots, count);
+	check_signal(&r);
+	tools_passphrase_msg(r);
+	if (r < 0)
+		goto out;
+
+	for (i = 0; i < count; i++)
+		tools_keyslot_msg(keyslots[i], CREATED);
+out:
+	for (i = 0; i < count; i++)
+		crypt_safe_free(passwords[i]);
+	crypt_safe_free(password);
+	return r;
+}
+
 static int action_luksAddKey(void)
 {
 	int r = -EINVAL, keysize = 0;
@@ -1834,7 +2340,11 @@ static int action_luksAddKey(void)
 		goto out;
 	}
 
-	if (ARG_SET(OPT_MASTER_KEY_FILE_ID)) {
+	if (ARG_SET(OPT_BATCH_FILE_ID)) {
+		r = luksAddKeyBatch(cd);
+		crypt_free(cd);
+		return r;
+	} else if (ARG_SET(OPT_MASTER_KEY_FILE_ID)) {
 		if (!keysize && !ARG_SET(OPT_KEY_SIZE_ID)) {
 			log_err(_("Cannot determine volume key size for LUKS without keyslots, please use --key-size option."));
 			r = -EINVAL;
@@ -2034,7 +2544,8 @@ static int action_isLuks(void)
 		goto out;
 
 	crypt_set_log_callback(cd, quiet_log, &log_parms);
-	r = crypt_load(cd, luksType(device_type), NULL);
+	/* binary headers only, full load only if LUKS2 header copies differ */
+	r = crypt_luks_probe(cd, luksType(device_type), CRYPT_LUKS_PROBE_STRICT, NULL, NULL, 0);
 out:
 	crypt_free(cd);
 	return r;
@@ -2043,25 +2554,26 @@ out:
 static int action_luksUUID(void)
 {
 	struct crypt_device *cd = NULL;
-	const char *existing_uuid = NULL;
+	char uuid[40];
 	int r;
 
 	if ((r = crypt_init(&cd, uuid_or_device_header(NULL))))
 		goto out;
 
+	if (!ARG_SET(OPT_UUID_ID)) {
+		r = crypt_luks_probe(cd, luksType(device_type), CRYPT_LUKS_PROBE_STRICT, NULL, uuid, sizeof(uuid));
+		if (!r)
+			log_std("%s\n", uuid);
+		goto out;
+	}
+
 	if (!ARG_SET(OPT_BATCH_MODE_ID))
 		crypt_set_confirm_callback(cd, yesDialog, _("Operation aborted.\n"));
 
 	if ((r = crypt_load(cd, luksType(device_type), NULL)))
 		goto out;
 
-	if (ARG_SET(OPT_UUID_ID))
-		r = crypt_set_uuid(cd, ARG_STR(OPT_UUID_ID));
-	else {
-		existing_uuid = crypt_get_uuid(cd);
-		log_std("%s\n", existing_uuid ?: "");
-		r = existing_uuid ? 0 : 1;
-	}
+	r = crypt_set_uuid(cd, ARG_STR(OPT_UUID_ID));
 out:
 	crypt_free(cd);
 	return r;
@@ -2269,6 +2781,9 @@ static int action_luksResume(void)
 		goto out;
 	}
 
+	if (ARG_SET(OPT_VOLUME_KEY_HANDOFF_ID))
+		crypt_volume_key_handoff(cd, ARG_UINT32(OPT_VOLUME_KEY_HANDOFF_ID));
+
 	tries = _set_tries_tty();
 	do {
 		r = tools_get_key(NULL, &password, &passwordLen,
@@ -2368,27 +2883,596 @@ static const char *_get_device_type(void)
 	return type;
 }
 
-static int action_open(void)
+static int open_batch_device(const char *name, const char *device, const char *key_file)
 {
-	int r = -EINVAL;
+	struct crypt_device *cd = NULL;
+	uint32_t activate_flags = 0;
+	char *password = NULL;
+	size_t passwordLen;
+	int r, tries;
 
-	if (ARG_SET(OPT_REFRESH_ID) && !device_type)
-		/* read device type from active mapping */
-		device_type = _get_device_type();
+	if ((r = crypt_init(&cd, device)))
+		goto out;
 
-	if (!device_type)
-		return -EINVAL;
+	if ((r = crypt_load(cd, luksType(device_type), NULL))) {
+		log_err(_("Device %s is not a valid LUKS device."), device);
+		goto out;
+	}
 
-	if (!strcmp(device_type, "luks") ||
-	    !strcmp(device_type, "luks1") ||
-	    !strcmp(device_type, "luks2")) {
-		if (action_argc < 2 && (!ARG_SET(OPT_TEST_PASSPHRASE_ID) && !ARG_SET(OPT_REFRESH_ID)))
-			goto out;
-		return action_open_luks();
-	} else if (!strcmp(device_type, "plain")) {
-		if (action_argc < 2 && !ARG_SET(OPT_REFRESH_ID))
+	_set_activation_flags(&activate_flags);
+
+	if (key_file) {
+		r = crypt_activate_by_keyfile_device_offset(cd, name, CRYPT_ANY_SLOT,
+			key_file, 0, 0, activate_flags);
+		tools_keyslot_msg(r, UNLOCKED);
+		tools_passphrase_msg(r);
+		goto out;
+	}
+
+	r = crypt_activate_by_token(cd, name, CRYPT_ANY_TOKEN, NULL, activate_flags);
+	tools_keyslot_msg(r, UNLOCKED);
+	if (r >= 0)
+		goto out;
+
+	tries = _set_tries_tty();
+	do {
+		r = tools_get_key(NULL, &password, &passwordLen, 0, 0, NULL,
+				ARG_UINT32(OPT_TIMEOUT_ID), _verify_passphrase(0), 0, cd);
+		if (r < 0)
 			goto out;
-		return action_open_plain();
+
+		r = crypt_activate_by_passphrase(cd, name, CRYPT_ANY_SLOT,
+			password, passwordLen, activate_flags);
+		tools_keyslot_msg(r, UNLOCKED);
+		tools_passphrase_msg(r);
+		check_signal(&r);
+		crypt_safe_free(password);
+		password = NULL;
+	} while ((r == -EPERM || r == -ERANGE) && (--tries > 0));
+out:
+	crypt_safe_free(password);
+	crypt_free(cd);
+	return r;
+}
+
+/* Devices without key file and token waiting for shared passphrase */
+struct batch_shared {
+	struct crypt_activate_volume *volumes;
+	size_t count;
+	size_t size;
+};
+
+/* Returns 1 if device was queued for shared passphrase */
+static int open_batch_device_shared(struct batch_shared *bs, const char *name, const char *device)
+{
+	struct crypt_activate_volume *v;
+	struct crypt_device *cd = NULL;
+	char *name_copy = NULL;
+	uint32_t flags = 0;
+	size_t size;
+	int r;
+
+	if ((r = crypt_init(&cd, device)))
+		return r;
+
+	if ((r = crypt_load(cd, luksType(device_type), NULL))) {
+		log_err(_("Device %s is not a valid LUKS device."), device);
+		goto out;
+	}
+
+	_set_activation_flags(&flags);
+
+	r = crypt_activate_by_token(cd, name, CRYPT_ANY_TOKEN, NULL, flags);
+	tools_keyslot_msg(r, UNLOCKED);
+	if (r >= 0)
+		goto out;
+
+	if (bs->count == bs->size) {
+		size = bs->size ? bs->size * 2 : 16;
+		v = realloc(bs->volumes, size * sizeof(*v));
+		if (!v) {
+			r = -ENOMEM;
+			goto out;
+		}
+		bs->volumes = v;
+		bs->size = size;
+	}
+
+	if (!(name_copy = strdup(name))) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	v = &bs->volumes[bs->count++];
+	memset(v, 0, sizeof(*v));
+	v->cd = cd;
+	v->name = name_copy;
+	v->keyslot = CRYPT_ANY_SLOT;
+	v->flags = flags;
+	v->result = -EPERM;
+
+	return 1;
+out:
+	crypt_free(cd);
+	return r;
+}
+
+/* One passphrase query for all queued devices, keyslots are unlocked in parallel */
+static int open_batch_shared(struct batch_shared *bs, unsigned int *failed)
+{
+	struct crypt_activate_volume *retry;
+	char *password = NULL;
+	size_t i, j, *idx, passwordLen;
+	int r = 0, tries;
+
+	retry = malloc(bs->count * sizeof(*retry));
+	idx = malloc(bs->count * sizeof(*idx));
+	if (!retry || !idx) {
+		free(retry);
+		free(idx);
+		return -ENOMEM;
+	}
+
+	tries = _set_tries_tty();
+	do {
+		/* devices with wrong passphrase only */
+		for (i = 0, j = 0; i < bs->count; i++)
+			if (bs->volumes[i].result == -EPERM) {
+				retry[j] = bs->volumes[i];
+				idx[j++] = i;
+			}
+		if (!j)
+			break;
+
+		r = tools_get_key(NULL, &password, &passwordLen, 0, 0, NULL,
+				ARG_UINT32(OPT_TIMEOUT_ID), _verify_passphrase(0), 0, NULL);
+		if (r < 0)
+			break;
+
+		r = crypt_activate_by_passphrase_multi(retry, j, password, passwordLen, 0, 0);
+		crypt_safe_free(password);
+		password = NULL;
+
+		for (i = 0; i < j; i++) {
+			bs->volumes[idx[i]] = retry[i];
+			if (retry[i].result >= 0)
+				log_verbose(_("Device %s activated using keyslot %d in %.3f s (waited %.3f s)."),
+					    retry[i].name, retry[i].result,
+					    (retry[i].unlock_usec + retry[i].activate_usec) / 1E6,
+					    retry[i].wait_usec / 1E6);
+		}
+
+		tools_passphrase_msg(r);
+		check_signal(&r);
+	} while (r == -EPERM && (--tries > 0));
+
+	free(retry);
+	free(idx);
+
+	for (i = 0; i < bs->count; i++)
+		if (bs->volumes[i].result < 0) {
+			log_err(_("Cannot activate device %s."), bs->volumes[i].name);
+			(*failed)++;
+		}
+
+	return r;
+}
+
+static void batch_shared_free(struct batch_shared *bs)
+{
+	size_t i;
+
+	for (i = 0; i < bs->count; i++) {
+		crypt_free(bs->volumes[i].cd);
+		free(CONST_CAST(void *)bs->volumes[i].name);
+	}
+	free(bs->volumes);
+}
+
+/*
+ * file format (one device per line): <name> <device> [<key file>|none]
+ * Empty lines and lines starting with '#' are ignored.
+ */
+static int action_open_batch(void)
+{
+	char buf[4096], name[256], device[PATH_MAX], key_file[PATH_MAX];
+	struct batch_shared bs = {};
+	unsigned int line = 0, failed = 0;
+	FILE *f;
+	int n, r = 0, r1;
+
+	if (device_type && strcmp(device_type, "luks") &&
+	    strcmp(device_type, "luks1") && strcmp(device_type, "luks2")) {
+		log_err(_("Option --batch-file is allowed only for LUKS, BITLK and TCRYPT devices."));
+		return -EINVAL;
+	}
+
+	if (!(f = fopen(ARG_STR(OPT_BATCH_FILE_ID), "r"))) {
+		log_err(_("Cannot open batch file %s."), ARG_STR(OPT_BATCH_FILE_ID));
+		return -EINVAL;
+	}
+
+	r = crypt_activate_batch_begin();
+	if (r < 0) {
+		fclose(f);
+		return r;
+	}
+
+	/* piped passphrases are read one per line for devices in batch file order */
+	tools_stdin_records(true);
+
+	while (!quit && fgets(buf, sizeof(buf), f)) {
+		line++;
+		n = sscanf(buf, " %255s %4095s %4095s", name, device, key_file);
+		if (n < 1 || name[0] == '#')
+			continue;
+		if (n < 2) {
+			log_err(_("Invalid batch file line %u."), line);
+			r = r ?: -EINVAL;
+			failed++;
+			continue;
+		}
+
+		if (ARG_SET(OPT_SHARED_PASSPHRASE_ID) && (n < 3 || !strcmp(key_file, "none")))
+			r1 = open_batch_device_shared(&bs, name, device);
+		else
+			r1 = open_batch_device(name, device, (n > 2 && strcmp(key_file, "none")) ? key_file : NULL);
+		if (r1 < 0) {
+			log_err(_("Cannot activate device %s (%s)."), name, device);
+			r = r ?: r1;
+			failed++;
+		}
+	}
+
+	fclose(f);
+
+	if (bs.count && !quit) {
+		r1 = open_batch_shared(&bs, &failed);
+		r = r ?: r1;
+	}
+	batch_shared_free(&bs);
+	tools_stdin_records(false);
+
+	/* wait once for udev to process all activated devices */
+	crypt_activate_batch_end();
+
+	if (failed)
+		log_dbg("Batch activation failed for %u device(s).", failed);
+
+	return quit ? -EINTR : r;
+}
+
+/* key derivation is CPU bound, up to one thread per CPU */
+#define OPEN_BATCH_THREADS_MAX 16
+
+/* BITLK or TCRYPT image from batch file, key derivation runs in worker thread */
+struct batch_kdf_device {
+	struct crypt_device *cd;
+	char *name;
+	char *device;
+	char *key_file;
+	char *password;
+	size_t passwordLen;
+	char *vk;
+	size_t vk_size;
+	uint64_t kdf_usec;
+	uint64_t activate_usec;
+	int r;
+};
+
+struct batch_kdf {
+	pthread_mutex_t lock;
+	struct batch_kdf_device *devs;
+	unsigned count;
+	unsigned next;
+	const char *type;
+	const char *password;
+	size_t passwordLen;
+};
+
+static uint64_t batch_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int batch_kdf_tcrypt(struct batch_kdf_device *bd, const char *password, size_t passwordLen)
+{
+	const char *keyfile = bd->key_file;
+	struct crypt_params_tcrypt params = {
+		.passphrase = password,
+		.passphrase_size = passwordLen,
+		.keyfiles = keyfile ? &keyfile : CONST_CAST(const char **)keyfiles,
+		.keyfiles_count = keyfile ? 1 : keyfiles_count,
+		.flags = CRYPT_TCRYPT_LEGACY_MODES |
+			 (ARG_SET(OPT_VERACRYPT_ID) ? CRYPT_TCRYPT_VERA_MODES : 0),
+		.veracrypt_pim = ARG_UINT32(OPT_VERACRYPT_PIM_ID),
+		.hash_name = ARG_STR(OPT_HASH_ID),
+		.cipher = ARG_STR(OPT_CIPHER_ID),
+	};
+
+	if (ARG_SET(OPT_TCRYPT_HIDDEN_ID))
+		params.flags |= CRYPT_TCRYPT_HIDDEN_HEADER;
+	if (ARG_SET(OPT_TCRYPT_SYSTEM_ID))
+		params.flags |= CRYPT_TCRYPT_SYSTEM_HEADER;
+	if (ARG_SET(OPT_TCRYPT_BACKUP_ID))
+		params.flags |= CRYPT_TCRYPT_BACKUP_HEADER;
+
+	/* TCRYPT header is encrypted, key derivation runs in load */
+	return crypt_load(bd->cd, CRYPT_TCRYPT, &params);
+}
+
+static int batch_kdf_bitlk(struct batch_kdf_device *bd,
+			   const char *password, size_t passwordLen)
+{
+	int r;
+
+	r = crypt_load(bd->cd, CRYPT_BITLK, NULL);
+	if (r < 0) {
+		log_err(_("Device %s is not a valid BITLK device."), bd->device);
+		return r;
+	}
+
+	r = crypt_get_volume_key_size(bd->cd);
+	if (r <= 0)
+		return -EINVAL;
+
+	bd->vk_size = r;
+	if (!(bd->vk = crypt_safe_alloc(bd->vk_size)))
+		return -ENOMEM;
+
+	return crypt_volume_key_get(bd->cd, CRYPT_ANY_SLOT, bd->vk, &bd->vk_size,
+				    password, passwordLen);
+}
+
+static void *batch_kdf_worker(void *arg)
+{
+	struct batch_kdf *bk = arg;
+	struct batch_kdf_device *bd;
+	const char *password;
+	size_t passwordLen;
+	uint64_t start;
+
+	while (!quit) {
+		pthread_mutex_lock(&bk->lock);
+		bd = bk->next < bk->count ? &bk->devs[bk->next++] : NULL;
+		pthread_mutex_unlock(&bk->lock);
+		if (!bd)
+			break;
+
+		/* invalid batch entry */
+		if (bd->r < 0)
+			continue;
+
+		/* images without own passphrase file share the one passphrase */
+		if (bd->password) {
+			password = bd->password;
+			passwordLen = bd->passwordLen;
+		} else {
+			password = bk->password;
+			passwordLen = bk->passwordLen;
+		}
+
+		start = batch_usec();
+		if (!strcmp(bk->type, CRYPT_TCRYPT))
+			bd->r = batch_kdf_tcrypt(bd, password, passwordLen);
+		else
+			bd->r = batch_kdf_bitlk(bd, password, passwordLen);
+		bd->kdf_usec = batch_usec() - start;
+	}
+
+	return NULL;
+}
+
+/* Credentials are read in main thread, tools_get_key() is not thread safe */
+static int batch_kdf_add(struct batch_kdf *bk, const char *name, const char *device,
+			 const char *key_file)
+{
+	struct batch_kdf_device *bd;
+	int r;
+
+	bd = realloc(bk->devs, (bk->count + 1) * sizeof(*bd));
+	if (!bd)
+		return -ENOMEM;
+	bk->devs = bd;
+	bd = &bk->devs[bk->count];
+	memset(bd, 0, sizeof(*bd));
+
+	if (!(bd->name = strdup(name)) || !(bd->device = strdup(device)))
+		r = -ENOMEM;
+	else
+		r = crypt_init(&bd->cd, device);
+
+	/* for TCRYPT the file is keyfile, for BITLK it contains passphrase or recovery key */
+	if (!r && key_file && !strcmp(bk->type, CRYPT_TCRYPT) && !(bd->key_file = strdup(key_file)))
+		r = -ENOMEM;
+	else if (!r && key_file && !strcmp(bk->type, CRYPT_BITLK))
+		r = tools_get_key(NULL, &bd->password, &bd->passwordLen, 0, 0, key_file,
+				  ARG_UINT32(OPT_TIMEOUT_ID), 0, 0, bd->cd);
+
+	/* count even failed entry, it is released in batch_kdf_free */
+	bk->count++;
+	bd->r = r;
+
+	return r;
+}
+
+static void batch_kdf_free(struct batch_kdf *bk)
+{
+	unsigned i;
+
+	for (i = 0; i < bk->count; i++) {
+		crypt_free(bk->devs[i].cd);
+		crypt_safe_free(bk->devs[i].password);
+		crypt_safe_free(bk->devs[i].vk);
+		free(bk->devs[i].name);
+		free(bk->devs[i].device);
+		free(bk->devs[i].key_file);
+	}
+	free(bk->devs);
+}
+
+/*
+ * BITLK and TCRYPT batch: the same file format as for LUKS, the shared
+ * passphrase is queried once (for images without own key file), key
+ * derivation for all images runs in parallel, activation in main thread.
+ */
+static int action_open_batch_kdf(const char *type)
+{
+	char buf[4096], name[256], device[PATH_MAX], key_file[PATH_MAX];
+	struct batch_kdf bk = { .type = type };
+	pthread_t tids[OPEN_BATCH_THREADS_MAX];
+	unsigned int line = 0, failed = 0, i, threads, started = 0;
+	uint32_t activate_flags = 0;
+	char *password = NULL;
+	bool shared = false;
+	uint64_t start;
+	long cpus;
+	FILE *f;
+	int n, r = 0;
+
+	if (!(f = fopen(ARG_STR(OPT_BATCH_FILE_ID), "r"))) {
+		log_err(_("Cannot open batch file %s."), ARG_STR(OPT_BATCH_FILE_ID));
+		return -EINVAL;
+	}
+
+	while (!quit && fgets(buf, sizeof(buf), f)) {
+		line++;
+		n = sscanf(buf, " %255s %4095s %4095s", name, device, key_file);
+		if (n < 1 || name[0] == '#')
+			continue;
+		if (n < 2) {
+			log_err(_("Invalid batch file line %u."), line);
+			r = r ?: -EINVAL;
+			failed++;
+			continue;
+		}
+
+		n = (n > 2 && strcmp(key_file, "none"));
+		/* TCRYPT keyfile does not replace passphrase */
+		if (!n || !strcmp(type, CRYPT_TCRYPT))
+			shared = true;
+
+		if (batch_kdf_add(&bk, name, uuid_or_device(device), n ? key_file : NULL) == -ENOMEM) {
+			r = -ENOMEM;
+			break;
+		}
+	}
+
+	fclose(f);
+
+	if (r == -ENOMEM || quit || !bk.count)
+		goto out;
+
+	if (shared) {
+		tools_stdin_records(true);
+		r = tools_get_key(NULL, &password, &bk.passwordLen, 0, 0, NULL,
+				  ARG_UINT32(OPT_TIMEOUT_ID), _verify_passphrase(0), 0, NULL);
+		tools_stdin_records(false);
+		if (r < 0)
+			goto out;
+		bk.password = password;
+	}
+
+	if (pthread_mutex_init(&bk.lock, NULL)) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	threads = cpus > 0 ? (unsigned)cpus : 1;
+	if (threads > OPEN_BATCH_THREADS_MAX)
+		threads = OPEN_BATCH_THREADS_MAX;
+	if (threads > bk.count)
+		threads = bk.count;
+
+	log_dbg("Deriving keys for %u images using %u threads.", bk.count, threads);
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&tids[i], NULL, batch_kdf_worker, &bk))
+			break;
+		started++;
+	}
+
+	/* no thread, derive keys one by one */
+	if (!started)
+		batch_kdf_worker(&bk);
+
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	pthread_mutex_destroy(&bk.lock);
+
+	if (quit)
+		goto out;
+
+	_set_activation_flags(&activate_flags);
+
+	/* wait once for udev to process all activated devices */
+	r = crypt_activate_batch_begin();
+	if (r < 0)
+		goto out;
+
+	for (i = 0; i < bk.count; i++) {
+		if (bk.devs[i].r >= 0) {
+			start = batch_usec();
+			bk.devs[i].r = crypt_activate_by_volume_key(bk.devs[i].cd, bk.devs[i].name,
+					bk.devs[i].vk, bk.devs[i].vk ? bk.devs[i].vk_size : 0, activate_flags);
+			bk.devs[i].activate_usec = batch_usec() - start;
+		}
+
+		if (bk.devs[i].r < 0) {
+			tools_passphrase_msg(bk.devs[i].r);
+			log_err(_("Cannot activate device %s (%s)."), bk.devs[i].name, bk.devs[i].device);
+			r = r ?: bk.devs[i].r;
+			failed++;
+		} else
+			log_verbose(_("Device %s activated in %.3f s (key derivation %.3f s)."),
+				    bk.devs[i].name, (bk.devs[i].kdf_usec + bk.devs[i].activate_usec) / 1E6,
+				    bk.devs[i].kdf_usec / 1E6);
+	}
+
+	crypt_activate_batch_end();
+out:
+	if (failed)
+		log_dbg("Batch activation failed for %u device(s).", failed);
+
+	crypt_safe_free(password);
+	batch_kdf_free(&bk);
+
+	return quit ? -EINTR : r;
+}
+
+static int action_open(void)
+{
+	int r = -EINVAL;
+
+	if (ARG_SET(OPT_BATCH_FILE_ID) && device_type && !strcmp(device_type, "bitlk"))
+		return action_open_batch_kdf(CRYPT_BITLK);
+	else if (ARG_SET(OPT_BATCH_FILE_ID) && device_type && !strcmp(device_type, "tcrypt"))
+		return action_open_batch_kdf(CRYPT_TCRYPT);
+	else if (ARG_SET(OPT_BATCH_FILE_ID))
+		return action_open_batch();
+
+	if (ARG_SET(OPT_REFRESH_ID) && !device_type)
+		/* read device type from active mapping */
+		device_type = _get_device_type();
+
+	if (!device_type)
+		return -EINVAL;
+
+	if (!strcmp(device_type, "luks") ||
+	    !strcmp(device_type, "luks1") ||
+	    !strcmp(device_type, "luks2")) {
+		if (action_argc < 2 && (!ARG_SET(OPT_TEST_PASSPHRASE_ID) && !ARG_SET(OPT_REFRESH_ID)))
+			goto out;
+		return action_open_luks();
+	} else if (!strcmp(device_type, "plain")) {
+		if (action_argc < 2 && !ARG_SET(OPT_REFRESH_ID))
+			goto out;
+		return action_open_plain();
 	} else if (!strcmp(device_type, "loopaes")) {
 		if (action_argc < 2 && !ARG_SET(OPT_REFRESH_ID))
 			goto out;
@@ -2416,6 +3500,12 @@ static int action_luksErase(void)
 {
 	struct crypt_device *cd = NULL;
 	crypt_keyslot_info ki;
+	struct tools_progress_params prog_parms = {
+		.frequency = ARG_UINT32(OPT_PROGRESS_FREQUENCY_ID),
+		.batch_mode = ARG_SET(OPT_BATCH_MODE_ID),
+		.json = ARG_SET(OPT_PROGRESS_JSON_ID)
+	};
+	uint64_t area_offset, area_length, total = 0, done = 0;
 	char *msg = NULL;
 	int i, max, r;
 
@@ -2447,26 +3537,238 @@ static int action_luksErase(void)
 		goto out;
 	}
 
+	/* json progress reports wiped keyslot area bytes */
+	if (prog_parms.json) {
+		for (i = 0; i < max; i++) {
+			ki = crypt_keyslot_status(cd, i);
+			if ((ki == CRYPT_SLOT_ACTIVE || ki == CRYPT_SLOT_ACTIVE_LAST) &&
+			    !crypt_keyslot_area(cd, i, &area_offset, &area_length))
+				total += area_length;
+		}
+		tools_wipe_progress(total, 0, &prog_parms);
+	}
+
 	for (i = 0; i < max; i++) {
 		ki = crypt_keyslot_status(cd, i);
 		if (ki == CRYPT_SLOT_ACTIVE || ki == CRYPT_SLOT_ACTIVE_LAST) {
+			if (crypt_keyslot_area(cd, i, &area_offset, &area_length))
+				area_length = 0;
 			r = crypt_keyslot_destroy(cd, i);
 			if (r < 0)
 				goto out;
 			tools_keyslot_msg(i, REMOVED);
+			done += area_length;
+			if (prog_parms.json)
+				tools_wipe_progress(total, done, &prog_parms);
 		}
 	}
+
+	/* no active keyslot, still report the final state */
+	if (prog_parms.json && !total)
+		tools_wipe_progress(0, 0, &prog_parms);
 out:
 	free(msg);
 	crypt_free(cd);
 	return r;
 }
 
+static int convert_load(struct crypt_device **cd, const char *device, const char *to_type)
+{
+	const char *from_type;
+	int r;
+
+	if ((r = crypt_init(cd, device)))
+		return r;
+
+	if ((r = crypt_load(*cd, CRYPT_LUKS, NULL)) ||
+	    !(from_type = crypt_get_type(*cd))) {
+		log_err(_("Device %s is not a valid LUKS device."), device);
+		crypt_free(*cd);
+		*cd = NULL;
+		return r ?: -EINVAL;
+	}
+
+	if (!strcmp(from_type, to_type)) {
+		log_err(_("Device %s is already %s type."), device, to_type);
+		crypt_free(*cd);
+		*cd = NULL;
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* conversion is I/O latency bound, more devices are converted at once */
+#define CONVERT_BATCH_THREADS 8
+
+struct convert_batch {
+	pthread_mutex_t lock;
+	char **devices;
+	struct crypt_device **cds;
+	unsigned count;
+	unsigned next;
+	unsigned failed;
+	const char *to_type;
+	int r;
+};
+
+static void *convert_batch_worker(void *arg)
+{
+	struct convert_batch *cb = arg;
+	unsigned i;
+	int r;
+
+	while (!quit) {
+		pthread_mutex_lock(&cb->lock);
+		/* devices that failed to load are already reported */
+		while (cb->next < cb->count && !cb->cds[cb->next])
+			cb->next++;
+		i = cb->next < cb->count ? cb->next++ : cb->count;
+		pthread_mutex_unlock(&cb->lock);
+		if (i == cb->count)
+			break;
+
+		r = crypt_convert(cb->cds[i], cb->to_type, NULL);
+		if (r < 0)
+			log_err(_("Device %s was not converted."), cb->devices[i]);
+		else
+			log_verbose(_("Device %s converted to %s format."), cb->devices[i], cb->to_type);
+
+		pthread_mutex_lock(&cb->lock);
+		if (r < 0) {
+			cb->failed++;
+			cb->r = cb->r ?: r;
+		}
+		pthread_mutex_unlock(&cb->lock);
+	}
+
+	return NULL;
+}
+
+static int convert_batch_read(struct convert_batch *cb)
+{
+	char buf[4096], device[PATH_MAX], **tmp;
+	unsigned int line = 0;
+	FILE *f;
+	int r = 0;
+
+	if (!(f = fopen(ARG_STR(OPT_BATCH_FILE_ID), "r"))) {
+		log_err(_("Cannot open batch file %s."), ARG_STR(OPT_BATCH_FILE_ID));
+		return -EINVAL;
+	}
+
+	while (fgets(buf, sizeof(buf), f)) {
+		line++;
+		if (sscanf(buf, " %4095s", device) < 1 || device[0] == '#')
+			continue;
+
+		tmp = realloc(cb->devices, (cb->count + 1) * sizeof(*tmp));
+		if (!tmp) {
+			r = -ENOMEM;
+			break;
+		}
+		cb->devices = tmp;
+
+		/* uuid_or_device() uses static buffer, resolve it here */
+		if (!(cb->devices[cb->count] = strdup(uuid_or_device(device)))) {
+			r = -ENOMEM;
+			break;
+		}
+		cb->count++;
+	}
+
+	fclose(f);
+
+	if (!r && !cb->count) {
+		log_err(_("No device found in batch file %s."), ARG_STR(OPT_BATCH_FILE_ID));
+		r = -EINVAL;
+	}
+
+	return r;
+}
+
+static int action_luksConvert_batch(const char *to_type)
+{
+	struct convert_batch cb = { .to_type = to_type };
+	pthread_t tids[CONVERT_BATCH_THREADS];
+	unsigned i, threads, started = 0;
+	char *msg = NULL;
+	int r;
+
+	if ((r = convert_batch_read(&cb)))
+		goto out;
+
+	/*
+	 * Contexts are loaded in main thread, so the library process-wide state
+	 * (crypto backend, RNG) is initialized before workers start and workers
+	 * only run conversion of their own context.
+	 */
+	if (!(cb.cds = calloc(cb.count, sizeof(*cb.cds)))) {
+		r = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < cb.count && !quit; i++)
+		if ((r = convert_load(&cb.cds[i], cb.devices[i], to_type))) {
+			log_err(_("Device %s was not converted."), cb.devices[i]);
+			cb.failed++;
+			cb.r = cb.r ?: r;
+		}
+	r = 0;
+
+	if (!ARG_SET(OPT_BATCH_MODE_ID)) {
+		if (asprintf(&msg, _("This operation will convert %u devices listed in %s to %s format.\n"),
+			     cb.count, ARG_STR(OPT_BATCH_FILE_ID), to_type) == -1) {
+			r = -ENOMEM;
+			goto out;
+		}
+		if (!yesDialog(msg, _("Operation aborted, devices were NOT converted.\n"))) {
+			r = -EPERM;
+			goto out;
+		}
+	}
+
+	if (pthread_mutex_init(&cb.lock, NULL)) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	threads = cb.count < CONVERT_BATCH_THREADS ? cb.count : CONVERT_BATCH_THREADS;
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&tids[i], NULL, convert_batch_worker, &cb))
+			break;
+		started++;
+	}
+
+	/* no thread, convert devices one by one */
+	if (!started)
+		convert_batch_worker(&cb);
+
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	pthread_mutex_destroy(&cb.lock);
+
+	if (cb.failed)
+		log_dbg("Batch conversion failed for %u device(s).", cb.failed);
+
+	r = quit ? -EINTR : cb.r;
+out:
+	for (i = 0; i < cb.count; i++) {
+		if (cb.cds)
+			crypt_free(cb.cds[i]);
+		free(cb.devices[i]);
+	}
+	free(cb.cds);
+	free(cb.devices);
+	free(msg);
+	return r;
+}
+
 static int action_luksConvert(void)
 {
 	struct crypt_device *cd = NULL;
 	char *msg = NULL;
-	const char *to_type, *from_type;
+	const char *to_type;
 	int r;
 
 	if (!strcmp(device_type, "luks2")) {
@@ -2478,24 +3780,12 @@ static int action_luksConvert(void)
 		return -EINVAL;
 	}
 
-	if ((r = crypt_init(&cd, uuid_or_device_header(NULL))))
-		return r;
+	if (ARG_SET(OPT_BATCH_FILE_ID))
+		return action_luksConvert_batch(to_type);
 
-	if ((r = crypt_load(cd, CRYPT_LUKS, NULL)) ||
-	    !(from_type = crypt_get_type(cd))) {
-		log_err(_("Device %s is not a valid LUKS device."),
-			uuid_or_device_header(NULL));
-		crypt_free(cd);
+	if ((r = convert_load(&cd, uuid_or_device_header(NULL), to_type)))
 		return r;
-	}
-
-	if (!strcmp(from_type, to_type)) {
-		log_err(_("Device is already %s type."), to_type);
-		crypt_free(cd);
-		return -EINVAL;
-	}
 
-	r = 0;
 	if (!ARG_SET(OPT_BATCH_MODE_ID)) {
 		if (asprintf(&msg, _("This operation will convert %s to %s format.\n"),
 				    uuid_or_device_header(NULL), to_type) == -1)
@@ -2563,6 +3853,30 @@ out:
 	return r;
 }
 
+static int action_luksCompact(void)
+{
+	struct crypt_device *cd = NULL;
+	int r;
+
+	if ((r = crypt_init(&cd, uuid_or_device_header(NULL))))
+		return r;
+
+	if ((r = crypt_load(cd, CRYPT_LUKS2, NULL))) {
+		log_err(_("Device %s is not a valid LUKS device."),
+			uuid_or_device_header(NULL));
+		goto out;
+	}
+
+	r = crypt_keyslot_areas_compact(cd);
+	if (r >= 0) {
+		log_verbose(_("Moved %d keyslot areas."), r);
+		r = 0;
+	}
+out:
+	crypt_free(cd);
+	return r;
+}
+
 static int _token_add(struct crypt_device *cd)
 {
 	int r, token;
@@ -2723,7 +4037,7 @@ static int _get_device_active_name(struct crypt_device *cd, const char *data_dev
 	char *msg;
 	int r;
 
-	r = auto_detect_active_name(cd, action_argv[0], buffer, buffer_size);
+	r = auto_detect_active_name(cd, data_device, buffer, buffer_size);
 	if (r > 0) {
 		if (*buffer == '\0') {
 			log_err(_("Device %s is still in use."), data_device);
@@ -2754,7 +4068,8 @@ static int _get_device_active_name(struct crypt_device *cd, const char *data_dev
 	return r;
 }
 
-static int action_reencrypt_load(struct crypt_device *cd)
+/* resume initialized reencryption of data device, key file can be NULL */
+static int reencrypt_load(struct crypt_device *cd, const char *data_device, const char *key_file)
 {
 	int r;
 	size_t passwordLen;
@@ -2768,14 +4083,23 @@ static int action_reencrypt_load(struct crypt_device *cd)
 		.flags = CRYPT_REENCRYPT_RESUME_ONLY
 	};
 
+	if (ARG_SET(OPT_HOTZONE_ADAPTIVE_ID))
+		params.flags |= CRYPT_REENCRYPT_ADAPTIVE_HOTZONE;
+	if (ARG_SET(OPT_SKIP_UNALLOCATED_ID))
+		params.flags |= CRYPT_REENCRYPT_SKIP_UNALLOCATED;
+	if (ARG_SET(OPT_KCAPI_ZEROCOPY_ID))
+		params.flags |= CRYPT_REENCRYPT_KCAPI_ZEROCOPY;
+	if (ARG_SET(OPT_ALLOW_CRC32C_ID))
+		params.flags |= CRYPT_REENCRYPT_ALLOW_CRC32C;
+
 	r = tools_get_key(NULL, &password, &passwordLen,
-			ARG_UINT64(OPT_KEYFILE_OFFSET_ID), ARG_UINT32(OPT_KEYFILE_SIZE_ID), ARG_STR(OPT_KEY_FILE_ID),
+			ARG_UINT64(OPT_KEYFILE_OFFSET_ID), ARG_UINT32(OPT_KEYFILE_SIZE_ID), key_file,
 			ARG_UINT32(OPT_TIMEOUT_ID), _verify_passphrase(0), 0, cd);
 	if (r < 0)
 		return r;
 
 	if (!ARG_SET(OPT_ACTIVE_NAME_ID)) {
-		r = _get_device_active_name(cd, action_argv[0], dm_name, sizeof(dm_name));
+		r = _get_device_active_name(cd, data_device, dm_name, sizeof(dm_name));
 		if (r > 0)
 			active_name = dm_name;
 		if (r < 0) {
@@ -2785,6 +4109,9 @@ static int action_reencrypt_load(struct crypt_device *cd)
 	} else
 		active_name = ARG_STR(OPT_ACTIVE_NAME_ID);
 
+	if (ARG_SET(OPT_VOLUME_KEY_HANDOFF_ID))
+		crypt_volume_key_handoff(cd, ARG_UINT32(OPT_VOLUME_KEY_HANDOFF_ID));
+
 	r = crypt_reencrypt_init_by_passphrase(cd, active_name, password, passwordLen, ARG_INT32(OPT_KEY_SLOT_ID), ARG_INT32(OPT_KEY_SLOT_ID), NULL, NULL, &params);
 
 	crypt_safe_free(password);
@@ -2792,6 +4119,11 @@ static int action_reencrypt_load(struct crypt_device *cd)
 	return r;
 }
 
+static int action_reencrypt_load(struct crypt_device *cd)
+{
+	return reencrypt_load(cd, action_argv[0], ARG_STR(OPT_KEY_FILE_ID));
+}
+
 static int action_encrypt_luks2(struct crypt_device **cd)
 {
 	char *tmp;
@@ -2964,6 +4296,9 @@ static int action_encrypt_luks2(struct crypt_device **cd)
 
 	/* just load reencryption context to continue reencryption */
 	if (!ARG_SET(OPT_INIT_ONLY_ID)) {
+		if ((r = tools_set_numa_node(*cd, ARG_SET(OPT_NUMA_NODE_ID), ARG_INT32(OPT_NUMA_NODE_ID))) ||
+		    (r = _set_resilience_device(*cd)))
+			goto out;
 		params.flags &= ~CRYPT_REENCRYPT_INITIALIZE_ONLY;
 		r = crypt_reencrypt_init_by_passphrase(*cd, activated_name, password, passwordLen,
 				CRYPT_ANY_SLOT, keyslot, NULL, NULL, &params);
@@ -3338,6 +4673,414 @@ out:
 	return r;
 }
 
+static volatile sig_atomic_t rate_limit_reload = 0;
+
+static void rate_limit_hup_handler(int sig __attribute__((__unused__)))
+{
+	rate_limit_reload = 1;
+}
+
+struct reencrypt_progress_params {
+	struct tools_progress_params *prog;
+	struct crypt_device *cd;
+};
+
+/* file format: <throughput bytes/s with optional unit> [<iops>] */
+static int reencrypt_read_rate_limit(const char *path, uint64_t *throughput, uint32_t *iops)
+{
+	char buf[128], str[64];
+	unsigned int tmp;
+	FILE *f;
+	int r;
+
+	if (!(f = fopen(path, "r"))) {
+		log_err(_("Cannot open rate limit file %s."), path);
+		return -EINVAL;
+	}
+
+	r = fgets(buf, sizeof(buf), f) ? sscanf(buf, "%63s %u", str, &tmp) : 0;
+	fclose(f);
+
+	if (r < 1 || tools_string_to_size(str, throughput)) {
+		log_err(_("Invalid rate limit in file %s."), path);
+		return -EINVAL;
+	}
+	*iops = r > 1 ? tmp : 0;
+
+	return 0;
+}
+
+static int reencrypt_set_rate_limit(struct crypt_device *cd)
+{
+	uint64_t throughput = ARG_UINT64(OPT_MAX_THROUGHPUT_ID);
+	uint32_t iops = ARG_UINT32(OPT_MAX_IOPS_ID);
+
+	if (ARG_SET(OPT_RATE_LIMIT_FILE_ID) &&
+	    reencrypt_read_rate_limit(ARG_STR(OPT_RATE_LIMIT_FILE_ID), &throughput, &iops))
+		return -EINVAL;
+
+	return crypt_reencrypt_set_rate_limit(cd, throughput, iops);
+}
+
+static int reencrypt_set_commit_interval(struct crypt_device *cd)
+{
+	if (!ARG_SET(OPT_COMMIT_INTERVAL_SIZE_ID) && !ARG_SET(OPT_COMMIT_INTERVAL_TIME_ID))
+		return 0;
+
+	return crypt_reencrypt_set_commit_interval(cd, ARG_UINT64(OPT_COMMIT_INTERVAL_SIZE_ID),
+		ARG_UINT32(OPT_COMMIT_INTERVAL_TIME_ID) * 1000);
+}
+
+static int reencrypt_rate_limit_progress(uint64_t size, uint64_t offset, void *usrptr)
+{
+	struct reencrypt_progress_params *parms = (struct reencrypt_progress_params *)usrptr;
+
+	/* on failure keep previous limit */
+	if (rate_limit_reload) {
+		rate_limit_reload = 0;
+		log_dbg("Reloading reencryption rate limit.");
+		reencrypt_set_rate_limit(parms->cd);
+	}
+
+	return tools_reencrypt_progress(size, offset, parms->prog);
+}
+
+static int reencrypt_run(struct crypt_device *cd, struct tools_progress_params *prog_parms)
+{
+	struct sigaction sigaction_hup;
+	struct reencrypt_progress_params parms = {
+		.prog = prog_parms,
+		.cd = cd
+	};
+	int r;
+
+	if (prog_parms->json)
+		prog_parms->cd = cd;
+
+	r = reencrypt_set_commit_interval(cd);
+	if (r < 0)
+		return r;
+
+	if (!ARG_SET(OPT_MAX_THROUGHPUT_ID) && !ARG_SET(OPT_MAX_IOPS_ID) && !ARG_SET(OPT_RATE_LIMIT_FILE_ID))
+		return crypt_reencrypt(cd, tools_reencrypt_progress, prog_parms);
+
+	r = reencrypt_set_rate_limit(cd);
+	if (r < 0)
+		return r;
+
+	if (ARG_SET(OPT_RATE_LIMIT_FILE_ID)) {
+		memset(&sigaction_hup, 0, sizeof(sigaction_hup));
+		sigaction_hup.sa_handler = rate_limit_hup_handler;
+		sigaction(SIGHUP, &sigaction_hup, 0);
+	}
+
+	return crypt_reencrypt(cd, reencrypt_rate_limit_progress, &parms);
+}
+
+/* reencryption is mostly I/O bound, limit of devices processed at once */
+#define REENCRYPT_BATCH_THREADS_MAX 32
+
+struct reencrypt_batch;
+
+struct reencrypt_batch_device {
+	struct reencrypt_batch *rb;
+	struct crypt_device *cd;
+	char *device;
+	uint64_t size;
+	uint64_t offset;
+	unsigned rate_generation;
+	bool reported;
+	bool done;
+	int r;
+};
+
+struct reencrypt_batch {
+	pthread_mutex_t lock;
+	struct reencrypt_batch_device *devs;
+	unsigned count;
+	unsigned next;
+	unsigned running;
+	unsigned failed;
+	/* aggregate limit, split equally between running devices */
+	uint64_t max_throughput;
+	uint32_t max_iops;
+	unsigned rate_generation;
+	bool stop;
+	struct tools_progress_params prog;
+};
+
+/* called with batch lock held */
+static void reencrypt_batch_rate_limit(struct reencrypt_batch_device *dev)
+{
+	struct reencrypt_batch *rb = dev->rb;
+	unsigned running = rb->running ?: 1;
+
+	dev->rate_generation = rb->rate_generation;
+	if (!rb->max_throughput && !rb->max_iops)
+		return;
+
+	if (crypt_reencrypt_set_rate_limit(dev->cd, rb->max_throughput / running,
+					   rb->max_iops ? (rb->max_iops / running ?: 1) : 0))
+		log_dbg("Cannot set rate limit for device %s.", dev->device);
+}
+
+/* Combined progress of all devices, callback runs in device worker thread */
+static int reencrypt_batch_progress(uint64_t size, uint64_t offset, void *usrptr)
+{
+	struct reencrypt_batch_device *dev = usrptr;
+	struct reencrypt_batch *rb = dev->rb;
+	uint64_t total = 0, done = 0;
+	bool complete = true;
+	unsigned i;
+	int r = 0;
+
+	pthread_mutex_lock(&rb->lock);
+	dev->size = size;
+	dev->offset = offset;
+	dev->reported = true;
+
+	if (rate_limit_reload) {
+		rate_limit_reload = 0;
+		log_dbg("Reloading aggregate reencryption rate limit.");
+		/* on failure keep previous limit */
+		if (!reencrypt_read_rate_limit(ARG_STR(OPT_RATE_LIMIT_FILE_ID), &rb->max_throughput, &rb->max_iops))
+			rb->rate_generation++;
+	}
+	if (dev->rate_generation != rb->rate_generation)
+		reencrypt_batch_rate_limit(dev);
+
+	if (rb->stop) {
+		pthread_mutex_unlock(&rb->lock);
+		return 1;
+	}
+
+	for (i = 0; i < rb->count; i++) {
+		total += rb->devs[i].size;
+		done += rb->devs[i].offset;
+		if (!rb->devs[i].reported || rb->devs[i].offset != rb->devs[i].size)
+			complete = false;
+	}
+
+	/* not yet started devices are not counted, do not report false final state */
+	if (done != total || complete)
+		r = tools_reencrypt_progress(total, done, &rb->prog);
+	else
+		check_signal(&r);
+
+	if (r)
+		rb->stop = true;
+	pthread_mutex_unlock(&rb->lock);
+
+	return r;
+}
+
+static void *reencrypt_batch_worker(void *arg)
+{
+	struct reencrypt_batch *rb = arg;
+	struct reencrypt_batch_device *dev;
+	int r;
+
+	while (!quit) {
+		pthread_mutex_lock(&rb->lock);
+		dev = (rb->next < rb->count && !rb->stop) ? &rb->devs[rb->next++] : NULL;
+		if (dev) {
+			rb->running++;
+			rb->rate_generation++;
+			reencrypt_batch_rate_limit(dev);
+		}
+		pthread_mutex_unlock(&rb->lock);
+		if (!dev)
+			break;
+
+		log_dbg("Starting reencryption of device %s.", dev->device);
+		r = reencrypt_set_commit_interval(dev->cd);
+		if (!r)
+			r = crypt_reencrypt(dev->cd, reencrypt_batch_progress, dev);
+
+		pthread_mutex_lock(&rb->lock);
+		rb->running--;
+		rb->rate_generation++;
+		dev->done = true;
+		dev->r = r;
+		if (r < 0)
+			rb->failed++;
+		pthread_mutex_unlock(&rb->lock);
+
+		if (r < 0)
+			log_err(_("Reencryption of device %s failed."), dev->device);
+		else
+			log_verbose(_("Reencryption of device %s finished."), dev->device);
+	}
+
+	return NULL;
+}
+
+/*
+ * file format (one device per line): <device> [<key file>|none]
+ * Empty lines and lines starting with '#' are ignored.
+ * Devices are loaded (and passphrases queried) in file order first.
+ */
+static int reencrypt_batch_load(struct reencrypt_batch *rb)
+{
+	char buf[4096], device[PATH_MAX], key_file[PATH_MAX];
+	struct reencrypt_batch_device *tmp, *dev;
+	unsigned int line = 0;
+	crypt_reencrypt_info ri;
+	FILE *f;
+	int n, r = 0;
+
+	if (!(f = fopen(ARG_STR(OPT_BATCH_FILE_ID), "r"))) {
+		log_err(_("Cannot open batch file %s."), ARG_STR(OPT_BATCH_FILE_ID));
+		return -EINVAL;
+	}
+
+	/* piped passphrases are read one per line for devices in batch file order */
+	tools_stdin_records(true);
+
+	while (!r && !quit && fgets(buf, sizeof(buf), f)) {
+		line++;
+		n = sscanf(buf, " %4095s %4095s", device, key_file);
+		if (n < 1 || device[0] == '#')
+			continue;
+
+		tmp = realloc(rb->devs, (rb->count + 1) * sizeof(*tmp));
+		if (!tmp) {
+			r = -ENOMEM;
+			break;
+		}
+		rb->devs = tmp;
+		dev = &rb->devs[rb->count];
+		memset(dev, 0, sizeof(*dev));
+		dev->rb = rb;
+
+		/* uuid_or_device() uses static buffer, resolve it here */
+		if (!(dev->device = strdup(uuid_or_device(device)))) {
+			r = -ENOMEM;
+			break;
+		}
+		rb->count++;
+
+		if ((r = crypt_init(&dev->cd, dev->device)))
+			break;
+
+		if ((r = crypt_load(dev->cd, CRYPT_LUKS2, NULL))) {
+			log_err(_("Device %s is not a valid LUKS device."), dev->device);
+			break;
+		}
+
+		ri = crypt_reencrypt_status(dev->cd, NULL);
+		if (ri != CRYPT_REENCRYPT_CLEAN && ri != CRYPT_REENCRYPT_CRASH) {
+			log_err(_("Device %s is not in reencryption (use --init-only first)."), dev->device);
+			r = -EINVAL;
+			break;
+		}
+
+		if ((r = tools_set_numa_node(dev->cd, ARG_SET(OPT_NUMA_NODE_ID), ARG_INT32(OPT_NUMA_NODE_ID))) ||
+		    (r = _set_resilience_device(dev->cd)))
+			break;
+
+		r = reencrypt_load(dev->cd, dev->device,
+				   (n > 1 && strcmp(key_file, "none")) ? key_file : NULL);
+		tools_passphrase_msg(r);
+		check_signal(&r);
+		if (r < 0)
+			log_err(_("Cannot resume reencryption of device %s."), dev->device);
+	}
+
+	tools_stdin_records(false);
+	fclose(f);
+
+	if (!r && quit)
+		r = -EINTR;
+
+	if (!r && !rb->count) {
+		log_err(_("No device found in batch file %s."), ARG_STR(OPT_BATCH_FILE_ID));
+		r = -EINVAL;
+	}
+
+	return r;
+}
+
+/*
+ * All devices from batch file are reencrypted concurrently in one process.
+ * Reencryption of every device has to be initialized before (its resilience
+ * metadata are independent), limits of --max-throughput and --max-iops
+ * are aggregate for all devices and progress is reported for all of them.
+ */
+static int action_reencrypt_batch(void)
+{
+	struct reencrypt_batch rb = {
+		.max_throughput = ARG_UINT64(OPT_MAX_THROUGHPUT_ID),
+		.max_iops = ARG_UINT32(OPT_MAX_IOPS_ID),
+		.prog = {
+			.frequency = ARG_UINT32(OPT_PROGRESS_FREQUENCY_ID),
+			.batch_mode = ARG_SET(OPT_BATCH_MODE_ID),
+			.json = ARG_SET(OPT_PROGRESS_JSON_ID)
+		}
+	};
+	struct sigaction sigaction_hup;
+	pthread_t tids[REENCRYPT_BATCH_THREADS_MAX];
+	unsigned i, threads, started = 0;
+	long cpus;
+	int r;
+
+	if ((r = reencrypt_batch_load(&rb)))
+		goto out;
+
+	if (ARG_SET(OPT_RATE_LIMIT_FILE_ID)) {
+		if ((r = reencrypt_read_rate_limit(ARG_STR(OPT_RATE_LIMIT_FILE_ID), &rb.max_throughput, &rb.max_iops)))
+			goto out;
+		memset(&sigaction_hup, 0, sizeof(sigaction_hup));
+		sigaction_hup.sa_handler = rate_limit_hup_handler;
+		sigaction(SIGHUP, &sigaction_hup, 0);
+	}
+
+	if (pthread_mutex_init(&rb.lock, NULL)) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	/* userspace crypto of all running devices shares CPUs */
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	threads = cpus > 0 ? (unsigned)cpus : 1;
+	if (threads > REENCRYPT_BATCH_THREADS_MAX)
+		threads = REENCRYPT_BATCH_THREADS_MAX;
+	if (threads > rb.count)
+		threads = rb.count;
+
+	log_dbg("Reencrypting %u devices, %u at once.", rb.count, threads);
+
+	set_int_handler(0);
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&tids[i], NULL, reencrypt_batch_worker, &rb))
+			break;
+		started++;
+	}
+
+	/* no thread, reencrypt devices one by one */
+	if (!started)
+		reencrypt_batch_worker(&rb);
+
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	pthread_mutex_destroy(&rb.lock);
+
+	for (i = 0; i < rb.count && !r; i++)
+		if (!rb.devs[i].done || rb.devs[i].r < 0)
+			r = rb.devs[i].done ? rb.devs[i].r : -EINTR;
+
+	if (rb.failed)
+		log_dbg("Batch reencryption failed for %u device(s).", rb.failed);
+out:
+	for (i = 0; i < rb.count; i++) {
+		crypt_free(rb.devs[i].cd);
+		free(rb.devs[i].device);
+	}
+	free(rb.devs);
+	return r;
+}
+
 static int action_reencrypt(void)
 {
 	uint32_t flags;
@@ -3346,9 +5089,13 @@ static int action_reencrypt(void)
 	int r = 0;
 	struct tools_progress_params prog_parms = {
 		.frequency = ARG_UINT32(OPT_PROGRESS_FREQUENCY_ID),
-		.batch_mode = ARG_SET(OPT_BATCH_MODE_ID)
+		.batch_mode = ARG_SET(OPT_BATCH_MODE_ID),
+		.json = ARG_SET(OPT_PROGRESS_JSON_ID)
 	};
 
+	if (ARG_SET(OPT_BATCH_FILE_ID))
+		return action_reencrypt_batch();
+
 	if (action_argc < 1 && (!ARG_SET(OPT_ACTIVE_NAME_ID) || ARG_SET(OPT_ENCRYPT_ID))) {
 		log_err(_("Command requires device as argument."));
 		return -EINVAL;
@@ -3398,6 +5145,10 @@ static int action_reencrypt(void)
 			r = -ENOTSUP;
 			goto out;
 		}
+
+		if ((r = tools_set_numa_node(cd, ARG_SET(OPT_NUMA_NODE_ID), ARG_INT32(OPT_NUMA_NODE_ID))) ||
+		    (r = _set_resilience_device(cd)))
+			goto out;
 	}
 
 	if (r == -EBUSY) {
@@ -3417,7 +5168,7 @@ static int action_reencrypt(void)
 
 	if (r >= 0 && !ARG_SET(OPT_INIT_ONLY_ID)) {
 		set_int_handler(0);
-		r = crypt_reencrypt(cd, tools_reencrypt_progress, &prog_parms);
+		r = reencrypt_run(cd, &prog_parms);
 	}
 out:
 	crypt_free(cd);
@@ -3447,6 +5198,7 @@ static struct action_type {
 	{ ADDKEY_ACTION,	action_luksAddKey,	1, 1, N_("<device> [<new key file>]"), N_("add key to LUKS device") },
 	{ REMOVEKEY_ACTION,	action_luksRemoveKey,	1, 1, N_("<device> [<key file>]"), N_("removes supplied key or key file from LUKS device") },
 	{ CHANGEKEY_ACTION,	action_luksChangeKey,	1, 1, N_("<device> [<key file>]"), N_("changes supplied key or key file of LUKS device") },
+	{ COMPACT_ACTION,	action_luksCompact,	1, 0, N_("<device>"), N_("move LUKS2 keyslot areas to the start of keyslots area") },
 	{ CONVERTKEY_ACTION,	action_luksConvertKey,	1, 1, N_("<device> [<key file>]"), N_("converts a key to new pbkdf parameters") },
 	{ KILLKEY_ACTION,	action_luksKillSlot,	2, 1, N_("<device> <key slot>"), N_("wipes key with number <key slot> from LUKS device") },
 	{ UUID_ACTION,		action_luksUUID,	1, 0, N_("<device>"), N_("print UUID of LUKS device") },
@@ -3566,9 +5318,10 @@ static int run_action(struct action_type *action)
 
 static bool needs_size_conversion(unsigned arg_id)
 {
-	return (arg_id == OPT_DEVICE_SIZE_ID || arg_id == OPT_HOTZONE_SIZE_ID ||
+	return (arg_id == OPT_COMMIT_INTERVAL_SIZE_ID ||
+		arg_id == OPT_DEVICE_SIZE_ID || arg_id == OPT_HOTZONE_SIZE_ID ||
 		arg_id == OPT_LUKS2_KEYSLOTS_SIZE_ID || arg_id == OPT_LUKS2_METADATA_SIZE_ID ||
-		arg_id == OPT_REDUCE_DEVICE_SIZE_ID);
+		arg_id == OPT_MAX_THROUGHPUT_ID || arg_id == OPT_REDUCE_DEVICE_SIZE_ID);
 }
 
 static void check_key_slot_value(poptContext popt_context)
@@ -3584,6 +5337,12 @@ static void basic_options_cb(poptContext popt_context,
 		 const char *arg,
 		 void *data __attribute__((unused)))
 {
+	/* special value, sector size is measured later */
+	if (key->val == OPT_SECTOR_SIZE_ID && arg && !strcmp(arg, "auto-bench")) {
+		sector_size_bench = true;
+		return;
+	}
+
 	tools_parse_arg_value(popt_context, tool_core_args[key->val].type, tool_core_args + key->val, arg, key->val, needs_size_conversion);
 
 	/* special cases additional handling */
@@ -3652,6 +5411,14 @@ static void basic_options_cb(poptContext popt_context,
 			      _("Unsupported encryption sector size."),
 			      poptGetInvocationName(popt_context));
 		break;
+	case OPT_PERF_PROFILE_ID:
+		if (strcmp(ARG_STR(OPT_PERF_PROFILE_ID), "auto") &&
+		    strcmp(ARG_STR(OPT_PERF_PROFILE_ID), "latency") &&
+		    strcmp(ARG_STR(OPT_PERF_PROFILE_ID), "throughput"))
+			usage(popt_context, EXIT_FAILURE,
+			_("Option --perf-profile can be only auto/latency/throughput."),
+			poptGetInvocationName(popt_context));
+		break;
 	case OPT_PRIORITY_ID:
 		if (strcmp(ARG_STR(OPT_PRIORITY_ID), "normal") &&
 		    strcmp(ARG_STR(OPT_PRIORITY_ID), "prefer") &&
@@ -3691,9 +5458,12 @@ int main(int argc, const char **argv)
 
 	crypt_set_log_callback(NULL, tool_log, &log_parms);
 
+#ifndef ENABLE_INITRAMFS_CRYPTSETUP
+	/* initramfs build avoids locale and message catalog lookup */
 	setlocale(LC_ALL, "");
 	bindtextdomain(PACKAGE, LOCALEDIR);
 	textdomain(PACKAGE);
+#endif
 
 	popt_context = poptGetContext(PACKAGE, argc, argv, popt_options, 0);
 	poptSetOtherOptionHelp(popt_context,
@@ -3779,12 +5549,22 @@ int main(int argc, const char **argv)
 		usage(popt_context, EXIT_FAILURE, _("Unknown action."),
 		      poptGetInvocationName(popt_context));
 
-	if (action_argc < action->required_action_argc)
+	/* open, convert or reencrypt with batch file and close all do not use device argument */
+	if (action_argc < action->required_action_argc &&
+	    !(ARG_SET(OPT_BATCH_FILE_ID) && (!strcmp(aname, OPEN_ACTION) || !strcmp(aname, CONVERT_ACTION) ||
+					     !strcmp(aname, REENCRYPT_ACTION))) &&
+	    !(ARG_SET(OPT_ALL_ID) && !strcmp(aname, CLOSE_ACTION)))
 		help_args(action, popt_context);
 
 	/* this routine short circuits to exit() on error */
 	tools_check_args(action->type, tool_core_args, ARRAY_SIZE(tool_core_args), popt_context);
 
+	if (sector_size_bench && (ARG_SET(OPT_SECTOR_SIZE_ID) ||
+	    (strcmp(aname, FORMAT_ACTION) && strcmp(aname, BENCHMARK_ACTION))))
+		usage(popt_context, EXIT_FAILURE,
+		      _("Option --sector-size auto-bench is allowed only for luksFormat and benchmark actions."),
+		      poptGetInvocationName(popt_context));
+
 	if (ARG_SET(OPT_REFRESH_ID) && ARG_SET(OPT_TEST_PASSPHRASE_ID))
 		usage(popt_context, EXIT_FAILURE,
 		      _("Options --refresh and --test-passphrase are mutually exclusive."),
@@ -3801,6 +5581,44 @@ int main(int argc, const char **argv)
 		      _("Option --shared is allowed only for open of plain device."),
 		      poptGetInvocationName(popt_context));
 
+	if (ARG_SET(OPT_BATCH_FILE_ID) && !strcmp(aname, REENCRYPT_ACTION) &&
+	    (ARG_SET(OPT_ENCRYPT_ID) || ARG_SET(OPT_DECRYPT_ID) || ARG_SET(OPT_INIT_ONLY_ID) ||
+	     ARG_SET(OPT_ACTIVE_NAME_ID) || ARG_SET(OPT_HEADER_ID)))
+		usage(popt_context, EXIT_FAILURE,
+		      _("Reencryption with --batch-file only resumes initialized reencryption (options --encrypt, --decrypt, --init-only, --active-name and --header are not allowed)."),
+		      poptGetInvocationName(popt_context));
+
+	if ((ARG_SET(OPT_COMMIT_INTERVAL_SIZE_ID) || ARG_SET(OPT_COMMIT_INTERVAL_TIME_ID)) &&
+	    ARG_SET(OPT_RESILIENCE_ID) && strcmp(ARG_STR(OPT_RESILIENCE_ID), "none"))
+		usage(popt_context, EXIT_FAILURE,
+		      _("Options --commit-interval-size and --commit-interval-time can be used only with --resilience none."),
+		      poptGetInvocationName(popt_context));
+
+	if (ARG_SET(OPT_BATCH_FILE_ID) && !strcmp(aname, ADDKEY_ACTION) &&
+	    (ARG_SET(OPT_UNBOUND_ID) || ARG_SET(OPT_MASTER_KEY_FILE_ID) || ARG_SET(OPT_KEY_SLOT_ID) ||
+	     action_argc > 1))
+		usage(popt_context, EXIT_FAILURE,
+		      _("Key files and keyslots are listed in batch file (options --unbound, --master-key-file, --key-slot and new key file argument are not allowed)."),
+		      poptGetInvocationName(popt_context));
+
+	if (ARG_SET(OPT_RESILIENCE_DEVICE_ID) &&
+	    (!ARG_SET(OPT_RESILIENCE_ID) || strcmp(ARG_STR(OPT_RESILIENCE_ID), "journal")))
+		usage(popt_context, EXIT_FAILURE,
+		      _("Option --resilience-device can be used only with --resilience journal."),
+		      poptGetInvocationName(popt_context));
+
+	if (ARG_SET(OPT_SHARED_PASSPHRASE_ID) && !ARG_SET(OPT_BATCH_FILE_ID))
+		usage(popt_context, EXIT_FAILURE,
+		      _("Option --shared-passphrase is allowed only with --batch-file."),
+		      poptGetInvocationName(popt_context));
+
+	if (ARG_SET(OPT_PERF_PROFILE_ID) && (ARG_SET(OPT_TEST_PASSPHRASE_ID) ||
+	    ARG_SET(OPT_BATCH_FILE_ID) || ARG_SET(OPT_TOKEN_ONLY_ID) ||
+	    (device_type && strncmp(device_type, "luks", 4))))
+		usage(popt_context, EXIT_FAILURE,
+		      _("Option --perf-profile is allowed only for open of LUKS device (not with --test-passphrase, --token-only or --batch-file)."),
+		      poptGetInvocationName(popt_context));
+
 	if (ARG_SET(OPT_PERSISTENT_ID) && ARG_SET(OPT_TEST_PASSPHRASE_ID))
 		usage(popt_context, EXIT_FAILURE,
 		      _("Option --persistent is not allowed with --test-passphrase."),
@@ -3905,6 +5723,18 @@ int main(int argc, const char **argv)
 		_("PBKDF forced iterations cannot be combined with iteration time option."),
 		poptGetInvocationName(popt_context));
 
+	if (ARG_SET(OPT_PBKDF_CACHE_ID) &&
+	    crypt_pbkdf_cache(NULL, ARG_STR(OPT_PBKDF_CACHE_ID), ARG_UINT32(OPT_PBKDF_CACHE_TTL_ID)))
+		usage(popt_context, EXIT_FAILURE,
+		_("PBKDF benchmark cache path must be absolute."),
+		poptGetInvocationName(popt_context));
+
+	if (ARG_SET(OPT_KEYSLOT_HINT_CACHE_ID) &&
+	    crypt_keyslot_hint_cache(NULL, ARG_STR(OPT_KEYSLOT_HINT_CACHE_ID)))
+		usage(popt_context, EXIT_FAILURE,
+		_("Keyslot hint cache path must be absolute."),
+		poptGetInvocationName(popt_context));
+
 	/* open action specific check */
 	if (ARG_SET(OPT_SECTOR_SIZE_ID) && !strcmp(aname, OPEN_ACTION) &&
 	    (!device_type || strcmp(device_type, "plain")))
@@ -3984,6 +5814,20 @@ int main(int argc, const char **argv)
 	if (ARG_SET(OPT_DISABLE_KEYRING_ID))
 		(void) crypt_volume_key_keyring(NULL, 0);
 
+	if (ARG_SET(OPT_MEMORY_LOCK_ID)) {
+		if (!strcmp(ARG_STR(OPT_MEMORY_LOCK_ID), "all"))
+			(void) crypt_set_memory_lock_policy(CRYPT_MEMORY_LOCK_ALL);
+		else if (!strcmp(ARG_STR(OPT_MEMORY_LOCK_ID), "secrets"))
+			(void) crypt_set_memory_lock_policy(CRYPT_MEMORY_LOCK_SECRETS);
+		else
+			usage(popt_context, EXIT_FAILURE, _("Invalid memory lock policy."),
+			      poptGetInvocationName(popt_context));
+	}
+
+	/* CLI instances are separate processes, budget is always shared */
+	if (ARG_SET(OPT_PBKDF_MEMORY_BUDGET_ID))
+		(void) crypt_pbkdf_memory_budget(ARG_UINT32(OPT_PBKDF_MEMORY_BUDGET_ID), CRYPT_PBKDF_BUDGET_GLOBAL);
+
 	if (ARG_SET(OPT_DISABLE_LOCKS_ID) && crypt_metadata_locking(NULL, 0)) {
 		log_std(_("Cannot disable metadata locking."));
 		r = EXIT_FAILURE;
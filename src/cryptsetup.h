@@ -86,6 +86,7 @@ int tools_get_key(const char *prompt,
 		  int timeout, int verify, int pwquality,
 		  struct crypt_device *cd);
 void tools_passphrase_msg(int r);
+void tools_stdin_records(bool enable);
 int tools_is_stdin(const char *key_file);
 int tools_string_to_size(const char *s, uint64_t *size);
 
@@ -95,8 +96,13 @@ struct tools_progress_params {
 	struct timeval end_time;
 	uint64_t start_offset;
 	bool batch_mode;
+	bool json;
+	uint64_t last_offset;
+	struct crypt_device *cd; /* reencryption counters in json output */
 };
 
+int tools_set_numa_node(struct crypt_device *cd, bool set, int32_t node);
+
 int tools_wipe_progress(uint64_t size, uint64_t offset, void *usrptr);
 int tools_reencrypt_progress(uint64_t size, uint64_t offset, void *usrptr);
 
@@ -25,14 +25,26 @@ ARG(OPT_ACTIVE_NAME, '\0', POPT_ARG_STRING, N_("Override device autodetection of
 
 ARG(OPT_ALIGN_PAYLOAD, '\0', POPT_ARG_STRING, N_("Align payload at <n> sector boundaries - for luksFormat"), N_("SECTORS"), CRYPT_ARG_UINT32, {}, OPT_ALIGN_PAYLOAD_ACTIONS)
 
+ARG(OPT_ALL, '\0', POPT_ARG_NONE, N_("Close all active devices managed by cryptsetup"), NULL, CRYPT_ARG_BOOL, {}, OPT_ALL_ACTIONS)
+
+ARG(OPT_ALLOW_CRC32C, '\0', POPT_ARG_NONE, N_("Allow crc32c resilience hash not supported by older releases"), NULL, CRYPT_ARG_BOOL, {}, OPT_ALLOW_CRC32C_ACTIONS)
+
 ARG(OPT_ALLOW_DISCARDS, '\0', POPT_ARG_NONE, N_("Allow discards (aka TRIM) requests for device"), NULL, CRYPT_ARG_BOOL, {}, OPT_ALLOW_DISCARDS_ACTIONS)
 
+ARG(OPT_BATCH_FILE, '\0', POPT_ARG_STRING, N_("Activate (<name> <device> [<key file>]), convert (<device>) or reencrypt (<device> [<key file>]) all LUKS devices listed in file"), NULL, CRYPT_ARG_STRING, {}, OPT_BATCH_FILE_ACTIONS)
+
 ARG(OPT_BATCH_MODE, 'q', POPT_ARG_NONE, N_("Do not ask for confirmation"), NULL, CRYPT_ARG_BOOL, {}, {})
 
+ARG(OPT_BUFFER_SIZE, '\0', POPT_ARG_STRING, N_("Benchmark buffer sizes (comma separated list)"), N_("bytes"), CRYPT_ARG_STRING, {}, OPT_BUFFER_SIZE_ACTIONS)
+
 ARG(OPT_CANCEL_DEFERRED, '\0', POPT_ARG_NONE, N_("Cancel a previously set deferred device removal"), NULL, CRYPT_ARG_BOOL, {}, OPT_DEFERRED_ACTIONS)
 
 ARG(OPT_CIPHER, 'c', POPT_ARG_STRING, N_("The cipher used to encrypt the disk (see /proc/crypto)"), NULL, CRYPT_ARG_STRING, {}, {})
 
+ARG(OPT_COMMIT_INTERVAL_SIZE, '\0', POPT_ARG_STRING, N_("Commit reencryption metadata after this amount of data (with none resilience)."), N_("bytes"), CRYPT_ARG_UINT64, {}, OPT_COMMIT_INTERVAL_ACTIONS)
+
+ARG(OPT_COMMIT_INTERVAL_TIME, '\0', POPT_ARG_STRING, N_("Commit reencryption metadata after this time (with none resilience)."), N_("secs"), CRYPT_ARG_UINT32, {}, OPT_COMMIT_INTERVAL_ACTIONS)
+
 ARG(OPT_DEBUG, '\0', POPT_ARG_NONE, N_("Show debug messages"), NULL, CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_DEBUG_JSON, '\0', POPT_ARG_NONE, N_("Show debug messages including JSON metadata"), NULL, CRYPT_ARG_BOOL, {}, {})
@@ -47,6 +59,8 @@ ARG(OPT_DISABLE_KEYRING, '\0', POPT_ARG_NONE, N_("Disable loading volume keys vi
 
 ARG(OPT_DISABLE_LOCKS, '\0', POPT_ARG_NONE, N_("Disable locking of on-disk metadata"), NULL, CRYPT_ARG_BOOL, {}, {})
 
+ARG(OPT_DMCRYPT, '\0', POPT_ARG_NONE, N_("Benchmark ciphers through temporary dm-crypt device"), NULL, CRYPT_ARG_BOOL, {}, OPT_DMCRYPT_ACTIONS)
+
 ARG(OPT_DUMP_JSON, '\0', POPT_ARG_NONE, N_("Dump info in JSON format (LUKS2 only)"), NULL, CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_DUMP_MASTER_KEY, '\0', POPT_ARG_NONE, N_("Dump volume (master) key instead of keyslots info"), NULL, CRYPT_ARG_BOOL, {}, {})
@@ -61,6 +75,8 @@ ARG(OPT_HEADER, '\0', POPT_ARG_STRING, N_("Device or file with separated LUKS he
 
 ARG(OPT_HEADER_BACKUP_FILE, '\0', POPT_ARG_STRING, N_("File with LUKS header and keyslots backup"), NULL, CRYPT_ARG_STRING, {}, {})
 
+ARG(OPT_HOTZONE_ADAPTIVE, '\0', POPT_ARG_NONE, N_("Adjust reencryption hotzone size to device load."), NULL, CRYPT_ARG_BOOL, {}, OPT_HOTZONE_ADAPTIVE_ACTIONS)
+
 ARG(OPT_HOTZONE_SIZE, '\0', POPT_ARG_STRING, N_("Maximal reencryption hotzone size."), N_("bytes"), CRYPT_ARG_UINT64, {}, OPT_HOTZONE_SIZE_ACTIONS)
 
 ARG(OPT_INIT_ONLY, '\0', POPT_ARG_NONE, N_("Initialize LUKS2 reencryption in metadata only."), NULL, CRYPT_ARG_BOOL, {}, {})
@@ -75,10 +91,14 @@ ARG(OPT_INTEGRITY_NO_WIPE, '\0', POPT_ARG_NONE, N_("Do not wipe device after for
 
 ARG(OPT_ITER_TIME, 'i', POPT_ARG_STRING, N_("PBKDF iteration time for LUKS (in ms)"), N_("msecs"), CRYPT_ARG_UINT32, {}, {})
 
+ARG(OPT_JSON, '\0', POPT_ARG_NONE, N_("Print benchmark results in JSON format"), NULL, CRYPT_ARG_BOOL, {}, OPT_JSON_ACTIONS)
+
 ARG(OPT_IV_LARGE_SECTORS, '\0', POPT_ARG_NONE, N_("Use IV counted in sector size (not in 512 bytes)"), NULL , CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_JSON_FILE, '\0', POPT_ARG_STRING, N_("Read or write the json from or to a file"), NULL, CRYPT_ARG_STRING, {}, {})
 
+ARG(OPT_KCAPI_ZEROCOPY, '\0', POPT_ARG_NONE, N_("Use zero-copy kernel crypto API in userspace reencryption."), NULL, CRYPT_ARG_BOOL, {}, OPT_KCAPI_ZEROCOPY_ACTIONS)
+
 ARG(OPT_KEY_DESCRIPTION, '\0', POPT_ARG_STRING, N_("Key description"), NULL, CRYPT_ARG_STRING, {}, {})
 
 ARG(OPT_KEY_FILE, 'd', POPT_ARG_STRING, N_("Read the key from a file"), NULL, CRYPT_ARG_STRING, {}, {})
@@ -93,6 +113,8 @@ ARG(OPT_KEYFILE_SIZE, 'l', POPT_ARG_STRING, N_("Limits the read from keyfile"),
 
 ARG(OPT_KEYSLOT_CIPHER, '\0', POPT_ARG_STRING, N_("LUKS2 keyslot: The cipher used for keyslot encryption"), NULL, CRYPT_ARG_STRING, {}, {})
 
+ARG(OPT_KEYSLOT_HINT_CACHE, '\0', POPT_ARG_STRING, N_("Path to cache of last opened LUKS2 keyslots"), NULL, CRYPT_ARG_STRING, {}, {})
+
 ARG(OPT_KEYSLOT_KEY_SIZE, '\0', POPT_ARG_STRING, N_("LUKS2 keyslot: The size of the encryption key"), N_("BITS"), CRYPT_ARG_UINT32, {}, {})
 
 ARG(OPT_LABEL, '\0', POPT_ARG_STRING, N_("Set label for the LUKS2 device"), NULL, CRYPT_ARG_STRING, {}, OPT_LABEL_ACTIONS)
@@ -103,24 +125,50 @@ ARG(OPT_LUKS2_METADATA_SIZE, '\0', POPT_ARG_STRING, N_("LUKS2 header metadata ar
 
 ARG(OPT_MASTER_KEY_FILE, '\0', POPT_ARG_STRING, N_("Read the volume (master) key from file."), NULL, CRYPT_ARG_STRING, {}, {})
 
+ARG(OPT_MAX_IOPS, '\0', POPT_ARG_STRING, N_("Limit reencryption hotzone I/O operations per second."), NULL, CRYPT_ARG_UINT32, {}, OPT_MAX_IOPS_ACTIONS)
+
+ARG(OPT_MAX_THROUGHPUT, '\0', POPT_ARG_STRING, N_("Limit reencryption throughput (per second)."), N_("bytes"), CRYPT_ARG_UINT64, {}, OPT_MAX_THROUGHPUT_ACTIONS)
+
+ARG(OPT_MEMORY_LOCK, '\0', POPT_ARG_STRING, N_("Memory locking policy (all, secrets)"), NULL, CRYPT_ARG_STRING, {}, {})
+
 ARG(OPT_NEW_KEYFILE_OFFSET , '\0', POPT_ARG_STRING, N_("Number of bytes to skip in newly added keyfile"), N_("bytes"), CRYPT_ARG_UINT64, {}, {})
 
 ARG(OPT_NEW_KEYFILE_SIZE, '\0', POPT_ARG_STRING, N_("Limits the read from newly added keyfile"), N_("bytes"), CRYPT_ARG_UINT32, {}, {})
 
+ARG(OPT_NUMA_NODE, '\0', POPT_ARG_STRING, N_("NUMA node for parallel workers (-1 disables binding, default is data device node)"), N_("node"), CRYPT_ARG_INT32, {}, OPT_NUMA_NODE_ACTIONS)
+
 ARG(OPT_OFFSET, 'o', POPT_ARG_STRING, N_("The start offset in the backend device"), N_("SECTORS"), CRYPT_ARG_UINT64, {}, OPT_OFFSET_ACTIONS)
 
 ARG(OPT_PBKDF, '\0', POPT_ARG_STRING, N_("PBKDF algorithm (for LUKS2): argon2i, argon2id, pbkdf2"), NULL, CRYPT_ARG_STRING, {}, {})
 
+ARG(OPT_PBKDF_CACHE, '\0', POPT_ARG_STRING, N_("Path to persistent PBKDF benchmark cache"), NULL, CRYPT_ARG_STRING, {}, {})
+
+ARG(OPT_PBKDF_CACHE_TTL, '\0', POPT_ARG_STRING, N_("PBKDF benchmark cache expiry time (0 means no expiry)"), N_("secs"), CRYPT_ARG_UINT32, { .u32_value = 86400 }, {})
+
 ARG(OPT_PBKDF_FORCE_ITERATIONS, '\0', POPT_ARG_STRING, N_("PBKDF iterations cost (forced, disables benchmark)"), "LONG", CRYPT_ARG_UINT32, {}, {})
 
 ARG(OPT_PBKDF_MEMORY, '\0', POPT_ARG_STRING, N_("PBKDF memory cost limit"), N_("kilobytes"), CRYPT_ARG_UINT32, { .u32_value = DEFAULT_LUKS2_MEMORY_KB }, {})
 
+ARG(OPT_PBKDF_MEMORY_BUDGET, '\0', POPT_ARG_STRING, N_("Total memory limit of concurrent memory-hard PBKDF unlocks"), N_("kilobytes"), CRYPT_ARG_UINT32, {}, OPT_PBKDF_MEMORY_BUDGET_ACTIONS)
+
 ARG(OPT_PBKDF_PARALLEL, '\0', POPT_ARG_STRING, N_("PBKDF parallel cost"), N_("threads"), CRYPT_ARG_UINT32, { .u32_value = DEFAULT_LUKS2_PARALLEL_THREADS }, {})
 
+ARG(OPT_PBKDF_SWEEP, '\0', POPT_ARG_NONE, N_("Measure PBKDF over a grid of memory, thread and iteration costs (JSON output)"), NULL, CRYPT_ARG_BOOL, {}, OPT_PBKDF_SWEEP_ACTIONS)
+
+ARG(OPT_PBKDF_SWEEP_ITERATIONS, '\0', POPT_ARG_STRING, N_("PBKDF sweep iteration costs (comma separated list)"), NULL, CRYPT_ARG_STRING, {}, OPT_PBKDF_SWEEP_ACTIONS)
+
+ARG(OPT_PBKDF_SWEEP_MEMORY, '\0', POPT_ARG_STRING, N_("PBKDF sweep memory costs (comma separated list)"), N_("bytes"), CRYPT_ARG_STRING, {}, OPT_PBKDF_SWEEP_ACTIONS)
+
+ARG(OPT_PBKDF_SWEEP_REPEAT, '\0', POPT_ARG_STRING, N_("PBKDF sweep measured runs per point"), NULL, CRYPT_ARG_UINT32, { .u32_value = 3 }, OPT_PBKDF_SWEEP_ACTIONS)
+
+ARG(OPT_PBKDF_SWEEP_WARMUP, '\0', POPT_ARG_STRING, N_("PBKDF sweep warm-up runs per point"), NULL, CRYPT_ARG_UINT32, { .u32_value = 1 }, OPT_PBKDF_SWEEP_ACTIONS)
+
 ARG(OPT_PERF_NO_READ_WORKQUEUE, '\0', POPT_ARG_NONE, N_("Bypass dm-crypt workqueue and process read requests synchronously"), NULL, CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_PERF_NO_WRITE_WORKQUEUE, '\0', POPT_ARG_NONE, N_("Bypass dm-crypt workqueue and process write requests synchronously"), NULL, CRYPT_ARG_BOOL, {}, {})
 
+ARG(OPT_PERF_PROFILE, '\0', POPT_ARG_STRING, N_("Probe and select dm-crypt performance flags (auto, latency, throughput)"), NULL, CRYPT_ARG_STRING, {}, OPT_PERF_PROFILE_ACTIONS)
+
 ARG(OPT_PERF_SAME_CPU_CRYPT, '\0', POPT_ARG_NONE, N_("Use dm-crypt same_cpu_crypt performance compatibility option"), NULL, CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_PERF_SUBMIT_FROM_CRYPT_CPUS, '\0', POPT_ARG_NONE, N_("Use dm-crypt submit_from_crypt_cpus performance compatibility option"), NULL, CRYPT_ARG_BOOL, {}, {})
@@ -131,6 +179,10 @@ ARG(OPT_PRIORITY, '\0', POPT_ARG_STRING, N_("Keyslot priority: ignore, normal, p
 
 ARG(OPT_PROGRESS_FREQUENCY, '\0', POPT_ARG_STRING, N_("Progress line update (in seconds)"), N_("secs"), CRYPT_ARG_UINT32, {}, {})
 
+ARG(OPT_PROGRESS_JSON, '\0', POPT_ARG_NONE, N_("Print progress data in json format (suitable for machine processing)"), NULL, CRYPT_ARG_BOOL, {}, {})
+
+ARG(OPT_RATE_LIMIT_FILE, '\0', POPT_ARG_STRING, N_("Read reencryption rate limit from file (reloaded on SIGHUP)"), NULL, CRYPT_ARG_STRING, {}, OPT_RATE_LIMIT_FILE_ACTIONS)
+
 ARG(OPT_READONLY, 'r', POPT_ARG_NONE, N_("Create a readonly mapping"), NULL, CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_REDUCE_DEVICE_SIZE, '\0', POPT_ARG_STRING, N_("Reduce data device size (move data offset). DANGEROUS!"), N_("bytes"), CRYPT_ARG_UINT64, {}, {})
@@ -139,20 +191,26 @@ ARG(OPT_REFRESH, '\0', POPT_ARG_NONE, N_("Refresh (reactivate) device with new p
 
 ARG(OPT_RESILIENCE, '\0', POPT_ARG_STRING, N_("Reencryption hotzone resilience type (checksum,journal,none)"), NULL, CRYPT_ARG_STRING, {}, {})
 
+ARG(OPT_RESILIENCE_DEVICE, '\0', POPT_ARG_STRING, N_("Device or file for reencryption journal (journal resilience only)"), NULL, CRYPT_ARG_STRING, {}, OPT_RESILIENCE_DEVICE_ACTIONS)
+
 ARG(OPT_RESILIENCE_HASH, '\0', POPT_ARG_STRING, N_("Reencryption hotzone checksums hash"), NULL, CRYPT_ARG_STRING, {}, {})
 
 ARG(OPT_RESUME_ONLY, '\0', POPT_ARG_NONE, N_("Resume initialized LUKS2 reencryption only."), NULL, CRYPT_ARG_BOOL, {}, {})
 
-ARG(OPT_SECTOR_SIZE, '\0', POPT_ARG_STRING, N_("Encryption sector size (default: 512 bytes)"), "INT", CRYPT_ARG_UINT32, {}, OPT_SECTOR_SIZE_ACTIONS)
+ARG(OPT_SECTOR_SIZE, '\0', POPT_ARG_STRING, N_("Encryption sector size (default: 512 bytes, auto-bench to measure)"), "INT", CRYPT_ARG_UINT32, {}, OPT_SECTOR_SIZE_ACTIONS)
 
 ARG(OPT_SERIALIZE_MEMORY_HARD_PBKDF, '\0', POPT_ARG_NONE, N_("Use global lock to serialize memory hard PBKDF (OOM workaround)"), NULL, CRYPT_ARG_BOOL, {}, OPT_SERIALIZE_MEMORY_HARD_PBKDF_ACTIONS)
 
 ARG(OPT_SHARED, '\0', POPT_ARG_NONE, N_("Share device with another non-overlapping crypt segment"), NULL, CRYPT_ARG_BOOL, {}, {})
 
+ARG(OPT_SHARED_PASSPHRASE, '\0', POPT_ARG_NONE, N_("Unlock batch file devices without key file using one passphrase in parallel"), NULL, CRYPT_ARG_BOOL, {}, OPT_SHARED_PASSPHRASE_ACTIONS)
+
 ARG(OPT_SIZE, 'b', POPT_ARG_STRING, N_("The size of the device"), N_("SECTORS"), CRYPT_ARG_UINT64, {}, {})
 
 ARG(OPT_SKIP, 'p', POPT_ARG_STRING, N_("How many sectors of the encrypted data to skip at the beginning"), N_("SECTORS"), CRYPT_ARG_UINT64, {}, OPT_SKIP_ACTIONS)
 
+ARG(OPT_SKIP_UNALLOCATED, '\0', POPT_ARG_NONE, N_("Do not encrypt unallocated areas (holes) in LUKS2 encryption."), NULL, CRYPT_ARG_BOOL, {}, OPT_SKIP_UNALLOCATED_ACTIONS)
+
 ARG(OPT_SUBSYSTEM, '\0', POPT_ARG_STRING, N_("Set subsystem label for the LUKS2 device"), NULL, CRYPT_ARG_STRING, {}, OPT_SUBSYSTEM_ACTIONS)
 
 ARG(OPT_TCRYPT_BACKUP, '\0', POPT_ARG_NONE, N_("Use backup (secondary) TCRYPT header"), NULL, CRYPT_ARG_BOOL, {}, OPT_TCRYPT_BACKUP_ACTIONS)
@@ -165,8 +223,12 @@ ARG(OPT_TEST_ARGS, '\0', POPT_ARG_NONE, N_("Do not run action, just validate all
 
 ARG(OPT_TEST_PASSPHRASE, '\0', POPT_ARG_NONE, N_("Do not activate device, just check passphrase"), NULL, CRYPT_ARG_BOOL, {}, OPT_TEST_PASSPHRASE_ACTIONS)
 
+ARG(OPT_THREADS, '\0', POPT_ARG_STRING, N_("Benchmark thread counts (comma separated list)"), N_("threads"), CRYPT_ARG_STRING, {}, OPT_THREADS_ACTIONS)
+
 ARG(OPT_TIMEOUT, 't', POPT_ARG_STRING, N_("Timeout for interactive passphrase prompt (in seconds)"), N_("secs"), CRYPT_ARG_UINT32, {}, {})
 
+ARG(OPT_TIMING, '\0', POPT_ARG_NONE, N_("Print time spent in activation phases"), NULL, CRYPT_ARG_BOOL, {}, OPT_TIMING_ACTIONS)
+
 ARG(OPT_TOKEN_ID, '\0', POPT_ARG_STRING, N_("Token number (default: any)"), "INT", CRYPT_ARG_INT32, { .i32_value = CRYPT_ANY_TOKEN }, {})
 
 ARG(OPT_TOKEN_ONLY, '\0', POPT_ARG_NONE, N_("Do not ask for passphrase if activation by token fails"), NULL, CRYPT_ARG_BOOL, {}, {})
@@ -192,3 +254,5 @@ ARG(OPT_VERACRYPT_QUERY_PIM, '\0', POPT_ARG_NONE, N_("Query Personal Iteration M
 ARG(OPT_VERBOSE, 'v', POPT_ARG_NONE, N_("Shows more detailed error messages"), NULL, CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_VERIFY_PASSPHRASE, 'y', POPT_ARG_NONE, N_("Verifies the passphrase by asking for it twice"), NULL, CRYPT_ARG_BOOL, {}, {})
+
+ARG(OPT_VOLUME_KEY_HANDOFF, '\0', POPT_ARG_STRING, N_("Keep unlocked volume key in session keyring for other invocations (in seconds)"), N_("secs"), CRYPT_ARG_UINT32, {}, OPT_VOLUME_KEY_HANDOFF_ACTIONS)
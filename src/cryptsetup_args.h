@@ -34,6 +34,7 @@
 #define ISLUKS_ACTION		"isLuks"
 #define ADDKEY_ACTION		"luksAddKey"
 #define CHANGEKEY_ACTION	"luksChangeKey"
+#define COMPACT_ACTION		"luksCompact"
 #define CONVERTKEY_ACTION	"luksConvertKey"
 #define LUKSDUMP_ACTION		"luksDump"
 #define FORMAT_ACTION		"luksFormat"
@@ -54,31 +55,53 @@
 
 /* avoid unshielded commas in ARG() macros later */
 #define OPT_ALIGN_PAYLOAD_ACTIONS		{ FORMAT_ACTION }
+#define OPT_ALL_ACTIONS				{ CLOSE_ACTION }
+#define OPT_ALLOW_CRC32C_ACTIONS		{ REENCRYPT_ACTION }
 #define OPT_ALLOW_DISCARDS_ACTIONS		{ OPEN_ACTION }
+#define OPT_BATCH_FILE_ACTIONS			{ OPEN_ACTION, CONVERT_ACTION, REENCRYPT_ACTION, ADDKEY_ACTION }
+#define OPT_BUFFER_SIZE_ACTIONS			{ BENCHMARK_ACTION }
+#define OPT_COMMIT_INTERVAL_ACTIONS		{ REENCRYPT_ACTION }
 #define OPT_DEFERRED_ACTIONS			{ CLOSE_ACTION }
+#define OPT_DMCRYPT_ACTIONS			{ BENCHMARK_ACTION }
+#define OPT_HOTZONE_ADAPTIVE_ACTIONS		{ REENCRYPT_ACTION }
 #define OPT_HOTZONE_SIZE_ACTIONS		{ REENCRYPT_ACTION }
 #define OPT_INTEGRITY_ACTIONS			{ FORMAT_ACTION }
+#define OPT_JSON_ACTIONS			{ BENCHMARK_ACTION }
+#define OPT_KCAPI_ZEROCOPY_ACTIONS		{ REENCRYPT_ACTION }
 #define OPT_KEY_SIZE_ACTIONS			{ OPEN_ACTION, BENCHMARK_ACTION, FORMAT_ACTION, REENCRYPT_ACTION, ADDKEY_ACTION }
 #define OPT_KEY_SLOT_ACTIONS			{ OPEN_ACTION, REENCRYPT_ACTION, CONFIG_ACTION, FORMAT_ACTION, ADDKEY_ACTION, CHANGEKEY_ACTION, CONVERTKEY_ACTION, LUKSDUMP_ACTION, TOKEN_ACTION }
 #define OPT_LABEL_ACTIONS			{ CONFIG_ACTION, FORMAT_ACTION }
 #define OPT_LUKS2_KEYSLOTS_SIZE_ACTIONS		{ REENCRYPT_ACTION, FORMAT_ACTION }
 #define OPT_LUKS2_METADATA_SIZE_ACTIONS		{ REENCRYPT_ACTION, FORMAT_ACTION }
+#define OPT_MAX_IOPS_ACTIONS			{ REENCRYPT_ACTION }
+#define OPT_MAX_THROUGHPUT_ACTIONS		{ REENCRYPT_ACTION }
+#define OPT_NUMA_NODE_ACTIONS			{ REENCRYPT_ACTION, FORMAT_ACTION }
 #define OPT_OFFSET_ACTIONS			{ OPEN_ACTION, REENCRYPT_ACTION, FORMAT_ACTION }
+#define OPT_PBKDF_MEMORY_BUDGET_ACTIONS		{ OPEN_ACTION, RESUME_ACTION, REENCRYPT_ACTION }
+#define OPT_PBKDF_SWEEP_ACTIONS			{ BENCHMARK_ACTION }
+#define OPT_PERF_PROFILE_ACTIONS		{ OPEN_ACTION }
 #define OPT_PERSISTENT_ACTIONS			{ OPEN_ACTION }
 #define OPT_PRIORITY_ACTIONS			{ CONFIG_ACTION }
+#define OPT_RATE_LIMIT_FILE_ACTIONS		{ REENCRYPT_ACTION }
+#define OPT_RESILIENCE_DEVICE_ACTIONS		{ REENCRYPT_ACTION }
 #define OPT_REFRESH_ACTIONS			{ OPEN_ACTION }
-#define OPT_SECTOR_SIZE_ACTIONS			{ OPEN_ACTION, REENCRYPT_ACTION, FORMAT_ACTION }
+#define OPT_SECTOR_SIZE_ACTIONS			{ OPEN_ACTION, REENCRYPT_ACTION, FORMAT_ACTION, BENCHMARK_ACTION }
 #define OPT_SERIALIZE_MEMORY_HARD_PBKDF_ACTIONS { OPEN_ACTION }
+#define OPT_SHARED_PASSPHRASE_ACTIONS		{ OPEN_ACTION }
 #define OPT_SKIP_ACTIONS			{ OPEN_ACTION }
+#define OPT_SKIP_UNALLOCATED_ACTIONS		{ REENCRYPT_ACTION }
 #define OPT_SUBSYSTEM_ACTIONS			{ CONFIG_ACTION, FORMAT_ACTION }
 #define OPT_TCRYPT_BACKUP_ACTIONS		{ OPEN_ACTION, TCRYPTDUMP_ACTION }
 #define OPT_TCRYPT_HIDDEN_ACTIONS		{ OPEN_ACTION, TCRYPTDUMP_ACTION }
 #define OPT_TCRYPT_SYSTEM_ACTIONS		{ OPEN_ACTION, TCRYPTDUMP_ACTION }
 #define OPT_TEST_PASSPHRASE_ACTIONS		{ OPEN_ACTION }
+#define OPT_THREADS_ACTIONS			{ BENCHMARK_ACTION }
+#define OPT_TIMING_ACTIONS			{ OPEN_ACTION }
 #define OPT_UNBOUND_ACTIONS			{ ADDKEY_ACTION, LUKSDUMP_ACTION }
 #define OPT_USE_RANDOM_ACTIONS			{ FORMAT_ACTION }
 #define OPT_USE_URANDOM_ACTIONS			{ FORMAT_ACTION }
 #define OPT_UUID_ACTIONS			{ FORMAT_ACTION, UUID_ACTION }
+#define OPT_VOLUME_KEY_HANDOFF_ACTIONS		{ OPEN_ACTION, RESUME_ACTION, REENCRYPT_ACTION }
 
 enum {
 OPT_UNUSED_ID = 0, /* leave unused due to popt library */
@@ -21,6 +21,7 @@
 
 #include <sys/ioctl.h>
 #include <linux/fs.h>
+#include <pthread.h>
 #include <uuid/uuid.h>
 
 #include "cryptsetup.h"
@@ -906,72 +907,317 @@ static ssize_t read_buf(int fd, void *buf, size_t count)
 	return (ssize_t)count;
 }
 
-static int copy_data_forward(struct reenc_ctx *rc, int fd_old, int fd_new,
-			     size_t block_size, void *buf, uint64_t *bytes)
-{
-	ssize_t s1, s2;
-	struct tools_progress_params prog_parms = {
-		.frequency = ARG_UINT32(OPT_PROGRESS_FREQUENCY_ID),
-		.batch_mode = ARG_SET(OPT_BATCH_MODE_ID)
-	};
+/*
+ * Next block is read from old device while the current one is written
+ * to the new device (reader thread fills buffers in order).
+ */
+#define COPY_BUFFERS 2
 
-	log_dbg("Reencrypting in forward direction.");
+struct copy_buffer {
+	void *buf;
+	uint64_t offset;
+	ssize_t size;
+	bool full;
+};
 
-	if (lseek64(fd_old, rc->device_offset, SEEK_SET) < 0 ||
-	    lseek64(fd_new, rc->device_offset, SEEK_SET) < 0) {
+struct copy_reader {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct copy_buffer b[COPY_BUFFERS];
+	int fd;
+	int direction;
+	size_t block_size;
+	uint64_t device_size;
+	uint64_t offset; /* next block start (forward) or end (backward) */
+	unsigned next;
+	bool dontneed;
+	bool threaded;
+	bool stop;
+	bool done;
+	int r;
+};
+
+/* Returns 1 if buffer was filled, 0 if there is nothing to read */
+static int copy_reader_fill(struct copy_reader *cr, struct copy_buffer *b)
+{
+	uint64_t offset;
+	ssize_t size, s;
+
+	if (cr->direction == FORWARD) {
+		if (cr->offset >= cr->device_size)
+			return 0;
+		offset = cr->offset;
+		size = cr->block_size;
+	} else {
+		if (!cr->offset)
+			return 0;
+		offset = cr->offset < cr->block_size ? 0 : cr->offset - cr->block_size;
+		size = cr->offset - offset;
+	}
+
+	if (lseek64(cr->fd, offset, SEEK_SET) < 0) {
 		log_err(_("Cannot seek to device offset."));
 		return -EIO;
 	}
 
-	rc->resume_bytes = *bytes = rc->device_offset;
+	s = read_buf(cr->fd, b->buf, size);
+	if (s < 0 || (s != size && (cr->direction == BACKWARD ||
+	    (offset + s) != cr->device_size))) {
+		log_dbg("Read error, expecting %zd, got %zd.", size, s);
+		return -EIO;
+	}
 
-	tools_reencrypt_progress(rc->device_size, *bytes, &prog_parms);
+	/* buffered fallback for direct-io, do not keep old data in page cache */
+	if (cr->dontneed)
+		posix_fadvise(cr->fd, offset, s, POSIX_FADV_DONTNEED);
 
-	if (write_log(rc) < 0)
-		return -EIO;
+	/* If device_size is forced, never write more than limit */
+	if ((offset + s) > cr->device_size)
+		s = cr->device_size - offset;
+
+	if (cr->direction == FORWARD)
+		cr->offset += s;
+	else
+		cr->offset = offset;
+
+	b->offset = offset;
+	b->size = s;
+
+	return 1;
+}
+
+static void *copy_reader_thread(void *arg)
+{
+	struct copy_reader *cr = arg;
+	struct copy_buffer *b;
+	bool stop;
+	unsigned i;
+	int r = 0;
+
+	for (i = 0; !quit; i++) {
+		b = &cr->b[i % COPY_BUFFERS];
+
+		pthread_mutex_lock(&cr->lock);
+		while (b->full && !cr->stop)
+			pthread_cond_wait(&cr->cond, &cr->lock);
+		stop = cr->stop;
+		pthread_mutex_unlock(&cr->lock);
+
+		if (stop)
+			break;
+
+		r = copy_reader_fill(cr, b);
+		if (r <= 0)
+			break;
+
+		pthread_mutex_lock(&cr->lock);
+		b->full = true;
+		pthread_cond_broadcast(&cr->cond);
+		pthread_mutex_unlock(&cr->lock);
+	}
+
+	pthread_mutex_lock(&cr->lock);
+	cr->r = r < 0 ? r : 0;
+	cr->done = true;
+	pthread_cond_broadcast(&cr->cond);
+	pthread_mutex_unlock(&cr->lock);
+
+	return NULL;
+}
 
-	while (!quit && rc->device_offset < rc->device_size) {
-		s1 = read_buf(fd_old, buf, block_size);
-		if (s1 < 0 || ((size_t)s1 != block_size &&
-		    (rc->device_offset + s1) != rc->device_size)) {
-			log_dbg("Read error, expecting %zu, got %zd.",
-				block_size, s1);
-			return -EIO;
+static void copy_reader_start(struct copy_reader *cr)
+{
+	if (pthread_mutex_init(&cr->lock, NULL))
+		return;
+
+	if (pthread_cond_init(&cr->cond, NULL)) {
+		pthread_mutex_destroy(&cr->lock);
+		return;
+	}
+
+	if (pthread_create(&cr->thread, NULL, copy_reader_thread, cr)) {
+		pthread_cond_destroy(&cr->cond);
+		pthread_mutex_destroy(&cr->lock);
+		return;
+	}
+
+	cr->threaded = true;
+}
+
+static void copy_reader_stop(struct copy_reader *cr)
+{
+	if (!cr->threaded)
+		return;
+
+	pthread_mutex_lock(&cr->lock);
+	cr->stop = true;
+	pthread_cond_broadcast(&cr->cond);
+	pthread_mutex_unlock(&cr->lock);
+
+	pthread_join(cr->thread, NULL);
+	pthread_cond_destroy(&cr->cond);
+	pthread_mutex_destroy(&cr->lock);
+	cr->threaded = false;
+}
+
+/* Returns next filled buffer in order, NULL if reader finished (or failed) */
+static struct copy_buffer *copy_reader_get(struct copy_reader *cr)
+{
+	struct copy_buffer *b = &cr->b[cr->next % COPY_BUFFERS];
+
+	/* without reader thread, read in the same thread */
+	if (!cr->threaded) {
+		cr->r = copy_reader_fill(cr, b);
+		if (cr->r <= 0) {
+			cr->r = cr->r < 0 ? cr->r : 0;
+			return NULL;
 		}
+		b->full = true;
+		return b;
+	}
+
+	pthread_mutex_lock(&cr->lock);
+	while (!b->full && !cr->done)
+		pthread_cond_wait(&cr->cond, &cr->lock);
+	if (!b->full)
+		b = NULL;
+	pthread_mutex_unlock(&cr->lock);
+
+	return b;
+}
+
+static void copy_reader_put(struct copy_reader *cr, struct copy_buffer *b)
+{
+	cr->next++;
+
+	if (!cr->threaded) {
+		b->full = false;
+		return;
+	}
+
+	pthread_mutex_lock(&cr->lock);
+	b->full = false;
+	pthread_cond_broadcast(&cr->cond);
+	pthread_mutex_unlock(&cr->lock);
+}
+
+/*
+ * Data is flushed before the log is updated, so the log offset never
+ * points beyond data already written to the new device.
+ */
+static int copy_data_sync(struct reenc_ctx *rc, int fd_new)
+{
+	if (ARG_SET(OPT_USE_FSYNC_ID) && fsync(fd_new) < 0) {
+		log_dbg("Write error, fsync.");
+		return -EIO;
+	}
+
+	if (ARG_SET(OPT_WRITE_LOG_ID) && write_log(rc) < 0)
+		return -EIO;
+
+	return 0;
+}
 
-		/* If device_size is forced, never write more than limit */
-		if ((s1 + rc->device_offset) > rc->device_size)
-			s1 = rc->device_size - rc->device_offset;
+static int copy_data_blocks(struct reenc_ctx *rc, struct copy_reader *cr, int fd_new,
+			    bool dontneed, uint64_t *bytes, struct tools_progress_params *prog_parms)
+{
+	uint64_t sync_bytes = (uint64_t)ARG_UINT32(OPT_SYNC_INTERVAL_ID) * 1024 * 1024;
+	uint64_t unsynced = 0, prev_offset = 0;
+	struct copy_buffer *b;
+	ssize_t s, prev_size = 0;
+	int r = 0;
+
+	copy_reader_start(cr);
+	if (!cr->threaded)
+		log_dbg("Cannot start reader thread, using synchronous copy.");
+
+	while (!quit && (b = copy_reader_get(cr))) {
+		if (lseek64(fd_new, b->offset, SEEK_SET) < 0) {
+			log_err(_("Cannot seek to device offset."));
+			r = -EIO;
+			break;
+		}
 
-		s2 = write(fd_new, buf, s1);
-		if (s2 < 0) {
-			log_dbg("Write error, expecting %zu, got %zd.",
-				block_size, s2);
-			return -EIO;
+		s = write(fd_new, b->buf, b->size);
+		if (s < 0 || s != b->size) {
+			log_dbg("Write error, expecting %zd, got %zd.", b->size, s);
+			r = -EIO;
+			break;
 		}
 
-		rc->device_offset += s1;
-		if (ARG_SET(OPT_WRITE_LOG_ID) && write_log(rc) < 0)
-			return -EIO;
+		if (rc->reencrypt_direction == FORWARD)
+			rc->device_offset += s;
+		else
+			rc->device_offset -= s;
 
-		if (ARG_SET(OPT_USE_FSYNC_ID) && fsync(fd_new) < 0) {
-			log_dbg("Write error, fsync.");
-			return -EIO;
+		/*
+		 * Dirty pages are not dropped, the first call only starts writeback,
+		 * the previous block is (usually) clean already.
+		 */
+		if (dontneed) {
+			posix_fadvise(fd_new, b->offset, s, POSIX_FADV_DONTNEED);
+			if (prev_size)
+				posix_fadvise(fd_new, prev_offset, prev_size, POSIX_FADV_DONTNEED);
+			prev_offset = b->offset;
+			prev_size = s;
 		}
 
-		*bytes += (uint64_t)s2;
+		copy_reader_put(cr, b);
+
+		*bytes += (uint64_t)s;
+		unsynced += (uint64_t)s;
+
+		if (unsynced >= sync_bytes) {
+			r = copy_data_sync(rc, fd_new);
+			if (r < 0)
+				break;
+			unsynced = 0;
+		}
 
-		tools_reencrypt_progress(rc->device_size, *bytes, &prog_parms);
+		tools_reencrypt_progress(rc->device_size, *bytes, prog_parms);
 	}
 
-	return quit ? -EAGAIN : 0;
+	copy_reader_stop(cr);
+
+	if (!r)
+		r = cr->r;
+
+	/* offset is correct even after failed write, flush what was written */
+	if (unsynced && copy_data_sync(rc, fd_new) < 0 && !r)
+		r = -EIO;
+
+	if (!r && quit)
+		r = -EAGAIN;
+
+	return r;
+}
+
+static int copy_data_forward(struct reenc_ctx *rc, struct copy_reader *cr,
+			     int fd_new, bool dontneed, uint64_t *bytes)
+{
+	struct tools_progress_params prog_parms = {
+		.frequency = ARG_UINT32(OPT_PROGRESS_FREQUENCY_ID),
+		.batch_mode = ARG_SET(OPT_BATCH_MODE_ID)
+	};
+
+	log_dbg("Reencrypting in forward direction.");
+
+	rc->resume_bytes = *bytes = rc->device_offset;
+
+	tools_reencrypt_progress(rc->device_size, *bytes, &prog_parms);
+
+	if (write_log(rc) < 0)
+		return -EIO;
+
+	cr->offset = rc->device_offset;
+
+	return copy_data_blocks(rc, cr, fd_new, dontneed, bytes, &prog_parms);
 }
 
-static int copy_data_backward(struct reenc_ctx *rc, int fd_old, int fd_new,
-			      size_t block_size, void *buf, uint64_t *bytes)
+static int copy_data_backward(struct reenc_ctx *rc, struct copy_reader *cr,
+			      int fd_new, bool dontneed, uint64_t *bytes)
 {
-	ssize_t s1, s2, working_block;
-	off64_t working_offset;
 	struct tools_progress_params prog_parms = {
 		.frequency = ARG_UINT32(OPT_PROGRESS_FREQUENCY_ID),
 		.batch_mode = ARG_SET(OPT_BATCH_MODE_ID)
@@ -996,50 +1242,9 @@ static int copy_data_backward(struct reenc_ctx *rc, int fd_old, int fd_new,
 	/* dirty the device during ENCRYPT mode */
 	rc->stained = 1;
 
-	while (!quit && rc->device_offset) {
-		if (rc->device_offset < block_size) {
-			working_offset = 0;
-			working_block = rc->device_offset;
-		} else {
-			working_offset = rc->device_offset - block_size;
-			working_block = block_size;
-		}
-
-		if (lseek64(fd_old, working_offset, SEEK_SET) < 0 ||
-		    lseek64(fd_new, working_offset, SEEK_SET) < 0) {
-			log_err(_("Cannot seek to device offset."));
-			return -EIO;
-		}
-
-		s1 = read_buf(fd_old, buf, working_block);
-		if (s1 < 0 || (s1 != working_block)) {
-			log_dbg("Read error, expecting %zu, got %zd.",
-				block_size, s1);
-			return -EIO;
-		}
-
-		s2 = write(fd_new, buf, working_block);
-		if (s2 < 0) {
-			log_dbg("Write error, expecting %zu, got %zd.",
-				block_size, s2);
-			return -EIO;
-		}
-
-		rc->device_offset -= s1;
-		if (ARG_SET(OPT_WRITE_LOG_ID) && write_log(rc) < 0)
-			return -EIO;
-
-		if (ARG_SET(OPT_USE_FSYNC_ID) && fsync(fd_new) < 0) {
-			log_dbg("Write error, fsync.");
-			return -EIO;
-		}
+	cr->offset = rc->device_offset;
 
-		*bytes += (uint64_t)s2;
-
-		tools_reencrypt_progress(rc->device_size, *bytes, &prog_parms);
-	}
-
-	return quit ? -EAGAIN : 0;
+	return copy_data_blocks(rc, cr, fd_new, dontneed, bytes, &prog_parms);
 }
 
 static void zero_rest_of_device(int fd, size_t block_size, void *buf,
@@ -1077,23 +1282,51 @@ static void zero_rest_of_device(int fd, size_t block_size, void *buf,
 	}
 }
 
+/*
+ * If direct-io is not supported, use buffered io but drop processed
+ * data from page cache (reencryption should not evict everything else).
+ */
+static int open_data_device(const char *path, int flags, bool *dontneed)
+{
+	int fd;
+
+	*dontneed = false;
+
+	if (!ARG_SET(OPT_USE_DIRECTIO_ID))
+		return open(path, flags);
+
+	fd = open(path, flags | O_DIRECT);
+	if (fd == -1 && errno == EINVAL) {
+		log_dbg("Direct-io not supported for %s, using page cache drop.", path);
+		fd = open(path, flags);
+		*dontneed = (fd != -1);
+	}
+
+	return fd;
+}
+
 static int copy_data(struct reenc_ctx *rc)
 {
 	size_t block_size = ARG_UINT32(OPT_BLOCK_SIZE_ID) * 1024 * 1024;
-	int fd_old = -1, fd_new = -1;
+	struct copy_reader cr = {
+		.block_size = block_size,
+		.direction = rc->reencrypt_direction,
+	};
+	int i, fd_old = -1, fd_new = -1;
 	int r = -EINVAL;
-	void *buf = NULL;
 	uint64_t bytes = 0;
+	size_t buf_align;
+	bool dontneed = false;
 
 	log_dbg("Data copy preparation.");
 
-	fd_old = open(rc->crypt_path_org, O_RDONLY | (ARG_SET(OPT_USE_DIRECTIO_ID) ? O_DIRECT : 0));
+	fd_old = open_data_device(rc->crypt_path_org, O_RDONLY, &cr.dontneed);
 	if (fd_old == -1) {
 		log_err(_("Cannot open temporary LUKS device."));
 		goto out;
 	}
 
-	fd_new = open(rc->crypt_path_new, O_WRONLY | (ARG_SET(OPT_USE_DIRECTIO_ID) ? O_DIRECT : 0));
+	fd_new = open_data_device(rc->crypt_path_new, O_WRONLY, &dontneed);
 	if (fd_new == -1) {
 		log_err(_("Cannot open temporary LUKS device."));
 		goto out;
@@ -1116,25 +1349,36 @@ static int copy_data(struct reenc_ctx *rc)
 	else
 		rc->device_size = rc->device_size_new_real;
 
-	if (posix_memalign((void *)&buf, alignment(fd_new), block_size)) {
-		log_err(_("Allocation of aligned memory failed."));
-		r = -ENOMEM;
-		goto out;
-	}
+	/* direct-io needs buffers aligned for both devices */
+	buf_align = pagesize();
+	if ((size_t)alignment(fd_old) > buf_align)
+		buf_align = alignment(fd_old);
+	if ((size_t)alignment(fd_new) > buf_align)
+		buf_align = alignment(fd_new);
+
+	for (i = 0; i < COPY_BUFFERS; i++)
+		if (posix_memalign(&cr.b[i].buf, buf_align, block_size)) {
+			log_err(_("Allocation of aligned memory failed."));
+			r = -ENOMEM;
+			goto out;
+		}
+
+	cr.fd = fd_old;
+	cr.device_size = rc->device_size;
 
 	set_int_handler(0);
 
 	if (rc->reencrypt_direction == FORWARD)
-		r = copy_data_forward(rc, fd_old, fd_new, block_size, buf, &bytes);
+		r = copy_data_forward(rc, &cr, fd_new, dontneed, &bytes);
 	else
-		r = copy_data_backward(rc, fd_old, fd_new, block_size, buf, &bytes);
+		r = copy_data_backward(rc, &cr, fd_new, dontneed, &bytes);
 
 	/* Zero (wipe) rest of now plain-only device when decrypting.
 	 * (To not leave any sign of encryption here.) */
 	if (!r && rc->reencrypt_mode == DECRYPT &&
 	    rc->device_size_new_real > rc->device_size_org_real) {
 		bytes = rc->device_size_new_real - rc->device_size_org_real;
-		zero_rest_of_device(fd_new, block_size, buf, &bytes, rc->device_size_org_real);
+		zero_rest_of_device(fd_new, block_size, cr.b[0].buf, &bytes, rc->device_size_org_real);
 	}
 
 	set_int_block(1);
@@ -1148,7 +1392,8 @@ out:
 		close(fd_old);
 	if (fd_new != -1)
 		close(fd_new);
-	free(buf);
+	for (i = 0; i < COPY_BUFFERS; i++)
+		free(cr.b[i].buf);
 	return r;
 }
 
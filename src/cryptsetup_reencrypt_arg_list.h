@@ -67,6 +67,8 @@ ARG(OPT_PROGRESS_FREQUENCY, '\0', POPT_ARG_STRING, N_("Progress line update (in
 
 ARG(OPT_REDUCE_DEVICE_SIZE, '\0', POPT_ARG_STRING, N_("Reduce data device size (move data offset). DANGEROUS!"), N_("bytes"), CRYPT_ARG_UINT64, {})
 
+ARG(OPT_SYNC_INTERVAL, '\0', POPT_ARG_STRING, N_("Flush data and update log file after this amount of data (default after each block)"), N_("MiB"), CRYPT_ARG_UINT32, {})
+
 ARG(OPT_TRIES, 'T', POPT_ARG_STRING, N_("How often the input of the passphrase can be retried"), "INT", CRYPT_ARG_UINT32, { .u32_value = 3 })
 
 ARG(OPT_TYPE, 'M', POPT_ARG_STRING,  N_("Type of LUKS metadata: luks1, luks2"), NULL, CRYPT_ARG_STRING, {})
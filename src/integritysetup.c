@@ -20,6 +20,8 @@
  */
 
 #include <uuid/uuid.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 #define DEFAULT_ALG_NAME "crc32c"
 
@@ -30,6 +32,9 @@
 
 #define MAX_KEY_SIZE 4096
 
+/* delay between status samples for recalculation rate estimate */
+#define RECALC_SAMPLE_MS 500
+
 static const char **action_argv;
 static int action_argc;
 static struct tools_log_params log_parms;
@@ -85,7 +90,8 @@ static int _wipe_data_device(struct crypt_device *cd, const char *integrity_key)
 	int r;
 	struct tools_progress_params prog_parms = {
 		.frequency = ARG_UINT32(OPT_PROGRESS_FREQUENCY_ID),
-		.batch_mode = ARG_SET(OPT_BATCH_MODE_ID)
+		.batch_mode = ARG_SET(OPT_BATCH_MODE_ID),
+		.json = ARG_SET(OPT_PROGRESS_JSON_ID)
 	};
 
 	if (!ARG_SET(OPT_BATCH_MODE_ID))
@@ -117,6 +123,300 @@ static int _wipe_data_device(struct crypt_device *cd, const char *integrity_key)
 	return r;
 }
 
+static int _init_tags(struct crypt_device *cd, const char *integrity_key)
+{
+	int r;
+	struct tools_progress_params prog_parms = {
+		.frequency = ARG_UINT32(OPT_PROGRESS_FREQUENCY_ID),
+		.batch_mode = ARG_SET(OPT_BATCH_MODE_ID),
+		.json = ARG_SET(OPT_PROGRESS_JSON_ID)
+	};
+
+	if (!ARG_SET(OPT_BATCH_MODE_ID))
+		log_std(_("Initializing integrity tags in userspace.\n"
+			"You can interrupt this by pressing CTRL+c "
+			"(rest of not initialized device will contain invalid checksum).\n"));
+
+	set_int_handler(0);
+	r = crypt_integrity_init_tags(cd, integrity_key, ARG_UINT32(OPT_INTEGRITY_KEY_SIZE_ID),
+				      &tools_wipe_progress, &prog_parms);
+	set_int_block(0);
+
+	if (r == -ENOTSUP) {
+		log_verbose(_("Userspace initialization is not supported for this device, using wipe.\n"));
+		r = _wipe_data_device(cd, integrity_key);
+	}
+
+	return r;
+}
+
+#define BENCHMARK_IO_SIZE	(64 * 1024 * 1024)
+#define BENCHMARK_IO_BLOCK	(1024 * 1024)
+#define BENCHMARK_IO_RANDOM	1024
+
+static double benchmark_time(struct timeval *start)
+{
+	struct timeval end;
+
+	gettimeofday(&end, NULL);
+	return (end.tv_sec - start->tv_sec) + (end.tv_usec - start->tv_usec) / 1000000.;
+}
+
+/*
+ * Sequential write, sequential read and random 4 KiB writes, all direct-io
+ * (read phase is skipped if read_mbs is NULL)
+ */
+static int benchmark_io(const char *path, uint64_t size,
+			double *write_mbs, double *read_mbs, double *random_iops)
+{
+	struct timeval start;
+	void *buf = NULL;
+	uint64_t offset;
+	unsigned i;
+	int fd, r = -EIO;
+
+	fd = open(path, O_RDWR | O_DIRECT);
+	if (fd < 0)
+		return -EINVAL;
+
+	if (posix_memalign(&buf, 4096, BENCHMARK_IO_BLOCK)) {
+		close(fd);
+		return -ENOMEM;
+	}
+	memset(buf, 0x5a, BENCHMARK_IO_BLOCK);
+
+	gettimeofday(&start, NULL);
+	for (offset = 0; offset < size; offset += BENCHMARK_IO_BLOCK)
+		if (pwrite(fd, buf, BENCHMARK_IO_BLOCK, offset) != BENCHMARK_IO_BLOCK)
+			goto out;
+	if (fsync(fd))
+		goto out;
+	*write_mbs = size / (1024. * 1024) / benchmark_time(&start);
+
+	if (read_mbs) {
+		gettimeofday(&start, NULL);
+		for (offset = 0; offset < size; offset += BENCHMARK_IO_BLOCK)
+			if (pread(fd, buf, BENCHMARK_IO_BLOCK, offset) != BENCHMARK_IO_BLOCK)
+				goto out;
+		*read_mbs = size / (1024. * 1024) / benchmark_time(&start);
+	}
+
+	srandom(size);
+	gettimeofday(&start, NULL);
+	for (i = 0; i < BENCHMARK_IO_RANDOM; i++) {
+		offset = ((uint64_t)random() % (size / 4096)) * 4096;
+		if (pwrite(fd, buf, 4096, offset) != 4096)
+			goto out;
+	}
+	if (fsync(fd))
+		goto out;
+	*random_iops = BENCHMARK_IO_RANDOM / benchmark_time(&start);
+	r = 0;
+out:
+	free(buf);
+	close(fd);
+	return r;
+}
+
+/* Candidate parameter sets for format --tune, zero means library or kernel default */
+static const struct {
+	uint64_t journal_size;
+	uint32_t interleave_sectors;
+	uint32_t buffer_sectors;
+	uint32_t journal_watermark;
+} tune_params[] = {
+	{ 0, 0, 0, 0 },
+	{ 16 * 1024 * 1024, 0, 0, 0 },
+	{ 64 * 1024 * 1024, 0, 0, 0 },
+	{ 64 * 1024 * 1024, 0, 512, 0 },
+	{ 64 * 1024 * 1024, 65536, 512, 75 },
+	{ 256 * 1024 * 1024, 0, 512, 75 },
+	{ 256 * 1024 * 1024, 65536, 1024, 90 },
+};
+
+static int tune_device_size(const char *path, uint64_t *size)
+{
+	struct stat st;
+	int fd, r = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -EINVAL;
+
+	if (fstat(fd, &st) < 0)
+		r = -EINVAL;
+	else if (S_ISREG(st.st_mode))
+		*size = st.st_size;
+	else if (!S_ISBLK(st.st_mode) || ioctl(fd, BLKGETSIZE64, size) < 0)
+		r = -EINVAL;
+
+	close(fd);
+	return r;
+}
+
+/*
+ * Format the device with candidate parameters, activate it as a private
+ * temporary mapping and run sequential and random 4 KiB write workload.
+ * The score is the workload time in seconds (lower is better).
+ */
+static int tune_candidate(struct crypt_params_integrity *params, const char *integrity_key,
+			  uint64_t device_size, uint64_t *overhead, double *score)
+{
+	struct crypt_device *cd = NULL;
+	char tmp_name[64], tmp_path[128], tmp_uuid[40];
+	double write_mbs = 0, random_iops = 0;
+	uint64_t size = 0;
+	uuid_t tmp_uuid_bin;
+	int r, fd;
+
+	uuid_generate(tmp_uuid_bin);
+	uuid_unparse(tmp_uuid_bin, tmp_uuid);
+	if (snprintf(tmp_name, sizeof(tmp_name), "temporary-cryptsetup-%s", tmp_uuid) < 0)
+		return -EINVAL;
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s/%s", crypt_get_dir(), tmp_name) < 0)
+		return -EINVAL;
+
+	r = crypt_init_data_device(&cd, action_argv[0], ARG_STR(OPT_DATA_DEVICE_ID));
+	if (r < 0)
+		return r;
+
+	if (ARG_SET(OPT_INTEGRITY_LEGACY_PADDING_ID))
+		crypt_set_compatibility(cd, CRYPT_COMPAT_LEGACY_INTEGRITY_PADDING);
+
+	if (ARG_SET(OPT_INTEGRITY_LEGACY_HMAC_ID))
+		crypt_set_compatibility(cd, CRYPT_COMPAT_LEGACY_INTEGRITY_HMAC);
+
+	r = crypt_format(cd, CRYPT_INTEGRITY, NULL, NULL, NULL, NULL, 0, params);
+	if (r < 0)
+		goto out;
+
+	r = crypt_activate_by_volume_key(cd, tmp_name, integrity_key,
+		ARG_UINT32(OPT_INTEGRITY_KEY_SIZE_ID), CRYPT_ACTIVATE_PRIVATE);
+	if (r < 0)
+		goto out;
+
+	fd = open(tmp_path, O_RDONLY);
+	if (fd < 0 || ioctl(fd, BLKGETSIZE64, &size) < 0)
+		r = -EINVAL;
+	if (fd >= 0)
+		close(fd);
+
+	/* not known with separate data device (space budget is not allowed there) */
+	if (!r)
+		*overhead = ARG_SET(OPT_DATA_DEVICE_ID) || device_size < size ? 0 : device_size - size;
+
+	if (!r && ARG_SET(OPT_TUNE_SPACE_BUDGET_ID) && *overhead > ARG_UINT64(OPT_TUNE_SPACE_BUDGET_ID))
+		r = -ENOSPC;
+
+	if (!r) {
+		size = (size > BENCHMARK_IO_SIZE ? BENCHMARK_IO_SIZE : size) / BENCHMARK_IO_BLOCK * BENCHMARK_IO_BLOCK;
+		r = size ? benchmark_io(tmp_path, size, &write_mbs, NULL, &random_iops) : -ENOSPC;
+	}
+
+	if (!r)
+		*score = size / (1024. * 1024) / write_mbs + BENCHMARK_IO_RANDOM / random_iops;
+
+	if (crypt_deactivate(cd, tmp_name))
+		log_err(_("Cannot deactivate temporary device %s."), tmp_path);
+out:
+	crypt_free(cd);
+	return r;
+}
+
+static const char *tune_value(char *buf, size_t buf_size, uint64_t value)
+{
+	if (!value)
+		return "default";
+
+	snprintf(buf, buf_size, "%" PRIu64, value);
+	return buf;
+}
+
+/*
+ * Try all candidate parameter sets (options set on command line are kept fixed)
+ * and store the fastest one that fits into space budget to params.
+ */
+static int tune_format_params(struct crypt_params_integrity *params, const char *integrity_key)
+{
+	struct crypt_params_integrity p, best_p;
+	char b1[24], b2[24], b3[24], b4[24];
+	uint64_t device_size = 0, overhead = 0;
+	double score = 0, best_score = 0;
+	bool found = false;
+	unsigned i;
+	int r = 0;
+
+	if (!ARG_SET(OPT_DATA_DEVICE_ID) && tune_device_size(action_argv[0], &device_size) < 0) {
+		log_err(_("Cannot get size of device %s."), action_argv[0]);
+		return -EINVAL;
+	}
+
+	log_std(_("# Tuning parameters on %s (up to %u MiB workload per candidate).\n"),
+		action_argv[0], BENCHMARK_IO_SIZE / (1024 * 1024));
+	/* TRANSLATORS: The string is header of a table and must be exactly (right side) aligned. */
+	log_std(_("#    Journal Interleave  Buffers Watermark     Overhead       Score\n"));
+
+	set_int_handler(0);
+	for (i = 0; i < ARRAY_SIZE(tune_params); i++) {
+		p = *params;
+		if (!ARG_SET(OPT_JOURNAL_SIZE_ID))
+			p.journal_size = tune_params[i].journal_size;
+		if (!ARG_SET(OPT_INTERLEAVE_SECTORS_ID))
+			p.interleave_sectors = tune_params[i].interleave_sectors;
+		if (!ARG_SET(OPT_BUFFER_SECTORS_ID))
+			p.buffer_sectors = tune_params[i].buffer_sectors;
+		if (!ARG_SET(OPT_JOURNAL_WATERMARK_ID))
+			p.journal_watermark = tune_params[i].journal_watermark;
+
+		r = tune_candidate(&p, integrity_key, device_size, &overhead, &score);
+		check_signal(&r);
+		if (r == -EINTR)
+			break;
+
+		log_std("%12s %10s %8s %9s ", tune_value(b1, sizeof(b1), p.journal_size),
+			tune_value(b2, sizeof(b2), p.interleave_sectors),
+			tune_value(b3, sizeof(b3), p.buffer_sectors),
+			tune_value(b4, sizeof(b4), p.journal_watermark));
+		if (r == -ENOSPC)
+			log_std("%8.1f MiB %11s\n", overhead / (1024. * 1024), _("over budget"));
+		else if (r < 0)
+			log_std("%12s %11s\n", "N/A", "N/A");
+		else
+			log_std("%8.1f MiB %9.3f s\n", overhead / (1024. * 1024), score);
+
+		if (!r && (!found || score < best_score)) {
+			best_p = p;
+			best_score = score;
+			found = true;
+		}
+	}
+	set_int_block(0);
+
+	if (r == -EINTR)
+		return r;
+
+	if (!found) {
+		log_err(_("No candidate parameters could be used on device %s."), action_argv[0]);
+		return -EINVAL;
+	}
+
+	params->journal_size = best_p.journal_size;
+	params->interleave_sectors = best_p.interleave_sectors;
+	params->buffer_sectors = best_p.buffer_sectors;
+	params->journal_watermark = best_p.journal_watermark;
+
+	log_std(_("Selected journal size %s, interleave sectors %s.\n"),
+		tune_value(b1, sizeof(b1), params->journal_size),
+		tune_value(b2, sizeof(b2), params->interleave_sectors));
+	/* activation parameters are not stored in superblock */
+	if (params->buffer_sectors || params->journal_watermark)
+		log_std(_("Use --buffer-sectors %s --journal-watermark %s for open action.\n"),
+			tune_value(b3, sizeof(b3), params->buffer_sectors),
+			tune_value(b4, sizeof(b4), params->journal_watermark));
+
+	return 0;
+}
+
 static int action_format(void)
 {
 	struct crypt_device *cd = NULL;
@@ -195,6 +495,9 @@ static int action_format(void)
 	if (ARG_SET(OPT_INTEGRITY_LEGACY_HMAC_ID))
 		crypt_set_compatibility(cd, CRYPT_COMPAT_LEGACY_INTEGRITY_HMAC);
 
+	if (ARG_SET(OPT_TUNE_ID) && (r = tune_format_params(&params, integrity_key)) < 0)
+		goto out;
+
 	r = crypt_format(cd, CRYPT_INTEGRITY, NULL, NULL, NULL, NULL, 0, &params);
 	if (r < 0) /* FIXME: call wipe signatures again */
 		goto out;
@@ -203,7 +506,13 @@ static int action_format(void)
 		log_std(_("Formatted with tag size %u, internal integrity %s.\n"),
 			params2.tag_size, params2.integrity);
 
-	if (!ARG_SET(OPT_NO_WIPE_ID))
+	if (ARG_SET(OPT_INTEGRITY_LAZY_INIT_ID)) {
+		r = crypt_integrity_lazy_init(cd);
+		if (!r && !ARG_SET(OPT_BATCH_MODE_ID))
+			log_std(_("Integrity tags will be calculated in kernel after activation.\n"));
+	} else if (ARG_SET(OPT_INTEGRITY_USERSPACE_INIT_ID))
+		r = _init_tags(cd, integrity_key);
+	else if (!ARG_SET(OPT_NO_WIPE_ID))
 		r = _wipe_data_device(cd, integrity_key);
 out:
 	crypt_safe_free(integrity_key);
@@ -328,6 +637,7 @@ static int action_status(void)
 	struct crypt_device *cd = NULL;
 	char *backing_file;
 	const char *device, *metadata_device;
+	struct crypt_integrity_recalc_progress recalc = {};
 	int path = 0, r = 0;
 
 	/* perhaps a path, not a dm device name */
@@ -394,6 +704,16 @@ static int action_status(void)
 			cad.flags & CRYPT_ACTIVATE_RECOVERY ? " recovery" : "");
 		log_std("  failures: %" PRIu64 "\n",
 			crypt_get_active_integrity_failures(cd, action_argv[0]));
+		if (!crypt_get_integrity_recalc_progress(cd, action_argv[0], RECALC_SAMPLE_MS, &recalc) &&
+		    recalc.recalc_sector < recalc.size) {
+			log_std("  recalculating: %" PRIu64 " of %" PRIu64 " sectors (%.1f%%)\n",
+				recalc.recalc_sector, recalc.size,
+				recalc.recalc_sector * 100. / recalc.size);
+			if (recalc.sectors_per_sec > 0)
+				log_std("  recalculation rate: %.1f MiB/s, %.0f s remaining\n",
+					recalc.sectors_per_sec * SECTOR_SIZE / (1024 * 1024),
+					(recalc.size - recalc.recalc_sector) / recalc.sectors_per_sec);
+		}
 		if (cad.flags & CRYPT_ACTIVATE_NO_JOURNAL_BITMAP) {
 			log_std("  bitmap 512-byte sectors per bit: %u\n", ip.journal_watermark);
 			log_std("  bitmap flush interval: %u ms\n", ip.journal_commit_time);
@@ -437,6 +757,169 @@ static int action_dump(void)
 	return r;
 }
 
+static int benchmark_device_mode(const char *integrity, uint32_t activate_flags,
+				 const char *mode)
+{
+	struct crypt_device *cd = NULL;
+	struct crypt_params_integrity params = {
+		.integrity = integrity,
+		.sector_size = ARG_UINT32(OPT_SECTOR_SIZE_ID),
+		.tag_size = ARG_UINT32(OPT_TAG_SIZE_ID),
+	};
+	char tmp_name[64], tmp_path[128], tmp_uuid[40], *integrity_key = NULL;
+	double write_mbs = 0, read_mbs = 0, random_iops = 0;
+	uint64_t size;
+	uuid_t tmp_uuid_bin;
+	int r, fd;
+
+	uuid_generate(tmp_uuid_bin);
+	uuid_unparse(tmp_uuid_bin, tmp_uuid);
+	if (snprintf(tmp_name, sizeof(tmp_name), "temporary-cryptsetup-%s", tmp_uuid) < 0)
+		return -EINVAL;
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s/%s", crypt_get_dir(), tmp_name) < 0)
+		return -EINVAL;
+
+	r = _read_keys(&integrity_key, &params);
+	if (r)
+		return r;
+
+	r = crypt_init(&cd, action_argv[0]);
+	if (r < 0)
+		goto out;
+
+	r = crypt_format(cd, CRYPT_INTEGRITY, NULL, NULL, NULL, NULL, 0, &params);
+	if (r < 0)
+		goto out;
+
+	r = crypt_activate_by_volume_key(cd, tmp_name, integrity_key,
+		ARG_UINT32(OPT_INTEGRITY_KEY_SIZE_ID), CRYPT_ACTIVATE_PRIVATE | activate_flags);
+	if (r < 0)
+		goto out;
+
+	fd = open(tmp_path, O_RDONLY);
+	if (fd < 0 || ioctl(fd, BLKGETSIZE64, &size) < 0)
+		r = -EINVAL;
+	if (fd >= 0)
+		close(fd);
+
+	if (!r) {
+		size = (size > BENCHMARK_IO_SIZE ? BENCHMARK_IO_SIZE : size) / BENCHMARK_IO_BLOCK * BENCHMARK_IO_BLOCK;
+		r = size ? benchmark_io(tmp_path, size, &write_mbs, &read_mbs, &random_iops) : -ENOSPC;
+	}
+
+	if (crypt_deactivate(cd, tmp_name))
+		log_err(_("Cannot deactivate temporary device %s."), tmp_path);
+out:
+	if (r < 0)
+		log_std("%-14s %-8s %14s %14s %15s\n", integrity, mode, "N/A", "N/A", "N/A");
+	else
+		log_std("%-14s %-8s %8.1f MiB/s %8.1f MiB/s %10.0f IOPS\n", integrity, mode,
+			write_mbs, read_mbs, random_iops);
+	crypt_safe_free(integrity_key);
+	crypt_safe_free(CONST_CAST(void*)params.journal_integrity_key);
+	crypt_safe_free(CONST_CAST(void*)params.journal_crypt_key);
+	crypt_free(cd);
+	return r;
+}
+
+static int benchmark_device(const char *integrity)
+{
+	static struct {
+		const char *mode;
+		uint32_t flags;
+	} bmodes[] = {
+		{ "journal", 0 },
+		{ "bitmap",  CRYPT_ACTIVATE_NO_JOURNAL_BITMAP },
+		{ "direct",  CRYPT_ACTIVATE_NO_JOURNAL },
+		{ NULL, 0 }
+	};
+	char *msg = NULL;
+	int i, r;
+
+	if (!ARG_SET(OPT_BATCH_MODE_ID)) {
+		r = asprintf(&msg, _("This will overwrite data on %s irrevocably."), action_argv[0]);
+		if (r == -1)
+			return -ENOMEM;
+
+		r = yesDialog(msg, _("Operation aborted.\n")) ? 0 : -EINVAL;
+		free(msg);
+		if (r < 0)
+			return r;
+	}
+
+	log_std(_("# Tests use %s (up to %u MiB), device is not wiped before test.\n"),
+		action_argv[0], BENCHMARK_IO_SIZE / (1024 * 1024));
+	/* TRANSLATORS: The string is header of a table and must be exactly (right side) aligned. */
+	log_std(_("# Algorithm    Mode         Seq. write      Seq. read    Rnd 4K write\n"));
+
+	set_int_handler(0);
+	for (i = 0; bmodes[i].mode; i++) {
+		r = benchmark_device_mode(integrity, bmodes[i].flags, bmodes[i].mode);
+		check_signal(&r);
+		if (r == -EINTR)
+			break;
+	}
+	set_int_block(0);
+
+	return r;
+}
+
+static int action_benchmark(void)
+{
+	struct {
+		const char *integrity;
+		size_t key_size;
+	} balgs[] = {
+		{ "crc32c",       0 },
+		{ "sha1",         0 },
+		{ "sha256",       0 },
+		{ "sha512",       0 },
+		{ "hmac(sha256)", 32 },
+		{ "hmac(sha512)", 64 },
+		{ NULL, 0 }
+	};
+	char integrity[MAX_CIPHER_LEN];
+	uint32_t sector_size = ARG_UINT32(OPT_SECTOR_SIZE_ID);
+	double tags_mbs = 0;
+	int i, r = 0;
+
+	if (ARG_SET(OPT_INTEGRITY_ID)) {
+		r = crypt_parse_hash_integrity_mode(ARG_STR(OPT_INTEGRITY_ID), integrity);
+		if (r < 0) {
+			log_err(_("No known integrity specification pattern detected."));
+			return r;
+		}
+	}
+
+	if (action_argc)
+		return benchmark_device(ARG_SET(OPT_INTEGRITY_ID) ? integrity : DEFAULT_ALG_NAME);
+
+	log_std(_("# Tests are approximate using memory only (no storage IO).\n"));
+	/* TRANSLATORS: The string is header of a table and must be exactly (right side) aligned. */
+	log_std(_("#  Algorithm | Sector |             Tags\n"));
+
+	/* Only the specified algorithm is tested */
+	if (ARG_SET(OPT_INTEGRITY_ID)) {
+		balgs[0].integrity = integrity;
+		balgs[0].key_size = ARG_UINT32(OPT_INTEGRITY_KEY_SIZE_ID);
+		balgs[1].integrity = NULL;
+	}
+
+	for (i = 0; balgs[i].integrity; i++) {
+		r = crypt_benchmark_integrity(NULL, balgs[i].integrity, balgs[i].key_size,
+					      sector_size, 1024 * 1024, &tags_mbs);
+		check_signal(&r);
+		if (r == -EINTR)
+			break;
+		if (r < 0)
+			log_std("%12s   %6u   %16s\n", balgs[i].integrity, sector_size, "N/A");
+		else
+			log_std("%12s   %6u   %10.1f MiB/s\n", balgs[i].integrity, sector_size, tags_mbs);
+	}
+
+	return r == -EINTR ? r : 0;
+}
+
 static struct action_type {
 	const char *type;
 	int (*handler)(void);
@@ -449,6 +932,7 @@ static struct action_type {
 	{ CLOSE_ACTION,	action_close,  1, N_("<name>"),N_("close device (remove mapping)") },
 	{ STATUS_ACTION,action_status, 1, N_("<name>"),N_("show active device status") },
 	{ DUMP_ACTION,	action_dump,   1, N_("<integrity_device>"),N_("show on-disk information") },
+	{ BENCHMARK_ACTION,action_benchmark, 0, N_("[<integrity_device>]"),N_("benchmark integrity algorithms (and modes on device)") },
 	{}
 };
 
@@ -500,7 +984,7 @@ static int run_action(struct action_type *action)
 
 static bool needs_size_conversion(unsigned int arg_id)
 {
-	return arg_id == OPT_JOURNAL_SIZE_ID;
+	return arg_id == OPT_JOURNAL_SIZE_ID || arg_id == OPT_TUNE_SPACE_BUDGET_ID;
 }
 
 static void basic_options_cb(poptContext popt_context,
@@ -657,6 +1141,18 @@ int main(int argc, const char **argv)
 		usage(popt_context, EXIT_FAILURE, _("Bitmap options can be used only in bitmap mode."),
 		      poptGetInvocationName(popt_context));
 
+	if (ARG_SET(OPT_TUNE_ID) && ARG_SET(OPT_INTEGRITY_BITMAP_MODE_ID))
+		usage(popt_context, EXIT_FAILURE, _("Option --tune cannot be used in bitmap mode."),
+		      poptGetInvocationName(popt_context));
+
+	if (ARG_SET(OPT_TUNE_SPACE_BUDGET_ID) && !ARG_SET(OPT_TUNE_ID))
+		usage(popt_context, EXIT_FAILURE, _("Option --tune-space-budget can be used only with --tune."),
+		      poptGetInvocationName(popt_context));
+
+	if (ARG_SET(OPT_TUNE_SPACE_BUDGET_ID) && ARG_SET(OPT_DATA_DEVICE_ID))
+		usage(popt_context, EXIT_FAILURE, _("Option --tune-space-budget cannot be used with separate data device."),
+		      poptGetInvocationName(popt_context));
+
 	if (ARG_SET(OPT_CANCEL_DEFERRED_ID) && ARG_SET(OPT_DEFERRED_ID))
 		usage(popt_context, EXIT_FAILURE,
 		      _("Options --cancel-deferred and --deferred cannot be used at the same time."),
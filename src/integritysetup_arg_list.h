@@ -45,6 +45,10 @@ ARG(OPT_INTEGRITY_KEY_FILE, '\0', POPT_ARG_STRING, N_("Read the integrity key fr
 
 ARG(OPT_INTEGRITY_KEY_SIZE, '\0', POPT_ARG_STRING, N_("The size of the data integrity key"), N_("BITS"), CRYPT_ARG_UINT32, {}, {})
 
+ARG(OPT_INTEGRITY_LAZY_INIT, '\0', POPT_ARG_NONE, N_("Do not wipe device, recalculate tags in kernel after activation"), NULL, CRYPT_ARG_BOOL, {}, OPT_INTEGRITY_LAZY_INIT_ACTIONS)
+
+ARG(OPT_INTEGRITY_USERSPACE_INIT, '\0', POPT_ARG_NONE, N_("Initialize integrity tags in userspace instead of wiping through kernel"), NULL, CRYPT_ARG_BOOL, {}, OPT_INTEGRITY_USERSPACE_INIT_ACTIONS)
+
 ARG(OPT_INTEGRITY_LEGACY_PADDING, '\0', POPT_ARG_NONE, N_("Use inefficient legacy padding (old kernels)"), NULL, CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_INTEGRITY_LEGACY_HMAC, '\0', POPT_ARG_NONE, N_("Do not protect superblock with HMAC (old kernels)"), NULL, CRYPT_ARG_BOOL, {}, {})
@@ -77,6 +81,8 @@ ARG(OPT_NO_WIPE, '\0', POPT_ARG_NONE, N_("Do not wipe device after format"), NUL
 
 ARG(OPT_PROGRESS_FREQUENCY, '\0', POPT_ARG_STRING, N_("Progress line update (in seconds)"), N_("secs"), CRYPT_ARG_UINT32, {}, {})
 
+ARG(OPT_PROGRESS_JSON, '\0', POPT_ARG_NONE, N_("Print progress data in json format (suitable for machine processing)"), NULL, CRYPT_ARG_BOOL, {}, {})
+
 ARG(OPT_INTEGRITY_BITMAP_MODE, 'B', POPT_ARG_NONE, N_("Use bitmap to track changes and disable journal for integrity device"), NULL, CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_INTEGRITY_RECALCULATE, '\0', POPT_ARG_NONE, N_("Recalculate initial tags automatically."), NULL, CRYPT_ARG_BOOL, {}, OPT_INTEGRITY_RECALCULATE_ACTIONS)
@@ -89,4 +95,8 @@ ARG(OPT_SECTOR_SIZE, 's', POPT_ARG_STRING, N_("Sector size"), N_("bytes"), CRYPT
 
 ARG(OPT_TAG_SIZE, 't', POPT_ARG_STRING, N_("Tag size (per-sector)"), N_("bytes"), CRYPT_ARG_UINT32, {}, OPT_TAG_SIZE_ACTIONS)
 
+ARG(OPT_TUNE, '\0', POPT_ARG_NONE, N_("Benchmark candidate journal and buffer parameters and use the fastest"), NULL, CRYPT_ARG_BOOL, {}, OPT_TUNE_ACTIONS)
+
+ARG(OPT_TUNE_SPACE_BUDGET, '\0', POPT_ARG_STRING, N_("Maximal space used for integrity metadata when tuning"), N_("bytes"), CRYPT_ARG_UINT64, {}, OPT_TUNE_ACTIONS)
+
 ARG(OPT_VERBOSE, 'v', POPT_ARG_NONE, N_("Shows more detailed error messages"), NULL, CRYPT_ARG_BOOL, {}, {})
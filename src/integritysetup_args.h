@@ -30,15 +30,19 @@
 #define CLOSE_ACTION	"close"
 #define STATUS_ACTION	"status"
 #define DUMP_ACTION	"dump"
+#define BENCHMARK_ACTION "benchmark"
 
 #define OPT_ALLOW_DISCARDS_ACTIONS		{ OPEN_ACTION }
 #define OPT_DEFERRED_ACTIONS			{ CLOSE_ACTION }
+#define OPT_INTEGRITY_LAZY_INIT_ACTIONS		{ FORMAT_ACTION }
+#define OPT_INTEGRITY_USERSPACE_INIT_ACTIONS	{ FORMAT_ACTION }
 #define OPT_INTEGRITY_RECALCULATE_ACTIONS	{ OPEN_ACTION }
 #define OPT_JOURNAL_SIZE_ACTIONS		{ FORMAT_ACTION }
 #define OPT_NO_WIPE_ACTIONS			{ FORMAT_ACTION }
 #define OPT_INTERLEAVE_SECTORS_ACTIONS		{ FORMAT_ACTION }
-#define OPT_SECTOR_SIZE_ACTIONS			{ FORMAT_ACTION }
-#define OPT_TAG_SIZE_ACTIONS			{ FORMAT_ACTION }
+#define OPT_SECTOR_SIZE_ACTIONS			{ FORMAT_ACTION, BENCHMARK_ACTION }
+#define OPT_TAG_SIZE_ACTIONS			{ FORMAT_ACTION, BENCHMARK_ACTION }
+#define OPT_TUNE_ACTIONS			{ FORMAT_ACTION }
 
 enum {
 OPT_UNUSED_ID = 0,
@@ -24,15 +24,21 @@
 
 #define OPT_ACTIVE_NAME			"active-name"
 #define OPT_ALIGN_PAYLOAD		"align-payload"
+#define OPT_ALL				"all"
+#define OPT_ALLOW_CRC32C		"allow-crc32c"
 #define OPT_ALLOW_DISCARDS		"allow-discards"
+#define OPT_BATCH_FILE			"batch-file"
 #define OPT_BATCH_MODE			"batch-mode"
 #define OPT_BITMAP_FLUSH_TIME		"bitmap-flush-time"
 #define OPT_BITMAP_SECTORS_PER_BIT	"bitmap-sectors-per-bit"
 #define OPT_BLOCK_SIZE			"block-size"
 #define OPT_BUFFER_SECTORS		"buffer-sectors"
+#define OPT_BUFFER_SIZE			"buffer-size"
 #define OPT_CANCEL_DEFERRED		"cancel-deferred"
 #define OPT_CHECK_AT_MOST_ONCE		"check-at-most-once"
 #define OPT_CIPHER			"cipher"
+#define OPT_COMMIT_INTERVAL_SIZE	"commit-interval-size"
+#define OPT_COMMIT_INTERVAL_TIME	"commit-interval-time"
 #define OPT_DATA_BLOCK_SIZE		"data-block-size"
 #define OPT_DATA_BLOCKS			"data-blocks"
 #define OPT_DATA_DEVICE			"data-device"
@@ -43,6 +49,7 @@
 #define OPT_DECRYPT			"decrypt"
 #define OPT_DISABLE_KEYRING		"disable-keyring"
 #define OPT_DISABLE_LOCKS		"disable-locks"
+#define OPT_DMCRYPT			"dmcrypt"
 #define OPT_DUMP_JSON			"dump-json-metadata"
 #define OPT_DUMP_MASTER_KEY		"dump-master-key"
 #define OPT_ENCRYPT			"encrypt"
@@ -54,8 +61,10 @@
 #define OPT_HASH			"hash"
 #define OPT_HASH_BLOCK_SIZE		"hash-block-size"
 #define OPT_HASH_OFFSET			"hash-offset"
+#define OPT_HASH_ONLY			"hash-only"
 #define OPT_HEADER			"header"
 #define OPT_HEADER_BACKUP_FILE		"header-backup-file"
+#define OPT_HOTZONE_ADAPTIVE		"hotzone-adaptive"
 #define OPT_HOTZONE_SIZE		"hotzone-size"
 #define OPT_IGNORE_CORRUPTION		"ignore-corruption"
 #define OPT_IGNORE_ZERO_BLOCKS		"ignore-zero-blocks"
@@ -64,6 +73,8 @@
 #define OPT_INTEGRITY_BITMAP_MODE	"integrity-bitmap-mode"
 #define OPT_INTEGRITY_KEY_FILE		"integrity-key-file"
 #define OPT_INTEGRITY_KEY_SIZE		"integrity-key-size"
+#define OPT_INTEGRITY_LAZY_INIT		"integrity-lazy-init"
+#define OPT_INTEGRITY_USERSPACE_INIT	"integrity-userspace-init"
 #define OPT_INTEGRITY_LEGACY_PADDING	"integrity-legacy-padding"
 #define OPT_INTEGRITY_LEGACY_HMAC	"integrity-legacy-hmac"
 #define OPT_INTEGRITY_LEGACY_RECALC	"integrity-legacy-recalculate"
@@ -75,6 +86,7 @@
 #define OPT_INTERLEAVE_SECTORS		"interleave-sectors"
 #define OPT_ITER_TIME			"iter-time"
 #define OPT_IV_LARGE_SECTORS		"iv-large-sectors"
+#define OPT_JSON			"json"
 #define OPT_JSON_FILE			"json-file"
 #define OPT_JOURNAL_COMMIT_TIME		"journal-commit-time"
 #define OPT_JOURNAL_CRYPT		"journal-crypt"
@@ -86,6 +98,7 @@
 #define OPT_JOURNAL_SIZE		"journal-size"
 #define OPT_JOURNAL_WATERMARK		"journal-watermark"
 #define OPT_KEEP_KEY			"keep-key"
+#define OPT_KCAPI_ZEROCOPY		"kcapi-zerocopy"
 #define OPT_KEY_DESCRIPTION		"key-description"
 #define OPT_KEY_FILE			"key-file"
 #define OPT_KEY_SIZE			"key-size"
@@ -93,6 +106,7 @@
 #define OPT_KEYFILE_OFFSET		"keyfile-offset"
 #define OPT_KEYFILE_SIZE		"keyfile-size"
 #define OPT_KEYSLOT_CIPHER		"keyslot-cipher"
+#define OPT_KEYSLOT_HINT_CACHE		"keyslot-hint-cache"
 #define OPT_KEYSLOT_KEY_SIZE		"keyslot-key-size"
 #define OPT_NO_SUPERBLOCK		"no-superblock"
 #define OPT_NO_WIPE			"no-wipe"
@@ -100,27 +114,43 @@
 #define OPT_LUKS2_KEYSLOTS_SIZE		"luks2-keyslots-size"
 #define OPT_LUKS2_METADATA_SIZE		"luks2-metadata-size"
 #define OPT_MASTER_KEY_FILE		"master-key-file"
+#define OPT_MAX_IOPS			"max-iops"
+#define OPT_MAX_THROUGHPUT		"max-throughput"
+#define OPT_MEMORY_LOCK			"memory-lock"
 #define OPT_NEW				"new"
 #define OPT_NEW_KEYFILE_OFFSET		"new-keyfile-offset"
 #define OPT_NEW_KEYFILE_SIZE		"new-keyfile-size"
+#define OPT_NUMA_NODE			"numa-node"
 #define OPT_OFFSET			"offset"
 #define OPT_PANIC_ON_CORRUPTION		"panic-on-corruption"
 #define OPT_PBKDF			"pbkdf"
+#define OPT_PBKDF_CACHE			"pbkdf-cache"
+#define OPT_PBKDF_CACHE_TTL		"pbkdf-cache-ttl"
 #define OPT_PBKDF_FORCE_ITERATIONS	"pbkdf-force-iterations"
 #define OPT_PBKDF_MEMORY		"pbkdf-memory"
+#define OPT_PBKDF_MEMORY_BUDGET		"pbkdf-memory-budget"
 #define OPT_PBKDF_PARALLEL		"pbkdf-parallel"
+#define OPT_PBKDF_SWEEP			"pbkdf-sweep"
+#define OPT_PBKDF_SWEEP_ITERATIONS	"pbkdf-sweep-iterations"
+#define OPT_PBKDF_SWEEP_MEMORY		"pbkdf-sweep-memory"
+#define OPT_PBKDF_SWEEP_REPEAT		"pbkdf-sweep-repeat"
+#define OPT_PBKDF_SWEEP_WARMUP		"pbkdf-sweep-warmup"
 #define OPT_PERF_NO_READ_WORKQUEUE	"perf-no_read_workqueue"
 #define OPT_PERF_NO_WRITE_WORKQUEUE	"perf-no_write_workqueue"
+#define OPT_PERF_PROFILE		"perf-profile"
 #define OPT_PERF_SAME_CPU_CRYPT		"perf-same_cpu_crypt"
 #define OPT_PERF_SUBMIT_FROM_CRYPT_CPUS	"perf-submit_from_crypt_cpus"
 #define OPT_PERSISTENT			"persistent"
 #define OPT_PLUGIN			"plugin"
 #define OPT_PRIORITY			"priority"
 #define OPT_PROGRESS_FREQUENCY		"progress-frequency"
+#define OPT_PROGRESS_JSON		"progress-json"
+#define OPT_RATE_LIMIT_FILE		"rate-limit-file"
 #define OPT_READONLY			"readonly"
 #define OPT_REDUCE_DEVICE_SIZE		"reduce-device-size"
 #define OPT_REFRESH			"refresh"
 #define OPT_RESILIENCE			"resilience"
+#define OPT_RESILIENCE_DEVICE		"resilience-device"
 #define OPT_RESILIENCE_HASH		"resilience-hash"
 #define OPT_RESTART_ON_CORRUPTION	"restart-on-corruption"
 #define OPT_RESUME_ONLY			"resume-only"
@@ -129,19 +159,26 @@
 #define OPT_SECTOR_SIZE			"sector-size"
 #define OPT_SERIALIZE_MEMORY_HARD_PBKDF	"serialize-memory-hard-pbkdf"
 #define OPT_SHARED			"shared"
+#define OPT_SHARED_PASSPHRASE		"shared-passphrase"
 #define OPT_SIZE			"size"
 #define OPT_SKIP			"skip"
+#define OPT_SKIP_UNALLOCATED		"skip-unallocated"
 #define OPT_SUBSYSTEM			"subsystem"
+#define OPT_SYNC_INTERVAL		"sync-interval"
 #define OPT_TAG_SIZE			"tag-size"
 #define OPT_TCRYPT_BACKUP		"tcrypt-backup"
 #define OPT_TCRYPT_HIDDEN		"tcrypt-hidden"
 #define OPT_TCRYPT_SYSTEM		"tcrypt-system"
 #define OPT_TEST_ARGS			"test-args"
 #define OPT_TEST_PASSPHRASE		"test-passphrase"
+#define OPT_THREADS			"threads"
 #define OPT_TIMEOUT			"timeout"
+#define OPT_TIMING			"timing"
 #define OPT_TOKEN_ID			"token-id"
 #define OPT_TOKEN_ONLY			"token-only"
 #define OPT_TRIES			"tries"
+#define OPT_TUNE			"tune"
+#define OPT_TUNE_SPACE_BUDGET		"tune-space-budget"
 #define OPT_TYPE			"type"
 #define OPT_UNBOUND			"unbound"
 #define OPT_USE_DIRECTIO		"use-directio"
@@ -154,6 +191,7 @@
 #define OPT_VERACRYPT_QUERY_PIM		"veracrypt-query-pim"
 #define OPT_VERBOSE			"verbose"
 #define OPT_VERIFY_PASSPHRASE		"verify-passphrase"
+#define OPT_VOLUME_KEY_HANDOFF		"volume-key-handoff"
 #define OPT_WRITE_LOG			"write-log"
 
 #endif
@@ -217,6 +217,12 @@ int tools_detect_signatures(const char *device, int ignore_luks, size_t *count,
 		return 0;
 	}
 
+	/* Zeroed device (all signature areas) needs no full probe */
+	if (blk_is_blank(device) == 1) {
+		log_dbg("Device %s is blank, skipping signature probe.", device);
+		return 0;
+	}
+
 	if ((r = blk_init_by_path(&h, device))) {
 		log_err(_("Failed to initialize device signature probes."));
 		return -EINVAL;
@@ -256,6 +256,104 @@ out:
 	return r;
 }
 
+/*
+ * Multi-record stdin (batch file processing): one passphrase per line,
+ * stdin is read in blocks and the rest is kept for the next passphrase.
+ * Only used when enabled, otherwise nothing after EOL is consumed.
+ */
+#define STDIN_RECORDS_BLOCK 4096
+
+static struct {
+	bool enabled;
+	char *buf;
+	size_t size;
+	size_t len;
+	size_t pos;
+	bool eof;
+} stdin_records;
+
+void tools_stdin_records(bool enable)
+{
+	if (!enable) {
+		crypt_safe_free(stdin_records.buf);
+		memset(&stdin_records, 0, sizeof(stdin_records));
+	}
+	stdin_records.enabled = enable;
+}
+
+static int stdin_records_read(char **key, size_t *key_size, size_t key_size_max)
+{
+	char *pass, *eol, *tmp;
+	size_t len;
+	ssize_t r;
+
+	if (!key_size_max)
+		key_size_max = DEFAULT_KEYFILE_SIZE_MAXKB * 1024;
+
+	while (!(eol = memchr(stdin_records.buf + stdin_records.pos, '\n',
+			      stdin_records.len - stdin_records.pos)) && !stdin_records.eof) {
+		if (stdin_records.len - stdin_records.pos > key_size_max) {
+			log_err(_("Maximum keyfile size exceeded."));
+			return -EINVAL;
+		}
+
+		/* move the rest to buffer start, grow buffer if needed */
+		if (stdin_records.pos) {
+			memmove(stdin_records.buf, stdin_records.buf + stdin_records.pos,
+				stdin_records.len - stdin_records.pos);
+			stdin_records.len -= stdin_records.pos;
+			crypt_safe_memzero(stdin_records.buf + stdin_records.len, stdin_records.pos);
+			stdin_records.pos = 0;
+		}
+		if (stdin_records.size - stdin_records.len < STDIN_RECORDS_BLOCK) {
+			tmp = crypt_safe_realloc(stdin_records.buf, stdin_records.size + STDIN_RECORDS_BLOCK);
+			if (!tmp) {
+				log_err(_("Out of memory while reading passphrase."));
+				return -ENOMEM;
+			}
+			stdin_records.buf = tmp;
+			stdin_records.size += STDIN_RECORDS_BLOCK;
+		}
+
+		r = read(STDIN_FILENO, stdin_records.buf + stdin_records.len,
+			 stdin_records.size - stdin_records.len);
+		if (r < 0 && (errno == EINTR || errno == EAGAIN) && !quit)
+			continue;
+		if (r < 0) {
+			log_err(_("Error reading passphrase."));
+			return -EPIPE;
+		}
+		if (!r)
+			stdin_records.eof = true;
+		stdin_records.len += r;
+	}
+
+	len = (eol ? (size_t)(eol - stdin_records.buf) : stdin_records.len) - stdin_records.pos;
+	if (!eol && !len) {
+		log_err(_("Nothing to read on input."));
+		return -EPIPE;
+	}
+	if (len > key_size_max) {
+		log_err(_("Maximum keyfile size exceeded."));
+		return -EINVAL;
+	}
+
+	pass = crypt_safe_alloc(len + 1);
+	if (!pass) {
+		log_err(_("Out of memory while reading passphrase."));
+		return -ENOMEM;
+	}
+	memcpy(pass, stdin_records.buf + stdin_records.pos, len);
+
+	/* consumed record is wiped in buffer immediately */
+	crypt_safe_memzero(stdin_records.buf + stdin_records.pos, len + (eol ? 1 : 0));
+	stdin_records.pos += len + (eol ? 1 : 0);
+
+	*key = pass;
+	*key_size = len;
+	return 0;
+}
+
 /*
  * Note: --key-file=- is interpreted as a read from a binary file (stdin)
  * key_size_max == 0 means detect maximum according to input type (tty/file)
@@ -288,6 +386,9 @@ int tools_get_key(const char *prompt,
 				}
 				r = crypt_get_key_tty(prompt ?: tmp, key, key_size, timeout, verify);
 			}
+		} else if (stdin_records.enabled && !key_file && !keyfile_offset) {
+			log_dbg("STDIN record passphrase entry requested.");
+			r = stdin_records_read(key, key_size, keyfile_size_max);
 		} else {
 			log_dbg("STDIN descriptor passphrase entry requested.");
 			/* No keyfile means STDIN with EOL handling (\n will end input)). */
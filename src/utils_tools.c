@@ -351,8 +351,47 @@ static void tools_clear_line(void)
 	log_std("\33[2K\r");
 }
 
+/*
+ * One json object per line, rates are in bytes per second:
+ * {"bytes":N,"total":N,"percent":F,"elapsed":F,"eta":N,"rate":F,"avg_rate":F,"final":B[,"stats":{...}]}
+ */
+static void tools_json_progress(uint64_t device_size, uint64_t bytes, double tdiff,
+				double idiff, struct tools_progress_params *parms)
+{
+	struct crypt_reencrypt_stats st = { .struct_size = sizeof(st) };
+	double avg, rate;
+	unsigned long long eta = 0;
+	int final = (bytes == device_size);
+
+	avg = tdiff > 0 ? (double)(bytes - parms->start_offset) / tdiff : 0;
+	rate = idiff > 0 ? (double)(bytes - parms->last_offset) / idiff : avg;
+	if (avg > 0 && !final)
+		eta = (unsigned long long)((device_size - bytes) / avg);
+	parms->last_offset = bytes;
+
+	log_std("{\"bytes\":%" PRIu64 ",\"total\":%" PRIu64 ",\"percent\":%.2f,"
+		"\"elapsed\":%.3f,\"eta\":%llu,\"rate\":%.0f,\"avg_rate\":%.0f,\"final\":%s",
+		bytes, device_size, device_size ? (double)bytes / device_size * 100 : 100.0,
+		tdiff, eta, rate, avg, final ? "true" : "false");
+
+	if (parms->cd && !crypt_reencrypt_get_stats(parms->cd, &st))
+		log_std(",\"stats\":{\"hotzones\":%" PRIu64 ",\"read_ns\":%" PRIu64
+			",\"read_bytes\":%" PRIu64 ",\"resilience_ns\":%" PRIu64
+			",\"resilience_bytes\":%" PRIu64 ",\"decrypt_ns\":%" PRIu64
+			",\"encrypt_ns\":%" PRIu64 ",\"write_ns\":%" PRIu64
+			",\"write_bytes\":%" PRIu64 ",\"datasync_ns\":%" PRIu64
+			",\"metadata_ns\":%" PRIu64 ",\"dm_ns\":%" PRIu64 "}",
+			st.hotzones, st.read_ns, st.read_bytes, st.resilience_ns,
+			st.resilience_bytes, st.decrypt_ns, st.encrypt_ns, st.write_ns,
+			st.write_bytes, st.datasync_ns, st.metadata_ns, st.dm_ns);
+
+	log_std("}\n");
+	fflush(stdout);
+}
+
 static void tools_time_progress(uint64_t device_size, uint64_t bytes, struct tools_progress_params *parms)
 {
+	struct timeval last_time;
 	struct timeval now_time;
 	unsigned long long mbytes, eta;
 	double tdiff, uib, frequency;
@@ -364,10 +403,14 @@ static void tools_time_progress(uint64_t device_size, uint64_t bytes, struct too
 		parms->start_time = now_time;
 		parms->end_time = now_time;
 		parms->start_offset = bytes;
+		parms->last_offset = bytes;
 		return;
 	}
 
-	if (parms->frequency) {
+	if (parms->json) {
+		frequency = parms->frequency ? (double)parms->frequency : 1.0;
+		eol = "\n";
+	} else if (parms->frequency) {
 		frequency = (double)parms->frequency;
 		eol = "\n";
 	} else {
@@ -378,9 +421,18 @@ static void tools_time_progress(uint64_t device_size, uint64_t bytes, struct too
 	if (!final && time_diff(&parms->end_time, &now_time) < frequency)
 		return;
 
+	last_time = parms->end_time;
 	parms->end_time = now_time;
 
 	tdiff = time_diff(&parms->start_time, &parms->end_time);
+
+	/* final json object is printed even for very fast operations */
+	if (parms->json) {
+		tools_json_progress(device_size, bytes, tdiff,
+				    time_diff(&last_time, &now_time), parms);
+		return;
+	}
+
 	if (!tdiff)
 		return;
 
@@ -422,12 +474,13 @@ int tools_wipe_progress(uint64_t size, uint64_t offset, void *usrptr)
 	int r = 0;
 	struct tools_progress_params *parms = (struct tools_progress_params *)usrptr;
 
-	if (parms && !parms->batch_mode)
+	/* json output is for machine processing, batch mode does not suppress it */
+	if (parms && (!parms->batch_mode || parms->json))
 		tools_time_progress(size, offset, parms);
 
 	check_signal(&r);
 	if (r) {
-		if (!parms || !parms->frequency)
+		if (!parms || (!parms->frequency && !parms->json))
 			tools_clear_line();
 		log_err(_("\nWipe interrupted."));
 	}
@@ -438,6 +491,26 @@ int tools_wipe_progress(uint64_t size, uint64_t offset, void *usrptr)
 /*
  * Keyfile - is standard input treated as a binary file (no EOL handling).
  */
+/* --numa-node option, -1 disables binding of worker threads */
+int tools_set_numa_node(struct crypt_device *cd, bool set, int32_t node)
+{
+	int r;
+
+	if (!set)
+		return 0;
+
+	if (node < -1) {
+		log_err(_("Invalid NUMA node specified."));
+		return -EINVAL;
+	}
+
+	r = crypt_set_numa_node(cd, node < 0 ? CRYPT_NUMA_NODE_NONE : node);
+	if (r < 0)
+		log_err(_("Cannot set NUMA node %d."), node);
+
+	return r;
+}
+
 int tools_is_stdin(const char *key_file)
 {
 	if (!key_file)
@@ -451,12 +524,13 @@ int tools_reencrypt_progress(uint64_t size, uint64_t offset, void *usrptr)
 	int r = 0;
 	struct tools_progress_params *parms = (struct tools_progress_params *)usrptr;
 
-	if (parms && !parms->batch_mode)
+	/* json output is for machine processing, batch mode does not suppress it */
+	if (parms && (!parms->batch_mode || parms->json))
 		tools_time_progress(size, offset, parms);
 
 	check_signal(&r);
 	if (r) {
-		if (!parms || !parms->frequency)
+		if (!parms || (!parms->frequency && !parms->json))
 			tools_clear_line();
 		log_err(_("\nReencryption interrupted."));
 	}
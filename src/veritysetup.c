@@ -19,6 +19,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <pthread.h>
 #include "cryptsetup.h"
 #include "veritysetup_args.h"
 
@@ -72,37 +73,280 @@ static int _prepare_format(struct crypt_params_verity *params,
 	return 0;
 }
 
-static int action_format(void)
+static int _create_image(const char *path, bool fec)
 {
-	struct crypt_device *cd = NULL;
-	struct crypt_params_verity params = {};
-	uint32_t flags = CRYPT_VERITY_CREATE_HASH;
 	int r;
 
-	/* Try to create hash image if doesn't exist */
-	r = open(action_argv[1], O_WRONLY | O_EXCL | O_CREAT, S_IRUSR | S_IWUSR);
+	/* Try to create image if doesn't exist */
+	r = open(path, O_WRONLY | O_EXCL | O_CREAT, S_IRUSR | S_IWUSR);
 	if (r < 0 && errno != EEXIST) {
-		log_err(_("Cannot create hash image %s for writing."), action_argv[1]);
+		if (fec)
+			log_err(_("Cannot create FEC image %s for writing."), path);
+		else
+			log_err(_("Cannot create hash image %s for writing."), path);
 		return -EINVAL;
 	} else if (r >= 0) {
-		log_dbg("Created hash image %s.", action_argv[1]);
+		if (fec)
+			log_dbg("Created FEC image %s.", path);
+		else
+			log_dbg("Created hash image %s.", path);
 		close(r);
 	}
-	/* Try to create FEC image if doesn't exist */
-	if (ARG_SET(OPT_FEC_DEVICE_ID)) {
-		r = open(ARG_STR(OPT_FEC_DEVICE_ID), O_WRONLY | O_EXCL | O_CREAT, S_IRUSR | S_IWUSR);
-		if (r < 0 && errno != EEXIST) {
-			log_err(_("Cannot create FEC image %s for writing."), ARG_STR(OPT_FEC_DEVICE_ID));
-			return -EINVAL;
-		} else if (r >= 0) {
-			log_dbg("Created FEC image %s.", ARG_STR(OPT_FEC_DEVICE_ID));
-			close(r);
+
+	return 0;
+}
+
+/* hashing is CPU bound, more images are formatted at once */
+#define FORMAT_BATCH_THREADS_MAX 16
+
+struct format_batch_image {
+	char *data_device;
+	char *hash_device;
+	char *fec_device;
+	char *root_hash;
+	size_t root_hash_size;
+	int r;
+};
+
+struct format_batch {
+	pthread_mutex_t lock;
+	struct format_batch_image *images;
+	unsigned count;
+	unsigned next;
+	const struct crypt_params_verity *params;
+};
+
+static int format_batch_one(const struct crypt_params_verity *params,
+			    struct format_batch_image *img)
+{
+	struct crypt_device *cd = NULL;
+	struct crypt_params_verity p = *params;
+	size_t size;
+	int r;
+
+	if ((r = _create_image(img->hash_device, false)))
+		return r;
+	if (img->fec_device && (r = _create_image(img->fec_device, true)))
+		return r;
+
+	if ((r = crypt_init(&cd, img->hash_device)))
+		return r;
+
+	/* uuid is generated for every image */
+	p.data_device = img->data_device;
+	p.fec_device = img->fec_device;
+	r = crypt_format(cd, CRYPT_VERITY, NULL, NULL, NULL, NULL, 0, &p);
+	if (r < 0)
+		goto out;
+
+	size = crypt_get_volume_key_size(cd);
+	if (!(img->root_hash = malloc(size))) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = crypt_volume_key_get(cd, CRYPT_ANY_SLOT, img->root_hash, &size, NULL, 0);
+	if (r >= 0) {
+		img->root_hash_size = size;
+		r = 0;
+	}
+out:
+	crypt_free(cd);
+	return r;
+}
+
+static void *format_batch_worker(void *arg)
+{
+	struct format_batch *fb = arg;
+	struct format_batch_image *img;
+
+	while (!quit) {
+		pthread_mutex_lock(&fb->lock);
+		img = fb->next < fb->count ? &fb->images[fb->next++] : NULL;
+		pthread_mutex_unlock(&fb->lock);
+		if (!img)
+			break;
+
+		img->r = format_batch_one(fb->params, img);
+	}
+
+	return NULL;
+}
+
+/* file format: <data_device> <hash_device> [<fec_device>] */
+static int format_batch_read(struct format_batch *fb)
+{
+	char buf[3 * PATH_MAX + 8], data[PATH_MAX], hash[PATH_MAX], fec[PATH_MAX];
+	struct format_batch_image *tmp, *img;
+	unsigned int line = 0;
+	FILE *f;
+	int n, r = 0;
+
+	if (!(f = fopen(ARG_STR(OPT_BATCH_FILE_ID), "r"))) {
+		log_err(_("Cannot open batch file %s."), ARG_STR(OPT_BATCH_FILE_ID));
+		return -EINVAL;
+	}
+
+	while (fgets(buf, sizeof(buf), f)) {
+		line++;
+		n = sscanf(buf, " %4095s %4095s %4095s", data, hash, fec);
+		if (n < 1 || data[0] == '#')
+			continue;
+		if (n < 2) {
+			log_err(_("Invalid line %u in batch file %s."), line, ARG_STR(OPT_BATCH_FILE_ID));
+			r = -EINVAL;
+			break;
+		}
+
+		tmp = realloc(fb->images, (fb->count + 1) * sizeof(*tmp));
+		if (!tmp) {
+			r = -ENOMEM;
+			break;
+		}
+		fb->images = tmp;
+
+		img = &fb->images[fb->count++];
+		memset(img, 0, sizeof(*img));
+		img->data_device = strdup(data);
+		img->hash_device = strdup(hash);
+		img->fec_device = n > 2 ? strdup(fec) : NULL;
+		if (!img->data_device || !img->hash_device || (n > 2 && !img->fec_device)) {
+			r = -ENOMEM;
+			break;
 		}
 	}
 
+	fclose(f);
+
+	if (!r && !fb->count) {
+		log_err(_("No device found in batch file %s."), ARG_STR(OPT_BATCH_FILE_ID));
+		r = -EINVAL;
+	}
+
+	return r;
+}
+
+/*
+ * All root hashes are printed to standard output in batch file order,
+ * one line per image: <data_device> <hash_device> <root_hash>
+ */
+static int action_format_batch(void)
+{
+	struct crypt_params_verity params = {};
+	struct format_batch fb = { .params = &params };
+	pthread_t tids[FORMAT_BATCH_THREADS_MAX];
+	unsigned i, threads, started = 0, failed = 0;
+	uint32_t flags = CRYPT_VERITY_CREATE_HASH;
+	size_t j;
+	long cpus;
+	int r;
+
+	if (ARG_SET(OPT_NO_SUPERBLOCK_ID))
+		flags |= CRYPT_VERITY_NO_HEADER;
+
+	r = _prepare_format(&params, NULL, flags);
+	if (r < 0)
+		return r;
+
+	if ((r = format_batch_read(&fb)))
+		goto out;
+
+	if (pthread_mutex_init(&fb.lock, NULL)) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	set_int_handler(0);
+
+	/*
+	 * The first image initializes crypto backend and RNG in this thread,
+	 * the others then share it.
+	 */
+	fb.images[0].r = format_batch_one(&params, &fb.images[0]);
+	fb.next = 1;
+
+	threads = ARG_UINT32(OPT_THREADS_ID);
+	if (!threads) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? (unsigned)cpus : 1;
+	}
+	if (threads > FORMAT_BATCH_THREADS_MAX)
+		threads = FORMAT_BATCH_THREADS_MAX;
+	if (threads > fb.count - 1)
+		threads = fb.count - 1;
+
+	log_dbg("Formatting %u images using %u threads.", fb.count, threads ?: 1);
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&tids[i], NULL, format_batch_worker, &fb))
+			break;
+		started++;
+	}
+
+	/* no thread, format images one by one */
+	if (!started)
+		format_batch_worker(&fb);
+
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	pthread_mutex_destroy(&fb.lock);
+
+	for (i = 0; i < fb.count; i++) {
+		if (i >= fb.next || fb.images[i].r < 0) {
+			log_err(_("Image %s was not formatted."), fb.images[i].data_device);
+			if (!r)
+				r = i >= fb.next ? -EINTR : fb.images[i].r;
+			failed++;
+			continue;
+		}
+
+		log_std("%s %s ", fb.images[i].data_device, fb.images[i].hash_device);
+		for (j = 0; j < fb.images[i].root_hash_size; j++)
+			log_std("%02hhx", fb.images[i].root_hash[j]);
+		log_std("\n");
+	}
+
+	if (failed)
+		log_dbg("Batch format failed for %u image(s).", failed);
+out:
+	for (i = 0; i < fb.count; i++) {
+		free(fb.images[i].data_device);
+		free(fb.images[i].hash_device);
+		free(fb.images[i].fec_device);
+		free(fb.images[i].root_hash);
+	}
+	free(fb.images);
+	free(CONST_CAST(char*)params.salt);
+	return r;
+}
+
+static int action_format(void)
+{
+	struct crypt_device *cd = NULL;
+	struct crypt_params_verity params = {};
+	struct crypt_params_verity vp = {};
+	struct tools_progress_params prog_parms = {
+		.json = ARG_SET(OPT_PROGRESS_JSON_ID)
+	};
+	uint32_t flags = CRYPT_VERITY_CREATE_HASH;
+	uint64_t size;
+	int r;
+
+	if (ARG_SET(OPT_BATCH_FILE_ID))
+		return action_format_batch();
+
+	if ((r = _create_image(action_argv[1], false)))
+		return r;
+	if (ARG_SET(OPT_FEC_DEVICE_ID) && (r = _create_image(ARG_STR(OPT_FEC_DEVICE_ID), true)))
+		return r;
+
 	if ((r = crypt_init(&cd, action_argv[1])))
 		goto out;
 
+	if ((r = tools_set_numa_node(cd, ARG_SET(OPT_NUMA_NODE_ID), ARG_INT32(OPT_NUMA_NODE_ID))))
+		goto out;
+
 	if (ARG_SET(OPT_NO_SUPERBLOCK_ID))
 		flags |= CRYPT_VERITY_NO_HEADER;
 
@@ -110,7 +354,18 @@ static int action_format(void)
 	if (r < 0)
 		goto out;
 
+	/*
+	 * Hash tree is created in one library call without progress callback,
+	 * json output reports only the final state of hashed data.
+	 */
+	if (prog_parms.json)
+		tools_wipe_progress(0, 0, &prog_parms);
+
 	r = crypt_format(cd, CRYPT_VERITY, NULL, NULL, ARG_STR(OPT_UUID_ID), NULL, 0, &params);
+	if (!r && prog_parms.json && !crypt_get_verity_info(cd, &vp)) {
+		size = vp.data_size * vp.data_block_size;
+		tools_wipe_progress(size, size, &prog_parms);
+	}
 	if (!r)
 		crypt_dump(cd);
 out:
@@ -200,20 +455,209 @@ out:
 
 static int action_open(void)
 {
+	uint32_t flags = 0;
+
+	if (ARG_SET(OPT_ROOT_HASH_SIGNATURE_ID))
+		flags |= CRYPT_VERITY_ROOT_HASH_SIGNATURE;
+	if (ARG_SET(OPT_HASH_ONLY_ID))
+		flags |= CRYPT_VERITY_CHECK_HASH_ONLY;
+
 	return _activate(action_argv[1],
 			 action_argv[0],
 			 action_argv[2],
 			 action_argv[3],
-			 ARG_SET(OPT_ROOT_HASH_SIGNATURE_ID) ? CRYPT_VERITY_ROOT_HASH_SIGNATURE : 0);
+			 flags);
+}
+
+/* Parse data block range in <first>[-<last>] format */
+static int _parse_range(const char *arg, struct crypt_verity_range *range)
+{
+	uint64_t first, last;
+	char *end;
+
+	if (!isdigit(*arg))
+		return -EINVAL;
+
+	errno = 0;
+	first = last = strtoull(arg, &end, 10);
+	if (!errno && *end == '-' && isdigit(end[1]))
+		last = strtoull(end + 1, &end, 10);
+
+	if (errno || *end || last < first || last == UINT64_MAX)
+		return -EINVAL;
+
+	range->offset = first;
+	range->length = last - first + 1;
+	return 0;
+}
+
+/* Parse ranges from all arguments starting at first */
+static int _parse_ranges(int first, struct crypt_verity_range **ranges)
+{
+	int i;
+
+	*ranges = calloc(action_argc - first, sizeof(**ranges));
+	if (!*ranges)
+		return -ENOMEM;
+
+	for (i = first; i < action_argc; i++)
+		if (_parse_range(action_argv[i], &(*ranges)[i - first])) {
+			log_err(_("Invalid data block range %s."), action_argv[i]);
+			free(*ranges);
+			*ranges = NULL;
+			return -EINVAL;
+		}
+
+	return 0;
+}
+
+static int _load(struct crypt_device **cd, struct crypt_params_verity *params,
+		 const char *data_device, const char *hash_device)
+{
+	int r;
+
+	if ((r = crypt_init_data_device(cd, hash_device, data_device)))
+		return r;
+
+	if (!ARG_SET(OPT_NO_SUPERBLOCK_ID)) {
+		params->hash_area_offset = ARG_UINT64(OPT_HASH_OFFSET_ID);
+		params->fec_area_offset = ARG_UINT64(OPT_FEC_OFFSET_ID);
+		params->fec_device = ARG_STR(OPT_FEC_DEVICE_ID);
+		params->fec_roots = ARG_UINT32(OPT_FEC_ROOTS_ID);
+		return crypt_load(*cd, CRYPT_VERITY, params);
+	}
+
+	r = _prepare_format(params, data_device, CRYPT_VERITY_NO_HEADER);
+	if (r < 0)
+		return r;
+	return crypt_format(*cd, CRYPT_VERITY, NULL, NULL, NULL, NULL, 0, params);
+}
+
+static int _verify_ranges(void)
+{
+	struct crypt_device *cd = NULL;
+	struct crypt_params_verity params = {};
+	struct crypt_verity_range *ranges;
+	char *root_hash_bytes = NULL;
+	ssize_t hash_size;
+	int r;
+
+	if ((r = _parse_ranges(3, &ranges)))
+		return r;
+
+	if ((r = _load(&cd, &params, action_argv[0], action_argv[1])) < 0)
+		goto out;
+
+	hash_size = crypt_get_volume_key_size(cd);
+	if (crypt_hex_to_bytes(action_argv[2], &root_hash_bytes, 0) != hash_size) {
+		log_err(_("Invalid root hash string specified."));
+		r = -EINVAL;
+		goto out;
+	}
+
+	/* Corrupted ranges are reported by library */
+	r = crypt_verity_verify(cd, ranges, action_argc - 3, NULL, NULL,
+				root_hash_bytes, hash_size);
+out:
+	crypt_free(cd);
+	free(root_hash_bytes);
+	free(ranges);
+	free(CONST_CAST(char*)params.salt);
+	return r;
 }
 
 static int action_verify(void)
 {
+	/* Optional data block ranges, verified with full report */
+	if (action_argc > 3) {
+		if (ARG_SET(OPT_HASH_ONLY_ID)) {
+			log_err(_("Option --hash-only cannot be combined with data block ranges."));
+			return -EINVAL;
+		}
+		return _verify_ranges();
+	}
+
 	return _activate(NULL,
 			 action_argv[0],
 			 action_argv[1],
 			 action_argv[2],
-			 CRYPT_VERITY_CHECK_HASH);
+			 ARG_SET(OPT_HASH_ONLY_ID) ? CRYPT_VERITY_CHECK_HASH_ONLY : CRYPT_VERITY_CHECK_HASH);
+}
+
+static int action_update(void)
+{
+	struct crypt_device *cd = NULL;
+	struct crypt_params_verity params = {};
+	struct crypt_verity_range *ranges;
+	char *root_hash = NULL;
+	int i, hash_size, r;
+
+	if ((r = _parse_ranges(2, &ranges)))
+		return r;
+
+	if ((r = _load(&cd, &params, action_argv[0], action_argv[1])) < 0)
+		goto out;
+
+	hash_size = crypt_get_volume_key_size(cd);
+	root_hash = malloc(hash_size);
+	if (!root_hash) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = crypt_verity_update(cd, ranges, action_argc - 2, root_hash, hash_size);
+	if (!r) {
+		log_std("Root hash:      \t");
+		for (i = 0; i < hash_size; i++)
+			log_std("%02hhx", root_hash[i]);
+		log_std("\n");
+	}
+out:
+	crypt_free(cd);
+	free(root_hash);
+	free(ranges);
+	free(CONST_CAST(char*)params.salt);
+	return r;
+}
+
+static int action_repair(void)
+{
+	struct crypt_device *cd = NULL;
+	struct crypt_params_verity params = {};
+	struct crypt_verity_range *repaired = NULL;
+	char *root_hash_bytes = NULL;
+	size_t i, repaired_count = 0;
+	ssize_t hash_size;
+	int r;
+
+	if (!ARG_SET(OPT_FEC_DEVICE_ID)) {
+		log_err(_("Option --fec-device is required for repair."));
+		return -EINVAL;
+	}
+
+	if ((r = _load(&cd, &params, action_argv[0], action_argv[1])) < 0)
+		goto out;
+
+	hash_size = crypt_get_volume_key_size(cd);
+	if (crypt_hex_to_bytes(action_argv[2], &root_hash_bytes, 0) != hash_size) {
+		log_err(_("Invalid root hash string specified."));
+		r = -EINVAL;
+		goto out;
+	}
+
+	r = crypt_verity_repair(cd, &repaired, &repaired_count, root_hash_bytes, hash_size);
+
+	for (i = 0; i < repaired_count; i++)
+		log_std(_("Repaired blocks %" PRIu64 "-%" PRIu64 ".\n"), repaired[i].offset,
+			repaired[i].offset + repaired[i].length - 1);
+	if (!r && !repaired_count)
+		log_std(_("No errors found.\n"));
+out:
+	crypt_free(cd);
+	free(repaired);
+	free(root_hash_bytes);
+	free(CONST_CAST(char*)params.salt);
+	return r;
 }
 
 static int action_close(void)
@@ -396,7 +840,9 @@ static struct action_type {
 	const char *desc;
 } action_types[] = {
 	{ "format",	action_format, 2, N_("<data_device> <hash_device>"),N_("format device") },
-	{ "verify",	action_verify, 3, N_("<data_device> <hash_device> <root_hash>"),N_("verify device") },
+	{ "verify",	action_verify, 3, N_("<data_device> <hash_device> <root_hash> [<first_block>[-<last_block>]...]"),N_("verify device") },
+	{ "update",	action_update, 3, N_("<data_device> <hash_device> <first_block>[-<last_block>]..."),N_("update hash after data blocks changed") },
+	{ "repair",	action_repair, 3, N_("<data_device> <hash_device> <root_hash>"),N_("repair device using FEC device") },
 	{ "open",	action_open,   4, N_("<data_device> <name> <hash_device> <root_hash>"),N_("open device as <name>") },
 	{ "close",	action_close,  1, N_("<name>"),N_("close device (remove mapping)") },
 	{ "status",	action_status, 1, N_("<name>"),N_("show active device status") },
@@ -552,7 +998,9 @@ int main(int argc, const char **argv)
 		usage(popt_context, EXIT_FAILURE, _("Unknown action."),
 		      poptGetInvocationName(popt_context));
 
-	if (action_argc < action->required_action_argc) {
+	/* format with batch file does not use device arguments */
+	if (action_argc < action->required_action_argc &&
+	    !(ARG_SET(OPT_BATCH_FILE_ID) && !strcmp(aname, FORMAT_ACTION))) {
 		char buf[128];
 		snprintf(buf, 128,_("%s: requires %s as arguments"), action->type, action->arg_desc);
 		usage(popt_context, EXIT_FAILURE, buf,
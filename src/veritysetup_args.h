@@ -29,15 +29,21 @@
 #define DUMP_ACTION	"dump"
 #define FORMAT_ACTION	"format"
 #define OPEN_ACTION	"open"
+#define REPAIR_ACTION	"repair"
 #define STATUS_ACTION	"status"
 #define VERIFY_ACTION	"verify"
 
+#define OPT_BATCH_FILE_ACTIONS			{ FORMAT_ACTION }
 #define OPT_DEFERRED_ACTIONS			{ CLOSE_ACTION }
 #define OPT_IGNORE_CORRUPTION_ACTIONS		{ OPEN_ACTION }
 #define OPT_IGNORE_ZERO_BLOCKS_ACTIONS		{ OPEN_ACTION }
+#define OPT_NUMA_NODE_ACTIONS			{ FORMAT_ACTION }
+#define OPT_PROGRESS_JSON_ACTIONS		{ FORMAT_ACTION }
 #define OPT_RESTART_ON_CORRUPTION_ACTIONS	{ OPEN_ACTION }
 #define OPT_PANIC_ON_CORRUPTION_ACTIONS		{ OPEN_ACTION }
 #define OPT_ROOT_HASH_SIGNATURE_ACTIONS		{ OPEN_ACTION }
+#define OPT_HASH_ONLY_ACTIONS			{ OPEN_ACTION, VERIFY_ACTION }
+#define OPT_THREADS_ACTIONS			{ FORMAT_ACTION }
 
 enum {
 OPT_UNUSED_ID = 0,
@@ -19,10 +19,13 @@
  */
 
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define UNUSED(expr) do { (void)(expr); } while (0)
 
@@ -110,6 +113,96 @@ do {											\
 	return 0;
 }
 
+struct io_thread_args {
+	int (*init)(void **cd, const char *device);
+	int (*load)(void *cd, const char *requested_type, void *params);
+	void (*free)(void *cd);
+	const char *device;
+	pthread_barrier_t barrier;
+};
+
+static void *io_thread(void *arg)
+{
+	struct io_thread_args *a = arg;
+	void *cd;
+
+	/* unaligned header probe uses per-thread library I/O buffers */
+	if (!a->init(&cd, a->device)) {
+		a->load(cd, NULL, NULL);
+		a->free(cd);
+	}
+
+	pthread_barrier_wait(&a->barrier);
+	/* library is unloaded now, thread exit must not call into it */
+	pthread_barrier_wait(&a->barrier);
+
+	return NULL;
+}
+
+static int check_thread_exit(const char *libfile)
+{
+	struct io_thread_args a = {};
+	char device[] = "/tmp/all-symbols-test-XXXXXX";
+	void (*locking)(void *cd, int enable);
+	pthread_t thread;
+	void *h;
+	int fd, r = 1;
+
+	log_std("Checking thread exit after dlclose(%s)...", libfile);
+
+	fd = mkstemp(device);
+	if (fd < 0 || ftruncate(fd, 1024 * 1024)) {
+		log_err("Cannot create temporary device file.");
+		if (fd >= 0)
+			close(fd);
+		return 1;
+	}
+	close(fd);
+
+	h = dlopen(libfile, RTLD_NOW);
+	if (!h) {
+		log_err("dlopen(): %s.", dlerror());
+		goto out;
+	}
+
+	*(void **)&a.init = dlsym(h, "crypt_init");
+	*(void **)&a.load = dlsym(h, "crypt_load");
+	*(void **)&a.free = dlsym(h, "crypt_free");
+	*(void **)&locking = dlsym(h, "crypt_metadata_locking");
+	if (!a.init || !a.load || !a.free || !locking) {
+		log_err("Missing symbol: %s.", dlerror());
+		dlclose(h);
+		goto out;
+	}
+
+	locking(NULL, 0);
+	a.device = device;
+	pthread_barrier_init(&a.barrier, NULL, 2);
+
+	if (pthread_create(&thread, NULL, io_thread, &a)) {
+		log_err("Cannot create thread.");
+		dlclose(h);
+		pthread_barrier_destroy(&a.barrier);
+		goto out;
+	}
+
+	pthread_barrier_wait(&a.barrier);
+	if (dlclose(h))
+		log_err("Failed to dlclose %s: %s.", libfile, dlerror());
+	else
+		r = 0;
+	pthread_barrier_wait(&a.barrier);
+
+	pthread_join(thread, NULL);
+	pthread_barrier_destroy(&a.barrier);
+
+	if (!r)
+		log_std("OK\n");
+out:
+	unlink(device);
+	return r;
+}
+
 static void usage(const char *app)
 {
 	log_std("usage:\n\t%s [-v|--verbose|--debug] [optional path to library so file]\n", app);
@@ -150,5 +243,8 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	if (!r)
+		r = check_thread_exit(libfile);
+
 	return r ? EXIT_FAILURE : EXIT_SUCCESS;
 }
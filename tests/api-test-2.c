@@ -27,7 +27,12 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dlfcn.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <inttypes.h>
 #include <sys/types.h>
 #ifdef KERNEL_KEYRING
@@ -76,6 +81,8 @@ typedef int32_t key_serial_t;
 #define KEYFILE2 "key2.file"
 #define KEY2 "0123456789abcdef"
 
+#define PBKDF_CACHE_FILE "pbkdf_cache.file"
+
 #define PASSPHRASE "blabla"
 #define PASSPHRASE1 "albalb"
 
@@ -225,10 +232,46 @@ static int get_luks2_offsets(int metadata_device,
 	return 0;
 }
 
+/* largest range in keyslots area not covered by any keyslot area */
+static uint64_t _keyslot_areas_max_gap(struct crypt_device *cd)
+{
+	uint64_t mdata_size, keyslots_size, start, end, offset, length, gap = 0;
+	int i, j;
+
+	if (crypt_get_metadata_size(cd, &mdata_size, &keyslots_size))
+		return 0;
+
+	/* candidate gap starts: keyslots area start and every area end */
+	for (i = -1; i < crypt_keyslot_max(CRYPT_LUKS2); i++) {
+		if (i < 0)
+			start = 2 * mdata_size;
+		else if (crypt_keyslot_area(cd, i, &start, &length))
+			continue;
+		else
+			start += length;
+
+		end = 2 * mdata_size + keyslots_size;
+		for (j = 0; j < crypt_keyslot_max(CRYPT_LUKS2); j++) {
+			if (crypt_keyslot_area(cd, j, &offset, &length))
+				continue;
+			if (offset <= start && start < offset + length)
+				end = start;
+			else if (offset > start && offset < end)
+				end = offset;
+		}
+
+		if (end - start > gap)
+			gap = end - start;
+	}
+
+	return gap;
+}
+
 static void _remove_keyfiles(void)
 {
 	remove(KEYFILE1);
 	remove(KEYFILE2);
+	remove(PBKDF_CACHE_FILE);
 }
 
 #if HAVE_DECL_DM_TASK_RETRY_REMOVE
@@ -477,8 +520,55 @@ static int test_open(struct crypt_device *cd __attribute__((unused)),
 	return 0;
 }
 
+static unsigned test_pass_open_calls;
+
+/* passphrase is stored in token, usrptr is not available in concurrent open */
+static int test_pass_open(struct crypt_device *cd,
+	int token,
+	char **buffer,
+	size_t *buffer_len,
+	void *usrptr __attribute__((unused)))
+{
+	const char *json, *str;
+
+	__atomic_add_fetch(&test_pass_open_calls, 1, __ATOMIC_SEQ_CST);
+
+	if (crypt_token_json_get(cd, token, &json) < 0 ||
+	    !(str = strstr(json, "\"pass\":\"")))
+		return -ENOENT;
+	str += strlen("\"pass\":\"");
+
+	*buffer = strndup(str, strcspn(str, "\""));
+	if (!*buffer)
+		return -ENOMEM;
+	*buffer_len = strlen(*buffer);
+
+	return 0;
+}
+
+#define TEST_PASS_TOKEN_JSON(x, y) "{\"type\":\"test_pass_token\",\"keyslots\":[" x "]," \
+			"\"pass\":\"" y "\"}"
+
+/* handler registration is global, the first test using it registers it */
+static int _register_pass_token(void)
+{
+	static const crypt_token_handler th = {
+		.name = "test_pass_token",
+		.open = test_pass_open
+	};
+	static bool registered = false;
+
+	if (!registered && !crypt_token_register(&th))
+		registered = true;
+
+	return registered ? 0 : -EINVAL;
+}
+
+static unsigned test_validate_calls;
+
 static int test_validate(struct crypt_device *cd __attribute__((unused)), const char *json)
 {
+	test_validate_calls++;
 	return (strstr(json, "magic_string") == NULL);
 }
 
@@ -486,6 +576,7 @@ static void UseLuks2Device(void)
 {
 	char key[128];
 	size_t key_size;
+	uint64_t r_metadata_size;
 
 	OK_(crypt_init(&cd, DEVICE_1));
 	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
@@ -526,8 +617,35 @@ static void UseLuks2Device(void)
 	OK_(crypt_activate_by_volume_key(cd, NULL, key, key_size, 0));
 	OK_(crypt_activate_by_volume_key(cd, CDEVICE_1, key, key_size, 0));
 	GE_(crypt_status(cd, CDEVICE_1), CRYPT_ACTIVE);
+	CRYPT_FREE(cd);
+
+	// init by name without header load, header is loaded on first use
+	FAIL_(crypt_init_by_name_flags(&cd, CDEVICE_1, NULL, ~CRYPT_INIT_BY_NAME_NO_HEADER), "unknown flags");
+	OK_(crypt_init_by_name_flags(&cd, CDEVICE_1, NULL, CRYPT_INIT_BY_NAME_NO_HEADER));
+	OK_(strcmp(CRYPT_LUKS2, crypt_get_type(cd)));
+	OK_(strcmp("aes", crypt_get_cipher(cd)));
+	EQ_((int)key_size, crypt_get_volume_key_size(cd));
+	OK_(strcmp(DEVICE_1_UUID, crypt_get_uuid(cd)));
+	OK_(crypt_volume_key_verify(cd, key, key_size));
+	CRYPT_FREE(cd);
+	// getters reading header data must load postponed header too
+	OK_(crypt_init_by_name_flags(&cd, CDEVICE_1, NULL, CRYPT_INIT_BY_NAME_NO_HEADER));
+	EQ_(8192, crypt_get_data_offset(cd));
+	CRYPT_FREE(cd);
+	OK_(crypt_init_by_name_flags(&cd, CDEVICE_1, NULL, CRYPT_INIT_BY_NAME_NO_HEADER));
+	GE_(crypt_keyslot_status(cd, 0), CRYPT_SLOT_ACTIVE);
+	CRYPT_FREE(cd);
+	OK_(crypt_init_by_name_flags(&cd, CDEVICE_1, NULL, CRYPT_INIT_BY_NAME_NO_HEADER));
+	EQ_(crypt_reencrypt_status(cd, NULL), CRYPT_REENCRYPT_NONE);
+	OK_(crypt_get_metadata_size(cd, &r_metadata_size, NULL));
+	GE_(r_metadata_size, 0x4000);
+	CRYPT_FREE(cd);
+	OK_(crypt_init_by_name_flags(&cd, CDEVICE_1, NULL, CRYPT_INIT_BY_NAME_NO_HEADER));
 	OK_(crypt_deactivate(cd, CDEVICE_1));
+	CRYPT_FREE(cd);
 
+	OK_(crypt_init(&cd, DEVICE_1));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
 	key[1] = ~key[1];
 	FAIL_(crypt_volume_key_verify(cd, key, key_size), "key mismatch");
 	FAIL_(crypt_activate_by_volume_key(cd, CDEVICE_1, key, key_size, 0), "key mismatch");
@@ -1113,6 +1231,34 @@ static void Luks2MetadataSize(void)
 	_cleanup_dmdevices();
 }
 
+static void NumaNode(void)
+{
+	cpu_set_t saved, set;
+	int cpu;
+
+	OK_(crypt_init(&cd, DEVICE_EMPTY));
+	FAIL_(crypt_set_numa_node(NULL, 0), "Context is required");
+	FAIL_(crypt_set_numa_node(cd, CRYPT_NUMA_NODE_NONE - 1), "Invalid node");
+	OK_(crypt_set_numa_node(cd, CRYPT_NUMA_NODE_AUTO));
+	OK_(crypt_set_numa_node(cd, CRYPT_NUMA_NODE_NONE));
+
+	// parallel wipe bound to node 0 must stay within allowed CPUs
+	OK_(crypt_set_numa_node(cd, 0));
+	OK_(sched_getaffinity(0, sizeof(saved), &saved));
+	for (cpu = 0; cpu < CPU_SETSIZE && !CPU_ISSET(cpu, &saved); cpu++);
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	OK_(sched_setaffinity(0, sizeof(set), &set));
+	OK_(crypt_wipe(cd, NULL, CRYPT_WIPE_ZERO, 0, 4*1024*1024, 4096, 0, NULL, NULL));
+	OK_(sched_setaffinity(0, sizeof(saved), &saved));
+	OK_(crypt_wipe(cd, NULL, CRYPT_WIPE_ZERO, 0, 4*1024*1024, 4096, 0, NULL, NULL));
+
+	// node without CPUs (or not present) falls back to unbound workers
+	OK_(crypt_set_numa_node(cd, 1023));
+	OK_(crypt_wipe(cd, NULL, CRYPT_WIPE_ZERO, 0, 4*1024*1024, 4096, 0, NULL, NULL));
+	CRYPT_FREE(cd);
+}
+
 static void UseTempVolumes(void)
 {
 	char tmp[256];
@@ -1284,12 +1430,13 @@ static void Luks2HeaderLoad(void)
 		.offset = 0,
 		.size = 0
 	};
-	char key[128], cmd[256];
+	char key[128], cmd[256], uuid[40], uuid2[40];
 
 	const char *mk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
 	size_t key_size = strlen(mk_hex) / 2;
 	const char *cipher = "aes";
 	const char *cipher_mode = "cbc-essiv:sha256";
+	const char *type;
 	uint64_t r_payload_offset, r_header_size, img_size;
 
 	/* Cannot use Argon2 in FIPS */
@@ -1397,6 +1544,146 @@ static void Luks2HeaderLoad(void)
 	EQ_(strcmp(CRYPT_LUKS2, crypt_get_type(cd)), 0);
 	CRYPT_FREE(cd);
 
+	/* probe reads only binary headers */
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_0S));
+	OK_(crypt_luks_probe(cd, CRYPT_LUKS, 0, &type, uuid, sizeof(uuid)));
+	EQ_(strcmp(CRYPT_LUKS2, type), 0);
+	OK_(!*uuid);
+	OK_(crypt_luks_probe(cd, CRYPT_LUKS2, CRYPT_LUKS_PROBE_STRICT, NULL, NULL, 0));
+	FAIL_(crypt_luks_probe(cd, CRYPT_LUKS1, 0, NULL, NULL, 0), "Wrong LUKS version");
+	NULL_(crypt_get_type(cd));
+	CRYPT_FREE(cd);
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	FAIL_(crypt_luks_probe(cd, CRYPT_LUKS, 0, NULL, NULL, 0), "Not a LUKS device");
+	CRYPT_FREE(cd);
+
+	/* primary header checksum mismatch, strict probe must use secondary header */
+	OK_(_system("printf 'X' | dd of=" DMDIR L_DEVICE_0S " bs=1 seek=16000 conv=notrunc 2>/dev/null", 1));
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_0S));
+	FAIL_(crypt_luks_probe(cd, CRYPT_LUKS, 0, NULL, NULL, 0), "Primary header checksum mismatch");
+	NULL_(crypt_get_type(cd));
+	OK_(crypt_luks_probe(cd, CRYPT_LUKS, CRYPT_LUKS_PROBE_STRICT, &type, uuid2, sizeof(uuid2)));
+	EQ_(strcmp(CRYPT_LUKS2, type), 0);
+	EQ_(strcmp(uuid, uuid2), 0);
+	EQ_(strcmp(CRYPT_LUKS2, crypt_get_type(cd)), 0);
+	CRYPT_FREE(cd);
+
+	/* wiped primary header, strict probe must use secondary header */
+	OK_(_system("dd if=/dev/zero of=" DMDIR L_DEVICE_0S " bs=4096 count=1 2>/dev/null", 1));
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_0S));
+	FAIL_(crypt_luks_probe(cd, CRYPT_LUKS, 0, NULL, NULL, 0), "Primary header wiped");
+	FAIL_(crypt_luks_probe(cd, CRYPT_LUKS1, CRYPT_LUKS_PROBE_STRICT, NULL, NULL, 0), "LUKS1 has no secondary header");
+	memset(uuid2, 0, sizeof(uuid2));
+	OK_(crypt_luks_probe(cd, NULL, CRYPT_LUKS_PROBE_STRICT, &type, uuid2, sizeof(uuid2)));
+	EQ_(strcmp(CRYPT_LUKS2, type), 0);
+	EQ_(strcmp(uuid, uuid2), 0);
+	CRYPT_FREE(cd);
+
+	_cleanup_dmdevices();
+}
+
+/* raw seqid and salt of primary LUKS2 binary header */
+static int luks2_hdr_seqid_salt(const char *device, char *seqid, char *salt)
+{
+	char buf[4096];
+	int fd, r = -EINVAL;
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0)
+		return -EINVAL;
+	if (read(fd, buf, sizeof(buf)) == (ssize_t)sizeof(buf)) {
+		memcpy(seqid, buf + 16, 8);
+		memcpy(salt, buf + 104, 64);
+		r = 0;
+	}
+	close(fd);
+	return r;
+}
+
+/*
+ * Rewrite header from another process, so header cache of this process
+ * is not invalidated by the write. With cipher_mode set, the header is
+ * reformatted with the same UUID (same seqid, new salt), otherwise
+ * activation flags are changed (seqid bump).
+ */
+static int luks2_hdr_rewrite_ext(const char *device, const char *uuid, const char *cipher_mode)
+{
+	struct crypt_device *cd2;
+	pid_t pid;
+	int r, status;
+
+	pid = fork();
+	if (pid < 0)
+		return -EINVAL;
+
+	if (!pid) {
+		r = crypt_init(&cd2, device);
+		if (!r && cipher_mode)
+			r = crypt_format(cd2, CRYPT_LUKS2, "aes", cipher_mode, uuid, NULL, 32, NULL);
+		else if (!r) {
+			r = crypt_load(cd2, CRYPT_LUKS2, NULL);
+			if (!r)
+				r = crypt_persistent_flags_set(cd2, CRYPT_FLAGS_ACTIVATION, CRYPT_ACTIVATE_ALLOW_DISCARDS);
+		}
+		crypt_free(cd2);
+		_exit(r ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+		return -EINVAL;
+
+	return WEXITSTATUS(status) ? -EINVAL : 0;
+}
+
+static void Luks2HeaderCache(void)
+{
+	char seqid[8], seqid2[8], salt[64], salt2[64];
+	const char *uuid = "b9c12b38-4e6a-4f6e-8b3d-5e0d1c3f6a21";
+	uint64_t r_payload_offset;
+	uint32_t flags;
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(L_DEVICE_OK, r_payload_offset + 1));
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", uuid, NULL, 32, NULL));
+	CRYPT_FREE(cd);
+
+	OK_(crypt_luks2_header_cache(NULL, 1));
+
+	/* first load fills the cache, unchanged header is then reused */
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	CRYPT_FREE(cd);
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	OK_(strcmp(crypt_get_cipher_mode(cd), "xts-plain64"));
+	CRYPT_FREE(cd);
+
+	/* same seqid, different salt (reformat with the same UUID) */
+	OK_(luks2_hdr_seqid_salt(DMDIR L_DEVICE_OK, seqid, salt));
+	OK_(luks2_hdr_rewrite_ext(DMDIR L_DEVICE_OK, uuid, "cbc-essiv:sha256"));
+	OK_(luks2_hdr_seqid_salt(DMDIR L_DEVICE_OK, seqid2, salt2));
+	OK_(memcmp(seqid, seqid2, sizeof(seqid)));
+	OK_(!memcmp(salt, salt2, sizeof(salt)));
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	OK_(strcmp(crypt_get_cipher_mode(cd), "cbc-essiv:sha256"));
+	OK_(strcmp(crypt_get_uuid(cd), uuid));
+	CRYPT_FREE(cd);
+
+	/* seqid bump, the same salt */
+	OK_(luks2_hdr_seqid_salt(DMDIR L_DEVICE_OK, seqid, salt));
+	OK_(luks2_hdr_rewrite_ext(DMDIR L_DEVICE_OK, uuid, NULL));
+	OK_(luks2_hdr_seqid_salt(DMDIR L_DEVICE_OK, seqid2, salt2));
+	OK_(!memcmp(seqid, seqid2, sizeof(seqid)));
+	OK_(memcmp(salt, salt2, sizeof(salt)));
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	OK_(crypt_persistent_flags_get(cd, CRYPT_FLAGS_ACTIVATION, &flags));
+	EQ_(flags, CRYPT_ACTIVATE_ALLOW_DISCARDS);
+	CRYPT_FREE(cd);
+
+	OK_(crypt_luks2_header_cache(NULL, 0));
 	_cleanup_dmdevices();
 }
 
@@ -1878,6 +2165,11 @@ static void Tokens(void)
 	FAIL_(crypt_token_register(&th2), "Token handler with the name already registered.");
 
 	FAIL_(crypt_token_register(&th_reserved), "luks2- is reserved prefix");
+	OK_(_register_pass_token());
+
+	// registered handlers are not external plugins
+	EQ_(crypt_token_unload_external(th.name), -ENOENT);
+	OK_(crypt_token_unload_external(NULL));
 
 	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
 	OK_(create_dmdevice_over_loop(L_DEVICE_1S, r_payload_offset + 1));
@@ -1890,12 +2182,40 @@ static void Tokens(void)
 	EQ_(crypt_token_status(cd, 32, NULL), CRYPT_TOKEN_INVALID);
 	EQ_(crypt_token_status(cd, 0, NULL), CRYPT_TOKEN_INACTIVE);
 	EQ_(crypt_token_status(cd, 31, NULL), CRYPT_TOKEN_INACTIVE);
+	FAIL_(crypt_token_concurrent_open(NULL, 1000), "Context is required");
+	OK_(crypt_token_concurrent_open(cd, 1000));
+	EQ_(crypt_activate_by_token(cd, NULL, CRYPT_ANY_TOKEN, NULL, 0), -ENOENT);
+	OK_(crypt_token_concurrent_open(cd, 0));
+	FAIL_(crypt_token_open_timeout(NULL, 1000), "Context is required");
+	OK_(crypt_token_open_timeout(cd, 1000));
+	EQ_(crypt_activate_by_token(cd, NULL, CRYPT_ANY_TOKEN, NULL, 0), -ENOENT);
+	OK_(crypt_token_open_timeout(cd, 0));
 	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
 	EQ_(crypt_keyslot_add_by_volume_key(cd, 1, NULL, 32, PASSPHRASE1, strlen(PASSPHRASE1)), 1);
+	FAIL_(crypt_keyslot_set_token_hint(cd, 0, PASSPHRASE, strlen(PASSPHRASE)), "Secret too short");
+	OK_(crypt_keyslot_set_token_hint(cd, 0, NULL, 0));
+	FAIL_(crypt_volume_key_handoff(NULL, 10), "Context is required");
+	OK_(crypt_volume_key_handoff(cd, 10));
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 0);
+	FAIL_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, "xxx", 3, 0), "Passphrase check ignores handoff");
+	OK_(crypt_volume_key_handoff(cd, 0));
+	FAIL_(crypt_pbkdf_memory_budget(1024, 0x80), "Unknown flag");
+	OK_(crypt_pbkdf_memory_budget(1024, 0));
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 0);
+	OK_(crypt_pbkdf_memory_budget(0, 0));
 	FAIL_(crypt_token_json_set(cd, CRYPT_ANY_TOKEN, TEST_TOKEN_JSON_INVALID("\"0\"")), "Token validation failed");
 	EQ_(crypt_token_json_set(cd, CRYPT_ANY_TOKEN, TEST_TOKEN_JSON("\"0\"")), 0);
 	EQ_(crypt_token_status(cd, 0, NULL), CRYPT_TOKEN_EXTERNAL);
 	EQ_(crypt_activate_by_token(cd, CDEVICE_1, 0, passptr, 0), 0);
+	{
+		struct crypt_operation_stats ost;
+
+		FAIL_(crypt_get_last_operation_stats(NULL, &ost), "Context is required");
+		FAIL_(crypt_get_last_operation_stats(cd, NULL), "Stats are required");
+		OK_(crypt_get_last_operation_stats(cd, &ost));
+		GE_(ost.kdf_count, 1);
+		GE_(ost.total_usec, ost.kdf_usec + ost.token_usec + ost.dm_usec + ost.udev_usec);
+	}
 	FAIL_(crypt_activate_by_token(cd, CDEVICE_1, 0, passptr, 0), "already active");
 	OK_(crypt_deactivate(cd, CDEVICE_1));
 
@@ -1912,6 +2232,15 @@ static void Tokens(void)
 	EQ_(crypt_activate_by_token(cd, CDEVICE_1, 2, passptr1, 0), 1);
 	OK_(crypt_deactivate(cd, CDEVICE_1));
 
+	// unchanged token validated in other context is not validated again
+	test_validate_calls = 0;
+	CRYPT_FREE(cd);
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_1S));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	EQ_(crypt_activate_by_token(cd, CDEVICE_1, 2, passptr1, 0), 1);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	EQ_(test_validate_calls, 0);
+
 	// test crypt_token_json_get returns correct token id
 	EQ_(crypt_token_json_get(cd, 2, &dummy), 2);
 
@@ -2000,12 +2329,410 @@ static void Tokens(void)
 
 	CRYPT_FREE(cd);
 
+	// concurrent open of registered tokens, handlers run in worker threads
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_1S));
+	crypt_set_iteration_time(cd, 1);
+	OK_(crypt_format(cd, CRYPT_LUKS2, cipher, cipher_mode, NULL, NULL, 32, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 1, NULL, 32, PASSPHRASE1, strlen(PASSPHRASE1)), 1);
+	EQ_(crypt_token_json_set(cd, 0, TEST_PASS_TOKEN_JSON("\"0\"", "xxx")), 0);
+	EQ_(crypt_token_json_set(cd, 1, TEST_PASS_TOKEN_JSON("\"1\"", PASSPHRASE1)), 1);
+	EQ_(crypt_token_json_set(cd, 2, TEST_PASS_TOKEN_JSON("\"0\"", PASSPHRASE)), 2);
+	OK_(crypt_token_concurrent_open(cd, 5000));
+	ks = crypt_activate_by_token(cd, CDEVICE_1, CRYPT_ANY_TOKEN, NULL, 0);
+	NOTFAIL_(ks, "Concurrent token open failed.");
+	OK_(ks != 0 && ks != 1);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	EQ_(crypt_token_json_set(cd, 1, NULL), 1);
+	EQ_(crypt_activate_by_token(cd, NULL, CRYPT_ANY_TOKEN, NULL, 0), 0);
+	// all tokens fail, the same error as sequential open, every handler was called
+	EQ_(crypt_token_json_set(cd, 2, NULL), 2);
+	EQ_(crypt_token_json_set(cd, 3, TEST_PASS_TOKEN_JSON("\"1\"", "yyy")), 3);
+	test_pass_open_calls = 0;
+	EQ_(crypt_activate_by_token(cd, NULL, CRYPT_ANY_TOKEN, NULL, 0), -EPERM);
+	EQ_(__atomic_load_n(&test_pass_open_calls, __ATOMIC_SEQ_CST), 2);
+	OK_(crypt_token_concurrent_open(cd, 0));
+	EQ_(crypt_activate_by_token(cd, NULL, CRYPT_ANY_TOKEN, NULL, 0), -EPERM);
+	CRYPT_FREE(cd);
+
 	EQ_(crypt_token_max(CRYPT_LUKS2), 32);
 	FAIL_(crypt_token_max(CRYPT_LUKS1), "No token support in LUKS1");
 	FAIL_(crypt_token_max(NULL), "No LUKS format specified");
 	_cleanup_dmdevices();
 }
 
+static void TokenKeyslotHint(void)
+{
+#define HINT_SECRET  "0123456789abcdef0123456789abcdef"
+#define HINT_SECRET1 "fedcba9876543210fedcba9876543210"
+	struct crypt_operation_stats ost;
+	uint64_t r_payload_offset;
+
+	OK_(_register_pass_token());
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(L_DEVICE_1S, r_payload_offset + 1));
+
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_1S));
+	crypt_set_iteration_time(cd, 1);
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, NULL, 32, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, HINT_SECRET1, strlen(HINT_SECRET1)), 0);
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 1, NULL, 32, HINT_SECRET, strlen(HINT_SECRET)), 1);
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 2, NULL, 32, HINT_SECRET, strlen(HINT_SECRET)), 2);
+	EQ_(crypt_token_json_set(cd, 0, TEST_PASS_TOKEN_JSON("\"0\",\"1\",\"2\"", HINT_SECRET)), 0);
+
+	FAIL_(crypt_keyslot_set_token_hint(NULL, 2, HINT_SECRET, strlen(HINT_SECRET)), "Context is required");
+	FAIL_(crypt_keyslot_set_token_hint(cd, 2, HINT_SECRET1, strlen(HINT_SECRET1)), "Wrong passphrase");
+	FAIL_(crypt_keyslot_set_token_hint(cd, 5, HINT_SECRET, strlen(HINT_SECRET)), "Inactive keyslot");
+
+	// no hints, keyslots are tried in token order
+	EQ_(crypt_activate_by_token(cd, NULL, 0, NULL, 0), 1);
+	OK_(crypt_get_last_operation_stats(cd, &ost));
+	EQ_(ost.kdf_count, 2);
+
+	// matching hint first, mismatching (possibly stale) hint last
+	OK_(crypt_keyslot_set_token_hint(cd, 0, HINT_SECRET1, strlen(HINT_SECRET1)));
+	OK_(crypt_keyslot_set_token_hint(cd, 2, HINT_SECRET, strlen(HINT_SECRET)));
+	EQ_(crypt_activate_by_token(cd, NULL, 0, NULL, 0), 2);
+	OK_(crypt_get_last_operation_stats(cd, &ost));
+	EQ_(ost.kdf_count, 1);
+
+	// keyslots without hint before mismatching hint
+	OK_(crypt_keyslot_set_token_hint(cd, 2, NULL, 0));
+	EQ_(crypt_activate_by_token(cd, CDEVICE_1, 0, NULL, 0), 1);
+	OK_(crypt_get_last_operation_stats(cd, &ost));
+	EQ_(ost.kdf_count, 1);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+
+	// hints are stored in metadata, the same order after reload
+	OK_(crypt_keyslot_set_token_hint(cd, 2, HINT_SECRET, strlen(HINT_SECRET)));
+	CRYPT_FREE(cd);
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_1S));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	EQ_(crypt_activate_by_token(cd, NULL, 0, NULL, 0), 2);
+
+	// passphrase change drops the hint
+	EQ_(crypt_keyslot_change_by_passphrase(cd, 2, 2, HINT_SECRET, strlen(HINT_SECRET), HINT_SECRET, strlen(HINT_SECRET)), 2);
+	EQ_(crypt_activate_by_token(cd, NULL, 0, NULL, 0), 1);
+	CRYPT_FREE(cd);
+
+	_cleanup_dmdevices();
+#undef HINT_SECRET
+#undef HINT_SECRET1
+}
+
+static int read_lock_count;
+
+static void read_lock_log_callback(int level, const char *msg, void *usrptr)
+{
+	if (level == CRYPT_LOG_DEBUG && strstr(msg, "Acquiring read lock for device"))
+		read_lock_count++;
+	global_log_callback(level, msg, usrptr);
+}
+
+static int lockless_writer_done;
+static int lockless_reads;
+static int lockless_read_errors;
+
+static void *lockless_reader(void *arg __attribute__((unused)))
+{
+	struct crypt_device *rcd;
+
+	while (!__atomic_load_n(&lockless_writer_done, __ATOMIC_SEQ_CST)) {
+		if (crypt_init(&rcd, DMDIR L_DEVICE_1S)) {
+			__atomic_add_fetch(&lockless_read_errors, 1, __ATOMIC_SEQ_CST);
+			break;
+		}
+		if (crypt_load(rcd, CRYPT_LUKS2, NULL) ||
+		    crypt_keyslot_status(rcd, 0) != CRYPT_SLOT_ACTIVE_LAST)
+			__atomic_add_fetch(&lockless_read_errors, 1, __ATOMIC_SEQ_CST);
+		crypt_free(rcd);
+		__atomic_add_fetch(&lockless_reads, 1, __ATOMIC_SEQ_CST);
+	}
+
+	return NULL;
+}
+
+static void LocklessHeaderRead(void)
+{
+	pthread_t tids[4];
+	uint64_t r_payload_offset;
+	char buf[4096];
+	unsigned i;
+	int fd;
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(L_DEVICE_1S, r_payload_offset + 1));
+
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_1S));
+	crypt_set_iteration_time(cd, 1);
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, NULL, 32, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	CRYPT_FREE(cd);
+
+	/* consistent header is read without lock */
+	crypt_set_debug_level(CRYPT_DEBUG_ALL);
+	read_lock_count = 0;
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_1S));
+	crypt_set_log_callback(cd, &read_lock_log_callback, NULL);
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	EQ_(read_lock_count, 0);
+	CRYPT_FREE(cd);
+
+	/* damaged secondary header needs locked read (and recovery) */
+	memset(buf, 0, sizeof(buf));
+	fd = open(DMDIR L_DEVICE_1S, O_RDWR);
+	GE_(fd, 0);
+	EQ_(pwrite(fd, buf, sizeof(buf), 16384), (ssize_t)sizeof(buf));
+	close(fd);
+	read_lock_count = 0;
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_1S));
+	crypt_set_log_callback(cd, &read_lock_log_callback, NULL);
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	GE_(read_lock_count, 1);
+	EQ_(crypt_keyslot_status(cd, 0), CRYPT_SLOT_ACTIVE_LAST);
+	crypt_set_debug_level(_debug ? CRYPT_DEBUG_JSON : CRYPT_DEBUG_NONE);
+
+	/* concurrent readers never see inconsistent header during update */
+	lockless_writer_done = lockless_reads = lockless_read_errors = 0;
+	for (i = 0; i < sizeof(tids) / sizeof(*tids); i++)
+		OK_(pthread_create(&tids[i], NULL, lockless_reader, NULL));
+	for (i = 0; i < 50; i++) {
+		EQ_(crypt_token_json_set(cd, 0, "{\"type\":\"lockless_test\",\"keyslots\":[\"0\"]}"), 0);
+		EQ_(crypt_token_json_set(cd, 0, NULL), 0);
+	}
+	__atomic_store_n(&lockless_writer_done, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i < sizeof(tids) / sizeof(*tids); i++)
+		OK_(pthread_join(tids[i], NULL));
+	GE_(lockless_reads, 1);
+	EQ_(lockless_read_errors, 0);
+	CRYPT_FREE(cd);
+
+	_cleanup_dmdevices();
+}
+
+static int serialize_lock_count;
+
+static void serialize_log_callback(int level, const char *msg, void *usrptr)
+{
+	if (level == CRYPT_LOG_DEBUG && strstr(msg, "Taking global memory-hard access serialization lock."))
+		__atomic_add_fetch(&serialize_lock_count, 1, __ATOMIC_SEQ_CST);
+	global_log_callback(level, msg, usrptr);
+}
+
+static void ActivateMulti(void)
+{
+	const struct crypt_pbkdf_type argon2 = {
+		.type = CRYPT_KDF_ARGON2ID,
+		.hash = "sha256",
+		.parallel_threads = 1,
+		.max_memory_kb = 33 * 1024,
+		.iterations = 4,
+		.flags = CRYPT_PBKDF_NO_BENCHMARK
+	};
+	struct crypt_device *cd2 = NULL;
+	struct crypt_activate_volume mv[2];
+	uint64_t r_payload_offset;
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(L_DEVICE_0S, r_payload_offset + 1));
+	OK_(create_dmdevice_over_loop(L_DEVICE_1S, r_payload_offset + 1));
+
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_0S));
+	crypt_set_iteration_time(cd, 1);
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, NULL, 32, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 1, NULL, 32, PASSPHRASE1, strlen(PASSPHRASE1)), 1);
+
+	OK_(crypt_init(&cd2, DMDIR L_DEVICE_1S));
+	crypt_set_iteration_time(cd2, 1);
+	OK_(crypt_format(cd2, CRYPT_LUKS2, "aes", "xts-plain64", NULL, NULL, 32, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd2, 2, NULL, 32, PASSPHRASE1, strlen(PASSPHRASE1)), 2);
+
+	// invalid parameters
+	memset(mv, 0, sizeof(mv));
+	mv[0].keyslot = CRYPT_ANY_SLOT;
+	FAIL_(crypt_activate_by_passphrase_multi(NULL, 1, PASSPHRASE, strlen(PASSPHRASE), 0, 0), "No volumes");
+	FAIL_(crypt_activate_by_passphrase_multi(mv, 0, PASSPHRASE, strlen(PASSPHRASE), 0, 0), "No volumes");
+	FAIL_(crypt_activate_by_passphrase_multi(mv, 1, PASSPHRASE, strlen(PASSPHRASE), 0, 0), "Context is required");
+	mv[0].cd = cd;
+	FAIL_(crypt_activate_by_passphrase_multi(mv, 1, NULL, 0, 0, 0), "No passphrase");
+
+	// passphrase check only
+	OK_(crypt_activate_by_passphrase_multi(mv, 1, PASSPHRASE1, strlen(PASSPHRASE1), 0, 0));
+	EQ_(mv[0].result, 1);
+	EQ_(crypt_activate_by_passphrase_multi(mv, 1, "xxx", 3, 0, 0), -EPERM);
+	EQ_(mv[0].result, -EPERM);
+
+	// more volumes, the result is set for every one
+	mv[0].name = CDEVICE_1;
+	mv[1] = (struct crypt_activate_volume) { .cd = cd2, .name = CDEVICE_2, .keyslot = CRYPT_ANY_SLOT };
+	OK_(crypt_activate_by_passphrase_multi(mv, 2, PASSPHRASE1, strlen(PASSPHRASE1), 0, 2));
+	EQ_(mv[0].result, 1);
+	EQ_(mv[1].result, 2);
+	GE_(crypt_status(cd, CDEVICE_1), CRYPT_ACTIVE);
+	GE_(crypt_status(cd2, CDEVICE_2), CRYPT_ACTIVE);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	OK_(crypt_deactivate(cd2, CDEVICE_2));
+
+	EQ_(crypt_activate_by_passphrase_multi(mv, 2, PASSPHRASE, strlen(PASSPHRASE), 0, 2), -EPERM);
+	EQ_(mv[0].result, 0);
+	EQ_(mv[1].result, -EPERM);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	EQ_(crypt_status(cd2, CDEVICE_2), CRYPT_INACTIVE);
+	CRYPT_FREE(cd);
+	CRYPT_FREE(cd2);
+
+	if (_fips_mode) {
+		printf("WARNING: Argon2 not available in FIPS mode, skipping test.\n");
+		_cleanup_dmdevices();
+		return;
+	}
+
+	// serialization flag is used also in worker threads
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_0S));
+	OK_(crypt_set_pbkdf_type(cd, &argon2));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, NULL, 32, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	OK_(crypt_init(&cd2, DMDIR L_DEVICE_1S));
+	OK_(crypt_set_pbkdf_type(cd2, &argon2));
+	OK_(crypt_format(cd2, CRYPT_LUKS2, "aes", "xts-plain64", NULL, NULL, 32, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd2, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+
+	crypt_set_debug_level(CRYPT_DEBUG_ALL);
+	crypt_set_log_callback(cd, &serialize_log_callback, NULL);
+	crypt_set_log_callback(cd2, &serialize_log_callback, NULL);
+	serialize_lock_count = 0;
+	memset(mv, 0, sizeof(mv));
+	mv[0] = (struct crypt_activate_volume) { .cd = cd, .keyslot = CRYPT_ANY_SLOT };
+	mv[1] = (struct crypt_activate_volume) { .cd = cd2, .keyslot = CRYPT_ANY_SLOT };
+	OK_(crypt_activate_by_passphrase_multi(mv, 2, PASSPHRASE, strlen(PASSPHRASE), 0, 2));
+	EQ_(serialize_lock_count, 0);
+	mv[0].flags = mv[1].flags = CRYPT_ACTIVATE_SERIALIZE_MEMORY_HARD_PBKDF;
+	OK_(crypt_activate_by_passphrase_multi(mv, 2, PASSPHRASE, strlen(PASSPHRASE), 0, 2));
+	EQ_(mv[0].result, 0);
+	EQ_(mv[1].result, 0);
+	EQ_(serialize_lock_count, 2);
+	crypt_set_debug_level(_debug ? CRYPT_DEBUG_JSON : CRYPT_DEBUG_NONE);
+	CRYPT_FREE(cd);
+	CRYPT_FREE(cd2);
+
+	_cleanup_dmdevices();
+}
+
+static int token_load_attempts;
+
+static void token_load_log_callback(int level, const char *msg, void *usrptr)
+{
+	if (level == CRYPT_LOG_DEBUG && strstr(msg, "Trying to load libcryptsetup-token-missingtest.so"))
+		token_load_attempts++;
+	global_log_callback(level, msg, usrptr);
+}
+
+static void TokensMissingPlugin(void)
+{
+#if USE_EXTERNAL_TOKENS
+	uint64_t r_payload_offset;
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(L_DEVICE_1S, r_payload_offset + 1));
+
+	/* load attempts are visible only in debug messages */
+	crypt_set_debug_level(CRYPT_DEBUG_ALL);
+	OK_(crypt_token_unload_external(NULL));
+	token_load_attempts = 0;
+
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_1S));
+	crypt_set_log_callback(cd, &token_load_log_callback, NULL);
+	crypt_set_iteration_time(cd, 1);
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, NULL, 32, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(crypt_token_json_set(cd, 0, "{\"type\":\"missingtest\",\"keyslots\":[\"0\"]}"), 0);
+	EQ_(crypt_token_status(cd, 0, NULL), CRYPT_TOKEN_EXTERNAL_UNKNOWN);
+	EQ_(token_load_attempts, 1);
+
+	/* missing plugin is remembered, not searched for again */
+	EQ_(crypt_activate_by_token(cd, NULL, 0, NULL, 0), -ENOENT);
+	EQ_(crypt_activate_by_token(cd, NULL, CRYPT_ANY_TOKEN, NULL, 0), -ENOENT);
+	EQ_(crypt_token_status(cd, 0, NULL), CRYPT_TOKEN_EXTERNAL_UNKNOWN);
+	EQ_(token_load_attempts, 1);
+	CRYPT_FREE(cd);
+
+	/* the cache is shared by contexts */
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_1S));
+	crypt_set_log_callback(cd, &token_load_log_callback, NULL);
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	EQ_(crypt_activate_by_token(cd, NULL, 0, NULL, 0), -ENOENT);
+	EQ_(token_load_attempts, 1);
+
+	/* unloading all handlers allows plugins installed meanwhile */
+	OK_(crypt_token_unload_external(NULL));
+	EQ_(crypt_activate_by_token(cd, NULL, 0, NULL, 0), -ENOENT);
+	EQ_(token_load_attempts, 2);
+	CRYPT_FREE(cd);
+
+	crypt_set_debug_level(_debug ? CRYPT_DEBUG_JSON : CRYPT_DEBUG_NONE);
+	_cleanup_dmdevices();
+#else
+	printf("WARNING: cryptsetup compiled with external tokens disabled, skipping test.\n");
+#endif
+}
+
+static void TokensAsync(void)
+{
+#if USE_EXTERNAL_TOKENS
+#define ASYNC_TOKEN_JSON(x) "{\"type\":\"asynctest\",\"keyslots\":[" x "]}"
+	const char *cipher = "aes";
+	const char *cipher_mode = "xts-plain64";
+	uint64_t r_payload_offset;
+	int *cancelled;
+	void *h;
+
+	/* test plugin built in tests, found through LD_LIBRARY_PATH */
+	h = dlopen("libcryptsetup-token-asynctest.so", RTLD_LAZY);
+	if (!h) {
+		printf("WARNING: asynchronous token test plugin not available, skipping test.\n");
+		return;
+	}
+	cancelled = dlsym(h, "cryptsetup_token_test_cancelled");
+	NOTNULL_(cancelled);
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(L_DEVICE_1S, r_payload_offset + 1));
+
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_1S));
+	crypt_set_iteration_time(cd, 1);
+	OK_(crypt_format(cd, CRYPT_LUKS2, cipher, cipher_mode, NULL, NULL, 32, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(crypt_token_json_set(cd, 0, ASYNC_TOKEN_JSON("\"0\"")), 0);
+	EQ_(crypt_token_json_set(cd, 1, ASYNC_TOKEN_JSON("\"0\"")), 1);
+
+	/* token 0 answers in two chunks, finish is called again after -EAGAIN */
+	EQ_(crypt_activate_by_token(cd, NULL, 0, NULL, 0), 0);
+	OK_(crypt_token_open_timeout(cd, 1000));
+	EQ_(crypt_activate_by_token(cd, NULL, 0, NULL, 0), 0);
+	EQ_(*cancelled, 0);
+
+	/* token 1 never answers, open is cancelled at timeout */
+	OK_(crypt_token_open_timeout(cd, 200));
+	EQ_(crypt_activate_by_token(cd, NULL, 1, NULL, 0), -ETIMEDOUT);
+	EQ_(*cancelled, 1);
+
+	/* concurrent open, token 0 wins */
+	OK_(crypt_token_concurrent_open(cd, 1000));
+	EQ_(crypt_activate_by_token(cd, CDEVICE_1, CRYPT_ANY_TOKEN, NULL, 0), 0);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	OK_(crypt_token_concurrent_open(cd, 0));
+	OK_(crypt_token_open_timeout(cd, 0));
+	CRYPT_FREE(cd);
+
+	dlclose(h);
+	_cleanup_dmdevices();
+#undef ASYNC_TOKEN_JSON
+#else
+	printf("WARNING: cryptsetup compiled with external tokens disabled, skipping test.\n");
+#endif
+}
+
 static void LuksConvert(void)
 {
 	uint64_t offset, r_payload_offset;
@@ -2783,6 +3510,170 @@ static void Pbkdf(void)
 	_cleanup_dmdevices();
 }
 
+/* keep cache key of PBKDF type written by library, replace cached values */
+static int pbkdf_cache_rewrite(const char *type, uint32_t iterations, uint32_t memory_kb)
+{
+	char line[1024], *c = NULL;
+	FILE *f;
+
+	if (!(f = fopen(PBKDF_CACHE_FILE, "r")))
+		return -EINVAL;
+	while (!c && fgets(line, sizeof(line), f))
+		if (!strncmp(line, type, strlen(type)) && line[strlen(type)] == ':')
+			c = strchr(line, ' ');
+	fclose(f);
+	if (!c)
+		return -EINVAL;
+	*c = '\0';
+
+	if (!(f = fopen(PBKDF_CACHE_FILE, "w")))
+		return -EINVAL;
+	fprintf(f, "%s 1 %u %u\n", line, iterations, memory_kb);
+
+	return fclose(f) ? -EINVAL : 0;
+}
+
+static void PbkdfCache(void)
+{
+	char path[4096];
+	struct crypt_pbkdf_type pbkdf, argon2 = {
+		.type = CRYPT_KDF_ARGON2I,
+		.hash = DEFAULT_LUKS1_HASH,
+		.time_ms = 6,
+		.max_memory_kb = 1024,
+		.parallel_threads = 1
+	};
+	uint64_t r_payload_offset;
+
+	/* Only PBKDF2 is allowed in FIPS, these tests cannot be run. */
+	if (_fips_mode)
+		return;
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(L_DEVICE_OK, r_payload_offset + 1));
+	OK_(!getcwd(path, sizeof(path) - sizeof(PBKDF_CACHE_FILE) - 1));
+	strcat(path, "/" PBKDF_CACHE_FILE);
+	remove(PBKDF_CACHE_FILE);
+
+	FAIL_(crypt_pbkdf_cache(NULL, PBKDF_CACHE_FILE, 0), "Relative path.");
+	OK_(crypt_pbkdf_cache(NULL, path, 0));
+
+	/* benchmark result is stored */
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_set_pbkdf_type(cd, &argon2));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, NULL, 32, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	CRYPT_FREE(cd);
+
+	/* valid cached entry is used instead of benchmark */
+	OK_(pbkdf_cache_rewrite(CRYPT_KDF_ARGON2I, 5, 512));
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	OK_(crypt_set_pbkdf_type(cd, &argon2));
+	EQ_(crypt_keyslot_add_by_passphrase(cd, 1, PASSPHRASE, strlen(PASSPHRASE), PASSPHRASE, strlen(PASSPHRASE)), 1);
+	OK_(crypt_keyslot_get_pbkdf(cd, 1, &pbkdf));
+	EQ_(pbkdf.iterations, 5);
+	EQ_(pbkdf.max_memory_kb, 512);
+	CRYPT_FREE(cd);
+
+	/* bogus entry (below minimal iterations, over requested memory) is ignored */
+	OK_(pbkdf_cache_rewrite(CRYPT_KDF_ARGON2I, 1, 1024 * 1024));
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	OK_(crypt_set_pbkdf_type(cd, &argon2));
+	EQ_(crypt_keyslot_add_by_passphrase(cd, 2, PASSPHRASE, strlen(PASSPHRASE), PASSPHRASE, strlen(PASSPHRASE)), 2);
+	OK_(crypt_keyslot_get_pbkdf(cd, 2, &pbkdf));
+	GE_(pbkdf.iterations, 4);
+	GE_(argon2.max_memory_kb, pbkdf.max_memory_kb);
+	CRYPT_FREE(cd);
+
+	OK_(crypt_pbkdf_cache(NULL, NULL, 0));
+	remove(PBKDF_CACHE_FILE);
+	_cleanup_dmdevices();
+}
+
+static int digest_cache_hits;
+
+static void digest_cache_log_callback(int level, const char *msg, void *usrptr)
+{
+	if (level == CRYPT_LOG_DEBUG && strstr(msg, "verified from cache"))
+		digest_cache_hits++;
+	global_log_callback(level, msg, usrptr);
+}
+
+static void Luks2DigestCache(void)
+{
+	const char *mk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	const char *mk_hex2 = "bb22158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(mk_hex) / 2;
+	char key[128], key2[128];
+	uint64_t r_payload_offset;
+
+	crypt_decode_key(key, mk_hex, key_size);
+	crypt_decode_key(key2, mk_hex2, key_size);
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(L_DEVICE_OK, r_payload_offset + 1));
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, NULL));
+	CRYPT_FREE(cd);
+
+	/* cache hits are visible only in debug messages */
+	crypt_set_debug_level(CRYPT_DEBUG_ALL);
+	OK_(crypt_digest_cache(NULL, 1));
+	digest_cache_hits = 0;
+
+	/* first verification fills the cache, the second one is a hit */
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	crypt_set_log_callback(cd, &digest_cache_log_callback, NULL);
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	OK_(crypt_volume_key_verify(cd, key, key_size));
+	EQ_(digest_cache_hits, 0);
+	CRYPT_FREE(cd);
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	crypt_set_log_callback(cd, &digest_cache_log_callback, NULL);
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	OK_(crypt_volume_key_verify(cd, key, key_size));
+	EQ_(digest_cache_hits, 1);
+
+	/* wrong key is a miss */
+	FAIL_(crypt_volume_key_verify(cd, key2, key_size), "Wrong volume key");
+	EQ_(digest_cache_hits, 1);
+	CRYPT_FREE(cd);
+
+	/* changed digest (same volume key, new digest salt) is a miss */
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	crypt_set_log_callback(cd, &digest_cache_log_callback, NULL);
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, NULL));
+	OK_(crypt_volume_key_verify(cd, key, key_size));
+	EQ_(digest_cache_hits, 1);
+	OK_(crypt_volume_key_verify(cd, key, key_size));
+	EQ_(digest_cache_hits, 2);
+	CRYPT_FREE(cd);
+
+	/* new volume key, previously cached key no longer verifies */
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	crypt_set_log_callback(cd, &digest_cache_log_callback, NULL);
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key2, key_size, NULL));
+	FAIL_(crypt_volume_key_verify(cd, key, key_size), "Volume key changed");
+	EQ_(digest_cache_hits, 2);
+	OK_(crypt_volume_key_verify(cd, key2, key_size));
+	EQ_(digest_cache_hits, 2);
+	CRYPT_FREE(cd);
+
+	/* disabled cache is flushed */
+	OK_(crypt_digest_cache(NULL, 0));
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	crypt_set_log_callback(cd, &digest_cache_log_callback, NULL);
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	OK_(crypt_volume_key_verify(cd, key2, key_size));
+	EQ_(digest_cache_hits, 2);
+	CRYPT_FREE(cd);
+
+	crypt_set_debug_level(_debug ? CRYPT_DEBUG_JSON : CRYPT_DEBUG_NONE);
+	_cleanup_dmdevices();
+}
+
 static void Luks2KeyslotAdd(void)
 {
 	char key[128], key2[128], key_ret[128];
@@ -2790,7 +3681,8 @@ static void Luks2KeyslotAdd(void)
 	const char *mk_hex =  "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
 	const char *mk_hex2 = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1e";
 	size_t key_ret_len, key_size = strlen(mk_hex) / 2;
-	uint64_t r_payload_offset;
+	uint64_t r_payload_offset, areas[6], offset, dummy, gap;
+	int i, moved;
 	struct crypt_pbkdf_type pbkdf = {
 		.type = "argon2i",
 		.hash = "sha256",
@@ -2916,6 +3808,31 @@ static void Luks2KeyslotAdd(void)
 	EQ_(crypt_activate_by_passphrase(cd, CDEVICE_1, 5, PASSPHRASE1, strlen(PASSPHRASE1), 0), 5);
 	OK_(crypt_deactivate(cd, CDEVICE_1));
 
+	/* keyslot areas compaction, the gap after keyslot 0 gets filled */
+	OK_(crypt_keyslot_destroy(cd, 0));
+	for (i = 1; i < 6; i++)
+		OK_(crypt_keyslot_area(cd, i, &areas[i], &dummy));
+	gap = _keyslot_areas_max_gap(cd);
+	GE_(crypt_keyslot_areas_compact(cd), 1);
+	EQ_(crypt_keyslot_areas_compact(cd), 0);
+	for (i = 1, moved = 0; i < 6; i++) {
+		OK_(crypt_keyslot_area(cd, i, &offset, &dummy));
+		GE_(areas[i], offset);
+		if (offset < areas[i])
+			moved++;
+	}
+	GE_(moved, 1);
+	GE_(_keyslot_areas_max_gap(cd), gap + 1);
+	CRYPT_FREE(cd);
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	EQ_(crypt_activate_by_passphrase(cd, CDEVICE_1, 5, PASSPHRASE1, strlen(PASSPHRASE1), 0), 5);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	EQ_(crypt_activate_by_passphrase(cd, NULL, 1, PASSPHRASE1, strlen(PASSPHRASE1), CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY), 1);
+	EQ_(crypt_activate_by_passphrase(cd, NULL, 2, PASSPHRASE1, strlen(PASSPHRASE1), CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY), 2);
+	EQ_(crypt_activate_by_passphrase(cd, NULL, 3, PASSPHRASE1, strlen(PASSPHRASE1), CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY), 3);
+	EQ_(crypt_activate_by_passphrase(cd, NULL, 4, PASSPHRASE1, strlen(PASSPHRASE1), CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY), 4);
+
 	CRYPT_FREE(cd);
 
 	_cleanup_dmdevices();
@@ -3069,6 +3986,8 @@ static void Luks2ActivateByKeyring(void)
 
 	key_serial_t kid, kid1;
 	uint64_t r_payload_offset;
+	char key[32];
+	size_t key_size = sizeof(key);
 
 	const char *cipher = "aes";
 	const char *cipher_mode = "xts-plain64";
@@ -3126,6 +4045,21 @@ static void Luks2ActivateByKeyring(void)
 	FAIL_(crypt_activate_by_keyring(cd, CDEVICE_1, KEY_DESC_TEST0, CRYPT_ANY_SLOT, 0), "no such key in keyring");
 	FAIL_(crypt_activate_by_keyring(cd, CDEVICE_1, KEY_DESC_TEST1, 2, 0), "no such key in keyring");
 	FAIL_(crypt_activate_by_keyring(cd, NULL, KEY_DESC_TEST1, 1, 0), "no such key in keyring");
+	FAIL_(crypt_activate_by_keyring_volume_key(cd, NULL, KEY_DESC_TEST0, 0), "no such key in keyring");
+
+	// activate by volume key in keyring skips keyslots
+	EQ_(crypt_volume_key_get(cd, CRYPT_ANY_SLOT, key, &key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	kid = add_key("user", KEY_DESC_TEST0, key, key_size, KEY_SPEC_THREAD_KEYRING);
+	NOTFAIL_(kid, "Test or kernel keyring are broken.");
+	OK_(crypt_activate_by_keyring_volume_key(cd, NULL, KEY_DESC_TEST0, 0));
+	OK_(crypt_activate_by_keyring_volume_key(cd, CDEVICE_1, KEY_DESC_TEST0, 0));
+	GE_(crypt_status(cd, CDEVICE_1), CRYPT_ACTIVE);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	NOTFAIL_(keyctl_unlink(kid, KEY_SPEC_THREAD_KEYRING), "Test or kernel keyring are broken.");
+	kid = add_key("user", KEY_DESC_TEST0, PASSPHRASE, strlen(PASSPHRASE), KEY_SPEC_THREAD_KEYRING);
+	NOTFAIL_(kid, "Test or kernel keyring are broken.");
+	FAIL_(crypt_activate_by_keyring_volume_key(cd, NULL, KEY_DESC_TEST0, 0), "not a volume key");
+	NOTFAIL_(keyctl_unlink(kid, KEY_SPEC_THREAD_KEYRING), "Test or kernel keyring are broken.");
 	CRYPT_FREE(cd);
 	_cleanup_dmdevices();
 #else
@@ -3314,6 +4248,10 @@ static void Luks2Requirements(void)
 	FAIL_((r = crypt_keyslot_set_priority(cd, 0, CRYPT_SLOT_PRIORITY_PREFER)), "Unmet requirements detected");
 	EQ_(r, -ETXTBSY);
 
+	/* crypt_keyslot_areas_compact (restricted) */
+	FAIL_((r = crypt_keyslot_areas_compact(cd)), "Unmet requirements detected");
+	EQ_(r, -ETXTBSY);
+
 	/* crypt_keyslot_area (unrestricted) */
 	OK_(crypt_keyslot_area(cd, 0, &dummy, &dummy));
 	OK_(!dummy);
@@ -3748,6 +4686,7 @@ static void Luks2Reencryption(void)
 		.hash = "sha1",
 		.luks2 = &params2,
 	};
+	struct crypt_reencrypt_stats rstats = { .struct_size = sizeof(rstats) };
 
 	const char *mk_hex = "bb21babe733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
 	size_t key_size = strlen(mk_hex) / 2;
@@ -3788,6 +4727,11 @@ static void Luks2Reencryption(void)
 	FAIL_(crypt_reencrypt_init_by_passphrase(cd, NULL, PASSPHRASE, strlen(PASSPHRASE), 21, 10, "tHeHamstErciphErr", "xts-plain64", &rparams), "Wrong cipher.");
 	FAIL_(crypt_reencrypt_init_by_passphrase(cd, NULL, PASSPHRASE, strlen(PASSPHRASE), 21, 10, "aes", "HamSterMoOode-plain64", &rparams), "Wrong mode.");
 
+	/* crc32c checksums must be allowed explicitly */
+	rparams.hash = "crc32c";
+	FAIL_(crypt_reencrypt_init_by_passphrase(cd, NULL, PASSPHRASE, strlen(PASSPHRASE), 21, 9, "aes", "xts-plain64", &rparams), "crc32c not allowed.");
+	rparams.hash = "sha1";
+
 	/* test reencryption flags */
 	rparams.flags = CRYPT_REENCRYPT_RESUME_ONLY;
 	FAIL_(crypt_reencrypt_init_by_passphrase(cd, NULL, PASSPHRASE, strlen(PASSPHRASE), 21, 9, "aes", "xts-plain64", &rparams), "Reencryption not initialized.");
@@ -3797,6 +4741,8 @@ static void Luks2Reencryption(void)
 	OK_(crypt_persistent_flags_get(cd, CRYPT_FLAGS_REQUIREMENTS, &getflags));
 	EQ_(getflags & CRYPT_REQUIREMENT_ONLINE_REENCRYPT, 0);
 	FAIL_(crypt_reencrypt(cd, NULL, NULL), "Reencryption context not initialized.");
+	FAIL_(crypt_reencrypt_set_rate_limit(cd, 1024 * 1024, 0), "Reencryption context not initialized.");
+	FAIL_(crypt_reencrypt_get_stats(cd, &rstats), "Reencryption context not initialized.");
 
 	rparams.flags &= ~CRYPT_REENCRYPT_RESUME_ONLY;
 	OK_(crypt_reencrypt_init_by_passphrase(cd, NULL, PASSPHRASE, strlen(PASSPHRASE), 21, 9, "aes", "xts-plain64", &rparams));
@@ -3829,6 +4775,14 @@ static void Luks2Reencryption(void)
 
 	rparams.flags = 0;
 	OK_(crypt_reencrypt_init_by_passphrase(cd, NULL, PASSPHRASE, strlen(PASSPHRASE), 21, 9, "aes", "xts-plain64", &rparams));
+	OK_(crypt_reencrypt_set_rate_limit(cd, 64 * 1024 * 1024, 1000));
+	OK_(crypt_reencrypt_get_stats(cd, &rstats));
+	EQ_(rstats.hotzones, 0);
+	EQ_(rstats.write_bytes, 0);
+	EQ_(rstats.struct_size, sizeof(rstats));
+	rstats.struct_size = 0;
+	FAIL_(crypt_reencrypt_get_stats(cd, &rstats), "Stats size not set.");
+	rstats.struct_size = sizeof(rstats);
 	OK_(crypt_reencrypt(cd, NULL, NULL));
 
 	/* check keyslots are reassigned to segment after reencryption */
@@ -4428,13 +5382,164 @@ static void Luks2Reencryption(void)
 #endif
 }
 
+static int async_poll_done(struct crypt_async *job, struct crypt_async_status *st)
+{
+	struct pollfd pfd = { .fd = crypt_async_fd(job), .events = POLLIN };
+	int updates = 0;
+
+	do {
+		if (poll(&pfd, 1, 10000) < 0 || crypt_async_status(job, st))
+			return -EINVAL;
+		updates++;
+	} while (!st->done);
+
+	return updates;
+}
+
+static void Luks2Async(void)
+{
+	uint64_t r_header_size;
+	struct crypt_async *job;
+	struct crypt_async_status st;
+	struct crypt_pbkdf_type pbkdf = {
+		.type = CRYPT_KDF_ARGON2I,
+		.hash = "sha256",
+		.parallel_threads = 1,
+		.max_memory_kb = 128,
+		.iterations = 4,
+		.flags = CRYPT_PBKDF_NO_BENCHMARK
+	};
+	struct crypt_params_luks2 params2 = {
+		.pbkdf = &pbkdf,
+		.sector_size = 512
+	};
+#if KERNEL_KEYRING
+	struct pollfd pfd = { .events = POLLIN };
+	struct crypt_params_reencrypt rparams = {
+		.mode = CRYPT_REENCRYPT_REENCRYPT,
+		.direction = CRYPT_REENCRYPT_FORWARD,
+		.resilience = "checksum",
+		.hash = "sha256",
+		.max_hotzone_size = 8,
+		.luks2 = &params2,
+	};
+#endif
+
+	/* Cannot use Argon2 in FIPS */
+	if (_fips_mode) {
+		pbkdf.type = CRYPT_KDF_PBKDF2;
+		pbkdf.parallel_threads = 0;
+		pbkdf.max_memory_kb = 0;
+		pbkdf.iterations = 1000;
+	}
+
+	OK_(get_luks2_offsets(1, 0, 0, &r_header_size, NULL));
+	OK_(create_dmdevice_over_loop(L_DEVICE_OK, r_header_size + 16384));
+
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_set_pbkdf_type(cd, &pbkdf));
+
+	/* format in worker thread, cannot be cancelled */
+	OK_(crypt_async_format(&job, cd, CRYPT_LUKS2, "aes", "cbc-essiv:sha256", NULL, NULL, 32, &params2));
+	EQ_(crypt_async_cancel(job), -ENOTSUP);
+	OK_(crypt_async_wait(job));
+	memset(&st, 0, sizeof(st));
+	FAIL_(crypt_async_status(job, &st), "Status size not set.");
+	st.struct_size = sizeof(st);
+	OK_(crypt_async_status(job, &st));
+	EQ_(st.done, 1);
+	EQ_(st.result, 0);
+	EQ_(crypt_async_cancel(job), -ENOTSUP);
+	crypt_async_free(job);
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+
+	/* passphrase check in worker thread */
+	OK_(crypt_async_activate_by_passphrase(&job, cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0));
+	EQ_(crypt_async_wait(job), 0);
+	crypt_async_free(job);
+	OK_(crypt_async_activate_by_passphrase(&job, cd, NULL, CRYPT_ANY_SLOT, "bad", 3, 0));
+	EQ_(crypt_async_wait(job), -EPERM);
+	EQ_(crypt_async_wait(job), -EPERM);
+	crypt_async_free(job);
+
+	/* wipe of data area, poll status until finished */
+	OK_(crypt_async_wipe(&job, cd, NULL, CRYPT_WIPE_RANDOM, crypt_get_data_offset(cd) * 512, 1024 * 1024, 64 * 1024, 0));
+	GE_(async_poll_done(job, &st), 1);
+	EQ_(st.result, 0);
+	EQ_(st.offset, st.size);
+	EQ_(crypt_async_cancel(job), -EALREADY);
+	OK_(crypt_async_wait(job));
+	crypt_async_free(job);
+
+	/* cancelled wipe finishes with an error */
+	OK_(crypt_async_wipe(&job, cd, NULL, CRYPT_WIPE_RANDOM, crypt_get_data_offset(cd) * 512, 0, 512, 0));
+	OK_(crypt_async_cancel(job));
+	GE_(async_poll_done(job, &st), 1);
+	FAIL_(st.result, "Wipe cancelled.");
+	EQ_(crypt_async_wait(job), st.result);
+	crypt_async_free(job);
+
+	/* freeing running wipe cancels it */
+	OK_(crypt_async_wipe(&job, cd, NULL, CRYPT_WIPE_RANDOM, crypt_get_data_offset(cd) * 512, 0, 512, 0));
+	crypt_async_free(job);
+
+/* reencryption currently depends on kernel keyring support */
+#if KERNEL_KEYRING
+	if (!t_dm_crypt_keyring_support()) {
+		CRYPT_FREE(cd);
+		_cleanup_dmdevices();
+		return;
+	}
+
+	EQ_(crypt_keyslot_add_by_key(cd, 1, NULL, 64, PASSPHRASE, strlen(PASSPHRASE), CRYPT_VOLUME_KEY_NO_SEGMENT), 1);
+	OK_(crypt_reencrypt_init_by_passphrase(cd, NULL, PASSPHRASE, strlen(PASSPHRASE), 0, 1, "aes", "xts-plain64", &rparams));
+
+	/* slow reencryption down so it is still running when cancelled */
+	OK_(crypt_reencrypt_set_rate_limit(cd, 64 * 1024, 0));
+	OK_(crypt_async_reencrypt(&job, cd));
+	pfd.fd = crypt_async_fd(job);
+	do {
+		GE_(poll(&pfd, 1, 10000), 0);
+		OK_(crypt_async_status(job, &st));
+	} while (!st.done && !st.offset);
+	EQ_(st.done, 0);
+	OK_(crypt_async_cancel(job));
+	GE_(async_poll_done(job, &st), 1);
+	/* interrupted reencryption can be resumed */
+	EQ_(st.result, 0);
+	GE_(st.size, st.offset + 1);
+	crypt_async_free(job);
+	EQ_(crypt_reencrypt_status(cd, NULL), CRYPT_REENCRYPT_CLEAN);
+
+	rparams.flags = CRYPT_REENCRYPT_RESUME_ONLY;
+	rparams.max_hotzone_size = 0;
+	OK_(crypt_reencrypt_init_by_passphrase(cd, NULL, PASSPHRASE, strlen(PASSPHRASE), 0, 1, "aes", "xts-plain64", &rparams));
+	OK_(crypt_async_reencrypt(&job, cd));
+	GE_(async_poll_done(job, &st), 1);
+	EQ_(st.result, 0);
+	EQ_(st.offset, st.size);
+	GE_(st.reencrypt_stats.hotzones, 1);
+	EQ_(st.reencrypt_stats.struct_size, sizeof(st.reencrypt_stats));
+	EQ_(crypt_async_cancel(job), -EALREADY);
+	OK_(crypt_async_wait(job));
+	crypt_async_free(job);
+	EQ_(crypt_reencrypt_status(cd, NULL), CRYPT_REENCRYPT_NONE);
+	EQ_(crypt_get_volume_key_size(cd), 64);
+#endif
+	CRYPT_FREE(cd);
+	_cleanup_dmdevices();
+}
+
 static void Luks2Repair(void)
 {
-	char rollback[256];
+	char rollback[256], wipe_label[256];
 
 	snprintf(rollback, sizeof(rollback),
 		 "dd if=" IMAGE_PV_LUKS2_SEC ".bcp of=%s bs=1M 2>/dev/null",
 		 DEVICE_6);
+	snprintf(wipe_label, sizeof(wipe_label),
+		 "dd if=/dev/zero of=%s bs=512 seek=1 count=1 2>/dev/null",
+		 DEVICE_6);
 
 	OK_(crypt_init(&cd, DEVICE_6));
 
@@ -4456,6 +5561,17 @@ static void Luks2Repair(void)
 	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
 	CRYPT_FREE(cd);
 
+	/* auto-recovery without foreign signature must not skip later blkid probe */
+	OK_(_system(rollback, 1));
+	OK_(_system(wipe_label, 1));
+	OK_(crypt_init(&cd, DEVICE_6));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	CRYPT_FREE(cd);
+	OK_(_system(rollback, 1));
+	OK_(crypt_init(&cd, DEVICE_6));
+	FAIL_(crypt_load(cd, CRYPT_LUKS, NULL), "Ambiguous signature detected");
+	CRYPT_FREE(cd);
+
 	/* repeat with locking disabled (must not have any effect) */
 	OK_(_system(rollback, 1));
 	OK_(crypt_init(&cd, DEVICE_6));
@@ -4525,16 +5641,25 @@ int main(int argc, char *argv[])
 	RUN_(AddDeviceLuks2, "Format and use LUKS2 device");
 	RUN_(Luks2MetadataSize, "LUKS2 metadata settings");
 	RUN_(Luks2HeaderLoad, "LUKS2 header load");
+	RUN_(Luks2HeaderCache, "LUKS2 header cache");
 	RUN_(Luks2HeaderRestore, "LUKS2 header restore");
 	RUN_(Luks2HeaderBackup, "LUKS2 header backup");
 	RUN_(ResizeDeviceLuks2, "LUKS2 device resize tests");
 	RUN_(UseLuks2Device, "Use pre-formated LUKS2 device");
 	RUN_(SuspendDevice, "LUKS2 Suspend/Resume");
 	RUN_(UseTempVolumes, "Format and use temporary encrypted device");
+	RUN_(NumaNode, "NUMA placement of parallel workers");
 	RUN_(Tokens, "General tokens API");
+	RUN_(TokenKeyslotHint, "Keyslot hints for token activation");
+	RUN_(TokensMissingPlugin, "Missing external token plugin");
+	RUN_(ActivateMulti, "Parallel activation of more devices");
+	RUN_(LocklessHeaderRead, "Lockless LUKS2 header read");
+	RUN_(TokensAsync, "Asynchronous external token API");
 	RUN_(TokenActivationByKeyring, "Builtin kernel keyring token");
 	RUN_(LuksConvert, "LUKS1 <-> LUKS2 conversions");
 	RUN_(Pbkdf, "Default PBKDF manipulation routines");
+	RUN_(PbkdfCache, "Persistent PBKDF benchmark cache");
+	RUN_(Luks2DigestCache, "LUKS2 volume key digest cache");
 	RUN_(Luks2KeyslotParams, "Add a new keyslot with different encryption");
 	RUN_(Luks2KeyslotAdd, "Add a new keyslot by unused key");
 	RUN_(Luks2ActivateByKeyring, "LUKS2 activation by passphrase in keyring");
@@ -4543,6 +5668,7 @@ int main(int argc, char *argv[])
 	RUN_(Luks2Refresh, "Active device table refresh");
 	RUN_(Luks2Flags, "LUKS2 persistent flags");
 	RUN_(Luks2Reencryption, "LUKS2 reencryption");
+	RUN_(Luks2Async, "Asynchronous operations");
 	RUN_(Luks2Repair, "LUKS2 repair"); // test disables metadata locking. Run always last!
 
 	_cleanup();
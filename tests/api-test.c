@@ -680,8 +680,9 @@ static void UseLuksDevice(void)
 static void SuspendDevice(void)
 {
 	struct crypt_active_device cad;
+	struct crypt_active_device_entry *entries;
 	char key[128];
-	size_t key_size;
+	size_t key_size, entries_count, i;
 	int suspend_status;
 	uint64_t r_payload_offset;
 	const struct crypt_pbkdf_type fast_pbkdf = {
@@ -707,6 +708,17 @@ static void SuspendDevice(void)
 	OK_(crypt_get_active_device(cd, CDEVICE_1, &cad));
 	EQ_(CRYPT_ACTIVATE_SUSPENDED, cad.flags & CRYPT_ACTIVATE_SUSPENDED);
 
+	OK_(crypt_list_active_devices(NULL, &entries, &entries_count));
+	for (i = 0; i < entries_count; i++)
+		if (!strcmp(entries[i].name, CDEVICE_1))
+			break;
+	OK_(i == entries_count);
+	OK_(strcmp(entries[i].type, CRYPT_LUKS1));
+	EQ_(entries[i].status, CRYPT_ACTIVE);
+	EQ_(entries[i].info.size, cad.size);
+	EQ_(CRYPT_ACTIVATE_SUSPENDED, entries[i].info.flags & CRYPT_ACTIVATE_SUSPENDED);
+	crypt_free_active_devices(entries, entries_count);
+
 	FAIL_(crypt_suspend(cd, CDEVICE_1), "already suspended");
 
 	FAIL_(crypt_resume_by_passphrase(cd, CDEVICE_1, CRYPT_ANY_SLOT, KEY1, strlen(KEY1)-1), "wrong key");
@@ -1491,6 +1503,11 @@ static void HashDevicePlain(void)
 	const char *mk_hex, *keystr;
 	char key[256];
 
+	// only secrets are locked, no mlockall
+	FAIL_(crypt_set_memory_lock_policy(-1), "invalid policy");
+	OK_(crypt_set_memory_lock_policy(CRYPT_MEMORY_LOCK_SECRETS));
+	EQ_(crypt_memory_lock(NULL, 1), 1);
+
 	OK_(crypt_init(&cd, DEVICE_1));
 	OK_(crypt_format(cd, CRYPT_PLAIN, "aes", "cbc-essiv:sha256", NULL, NULL, 16, &params));
 
@@ -1539,6 +1556,9 @@ static void HashDevicePlain(void)
 	OK_(crypt_deactivate(cd, CDEVICE_1));
 	CRYPT_FREE(cd);
 
+	EQ_(crypt_memory_lock(NULL, 0), 0);
+	OK_(crypt_set_memory_lock_policy(CRYPT_MEMORY_LOCK_ALL));
+
 	_remove_keyfiles();
 
 	// Handling of legacy "plain" hash (no hash)
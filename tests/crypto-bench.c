@@ -0,0 +1,406 @@
+/*
+ * cryptsetup crypto backend and internal primitives micro-benchmark
+ *
+ * Copyright (C) 2021 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Measured are primitives the library uses internally: hash, HMAC, PBKDF2,
+ * crypt_storage and crypt_storage_wrapper (userspace crypto over a temporary
+ * file), LUKS1 AF split and merge, base64 (LUKS2 JSON), crc32, crc32c
+ * and RS encoding (verity FEC).
+ *
+ * Output is CSV (one line per measurement):
+ *   backend,primitive,algorithm,param,buffer_size,ops_per_sec,mb_per_sec
+ * Numbers are not comparable between machines, only between builds
+ * (crypto backends, configure options) on the same machine.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "internal.h"
+#include "base64.h"
+#include "luks1/af.h"
+#include "verity/rs.h"
+
+#ifndef ARRAY_SIZE
+# define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+#endif
+
+#define BENCH_BUFFER_MAX (1024 * 1024)
+
+static unsigned bench_ms = 200;
+static const char *backend;
+static char *buf;
+
+struct bench_ctx {
+	const char *alg;
+	size_t param;
+	size_t length;
+	void *priv;
+};
+
+typedef int (*bench_fn)(struct bench_ctx *ctx);
+
+static double time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Run fn repeatedly until bench_ms elapsed, print one CSV line */
+static int bench_run(const char *primitive, bench_fn fn, struct bench_ctx *ctx)
+{
+	double start, elapsed;
+	unsigned long ops = 0;
+	int r;
+
+	start = time_ms();
+	do {
+		r = fn(ctx);
+		if (r) {
+			printf("%s,%s,%s,%zu,%zu,error,%d\n", backend, primitive,
+			       ctx->alg ?: "-", ctx->param, ctx->length, r);
+			return r;
+		}
+		ops++;
+		elapsed = time_ms() - start;
+	} while (elapsed < bench_ms);
+
+	printf("%s,%s,%s,%zu,%zu,%.1f,%.2f\n", backend, primitive, ctx->alg ?: "-",
+	       ctx->param, ctx->length, ops * 1000.0 / elapsed,
+	       (double)ops * ctx->length * 1000.0 / elapsed / (1024 * 1024));
+	return 0;
+}
+
+static int bench_hash(struct bench_ctx *ctx)
+{
+	struct crypt_hash *h;
+	char digest[64];
+	int r;
+
+	if (crypt_hash_init(&h, ctx->alg))
+		return -EINVAL;
+
+	r = crypt_hash_write(h, buf, ctx->length);
+	if (!r)
+		r = crypt_hash_final(h, digest, crypt_hash_size(ctx->alg));
+	crypt_hash_destroy(h);
+
+	return r;
+}
+
+static int bench_hmac(struct bench_ctx *ctx)
+{
+	struct crypt_hmac *h;
+	char digest[64];
+	int r;
+
+	if (crypt_hmac_init(&h, ctx->alg, buf, 32))
+		return -EINVAL;
+
+	r = crypt_hmac_write(h, buf, ctx->length);
+	if (!r)
+		r = crypt_hmac_final(h, digest, crypt_hmac_size(ctx->alg));
+	crypt_hmac_destroy(h);
+
+	return r;
+}
+
+static int bench_pbkdf2(struct bench_ctx *ctx)
+{
+	char key[32];
+
+	return crypt_pbkdf("pbkdf2", ctx->alg, "password", 8, buf, 32,
+			   key, sizeof(key), ctx->param, 0, 0);
+}
+
+static int bench_storage(struct bench_ctx *ctx)
+{
+	return crypt_storage_encrypt(ctx->priv, 0, ctx->length, buf);
+}
+
+static int bench_crc32(struct bench_ctx *ctx)
+{
+	volatile uint32_t crc;
+
+	crc = crypt_crc32(0xffffffff, (const unsigned char *)buf, ctx->length);
+	(void)crc;
+	return 0;
+}
+
+static int bench_crc32c(struct bench_ctx *ctx)
+{
+	volatile uint32_t crc;
+
+	crc = crypt_crc32c(0xffffffff, (const unsigned char *)buf, ctx->length);
+	(void)crc;
+	return 0;
+}
+
+/* Storage wrapper write and read of keyslot area sized chunks (temp file) */
+static int bench_wrapper_write(struct bench_ctx *ctx)
+{
+	ssize_t r = crypt_storage_wrapper_encrypt_write(ctx->priv, 0, buf, ctx->length);
+
+	return r == (ssize_t)ctx->length ? 0 : -EIO;
+}
+
+static int bench_wrapper_read(struct bench_ctx *ctx)
+{
+	ssize_t r = crypt_storage_wrapper_read_decrypt(ctx->priv, 0, buf, ctx->length);
+
+	return r == (ssize_t)ctx->length ? 0 : -EIO;
+}
+
+/* AF split of LUKS1 keyslot material (param is key size, 4000 stripes) */
+static int bench_af_split(struct bench_ctx *ctx)
+{
+	return AF_split(NULL, buf, buf + ctx->param, ctx->param, 4000, ctx->alg);
+}
+
+/* AF merge of LUKS1 keyslot material (param is key size, 4000 stripes) */
+static int bench_af_merge(struct bench_ctx *ctx)
+{
+	char key[64];
+
+	return AF_merge(NULL, buf, key, ctx->param, 4000, ctx->alg);
+}
+
+/* base64 as used for LUKS2 JSON salts and digests (buffer is binary size) */
+static int bench_base64_encode(struct bench_ctx *ctx)
+{
+	base64_encode(buf, ctx->length, ctx->priv, BASE64_LENGTH(ctx->length));
+	return 0;
+}
+
+static int bench_base64_decode(struct bench_ctx *ctx)
+{
+	size_t out_len = ctx->length;
+
+	return base64_decode(ctx->priv, BASE64_LENGTH(ctx->length), buf, &out_len) ? 0 : -EINVAL;
+}
+
+/* RS encode as used by dm-verity FEC (param is number of roots) */
+static int bench_rs_encode(struct bench_ctx *ctx)
+{
+	data_t parity[64];
+	size_t i, block = 255 - ctx->param;
+
+	for (i = 0; i + block <= ctx->length; i += block)
+		encode_rs_char(ctx->priv, (data_t *)&buf[i], parity);
+
+	return 0;
+}
+
+static const char *hashes[] = { "sha1", "sha256", "sha512", "ripemd160", "whirlpool", "blake2b-512" };
+static const size_t buffer_sizes[] = { 64, 4096, 65536, BENCH_BUFFER_MAX };
+
+static void bench_hashes(void)
+{
+	struct bench_ctx ctx = {};
+	unsigned i, j;
+
+	for (i = 0; i < ARRAY_SIZE(hashes); i++) {
+		if (crypt_hash_size(hashes[i]) <= 0)
+			continue;
+		ctx.alg = hashes[i];
+		for (j = 0; j < ARRAY_SIZE(buffer_sizes); j++) {
+			ctx.length = buffer_sizes[j];
+			if (bench_run("hash", bench_hash, &ctx))
+				break;
+		}
+		for (j = 0; j < ARRAY_SIZE(buffer_sizes); j++) {
+			ctx.length = buffer_sizes[j];
+			if (bench_run("hmac", bench_hmac, &ctx))
+				break;
+		}
+		ctx.length = 0;
+		ctx.param = 1000;
+		bench_run("pbkdf2", bench_pbkdf2, &ctx);
+		ctx.param = 0;
+	}
+}
+
+static void bench_storages(void)
+{
+	static const struct {
+		const char *cipher;
+		const char *mode;
+		size_t key_size;
+	} ciphers[] = {
+		{ "aes", "xts-plain64", 64 },
+		{ "aes", "cbc-essiv:sha256", 32 },
+		{ "aes", "ecb", 32 },
+		{ "serpent", "xts-plain64", 64 },
+		{ "twofish", "xts-plain64", 64 },
+	};
+	static const size_t sector_sizes[] = { 512, 4096 };
+	struct crypt_storage *s;
+	struct bench_ctx ctx = {};
+	char alg[64];
+	unsigned i, j, k;
+
+	for (i = 0; i < ARRAY_SIZE(ciphers); i++) {
+		snprintf(alg, sizeof(alg), "%s-%s", ciphers[i].cipher, ciphers[i].mode);
+		ctx.alg = alg;
+		for (j = 0; j < ARRAY_SIZE(sector_sizes); j++) {
+			if (crypt_storage_init(&s, sector_sizes[j], ciphers[i].cipher,
+					       ciphers[i].mode, buf, ciphers[i].key_size, false))
+				continue;
+			ctx.priv = s;
+			ctx.param = sector_sizes[j];
+			for (k = 1; k < ARRAY_SIZE(buffer_sizes); k++) {
+				ctx.length = buffer_sizes[k];
+				if (bench_run("storage", bench_storage, &ctx))
+					break;
+			}
+			crypt_storage_destroy(s);
+		}
+	}
+}
+
+/* crypt_storage_wrapper over a temporary file, userspace crypto only */
+static void bench_wrappers(void)
+{
+	static const size_t sector_sizes[] = { 512, 4096 };
+	char path[] = "/tmp/crypto-bench-XXXXXX";
+	struct crypt_storage_wrapper *cw;
+	struct device *device = NULL;
+	struct volume_key *vk;
+	struct bench_ctx ctx = { .alg = "aes-xts-plain64" };
+	unsigned j, k;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return;
+
+	vk = crypt_alloc_volume_key(64, buf);
+	if (!vk || ftruncate(fd, BENCH_BUFFER_MAX) || device_alloc(NULL, &device, path))
+		goto out;
+
+	for (j = 0; j < ARRAY_SIZE(sector_sizes); j++) {
+		if (crypt_storage_wrapper_init(NULL, &cw, device, 0, 0, sector_sizes[j],
+					       ctx.alg, vk, DISABLE_KCAPI | DISABLE_DMCRYPT))
+			continue;
+		ctx.priv = cw;
+		ctx.param = sector_sizes[j];
+		for (k = 1; k < ARRAY_SIZE(buffer_sizes); k++) {
+			ctx.length = buffer_sizes[k];
+			if (bench_run("wrapper_write", bench_wrapper_write, &ctx) ||
+			    bench_run("wrapper_read", bench_wrapper_read, &ctx))
+				break;
+		}
+		crypt_storage_wrapper_destroy(cw);
+	}
+out:
+	device_free(NULL, device);
+	crypt_free_volume_key(vk);
+	close(fd);
+	unlink(path);
+}
+
+static void bench_base64(void)
+{
+	struct bench_ctx ctx = {};
+	unsigned i;
+
+	ctx.priv = malloc(BASE64_LENGTH(BENCH_BUFFER_MAX));
+	if (!ctx.priv)
+		return;
+
+	/* decode reads what the encode benchmark of the same size produced */
+	for (i = 0; i < ARRAY_SIZE(buffer_sizes); i++) {
+		ctx.length = buffer_sizes[i];
+		bench_run("base64_encode", bench_base64_encode, &ctx);
+		bench_run("base64_decode", bench_base64_decode, &ctx);
+	}
+
+	free(ctx.priv);
+}
+
+static void bench_misc(void)
+{
+	static const size_t key_sizes[] = { 32, 64 };
+	struct bench_ctx ctx = {};
+	struct rs *rs;
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(buffer_sizes); i++) {
+		ctx.length = buffer_sizes[i];
+		bench_run("crc32", bench_crc32, &ctx);
+		bench_run("crc32c", bench_crc32c, &ctx);
+	}
+
+	ctx.alg = "sha256";
+	for (i = 0; i < ARRAY_SIZE(key_sizes); i++) {
+		ctx.param = key_sizes[i];
+		ctx.length = key_sizes[i] * 4000;
+		bench_run("af_split", bench_af_split, &ctx);
+		bench_run("af_merge", bench_af_merge, &ctx);
+	}
+
+	/* dm-verity FEC default: 2 roots */
+	ctx.alg = NULL;
+	ctx.param = 2;
+	rs = init_rs_char(8, 0x11d, 0, 1, ctx.param, 0);
+	if (rs) {
+		ctx.priv = rs;
+		ctx.length = BENCH_BUFFER_MAX;
+		bench_run("rs_encode", bench_rs_encode, &ctx);
+		free_rs_char(rs);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	size_t i;
+
+	if (argc > 1)
+		bench_ms = atoi(argv[1]) ?: bench_ms;
+
+	if (crypt_backend_init()) {
+		printf("Crypto backend init error.\n");
+		exit(EXIT_FAILURE);
+	}
+	backend = crypt_backend_version();
+
+	buf = malloc(BENCH_BUFFER_MAX);
+	if (!buf)
+		exit(EXIT_FAILURE);
+	for (i = 0; i < BENCH_BUFFER_MAX; i++)
+		buf[i] = (char)(i * 7 + i / 251);
+
+	printf("backend,primitive,algorithm,param,buffer_size,ops_per_sec,mb_per_sec\n");
+
+	bench_hashes();
+	bench_storages();
+	bench_wrappers();
+	bench_base64();
+	bench_misc();
+
+	free(buf);
+	crypt_backend_destroy();
+	exit(EXIT_SUCCESS);
+}
@@ -218,6 +218,31 @@ static struct kdf_test_vector kdf_test_vectors[] = {
 		"\xa8\x09\x0f\x3e\xa8\x0b\xe0\x1d"
 		"\x5f\x95\x12\x6a\x2c\xdd\xc3\xfa"
 		"\xcc\x4a\x5e\x6d\xca\x04\xec\x58", 32
+	}, {
+	/* RFC 7914 (multiple output blocks) */
+		"pbkdf2", "sha256", 64, 1, 0, 0,
+		"passwd", 6,
+		"salt", 4,
+		"\x55\xac\x04\x6e\x56\xe3\x08\x9f"
+		"\xec\x16\x91\xc2\x25\x44\xb6\x05"
+		"\xf9\x41\x85\x21\x6d\xde\x04\x65"
+		"\xe6\x8b\x9d\x57\xc2\x0d\xac\xbc"
+		"\x49\xca\x9c\xcc\xf1\x79\xb6\x45"
+		"\x99\x16\x64\xb3\x9d\x77\xef\x31"
+		"\x7c\x71\xb8\x45\xb1\xe3\x0b\xd5"
+		"\x09\x11\x20\x41\xd3\xa1\x97\x83", 64
+	}, {
+		"pbkdf2", "sha256", 64, 80000, 0, 0,
+		"Password", 8,
+		"NaCl", 4,
+		"\x4d\xdc\xd8\xf6\x0b\x98\xbe\x21"
+		"\x83\x0c\xee\x5e\xf2\x27\x01\xf9"
+		"\x64\x1a\x44\x18\xd0\x4c\x04\x14"
+		"\xae\xff\x08\x87\x6b\x34\xab\x56"
+		"\xa1\xd4\x25\xa1\x22\x58\x33\x54"
+		"\x9a\xdb\x84\x1b\x51\xc9\xb3\x17"
+		"\x6a\x27\x2b\xde\xbb\xa1\xd0\x78"
+		"\x47\x8f\x62\xb3\x97\xf3\x3c\x8d", 64
 	}, {
 		"pbkdf2", "sha512", 128, 1200, 0, 0,
 		"XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX"
@@ -617,6 +642,26 @@ static struct cipher_test_vector cipher_test_vectors[] = {
 		"\x40\x95\xa3\x2c\xdb\x38\xe2\x6f\x03\x91\xf5\xd3\x51\x7e\x52\xb0"
 		"\x8a\x1c\x2d\x7f\x04\x59\x13\x93\x31\xa9\x82\xc9\x4e\xd9\x11\x0c"
 	},
+}},{ // NIST SP 800-38A
+	"\x2b\x7e\x15\x16\x28\xae\xd2\xa6\xab\xf7\x15\x88\x09\xcf\x4f\x3c", 16,
+	"\xf0\xf1\xf2\xf3\xf4\xf5\xf6\xf7\xf8\xf9\xfa\xfb\xfc\xfd\xfe\xff", 16,
+	"\x6b\xc1\xbe\xe2\x2e\x40\x9f\x96\xe9\x3d\x7e\x11\x73\x93\x17\x2a"
+	"\xae\x2d\x8a\x57\x1e\x03\xac\x9c\x9e\xb7\x6f\xac\x45\xaf\x8e\x51"
+	"\x30\xc8\x1c\x46\xa3\x5c\xe4\x11\xe5\xfb\xc1\x19\x1a\x0a\x52\xef"
+	"\xf6\x9f\x24\x45\xdf\x4f\x9b\x17\xad\x2b\x41\x7b\xe6\x6c\x37\x10", 64, {
+	{
+		"aes", "ctr",
+		"\x87\x4d\x61\x91\xb6\x20\xe3\x26\x1b\xef\x68\x64\x99\x0d\xb6\xce"
+		"\x98\x06\xf6\x6b\x79\x70\xfd\xff\x86\x17\x18\x7b\xb9\xff\xfd\xff"
+		"\x5a\xe4\xdf\x3e\xdb\xd5\xd3\x5e\x5b\x4f\x09\x02\x0d\xb0\x3e\xab"
+		"\x1e\x03\x1d\xda\x2f\xbe\x03\xd1\x79\x21\x70\xa0\xf3\x00\x9c\xee"
+	},{
+		"serpent", "ctr",
+		"\x7c\x2a\x0d\x21\x3f\x77\x84\xc3\xb7\xf7\x74\xd0\xdd\x49\xca\x0b"
+		"\x04\xb5\x17\xcc\x8e\x99\xa1\x7a\x95\x8d\x35\x00\xb3\xb2\x5b\x2b"
+		"\xd7\xc7\x58\xe4\x91\x37\x22\x03\x83\xd8\x3b\x3e\x85\x31\x31\x73"
+		"\xb5\xe5\xa2\xfa\x70\x66\xaa\x3a\x18\x22\x5f\x41\xe9\xbe\x12\x7f"
+	},
 }},{ // CAVS XTSGenAES128,101
 	"\xb7\xb9\x3f\x51\x6a\xef\x29\x5e\xff\x3a\x29\xd8\x37\xcf\x1f\x13"
 	"\x53\x47\xe8\xa2\x1d\xae\x61\x6f\xf5\x06\x2b\x2e\x8d\x78\xce\x5e", 32,
@@ -967,6 +1012,170 @@ static int crc32_test(const struct hash_test_vector *vector, unsigned int i)
 	return EXIT_SUCCESS;
 }
 
+/* Table (slice-by-8) and carry-less multiply paths must match byte-wise CRC */
+static int crc32_length_test(void)
+{
+	const size_t length = 64 * 1024 + 7;
+	uint32_t *trace, crc_ref, crc32, crc32_split;
+	unsigned char *buf;
+	size_t i, split;
+	int r = EXIT_FAILURE;
+
+	printf("CRC32 lengths: ");
+
+	buf = malloc(length);
+	trace = malloc(length * sizeof(*trace));
+	if (!buf || !trace)
+		goto out;
+
+	for (i = 0; i < length; i++)
+		buf[i] = (unsigned char)(i * 7 + i / 251);
+
+	crc_ref = crypt_crc32_trace(~0, buf, length, trace);
+
+	for (i = 1; i < length; i += 97) {
+		/* unaligned start and chained update */
+		split = i % 67;
+		crc32 = crypt_crc32(~0, buf, i);
+		crc32_split = crypt_crc32(crypt_crc32(~0, buf, split), buf + split, i - split);
+		if (crc32 != trace[i - 1] || crc32_split != trace[i - 1]) {
+			printf("[FAILED at %zu]\n", i);
+			goto out;
+		}
+	}
+
+	if (crypt_crc32(~0, buf, length) != crc_ref) {
+		printf("[FAILED]\n");
+		goto out;
+	}
+	printf("[OK]\n");
+	r = EXIT_SUCCESS;
+out:
+	free(buf);
+	free(trace);
+	return r;
+}
+
+static int hash_copy_test(const char *name, const char *data, size_t data_length,
+			  const char *out, size_t out_length)
+{
+	struct crypt_hash *h, *h_copy;
+	char result[64];
+	size_t half = data_length / 2;
+	int r;
+
+	if (crypt_hash_init(&h, name))
+		return -EINVAL;
+
+	if (crypt_hash_init(&h_copy, name)) {
+		crypt_hash_destroy(h);
+		return -EINVAL;
+	}
+
+	r = crypt_hash_write(h, data, half);
+	if (!r)
+		r = crypt_hash_copy(h_copy, h);
+	if (r == -ENOTSUP) {
+		r = 0;
+		goto out;
+	}
+	if (!r)
+		r = crypt_hash_write(h_copy, data + half, data_length - half);
+	if (!r)
+		r = crypt_hash_final(h_copy, result, out_length);
+
+	if (!r && memcmp(result, out, out_length)) {
+		printf("[FAILED (copy)]\n");
+		printhex(" got", result, out_length);
+		printhex("want", out, out_length);
+		r = -EINVAL;
+	}
+out:
+	crypt_hash_destroy(h);
+	crypt_hash_destroy(h_copy);
+	return r;
+}
+
+static int hash_blocks_test(const char *name, const char *data, size_t data_length,
+			    const char *out, size_t out_length)
+{
+	char *blocks, result[5 * 64];
+	size_t prefix = data_length / 3, block = data_length / 3, i;
+	int r;
+
+	blocks = malloc(5 * block + 1);
+	if (!blocks)
+		return -ENOMEM;
+
+	for (i = 0; i < 5; i++)
+		memcpy(&blocks[i * block], data + prefix, block);
+
+	r = crypt_hash_blocks(name, data, prefix,
+			      data + prefix + block, data_length - prefix - block,
+			      blocks, block, 5, result, 64, out_length);
+
+	for (i = 0; i < 5 && !r; i++)
+		if (memcmp(&result[i * 64], out, out_length)) {
+			printf("[FAILED (blocks)]\n");
+			printhex(" got", &result[i * 64], out_length);
+			printhex("want", out, out_length);
+			r = -EINVAL;
+		}
+
+	free(blocks);
+	return r;
+}
+
+/* BITLK KDF internal loop must match backend hash of the same message */
+static int bitlk_kdf_test(void)
+{
+	struct {
+		char last_sha256[32];
+		char initial_sha256[32];
+		char salt[16];
+		unsigned char count[8]; /* little-endian */
+	} __attribute__ ((packed)) kdf = {};
+	struct crypt_hash *h;
+	char key[32];
+	unsigned int i, j;
+	int r = 0;
+
+	if (crypt_hash_size("sha256") != 32) {
+		printf("[N/A]\n");
+		return 0;
+	}
+
+	for (i = 0; i < sizeof(kdf.initial_sha256); i++)
+		kdf.initial_sha256[i] = (char)(i * 7);
+	for (i = 0; i < sizeof(kdf.salt); i++)
+		kdf.salt[i] = (char)(0xa5 ^ i);
+
+	if (crypt_bitlk_kdf_sha256(kdf.initial_sha256, kdf.salt, 1000, key))
+		return EXIT_FAILURE;
+
+	if (crypt_hash_init(&h, "sha256"))
+		return EXIT_FAILURE;
+
+	for (i = 0; i < 1000 && !r; i++) {
+		for (j = 0; j < sizeof(kdf.count); j++)
+			kdf.count[j] = (unsigned char)((uint64_t)i >> (8 * j));
+		r = crypt_hash_write(h, (const char *)&kdf, sizeof(kdf));
+		if (!r)
+			r = crypt_hash_final(h, kdf.last_sha256, sizeof(kdf.last_sha256));
+	}
+	crypt_hash_destroy(h);
+
+	if (r || memcmp(key, kdf.last_sha256, sizeof(key))) {
+		printf("[FAILED (BITLK KDF)]\n");
+		printhex(" got", key, sizeof(key));
+		printhex("want", kdf.last_sha256, sizeof(key));
+		return EXIT_FAILURE;
+	}
+
+	printf("[OK]\n");
+	return EXIT_SUCCESS;
+}
+
 static int hash_test(void)
 {
 	const struct hash_test_vector *vector;
@@ -1023,6 +1232,15 @@ static int hash_test(void)
 				printhex("want", vector->out[j].out, vector->out[j].length);
 				return EXIT_FAILURE;
 			}
+
+			/* Copy of intermediate state must continue the same hash */
+			if (hash_copy_test(vector->out[j].name, vector->data, vector->data_length,
+					   vector->out[j].out, vector->out[j].length))
+				return EXIT_FAILURE;
+
+			if (hash_blocks_test(vector->out[j].name, vector->data, vector->data_length,
+					     vector->out[j].out, vector->out[j].length))
+				return EXIT_FAILURE;
 		}
 		printf("\n");
 	}
@@ -1231,6 +1449,188 @@ static int cipher_iv_test(void)
 	return EXIT_SUCCESS;
 }
 
+static int storage_threads_test(void)
+{
+	struct crypt_storage *storage, *storage_mt;
+	const size_t length = 4 * 1024 * 1024 + 4096;
+	const char key[64] = { 0x31 };
+	char *buf, *buf_mt, hash[32], hash_mt[32];
+	size_t i;
+	int r = EXIT_FAILURE;
+
+	printf("Storage threads: [aes-xts-plain64]");
+
+	if (crypt_storage_init(&storage, 4096, "aes", "xts-plain64", key, sizeof(key), true)) {
+		printf("[N/A]\n");
+		return EXIT_SUCCESS;
+	}
+
+	if (crypt_storage_init_threads(&storage_mt, 4096, "aes", "xts-plain64", key, sizeof(key), true, 4)) {
+		crypt_storage_destroy(storage);
+		return EXIT_FAILURE;
+	}
+
+	buf = malloc(length);
+	buf_mt = malloc(length);
+	if (!buf || !buf_mt)
+		goto out;
+
+	for (i = 0; i < length; i++)
+		buf[i] = buf_mt[i] = (char)i;
+	get_sha256(buf, length, hash);
+
+	if (crypt_storage_encrypt(storage, 8, length, buf) ||
+	    crypt_storage_encrypt(storage_mt, 8, length, buf_mt))
+		goto out;
+
+	if (memcmp(buf, buf_mt, length)) {
+		printf("[ENCRYPTION FAILED]\n");
+		goto out;
+	}
+	printf("[ENC]");
+
+	if (crypt_storage_decrypt(storage_mt, 8, length, buf_mt))
+		goto out;
+
+	get_sha256(buf_mt, length, hash_mt);
+	if (memcmp(hash, hash_mt, sizeof(hash))) {
+		printf("[DECRYPTION FAILED]\n");
+		goto out;
+	}
+	printf("[DEC]\n");
+
+	r = EXIT_SUCCESS;
+out:
+	free(buf);
+	free(buf_mt);
+	crypt_storage_destroy(storage);
+	crypt_storage_destroy(storage_mt);
+	return r;
+}
+
+static int storage_batch_test(void)
+{
+	struct crypt_storage *storage;
+	struct crypt_cipher *cipher;
+	const size_t length = 256 * 1024 + 512;
+	const char key[32] = { 0x42 };
+	char *buf, *buf_ref;
+	size_t i;
+	int r = EXIT_FAILURE;
+
+	printf("Storage batch: [aes-ecb]");
+
+	if (crypt_storage_init(&storage, 512, "aes", "ecb", key, sizeof(key), false)) {
+		printf("[N/A]\n");
+		return EXIT_SUCCESS;
+	}
+
+	if (crypt_cipher_init(&cipher, "aes", "ecb", key, sizeof(key))) {
+		crypt_storage_destroy(storage);
+		return EXIT_FAILURE;
+	}
+
+	buf = malloc(length);
+	buf_ref = malloc(length);
+	if (!buf || !buf_ref)
+		goto out;
+
+	for (i = 0; i < length; i++)
+		buf[i] = buf_ref[i] = (char)(i >> 3);
+
+	for (i = 0; i < length; i += 512)
+		if (crypt_cipher_encrypt(cipher, &buf_ref[i], &buf_ref[i], 512, NULL, 0))
+			goto out;
+
+	if (crypt_storage_encrypt(storage, 0, length, buf) || memcmp(buf, buf_ref, length)) {
+		printf("[ENCRYPTION FAILED]\n");
+		goto out;
+	}
+	printf("[ENC]");
+
+	for (i = 0; i < length; i += 512)
+		if (crypt_cipher_decrypt(cipher, &buf_ref[i], &buf_ref[i], 512, NULL, 0))
+			goto out;
+
+	if (crypt_storage_decrypt(storage, 0, length, buf) || memcmp(buf, buf_ref, length)) {
+		printf("[DECRYPTION FAILED]\n");
+		goto out;
+	}
+	printf("[DEC]\n");
+
+	r = EXIT_SUCCESS;
+out:
+	free(buf);
+	free(buf_ref);
+	crypt_cipher_destroy(cipher);
+	crypt_storage_destroy(storage);
+	return r;
+}
+
+static int storage_zerocopy_test(void)
+{
+	struct crypt_storage *storage, *storage_zc;
+	const size_t length = 64 * 4096;
+	const char key[64] = { 0x5a };
+	char *buf = NULL, *buf_zc = NULL;
+	size_t i;
+	int r = EXIT_FAILURE;
+
+	printf("Storage zero-copy: [aes-xts-plain64]");
+
+	if (crypt_storage_init(&storage_zc, 4096, "aes", "xts-plain64", key, sizeof(key), true)) {
+		printf("[N/A]\n");
+		return EXIT_SUCCESS;
+	}
+
+	/* zero-copy is opt-in and available only for kernel (AF_ALG) ciphers */
+	if (crypt_storage_zerocopy(storage_zc)) {
+		crypt_storage_destroy(storage_zc);
+		printf("[N/A]\n");
+		return EXIT_SUCCESS;
+	}
+
+	if (crypt_storage_init(&storage, 4096, "aes", "xts-plain64", key, sizeof(key), true)) {
+		crypt_storage_destroy(storage_zc);
+		return EXIT_FAILURE;
+	}
+
+	if (posix_memalign((void *)&buf, 4096, length) ||
+	    posix_memalign((void *)&buf_zc, 4096, length))
+		goto out;
+
+	for (i = 0; i < length; i++)
+		buf[i] = buf_zc[i] = (char)(i * 7);
+
+	if (crypt_storage_encrypt(storage, 16, length, buf) ||
+	    crypt_storage_encrypt(storage_zc, 16, length, buf_zc) ||
+	    memcmp(buf, buf_zc, length)) {
+		printf("[ENCRYPTION FAILED]\n");
+		goto out;
+	}
+	printf("[ENC]");
+
+	if (crypt_storage_decrypt(storage_zc, 16, length, buf_zc)) {
+		printf("[DECRYPTION FAILED]\n");
+		goto out;
+	}
+
+	for (i = 0; i < length; i++)
+		if (buf_zc[i] != (char)(i * 7)) {
+			printf("[DECRYPTION FAILED]\n");
+			goto out;
+		}
+	printf("[DEC]\n");
+
+	r = EXIT_SUCCESS;
+out:
+	free(buf);
+	free(buf_zc);
+	crypt_storage_destroy(storage);
+	crypt_storage_destroy(storage_zc);
+	return r;
+}
+
 static void __attribute__((noreturn)) exit_test(const char *msg, int r)
 {
 	if (msg)
@@ -1259,6 +1659,13 @@ int main(__attribute__ ((unused)) int argc, __attribute__ ((unused))char *argv[]
 	if (hash_test())
 		exit_test("HASH test failed.", EXIT_FAILURE);
 
+	if (crc32_length_test())
+		exit_test("CRC32 test failed.", EXIT_FAILURE);
+
+	printf("BITLK KDF:");
+	if (bitlk_kdf_test())
+		exit_test("BITLK KDF test failed.", EXIT_FAILURE);
+
 	if (hmac_test())
 		exit_test("HMAC test failed.", EXIT_FAILURE);
 
@@ -1268,5 +1675,14 @@ int main(__attribute__ ((unused)) int argc, __attribute__ ((unused))char *argv[]
 	if (cipher_iv_test())
 		exit_test("IV test failed.", EXIT_FAILURE);
 
+	if (storage_threads_test())
+		exit_test("Storage threads test failed.", EXIT_FAILURE);
+
+	if (storage_batch_test())
+		exit_test("Storage batch test failed.", EXIT_FAILURE);
+
+	if (storage_zerocopy_test())
+		exit_test("Storage zero-copy test failed.", EXIT_FAILURE);
+
 	exit_test(NULL, EXIT_SUCCESS);
 }
@@ -0,0 +1,135 @@
+/*
+ * Asynchronous token open test plugin (CRYPTSETUP_TOKEN_1.1 ABI)
+ *
+ * Copyright (C) 2021 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Token 0 returns the passphrase in two chunks (the second one is written
+ * only after the first finish call returns -EAGAIN), any other token never
+ * answers and must be cancelled by the library.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "libcryptsetup.h"
+
+#define TOKEN_PASSPHRASE "blabla"
+
+struct async_ctx {
+	int pipe[2];
+	size_t read;
+	char buf[sizeof(TOKEN_PASSPHRASE)];
+};
+
+/* number of cancelled open operations, checked by api-test-2 */
+int cryptsetup_token_test_cancelled;
+
+const char *cryptsetup_token_version(void)
+{
+	return "1.1";
+}
+
+int cryptsetup_token_open(struct crypt_device *cd __attribute__((unused)),
+	int token __attribute__((unused)),
+	char **buffer __attribute__((unused)),
+	size_t *buffer_len __attribute__((unused)),
+	void *usrptr __attribute__((unused)))
+{
+	/* never used, asynchronous open takes precedence */
+	return -EINVAL;
+}
+
+static void ctx_free(struct async_ctx *ctx)
+{
+	close(ctx->pipe[0]);
+	close(ctx->pipe[1]);
+	free(ctx);
+}
+
+int cryptsetup_token_open_async(struct crypt_device *cd __attribute__((unused)),
+	int token,
+	const char *pin __attribute__((unused)),
+	size_t pin_size __attribute__((unused)),
+	void *usrptr __attribute__((unused)),
+	uint32_t timeout_ms __attribute__((unused)),
+	void **ctx,
+	int *fd)
+{
+	struct async_ctx *c;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return -ENOMEM;
+
+	if (pipe2(c->pipe, O_CLOEXEC | O_NONBLOCK)) {
+		free(c);
+		return -EIO;
+	}
+
+	if (!token && write(c->pipe[1], TOKEN_PASSPHRASE, 3) != 3) {
+		ctx_free(c);
+		return -EIO;
+	}
+
+	*ctx = c;
+	*fd = c->pipe[0];
+	return 0;
+}
+
+int cryptsetup_token_open_finish(void *ctx, char **buffer, size_t *buffer_len)
+{
+	struct async_ctx *c = ctx;
+	const size_t len = strlen(TOKEN_PASSPHRASE);
+	ssize_t r;
+	int ret = 0;
+
+	r = read(c->pipe[0], c->buf + c->read, len - c->read);
+	if (r <= 0) {
+		ret = r < 0 && errno == EAGAIN ? -EAGAIN : -EIO;
+		goto out;
+	}
+	c->read += r;
+
+	if (c->read < len) {
+		/* first chunk only, make the library poll again */
+		if (write(c->pipe[1], TOKEN_PASSPHRASE + c->read, len - c->read) != (ssize_t)(len - c->read))
+			ret = -EIO;
+		else
+			return -EAGAIN;
+		goto out;
+	}
+
+	*buffer = strndup(c->buf, len);
+	if (!*buffer)
+		ret = -ENOMEM;
+	else
+		*buffer_len = len;
+out:
+	if (ret != -EAGAIN)
+		ctx_free(c);
+	return ret;
+}
+
+void cryptsetup_token_cancel(void *ctx)
+{
+	cryptsetup_token_test_cancelled++;
+	ctx_free(ctx);
+}
@@ -0,0 +1,251 @@
+/*
+ * simple unit test for base64.c (LUKS2 JSON binary values)
+ *
+ * Compares base64 encoder and decoder (including the vectorized code paths)
+ * with plain reference implementation for all lengths covering several
+ * vector blocks and with unaligned buffers.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "base64.h"
+
+#ifndef ARRAY_SIZE
+# define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+#endif
+
+#define MAX_LENGTH	512
+#define GUARD		0x5a
+
+static const char alphabet[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* RFC 4648, section 10 */
+static const struct {
+	const char *in;
+	const char *out;
+} rfc_vectors[] = {
+	{ "",       ""         },
+	{ "f",      "Zg=="     },
+	{ "fo",     "Zm8="     },
+	{ "foo",    "Zm9v"     },
+	{ "foob",   "Zm9vYg==" },
+	{ "fooba",  "Zm9vYmE=" },
+	{ "foobar", "Zm9vYmFy" },
+};
+
+static void fill_random(char *buf, size_t len, unsigned *seed)
+{
+	while (len--) {
+		*seed = *seed * 1103515245 + 12345;
+		*buf++ = (char)(*seed >> 16);
+	}
+}
+
+static void ref_encode(const unsigned char *in, size_t inlen, char *out)
+{
+	unsigned v;
+	size_t i;
+
+	for (i = 0; i + 2 < inlen; i += 3) {
+		v = in[i] << 16 | in[i + 1] << 8 | in[i + 2];
+		*out++ = alphabet[(v >> 18) & 0x3f];
+		*out++ = alphabet[(v >> 12) & 0x3f];
+		*out++ = alphabet[(v >> 6) & 0x3f];
+		*out++ = alphabet[v & 0x3f];
+	}
+
+	if (i < inlen) {
+		v = in[i] << 16 | (i + 1 < inlen ? in[i + 1] << 8 : 0);
+		*out++ = alphabet[(v >> 18) & 0x3f];
+		*out++ = alphabet[(v >> 12) & 0x3f];
+		*out++ = i + 1 < inlen ? alphabet[(v >> 6) & 0x3f] : '=';
+		*out++ = '=';
+	}
+}
+
+static int rfc_test(void)
+{
+	char out[16], dec[16];
+	size_t i, inlen, outlen;
+
+	for (i = 0; i < ARRAY_SIZE(rfc_vectors); i++) {
+		inlen = strlen(rfc_vectors[i].in);
+
+		memset(out, 0, sizeof(out));
+		base64_encode(rfc_vectors[i].in, inlen, out, sizeof(out));
+		if (strcmp(out, rfc_vectors[i].out)) {
+			printf("[RFC vector %zu encode mismatch]\n", i);
+			return EXIT_FAILURE;
+		}
+
+		outlen = sizeof(dec);
+		if (!base64_decode(rfc_vectors[i].out, strlen(rfc_vectors[i].out), dec, &outlen) ||
+		    outlen != inlen || memcmp(dec, rfc_vectors[i].in, inlen)) {
+			printf("[RFC vector %zu decode mismatch]\n", i);
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* All lengths and misalignments, output buffer exact, larger and too short */
+static int length_test(void)
+{
+	char in[MAX_LENGTH + 3], ref[BASE64_LENGTH(MAX_LENGTH) + 1];
+	char out[BASE64_LENGTH(MAX_LENGTH) + 8], dec[MAX_LENGTH + 8], *alloc;
+	size_t len, b64len, outlen, offset, short_len;
+	unsigned seed = 1;
+
+	for (len = 0; len <= MAX_LENGTH; len++) {
+		b64len = BASE64_LENGTH(len);
+		for (offset = 0; offset < 3; offset++) {
+			fill_random(in + offset, len, &seed);
+			ref_encode((unsigned char *)in + offset, len, ref);
+
+			memset(out, GUARD, sizeof(out));
+			base64_encode(in + offset, len, out + offset, b64len);
+			if (memcmp(out + offset, ref, b64len) || out[offset + b64len] != GUARD) {
+				printf("[encode mismatch, length %zu, offset %zu]\n", len, offset);
+				return EXIT_FAILURE;
+			}
+
+			memset(out, GUARD, sizeof(out));
+			base64_encode(in + offset, len, out, b64len + 1);
+			if (memcmp(out, ref, b64len) || out[b64len] != '\0') {
+				printf("[encode mismatch, length %zu, larger output]\n", len);
+				return EXIT_FAILURE;
+			}
+
+			short_len = b64len / 2;
+			memset(out, GUARD, sizeof(out));
+			base64_encode(in + offset, len, out, short_len);
+			if (memcmp(out, ref, short_len) || out[short_len] != GUARD) {
+				printf("[encode mismatch, length %zu, short output]\n", len);
+				return EXIT_FAILURE;
+			}
+
+			memcpy(out + offset, ref, b64len);
+			outlen = len;
+			memset(dec, GUARD, sizeof(dec));
+			if (!base64_decode(out + offset, b64len, dec + offset, &outlen) ||
+			    outlen != len || memcmp(dec + offset, in + offset, len) ||
+			    dec[offset + len] != (char)GUARD) {
+				printf("[decode mismatch, length %zu, offset %zu]\n", len, offset);
+				return EXIT_FAILURE;
+			}
+		}
+
+		/* input and reference from the last offset */
+		offset--;
+		if (base64_encode_alloc(in + offset, len, &alloc) != b64len || !alloc ||
+		    memcmp(alloc, ref, b64len) || alloc[b64len]) {
+			printf("[encode alloc mismatch, length %zu]\n", len);
+			free(alloc);
+			return EXIT_FAILURE;
+		}
+		free(alloc);
+
+		if (!base64_decode_alloc(ref, b64len, &alloc, &outlen) || !alloc ||
+		    outlen != len || memcmp(alloc, in + offset, len)) {
+			printf("[decode alloc mismatch, length %zu]\n", len);
+			free(alloc);
+			return EXIT_FAILURE;
+		}
+		free(alloc);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* Invalid character anywhere must be detected (including inside vector blocks) */
+static int invalid_test(void)
+{
+	static const char invalid[] = { '!', '-', '_', '\0', '\n', (char)0x80, (char)0xff };
+	char in[192], b64[BASE64_LENGTH(192)], dec[sizeof(in)];
+	size_t i, j, outlen;
+	unsigned seed = 2;
+
+	fill_random(in, sizeof(in), &seed);
+	ref_encode((unsigned char *)in, sizeof(in), b64);
+
+	for (i = 0; i < sizeof(b64); i++)
+		for (j = 0; j < ARRAY_SIZE(invalid); j++) {
+			char c = b64[i];
+
+			b64[i] = invalid[j];
+			outlen = sizeof(dec);
+			if (base64_decode(b64, sizeof(b64), dec, &outlen)) {
+				printf("[invalid character 0x%02x at %zu accepted]\n",
+				       (unsigned char)invalid[j], i);
+				return EXIT_FAILURE;
+			}
+			b64[i] = c;
+		}
+
+	/* padding only at the end */
+	b64[8] = '=';
+	outlen = sizeof(dec);
+	if (base64_decode(b64, sizeof(b64), dec, &outlen)) {
+		printf("[padding inside data accepted]\n");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* Decoder with context skips newlines, as in wrapped input */
+static int newline_test(void)
+{
+	char in[300], b64[BASE64_LENGTH(300)], wrapped[sizeof(b64) * 2], dec[sizeof(in)];
+	struct base64_decode_context ctx;
+	size_t i, len = 0, outlen;
+	unsigned seed = 3;
+
+	fill_random(in, sizeof(in), &seed);
+	ref_encode((unsigned char *)in, sizeof(in), b64);
+
+	for (i = 0; i < sizeof(b64); i++) {
+		if (i && !(i % 76))
+			wrapped[len++] = '\n';
+		wrapped[len++] = b64[i];
+	}
+
+	base64_decode_ctx_init(&ctx);
+	outlen = sizeof(dec);
+	if (!base64_decode_ctx(&ctx, wrapped, len, dec, &outlen) ||
+	    outlen != sizeof(in) || memcmp(dec, in, sizeof(in))) {
+		printf("[wrapped input decode mismatch]\n");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+	if (rfc_test() || length_test() || invalid_test() || newline_test()) {
+		printf("Base64 test failed.\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("Base64 test passed.\n");
+	return EXIT_SUCCESS;
+}
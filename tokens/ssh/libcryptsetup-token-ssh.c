@@ -25,11 +25,14 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
 #include <json-c/json.h>
 #include <libssh/libssh.h>
 #include <libssh/sftp.h>
@@ -46,6 +49,10 @@
 #define PATH_ARG	"plugin-ssh-path"
 #define KEYPATH_ARG	"plugin-ssh-keypath"
 
+/* Authenticated connections are reused for other token opens in process */
+#define CONN_CACHE_SIZE	8
+#define CONN_IDLE_TIMEOUT 60 /* seconds */
+
 #define l_dbg(cd, x...) crypt_logf(cd, CRYPT_LOG_DEBUG, x)
 
 struct sshplugin_context {
@@ -62,6 +69,120 @@ struct sshplugin_context {
 	struct crypt_cli *cli;
 };
 
+struct sshplugin_conn {
+	char *server;
+	char *user;
+	char *sshkey_path;
+	ssh_session ssh;
+	sftp_session sftp;
+	time_t last_used;
+};
+
+/* Idle connections only, connection in use is owned by the token open call */
+static struct sshplugin_conn *conn_cache[CONN_CACHE_SIZE];
+static pthread_mutex_t conn_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t conn_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void sshplugin_conn_free(struct sshplugin_conn *conn)
+{
+	if (!conn)
+		return;
+
+	if (conn->sftp)
+		sftp_free(conn->sftp);
+	if (conn->ssh) {
+		ssh_disconnect(conn->ssh);
+		ssh_free(conn->ssh);
+	}
+	free(conn->server);
+	free(conn->user);
+	free(conn->sshkey_path);
+	free(conn);
+}
+
+static bool sshplugin_conn_match(const struct sshplugin_conn *conn,
+	const char *server, const char *user, const char *sshkey_path)
+{
+	return !strcmp(conn->server, server) && !strcmp(conn->user, user) &&
+	       !strcmp(conn->sshkey_path, sshkey_path);
+}
+
+/* Remove matching idle connection from cache, drop expired ones */
+static struct sshplugin_conn *sshplugin_conn_get(struct crypt_device *cd,
+	const char *server, const char *user, const char *sshkey_path)
+{
+	struct sshplugin_conn *conn = NULL, *expired[CONN_CACHE_SIZE] = {};
+	time_t now = conn_now();
+	int i;
+
+	pthread_mutex_lock(&conn_cache_lock);
+	for (i = 0; i < CONN_CACHE_SIZE; i++) {
+		if (!conn_cache[i])
+			continue;
+		if (now - conn_cache[i]->last_used > CONN_IDLE_TIMEOUT ||
+		    !ssh_is_connected(conn_cache[i]->ssh)) {
+			expired[i] = conn_cache[i];
+			conn_cache[i] = NULL;
+		} else if (!conn && sshplugin_conn_match(conn_cache[i], server, user, sshkey_path)) {
+			conn = conn_cache[i];
+			conn_cache[i] = NULL;
+		}
+	}
+	pthread_mutex_unlock(&conn_cache_lock);
+
+	/* disconnect is not done under lock */
+	for (i = 0; i < CONN_CACHE_SIZE; i++)
+		sshplugin_conn_free(expired[i]);
+
+	if (conn)
+		l_dbg(cd, "Reusing ssh connection to %s@%s.", user, server);
+
+	return conn;
+}
+
+/* Return connection to cache, replace the least recently used if full */
+static void sshplugin_conn_put(struct sshplugin_conn *conn)
+{
+	struct sshplugin_conn *old;
+	int i, lru = 0;
+
+	conn->last_used = conn_now();
+
+	pthread_mutex_lock(&conn_cache_lock);
+	for (i = 0; i < CONN_CACHE_SIZE; i++) {
+		if (!conn_cache[i]) {
+			lru = i;
+			break;
+		}
+		if (conn_cache[i]->last_used < conn_cache[lru]->last_used)
+			lru = i;
+	}
+	old = conn_cache[lru];
+	conn_cache[lru] = conn;
+	pthread_mutex_unlock(&conn_cache_lock);
+
+	sshplugin_conn_free(old);
+}
+
+static void __attribute__((destructor)) sshplugin_conn_cache_free(void)
+{
+	int i;
+
+	pthread_mutex_lock(&conn_cache_lock);
+	for (i = 0; i < CONN_CACHE_SIZE; i++) {
+		sshplugin_conn_free(conn_cache[i]);
+		conn_cache[i] = NULL;
+	}
+	pthread_mutex_unlock(&conn_cache_lock);
+}
+
 const char *cryptsetup_token_version(void)
 {
 	return TOKEN_VERSION_MAJOR "." TOKEN_VERSION_MINOR;
@@ -78,32 +199,59 @@ static json_object *get_token_jobj(struct crypt_device *cd, int token)
 	return json_tokener_parse(json_slot);
 }
 
-static int sshplugin_download_password(struct crypt_device *cd, ssh_session ssh,
-	const char *path, char **password, size_t *password_len)
+static sftp_session sshplugin_sftp_init(struct crypt_device *cd, ssh_session ssh)
 {
-	char *pass = NULL;
-	size_t pass_len;
-	int r;
-	sftp_attributes sftp_attr = NULL;
-	sftp_session sftp = NULL;
-	sftp_file file = NULL;
+	sftp_session sftp;
 
 	sftp = sftp_new(ssh);
 	if (!sftp) {
 		crypt_log(cd, CRYPT_LOG_ERROR, "Cannot create sftp session: ");
-		r = SSH_FX_FAILURE;
-		goto out;
+		goto err;
 	}
 
-	r = sftp_init(sftp);
-	if (r != SSH_OK) {
+	if (sftp_init(sftp) != SSH_OK) {
 		crypt_log(cd, CRYPT_LOG_ERROR, "Cannot init sftp session: ");
-		goto out;
+		sftp_free(sftp);
+		goto err;
 	}
 
+	return sftp;
+err:
+	crypt_log(cd, CRYPT_LOG_ERROR, ssh_get_error(ssh));
+	crypt_log(cd, CRYPT_LOG_ERROR, "\n");
+	return NULL;
+}
+
+/* Only broken connection is worth retrying, not missing file or permissions */
+static bool sshplugin_conn_lost(ssh_session ssh, sftp_session sftp)
+{
+	int err;
+
+	if (!ssh_is_connected(ssh) || ssh_get_error_code(ssh) == SSH_FATAL)
+		return true;
+
+	err = sftp_get_error(sftp);
+	return err == SSH_FX_CONNECTION_LOST || err == SSH_FX_NO_CONNECTION;
+}
+
+/*
+ * More files can be fetched over one sftp session.
+ * Returns -ENOTCONN if connection was lost.
+ */
+static int sshplugin_download_password(struct crypt_device *cd, ssh_session ssh,
+	sftp_session sftp, const char *path, char **password, size_t *password_len)
+{
+	char *pass = NULL;
+	size_t pass_len;
+	int r;
+	bool lost = false;
+	sftp_attributes sftp_attr = NULL;
+	sftp_file file = NULL;
+
 	file = sftp_open(sftp, path, O_RDONLY, 0);
 	if (!file) {
-		crypt_log(cd, CRYPT_LOG_ERROR, "Cannot create sftp session: ");
+		crypt_log(cd, CRYPT_LOG_ERROR, "Cannot open sftp file: ");
+		lost = sshplugin_conn_lost(ssh, sftp);
 		r = SSH_FX_FAILURE;
 		goto out;
 	}
@@ -111,6 +259,7 @@ static int sshplugin_download_password(struct crypt_device *cd, ssh_session ssh,
 	sftp_attr = sftp_fstat(file);
 	if (!sftp_attr) {
 		crypt_log(cd, CRYPT_LOG_ERROR, "Cannot stat sftp file: ");
+		lost = sshplugin_conn_lost(ssh, sftp);
 		r = SSH_FX_FAILURE;
 		goto out;
 	}
@@ -126,6 +275,7 @@ static int sshplugin_download_password(struct crypt_device *cd, ssh_session ssh,
 	r = sftp_read(file, pass, pass_len);
 	if (r < 0 || (size_t)r != pass_len) {
 		crypt_log(cd, CRYPT_LOG_ERROR, "Cannot read remote key: ");
+		lost = sshplugin_conn_lost(ssh, sftp);
 		r = SSH_FX_FAILURE;
 		goto out;
 	}
@@ -146,9 +296,10 @@ out:
 
 	if (file)
 		sftp_close(file);
-	if (sftp)
-		sftp_free(sftp);
-	return r == SSH_OK ? 0 : -EINVAL;
+
+	if (r == SSH_OK)
+		return 0;
+	return lost ? -ENOTCONN : -EINVAL;
 }
 
 static ssh_session sshplugin_session_init(struct crypt_device *cd,
@@ -220,14 +371,47 @@ static int sshplugin_public_key_auth(struct crypt_device *cd, ssh_session ssh, c
 	return r;
 }
 
+static struct sshplugin_conn *sshplugin_conn_new(struct crypt_device *cd,
+	const char *server, const char *user, const char *sshkey_path, const ssh_key pkey)
+{
+	struct sshplugin_conn *conn;
+
+	conn = calloc(1, sizeof(*conn));
+	if (!conn)
+		return NULL;
+
+	conn->server = strdup(server);
+	conn->user = strdup(user);
+	conn->sshkey_path = strdup(sshkey_path);
+	if (!conn->server || !conn->user || !conn->sshkey_path)
+		goto err;
+
+	conn->ssh = sshplugin_session_init(cd, server, user);
+	if (!conn->ssh)
+		goto err;
+
+	if (sshplugin_public_key_auth(cd, conn->ssh, pkey) != SSH_AUTH_SUCCESS)
+		goto err;
+
+	conn->sftp = sshplugin_sftp_init(cd, conn->ssh);
+	if (!conn->sftp)
+		goto err;
+
+	return conn;
+err:
+	sshplugin_conn_free(conn);
+	return NULL;
+}
+
 int cryptsetup_token_open_pin(struct crypt_device *cd, int token, const char *pin,
 	size_t pin_size __attribute__((unused)), char **password, size_t *password_len,
 	void *usrptr __attribute__((unused)))
 {
 	int r;
 	json_object *jobj_server, *jobj_user, *jobj_path, *jobj_token, *jobj_keypath;
+	const char *server, *user, *path, *keypath;
+	struct sshplugin_conn *conn;
 	ssh_key pkey;
-	ssh_session ssh;
 
 	jobj_token = get_token_jobj(cd, token);
 	json_object_object_get_ex(jobj_token, "ssh_server", &jobj_server);
@@ -235,8 +419,15 @@ int cryptsetup_token_open_pin(struct crypt_device *cd, int token, const char *pi
 	json_object_object_get_ex(jobj_token, "ssh_path",   &jobj_path);
 	json_object_object_get_ex(jobj_token, "ssh_keypath",&jobj_keypath);
 
-	r = ssh_pki_import_privkey_file(json_object_get_string(jobj_keypath), pin, NULL, NULL, &pkey);
+	server = json_object_get_string(jobj_server);
+	user = json_object_get_string(jobj_user);
+	path = json_object_get_string(jobj_path);
+	keypath = json_object_get_string(jobj_keypath);
+
+	/* Key is always imported, cached connection must not bypass its passphrase */
+	r = ssh_pki_import_privkey_file(keypath, pin, NULL, NULL, &pkey);
 	if (r != SSH_OK) {
+		json_object_put(jobj_token);
 		if (r == SSH_EOF) {
 			crypt_log(cd, CRYPT_LOG_ERROR, "Failed to open and import private key.\n");
 			return -EINVAL;
@@ -245,22 +436,33 @@ int cryptsetup_token_open_pin(struct crypt_device *cd, int token, const char *pi
 		return -EAGAIN;
 	}
 
-	ssh = sshplugin_session_init(cd, json_object_get_string(jobj_server),
-				   json_object_get_string(jobj_user));
-	if (!ssh) {
-		ssh_key_free(pkey);
-		return -EINVAL;
+	/* Server can close idle connection anytime, retry with new one */
+	conn = sshplugin_conn_get(cd, server, user, keypath);
+	if (conn) {
+		r = sshplugin_download_password(cd, conn->ssh, conn->sftp, path,
+						password, password_len);
+		if (r != -ENOTCONN)
+			goto out;
+
+		l_dbg(cd, "Cached ssh connection lost, reconnecting.");
+		sshplugin_conn_free(conn);
+		conn = NULL;
 	}
 
-	r = sshplugin_public_key_auth(cd, ssh, pkey);
+	conn = sshplugin_conn_new(cd, server, user, keypath, pkey);
+	if (conn)
+		r = sshplugin_download_password(cd, conn->ssh, conn->sftp, path,
+						password, password_len);
+	else
+		r = -EINVAL;
+out:
 	ssh_key_free(pkey);
+	json_object_put(jobj_token);
 
-	if (r == SSH_AUTH_SUCCESS)
-		r = sshplugin_download_password(cd, ssh, json_object_get_string(jobj_path),
-					      password, password_len);
-
-	ssh_disconnect(ssh);
-	ssh_free(ssh);
+	if (conn && !r)
+		sshplugin_conn_put(conn);
+	else
+		sshplugin_conn_free(conn);
 
 	return r ? -EINVAL : r;
 }